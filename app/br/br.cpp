@@ -98,6 +98,9 @@ public:
             } else if (!strcmp(fun, "compare")) {
                 check((parc >= 2) && (parc <= 3), "Incorrect parameter count for 'compare'.");
                 br_compare(parv[0], parv[1], parc == 3 ? parv[2] : "");
+            } else if (!strcmp(fun, "search")) {
+                check((parc >= 3) && (parc <= 4), "Incorrect parameter count for 'search'.");
+                br_search(parv[0], parv[1], atoi(parv[2]), parc == 4 ? parv[3] : "");
             } else if (!strcmp(fun, "eval")) {
                 check((parc >= 2) && (parc <= 3), "Incorrect parameter count for 'eval'.");
                 br_eval(parv[0], parv[1], parc == 3 ? parv[2] : "");
@@ -113,15 +116,27 @@ public:
             } else if (!strcmp(fun, "cluster")) {
                 check(parc >= 3, "Insufficient parameter count for 'cluster'.");
                 br_cluster(parc-2, parv, atof(parv[parc-2]), parv[parc-1]);
+            } else if (!strcmp(fun, "clusterGallery")) {
+                check(parc == 4, "Incorrect parameter count for 'clusterGallery'.");
+                br_cluster_gallery(parv[0], atoi(parv[1]), atof(parv[2]), parv[3]);
+            } else if (!strcmp(fun, "deduplicate")) {
+                check((parc >= 2) && (parc <= 3), "Incorrect parameter count for 'deduplicate'.");
+                br_deduplicate(parv[0], parv[1], parc == 3 ? parv[2] : "");
             } else if (!strcmp(fun, "makeMask")) {
                 check(parc == 3, "Incorrect parameter count for 'makeMask'.");
                 br_make_mask(parv[0], parv[1], parv[2]);
             } else if (!strcmp(fun, "combineMasks")) {
                 check(parc >= 4, "Insufficient parameter count for 'combineMasks'.");
                 br_combine_masks(parc-2, parv, parv[parc-2], parv[parc-1]);
+            } else if (!strcmp(fun, "mergeMatrices")) {
+                check(parc >= 2, "Insufficient parameter count for 'mergeMatrices'.");
+                br_merge_matrices(parc-1, parv, parv[parc-1]);
             } else if (!strcmp(fun, "cat")) {
                 check(parc >= 2, "Insufficient parameter count for 'cat'.");
                 br_cat(parc-1, parv, parv[parc-1]);
+            } else if (!strcmp(fun, "aggregate")) {
+                check(parc == 2, "Incorrect parameter count for 'aggregate'.");
+                br_aggregate(parv[0], parv[1]);
             } else if (!strcmp(fun, "convert")) {
                 check(parc == 2, "Incorrect parameter count for 'convert'.");
                 br_convert(parv[0], parv[1]);
@@ -162,6 +177,9 @@ public:
             } else if (!strcmp(fun, "version")) {
                 check(parc == 0, "No parameters expected for 'version'.");
                 printf("%s\n", br_version());
+            } else if (!strcmp(fun, "serve")) {
+                check(parc == 1, "Incorrect parameter count for 'serve'.");
+                br_serve(parv[0]);
             } else if (!strcmp(fun, "shell")) {
                 check(parc == 0, "No parameters expected for 'shell'.");
                 shell = true;
@@ -197,15 +215,20 @@ private:
                "-train <gallery> ... <gallery> [{model}]\n"
                "-enroll <input_gallery> ... <input_gallery> {output_gallery}\n"
                "-compare <target_gallery> <query_gallery> [{output}]\n"
+               "-search <target_gallery> <query_gallery> <count> [{csv}]\n"
                "-eval <simmat> <mask> [{csv}]\n"
                "-plot <file> ... <file> {destination}\n"
                "\n"
                "==== Other Commands ====\n"
                "-fuse <simmat> ... <simmat> <mask> (None|MinMax|ZScore|WScore) (Min|Max|Sum[W1:W2:...:Wn]|Replace|Difference|None) {simmat}\n"
                "-cluster <simmat> ... <simmat> <aggressiveness> {csv}\n"
+               "-clusterGallery <gallery> <k> <aggressiveness> {csv}\n"
+               "-deduplicate <target_gallery> <query_gallery> [{csv}]\n"
                "-makeMask <target_gallery> <query_gallery> {mask}\n"
                "-combineMasks <mask> ... <mask> {mask} (And|Or)\n"
+               "-mergeMatrices <simmat> ... <simmat> {simmat}\n"
                "-cat <gallery> ... <gallery> {gallery}\n"
+               "-aggregate <gallery> {gallery}\n"
                "-convert <template> {template}\n"
                "-reformat <target_sigset> <query_sigset> <simmat> {output}\n"
                "-evalClassification <predicted_gallery> <truth_gallery>\n"
@@ -221,6 +244,7 @@ private:
                "-objects [abstraction [implementation]]\n"
                "-about\n"
                "-version\n"
+               "-serve <socket>\n"
                "-shell\n"
                "-exit\n");
     }
@@ -0,0 +1,418 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \ingroup cli
+ * \page cli_bench Benchmarks
+ * \brief Times distances, transforms, galleries and streams on synthetic data and prints the results as CSV.
+ * \code
+ * $ br_bench -type 32F -size 256 -targets 4096 -queries 256 -trials 3 -output bench.csv
+ * \endcode
+ * Arguments:
+ * - \c -type \c 8U or \c 32F, the element type of the synthetic templates (default \c 8U).
+ * - \c -size Elements per template (default \c 256).
+ * - \c -targets, \c -queries Number of target and query templates (default \c 4096 and \c 256).
+ * - \c -images, \c -imageSize Number and width of the square images used for transforms (default \c 64 and \c 128).
+ * - \c -trials Repetitions of each benchmark, the fastest is reported (default \c 3).
+ * - \c -distances, \c -transforms Semicolon-separated lists overriding the benchmarked algorithms.
+ * - \c -frames, \c -fps, \c -frameSize Frames streamed per trial, the rate they arrive at and their width (default \c 1000, \c 0 for unthrottled and \c 640).
+ * - \c -streams Semicolon-separated list of stage chains, like <tt>Burn(1000)+SequentialBurn(500)</tt>, overriding the streamed pipelines.
+ * - \c -scratch Directory for temporary galleries (default is the system temporary directory).
+ * - \c -output CSV file to write, \c stdout by default.
+ *
+ * Streams report frames/sec and the 50th, 90th and 99th percentile of the per-frame \c StreamLatency.
+ * Unthrottled streams also report the same stages projected frame by frame without a stream,
+ * and the difference per frame as the stream overhead, negative once concurrent stages outweigh the buffering.
+ *
+ * Any other arguments are passed to br::Context as properties, for example <tt>-parallelism 1</tt>.
+ */
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStringList>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+#include <algorithm>
+#include <limits>
+#include <stdio.h>
+#include <string.h>
+
+using namespace br;
+
+struct Options
+{
+    int type, size, targets, queries, images, imageSize, trials, frames, frameSize;
+    float fps;
+    QStringList distances, transforms, streams;
+    QString scratch, output;
+
+    Options()
+        : type(CV_8UC1), size(256), targets(4096), queries(256), images(64), imageSize(128), trials(3), frames(1000), frameSize(640),
+          fps(0), scratch(QDir::tempPath()) {}
+};
+
+// Discards scores so only the distance is measured
+class NullOutput : public Output
+{
+    QAtomicInt sink; // Keeps the scores observable, set() is called concurrently
+
+    void set(float value, int i, int j)
+    {
+        (void) i; (void) j;
+        int bits;
+        memcpy(&bits, &value, sizeof(bits));
+        sink.store(bits);
+    }
+
+public:
+    NullOutput(const FileList &targetFiles, const FileList &queryFiles)
+        : sink(0)
+    {
+        initialize(targetFiles, queryFiles);
+    }
+};
+
+static QStringList results;
+
+static QString csvField(const QString &field)
+{
+    return field.contains(',') ? "\"" + field + "\"" : field;
+}
+
+// Records a measurement that isn't a rate, like a latency
+static void record(const QString &benchmark, const QString &name, const QString &configuration, double seconds, double value, const QString &units)
+{
+    results.append(QString("%1,%2,%3,%4,%5,%6").arg(benchmark, csvField(name), csvField(configuration),
+                                                   QString::number(seconds), QString::number(value), units));
+    if (!Globals->quiet) fprintf(stderr, "%s %s %s %.3g %s\n", qPrintable(benchmark), qPrintable(name), qPrintable(configuration), value, qPrintable(units));
+}
+
+static void report(const QString &benchmark, const QString &name, const QString &configuration, double seconds, double items, const QString &units)
+{
+    record(benchmark, name, configuration, seconds, items / seconds, units);
+}
+
+static QString typeString(int type)
+{
+    return type == CV_32FC1 ? "32F" : "8U";
+}
+
+static TemplateList makeTemplates(int count, int rows, int cols, int type, const QString &prefix)
+{
+    TemplateList templates;
+    templates.reserve(count);
+    for (int i=0; i<count; i++) {
+        cv::Mat m(rows, cols, type);
+        if (type == CV_32FC1) cv::randu(m, 0.f, 1.f);
+        else                  cv::randu(m, 0, 256);
+        File file(QString("%1%2.png").arg(prefix, QString::number(i)));
+        file.set("Label", i % 100);
+        file.set("Affine_0", QPointF(0.3*cols, 0.4*rows));
+        file.set("Affine_1", QPointF(0.7*cols, 0.4*rows));
+        templates.append(Template(file, m));
+    }
+    return templates;
+}
+
+// Copies the templates into one contiguous buffer, as memGallery does
+static TemplateList align(const TemplateList &templates)
+{
+    TemplateList aligned = templates;
+    aligned.align();
+    return aligned;
+}
+
+// Returns the fastest of the timed trials
+template <typename Function>
+static double fastest(int trials, Function function)
+{
+    double best = std::numeric_limits<double>::max();
+    for (int i=0; i<trials; i++) {
+        QElapsedTimer timer; timer.start();
+        function(i);
+        best = std::min(best, timer.nsecsElapsed() / 1e9);
+    }
+    return best;
+}
+
+struct CompareTrial
+{
+    const Distance *distance;
+    const TemplateList *targets, *queries;
+
+    void operator()(int) const
+    {
+        NullOutput output(targets->files(), queries->files());
+        output.setBlock(0, 0);
+        distance->compare(*targets, *queries, &output);
+    }
+};
+
+static void benchmarkDistances(const Options &options)
+{
+    QStringList distances = options.distances;
+    if (distances.isEmpty()) {
+        if (options.type == CV_32FC1) distances << "L1" << "L2" << "Dist(L1)" << "Dist(L2)" << "Dist(Cosine)";
+        else                          distances << "ByteL1" << "HalfByteL1";
+    }
+
+    const TemplateList targets = makeTemplates(options.targets, 1, options.size, options.type, "target");
+    const TemplateList queries = makeTemplates(options.queries, 1, options.size, options.type, "query");
+    const TemplateList alignedTargets = align(targets);
+    const QString configuration = QString("%1x%2 %3x%4").arg(QString::number(options.size), typeString(options.type),
+                                                              QString::number(options.queries), QString::number(options.targets));
+
+    foreach (const QString &description, distances) {
+        QScopedPointer<Distance> distance(Distance::make(description, NULL));
+        const double comparisons = double(targets.size()) * double(queries.size());
+
+        CompareTrial trial = { distance.data(), &targets, &queries };
+        report("Distance", description, configuration + " unaligned", fastest(options.trials, trial), comparisons, "comparisons/sec");
+
+        trial.targets = &alignedTargets;
+        report("Distance", description, configuration + " aligned", fastest(options.trials, trial), comparisons, "comparisons/sec");
+    }
+}
+
+struct ProjectTrial
+{
+    const Transform *transform;
+    const TemplateList *src;
+
+    void operator()(int) const
+    {
+        TemplateList dst;
+        transform->project(*src, dst);
+    }
+};
+
+static void benchmarkTransforms(const Options &options)
+{
+    // Vector transforms, like PCA, are trained and projected on float vectors of the configured size
+    QStringList imageTransforms = options.transforms, vectorTransforms;
+    if (imageTransforms.isEmpty()) {
+        imageTransforms << "LBP(1,2)" << "Gabor(8,0,0,4,1,Magnitude)" << "Integral+IntegralSampler" << "Affine(88,88,0.25,0.35)";
+        vectorTransforms << "PCA(64)";
+    }
+
+    const TemplateList images = makeTemplates(options.images, options.imageSize, options.imageSize, CV_8UC1, "image");
+    const TemplateList vectors = makeTemplates(std::max(options.images, 2*options.size), 1, options.size, CV_32FC1, "vector");
+    const QString imageConfiguration = QString("%1x%1 8U x%2").arg(QString::number(options.imageSize), QString::number(images.size()));
+    const QString vectorConfiguration = QString("%1x32F x%2").arg(QString::number(options.size), QString::number(vectors.size()));
+
+    for (int i=0; i<imageTransforms.size() + vectorTransforms.size(); i++) {
+        const bool vector = (i >= imageTransforms.size());
+        const QString description = vector ? vectorTransforms[i-imageTransforms.size()] : imageTransforms[i];
+        const TemplateList &data = vector ? vectors : images;
+
+        QScopedPointer<Transform> transform(Transform::make(description, NULL));
+        if (transform->trainable) transform->train(data);
+
+        ProjectTrial trial = { transform.data(), &data };
+        report("Transform", description, vector ? vectorConfiguration : imageConfiguration, fastest(options.trials, trial), data.size(), "templates/sec");
+    }
+}
+
+struct GalleryTrial
+{
+    QString prefix, suffix;
+    const TemplateList *templates;
+    bool write;
+
+    QString fileName(int trial) const
+    {
+        return QString("%1_%2.%3").arg(prefix, QString::number(trial), suffix);
+    }
+
+    void operator()(int trial) const
+    {
+        QScopedPointer<Gallery> gallery(Gallery::make(fileName(trial)));
+        if (write) gallery->writeBlock(*templates);
+        else       gallery->read();
+    }
+};
+
+struct SimmatTrial
+{
+    QString fileName;
+    const TemplateList *targets, *queries;
+    bool write;
+
+    void operator()(int) const
+    {
+        if (write) {
+            QScopedPointer<Output> output(Output::make(fileName, targets->files(), queries->files()));
+            output->setBlock(0, 0);
+            for (int i=0; i<queries->size(); i++)
+                for (int j=0; j<targets->size(); j++)
+                    output->setRelative(i+j, i, j);
+        } else {
+            QScopedPointer<Format> format(Factory<Format>::make(fileName));
+            format->read();
+        }
+    }
+};
+
+static void benchmarkGalleries(const Options &options)
+{
+    const TemplateList templates = makeTemplates(options.targets, 1, options.size, options.type, "target");
+    const TemplateList queries = makeTemplates(options.queries, 1, options.size, options.type, "query");
+    const double megabytes = templates.bytes<double>() / (1024*1024);
+    const QString configuration = QString("%1x%2 x%3").arg(QString::number(options.size), typeString(options.type), QString::number(templates.size()));
+    const QString prefix = QDir(options.scratch).absoluteFilePath("br_bench");
+
+    foreach (const QString &suffix, QStringList() << "gal" << "mgal" << "mem") {
+        GalleryTrial trial = { prefix, suffix, &templates, true };
+        for (int i=0; i<options.trials; i++) QFile::remove(trial.fileName(i));
+        report("Gallery", suffix + " write", configuration, fastest(options.trials, trial), megabytes, "MB/sec");
+        trial.write = false;
+        report("Gallery", suffix + " read", configuration, fastest(options.trials, trial), megabytes, "MB/sec");
+        for (int i=0; i<options.trials; i++) QFile::remove(trial.fileName(i));
+    }
+
+    SimmatTrial trial = { prefix + ".mtx", &templates, &queries, true };
+    const double simmatMegabytes = double(templates.size()) * double(queries.size()) * sizeof(float) / (1024*1024);
+    const QString simmatConfiguration = QString("%1x%2").arg(QString::number(queries.size()), QString::number(templates.size()));
+    report("Gallery", "mtx write", simmatConfiguration, fastest(options.trials, trial), simmatMegabytes, "MB/sec");
+    trial.write = false;
+    report("Gallery", "mtx read", simmatConfiguration, fastest(options.trials, trial), simmatMegabytes, "MB/sec");
+    QFile::remove(trial.fileName);
+}
+
+struct StreamTrial
+{
+    Transform *stream;
+    File source;
+    QVector<int> *latencies;
+
+    void operator()(int) const
+    {
+        TemplateList src, dst;
+        src.append(Template(source));
+        stream->projectUpdate(src, dst);
+        foreach (const Template &frame, dst)
+            latencies->append(frame.file.get<int>("StreamLatency", 0));
+    }
+};
+
+// The same stages without a stream, one frame at a time
+struct DirectTrial
+{
+    Transform *stages;
+    const Template *frame;
+    int frames;
+
+    void operator()(int) const
+    {
+        for (int i=0; i<frames; i++) {
+            TemplateList src, dst;
+            src.append(*frame);
+            src.first().file.set("FrameNumber", i);
+            stages->projectUpdate(src, dst);
+        }
+    }
+};
+
+static double percentile(QVector<int> values, double p)
+{
+    if (values.isEmpty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[qMin(values.size()-1, int(p * (values.size()-1) + 0.5))];
+}
+
+static void benchmarkStream(const Options &options)
+{
+    QStringList chains = options.streams;
+    if (chains.isEmpty())
+        chains << "Identity" << "Identity+Identity+Identity+Identity" << "Burn(1000)+Burn(1000)" << "Burn(1000)+SequentialBurn(500)+Burn(1000)";
+
+    const int rows = options.frameSize * 3 / 4;
+    File source("synthetic");
+    source.set("frames", options.frames);
+    source.set("fps", options.fps);
+    source.set("rows", rows);
+    source.set("cols", options.frameSize);
+    const Template frame(File("synthetic"), cv::Mat(rows, options.frameSize, CV_8UC3, cv::Scalar::all(128)));
+    const QString configuration = QString("%1x%2 x%3 %4").arg(QString::number(options.frameSize), QString::number(rows), QString::number(options.frames),
+                                                              options.fps > 0 ? QString::number(options.fps) + " fps" : QString("unthrottled"));
+
+    foreach (const QString &chain, chains) {
+        QScopedPointer<Transform> stream(Transform::make("Stream([" + chain.split('+').join(",") + "],source=Synthetic)", NULL));
+        QVector<int> latencies;
+        StreamTrial trial = { stream.data(), source, &latencies };
+        const double seconds = fastest(options.trials, trial);
+        report("Stream", chain, configuration, seconds, options.frames, "frames/sec");
+        record("Stream", chain + " p50", configuration, seconds, percentile(latencies, 0.5), "ms latency");
+        record("Stream", chain + " p90", configuration, seconds, percentile(latencies, 0.9), "ms latency");
+        record("Stream", chain + " p99", configuration, seconds, percentile(latencies, 0.99), "ms latency");
+
+        // Throttled streams are paced by the source, not the stages
+        if (options.fps > 0) continue;
+        QScopedPointer<Transform> stages(Transform::make(chain, NULL));
+        DirectTrial direct = { stages.data(), &frame, options.frames };
+        const double directSeconds = fastest(options.trials, direct);
+        report("Stream", chain + " direct", configuration, directSeconds, options.frames, "frames/sec");
+        record("Stream", chain + " overhead", configuration, seconds, 1e6 * (seconds - directSeconds) / options.frames, "us/frame");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Context::initialize(argc, argv);
+
+    Options options;
+    for (int i=1; i<argc; i++) {
+        const QString key = QString(argv[i]).mid(1);
+        const QString value = (i+1 < argc) ? QString(argv[++i]) : QString();
+        if      (key == "type")       options.type = (value == "32F") ? CV_32FC1 : CV_8UC1;
+        else if (key == "size")       options.size = value.toInt();
+        else if (key == "targets")    options.targets = value.toInt();
+        else if (key == "queries")    options.queries = value.toInt();
+        else if (key == "images")     options.images = value.toInt();
+        else if (key == "imageSize")  options.imageSize = value.toInt();
+        else if (key == "trials")     options.trials = std::max(1, value.toInt());
+        else if (key == "distances")  options.distances = value.split(';', QString::SkipEmptyParts);
+        else if (key == "transforms") options.transforms = value.split(';', QString::SkipEmptyParts);
+        else if (key == "frames")     options.frames = std::max(1, value.toInt());
+        else if (key == "fps")        options.fps = value.toFloat();
+        else if (key == "frameSize")  options.frameSize = std::max(1, value.toInt());
+        else if (key == "streams")    options.streams = value.split(';', QString::SkipEmptyParts);
+        else if (key == "scratch")    options.scratch = value;
+        else if (key == "output")     options.output = value;
+        else                          Globals->setProperty(qPrintable(key), value);
+    }
+
+    results.append("Benchmark,Name,Configuration,Seconds,Throughput,Units");
+    benchmarkDistances(options);
+    benchmarkTransforms(options);
+    benchmarkGalleries(options);
+    benchmarkStream(options);
+
+    if (options.output.isEmpty()) {
+        printf("%s\n", qPrintable(results.join("\n")));
+    } else {
+        QFile file(options.output);
+        if (!file.open(QFile::WriteOnly | QFile::Text))
+            qFatal("Failed to open %s for writing.", qPrintable(options.output));
+        file.write(results.join("\n").toLocal8Bit() + "\n");
+    }
+
+    Context::finalize();
+    return 0;
+}
@@ -0,0 +1,58 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * Bayesian product quantization scores every pair of codes, including pairs whose distance lies
+ * beyond the genuine and impostor scores sampled during training, so every score must be finite.
+ */
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+#include <cmath>
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv);
+    br::Globals->quiet = true;
+
+    // Tight subjects in a narrow range, codes far from it are never paired in training
+    cv::RNG rng(0);
+    br::TemplateList training;
+    for (int subject=0; subject<32; subject++)
+        for (int sample=0; sample<16; sample++) {
+            cv::Mat m(1, 2, CV_32FC1);
+            m.at<float>(0, 0) = subject + rng.gaussian(0.05);
+            m.at<float>(0, 1) = (sample < 8 ? 0 : 1000) + rng.gaussian(0.05);
+            br::Template t(br::File(QString("%1_%2").arg(subject).arg(sample)), m);
+            t.file.set("Label", subject);
+            training.append(t);
+        }
+
+    QScopedPointer<br::Transform> transform(br::Transform::make("ProductQuantization(n=2,bayesian=true)", NULL));
+    transform->train(training);
+    QScopedPointer<br::Distance> distance(br::Distance::make("ProductQuantization(bayesian=true)", NULL));
+
+    int failures = 0;
+    for (int j=0; j<256; j++)
+        for (int k=0; k<256; k++) {
+            cv::Mat a(1, 1, CV_8UC1, cv::Scalar(j)), b(1, 1, CV_8UC1, cv::Scalar(k));
+            if (!std::isfinite(distance->compare(br::Template(a), br::Template(b))))
+                failures++;
+        }
+
+    if (failures) printf("%d of 65536 code pairs scored non-finite.\n", failures);
+    br::Context::finalize();
+    return failures ? 1 : 0;
+}
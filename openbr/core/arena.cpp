@@ -0,0 +1,135 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/arena.h"
+#include "openbr/core/parallel.h"
+
+using namespace br;
+
+namespace
+{
+
+enum { Min_Class_Bits = 8, // 256 bytes
+       Classes = 19, // Up to 64 MB, larger buffers bypass the caches
+       Max_Cached = 16, // Buffers per class and thread
+       Max_Cached_Bytes = 64 << 20, // Per thread, across classes
+       Header = 16 }; // Reference count and size class, keeps the data 16 byte aligned
+
+struct Cache
+{
+    QVector<uchar*> free[Classes];
+    size_t bytes; // Held in free
+    qint64 allocations, reuses, releases;
+    Cache() : bytes(0), allocations(0), reuses(0), releases(0) {}
+};
+
+ThreadLocal<Cache> caches;
+MatArena &arena = *new MatArena(); // Never destroyed, matrices may release their buffers during static destruction
+
+// Matrices can outlive the caches, like those held by other statics, they are then freed without them.
+// A plain bool is never destroyed, so it stays readable after the guard clears it.
+bool cachesAlive = false;
+struct CachesGuard
+{
+    CachesGuard() { cachesAlive = true; }
+    ~CachesGuard() { cachesAlive = false; }
+} cachesGuard; // Destroyed before caches
+
+int sizeClass(size_t bytes)
+{
+    int c = 0;
+    while ((c < Classes) && ((size_t(1) << (c + Min_Class_Bits)) < bytes))
+        c++;
+    return (c < Classes) ? c : -1;
+}
+
+} // namespace
+
+cv::Mat &MatArena::output(cv::Mat &m)
+{
+    if (Globals->arena && (m.data == NULL) && (m.allocator == NULL))
+        m.allocator = &arena;
+    return m;
+}
+
+MatArena::Statistics MatArena::statistics()
+{
+    Statistics totals = { 0, 0, 0 };
+    foreach (const Cache *cache, caches.values()) {
+        totals.allocations += cache->allocations;
+        totals.reuses += cache->reuses;
+        totals.releases += cache->releases;
+    }
+    return totals;
+}
+
+void MatArena::allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+{
+    size_t bytes = CV_ELEM_SIZE(type);
+    for (int i=dims-1; i>=0; i--) {
+        step[i] = bytes;
+        bytes *= sizes[i];
+    }
+
+    if (!cachesAlive) {
+        uchar *block = (uchar*)cv::fastMalloc(Header + bytes);
+        refcount = (int*)block;
+        refcount[0] = 1;
+        refcount[1] = -1;
+        datastart = data = block + Header;
+        return;
+    }
+
+    const int c = sizeClass(bytes);
+    Cache &cache = caches.local();
+    uchar *block;
+    if ((c != -1) && !cache.free[c].isEmpty()) {
+        block = cache.free[c].last();
+        cache.free[c].removeLast();
+        cache.bytes -= size_t(1) << (c + Min_Class_Bits);
+        cache.reuses++;
+    } else {
+        block = (uchar*)cv::fastMalloc(Header + ((c != -1) ? (size_t(1) << (c + Min_Class_Bits)) : bytes));
+        cache.allocations++;
+    }
+
+    refcount = (int*)block;
+    refcount[0] = 1;
+    refcount[1] = c;
+    datastart = data = block + Header;
+}
+
+void MatArena::deallocate(int *refcount, uchar *datastart, uchar *data)
+{
+    (void) datastart; (void) data;
+    const int c = refcount[1];
+    if (!cachesAlive) {
+        cv::fastFree(refcount);
+        return;
+    }
+
+    Cache &cache = caches.local();
+    cache.releases++;
+    const size_t classBytes = (c != -1) ? (size_t(1) << (c + Min_Class_Bits)) : 0;
+    if ((c != -1) && (cache.free[c].size() < Max_Cached) && (cache.bytes + classBytes <= size_t(Max_Cached_Bytes))) {
+        cache.free[c].append((uchar*)refcount);
+        cache.bytes += classBytes;
+    } else {
+        cv::fastFree(refcount);
+    }
+}
@@ -0,0 +1,59 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <QtGlobal>
+#include <opencv2/core/core.hpp>
+
+namespace br
+{
+
+/*!
+ * \brief Per-thread recycling of matrix buffers.
+ *
+ * Matrices created through output() draw their data from power-of-two size classes cached per thread.
+ * When the last reference to such a matrix is released its buffer returns to the releasing thread's cache rather than the heap,
+ * unless the cache already holds its limit of buffers of that size or bytes in total.
+ * Buffers released after the caches are destroyed at exit go straight back to the heap.
+ * Pooling is enabled by br::Context::arena, otherwise output() leaves matrices untouched.
+ */
+class MatArena : public cv::MatAllocator
+{
+public:
+    struct Statistics
+    {
+        qint64 allocations; /*!< \brief Buffers taken from the heap. */
+        qint64 reuses; /*!< \brief Buffers taken from a thread cache. */
+        qint64 releases; /*!< \brief Buffers given back. */
+    };
+
+    /*!
+     * \brief Returns \em m, set to allocate from the arena if pooling is enabled and \em m holds no data yet.
+     *
+     * Pass the result as the output of an OpenCV function, ex. <tt>resize(src, MatArena::output(dst), size)</tt>.
+     */
+    static cv::Mat &output(cv::Mat &m);
+    static Statistics statistics(); /*!< \brief Totals over every thread. */
+
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step);
+    void deallocate(int *refcount, uchar *datastart, uchar *data);
+};
+
+} // namespace br
+
+#endif // __ARENA_H
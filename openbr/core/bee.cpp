@@ -19,15 +19,16 @@
 #include <QHash>
 #include <QMap>
 #include <QRegExp>
-#ifndef BR_EMBEDDED
-#include <QtXml>
-#endif // BR_EMBEDDED
+#include <QScopedPointer>
+#include <QSharedPointer>
 #include <algorithm>
 #include <limits>
+#include <vector>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
 #include "opencvutils.h"
+#include "parallel.h"
 #include "qtutils.h"
 
 using namespace cv;
@@ -37,233 +38,586 @@ using namespace br;
 FileList BEE::readSigset(const QString &sigset, bool ignoreMetadata)
 {
     FileList fileList;
+    SigsetReader reader(sigset, ignoreMetadata);
+    while (!reader.atEnd())
+        fileList.append(reader.read(std::numeric_limits<int>::max()));
+    return fileList;
+}
 
-#ifndef BR_EMBEDDED
-    QDomDocument doc(sigset);
-    QFile file(sigset);
-    bool success;
-    success = file.open(QIODevice::ReadOnly); if (!success) qFatal("Unable to open %s for reading.", qPrintable(sigset));
-    success = doc.setContent(&file);          if (!success) qFatal("Unable to parse %s.", qPrintable(sigset));
-    file.close();
+BEE::SigsetReader::SigsetReader(const QString &sigset_, bool ignoreMetadata_)
+    : sigset(sigset_), file(sigset_), depth(0), ignoreMetadata(ignoreMetadata_), done(false)
+{
+    if (!file.open(QIODevice::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(sigset));
+    xml.setDevice(&file);
 
-    QDomElement docElem = doc.documentElement();
-    if (docElem.nodeName() != "biometric-signature-set")
-        return fileList;
-
-    QDomNode subject = docElem.firstChild();
-    while (!subject.isNull()) {
-        // Looping through subjects
-        QDomNode fileNode = subject.firstChild();
-        QDomElement d = subject.toElement();
-        QString name = d.attribute("name");
-        while (!fileNode.isNull()) {
-            // Looping through files
-            File file;
-
-            QDomElement e = fileNode.toElement();
-            QDomNamedNodeMap attributes = e.attributes();
-            for (int i=0; i<attributes.length(); i++) {
-                QString key = attributes.item(i).nodeName();
-                QString value = attributes.item(i).nodeValue();
-
-                if (key == "file-name") {
-                    File newFile(value, name);
-                    newFile.append(file);
-                    file = newFile;
-                } else if (!ignoreMetadata) {
-                    file.set(key, value);
-                }
-            }
+    // Only a biometric-signature-set contains files
+    if (xml.readNextStartElement() && (xml.name() == "biometric-signature-set")) depth = 1;
+    else if (xml.hasError()) qFatal("Unable to parse %s.", qPrintable(sigset));
+    else done = true;
+}
 
-            if (file.isNull()) qFatal("Empty file-name in %s.", qPrintable(sigset));
-            fileList.append(file);
+FileList BEE::SigsetReader::read(int maxFiles)
+{
+    FileList files;
+    while (!done && (files.size() < maxFiles)) {
+        switch (xml.readNext()) {
+          case QXmlStreamReader::StartElement:
+            depth++;
+            if (depth == 2) {
+                // Subject
+                subject = xml.attributes().value("name").toString();
+            } else if (depth == 3) {
+                // File within the subject
+                File file;
+                foreach (const QXmlStreamAttribute &attribute, xml.attributes()) {
+                    const QString key = attribute.name().toString();
+                    const QString value = attribute.value().toString();
+                    if (key == "file-name") {
+                        File newFile(value, subject);
+                        newFile.append(file);
+                        file = newFile;
+                    } else if (!ignoreMetadata) {
+                        file.set(key, value);
+                    }
+                }
 
-            fileNode = fileNode.nextSibling();
+                if (file.isNull()) qFatal("Empty file-name in %s.", qPrintable(sigset));
+                files.append(file);
+            }
+            break;
+          case QXmlStreamReader::EndElement:
+            if (--depth == 0) done = true;
+            break;
+          case QXmlStreamReader::Invalid:
+            qFatal("Unable to parse %s.", qPrintable(sigset));
+            break;
+          case QXmlStreamReader::EndDocument:
+            done = true;
+            break;
+          default:
+            break;
         }
-        subject = subject.nextSibling();
     }
-#else // BR_EMBEDDED
-    (void) sigset;
-    (void) ignoreMetadata;
-#endif // BR_EMBEDDED
-
-    return fileList;
+    return files;
 }
 
 void BEE::writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata)
 {
-    QStringList lines; lines.reserve(3*files.size()+3);
-    lines.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
-    lines.append("<biometric-signature-set>");
+    // Signatures are encoded into one buffer rather than a list of every line,
+    // and written through QtUtils::writeFile() so "terminal" and "buffer" outputs still work
+    QByteArray text("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<biometric-signature-set>\n");
     foreach (const File &file, files) {
         QStringList metadata;
         if (!ignoreMetadata)
             foreach (const QString &key, file.localKeys())
                 metadata.append(key+"=\""+file.get<QString>(key, "?")+"\"");
-        lines.append("\t<biometric-signature name=\"" + file.subject() +"\">");
-        lines.append("\t\t<presentation file-name=\"" + file.name + "\" " + metadata.join(" ") + "/>");
-        lines.append("\t</biometric-signature>");
+        text += "\t<biometric-signature name=\"" + file.subject().toUtf8() + "\">\n";
+        text += "\t\t<presentation file-name=\"" + file.name.toUtf8() + "\" " + metadata.join(" ").toUtf8() + "/>\n";
+        text += "\t</biometric-signature>\n";
     }
-    lines.append("</biometric-signature-set>");
-    QtUtils::writeFile(sigset, lines);
+    text += "</biometric-signature-set>";
+    QtUtils::writeFile(sigset, text);
 }
 
 template <typename T>
 Mat readMatrix(const br::File &matrix)
 {
-    // Special case matrix construction
-    if (matrix == "Identity") {
-        int rows = matrix.get<int>("rows", -1);
-        int columns = matrix.get<int>("columns", -1);
+    BEE::MatrixReader reader(matrix, sizeof(T) == sizeof(BEE::Mask_t));
+    const Mat m = reader.read(reader.rows);
+
+    // Views of the mapped file don't outlive the reader
+    return reader.readsViews() ? m.clone() : m;
+}
+
+Mat BEE::readSimmat(const br::File &simmat)
+{
+    return readMatrix<Simmat_t>(simmat);
+}
+
+Mat BEE::readMask(const br::File &mask)
+{
+    return readMatrix<Mask_t>(mask);
+}
+
+BEE::MatrixReader::MatrixReader(const br::File &matrix_, bool mask_)
+    : matrix(matrix_), dataOffset(0), mapped(NULL), row(0), step(1), mask(mask_), negate(false), selfSimilar(false), labels(false), runLength(false), quantized(false), groupRow(0)
+{
+    identity = (matrix == "Identity");
+    if (identity) {
+        // Same special case as readMatrix(), generated as rows are read
+        rows = matrix.get<int>("rows", -1);
+        columns = matrix.get<int>("columns", -1);
         const int size = matrix.get<int>("size", -1);
         if (size != -1) {
             if (rows == -1) rows = size;
             if (columns == -1) columns = size;
         }
-        const int step = matrix.get<int>("step", 1);
+        step = matrix.get<int>("step", 1);
         if (rows    % step != 0) qFatal("Step does not divide rows evenly.");
         if (columns % step != 0) qFatal("Step does not divide columns evenly.");
+        selfSimilar = matrix.get<bool>("selfSimilar", false);
+        return;
+    }
 
-        if (sizeof(T) == sizeof(BEE::Mask_t)) {
-            const bool selfSimilar = matrix.get<bool>("selfSimilar", false);
-
-            Mat m(rows, columns, CV_8UC1);
-            m.setTo(BEE::NonMatch);
-            for (int i=0; i<std::min(rows, columns); i+=step)
-                for (int j=0; j<step; j++)
-                    for (int k=0; k<step; k++)
-                        m.at<BEE::Mask_t>(i+j,i+k) = ((selfSimilar && (j == k)) ? BEE::DontCare : BEE::Match);
-            return m;
-        } else if (sizeof(T) == sizeof(BEE::Simmat_t)) {
-            Mat m(rows, columns, CV_32FC1);
-            m.setTo(0);
-            for (int i=0; i<std::min(rows, columns); i+=step)
-                for (int j=0; j<step; j++)
-                    for (int k=0; k<step; k++)
-                        m.at<BEE::Simmat_t>(i+j,i+k) = 1;
-            return m;
-        }
+    labels = (matrix == "Labels");
+    if (labels) {
+        // Mask rows are made from the galleries as they are read, so no mask file is needed
+        if (!mask) qFatal("Labels can only be read as a mask.");
+        const FileList targets = FileList::fromGallery(matrix.get<QString>("target"));
+        const QString query = matrix.get<QString>("query", ".");
+        const FileList queries = (query == ".") ? targets : FileList::fromGallery(query);
+        MaskKeys::make(targets, queries, targetKeys, queryKeys);
+        rows = queries.size();
+        columns = targets.size();
+        return;
     }
 
-    QFile file(matrix);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+    file.setFileName(matrix);
+    if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
 
     // Check format
     QByteArray format = file.readLine();
-    bool isDistance = (format[0] == 'D');
+    const bool isDistance = (format[0] == 'D');
     if (format[1] != '2') qFatal("Invalid matrix header.");
+    negate = !mask && (isDistance ^ matrix.get<bool>("negate", false));
 
-    // Skip sigset lines
-    file.readLine();
-    file.readLine();
+    targetSigset = QString(file.readLine()).trimmed();
+    querySigset = QString(file.readLine()).trimmed();
 
     // Get matrix size
     QStringList words = QString(file.readLine()).split(" ");
-    int rows = words[1].toInt();
-    int cols = words[2].toInt();
-
-    // Get matrix data
-    qint64 bytesExpected = (qint64)rows*(qint64)cols*(qint64)sizeof(T);
-    Mat m(rows, cols, OpenCVType<T,1>::make());
-    if (file.read((char*)m.data, bytesExpected) != bytesExpected)
-        qFatal("Invalid matrix size.");
-    file.close();
+    rows = words[1].toInt();
+    columns = words[2].toInt();
+    dataOffset = file.pos();
+
+    runLength = (words[0] == "MR");
+    if (runLength) {
+        if (!mask) qFatal("Run-length matrices can only be read as masks.");
+        return;
+    }
+
+    quantized = (words[0] == "MQ");
+    if (quantized) {
+        if (mask) qFatal("Quantized matrices can only be read as simmats.");
+        return;
+    }
+
+    const qint64 bytesExpected = qint64(rows)*qint64(columns)*qint64(mask ? sizeof(Mask_t) : sizeof(Simmat_t));
+    if (file.size() - dataOffset < bytesExpected) qFatal("Invalid matrix size.");
 
-    Mat result;
-    if (isDistance ^ matrix.get<bool>("negate", false)) m.convertTo(result, -1, -1);
-    else                                                result = m.clone();
-    return result;
+    // Unmapped files, for example on 32-bit hosts, are read a block at a time
+    if (bytesExpected > 0) mapped = file.map(dataOffset, bytesExpected);
 }
 
-Mat BEE::readSimmat(const br::File &simmat)
+Mat BEE::MatrixReader::read(int maxRows)
 {
-    return readMatrix<Simmat_t>(simmat);
+    const int count = std::min(maxRows, rows - row);
+    if (count <= 0) return Mat();
+
+    const int type = mask ? CV_8UC1 : CV_32FC1;
+    Mat m;
+    if (identity) {
+        m = readIdentity(count);
+    } else if (labels) {
+        m = Mat(count, columns, type);
+        makeMaskBlock(targetKeys, queryKeys, row, m);
+    } else if (runLength) {
+        m = readRuns(count);
+    } else if (quantized) {
+        m = readQuantized(count);
+        if (negate) m.convertTo(m, -1, -1);
+    } else if (mapped) {
+        const Mat view(count, columns, type, mapped + qint64(row)*qint64(columns)*qint64(CV_ELEM_SIZE(type)));
+        if (negate) view.convertTo(m, -1, -1);
+        else        m = view;
+    } else {
+        m = Mat(count, columns, type);
+        const qint64 bytes = qint64(count)*qint64(columns)*qint64(m.elemSize());
+        if (file.read((char*)m.data, bytes) != bytes) qFatal("Invalid matrix size.");
+        if (negate) m.convertTo(m, -1, -1);
+    }
+
+    row += count;
+    return m;
 }
 
-Mat BEE::readMask(const br::File &mask)
+void BEE::MatrixReader::reset()
 {
-    return readMatrix<Mask_t>(mask);
+    row = 0;
+    group.release();
+    groupRow = 0;
+    if (!identity && !labels && !mapped) file.seek(dataOffset);
 }
 
+// Each run is a mask value followed by its length as a native quint32
+static const int RunBytes = sizeof(BEE::Mask_t) + sizeof(quint32);
+
+Mat BEE::MatrixReader::readRuns(int count)
+{
+    Mat m(count, columns, CV_8UC1);
+    char run[RunBytes];
+    for (int i=0; i<count; i++) {
+        Mask_t *values = m.ptr<Mask_t>(i);
+        int j = 0;
+        while (j < columns) {
+            if (file.read(run, RunBytes) != RunBytes) qFatal("Truncated run-length mask %s.", qPrintable(matrix.name));
+            quint32 length;
+            memcpy(&length, run + sizeof(Mask_t), sizeof(quint32));
+            if (length > quint32(columns - j)) qFatal("Invalid run-length mask %s.", qPrintable(matrix.name));
+            memset(values + j, uchar(run[0]), length);
+            j += length;
+        }
+    }
+    return m;
+}
+
+// Each group of a quantized simmat is this header, native like the runs, followed by its codes.
+// Code 0 is a missing score, read as -FLT_MAX, and codes [1, 2^bits) span [lo, hi].
+struct QuantizedGroup
+{
+    quint32 rows;
+    quint16 bits; // 8, 16, or 32 for scores that are only compressed
+    quint16 compressed;
+    float lo, hi;
+    quint32 bytes;
+};
+
 template <typename T>
-void writeMatrix(const Mat &m, const QString &matrix, const QString &targetSigset, const QString &querySigset)
+static void dequantize(const T *codes, float *scores, size_t count, const QuantizedGroup &header)
 {
-    if (m.type() != OpenCVType<T,1>::make()) qFatal("Invalid matrix type.");
+    const int levels = std::numeric_limits<T>::max();
+    const float scale = (levels > 1) ? (header.hi - header.lo) / (levels - 1) : 0;
+    for (size_t i=0; i<count; i++)
+        scores[i] = (codes[i] == 0) ? -std::numeric_limits<float>::max() : header.lo + (codes[i] - 1) * scale;
+}
 
-    int elemSize = sizeof(T);
-    QString matrixType;
-    if      (elemSize == 1) matrixType = "B";
-    else if (elemSize == 4) matrixType = "F";
-    else                    qFatal("Invalid element size.");
+template <typename T>
+static void quantize(const float *scores, T *codes, size_t count, QuantizedGroup &header)
+{
+    // Missing scores, and those that aren't a number, don't stretch the range
+    const float lowest = -std::numeric_limits<float>::max();
+    float lo = std::numeric_limits<float>::max(), hi = lowest;
+    for (size_t i=0; i<count; i++)
+        if ((scores[i] > lowest) && (scores[i] < std::numeric_limits<float>::infinity())) {
+            lo = std::min(lo, scores[i]);
+            hi = std::max(hi, scores[i]);
+        }
+    if (lo > hi) lo = hi = 0;
+    header.lo = lo;
+    header.hi = hi;
+
+    const int levels = std::numeric_limits<T>::max();
+    const float scale = (hi > lo) ? (levels - 1) / (hi - lo) : 0;
+    for (size_t i=0; i<count; i++) {
+        if (!(scores[i] > lowest)) { codes[i] = 0; continue; }
+        const float code = 1 + (std::min(scores[i], hi) - lo) * scale + 0.5f;
+        codes[i] = T(std::min(float(levels), code));
+    }
+}
+
+Mat BEE::MatrixReader::readQuantized(int count)
+{
+    Mat m(count, columns, CV_32FC1);
+    int filled = 0;
+    while (filled < count) {
+        if (groupRow >= group.rows) {
+            group = readGroup();
+            groupRow = 0;
+        }
+        const int n = std::min(count - filled, group.rows - groupRow);
+        group.rowRange(groupRow, groupRow+n).copyTo(m.rowRange(filled, filled+n));
+        groupRow += n;
+        filled += n;
+    }
+    return m;
+}
+
+Mat BEE::MatrixReader::readGroup()
+{
+    QuantizedGroup header;
+    if (file.read((char*)&header, sizeof(header)) != sizeof(header)) qFatal("Truncated quantized matrix %s.", qPrintable(matrix.name));
+    if ((header.rows == 0) || (header.rows > quint32(rows)) ||
+        ((header.bits != 8) && (header.bits != 16) && (header.bits != 32))) qFatal("Invalid quantized matrix %s.", qPrintable(matrix.name));
+
+    QByteArray data = file.read(header.bytes);
+    if (data.size() != int(header.bytes)) qFatal("Truncated quantized matrix %s.", qPrintable(matrix.name));
+    if (header.compressed) data = qUncompress(data);
+    const size_t count = size_t(header.rows) * size_t(columns);
+    if (size_t(data.size()) != count * (header.bits / 8)) qFatal("Invalid quantized matrix %s.", qPrintable(matrix.name));
+
+    Mat m(header.rows, columns, CV_32FC1);
+    if      (header.bits == 8)  dequantize((const quint8*)data.constData(), m.ptr<float>(), count, header);
+    else if (header.bits == 16) dequantize((const quint16*)data.constData(), m.ptr<float>(), count, header);
+    else                        memcpy(m.data, data.constData(), count * sizeof(float));
+    return m;
+}
 
+BEE::MatrixWriter::MatrixWriter(const br::File &matrix, int rows_, int columns_, bool mask_, const QString &targetSigset, const QString &querySigset)
+    : rows(rows_), columns(columns_), dataOffset(0), mapped(NULL), mask(mask_), next(0)
+{
     char buff[4];
-    QFile file(matrix);
+    runLength = mask && matrix.get<bool>("runLength", false);
+    compress = !mask && matrix.get<bool>("compress", false);
+    bits = mask ? 0 : matrix.get<int>("quantize", 0);
+    if ((bits != 0) && (bits != 8) && (bits != 16)) qFatal("Simmats can only be quantized to 8 or 16 bits.");
+    if (compress && (bits == 0)) bits = 32;
+    file.setFileName(matrix.name);
     QtUtils::touchDir(file);
-    bool success = file.open(QFile::WriteOnly); if (!success) qFatal("Unable to open %s for writing.", qPrintable(matrix));
+    bool success = file.open(QFile::ReadWrite | QFile::Truncate); if (!success) qFatal("Unable to open %s for writing.", qPrintable(matrix.name));
     file.write("S2\n");
     file.write(qPrintable(QFileInfo(targetSigset).fileName()));
     file.write("\n");
     file.write(qPrintable(QFileInfo(querySigset).fileName()));
     file.write("\n");
     file.write("M");
-    file.write(qPrintable(matrixType));
+    file.write(runLength ? "R" : (bits ? "Q" : (mask ? "B" : "F")));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(columns)));
     file.write(" ");
     int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
+    dataOffset = file.pos();
+    if (runLength) return;
+
+    const qint64 bytes = qint64(rows)*qint64(columns)*qint64(mask ? sizeof(Mask_t) : sizeof(Simmat_t));
+    if (bytes == 0) return;
+    if (bits) {
+        // Staged beside the matrix so blocks can still be written in any order
+        staging.reset(new QTemporaryFile(file.fileName() + ".XXXXXX"));
+        if (staging->open() && staging->resize(bytes)) mapped = staging->map(0, bytes);
+    } else if (file.resize(dataOffset + bytes)) {
+        mapped = file.map(dataOffset, bytes);
+    }
+    if (!mapped) buffer = Mat(rows, columns, mask ? CV_8UC1 : CV_32FC1);
+}
+
+BEE::MatrixWriter::~MatrixWriter()
+{
+    if (runLength) {
+        writeRuns();
+        if (next != rows) qWarning("Run-length mask %s is missing rows.", qPrintable(file.fileName()));
+    } else if (bits) {
+        writeGroups();
+    } else if (!buffer.empty()) {
+        file.seek(dataOffset);
+        file.write((const char*)buffer.data, buffer.total()*buffer.elemSize());
+    }
     file.close();
 }
 
-void BEE::writeSimmat(const Mat &m, const QString &simmat, const QString &targetSigset, const QString &querySigset)
+Mat BEE::MatrixWriter::block(int begin, int count)
+{
+    if ((begin < 0) || (count < 0) || (begin+count > rows)) qFatal("Invalid matrix block.");
+    if (runLength) {
+        if (begin != next) qFatal("Run-length mask blocks must be written in row order.");
+        writeRuns();
+        buffer = Mat(count, columns, CV_8UC1);
+        next = begin + count;
+        return buffer;
+    }
+    if (!buffer.empty()) return buffer.rowRange(begin, begin+count);
+    const int type = mask ? CV_8UC1 : CV_32FC1;
+    return Mat(count, columns, type, mapped + qint64(begin)*qint64(columns)*qint64(CV_ELEM_SIZE(type)));
+}
+
+void BEE::MatrixWriter::writeRuns()
+{
+    QByteArray runs;
+    for (int i=0; i<buffer.rows; i++) {
+        const Mask_t *values = buffer.ptr<Mask_t>(i);
+        int j = 0;
+        while (j < columns) {
+            int k = j + 1;
+            while ((k < columns) && (values[k] == values[j])) k++;
+            const quint32 length = k - j;
+            runs.append(char(values[j]));
+            runs.append((const char*)&length, sizeof(quint32));
+            j = k;
+        }
+    }
+    if (file.write(runs) != runs.size()) qFatal("Failed to write %s.", qPrintable(file.fileName()));
+    buffer.release();
+}
+
+void BEE::MatrixWriter::writeGroups()
+{
+    if ((rows == 0) || (columns == 0)) return;
+    const Mat scores = buffer.empty() ? Mat(rows, columns, CV_32FC1, mapped) : buffer;
+
+    // Each group has its own score range, small enough that a few outliers don't cost the rest their precision
+    const int groupRows = std::max(1, (1 << 20) / columns);
+    QByteArray data;
+    for (int begin=0; begin<rows; begin+=groupRows) {
+        const Mat group = scores.rowRange(begin, std::min(rows, begin+groupRows));
+        const size_t count = group.total();
+
+        QuantizedGroup header;
+        header.rows = group.rows;
+        header.bits = bits;
+        header.compressed = compress;
+        header.lo = header.hi = 0;
+        data.resize(int(count * (bits / 8)));
+        if      (bits == 8)  quantize(group.ptr<float>(), (quint8*)data.data(), count, header);
+        else if (bits == 16) quantize(group.ptr<float>(), (quint16*)data.data(), count, header);
+        else                 memcpy(data.data(), group.data, count * sizeof(float));
+        if (compress) data = qCompress(data);
+        header.bytes = data.size();
+
+        if ((file.write((const char*)&header, sizeof(header)) != sizeof(header)) ||
+            (file.write(data) != data.size())) qFatal("Failed to write %s.", qPrintable(file.fileName()));
+    }
+
+    if (mapped) staging->unmap(mapped);
+    mapped = NULL;
+    staging.reset();
+}
+
+Mat BEE::MatrixReader::readIdentity(int count) const
+{
+    Mat m(count, columns, mask ? CV_8UC1 : CV_32FC1);
+    m.setTo(mask ? NonMatch : 0);
+    const int diagonal = std::min(rows, columns);
+    for (int i=0; i<count; i++) {
+        const int r = row + i;
+        const int begin = (r / step) * step;
+        if (begin >= diagonal) continue;
+        for (int c=begin; c<std::min(begin+step, columns); c++) {
+            if (mask) m.at<Mask_t>(i,c) = ((selfSimilar && (r == c)) ? DontCare : Match);
+            else      m.at<Simmat_t>(i,c) = 1;
+        }
+    }
+    return m;
+}
+
+template <typename T>
+void writeMatrix(const Mat &m, const br::File &matrix, const QString &targetSigset, const QString &querySigset)
+{
+    if (m.type() != OpenCVType<T,1>::make()) qFatal("Invalid matrix type.");
+    BEE::MatrixWriter writer(matrix, m.rows, m.cols, sizeof(T) == sizeof(BEE::Mask_t), targetSigset, querySigset);
+    Mat block = writer.block(0, m.rows);
+    m.copyTo(block);
+}
+
+void BEE::writeSimmat(const Mat &m, const br::File &simmat, const QString &targetSigset, const QString &querySigset)
 {
     writeMatrix<Simmat_t>(m, simmat, targetSigset, querySigset);
 }
 
-void BEE::writeMask(const Mat &m, const QString &mask, const QString &targetSigset, const QString &querySigset)
+void BEE::writeMask(const Mat &m, const br::File &mask, const QString &targetSigset, const QString &querySigset)
 {
     writeMatrix<Mask_t>(m, mask, targetSigset, querySigset);
 }
 
+static void makeKeys(const FileList &files, QHash<QString,int> &nameCodes, BEE::MaskKeys &keys, bool isTarget)
+{
+    const QList<float> labels = files.labels();
+    const QList<int> partitions = files.crossValidationPartitions();
+    keys.names.resize(files.size());
+    keys.labels.resize(files.size());
+    keys.partitions.resize(files.size());
+    for (int i=0; i<files.size(); i++) {
+        QHash<QString,int>::const_iterator code = nameCodes.constFind(files[i].name);
+        if (code == nameCodes.constEnd()) code = nameCodes.insert(files[i].name, nameCodes.size());
+        keys.names[i] = code.value();
+        keys.labels[i] = int(labels[i]);
+        keys.partitions[i] = ((keys.labels[i] == -1) && isTarget) ? std::numeric_limits<int>::min() : partitions[i];
+    }
+}
+
+void BEE::MaskKeys::make(const FileList &targets, const FileList &queries, MaskKeys &targetKeys, MaskKeys &queryKeys)
+{
+    QHash<QString,int> nameCodes;
+    makeKeys(targets, nameCodes, targetKeys, true);
+    makeKeys(queries, nameCodes, queryKeys, false);
+}
+
+static void makeMaskRows(const BEE::MaskKeys *targets, const BEE::MaskKeys *queries, int begin, Mat rows)
+{
+    const int columns = targets->names.size();
+    const int *names = targets->names.constData();
+    const int *labels = targets->labels.constData();
+    const int *partitions = targets->partitions.constData();
+    for (int i=0; i<rows.rows; i++) {
+        BEE::Mask_t *row = rows.ptr<BEE::Mask_t>(i);
+        const int name = queries->names[begin+i];
+        const int label = queries->labels[begin+i];
+        const int partition = queries->partitions[begin+i];
+        if (label == -1) {
+            memset(row, BEE::DontCare, columns);
+            continue;
+        }
+
+        // Branch free so the compiler can vectorize it
+        for (int j=0; j<columns; j++)
+            row[j] = ((name == names[j]) | (partition != partitions[j])) ? BEE::DontCare
+                                                                         : ((label == labels[j]) ? BEE::Match : BEE::NonMatch);
+    }
+}
+
+void BEE::makeMaskBlock(const MaskKeys &targets, const MaskKeys &queries, int begin, Mat &block)
+{
+    const int chunk = std::max(1, (1 << 16) / std::max(1, block.cols));
+    TaskGroup tasks;
+    for (int i=0; i<block.rows; i += chunk) {
+        const Mat rows = block.rowRange(i, std::min(i+chunk, block.rows));
+        if (Globals->parallelism) tasks.run(&makeMaskRows, &targets, &queries, begin+i, rows);
+        else                      makeMaskRows(&targets, &queries, begin+i, rows);
+    }
+    tasks.wait();
+}
+
 void BEE::makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
 {
     qDebug("Making mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
 
-    FileList targetFiles = TemplateList::fromGallery(targetInput).files();
-    FileList queryFiles = (queryInput == ".") ? targetFiles : TemplateList::fromGallery(queryInput).files();
-    QList<float> targetLabels = targetFiles.labels();
-    QList<float> queryLabels = queryFiles.labels();
-    QList<int> targetPartitions = targetFiles.crossValidationPartitions();
-    QList<int> queryPartitions = queryFiles.crossValidationPartitions();
-
-    Mat vals(queryFiles.size(), targetFiles.size(), CV_8UC1);
-    for (int i=0; i<queryFiles.size(); i++) {
-        const QString &fileA = queryFiles[i];
-        const int labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        for (int j=0; j<targetFiles.size(); j++) {
-            const QString &fileB = targetFiles[j];
-            const int labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
-
-            Mask_t val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (labelA == -1)             val = DontCare;
-            else if (labelB == -1)             val = DontCare;
-            else if (partitionA != partitionB) val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            vals.at<Mask_t>(i,j) = val;
+    const FileList targetFiles = FileList::fromGallery(targetInput);
+    const FileList queryFiles = (queryInput == ".") ? targetFiles : FileList::fromGallery(queryInput);
+    MaskKeys targetKeys, queryKeys;
+    MaskKeys::make(targetFiles, queryFiles, targetKeys, queryKeys);
+
+    // Rows are generated straight into the mapped mask a block at a time
+    MatrixWriter writer(mask, queryFiles.size(), targetFiles.size(), true, targetInput, queryInput);
+    const int blockRows = std::max(1, (1 << 24) / std::max(1, writer.columns));
+    for (int begin=0; begin<writer.rows; begin += blockRows) {
+        Mat block = writer.block(begin, std::min(blockRows, writer.rows - begin));
+        makeMaskBlock(targetKeys, queryKeys, begin, block);
+    }
+}
+
+// Combines rows [begin, end) of the input blocks into the output block.
+// Each mask is folded into per-column 0x00/0xff flags with branchless byte loops the compiler vectorizes.
+static void combineRows(const QList<Mat> *masks, Mat *combined, int begin, int end, bool AND)
+{
+    const int columns = combined->cols;
+    std::vector<uchar> anyMatch(columns), anyNonMatch(columns), anyDontCare(columns);
+    for (int i=begin; i<end; i++) {
+        std::fill(anyMatch.begin(), anyMatch.end(), 0);
+        std::fill(anyNonMatch.begin(), anyNonMatch.end(), 0);
+        std::fill(anyDontCare.begin(), anyDontCare.end(), 0);
+        uchar *m = &anyMatch[0], *n = &anyNonMatch[0], *d = &anyDontCare[0];
+
+        for (int k=0; k<masks->size(); k++) {
+            const BEE::Mask_t *v = (*masks)[k].ptr<BEE::Mask_t>(i);
+            for (int j=0; j<columns; j++) {
+                m[j] |= (v[j] == BEE::Match)    ? 0xff : 0;
+                n[j] |= (v[j] == BEE::NonMatch) ? 0xff : 0;
+                d[j] |= (v[j] == BEE::DontCare) ? 0xff : 0;
+            }
+        }
+
+        uchar conflict = 0;
+        BEE::Mask_t *out = combined->ptr<BEE::Mask_t>(i);
+        for (int j=0; j<columns; j++) {
+            conflict |= m[j] & n[j];
+            out[j] = (m[j] & BEE::Match) | (~m[j] & n[j] & BEE::NonMatch);
+            if (AND) out[j] &= ~d[j];
         }
+        if (conflict) qFatal("Comparison is both a genuine and an imposter.");
     }
-    writeMask(vals, mask, targetInput, queryInput);
 }
 
 void BEE::combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
@@ -275,43 +629,80 @@ void BEE::combineMasks(const QStringList &inputMasks, const QString &outputMask,
     else if (method == "Or")  AND = false;
     else                      qFatal("Invalid method.");
 
-    QList<Mat> masks;
-    foreach (const QString &inputMask, inputMasks)
-        masks.append(readMask(inputMask));
-    if (masks.size() < 2) qFatal("Expected at least two masks.");
+    if (inputMasks.size() < 2) qFatal("Expected at least two masks.");
+    QList< QSharedPointer<MatrixReader> > readers;
+    foreach (const QString &inputMask, inputMasks) {
+        readers.append(QSharedPointer<MatrixReader>(new MatrixReader(inputMask, true)));
+        if ((readers.last()->rows != readers.first()->rows) || (readers.last()->columns != readers.first()->columns))
+            qFatal("Mask size mismatch.");
+    }
 
-    const int rows = masks.first().rows;
-    const int columns = masks.first().cols;
+    // Blocks of rows are read from the mapped inputs and combined in parallel straight into the mapped output
+    MatrixWriter writer(outputMask, readers.first()->rows, readers.first()->columns, true, "Combined_Targets", "Combined_Queries");
+    const int blockRows = std::max(1, (1 << 24) / std::max(1, writer.columns));
+    const int threads = std::max(1, abs(Globals->parallelism));
+    for (int begin=0; begin<writer.rows; begin += blockRows) {
+        const int count = std::min(blockRows, writer.rows - begin);
+        QList<Mat> masks;
+        foreach (const QSharedPointer<MatrixReader> &reader, readers)
+            masks.append(reader->read(count));
+        Mat combined = writer.block(begin, count);
+
+        const int step = (count + threads - 1) / threads;
+        TaskGroup tasks;
+        for (int b=0; b<count; b+=step) {
+            if (Globals->parallelism) tasks.run(&combineRows, &masks, &combined, b, std::min(count, b+step), AND);
+            else                      combineRows(&masks, &combined, b, std::min(count, b+step), AND);
+        }
+        tasks.wait();
+    }
+}
 
-    Mat combinedMask(rows, columns, CV_8UC1);
-    for (int i=0; i<rows; i++) {
-        for (int j=0; j<columns; j++) {
-            int genuineCount = 0;
-            int imposterCount = 0;
-            int dontcareCount = 0;
-            for (int k=0; k<masks.size(); k++) {
-                switch (masks[k].at<Mask_t>(i,j)) {
-                  case Match:
-                    genuineCount++;
-                    break;
-                  case NonMatch:
-                    imposterCount++;
-                    break;
-                  case DontCare:
-                    dontcareCount++;
-                    break;
-                }
-            }
-            if ((genuineCount != 0) && (imposterCount != 0)) qFatal("Comparison is both a genuine and an imposter.");
-
-            Mask_t val;
-            if      (genuineCount > 0)  val = Match;
-            else if (imposterCount > 0) val = NonMatch;
-            else                        val = DontCare;
-            if (AND && (dontcareCount > 0)) val = DontCare;
-            combinedMask.at<Mask_t>(i,j) = val;
+QString BEE::fragmentSigset(const QString &sigset, int begin, int end, int total)
+{
+    return QString("%1@%2:%3:%4").arg(QFileInfo(sigset).fileName(), QString::number(begin), QString::number(end), QString::number(total));
+}
+
+// Splits "<sigset>@<begin>:<end>:<total>" as written by fragmentSigset()
+static void parseFragmentSigset(const QString &fragment, const QString &sigset, QString &name, int &begin, int &end, int &total)
+{
+    const int index = sigset.lastIndexOf('@');
+    const QStringList words = sigset.mid(index+1).split(':');
+    if ((index == -1) || (words.size() != 3)) qFatal("%s is not a comparison fragment.", qPrintable(fragment));
+    name = sigset.left(index);
+    begin = words[0].toInt();
+    end = words[1].toInt();
+    total = words[2].toInt();
+}
+
+void BEE::mergeMatrices(const QStringList &fragments, const QString &simmat)
+{
+    qDebug("Merging %d fragments to %s", fragments.size(), qPrintable(simmat));
+    if (fragments.isEmpty()) qFatal("Expected at least one fragment.");
+
+    QScopedPointer<MatrixWriter> writer;
+    qint64 covered = 0;
+    foreach (const QString &fragment, fragments) {
+        MatrixReader reader(fragment, false);
+        QString targetSigset, querySigset;
+        int columnBegin, columnEnd, columns, rowBegin, rowEnd, rows;
+        parseFragmentSigset(fragment, reader.targetSigset, targetSigset, columnBegin, columnEnd, columns);
+        parseFragmentSigset(fragment, reader.querySigset, querySigset, rowBegin, rowEnd, rows);
+        if ((reader.rows != rowEnd-rowBegin) || (reader.columns != columnEnd-columnBegin)) qFatal("%s has an invalid size.", qPrintable(fragment));
+
+        if (writer.isNull()) writer.reset(new MatrixWriter(simmat, rows, columns, false, targetSigset, querySigset));
+        else if ((writer->rows != rows) || (writer->columns != columns)) qFatal("%s belongs to a different comparison.", qPrintable(fragment));
+
+        // Rows are copied a block at a time into the mapped output
+        const int blockRows = std::max(1, (1 << 22) / std::max(1, reader.columns));
+        for (int begin=0; begin<reader.rows; begin+=blockRows) {
+            const Mat scores = reader.read(blockRows);
+            Mat block = writer->block(rowBegin+begin, scores.rows);
+            scores.copyTo(block.colRange(columnBegin, columnEnd));
         }
+        covered += qint64(reader.rows) * qint64(reader.columns);
     }
 
-    writeMask(combinedMask, outputMask, "Combined_Targets", "Combined_Queries");
+    const qint64 total = qint64(writer->rows) * qint64(writer->columns);
+    if (covered != total) qWarning("Fragments cover %lld of %lld comparisons.", covered, total);
 }
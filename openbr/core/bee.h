@@ -17,11 +17,16 @@
 #ifndef __BEE_H
 #define __BEE_H
 
+#include <QFile>
 #include <QList>
 #include <QPair>
 #include <QHash>
+#include <QScopedPointer>
 #include <QString>
 #include <QStringList>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QXmlStreamReader>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -38,15 +43,108 @@ namespace BEE
     br::FileList readSigset(const QString &sigset, bool ignoreMetadata = false);
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
+    // Reads a sigset a block of files at a time, without holding the document in memory
+    class SigsetReader
+    {
+    public:
+        SigsetReader(const QString &sigset, bool ignoreMetadata = false);
+        br::FileList read(int maxFiles); // Returns an empty list after the last file
+        bool atEnd() const { return done; }
+
+    private:
+        QString sigset, subject;
+        QFile file;
+        QXmlStreamReader xml;
+        int depth;
+        bool ignoreMetadata, done;
+    };
+
     // Matrix IO
     cv::Mat readSimmat(const br::File &simmat);
     cv::Mat readMask(const br::File &mask);
-    void writeSimmat(const cv::Mat &m, const QString &simmat, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
-    void writeMask(const cv::Mat &m, const QString &mask, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    void writeSimmat(const cv::Mat &m, const br::File &simmat, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    void writeMask(const cv::Mat &m, const br::File &mask, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+
+    // Integer keys compared to make a mask, equal template names share a code.
+    // Targets without a label are given a partition no query has, so they compare as DontCare.
+    struct MaskKeys
+    {
+        QVector<int> names, labels, partitions;
+        static void make(const br::FileList &targets, const br::FileList &queries, MaskKeys &targetKeys, MaskKeys &queryKeys);
+    };
+
+    // Fills query rows [begin, begin+block.rows) of a mask in parallel
+    void makeMaskBlock(const MaskKeys &targets, const MaskKeys &queries, int begin, cv::Mat &block);
+
+    // Reads a simmat or mask a block of rows at a time.
+    // Rows are read-only views of the memory mapped file, valid for the lifetime of the reader,
+    // unless the matrix is negated or the file can't be mapped in which case they are copies.
+    // A mask named "Labels" is computed from the "target" and "query" galleries as rows are read.
+    // Run-length encoded masks and quantized simmats are decoded into copies.
+    class MatrixReader
+    {
+    public:
+        int rows, columns;
+        QString targetSigset, querySigset; // From the header
+
+        MatrixReader(const br::File &matrix, bool mask);
+        cv::Mat read(int maxRows); // Returns an empty matrix after the last row
+        void reset();
+        bool readsViews() const { return (mapped != NULL) && !negate; }
+
+    private:
+        br::File matrix;
+        QFile file;
+        qint64 dataOffset;
+        uchar *mapped;
+        int row, step;
+        bool mask, negate, identity, selfSimilar, labels, runLength, quantized;
+        MaskKeys targetKeys, queryKeys;
+        cv::Mat group; // The decoded group of a quantized simmat whose rows from groupRow haven't been read
+        int groupRow;
+
+        cv::Mat readIdentity(int count) const;
+        cv::Mat readRuns(int count);
+        cv::Mat readQuantized(int count);
+        cv::Mat readGroup();
+    };
+
+    // Writes a simmat or mask through writable views of the memory mapped file, flushed on destruction.
+    // Masks with "runLength" set store each row as (value, length) runs instead, their blocks must be requested in row order
+    // and each is encoded when the next is requested.
+    // Simmats with "quantize" set to 8 or 16 store each group of rows as integers mapped linearly from the group's score range,
+    // which preserves the order of scores, and with "compress" set each group is also zlib compressed,
+    // a compressed simmat that isn't quantized keeps its 32-bit scores. Their blocks are staged in a temporary file beside the matrix
+    // and encoded on destruction.
+    class MatrixWriter
+    {
+    public:
+        int rows, columns;
+
+        MatrixWriter(const br::File &matrix, int rows, int columns, bool mask, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+        ~MatrixWriter();
+        cv::Mat block(int begin, int count); // Rows [begin, begin+count)
+
+    private:
+        QFile file;
+        qint64 dataOffset;
+        uchar *mapped;
+        cv::Mat buffer; // Used when the file can't be mapped, or the pending rows of a run-length mask
+        bool mask, runLength, compress;
+        int next, bits;
+        QScopedPointer<QTemporaryFile> staging; // Scores of a quantized or compressed simmat before they are encoded
+
+        void writeRuns();
+        void writeGroups();
+    };
 
     // Write BEE files
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method);
+
+    // Fragments of a comparison restricted to block ranges record their place in their sigset names
+    QString fragmentSigset(const QString &sigset, int begin, int end, int total);
+    void mergeMatrices(const QStringList &fragments, const QString &simmat);
 }
 
 #endif // __BEE_H
@@ -0,0 +1,172 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDir>
+#include <QMutex>
+#include <algorithm>
+
+#include "budget.h"
+
+using namespace br;
+
+/* MemoryLedger - public methods */
+bool MemoryLedger::reserve(qint64 bytes, MemoryLedger **ledger, int *kilobytes)
+{
+    *ledger = NULL;
+    *kilobytes = 0;
+    Context *context = Globals;
+    if ((context == NULL) || (context->memoryLimit <= 0)) return true;
+
+    const int budget = context->memoryLimit * 1024;
+    const int charge = int((bytes + 1023) / 1024);
+    MemoryLedger *charged = context->memoryLedger;
+    int current;
+    do {
+        current = charged->kilobytes.load();
+        if (current + qint64(charge) > budget) return false;
+    } while (!charged->kilobytes.testAndSetOrdered(current, current + charge));
+
+    charged->refs.ref();
+    *ledger = charged;
+    *kilobytes = charge;
+    return true;
+}
+
+void MemoryLedger::release(MemoryLedger *ledger, int kilobytes)
+{
+    if (ledger == NULL) return;
+    ledger->kilobytes.fetchAndAddOrdered(-kilobytes);
+    if (!ledger->refs.deref()) delete ledger;
+}
+
+/* SpillData - public methods */
+SpillData::SpillData(size_t size_)
+    : data(NULL), size(size_), file(QDir::tempPath() + "/openbr_spill_XXXXXX")
+{
+    if (!file.open() || !file.resize(qint64(std::max(size, size_t(1)))))
+        qFatal("Failed to create a %s byte spill file in %s.", qPrintable(QString::number(size)), qPrintable(QDir::tempPath()));
+    data = file.map(0, qint64(std::max(size, size_t(1))));
+    if (data == NULL) qFatal("Failed to map spill file %s.", qPrintable(file.fileName()));
+}
+
+SpillData::~SpillData()
+{
+    file.unmap(data);
+}
+
+/* MatBudget */
+namespace
+{
+
+enum { Spill_Chunk = 256 << 20, // Bytes per shared spill file
+       Header = 32 }; // Keeps the data 16 byte aligned
+
+// A spill file shared by the buffers carved from it, deleted once it is full and they are all released
+struct SpillChunk
+{
+    SpillData storage;
+    size_t used;
+    int live;
+    bool retired;
+    explicit SpillChunk(size_t size) : storage(size), used(0), live(0), retired(false) {}
+};
+
+// Precedes the data of every buffer, the reference count must come first
+struct Block
+{
+    int refcount;
+    int kilobytes;
+    MemoryLedger *ledger; // Of a buffer in memory
+    SpillChunk *chunk; // Of a spilled buffer
+};
+
+MatBudget budget;
+SpillChunk *currentChunk = NULL;
+QMutex spillLock;
+
+} // namespace
+
+void MatBudget::hold(cv::Mat &m)
+{
+    if ((Globals == NULL) || (Globals->memoryLimit <= 0) || (m.data == NULL) || (m.refcount == NULL) || (m.allocator == &budget)) return;
+    cv::Mat held;
+    held.allocator = &budget;
+    m.copyTo(held);
+    m = held;
+}
+
+void MatBudget::hold(Template &t)
+{
+    for (int i=0; i<t.size(); i++)
+        hold(t[i]);
+}
+
+cv::MatAllocator *MatBudget::allocator()
+{
+    return ((Globals == NULL) || (Globals->memoryLimit <= 0)) ? NULL : &budget;
+}
+
+void MatBudget::allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+{
+    size_t bytes = CV_ELEM_SIZE(type);
+    for (int i=dims-1; i>=0; i--) {
+        step[i] = bytes;
+        bytes *= sizes[i];
+    }
+
+    Block *block;
+    MemoryLedger *ledger;
+    int kilobytes;
+    if (MemoryLedger::reserve(qint64(Header + bytes), &ledger, &kilobytes)) {
+        block = (Block*)cv::fastMalloc(Header + bytes);
+        block->chunk = NULL;
+    } else {
+        const size_t needed = (Header + bytes + 15) / 16 * 16;
+        QMutexLocker locker(&spillLock);
+        if ((currentChunk == NULL) || (currentChunk->used + needed > currentChunk->storage.size)) {
+            if (currentChunk != NULL) {
+                currentChunk->retired = true;
+                if (currentChunk->live == 0) delete currentChunk;
+            }
+            currentChunk = new SpillChunk(std::max(needed, size_t(Spill_Chunk)));
+        }
+        block = (Block*)(currentChunk->storage.data + currentChunk->used);
+        currentChunk->used += needed;
+        currentChunk->live++;
+        block->chunk = currentChunk;
+    }
+
+    block->refcount = 1;
+    block->kilobytes = kilobytes;
+    block->ledger = ledger;
+    refcount = &block->refcount;
+    datastart = data = (uchar*)block + Header;
+}
+
+void MatBudget::deallocate(int *refcount, uchar *datastart, uchar *data)
+{
+    (void) datastart; (void) data;
+    Block *block = (Block*)refcount;
+    if (block->chunk == NULL) {
+        MemoryLedger::release(block->ledger, block->kilobytes);
+        cv::fastFree(block);
+        return;
+    }
+
+    QMutexLocker locker(&spillLock);
+    SpillChunk *chunk = block->chunk;
+    if ((--chunk->live == 0) && chunk->retired) delete chunk;
+}
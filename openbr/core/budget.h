@@ -0,0 +1,92 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __BUDGET_H
+#define __BUDGET_H
+
+#include <QAtomicInt>
+#include <QTemporaryFile>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief The bytes of br::Context::memoryLimit held by one context, counted in kilobytes.
+ *
+ * Each context owns a ledger, and every allocation charged to it keeps a reference
+ * so its bytes can be given back after the context is gone.
+ */
+struct MemoryLedger
+{
+    QAtomicInt refs, kilobytes;
+    MemoryLedger() : refs(1), kilobytes(0) {}
+
+    /*!
+     * \brief Charges \em bytes to the calling thread's context, returns \c false without charging them if they don't fit its budget.
+     *
+     * On success \em ledger is the charged ledger, or \c NULL if the context has no budget, pass it and \em kilobytes to release().
+     */
+    static bool reserve(qint64 bytes, MemoryLedger **ledger, int *kilobytes);
+    static void release(MemoryLedger *ledger, int kilobytes); /*!< \brief Gives back a reservation, \em ledger may be \c NULL. */
+};
+
+/*!
+ * \brief Disk-backed memory for data that doesn't fit br::Context::memoryLimit.
+ *
+ * The pages are a shared mapping of a temporary file, which the kernel writes back and drops under memory pressure
+ * rather than the process growing until it is killed.
+ */
+class SpillData
+{
+public:
+    uchar *data;
+    size_t size;
+
+    explicit SpillData(size_t size);
+    ~SpillData();
+
+private:
+    QTemporaryFile file;
+    Q_DISABLE_COPY(SpillData)
+};
+
+/*!
+ * \brief Matrix allocator that charges its buffers to br::Context::memoryLimit, placing them in br::SpillData once the limit is reached.
+ *
+ * Spilled buffers are carved from shared spill files, each removed once its last buffer is released.
+ * Deserialized matrices are allocated by it directly, see allocator().
+ */
+class MatBudget : public cv::MatAllocator
+{
+public:
+    /*!
+     * \brief Moves the data of \em m under the budget, if the calling thread's context has one and \em m owns its data.
+     *
+     * Views of mapped files and other external data are left alone, they are already backed by disk.
+     */
+    static void hold(cv::Mat &m);
+    static void hold(Template &t); /*!< \brief Holds each matrix of \em t. */
+    static cv::MatAllocator *allocator(); /*!< \brief The allocator for matrices read by the calling thread, \c NULL if its context has no limit. */
+
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step);
+    void deallocate(int *refcount, uchar *datastart, uchar *data);
+};
+
+} // namespace br
+
+#endif // __BUDGET_H
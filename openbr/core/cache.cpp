@@ -0,0 +1,195 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QMutexLocker>
+#include <openbr/openbr_plugin.h>
+#include <algorithm>
+#include <climits>
+
+#include "cache.h"
+#include "codec.h"
+#include "qtutils.h"
+
+using namespace br;
+
+/*!
+ * \ingroup initializers
+ * \brief Closes the template caches opened by br::CacheTransform.
+ * \author Josh Klontz \cite jklontz
+ */
+class TemplateCacheManager : public Initializer
+{
+    Q_OBJECT
+
+public:
+    static QHash<QString, QSharedPointer<TemplateCache> > caches;
+    static QMutex cachesLock;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        caches.clear();
+    }
+};
+
+QHash<QString, QSharedPointer<TemplateCache> > TemplateCacheManager::caches;
+QMutex TemplateCacheManager::cachesLock;
+
+BR_REGISTER(Initializer, TemplateCacheManager)
+
+/* TemplateCache - public methods */
+QSharedPointer<TemplateCache> TemplateCache::fromFile(const QString &log, int capacity)
+{
+    QMutexLocker locker(&TemplateCacheManager::cachesLock);
+    QSharedPointer<TemplateCache> &cache = TemplateCacheManager::caches[log];
+    if (cache.isNull()) cache = QSharedPointer<TemplateCache>(new TemplateCache(log, capacity));
+    return cache;
+}
+
+QByteArray TemplateCache::key(const File &file, const QString &description)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(file.name.toUtf8());
+    hash.addData("\n", 1);
+    hash.addData(description.toUtf8());
+    return hash.result();
+}
+
+QByteArray TemplateCache::contentKey(const Template &t, const QString &description)
+{
+    const File &file = t.file;
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    // Templates that already hold data, such as expanded detections or images enrolled from memory, may share a file
+    bool hasData = false;
+    foreach (const cv::Mat &m, t) {
+        if (m.data == NULL) continue;
+        hasData = true;
+        const int header[4] = { m.type(), m.rows, m.cols, m.dims };
+        hash.addData((const char*) header, sizeof(header));
+        const cv::Mat continuous = (m.isContinuous() || (m.dims > 2)) ? m : m.clone();
+        hash.addData((const char*) continuous.data, int(continuous.total() * continuous.elemSize()));
+    }
+
+    if (!hasData) {
+        QFile content(file.resolved());
+        if (!content.open(QFile::ReadOnly)) return QByteArray();
+        while (!content.atEnd())
+            hash.addData(content.read(1 << 20));
+        content.close();
+    }
+    hash.addData("\n", 1);
+    hash.addData(file.flat().toUtf8());
+    hash.addData("\n", 1);
+    hash.addData(description.toUtf8());
+    return hash.result();
+}
+
+bool TemplateCache::find(const QByteArray &key, Template &t)
+{
+    {
+        Shard &s = shard(key);
+        QMutexLocker locker(&s.lock);
+        const Template *cached = s.templates.object(key);
+        if (cached) {
+            t = *cached;
+            return true;
+        }
+    }
+
+    QByteArray data;
+    {
+        QMutexLocker locker(&fileLock);
+        if (!offsets.contains(key)) return false;
+        file.seek(offsets[key]);
+        QDataStream stream(&file);
+        QByteArray storedKey;
+        stream >> storedKey >> data;
+        if ((stream.status() != QDataStream::Ok) || (storedKey != key))
+            qFatal("Corrupt cache entry in %s.", qPrintable(file.fileName()));
+    }
+
+    t = TemplateCodec::decode(data);
+    remember(key, t);
+    return true;
+}
+
+void TemplateCache::insert(const QByteArray &key, const Template &t)
+{
+    const QByteArray data = TemplateCodec::encode(t);
+
+    {
+        QMutexLocker locker(&fileLock);
+        if (offsets.contains(key)) return;
+        const qint64 offset = file.size();
+        file.seek(offset);
+        QDataStream log(&file);
+        log << key << data;
+        file.flush();
+        offsets.insert(key, offset);
+    }
+
+    remember(key, t);
+}
+
+/* TemplateCache - private methods */
+TemplateCache::TemplateCache(const QString &log, int capacity)
+{
+    for (int i=0; i<Shards; i++)
+        shards[i].templates.setMaxCost(std::max(1, capacity * 1024 * 1024 / Shards));
+
+    file.setFileName(log);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::ReadWrite))
+        qFatal("Unable to open %s for reading and writing.", qPrintable(log));
+
+    // Index the log without reading the templates
+    QDataStream stream(&file);
+    qint64 offset = 0;
+    while (!stream.atEnd()) {
+        QByteArray key;
+        quint32 length;
+        stream >> key >> length;
+        if ((stream.status() != QDataStream::Ok) ||
+            (length == 0xFFFFFFFF) ||
+            (stream.skipRawData(length) != int(length)))
+            break;
+        offsets.insert(key, offset);
+        offset = file.pos();
+    }
+
+    if (offset != file.size()) {
+        qWarning("Discarding incomplete entry at the end of %s.", qPrintable(log));
+        file.resize(offset);
+    }
+}
+
+TemplateCache::Shard &TemplateCache::shard(const QByteArray &key)
+{
+    return shards[qHash(key) % Shards];
+}
+
+void TemplateCache::remember(const QByteArray &key, const Template &t)
+{
+    Shard &s = shard(key);
+    QMutexLocker locker(&s.lock);
+    s.templates.insert(key, new Template(t), int(std::min(std::max(t.bytes(), size_t(1)), size_t(INT_MAX))));
+}
+
+#include "cache.moc"
@@ -0,0 +1,68 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Persistent, concurrent cache of projected templates.
+ *
+ * Entries are encoded with br::TemplateCodec and appended to a log on disk, only the offsets of the entries are read when the log is opened.
+ * Recently used entries are kept in memory, split across shards with their own locks and bounded by \em capacity megabytes.
+ * A log truncated by a crash is recovered up to its last complete entry.
+ */
+class TemplateCache
+{
+public:
+    static QSharedPointer<TemplateCache> fromFile(const QString &log, int capacity); /*!< \brief Returns the shared cache stored at \em log. */
+    static QByteArray key(const File &file, const QString &description); /*!< \brief Hash identifying \em file projected by \em description. */
+    static QByteArray contentKey(const Template &t, const QString &description); /*!< \brief Like key() but hashes the matrices of \em t, or the contents of its file if it has none, and its metadata instead of its name. Empty if \em t has neither, so it shouldn't be cached. */
+
+    bool find(const QByteArray &key, Template &t); /*!< \brief Sets \em t and returns \c true if \em key is cached. */
+    void insert(const QByteArray &key, const Template &t); /*!< \brief Caches \em t unless \em key is already cached. */
+
+private:
+    enum { Shards = 16 };
+    struct Shard
+    {
+        QMutex lock;
+        QCache<QByteArray, Template> templates;
+    } shards[Shards];
+
+    QFile file;
+    QHash<QByteArray, qint64> offsets; // Position of each entry in the log
+    QMutex fileLock;
+
+    TemplateCache(const QString &log, int capacity);
+    Shard &shard(const QByteArray &key);
+    void remember(const QByteArray &key, const Template &t);
+};
+
+} // namespace br
+
+#endif // __CACHE_H
@@ -15,12 +15,18 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QDebug>
+#include <QFile>
 #include <QHash>
+#include <QScopedPointer>
+#include <algorithm>
 #include <openbr/openbr_plugin.h>
 
 #include "classify.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
+using namespace br;
+
 // Helper struct for statistics accumulation
 struct Counter
 {
@@ -33,26 +39,128 @@ struct Counter
     }
 };
 
-void br::EvalClassification(const QString &predictedInput, const QString &truthInput)
+// Files of one gallery a block at a time, or all at once when its options need the whole gallery
+class FileReader
 {
-    qDebug("Evaluating classification of %s against %s", qPrintable(predictedInput), qPrintable(truthInput));
+    QScopedPointer<Gallery> gallery;
+    FileList all;
+    bool done;
 
-    TemplateList predicted(TemplateList::fromGallery(predictedInput));
-    TemplateList truth(TemplateList::fromGallery(truthInput));
-    if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
+public:
+    FileReader(const File &file)
+        : done(false)
+    {
+        if ((file.split().size() == 1) && file.localMetadata().isEmpty()) gallery.reset(Gallery::make(file));
+        else                                                              all = FileList::fromGallery(file);
+    }
 
-    QHash<int, Counter> counters;
-    for (int i=0; i<predicted.size(); i++) {
-        if (predicted[i].file.name != truth[i].file.name)
+    FileList read()
+    {
+        if (done) return FileList();
+        if (gallery.isNull()) {
+            done = true;
+            return all;
+        }
+        return gallery->readBlock(&done).files();
+    }
+
+    bool finished() const { return done; }
+};
+
+// Reads two galleries in lockstep, returning equal length runs of corresponding files
+class PairedReader
+{
+    FileReader a, b;
+    FileList pendingA, pendingB;
+
+    static void fill(FileReader &reader, FileList &pending)
+    {
+        while (pending.isEmpty() && !reader.finished())
+            pending = reader.read();
+    }
+
+    static FileList take(FileList &pending, int n)
+    {
+        const FileList taken = pending.mid(0, n);
+        pending = pending.mid(n);
+        return taken;
+    }
+
+public:
+    qint64 count;
+
+    PairedReader(const File &a, const File &b)
+        : a(a), b(b), count(0) {}
+
+    bool read(FileList &first, FileList &second)
+    {
+        fill(a, pendingA);
+        fill(b, pendingB);
+        if (pendingA.isEmpty() != pendingB.isEmpty()) qFatal("Input size mismatch.");
+        if (pendingA.isEmpty()) return false;
+
+        const int n = std::min(pendingA.size(), pendingB.size());
+        first = take(pendingA, n);
+        second = take(pendingB, n);
+        count += n;
+        return true;
+    }
+};
+
+static void countLabels(const FileList *predicted, const FileList *truth, int begin, int end, QHash<int, Counter> *counters)
+{
+    for (int i=begin; i<end; i++) {
+        if ((*predicted)[i].name != (*truth)[i].name)
             qFatal("Input order mismatch.");
 
-        const int trueLabel = truth[i].file.label();
-        const int predictedLabel = predicted[i].file.label();
+        const int trueLabel = (*truth)[i].label();
+        const int predictedLabel = (*predicted)[i].label();
         if (trueLabel == predictedLabel) {
-            counters[trueLabel].truePositive++;
+            (*counters)[trueLabel].truePositive++;
         } else {
-            counters[trueLabel].falseNegative++;
-            counters[predictedLabel].falsePositive++;
+            (*counters)[trueLabel].falseNegative++;
+            (*counters)[predictedLabel].falsePositive++;
+        }
+    }
+}
+
+// Runs of a block one task per thread
+static QList< QPair<int,int> > partition(int size)
+{
+    QList< QPair<int,int> > ranges;
+    const int threads = std::max(1, abs(Globals->parallelism));
+    const int step = std::max(1, (size + threads - 1) / threads);
+    for (int begin=0; begin<size; begin+=step)
+        ranges.append(QPair<int,int>(begin, std::min(size, begin+step)));
+    return ranges;
+}
+
+void br::EvalClassification(const QString &predictedInput, const QString &truthInput)
+{
+    qDebug("Evaluating classification of %s against %s", qPrintable(predictedInput), qPrintable(truthInput));
+
+    // Each task counts its run of a block separately and the counts are summed, which is exact
+    QHash<int, Counter> counters;
+    PairedReader reader(predictedInput, truthInput);
+    FileList predicted, truth;
+    while (reader.read(predicted, truth)) {
+        const QList< QPair<int,int> > ranges = partition(predicted.size());
+        QVector< QHash<int, Counter> > partial(ranges.size());
+
+        TaskGroup tasks;
+        for (int t=0; t<ranges.size(); t++) {
+            if (Globals->parallelism) tasks.run(&countLabels, &predicted, &truth, ranges[t].first, ranges[t].second, &partial[t]);
+            else                      countLabels(&predicted, &truth, ranges[t].first, ranges[t].second, &partial[t]);
+        }
+        tasks.wait();
+
+        foreach (const QHash<int, Counter> &counts, partial) {
+            for (QHash<int, Counter>::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+                Counter &counter = counters[it.key()];
+                counter.truePositive += it.value().truePositive;
+                counter.falsePositive += it.value().falsePositive;
+                counter.falseNegative += it.value().falseNegative;
+            }
         }
     }
 
@@ -60,8 +168,9 @@ void br::EvalClassification(const QString &predictedInput, const QString &truthI
 
     int tpc = 0;
     int fnc = 0;
-    for (int i=0; i<counters.size(); i++) {
-        int trueLabel = counters.keys()[i];
+    const QList<int> labels = counters.keys();
+    for (int i=0; i<labels.size(); i++) {
+        int trueLabel = labels[i];
         const Counter &counter = counters[trueLabel];
         tpc += counter.truePositive;
         fnc += counter.falseNegative;
@@ -79,29 +188,60 @@ void br::EvalClassification(const QString &predictedInput, const QString &truthI
     qDebug("Overall Accuracy = %f", (float)tpc / (float)(tpc + fnc));
 }
 
+// Squared error and the "Actual,Predicted" rows of a run of files
+struct RegressionBlock
+{
+    double squaredError;
+    QByteArray rows;
+    RegressionBlock() : squaredError(0) {}
+};
+
+static void accumulateErrors(const FileList *predicted, const FileList *truth, int begin, int end, RegressionBlock *block)
+{
+    for (int i=begin; i<end; i++) {
+        if ((*predicted)[i].name != (*truth)[i].name)
+            qFatal("Input order mismatch.");
+        const float actual = (*truth)[i].label();
+        const float prediction = (*predicted)[i].label();
+        block->squaredError += pow(double(prediction)-actual, 2.0);
+        block->rows += QByteArray::number(actual) + ',' + QByteArray::number(prediction) + '\n';
+    }
+}
+
 void br::EvalRegression(const QString &predictedInput, const QString &truthInput)
 {
     qDebug("Evaluating regression of %s against %s", qPrintable(predictedInput), qPrintable(truthInput));
 
-    const TemplateList predicted(TemplateList::fromGallery(predictedInput));
-    const TemplateList truth(TemplateList::fromGallery(truthInput));
-    if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
+    // Values are streamed to a data file for the R script rather than held in memory
+    const QString dataFile = "EvalRegression.csv";
+    QFile data(dataFile);
+    if (!data.open(QFile::WriteOnly | QFile::Text)) qFatal("Failed to open %s for writing.", qPrintable(dataFile));
+    data.write("Actual,Predicted\n");
 
-    float rmsError = 0;
-    QStringList truthValues, predictedValues;
-    for (int i=0; i<predicted.size(); i++) {
-        if (predicted[i].file.name != truth[i].file.name)
-            qFatal("Input order mismatch.");
-        rmsError += pow(predicted[i].file.label()-truth[i].file.label(), 2.f);
-        truthValues.append(QString::number(truth[i].file.label()));
-        predictedValues.append(QString::number(predicted[i].file.label()));
+    double squaredError = 0;
+    PairedReader reader(predictedInput, truthInput);
+    FileList predicted, truth;
+    while (reader.read(predicted, truth)) {
+        const QList< QPair<int,int> > ranges = partition(predicted.size());
+        QVector<RegressionBlock> blocks(ranges.size());
+
+        TaskGroup tasks;
+        for (int t=0; t<ranges.size(); t++) {
+            if (Globals->parallelism) tasks.run(&accumulateErrors, &predicted, &truth, ranges[t].first, ranges[t].second, &blocks[t]);
+            else                      accumulateErrors(&predicted, &truth, ranges[t].first, ranges[t].second, &blocks[t]);
+        }
+        tasks.wait();
+
+        foreach (const RegressionBlock &block, blocks) {
+            squaredError += block.squaredError;
+            data.write(block.rows);
+        }
     }
+    data.close();
 
     QStringList rSource;
     rSource << "# Load libraries" << "library(ggplot2)" << "" << "# Set Data"
-            << "Actual <- c(" + truthValues.join(",") + ")"
-            << "Predicted <- c(" + predictedValues.join(",") + ")"
-            << "data <- data.frame(Actual, Predicted)"
+            << "data <- read.csv(\"" + dataFile + "\")"
             << "" << "# Construct Plot" << "pdf(\"EvalRegression.pdf\")"
             << "print(qplot(Actual, Predicted, data=data, geom=\"jitter\", alpha=I(2/3)) + geom_abline(intercept=0, slope=1, color=\"forestgreen\", size=I(1)) + geom_smooth(size=I(1), color=\"mediumblue\") + theme_bw())"
             << "print(qplot(Actual, Predicted-Actual, data=data, geom=\"jitter\", alpha=I(2/3)) + geom_abline(intercept=0, slope=0, color=\"forestgreen\", size=I(1)) + geom_smooth(size=I(1), color=\"mediumblue\") + theme_bw())"
@@ -113,5 +253,5 @@ void br::EvalRegression(const QString &predictedInput, const QString &truthInput
     bool success = QtUtils::runRScript(rFile);
     if (success) QtUtils::showFile("EvalRegression.pdf");
 
-    qDebug("RMS Error = %f", sqrt(rmsError/predicted.size()));
+    qDebug("RMS Error = %f", sqrt(squaredError/std::max(qint64(1), reader.count)));
 }
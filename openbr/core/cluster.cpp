@@ -14,16 +14,20 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QDataStream>
 #include <QDebug>
 #include <QFile>
+#include <QFileInfo>
 #include <QHash>
 #include <QPair>
 #include <QSet>
+#include <algorithm>
 #include <limits>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/bee.h"
 #include "openbr/core/cluster.h"
+#include "openbr/core/parallel.h"
 
 typedef QPair<int,float> Neighbor; // QPair<id,similarity>
 typedef QList<Neighbor> Neighbors;
@@ -82,6 +86,95 @@ float normalizedROD(const Neighborhood &neighborhood, int a, int b)
     return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
 }
 
+// Rows of a simmat block scanned by one task
+struct NeighborhoodBlock
+{
+    cv::Mat scores;
+    int row, column; // Neighborhood indices of the first row and the first column of the block
+    bool selfSimilar;
+    int cutoff; // Number of neighbors to keep
+    Neighbors *neighborhood;
+    float min, max;
+};
+
+// Keeps the best neighbors of each row in a heap whose top is the worst neighbor kept
+static void scanBlock(NeighborhoodBlock *block)
+{
+    const int cutoff = block->cutoff;
+    block->max = -std::numeric_limits<float>::max();
+    block->min = std::numeric_limits<float>::max();
+    for (int k=0; k<block->scores.rows; k++) {
+        Neighbors &neighbors = block->neighborhood[k];
+        const float *scores = block->scores.ptr<float>(k);
+        for (int l=0; l<block->scores.cols; l++) {
+            const float val = scores[l];
+            if (block->selfSimilar && (block->row+k == block->column+l)) continue; // Skips self-similarity scores
+
+            if ((val != -std::numeric_limits<float>::infinity()) &&
+                (val != std::numeric_limits<float>::infinity())) {
+                block->max = std::max(block->max, val);
+                block->min = std::min(block->min, val);
+            }
+
+            const Neighbor neighbor(l+block->column, val);
+            if (neighbors.size() < cutoff) {
+                neighbors.append(neighbor);
+                std::push_heap(neighbors.begin(), neighbors.end(), compareNeighbors);
+            } else if (compareNeighbors(neighbor, neighbors.first())) {
+                std::pop_heap(neighbors.begin(), neighbors.end(), compareNeighbors);
+                neighbors.last() = neighbor;
+                std::push_heap(neighbors.begin(), neighbors.end(), compareNeighbors);
+            }
+        }
+    }
+}
+
+// Splits the rows of scores into tasks that scan them into the neighborhood
+static void scanScores(const cv::Mat &scores, int row, int column, bool selfSimilar, int cutoff, Neighborhood &neighborhood, float &globalMin, float &globalMax)
+{
+    const int taskRows = std::max(1, scores.rows / (4*std::max(1, abs(br::Globals->parallelism))));
+    QVector<NeighborhoodBlock> blocks;
+    for (int k=0; k<scores.rows; k+=taskRows) {
+        NeighborhoodBlock block;
+        block.scores = scores.rowRange(k, std::min(scores.rows, k+taskRows));
+        block.row = row+k;
+        block.column = column;
+        block.selfSimilar = selfSimilar;
+        block.cutoff = cutoff;
+        block.neighborhood = neighborhood.data() + row+k;
+        blocks.append(block);
+    }
+
+    br::TaskGroup tasks;
+    for (int k=0; k<blocks.size(); k++)
+        if (br::Globals->parallelism) tasks.run(&scanBlock, &blocks[k]);
+        else                                    scanBlock(&blocks[k]);
+    tasks.wait();
+
+    foreach (const NeighborhoodBlock &block, blocks) {
+        globalMax = std::max(globalMax, block.max);
+        globalMin = std::min(globalMin, block.min);
+    }
+}
+
+// Orders the kept neighbors from highest to lowest similarity and normalizes their scores to [0,1]
+static void finishNeighborhood(Neighborhood &neighborhood, float globalMin, float globalMax)
+{
+    for (int i=0; i<neighborhood.size(); i++) {
+        Neighbors &neighbors = neighborhood[i];
+        std::sort_heap(neighbors.begin(), neighbors.end(), compareNeighbors);
+        for (int j=0; j<neighbors.size(); j++) {
+            Neighbor &neighbor = neighbors[j];
+            if (neighbor.second == -std::numeric_limits<float>::infinity())
+                neighbor.second = 0;
+            else if (neighbor.second == std::numeric_limits<float>::infinity())
+                neighbor.second = 1;
+            else
+                neighbor.second = (neighbor.second - globalMin) / (globalMax - globalMin);
+        }
+    }
+}
+
 Neighborhood getNeighborhood(const QStringList &simmats)
 {
     Neighborhood neighborhood;
@@ -92,74 +185,87 @@ Neighborhood getNeighborhood(const QStringList &simmats)
     if (numGalleries*numGalleries != simmats.size())
         qFatal("Incorrect number of similarity matrices.");
 
-    // Process each simmat
+    // Process each simmat a block of rows at a time, only the top neighbors of each row are kept
+    const int cutoff = 20; // Somewhat arbitrary number of neighbors to keep
     for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
-
+        const int rowOffset = neighborhood.size();
         int currentRows = -1;
         int columnOffset = 0;
         for (int j=0; j<numGalleries; j++) {
-            cv::Mat m = BEE::readSimmat(simmats[i*numGalleries+j]);
+            BEE::MatrixReader reader(simmats[i*numGalleries+j], false);
             if (j==0) {
-                currentRows = m.rows;
-                allNeighbors.resize(currentRows);
-            }
-            if (currentRows != m.rows) qFatal("Row count mismatch.");
-
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if ((val != -std::numeric_limits<float>::infinity()) &&
-                        (val != std::numeric_limits<float>::infinity())) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
-                }
+                currentRows = reader.rows;
+                neighborhood.resize(rowOffset + currentRows);
             }
+            if (currentRows != reader.rows) qFatal("Row count mismatch.");
 
-            columnOffset += m.cols;
-        }
+            const int blockRows = std::max(1, (1 << 24) / std::max(1, reader.columns));
+            int row = rowOffset;
+            for (cv::Mat m = reader.read(blockRows); !m.empty(); m = reader.read(blockRows)) {
+                scanScores(m, row, columnOffset, i == j, cutoff, neighborhood, globalMin, globalMax);
+                row += m.rows;
+            }
 
-        // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = 20; // Somewhat arbitrary number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
+            columnOffset += reader.columns;
         }
     }
 
-    // Normalize scores
-    for (int i=0; i<neighborhood.size(); i++) {
-        Neighbors &neighbors = neighborhood[i];
-        for (int j=0; j<neighbors.size(); j++) {
-            Neighbor &neighbor = neighbors[j];
-            if (neighbor.second == -std::numeric_limits<float>::infinity())
-                neighbor.second = 0;
-            else if (neighbor.second == std::numeric_limits<float>::infinity())
-                neighbor.second = 1;
-            else
-                neighbor.second = (neighbor.second - globalMin) / (globalMax - globalMin);
+    finishNeighborhood(neighborhood, globalMin, globalMax);
+    return neighborhood;
+}
+
+// Compares every pair of blocks, only the top k neighbors of each template are kept
+static Neighborhood getNeighborhood(const QList<br::TemplateList> &blocks, const br::Distance *distance, int k)
+{
+    int size = 0;
+    foreach (const br::TemplateList &block, blocks)
+        size += block.size();
+    Neighborhood neighborhood(size);
+
+    float globalMax = -std::numeric_limits<float>::max();
+    float globalMin = std::numeric_limits<float>::max();
+    br::Globals->currentStep = 0;
+    br::Globals->totalSteps = double(size) * double(size);
+    br::Globals->startTime.start();
+    int row = 0;
+    foreach (const br::TemplateList &queries, blocks) {
+        int column = 0;
+        foreach (const br::TemplateList &targets, blocks) {
+            QScopedPointer<br::MatrixOutput> scores(br::MatrixOutput::make(targets.files(), queries.files()));
+            scores->setBlock(0, 0);
+            distance->compare(targets, queries, scores.data());
+            scores->completeBlock();
+            scanScores(scores->data, row, column, true, k, neighborhood, globalMin, globalMax);
+            column += targets.size();
+
+            br::Globals->currentStep += double(targets.size()) * double(queries.size());
+            br::Globals->printStatus();
         }
+        row += queries.size();
     }
+    br::Globals->totalSteps = 0;
 
+    finishNeighborhood(neighborhood, globalMin, globalMax);
     return neighborhood;
 }
 
-// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
-br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv)
+// Evaluates the merge criterion of ClusterGallery for clusters [begin, end)
+static void flagSimilar(const Neighborhood *neighborhood, float threshold, int begin, int end, QVector< QVector<bool> > *similar)
 {
-    qDebug("Clustering %d simmat(s)", simmats.size());
+    for (int clusterID=begin; clusterID<end; clusterID++) {
+        const Neighbors &neighbors = (*neighborhood)[clusterID];
+        QVector<bool> &flags = (*similar)[clusterID];
+        flags.resize(neighbors.size());
+        for (int j=0; j<neighbors.size(); j++)
+            flags[j] = (normalizedROD(*neighborhood, clusterID, neighbors[j].first) < threshold);
+    }
+}
 
-    // Read in gallery parts, keeping top neighbors of each template
-    Neighborhood neighborhood = getNeighborhood(simmats);
+// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+static br::Clusters clusterNeighborhood(Neighborhood neighborhood, float aggressiveness, const QString &csv)
+{
+    using namespace br;
+    if (neighborhood.isEmpty()) qFatal("Nothing to cluster.");
     const int cutoff = neighborhood.first().size();
     const float threshold = 3*cutoff/4 * aggressiveness/5;
 
@@ -174,21 +280,30 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
         QVector<int> nextClusterIDs(neighborhood.size());
         for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
 
+        // The rank-order distances don't depend on the merge order, so they are computed in parallel up front
+        QVector< QVector<bool> > similar(neighborhood.size());
+        const int chunk = 1024;
+        TaskGroup tasks;
+        for (int i=0; i<neighborhood.size(); i+=chunk)
+            if (Globals->parallelism) tasks.run(&flagSimilar, &neighborhood, threshold, i, std::min(i+chunk, neighborhood.size()), &similar);
+            else                                flagSimilar(&neighborhood, threshold, i, std::min(i+chunk, neighborhood.size()), &similar);
+        tasks.wait();
+
         // For each cluster
         for (int clusterID=0; clusterID<neighborhood.size(); clusterID++) {
             const Neighbors &neighbors = neighborhood[clusterID];
             int nextClusterID = nextClusterIDs[clusterID];
 
             // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
+            for (int j=0; j<neighbors.size(); j++) {
+                int neighborID = neighbors[j].first;
                 int nextNeighborID = nextClusterIDs[neighborID];
 
                 // Don't bother if they have already merged
                 if (nextNeighborID == nextClusterID) continue;
 
                 // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
+                if (similar[clusterID][j]) {
                     if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
                     else                                nextClusterIDs[clusterID] = nextNeighborID;
                 }
@@ -242,34 +357,71 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
     return clusters;
 }
 
+br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv)
+{
+    qDebug("Clustering %d simmat(s)", simmats.size());
+
+    // Read in gallery parts, keeping top neighbors of each template
+    return clusterNeighborhood(getNeighborhood(simmats), aggressiveness, csv);
+}
+
+br::Clusters br::ClusterTemplates(const QList<TemplateList> &blocks, const Distance *distance, int k, float aggressiveness, const QString &csv)
+{
+    if (k < 1) qFatal("Clustering requires at least one neighbor.");
+    return clusterNeighborhood(getNeighborhood(blocks, distance, k), aggressiveness, csv);
+}
+
+// Number of unordered pairs among n items
+static qint64 pairs(qint64 n)
+{
+    return n*(n-1)/2;
+}
+
+// Pairs sharing both a cluster and an index, counted from the non-zero cells of their contingency table
+static qint64 agreeingPairs(const QHash<qint64, qint64> &cells)
+{
+    qint64 agreeing = 0;
+    foreach (qint64 count, cells)
+        agreeing += pairs(count);
+    return agreeing;
+}
+
+static qint64 cell(int cluster, int index)
+{
+    return (qint64(cluster) << 32) | quint32(index);
+}
+
 // Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
 // wI or wII metric (page 148)
 float wallaceMetric(const br::Clusters &clusters, const QVector<int> &indices)
 {
-    int matches = 0;
-    int total = 0;
-    foreach (const QList<int> &cluster, clusters) {
-        for (int i=0; i<cluster.size(); i++) {
-            for (int j=i+1; j<cluster.size(); j++) {
-                total++;
-                if (indices[cluster[i]] == indices[cluster[j]])
-                    matches++;
-            }
-        }
+    QHash<qint64, qint64> cells;
+    qint64 total = 0;
+    for (int i=0; i<clusters.size(); i++) {
+        foreach (int member, clusters[i])
+            cells[cell(i, indices[member])]++;
+        total += pairs(clusters[i].size());
     }
-    return (float)matches/(float)total;
+    return (float)agreeingPairs(cells)/(float)total;
 }
 
 // Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
 // Jaccard index (page 149)
 float jaccardIndex(const QVector<int> &indicesA, const QVector<int> &indicesB)
 {
-    int a[2][2] = {{0,0},{0,0}};
-    for (int i=0; i<indicesA.size()-1; i++)
-        for (int j=i+1; j<indicesA.size(); j++)
-            a[indicesA[i] == indicesA[j] ? 1 : 0][indicesB[i] == indicesB[j] ? 1 : 0]++;
+    QHash<qint64, qint64> cells;
+    QHash<int, qint64> sizesA, sizesB;
+    for (int i=0; i<indicesA.size(); i++) {
+        cells[cell(indicesA[i], indicesB[i])]++;
+        sizesA[indicesA[i]]++;
+        sizesB[indicesB[i]]++;
+    }
 
-    return float(a[1][1]) / (a[0][1] + a[1][0] + a[1][1]);
+    qint64 sameA = 0, sameB = 0;
+    foreach (qint64 size, sizesA) sameA += pairs(size);
+    foreach (qint64 size, sizesB) sameB += pairs(size);
+    const qint64 both = agreeingPairs(cells);
+    return float(both) / (sameA + sameB - both);
 }
 
 // Evaluates clustering algorithms based on metrics described in
@@ -278,7 +430,7 @@ void br::EvalClustering(const QString &csv, const QString &input)
 {
     qDebug("Evaluating %s against %s", qPrintable(csv), qPrintable(input));
 
-    QList<float> labels = TemplateList::fromGallery(input).files().labels();
+    QList<float> labels = FileList::fromGallery(input).labels();
 
     QHash<int, int> labelToIndex;
     int nClusters = 0;
@@ -317,24 +469,59 @@ void br::EvalClustering(const QString &csv, const QString &input)
     qDebug("Recall: %f  Precision: %f  F-score: %f  Jaccard index: %f", wI, wII, sqrt(wI*wII), jaccard);
 }
 
+// Clusters are stored with QDataStream instead of as text when the file has a .bin suffix
+static bool isBinary(const QString &file)
+{
+    return QFileInfo(file).suffix() == "bin";
+}
+
 br::Clusters br::ReadClusters(const QString &csv)
 {
     Clusters clusters;
     QFile file(csv);
     bool success = file.open(QFile::ReadOnly);
     if (!success) qFatal("Failed to open %s for reading.", qPrintable(csv));
-    QStringList lines = QString(file.readAll()).split("\n");
+
+    if (isBinary(csv)) {
+        QDataStream stream(&file);
+        stream >> clusters;
+        file.close();
+        return clusters;
+    }
+
+    const QByteArray data = file.readAll();
     file.close();
 
-    foreach (const QString &line, lines) {
-        Cluster cluster;
-        QStringList ids = line.trimmed().split(",", QString::SkipEmptyParts);
-        foreach (const QString &id, ids) {
-            bool ok;
-            cluster.append(id.toInt(&ok));
-            if (!ok) qFatal("Non-interger id.");
+    // Ids are parsed in place, one cluster per line
+    Cluster cluster;
+    qint64 id = 0;
+    bool inId = false, negative = false;
+    for (int i=0; i<=data.size(); i++) {
+        const char c = (i < data.size()) ? data[i] : '\n';
+        if ((c >= '0') && (c <= '9')) {
+            id = 10*id + (c - '0');
+            inId = true;
+            continue;
+        }
+
+        if ((c == '-') && !inId && !negative) {
+            negative = true;
+            continue;
+        }
+        if (negative && !inId) qFatal("Non-interger id.");
+        if (inId) {
+            if (id > std::numeric_limits<int>::max()) qFatal("Non-interger id.");
+            cluster.append(negative ? -int(id) : int(id));
+            id = 0;
+            inId = negative = false;
+        }
+
+        if (c == '\n') {
+            clusters.append(cluster);
+            cluster.clear();
+        } else if ((c != ',') && (c != ' ') && (c != '\t') && (c != '\r')) {
+            qFatal("Non-interger id.");
         }
-        clusters.append(cluster);
     }
     return clusters;
 }
@@ -345,14 +532,32 @@ void br::WriteClusters(const Clusters &clusters, const QString &csv)
     bool success = file.open(QFile::WriteOnly);
     if (!success) qFatal("Failed to open %s for writing.", qPrintable(csv));
 
+    Clusters sorted; sorted.reserve(clusters.size());
     foreach (Cluster cluster, clusters) {
         if (cluster.empty()) continue;
-
         qSort(cluster);
-        QStringList ids;
-        foreach (int id, cluster)
-            ids.append(QString::number(id));
-        file.write(qPrintable(ids.join(",")+"\n"));
+        sorted.append(cluster);
+    }
+
+    if (isBinary(csv)) {
+        QDataStream stream(&file);
+        stream << sorted;
+        file.close();
+        return;
+    }
+
+    QByteArray text;
+    foreach (const Cluster &cluster, sorted) {
+        for (int i=0; i<cluster.size(); i++) {
+            if (i > 0) text.append(',');
+            text.append(QByteArray::number(cluster[i]));
+        }
+        text.append('\n');
+        if (text.size() > (1 << 20)) {
+            file.write(text);
+            text.clear();
+        }
     }
+    file.write(text);
     file.close();
 }
@@ -21,6 +21,7 @@
 #include <QString>
 #include <QStringList>
 #include <QVector>
+#include <openbr/openbr_plugin.h>
 
 namespace br
 {
@@ -28,6 +29,7 @@ namespace br
     typedef QVector<Cluster> Clusters;
 
     Clusters ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv);
+    Clusters ClusterTemplates(const QList<TemplateList> &blocks, const Distance *distance, int k, float aggressiveness, const QString &csv); // Indices follow the blocks in order
     void EvalClustering(const QString &csv, const QString &input);
 
     Clusters ReadClusters(const QString &csv);
@@ -0,0 +1,320 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QPointF>
+#include <QRectF>
+#include <opencv2/core/core.hpp>
+
+#include "budget.h"
+#include "codec.h"
+#include "opencvutils.h"
+
+using namespace br;
+using namespace cv;
+
+namespace
+{
+
+enum Tag { Null, Bool, Int, Float, Double, String, Points, Rects, Generic };
+
+// Returns true if every element of list has the given type
+bool homogeneous(const QList<QVariant> &list, QVariant::Type type)
+{
+    foreach (const QVariant &element, list)
+        if (element.type() != type) return false;
+    return true;
+}
+
+} // namespace
+
+/* TemplateCodec - public methods */
+TemplateCodec::TemplateCodec(int flags)
+    : flags(flags)
+{
+    reset();
+}
+
+void TemplateCodec::reset()
+{
+    headerWritten = compact = compressed = false;
+    keys.clear();
+    ids.clear();
+}
+
+void TemplateCodec::write(QDataStream &stream, const Template &t)
+{
+    if (!headerWritten) {
+        stream << quint32(Magic) << quint16(Version) << quint16(flags);
+        keys.clear();
+        ids.clear();
+        headerWritten = true;
+    }
+
+    if (flags & Compressed) {
+        QByteArray data;
+        QDataStream record(&data, QIODevice::WriteOnly);
+        writeTemplate(record, t);
+        stream << qCompress(data);
+    } else {
+        writeTemplate(stream, t);
+    }
+}
+
+bool TemplateCodec::read(QDataStream &stream, Template &t)
+{
+    t = Template();
+    return readFile(stream, t.file, &t);
+}
+
+bool TemplateCodec::readFile(QDataStream &stream, File &file)
+{
+    return readFile(stream, file, NULL);
+}
+
+QByteArray TemplateCodec::encode(const Template &t, int flags)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    TemplateCodec codec(flags);
+    codec.write(stream, t);
+    return data;
+}
+
+Template TemplateCodec::decode(const QByteArray &data)
+{
+    QDataStream stream(data);
+    TemplateCodec codec;
+    Template t;
+    if (!codec.read(stream, t)) qFatal("Empty template encoding.");
+    return t;
+}
+
+bool TemplateCodec::startsSegment(const QByteArray &data)
+{
+    QDataStream stream(data);
+    quint32 word;
+    stream >> word;
+    return (stream.status() == QDataStream::Ok) && (word == Magic);
+}
+
+/* TemplateCodec - private methods */
+bool TemplateCodec::readFile(QDataStream &stream, File &file, Template *t)
+{
+    while (!stream.atEnd()) {
+        quint32 word;
+        stream >> word;
+
+        if (word == Magic) {
+            quint16 version, segmentFlags;
+            stream >> version >> segmentFlags;
+            if (version > Version) qFatal("Unsupported template encoding version %d.", int(version));
+            compact = true;
+            compressed = (segmentFlags & Compressed);
+            keys.clear();
+            ids.clear();
+            continue;
+        }
+
+        if (!compact) {
+            // Legacy encoding, see operator<<(QDataStream&, const Template&)
+            for (quint32 i=0; i<word; i++) {
+                Mat m;
+                stream >> m;
+                if (t) t->append(m);
+            }
+            stream >> file;
+        } else if (compressed) {
+            QByteArray data(word, Qt::Uninitialized);
+            if (stream.readRawData(data.data(), word) != int(word)) qFatal("Corrupt template encoding.");
+            QDataStream record(qUncompress(data));
+            quint32 matrices;
+            record >> matrices;
+            readTemplate(record, matrices, t, file);
+        } else {
+            readTemplate(stream, word, t, file);
+        }
+
+        if (stream.status() != QDataStream::Ok) qFatal("Corrupt template encoding.");
+        return true;
+    }
+    return false;
+}
+
+void TemplateCodec::writeTemplate(QDataStream &stream, const Template &t)
+{
+    stream << quint32(t.size());
+    foreach (const Mat &matrix, t) {
+        const Mat m = matrix.isContinuous() ? matrix : matrix.clone();
+        stream << qint32(m.rows) << qint32(m.cols) << qint32(m.type());
+        const int len = m.rows*m.cols*m.elemSize();
+        if ((len > 0) && (stream.writeRawData((const char*)m.data, len) != len))
+            qFatal("Serialization failure.");
+    }
+
+    const QMap<QString,QVariant> metadata = t.file.localMetadata();
+    stream << t.file.name << quint32(metadata.size());
+    QMapIterator<QString,QVariant> i(metadata);
+    while (i.hasNext()) {
+        i.next();
+        if (ids.contains(i.key())) {
+            stream << quint32(ids.value(i.key()));
+        } else {
+            stream << quint32(keys.size()) << i.key();
+            ids.insert(i.key(), keys.size());
+            keys.append(i.key());
+        }
+        writeValue(stream, i.value());
+    }
+}
+
+void TemplateCodec::readTemplate(QDataStream &stream, quint32 matrices, Template *t, File &file)
+{
+    for (quint32 i=0; i<matrices; i++) {
+        qint32 rows, cols, type;
+        stream >> rows >> cols >> type;
+        const int len = rows*cols*CV_ELEM_SIZE(type);
+        if (t) {
+            Mat m;
+            m.allocator = MatBudget::allocator();
+            m.create(rows, cols, type);
+            if ((len > 0) && (stream.readRawData((char*)m.data, len) != len))
+                qFatal("Corrupt template encoding.");
+            t->append(m);
+        } else if ((len > 0) && (stream.skipRawData(len) != len)) {
+            qFatal("Corrupt template encoding.");
+        }
+    }
+
+    quint32 size;
+    file = File();
+    stream >> file.name >> size;
+    for (quint32 i=0; i<size; i++) {
+        quint32 id;
+        stream >> id;
+        if (id == quint32(keys.size())) {
+            QString key;
+            stream >> key;
+            ids.insert(key, keys.size());
+            keys.append(key);
+        } else if (id > quint32(keys.size())) {
+            qFatal("Corrupt template encoding.");
+        }
+        file.set(keys[id], readValue(stream));
+    }
+}
+
+void TemplateCodec::writeValue(QDataStream &stream, const QVariant &value) const
+{
+    switch (value.userType()) {
+      case QMetaType::UnknownType:
+        stream << quint8(Null);
+        return;
+      case QMetaType::Bool:
+        stream << quint8(Bool) << value.toBool();
+        return;
+      case QMetaType::Int:
+        stream << quint8(Int) << qint32(value.toInt());
+        return;
+      case QMetaType::Float:
+        stream << quint8(Float) << value.toFloat();
+        return;
+      case QMetaType::Double:
+        stream << quint8(Double) << value.toDouble();
+        return;
+      case QMetaType::QString:
+        stream << quint8(String) << value.toString();
+        return;
+      case QMetaType::QVariantList: {
+        const QList<QVariant> list = value.toList();
+        if (homogeneous(list, QVariant::PointF)) {
+            stream << quint8(Points) << quint32(list.size());
+            foreach (const QVariant &element, list) {
+                const QPointF point = element.toPointF();
+                stream << point.x() << point.y();
+            }
+            return;
+        }
+        if (homogeneous(list, QVariant::RectF)) {
+            stream << quint8(Rects) << quint32(list.size());
+            foreach (const QVariant &element, list) {
+                const QRectF rect = element.toRectF();
+                stream << rect.x() << rect.y() << rect.width() << rect.height();
+            }
+            return;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+
+    stream << quint8(Generic) << value;
+}
+
+QVariant TemplateCodec::readValue(QDataStream &stream) const
+{
+    quint8 tag;
+    stream >> tag;
+    switch (tag) {
+      case Null:
+        return QVariant();
+      case Bool: {
+        bool value; stream >> value;
+        return value;
+      }
+      case Int: {
+        qint32 value; stream >> value;
+        return int(value);
+      }
+      case Float: {
+        float value; stream >> value;
+        return value;
+      }
+      case Double: {
+        double value; stream >> value;
+        return value;
+      }
+      case String: {
+        QString value; stream >> value;
+        return value;
+      }
+      case Points: {
+        quint32 size; stream >> size;
+        QList<QVariant> points; points.reserve(size);
+        for (quint32 i=0; i<size; i++) {
+            double x, y; stream >> x >> y;
+            points.append(QPointF(x, y));
+        }
+        return points;
+      }
+      case Rects: {
+        quint32 size; stream >> size;
+        QList<QVariant> rects; rects.reserve(size);
+        for (quint32 i=0; i<size; i++) {
+            double x, y, width, height; stream >> x >> y >> width >> height;
+            rects.append(QRectF(x, y, width, height));
+        }
+        return rects;
+      }
+      case Generic: {
+        QVariant value; stream >> value;
+        return value;
+      }
+      default:
+        qFatal("Corrupt template encoding.");
+    }
+    return QVariant();
+}
@@ -0,0 +1,72 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QHash>
+#include <QStringList>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Compact, versioned binary encoding of br::Template.
+ *
+ * A segment starts with a header holding a magic number, a version and flags.
+ * Each template that follows stores fixed size matrix headers with raw payloads and its metadata as dictionary ids with typed values,
+ * a key is spelled out only the first time it occurs in a segment.
+ * With br::TemplateCodec::Compressed each template is deflated individually.
+ * Streams without a header, as written by operator<<(QDataStream&, const Template&), are still decoded.
+ * Used by galGallery, br::TemplateCache and the templates exchanged between MPI processes during enrollment.
+ */
+class TemplateCodec
+{
+public:
+    enum Flags { Compressed = 0x1 };
+
+    explicit TemplateCodec(int flags = 0);
+
+    void reset(); /*!< \brief Forget the key dictionary and segment state, called when the stream is repositioned. */
+    void write(QDataStream &stream, const Template &t); /*!< \brief Appends \em t, starting a new segment first if needed. */
+    bool read(QDataStream &stream, Template &t); /*!< \brief Reads the next template, returns \c false at the end of the stream. */
+    bool readFile(QDataStream &stream, File &file); /*!< \brief Like read() but skips over the matrices. */
+
+    static QByteArray encode(const Template &t, int flags = 0); /*!< \brief A self-contained segment holding only \em t. */
+    static Template decode(const QByteArray &data); /*!< \brief Inverse of encode(), also accepts the legacy encoding. */
+    static bool startsSegment(const QByteArray &data); /*!< \brief \c true if \em data begins with a segment header, so the stream it starts reads the same when appended to another. */
+
+private:
+    enum { Magic = 0x4252544d, Version = 1 };
+
+    int flags;
+    bool headerWritten, compact, compressed;
+    QStringList keys;
+    QHash<QString,int> ids;
+
+    bool readFile(QDataStream &stream, File &file, Template *t);
+    void writeTemplate(QDataStream &stream, const Template &t);
+    void readTemplate(QDataStream &stream, quint32 matrices, Template *t, File &file);
+    void writeValue(QDataStream &stream, const QVariant &value) const;
+    QVariant readValue(QDataStream &stream) const;
+};
+
+} // namespace br
+
+#endif // __CODEC_H
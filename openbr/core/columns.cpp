@@ -0,0 +1,208 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QDataStream>
+#include <QFile>
+#include <QHash>
+#include <QMap>
+
+#include "columns.h"
+
+using namespace br;
+
+static const quint32 Magic = 0x434d5242; // "BRMC"
+static const quint32 Version = 2; // Version 1 lacks sourceModified
+
+static MetadataColumns::Type typeOf(const QVariant &variant)
+{
+    switch (variant.userType()) {
+      case QMetaType::Int:     return MetadataColumns::Int;
+      case QMetaType::Float:
+      case QMetaType::Double:  return MetadataColumns::Float;
+      case QMetaType::QString: return MetadataColumns::String;
+      default:                 return MetadataColumns::Variant;
+    }
+}
+
+QVariant MetadataColumns::Column::value(int index) const
+{
+    if (!present.testBit(index)) return QVariant();
+    switch (type) {
+      case Int:    return ints[index];
+      case Float:  return floats[index];
+      case String: return dictionary[codes[index]];
+      default:     return variants[index];
+    }
+}
+
+MetadataColumns MetadataColumns::fromFiles(const FileList &files)
+{
+    MetadataColumns result;
+    result.names = files.names();
+
+    // First pass settles each key's type, keys with mixed types fall back to Variant
+    QMap<QString,int> indices;
+    for (int i=0; i<files.size(); i++) {
+        const QMap<QString,QVariant> metadata = files[i].localMetadata();
+        for (QMap<QString,QVariant>::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            const Type type = typeOf(it.value());
+            if (!indices.contains(it.key())) {
+                indices.insert(it.key(), result.columns.size());
+                Column column;
+                column.key = it.key();
+                column.type = type;
+                result.columns.append(column);
+            } else {
+                Column &column = result.columns[indices[it.key()]];
+                if (column.type != type) column.type = Variant;
+            }
+        }
+    }
+
+    const int n = files.size();
+    for (int c=0; c<result.columns.size(); c++) {
+        Column &column = result.columns[c];
+        column.present = QBitArray(n);
+        switch (column.type) {
+          case Int:     column.ints = QVector<qint32>(n, 0); break;
+          case Float:   column.floats = QVector<float>(n, 0); break;
+          case String:  column.codes = QVector<qint32>(n, -1); break;
+          default:      for (int i=0; i<n; i++) column.variants.append(QVariant());
+        }
+    }
+
+    // Second pass fills the arrays
+    QList< QHash<QString,int> > dictionaries;
+    for (int c=0; c<result.columns.size(); c++)
+        dictionaries.append(QHash<QString,int>());
+    for (int i=0; i<n; i++) {
+        const QMap<QString,QVariant> metadata = files[i].localMetadata();
+        for (QMap<QString,QVariant>::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            const int c = indices[it.key()];
+            Column &column = result.columns[c];
+            column.present.setBit(i);
+            switch (column.type) {
+              case Int:    column.ints[i] = it.value().toInt(); break;
+              case Float:  column.floats[i] = it.value().toFloat(); break;
+              case String: {
+                const QString string = it.value().toString();
+                QHash<QString,int>::const_iterator code = dictionaries[c].constFind(string);
+                if (code == dictionaries[c].constEnd()) {
+                    code = dictionaries[c].insert(string, column.dictionary.size());
+                    column.dictionary.append(string);
+                }
+                column.codes[i] = code.value();
+              } break;
+              default:     column.variants[i] = it.value();
+            }
+        }
+    }
+
+    return result;
+}
+
+FileList MetadataColumns::files() const
+{
+    // Subjects are interned once per dictionary entry, rather than by File::set() once per template
+    if (const Column *labels = column("Label")) {
+        if (labels->type == String) {
+            foreach (const QString &subject, labels->dictionary)
+                File().set("Label", subject);
+        } else {
+            for (int i=0; i<names.size(); i++)
+                if (labels->present.testBit(i))
+                    File().set("Label", labels->value(i));
+        }
+    }
+
+    FileList files;
+    files.reserve(names.size());
+    for (int i=0; i<names.size(); i++) {
+        QMap<QString,QVariant> metadata;
+        foreach (const Column &column, columns)
+            if (column.present.testBit(i))
+                metadata.insert(column.key, column.value(i));
+
+        File file;
+        file.name = names[i];
+        file.append(metadata);
+        files.append(file);
+    }
+    return files;
+}
+
+const MetadataColumns::Column *MetadataColumns::column(const QString &key) const
+{
+    for (int i=0; i<columns.size(); i++)
+        if (columns[i].key == key)
+            return &columns[i];
+    return NULL;
+}
+
+bool MetadataColumns::save(const QString &fileName) const
+{
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly)) {
+        qWarning("Can't write metadata columns: %s", qPrintable(fileName));
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream << Magic << Version << sourceBytes << sourceModified << names << qint32(columns.size());
+    foreach (const Column &column, columns) {
+        stream << column.key << quint8(column.type) << column.present;
+        switch (column.type) {
+          case Int:    stream << column.ints; break;
+          case Float:  stream << column.floats; break;
+          case String: stream << column.dictionary << column.codes; break;
+          default:     stream << column.variants;
+        }
+    }
+    return stream.status() == QDataStream::Ok;
+}
+
+bool MetadataColumns::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly)) return false;
+
+    QDataStream stream(&file);
+    quint32 magic, version;
+    stream >> magic >> version;
+    if ((magic != Magic) || (version > Version)) return false;
+
+    qint32 count;
+    stream >> sourceBytes;
+    sourceModified = QDateTime();
+    if (version >= 2) stream >> sourceModified;
+    stream >> names >> count;
+    columns.clear();
+    for (int i=0; i<count; i++) {
+        Column column;
+        quint8 type;
+        stream >> column.key >> type >> column.present;
+        column.type = Type(type);
+        switch (column.type) {
+          case Int:    stream >> column.ints; break;
+          case Float:  stream >> column.floats; break;
+          case String: stream >> column.dictionary >> column.codes; break;
+          default:     stream >> column.variants;
+        }
+        columns.append(column);
+    }
+    return stream.status() == QDataStream::Ok;
+}
@@ -0,0 +1,86 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef __COLUMNS_H
+#define __COLUMNS_H
+
+#include <QBitArray>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Column-oriented copy of the template metadata in a gallery.
+ *
+ * Each metadata key becomes one typed array: integers and floats are stored as
+ * plain vectors and strings are dictionary encoded, so a key can be scanned
+ * without reading template payloads or building a br::File per template.
+ * Galleries keep it in a sidecar next to the template data, stamped with the
+ * size and modification time of the gallery it describes so stale sidecars are ignored.
+ */
+struct MetadataColumns
+{
+    enum Type { Int, Float, String, Variant };
+
+    /*!
+     * \brief The values of one metadata key, \c present marks the templates that have it.
+     */
+    struct Column
+    {
+        QString key;
+        Type type;
+        QBitArray present;
+        QVector<qint32> ints;
+        QVector<float> floats;
+        QStringList dictionary;
+        QVector<qint32> codes; /*!< \brief Index into \c dictionary for String columns. */
+        QList<QVariant> variants;
+
+        QVariant value(int index) const; /*!< \brief The value for template \em index, or an invalid variant. */
+    };
+
+    qint64 sourceBytes; /*!< \brief Size of the gallery when the columns were built. */
+    QDateTime sourceModified; /*!< \brief Modification time of the gallery when the columns were built. */
+    QStringList names;
+    QList<Column> columns;
+
+    MetadataColumns() : sourceBytes(-1) {}
+
+    static MetadataColumns fromFiles(const FileList &files);
+    void stamp(const QFileInfo &source) { sourceBytes = source.size(); sourceModified = source.lastModified(); } /*!< \brief Records \em source as the gallery described. */
+    bool describes(const QFileInfo &source) const { return (sourceBytes == source.size()) && sourceModified.isValid() && (sourceModified == source.lastModified()); } /*!< \brief \c true if \em source is unchanged since stamp(). */
+    FileList files() const; /*!< \brief Rebuild the files the columns were made from. */
+    const Column *column(const QString &key) const; /*!< \brief The column for \em key, or \c NULL. */
+    int size() const { return names.size(); }
+
+    bool save(const QString &fileName) const;
+    bool load(const QString &fileName); /*!< \brief Returns \c false if \em fileName is missing or isn't a sidecar. */
+
+    static QString sidecar(const QString &gallery) { return gallery + ".columns"; }
+};
+
+} // namespace br
+
+#endif // __COLUMNS_H
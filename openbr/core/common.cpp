@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <opencv2/core/core.hpp>
+
 #include "common.h"
 
 using namespace std;
@@ -63,3 +65,67 @@ QList<int> Common::RandSample(int n, const QSet<int> &values, bool unique)
     }
     return samples;
 }
+
+QVector<double> Common::BinnedKernelDensityEstimation(const vector<double> &vals, double min, double max, int size, double h)
+{
+    QVector<double> density(qMax(size, 0), 0);
+    if (vals.empty() || (size < 1) || !(h > 0)) return density;
+
+    const double norm = vals.size() * h * sqrt(2*CV_PI);
+    const double delta = (size > 1) ? (max - min) / (size - 1) : 0;
+    const int reach = (delta > 0) ? int(ceil(4*h/delta)) : 0;
+    if (!(delta > 0) || (reach > 4*size)) {
+        // Degenerate grid, or the kernel is much wider than it; evaluate each point directly
+        for (int i=0; i<size; i++) {
+            const double x = min + i*delta;
+            double y = 0;
+            for (size_t j=0; j<vals.size(); j++)
+                y += exp(-pow((vals[j]-x)/h,2)/2);
+            density[i] = y / norm;
+        }
+        return density;
+    }
+
+    // Bin onto the grid extended by the kernel reach on each side, so samples just outside <min, max> still count.
+    // The transform is at least as long as the extended grid, so the circular convolution doesn't wrap into it.
+    const int extended = size + 2*reach;
+    const int length = cv::getOptimalDFTSize(extended + reach);
+    cv::Mat bins = cv::Mat::zeros(1, length, CV_64FC1);
+    cv::Mat kernel = cv::Mat::zeros(1, length, CV_64FC1);
+    double *b = bins.ptr<double>();
+    for (size_t j=0; j<vals.size(); j++) {
+        const double x = (vals[j] - min) / delta + reach;
+        if (!(x >= 0) || !(x <= extended-1)) continue;
+        const int i = int(x);
+        const double w = x - i;
+        b[i] += 1 - w;
+        if (i+1 < extended) b[i+1] += w;
+    }
+
+    double *k = kernel.ptr<double>();
+    for (int i=0; i<=reach; i++) {
+        k[i] = exp(-pow(i*delta/h,2)/2);
+        if (i > 0) k[length-i] = k[i];
+    }
+
+    cv::Mat binsDFT, kernelDFT;
+    cv::dft(bins, binsDFT);
+    cv::dft(kernel, kernelDFT);
+    cv::mulSpectrums(binsDFT, kernelDFT, binsDFT, 0);
+    cv::dft(binsDFT, bins, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+    b = bins.ptr<double>();
+    for (int i=0; i<size; i++)
+        density[i] = qMax(b[i+reach], 0.0) / norm; // Round-off can leave empty regions slightly negative
+    return density;
+}
+
+double Common::Interpolate(const QVector<double> &grid, double min, double max, double x)
+{
+    if (grid.isEmpty()) return 0;
+    if ((grid.size() == 1) || !(x > min)) return grid.first();
+    if (!(x < max)) return grid.last();
+    const double position = (x - min) / (max - min) * (grid.size() - 1);
+    const int i = int(position);
+    return grid[i] + (grid[i+1] - grid[i]) * (position - i);
+}
@@ -22,6 +22,7 @@
 #include <QMap>
 #include <QPair>
 #include <QSet>
+#include <QVector>
 #include <QtAlgorithms>
 #include <algorithm>
 #include <functional>
@@ -213,6 +214,30 @@ double KernelDensityEstimation(const V<T> &vals, double x, double h)
     return y / (vals.size() * h);
 }
 
+/*!
+ * \brief Compute kernel density at \em size evenly spaced points spanning <min, max> with bandwidth h.
+ *
+ * Samples are linearly binned onto the grid and convolved with the kernel by FFT,
+ * costing O(n + size*log(size)) instead of the O(n*size) of evaluating each point.
+ * The kernel is truncated at four bandwidths.
+ */
+QVector<double> BinnedKernelDensityEstimation(const std::vector<double> &vals, double min, double max, int size, double h);
+
+template <template<class> class V, typename T>
+QVector<double> KernelDensityEstimation(const V<T> &vals, double min, double max, int size, double h)
+{
+    std::vector<double> samples;
+    samples.reserve(vals.size());
+    foreach (T val, vals)
+        samples.push_back(val);
+    return BinnedKernelDensityEstimation(samples, min, max, size, h);
+}
+
+/*!
+ * \brief Linearly interpolate \em grid, sampled at evenly spaced points spanning <min, max>, at x.
+ */
+double Interpolate(const QVector<double> &grid, double min, double max, double x);
+
 /*!
  * \brief Returns a vector of n integers sampled in the range <min, max].
  *
@@ -14,16 +14,165 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QThread>
+#include <QWaitCondition>
+#include <algorithm>
+#include <functional>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/bee.h"
+#include "openbr/core/cluster.h"
+#include "openbr/core/codec.h"
 #include "openbr/core/common.h"
+#include "openbr/core/distributed.h"
+#include "openbr/core/index.h"
+#include "openbr/core/metrics.h"
+#include "openbr/core/network.h"
+#include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
+#include "openbr/core/trace.h"
 
 using namespace br;
 
+/**** BLOCK_READER ****/
+/*!
+ * \brief Reads gallery blocks on the I/O workers, one block ahead of the consumer.
+ *
+ * The read isn't queued behind compute tasks, and a consumer waiting on it runs compute tasks in the meantime.
+ */
+class BlockReader
+{
+    Gallery *gallery;
+    TemplateList block;
+    bool done;
+    TaskGroup reads;
+
+public:
+    BlockReader(Gallery *gallery)
+        : gallery(gallery), done(false), reads(Parallel::IO)
+    {
+        reads.run(this, &BlockReader::readNext);
+    }
+
+    TemplateList read(bool *done)
+    {
+        reads.wait();
+        TemplateList result = block;
+        *done = this->done;
+        if (!*done) reads.run(this, &BlockReader::readNext);
+        return result;
+    }
+
+private:
+    void readNext()
+    {
+        Trace::Scope span("io", "Gallery::readBlock");
+        QElapsedTimer timer; timer.start();
+        block = gallery->readBlock(&done);
+        Metrics::observe("br_gallery_read_seconds", timer.nsecsElapsed()/1e9);
+        Metrics::increment("br_gallery_templates_read_total", block.size());
+        Metrics::increment("br_gallery_bytes_read_total", block.bytes<double>());
+
+        // Start downloading remote images before the block reaches the transform workers
+        Network::prefetch(block.files().names());
+    }
+};
+
+/**** ENROLLMENT_QUEUE ****/
+/*!
+ * \brief Projects templates independently on the shared scheduler and returns the results in submission order.
+ *
+ * Results are sequenced like \c SequencingBuffer in stream.cpp, so a slow template only delays the writes queued behind it.
+ * Per-template latencies are buffered and reported to br::Metrics once per block.
+ */
+class EnrollmentQueue
+{
+    const Transform *transform;
+    QMutex resultsLock;
+    QWaitCondition resultReady;
+    QMap<int, TemplateList> results;
+    QList<double> latencies; // Guarded by resultsLock
+    int submitted, taken;
+    TaskGroup tasks;
+
+public:
+    EnrollmentQueue(const Transform *transform)
+        : transform(transform), submitted(0), taken(0) {}
+
+    ~EnrollmentQueue()
+    {
+        while (pending() > 0) take();
+        flush();
+    }
+
+    int pending() const
+    {
+        return submitted - taken;
+    }
+
+    void submit(const Template &t)
+    {
+        tasks.run(this, &EnrollmentQueue::project, submitted++, t);
+    }
+
+    TemplateList take()
+    {
+        QMutexLocker locker(&resultsLock);
+        while (!results.contains(taken)) {
+            // Execute queued work rather than idle while the next result is computed
+            locker.unlock();
+            const bool helped = Parallel::help();
+            locker.relock();
+            if (!helped && !results.contains(taken))
+                resultReady.wait(&resultsLock, 1);
+        }
+        const TemplateList result = results.take(taken++);
+        const bool full = latencies.size() >= Globals->blockSize;
+        locker.unlock();
+
+        if (full) flush();
+        return result;
+    }
+
+private:
+    void project(int sequenceNumber, const Template &t)
+    {
+        TemplateList dst;
+        QElapsedTimer timer; timer.start();
+        transform->project(TemplateList() << t, dst);
+        const double seconds = timer.nsecsElapsed()/1e9;
+
+        QMutexLocker locker(&resultsLock);
+        results.insert(sequenceNumber, dst);
+        latencies.append(seconds);
+        resultReady.wakeAll();
+    }
+
+    void flush()
+    {
+        QMutexLocker locker(&resultsLock);
+        QList<double> batch;
+        batch.swap(latencies);
+        const int depth = pending();
+        locker.unlock();
+
+        Metrics::observe("br_enroll_template_seconds", batch);
+        Metrics::set("br_enroll_queue_depth", depth);
+    }
+};
+
 /**** ALGORITHM_CORE ****/
 struct AlgorithmCore
 {
+    QSharedPointer<QFile> mapping; // Declared first so the model matrices referencing it are released before it
     QSharedPointer<Transform> transform;
     QSharedPointer<Distance> distance;
 
@@ -54,7 +203,7 @@ struct AlgorithmCore
             data >> *transform;
 
             qDebug("Training Comparison");
-            distance->train(data);
+            distance->train(data.unfailed());
         }
 
         if (!model.isEmpty()) {
@@ -65,11 +214,21 @@ struct AlgorithmCore
         qDebug("Training Time (sec): %d", time.elapsed()/1000);
     }
 
+    /*!
+     * Models start with a 64-byte header holding Model_Magic, Model_Version and the zlib level of the payload.
+     * Uncompressed payloads are memory mapped on load and their matrices reference the mapping,
+     * so only the pages a transform touches are read.
+     * Files without the header are legacy models compressed in full.
+     */
+    enum { Model_Magic = 0x42524d44, Model_Version = 1, Model_Header_Size = 64 };
+
     void store(const QString &model) const
     {
         // Create stream
         QByteArray data;
         QDataStream out(&data, QFile::WriteOnly);
+        out << quint32(Model_Magic) << quint16(Model_Version) << quint16(Globals->modelCompression);
+        out.writeRawData(QByteArray(Model_Header_Size - 8, 0).constData(), Model_Header_Size - 8);
 
         // Serialize algorithm to stream
         out << name;
@@ -79,18 +238,44 @@ struct AlgorithmCore
         if (hasComparer) distance->store(out);
         out << Globals->classes;
 
-        // Compress and save to file
-        QtUtils::writeFile(model, data, -1);
+        // Compress the payload and save to file
+        if (Globals->modelCompression != 0)
+            data = data.left(Model_Header_Size) + qCompress(data.mid(Model_Header_Size), Globals->modelCompression);
+        QtUtils::writeFile(model, data, 0);
     }
 
     void load(const QString &model)
     {
-        // Load from file and decompress
-        QByteArray data;
-        QtUtils::readFile(model, data, true);
+        QSharedPointer<QFile> file(new QFile(model));
+        if (!file->open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(model));
+
+        quint32 magic = 0;
+        quint16 version = 0, compression = 0;
+        QDataStream header(file->read(Model_Header_Size));
+        header >> magic >> version >> compression;
+
+        QBuffer buffer;
+        if (magic != Model_Magic) {
+            // Legacy model
+            QByteArray data;
+            QtUtils::readFile(model, data, true);
+            buffer.setData(data);
+        } else if (version > Model_Version) {
+            qFatal("Unsupported model version %d in %s.", int(version), qPrintable(model));
+        } else if (compression != 0) {
+            buffer.setData(qUncompress(file->readAll()));
+        } else {
+            // Private mapping so transforms may modify their matrices in place
+            const uchar *data = file->map(Model_Header_Size, file->size() - Model_Header_Size, QFileDevice::MapPrivateOption);
+            if (data == NULL) qFatal("Unable to map %s.", qPrintable(model));
+            buffer.setData(QByteArray::fromRawData((const char*)data, file->size() - Model_Header_Size));
+            buffer.setProperty("mapped", true);
+            mapping = file;
+        }
 
         // Create stream
-        QDataStream in(&data, QFile::ReadOnly);
+        buffer.open(QBuffer::ReadOnly);
+        QDataStream in(&buffer);
 
         // Load algorithm
         in >> name; init(Globals->abbreviations.contains(name) ? Globals->abbreviations[name] : name);
@@ -100,6 +285,20 @@ struct AlgorithmCore
         in >> Globals->classes;
     }
 
+    Template enroll(const Template &input) const
+    {
+        if (transform.isNull()) qFatal("Null transform.");
+        Template output;
+        transform->project(input, output);
+        return output;
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        if (distance.isNull()) qFatal("Null distance.");
+        return distance->compare(target, query);
+    }
+
     File getMemoryGallery(const File &file) const
     {
         return name + file.baseName() + file.hash() + ".mem";
@@ -110,66 +309,141 @@ struct AlgorithmCore
         FileList fileList;
         if (gallery.isNull()) gallery = getMemoryGallery(input);
 
-        QScopedPointer<Gallery> g(Gallery::make(gallery));
-        if (g.isNull()) return FileList();
+        // Memory galleries are private to each process so every process enrolls them in full
+        if (transform.isNull()) qFatal("Null transform.");
+        const bool distributed = Distributed::enabled() && (gallery.suffix() != "mem") && !transform->timeVarying();
+        const bool writer = !distributed || (Distributed::rank() == 0);
 
-        if (gallery.contains("read") || gallery.contains("cache")) {
-            fileList = g->files();
+        QScopedPointer<Gallery> g;
+        if (writer) {
+            g.reset(Gallery::make(gallery));
+            if (g.isNull()) return FileList();
+
+            if (gallery.contains("read") || gallery.contains("cache")) {
+                fileList = g->files();
+            }
+        }
+        if (distributed) {
+            // Agree on the existing gallery contents
+            QByteArray existing;
+            QDataStream out(&existing, QFile::WriteOnly);
+            out << fileList;
+            Distributed::broadcast(existing);
+            QDataStream in(existing);
+            in >> fileList;
         }
         if (!fileList.isEmpty() && gallery.contains("cache"))
             return fileList;
 
-        const TemplateList i(TemplateList::fromGallery(input));
+        TemplateList i(TemplateList::fromGallery(input));
+        if (gallery.contains("blocks")) {
+            // Enroll one shard of the input, the partial galleries are concatenated in block order
+            int begin, end;
+            blockRange(gallery, "blocks", Globals->blocks(i.size()), begin, end);
+            i = i.mid(begin*Globals->blockSize, (end-begin)*Globals->blockSize);
+        }
         if (i.isEmpty()) return fileList; // Nothing to enroll
 
-        if (transform.isNull()) qFatal("Null transform.");
         const int blocks = Globals->blocks(i.size());
         Globals->currentStep = 0;
         Globals->totalSteps = i.size();
         Globals->startTime.start();
 
         const bool noDuplicates = gallery.contains("noDuplicates");
-        QStringList fileNames = noDuplicates ? fileList.names() : QStringList();
+        const QSet<QString> fileNames = noDuplicates ? fileList.names().toSet() : QSet<QString>();
         const int subBlockSize = 4*std::max(1, Globals->parallelism);
         const int numSubBlocks = ceil(1.0*Globals->blockSize/subBlockSize);
         int totalCount = 0, failureCount = 0;
         double totalBytes = 0;
-        for (int block=0; block<blocks; block++) {
-            for (int subBlock = 0; subBlock<numSubBlocks; subBlock++) {
-                TemplateList data = i.mid(block*Globals->blockSize + subBlock*subBlockSize, subBlockSize);
-                if (data.isEmpty()) break;
-                if (noDuplicates)
-                    for (int i=data.size()-1; i>=0; i--)
-                        if (fileNames.contains(data[i].file.name))
-                            data.removeAt(i);
-                const int numFiles = data.size();
-
-                if (Globals->backProject) {
-                    TemplateList backProjectedData;
-                    transform->backProject(data, backProjectedData);
-                    data = backProjectedData;
+        if (distributed) {
+            // Blocks are enrolled round robin by the processes and written in order by rank 0
+            for (int block=0; block<blocks; block++) {
+                const int owner = Distributed::owner(block);
+                if (!writer && (owner != Distributed::rank())) continue;
+
+                TemplateList data;
+                int numFiles;
+                if (owner == Distributed::rank()) {
+                    data = i.mid(block*Globals->blockSize, Globals->blockSize);
+                    if (noDuplicates)
+                        for (int i=data.size()-1; i>=0; i--)
+                            if (fileNames.contains(data[i].file.name))
+                                data.removeAt(i);
+                    numFiles = data.size();
+
+                    if (Globals->backProject) {
+                        TemplateList backProjectedData;
+                        transform->backProject(data, backProjectedData);
+                        data = backProjectedData;
+                    } else {
+                        data >> *transform;
+                    }
+
+                    if (!writer) {
+                        Distributed::send(pack(data, numFiles), 0, EnrollTag);
+                        Globals->currentStep += numFiles;
+                        Globals->printStatus();
+                        continue;
+                    }
                 } else {
-                    data >> *transform;
+                    data = unpack(Distributed::receive(owner, EnrollTag), &numFiles);
                 }
 
-                g->writeBlock(data);
-                const FileList newFiles = data.files();
-                fileList.append(newFiles);
-
-                totalCount += newFiles.size();
-                failureCount += newFiles.failures();
-                totalBytes += data.bytes<double>();
-                Globals->currentStep += numFiles;
-                Globals->printStatus();
+                write(g.data(), data, numFiles, fileList, totalCount, failureCount, totalBytes);
+            }
+        } else if (Globals->backProject || transform->timeVarying() || (Globals->parallelism == 0)) {
+            for (int block=0; (block<blocks) && !Globals->cancelled(); block++) {
+                for (int subBlock = 0; (subBlock<numSubBlocks) && !Globals->cancelled(); subBlock++) {
+                    TemplateList data = i.mid(block*Globals->blockSize + subBlock*subBlockSize, subBlockSize);
+                    if (data.isEmpty()) break;
+                    if (noDuplicates)
+                        for (int i=data.size()-1; i>=0; i--)
+                            if (fileNames.contains(data[i].file.name))
+                                data.removeAt(i);
+                    const int numFiles = data.size();
+
+                    if (Globals->backProject) {
+                        TemplateList backProjectedData;
+                        transform->backProject(data, backProjectedData);
+                        data = backProjectedData;
+                    } else {
+                        data >> *transform;
+                    }
+
+                    write(g.data(), data, numFiles, fileList, totalCount, failureCount, totalBytes);
+                }
             }
+        } else {
+            // Keep a bounded number of templates in flight and write them in order as they finish
+            EnrollmentQueue queue(transform.data());
+            const int maxPending = 2*subBlockSize;
+            foreach (const Template &t, i) {
+                if (Globals->cancelled()) break;
+                if (noDuplicates && fileNames.contains(t.file.name)) {
+                    Globals->currentStep++;
+                    continue;
+                }
+                if (queue.pending() >= maxPending)
+                    write(g.data(), queue.take(), 1, fileList, totalCount, failureCount, totalBytes);
+                queue.submit(t);
+            }
+            while (queue.pending() > 0)
+                write(g.data(), queue.take(), 1, fileList, totalCount, failureCount, totalBytes);
         }
 
+        // SPEED is per thread, the metric is the wall clock rate of the whole job
+        Metrics::set("br_enroll_templates_per_second", 1000 * Globals->totalSteps / std::max(qint64(1), qint64(Globals->startTime.elapsed())));
         const float speed = 1000 * Globals->totalSteps / Globals->startTime.elapsed() / std::max(1, abs(Globals->parallelism));
         if (!Globals->quiet && (Globals->totalSteps > 1))
             fprintf(stderr, "\rSPEED=%.1e  SIZE=%.4g  FAILURES=%d/%d  \n",
                     speed, totalBytes/totalCount, failureCount, totalCount);
         Globals->totalSteps = 0;
 
+        if (writer && gallery.contains("index") && (gallery.suffix() != "mem")) {
+            g.reset(); // Flush the gallery before indexing it
+            InvertedIndex::build(gallery, gallery.get<int>("index", 0));
+        }
+
         return fileList;
     }
 
@@ -202,40 +476,640 @@ struct AlgorithmCore
         retrieveOrEnroll(targetGallery, t, targetFiles);
         retrieveOrEnroll(queryGallery, q, queryFiles);
 
-        QScopedPointer<Output> o(Output::make(output, targetFiles, queryFiles));
+        if (output.get<bool>("incremental", false)) {
+            compareIncremental(t.data(), q.data(), output);
+            return;
+        }
+
+        // Gallery reads, block ranges and output offsets all follow the budgeted block size until the comparison ends
+        const int blockSize = Globals->blockSize;
+        if (Globals->memoryBudget > 0)
+            Globals->blockSize = budgetedBlockSize(t->file, targetFiles.size(), q->file, queryFiles.size());
+
+        // Only the query (row) and target (column) blocks in range are compared,
+        // the output then holds a fragment that records where it belongs in the full matrix
+        int rowBegin, rowEnd, columnBegin, columnEnd;
+        blockRange(output, "rowBlocks", Globals->blocks(queryFiles.size()), rowBegin, rowEnd);
+        blockRange(output, "colBlocks", Globals->blocks(targetFiles.size()), columnBegin, columnEnd);
+        if (output.contains("rowBlocks") || output.contains("colBlocks")) {
+            const FileList fragmentTargets = targetFiles.mid(columnBegin*Globals->blockSize, (columnEnd-columnBegin)*Globals->blockSize);
+            const FileList fragmentQueries = queryFiles.mid(rowBegin*Globals->blockSize, (rowEnd-rowBegin)*Globals->blockSize);
+            output.set("targetSigset", BEE::fragmentSigset(targetGallery.name, columnBegin*Globals->blockSize, columnBegin*Globals->blockSize + fragmentTargets.size(), targetFiles.size()));
+            output.set("querySigset", BEE::fragmentSigset(queryGallery.name, rowBegin*Globals->blockSize, rowBegin*Globals->blockSize + fragmentQueries.size(), queryFiles.size()));
+            targetFiles = fragmentTargets;
+            queryFiles = fragmentQueries;
+        }
 
+        // Query blocks are compared round robin by the processes and output in order by rank 0
+        const bool distributed = Distributed::enabled();
+        const bool writer = !distributed || (Distributed::rank() == 0);
+        QScopedPointer<Output> o(writer ? Output::make(output, targetFiles, queryFiles) : NULL);
+
+        // Symmetric self-comparisons only compute the blocks on and above the diagonal and mirror them
         if (distance.isNull()) qFatal("Null distance.");
+        const bool triangular = !distributed && o->selfSimilar && (rowBegin == columnBegin) && distance->symmetric();
         Globals->currentStep = 0;
         Globals->totalSteps = double(targetFiles.size()) * double(queryFiles.size());
         Globals->startTime.start();
 
+        // Target blocks are kept in memory after the first pass if they fit in the cache
+        const qint64 cacheBytes = qint64(Globals->targetCache) * 1024 * 1024;
+        QList<TemplateList> cachedTargets;
+        qint64 cachedBytes = 0;
+        bool cacheTargets = (cacheBytes > 0), targetsCached = false;
+
         int queryBlock = -1;
-        bool queryDone = false;
-        while (!queryDone) {
+        bool queryDone = targetFiles.isEmpty() || queryFiles.isEmpty();
+        BlockReader queryReader(q.data());
+        while (!queryDone && (distributed || !Globals->cancelled())) {
             queryBlock++;
-            TemplateList queries = q->readBlock(&queryDone);
+            TemplateList queries = queryReader.read(&queryDone);
+            if (queryBlock+1 >= rowEnd) queryDone = true;
+            if (queryBlock < rowBegin) continue;
+
+            // Rows computed by another process are only needed by rank 0
+            Output *blockOutput = o.data();
+            int outputBlock = queryBlock - rowBegin;
+            QScopedPointer<MatrixOutput> stripe;
+            if (distributed) {
+                const int owner = Distributed::owner(queryBlock);
+                if (owner != Distributed::rank()) {
+                    if (writer) receiveStripe(owner, o.data(), outputBlock);
+                    else        Globals->currentStep += double(targetFiles.size()) * double(queries.size());
+                    continue;
+                }
+                if (!writer) {
+                    stripe.reset(MatrixOutput::make(targetFiles, queries.files()));
+                    blockOutput = stripe.data();
+                    outputBlock = 0;
+                }
+            }
+
+            if (targetsCached) {
+                for (int targetBlock=0; (targetBlock<cachedTargets.size()) && (distributed || !Globals->cancelled()); targetBlock++)
+                    compareBlock(cachedTargets[targetBlock], queries, blockOutput, outputBlock, targetBlock, triangular);
+                if (!stripe.isNull()) Distributed::send(pack(stripe->data), 0, CompareTag);
+                continue;
+            }
 
             int targetBlock = -1;
             bool targetDone = false;
-            while (!targetDone) {
+            BlockReader targetReader(t.data());
+            while (!targetDone && (distributed || !Globals->cancelled())) {
                 targetBlock++;
-                TemplateList targets = t->readBlock(&targetDone);
-
-                o->setBlock(queryBlock, targetBlock);
-                distance->compare(targets, queries, o.data());
+                TemplateList targets = targetReader.read(&targetDone);
+                if (targetBlock+1 >= columnEnd) targetDone = true;
+                if (targetBlock < columnBegin) continue;
+
+                if (cacheTargets && !queryDone) {
+                    cachedBytes += targets.bytes<qint64>();
+                    cacheTargets = (cachedBytes <= cacheBytes);
+                    if (cacheTargets) cachedTargets.append(targets);
+                    else              cachedTargets.clear();
+                }
 
-                Globals->currentStep += double(targets.size()) * double(queries.size());
-                Globals->printStatus();
+                compareBlock(targets, queries, blockOutput, outputBlock, targetBlock - columnBegin, triangular);
             }
+            targetsCached = cacheTargets;
+            if (!stripe.isNull()) Distributed::send(pack(stripe->data), 0, CompareTag);
         }
 
+        Metrics::set("br_compare_comparisons_per_second", 1000 * Globals->totalSteps / std::max(qint64(1), qint64(Globals->startTime.elapsed())));
         const float speed = 1000 * Globals->totalSteps / Globals->startTime.elapsed() / std::max(1, abs(Globals->parallelism));
         if (!Globals->quiet && (Globals->totalSteps > 1)) fprintf(stderr, "\rSPEED=%.1e  \n", speed);
         Globals->totalSteps = 0;
+        Globals->blockSize = blockSize;
+    }
+
+    void search(const File &targetGallery, File queryGallery, int count, const File &output)
+    {
+        if (distance.isNull()) qFatal("Null distance.");
+        if (queryGallery == ".") queryGallery = targetGallery;
+
+        // Binary codes are searched within a Hamming radius, anything else by its nearest inverted lists
+        const bool hashing = targetGallery.contains("radius");
+        QSharedPointer<InvertedIndex> index;
+        QSharedPointer<MultiIndexHash> hashes;
+        if (hashing) hashes = MultiIndexHash::fromGallery(targetGallery);
+        else         index = InvertedIndex::fromGallery(targetGallery);
+        QScopedPointer<Gallery> q;
+        FileList queryFiles;
+        retrieveOrEnroll(queryGallery, q, queryFiles);
+        const TemplateList queries = q->read();
+
+        QVector<QStringList> results(queries.size());
+        TaskGroup tasks;
+        for (int i=0; i<queries.size(); i++) {
+            if (hashing) {
+                if (Globals->parallelism) tasks.run(this, &AlgorithmCore::searchRadius, hashes.data(), targetGallery.get<int>("radius"), queries[i], count, &results[i]);
+                else                                                   searchRadius(hashes.data(), targetGallery.get<int>("radius"), queries[i], count, &results[i]);
+            } else {
+                if (Globals->parallelism) tasks.run(this, &AlgorithmCore::searchQuery, index.data(), targetGallery, queries[i], count, &results[i]);
+                else                                                   searchQuery(index.data(), targetGallery, queries[i], count, &results[i]);
+            }
+        }
+        tasks.wait();
+
+        QStringList lines; lines.append("Query,Target,Score");
+        foreach (const QStringList &result, results)
+            lines.append(result);
+        if (output.isNull()) printf("%s\n", qPrintable(lines.join("\n")));
+        else                 QtUtils::writeFile(output, lines);
+    }
+
+    void cluster(const File &gallery, int k, float aggressiveness, const QString &csv)
+    {
+        if (distance.isNull()) qFatal("Null distance.");
+        QScopedPointer<Gallery> g;
+        FileList files;
+        retrieveOrEnroll(gallery, g, files);
+
+        // Aligned blocks are compared against each other, so no similarity matrix is ever held in full
+        QList<TemplateList> blocks;
+        bool done = false;
+        while (!done) {
+            TemplateList block = g->readBlock(&done);
+            if (block.isEmpty()) continue;
+            block.align();
+            blocks.append(block);
+        }
+        ClusterTemplates(blocks, distance.data(), k, aggressiveness, csv);
+    }
+
+    void aggregate(const File &inputGallery, const File &outputGallery)
+    {
+        const QString key = outputGallery.get<QString>("key", "Label");
+        const QString method = outputGallery.get<QString>("method", "Mean");
+        const int count = outputGallery.get<int>("count", 1);
+        if ((method != "Mean") && (method != "Medoid") && (method != "Centers")) qFatal("Unknown aggregation method %s.", qPrintable(method));
+        if ((method != "Mean") && distance.isNull()) qFatal("Null distance.");
+
+        QScopedPointer<Gallery> i;
+        FileList files;
+        retrieveOrEnroll(inputGallery, i, files);
+        const TemplateList templates = i->read();
+
+        // Members of each subject in order of first appearance, templates without a subject or that failed to enroll are kept as is
+        QHash<QString, int> index;
+        QList<TemplateList> subjects;
+        foreach (const Template &t, templates) {
+            const QString subject = t.file.get<QString>(key, QString());
+            if (subject.isEmpty() || t.file.get<bool>("FTE", false)) {
+                subjects.append(TemplateList());
+                subjects.last().append(t);
+                continue;
+            }
+            QHash<QString, int>::const_iterator it = index.constFind(subject);
+            if (it == index.constEnd()) {
+                it = index.insert(subject, subjects.size());
+                subjects.append(TemplateList());
+            }
+            subjects[it.value()].append(t);
+        }
+
+        QVector<Template> results(subjects.size());
+        TaskGroup tasks;
+        for (int j=0; j<subjects.size(); j++)
+            if (Globals->parallelism) tasks.run(this, &AlgorithmCore::aggregateSubject, subjects[j], key, method, count, &results[j]);
+            else                                       aggregateSubject(subjects[j], key, method, count, &results[j]);
+        tasks.wait();
+        qDebug("Aggregated %d templates into %d", templates.size(), results.size());
+
+        QScopedPointer<Gallery> o(Gallery::make(outputGallery));
+        o->writeBlock(results.toList());
+    }
+
+    void deduplicate(const File &targetGallery, File queryGallery, const File &output)
+    {
+        const bool self = (queryGallery == ".") || (queryGallery == targetGallery);
+        if (self) queryGallery = targetGallery;
+
+        // Hash join on the enrolled bytes, which finds the same pairs as comparing with Identical
+        QHash<QByteArray, int> index;
+        QVector<DuplicateGroup> groups;
+        insertDuplicates(targetGallery, false, index, groups);
+        if (!self) insertDuplicates(queryGallery, true, index, groups);
+
+        QStringList lines; lines.append("Group,Gallery,File");
+        int group = 0;
+        foreach (const DuplicateGroup &g, groups) {
+            if (self ? (g.targets.size() < 2) : (g.targets.isEmpty() || g.queries.isEmpty())) continue;
+            foreach (const QString &target, g.targets)
+                lines.append(QString::number(group) + ",Target," + target);
+            foreach (const QString &query, g.queries)
+                lines.append(QString::number(group) + ",Query," + query);
+            group++;
+        }
+        qDebug("%d duplicate groups", group);
+
+        if (output.isNull()) printf("%s\n", qPrintable(lines.join("\n")));
+        else                 QtUtils::writeFile(output, lines);
     }
 
 private:
     QString name;
+    enum { EnrollTag = 1, CompareTag = 2 };
+
+    struct DuplicateGroup
+    {
+        QStringList targets, queries;
+    };
+
+    // Templates of at most this many bytes are keyed by their bytes, longer ones by their SHA-1 digest
+    enum { Max_Key_Bytes = 64 };
+
+    static QByteArray duplicateKey(const Template &t)
+    {
+        QByteArray bytes;
+        foreach (const cv::Mat &m, t) {
+            const int size = int(m.total() * m.elemSize());
+            bytes.append((const char*)&size, sizeof(size)); // Keeps matrix boundaries from aliasing
+            if (m.isContinuous()) {
+                bytes.append((const char*)m.data, size);
+            } else {
+                const cv::Mat continuous = m.clone();
+                bytes.append((const char*)continuous.data, size);
+            }
+        }
+        return (bytes.size() <= Max_Key_Bytes) ? bytes : QCryptographicHash::hash(bytes, QCryptographicHash::Sha1);
+    }
+
+    void insertDuplicates(const File &gallery, bool query, QHash<QByteArray, int> &index, QVector<DuplicateGroup> &groups)
+    {
+        QScopedPointer<Gallery> g;
+        FileList files;
+        retrieveOrEnroll(gallery, g, files);
+
+        // Stream the gallery so only the keys and file names are held in memory
+        bool done = false;
+        while (!done) {
+            const TemplateList block = g->readBlock(&done);
+            foreach (const Template &t, block) {
+                if (t.file.failed()) continue;
+                const QByteArray key = duplicateKey(t);
+                QHash<QByteArray, int>::const_iterator it = index.constFind(key);
+                if (it == index.constEnd()) {
+                    // Queries can only join groups started by targets
+                    if (query) continue;
+                    it = index.insert(key, groups.size());
+                    groups.append(DuplicateGroup());
+                }
+                if (query) groups[it.value()].queries.append(t.file.name);
+                else       groups[it.value()].targets.append(t.file.name);
+            }
+        }
+    }
+
+    // Average bytes per template, from the size of a gallery file or else its first block
+    static double templateBytes(const File &gallery, int count)
+    {
+        if ((gallery.suffix() == "gal") && QFileInfo(gallery.name).exists())
+            return double(QFileInfo(gallery.name).size()) / std::max(1, count);
+
+        bool done = false;
+        QScopedPointer<Gallery> sample(Gallery::make(gallery));
+        const TemplateList block = sample->readBlock(&done);
+        return block.bytes<double>() / std::max(1, block.size());
+    }
+
+    // Two blocks of each gallery are in memory at once, the block being compared and the block being read
+    static int budgetedBlockSize(const File &targetGallery, int targetCount, const File &queryGallery, int queryCount)
+    {
+        const double bytes = templateBytes(targetGallery, targetCount) + templateBytes(queryGallery, queryCount);
+        const double budget = double(Globals->memoryBudget) * 1024 * 1024;
+        const int minimum = 4*std::max(1, abs(Globals->parallelism)); // Enough templates to keep every thread busy
+        const int maximum = std::max(minimum, std::max(targetCount, queryCount));
+        const int blockSize = std::max(minimum, std::min(maximum, int(std::min(budget / (2*std::max(1.0, bytes)), double(maximum)))));
+        qDebug("Comparing in blocks of %d templates", blockSize);
+        return blockSize;
+    }
+
+    // Parses the half-open range "<begin>:<end>" of blocks in key, an omitted bound is the first or last block
+    static void blockRange(const File &file, const QString &key, int blocks, int &begin, int &end)
+    {
+        begin = 0;
+        end = blocks;
+        if (!file.contains(key)) return;
+        const QStringList words = file.get<QString>(key).split(':');
+        if (words.size() != 2) qFatal("Expected %s=<begin>:<end>.", qPrintable(key));
+        if (!words[0].isEmpty()) begin = std::min(blocks, words[0].toInt());
+        if (!words[1].isEmpty()) end = std::min(blocks, words[1].toInt());
+        if ((begin < 0) || (begin > end)) qFatal("Invalid %s range %s.", qPrintable(key), qPrintable(file.get<QString>(key)));
+    }
+
+    void searchQuery(const InvertedIndex *index, const File &targetGallery, const Template &query, int count, QStringList *result) const
+    {
+        if (query.file.failed()) return;
+
+        TemplateList targets;
+        foreach (int candidate, index->candidates(query, targetGallery.get<int>("probes", 8)))
+            targets.append(index->templates[candidate]);
+
+        // Candidates are re-ranked with the algorithm's distance unless the coarse L2 ranking suffices
+        QList<float> scores;
+        if (targetGallery.get<bool>("rerank", true)) {
+            scores = distance->compare(targets, query);
+        } else {
+            foreach (const Template &target, targets)
+                scores.append(InvertedIndex::score(target, query));
+        }
+
+        appendRanked(query, targets, scores, count, result);
+    }
+
+    void searchRadius(const MultiIndexHash *hashes, int radius, const Template &query, int count, QStringList *result) const
+    {
+        if (query.file.failed()) return;
+
+        TemplateList targets;
+        foreach (int candidate, hashes->candidates(query, radius))
+            targets.append(hashes->templates[candidate]);
+        appendRanked(query, targets, distance->compare(targets, query), count, result);
+    }
+
+    static void appendRanked(const Template &query, const TemplateList &targets, const QList<float> &scores, int count, QStringList *result)
+    {
+        QList< QPair<float,int> > ranked; ranked.reserve(scores.size());
+        for (int i=0; i<scores.size(); i++)
+            ranked.append(QPair<float,int>(scores[i], i));
+        const int n = std::min(count, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin()+n, ranked.end(), std::greater< QPair<float,int> >());
+
+        for (int i=0; i<n; i++)
+            result->append(query.file.name + "," + targets[ranked[i].second].file.name + "," + QString::number(ranked[i].first));
+    }
+
+    // Templates are sent in one br::TemplateCodec segment, so their metadata keys are spelled out once per message
+    static QByteArray pack(const TemplateList &templates, int numFiles)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << numFiles << templates.size();
+        TemplateCodec codec;
+        foreach (const Template &t, templates)
+            codec.write(stream, t);
+        return data;
+    }
+
+    static TemplateList unpack(const QByteArray &data, int *numFiles)
+    {
+        QDataStream stream(data);
+        int size;
+        stream >> *numFiles >> size;
+        TemplateList templates; templates.reserve(size);
+        TemplateCodec codec;
+        Template t;
+        while ((templates.size() < size) && codec.read(stream, t))
+            templates.append(t);
+        if (templates.size() != size) qFatal("Corrupt enrollment message.");
+        return templates;
+    }
+
+    static QByteArray pack(const cv::Mat &scores)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << scores;
+        return data;
+    }
+
+    static void receiveStripe(int owner, Output *output, int queryBlock)
+    {
+        cv::Mat scores;
+        QDataStream stream(Distributed::receive(owner, CompareTag));
+        stream >> scores;
+
+        output->setBlock(queryBlock, -1);
+        for (int i=0; i<scores.rows; i++)
+            output->setRelative(scores.ptr<float>(i), i, 0, scores.cols);
+
+        Globals->currentStep += double(scores.rows) * double(scores.cols);
+        Globals->printStatus();
+    }
+
+    static void write(Gallery *gallery, const TemplateList &data, int numFiles, FileList &fileList, int &totalCount, int &failureCount, double &totalBytes)
+    {
+        {
+            Trace::Scope span("io", "Gallery::writeBlock");
+            gallery->writeBlock(data);
+        }
+        const FileList newFiles = data.files();
+        fileList.append(newFiles);
+
+        totalCount += newFiles.size();
+        failureCount += newFiles.failures();
+        totalBytes += data.bytes<double>();
+
+        int fte = 0, fto = 0;
+        foreach (const File &file, newFiles) {
+            if      (file.get<bool>("FTO", false)) fto++;
+            else if (file.get<bool>("FTE", false)) fte++;
+        }
+        Metrics::increment("br_templates_enrolled_total", newFiles.size());
+        Metrics::increment("br_template_bytes_written_total", data.bytes<double>());
+        if (fte) Metrics::increment("br_failures_total{reason=\"FTE\"}", fte);
+        if (fto) Metrics::increment("br_failures_total{reason=\"FTO\"}", fto);
+        Globals->currentStep += numFiles;
+        Globals->printStatus();
+    }
+
+    // One or a few representative templates of a subject, see br_aggregate
+    void aggregateSubject(const TemplateList &members, const QString &key, const QString &method, int count, Template *result) const
+    {
+        const File &first = members.first().file;
+        if ((members.size() == 1) && first.get<QString>(key, QString()).isEmpty()) {
+            *result = members.first();
+            return;
+        }
+
+        File file(first.get<QString>(key));
+        file.set(key, first.value(key));
+        if (first.contains("Label")) file.set("Label", first.value("Label"));
+        file.set("Members", members.size());
+
+        // Unit length members are averaged, so every member counts equally regardless of its magnitude
+        if (method == "Mean") {
+            cv::Mat sum;
+            foreach (const Template &t, members) {
+                if ((t.size() != 1) || (t.m().depth() != CV_32F)) qFatal("Mean aggregation requires single matrix floating point templates.");
+                cv::Mat m;
+                cv::normalize(t.m(), m);
+                if (sum.empty()) sum = m;
+                else if ((m.size() != sum.size()) || (m.type() != sum.type())) qFatal("Template size mismatch for subject %s.", qPrintable(file.name));
+                else sum += m;
+            }
+            cv::normalize(sum, sum);
+            *result = Template(file, sum);
+            return;
+        }
+
+        // scores[j][k] compares member j to member k
+        const int n = members.size();
+        QVector< QList<float> > scores(n);
+        for (int j=0; j<n; j++)
+            scores[j] = distance->compare(members, members[j]);
+
+        // The medoid is the member most similar to the others in total
+        int medoid = 0;
+        float bestTotal = -std::numeric_limits<float>::max();
+        for (int j=0; j<n; j++) {
+            float total = 0;
+            for (int k=0; k<n; k++)
+                if (k != j) total += scores[j][k];
+            if (total > bestTotal) {
+                bestTotal = total;
+                medoid = j;
+            }
+        }
+
+        // Greedy k-center, each new center is the member least similar to its nearest center
+        QList<int> centers; centers.append(medoid);
+        if (method == "Centers") {
+            QVector<float> nearest(n);
+            for (int j=0; j<n; j++)
+                nearest[j] = scores[j][medoid];
+            while (centers.size() < std::min(count, n)) {
+                int farthest = -1;
+                for (int j=0; j<n; j++)
+                    if (!centers.contains(j) && ((farthest == -1) || (nearest[j] < nearest[farthest])))
+                        farthest = j;
+                centers.append(farthest);
+                for (int j=0; j<n; j++)
+                    nearest[j] = std::max(nearest[j], scores[j][farthest]);
+            }
+        }
+
+        *result = Template(file);
+        foreach (int center, centers)
+            result->append(members[center]);
+    }
+
+    // Identity of a template across incremental comparisons, its name and contents
+    static QList<QByteArray> comparisonKeys(const TemplateList &templates)
+    {
+        QList<QByteArray> keys;
+        foreach (const Template &t, templates)
+            keys.append(t.file.name.toUtf8() + '\0' + duplicateKey(t));
+        return keys;
+    }
+
+    // Index of each key in previous, -1 for keys that are new
+    static QVector<int> previousIndices(const QList<QByteArray> &keys, const QList<QByteArray> &previous)
+    {
+        QHash<QByteArray, int> index;
+        for (int i=previous.size()-1; i>=0; i--)
+            index.insert(previous[i], i);
+        QVector<int> indices(keys.size());
+        for (int i=0; i<keys.size(); i++)
+            indices[i] = index.value(keys[i], -1);
+        return indices;
+    }
+
+    // Compares targets and queries and copies the scores into the given columns and rows of simmat
+    void compareInto(const TemplateList &targets, const TemplateList &queries, const QVector<int> &columns, const QVector<int> &rows, cv::Mat &simmat) const
+    {
+        if (targets.isEmpty() || queries.isEmpty()) return;
+        QScopedPointer<MatrixOutput> scores(MatrixOutput::make(targets.files(), queries.files()));
+        compareBlock(targets, queries, scores.data(), 0, 0);
+        for (int i=0; i<rows.size(); i++) {
+            const float *src = scores->data.ptr<float>(i);
+            float *dst = simmat.ptr<float>(rows[i]);
+            for (int j=0; j<columns.size(); j++)
+                dst[columns[j]] = src[j];
+        }
+    }
+
+    // Only the scores of new queries, and of old queries against new targets, are computed, the rest are copied from the previous output
+    void compareIncremental(Gallery *t, Gallery *q, const File &output)
+    {
+        if (output.suffix() != "mtx") qFatal("Incremental comparison requires a .mtx output.");
+        if (distance.isNull()) qFatal("Null distance.");
+        const TemplateList targets = t->read();
+        const TemplateList queries = q->read();
+        const QList<QByteArray> targetKeys = comparisonKeys(targets);
+        const QList<QByteArray> queryKeys = comparisonKeys(queries);
+
+        const QString keysFile = output.name + ".keys";
+        QList<QByteArray> previousTargetKeys, previousQueryKeys;
+        cv::Mat previous;
+        if (output.exists() && QFileInfo(keysFile).exists()) {
+            QByteArray data;
+            QtUtils::readFile(keysFile, data);
+            QDataStream stream(data);
+            QString previousDistance;
+            stream >> previousDistance >> previousTargetKeys >> previousQueryKeys;
+            previous = BEE::readSimmat(output);
+
+            // Scores of another distance, or a matrix rewritten since its keys, can't be reused
+            if ((previousDistance != distance->description()) || (previous.rows != previousQueryKeys.size()) || (previous.cols != previousTargetKeys.size())) {
+                qWarning("Recomputing %s, its keys don't match the matrix or the distance.", qPrintable(output.name));
+                previousTargetKeys.clear();
+                previousQueryKeys.clear();
+                previous = cv::Mat();
+            }
+        }
+
+        const QVector<int> previousColumns = previousIndices(targetKeys, previousTargetKeys);
+        const QVector<int> previousRows = previousIndices(queryKeys, previousQueryKeys);
+
+        cv::Mat simmat(queries.size(), targets.size(), CV_32FC1);
+        TemplateList newTargets, newQueries, oldQueries;
+        QVector<int> allColumns, newColumns, newRows, oldRows;
+        for (int j=0; j<targets.size(); j++) {
+            allColumns.append(j);
+            if (previousColumns[j] == -1) {
+                newTargets.append(targets[j]);
+                newColumns.append(j);
+            }
+        }
+        for (int i=0; i<queries.size(); i++) {
+            if (previousRows[i] == -1) {
+                newQueries.append(queries[i]);
+                newRows.append(i);
+                continue;
+            }
+
+            oldQueries.append(queries[i]);
+            oldRows.append(i);
+            const float *src = previous.ptr<float>(previousRows[i]);
+            float *dst = simmat.ptr<float>(i);
+            for (int j=0; j<targets.size(); j++)
+                if (previousColumns[j] != -1)
+                    dst[j] = src[previousColumns[j]];
+        }
+
+        Globals->currentStep = 0;
+        Globals->totalSteps = double(targets.size()) * double(newQueries.size()) + double(newTargets.size()) * double(oldQueries.size());
+        Globals->startTime.start();
+        compareInto(targets, newQueries, allColumns, newRows, simmat);
+        compareInto(newTargets, oldQueries, newColumns, oldRows, simmat);
+        qDebug("Reused %.0f of %.0f scores", double(targets.size()) * double(queries.size()) - Globals->totalSteps, double(targets.size()) * double(queries.size()));
+        Globals->totalSteps = 0;
+
+        BEE::writeSimmat(simmat, output, output.get<QString>("targetSigset", "Unknown_Target"), output.get<QString>("querySigset", "Unknown_Query"));
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << distance->description() << targetKeys << queryKeys;
+        QtUtils::writeFile(keysFile, data);
+    }
+
+    void compareBlock(const TemplateList &targets, const TemplateList &queries, Output *output, int queryBlock, int targetBlock, bool triangular = false) const
+    {
+        // Blocks below the diagonal of a triangular comparison were mirrored from the blocks above it
+        if (!triangular || (targetBlock >= queryBlock)) {
+            output->setBlock(queryBlock, targetBlock, triangular);
+            QElapsedTimer timer; timer.start();
+            distance->compare(targets, queries, output);
+            if (Globals->profile) Globals->addProfile(distance->objectName(), timer.nsecsElapsed(), 0, targets.size()*queries.size());
+            Metrics::observe("br_compare_block_seconds", timer.nsecsElapsed()/1e9);
+            Metrics::increment("br_comparisons_total", double(targets.size()) * double(queries.size()));
+            Trace::Scope span("io", "Output::completeBlock");
+            output->completeBlock();
+        }
+
+        Globals->currentStep += double(targets.size()) * double(queries.size());
+        Globals->printStatus();
+    }
 
     QString getFileName(const QString &description) const
     {
@@ -271,18 +1145,27 @@ private:
 };
 
 
+/*!
+ * \brief Caches every algorithm constructed by the process, each is loaded exactly once.
+ *
+ * The first requester of an algorithm constructs it while later requesters wait for it to finish,
+ * so concurrent first use doesn't load the same models several times.
+ */
 class AlgorithmManager : public Initializer
 {
     Q_OBJECT
 
 public:
     static QHash<QString, QSharedPointer<AlgorithmCore> > algorithms;
-    static QMutex algorithmsLock;
+    static QHash<QString, QThread*> loading; // Algorithms under construction and the thread constructing them
+    static QReadWriteLock algorithmsLock;
+    static QWaitCondition algorithmLoaded;
 
     void initialize() const {}
 
     void finalize() const
     {
+        QWriteLocker locker(&algorithmsLock);
         algorithms.clear();
     }
 
@@ -290,22 +1173,39 @@ public:
     {
         if (algorithm.isEmpty()) qFatal("No default algorithm set.");
 
-        if (!algorithms.contains(algorithm)) {
-            // Some algorithms are recursive, so we need to construct them outside the lock.
-            QSharedPointer<AlgorithmCore> algorithmCore(new AlgorithmCore(algorithm));
+        // Loaded algorithms are only ever read, so lookups proceed in parallel
+        {
+            QReadLocker locker(&algorithmsLock);
+            const QSharedPointer<AlgorithmCore> algorithmCore = algorithms.value(algorithm);
+            if (algorithmCore) return algorithmCore;
+        }
 
-            algorithmsLock.lock();
-            if (!algorithms.contains(algorithm))
-                algorithms.insert(algorithm, algorithmCore);
-            algorithmsLock.unlock();
+        QWriteLocker locker(&algorithmsLock);
+        forever {
+            const QSharedPointer<AlgorithmCore> algorithmCore = algorithms.value(algorithm);
+            if (algorithmCore) return algorithmCore;
+            if (!loading.contains(algorithm)) break;
+            if (loading[algorithm] == QThread::currentThread()) qFatal("Algorithm %s depends on itself.", qPrintable(algorithm));
+            algorithmLoaded.wait(&algorithmsLock);
         }
 
-        return algorithms[algorithm];
+        // Some algorithms are recursive, so we need to construct them outside the lock.
+        loading.insert(algorithm, QThread::currentThread());
+        locker.unlock();
+        const QSharedPointer<AlgorithmCore> algorithmCore(new AlgorithmCore(algorithm));
+
+        locker.relock();
+        loading.remove(algorithm);
+        algorithms.insert(algorithm, algorithmCore);
+        algorithmLoaded.wakeAll();
+        return algorithmCore;
     }
 };
 
 QHash<QString, QSharedPointer<AlgorithmCore> > AlgorithmManager::algorithms;
-QMutex AlgorithmManager::algorithmsLock;
+QHash<QString, QThread*> AlgorithmManager::loading;
+QReadWriteLock AlgorithmManager::algorithmsLock;
+QWaitCondition AlgorithmManager::algorithmLoaded;
 
 BR_REGISTER(Initializer, AlgorithmManager)
 
@@ -329,6 +1229,134 @@ FileList br::Enroll(const File &input, const File &gallery)
     return AlgorithmManager::getAlgorithm(gallery.get<QString>("algorithm"))->enroll(input, gallery);
 }
 
+Template br::EnrollTemplate(const Template &input, const QString &algorithm)
+{
+    return AlgorithmManager::getAlgorithm(algorithm.isEmpty() ? Globals->algorithm : algorithm)->enroll(input);
+}
+
+float br::CompareTemplates(const Template &target, const Template &query, const QString &algorithm)
+{
+    return AlgorithmManager::getAlgorithm(algorithm.isEmpty() ? Globals->algorithm : algorithm)->compare(target, query);
+}
+
+/* ResidentGallery - public methods */
+ResidentGallery::ResidentGallery(const QString &algorithm)
+{
+    distance = Distance::fromAlgorithm(algorithm.isEmpty() ? Globals->algorithm : algorithm);
+    if (distance.isNull()) qFatal("Resident galleries require an algorithm with a distance.");
+}
+
+void ResidentGallery::add(const TemplateList &templates)
+{
+    TemplateList enrolled;
+    foreach (const Template &t, templates)
+        if (!t.file.failed() && !t.isEmpty())
+            enrolled.append(t);
+    if (enrolled.isEmpty()) return;
+
+    // Pack outside the update lock, other writers only wait to publish
+    const Segment segment = pack(enrolled);
+
+    QMutexLocker locker(&updateLock);
+    QList<Segment> updated = segments;
+    updated.append(segment);
+
+    // Compact many small additions into one segment so searches stay contiguous
+    if (updated.size() > Max_Segments) {
+        TemplateList merged;
+        foreach (const Segment &s, updated)
+            merged.append(*s);
+        updated = QList<Segment>() << pack(merged);
+    }
+    publish(updated);
+}
+
+int ResidentGallery::remove(const QString &name)
+{
+    QMutexLocker locker(&updateLock);
+    int removed = 0;
+    QList<Segment> updated;
+    foreach (const Segment &segment, segments) {
+        TemplateList kept;
+        foreach (const Template &t, *segment)
+            if (t.file.name != name) kept.append(t);
+
+        removed += segment->size() - kept.size();
+        if (kept.size() == segment->size()) updated.append(segment);
+        else if (!kept.isEmpty())           updated.append(pack(kept));
+    }
+    if (removed > 0) publish(updated);
+    return removed;
+}
+
+int ResidentGallery::size() const
+{
+    QReadLocker locker(&segmentsLock);
+    int size = 0;
+    foreach (const Segment &segment, segments)
+        size += segment->size();
+    return size;
+}
+
+QList<ResidentGallery::Match> ResidentGallery::search(const Template &query, int count) const
+{
+    QList<Segment> pinned;
+    {
+        QReadLocker locker(&segmentsLock);
+        pinned = segments;
+    }
+
+    QList<Match> matches;
+    if (query.file.failed() || (count <= 0)) return matches;
+
+    // Keep the best matches in a min-heap, whose minimum bounds the comparisons that follow once it is full
+    typedef QPair<float,const Template*> Ranked;
+    QVector<Ranked> heap;
+    QVector<float> scores(Search_Batch);
+    foreach (const Segment &segment, pinned) {
+        for (int offset=0; offset<segment->size(); offset+=Search_Batch) {
+            const int batch = std::min(int(Search_Batch), segment->size()-offset);
+            const float lower = (heap.size() < count) ? -std::numeric_limits<float>::max() : heap.first().first;
+            distance->compareBatchBounded(*segment, query, scores.data(), offset, batch, lower, std::numeric_limits<float>::max());
+            for (int i=0; i<batch; i++) {
+                const Ranked candidate(scores[i], &segment->at(offset+i));
+                if (heap.size() < count) {
+                    heap.append(candidate);
+                    std::push_heap(heap.begin(), heap.end(), std::greater<Ranked>());
+                } else if (candidate > heap.first()) {
+                    std::pop_heap(heap.begin(), heap.end(), std::greater<Ranked>());
+                    heap.last() = candidate;
+                    std::push_heap(heap.begin(), heap.end(), std::greater<Ranked>());
+                }
+            }
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), std::greater<Ranked>());
+    foreach (const Ranked &ranked, heap)
+        matches.append(Match(ranked.first, ranked.second->file));
+    return matches;
+}
+
+/* ResidentGallery - private methods */
+void ResidentGallery::publish(const QList<Segment> &updated)
+{
+    QWriteLocker locker(&segmentsLock);
+    segments = updated;
+}
+
+ResidentGallery::Segment ResidentGallery::pack(const TemplateList &templates)
+{
+    QSharedPointer<TemplateList> segment(new TemplateList(templates));
+
+    // Multi-matrix templates are compared one at a time instead
+    bool single = true;
+    foreach (const Template &t, templates)
+        single = single && (t.size() == 1);
+    if (single) segment->align();
+    return segment;
+}
+
 void br::Compare(const File &targetGallery, const File &queryGallery, const File &output)
 {
     qDebug("Comparing %s and %s%s", qPrintable(targetGallery.flat()),
@@ -337,6 +1365,34 @@ void br::Compare(const File &targetGallery, const File &queryGallery, const File
     AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->compare(targetGallery, queryGallery, output);
 }
 
+void br::Search(const File &targetGallery, const File &queryGallery, int count, const File &output)
+{
+    qDebug("Searching %s for the %d best matches of %s%s", qPrintable(targetGallery.flat()), count,
+                                                           qPrintable(queryGallery.flat()),
+                                                           output.isNull() ? "" : qPrintable(" to " + output.flat()));
+    AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->search(targetGallery, queryGallery, count, output);
+}
+
+void br::ClusterNeighbors(const File &gallery, int k, float aggressiveness, const QString &csv)
+{
+    qDebug("Clustering %s by its %d nearest neighbors%s", qPrintable(gallery.flat()), k, csv.isEmpty() ? "" : qPrintable(" to " + csv));
+    AlgorithmManager::getAlgorithm(gallery.get<QString>("algorithm"))->cluster(gallery, k, aggressiveness, csv);
+}
+
+void br::Aggregate(const File &inputGallery, const File &outputGallery)
+{
+    qDebug("Aggregating %s to %s", qPrintable(inputGallery.flat()), qPrintable(outputGallery.flat()));
+    AlgorithmManager::getAlgorithm(outputGallery.get<QString>("algorithm"))->aggregate(inputGallery, outputGallery);
+}
+
+void br::Deduplicate(const File &targetGallery, const File &queryGallery, const File &output)
+{
+    qDebug("Deduplicating %s and %s%s", qPrintable(targetGallery.flat()),
+                                        qPrintable(queryGallery.flat()),
+                                        output.isNull() ? "" : qPrintable(" to " + output.flat()));
+    AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->deduplicate(targetGallery, queryGallery, output);
+}
+
 void br::Convert(const File &src, const File &dst)
 {
     qDebug("Converting %s to %s", qPrintable(src.flat()), qPrintable(dst.flat()));
@@ -352,10 +1408,28 @@ void br::Cat(const QStringList &inputGalleries, const QString &outputGallery)
         if (inputGallery == outputGallery)
             qFatal("outputGallery must not be in inputGalleries.");
     QScopedPointer<Gallery> og(Gallery::make(outputGallery));
-    foreach (const QString &inputGallery, inputGalleries) {
-        QScopedPointer<Gallery> ig(Gallery::make(inputGallery));
+
+    // Galleries whose formats allow it are copied byte for byte
+    FileList inputs;
+    foreach (const QString &inputGallery, inputGalleries)
+        inputs.append(inputGallery);
+    if (og->append(inputs)) return;
+
+    foreach (const File &input, inputs) {
+        QScopedPointer<Gallery> ig(Gallery::make(input));
+        const int pos = input.get<int>("pos", 0);
+        const int length = input.get<int>("length", -1);
+        const int step = std::max(1, input.get<int>("step", 1));
+        int index = 0;
         bool done = false;
-        while (!done) og->writeBlock(ig->readBlock(&done));
+        while (!done && ((length < 0) || (index < pos+length))) {
+            const TemplateList block = ig->readBlock(&done);
+            TemplateList selected;
+            for (int j=0; j<block.size(); j++, index++)
+                if ((index >= pos) && ((length < 0) || (index < pos+length)) && ((index-pos) % step == 0))
+                    selected.append(block[j]);
+            og->writeBlock(selected);
+        }
     }
 }
 
@@ -0,0 +1,843 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "distance_sse.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define BR_X86
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#  if !defined(__GNUC__) || defined(__clang__) || (__GNUC__ >= 5)
+#    define BR_AVX512
+#  endif
+#  if defined(_MSC_VER) || (defined(__clang__) && (__clang_major__ >= 6)) || (!defined(__clang__) && defined(__GNUC__) && (__GNUC__ >= 8))
+#    define BR_AVX512_VPOPCNTDQ
+#  endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define BR_NEON
+#  include <arm_neon.h>
+#endif
+
+// Allows kernels for newer instruction sets to be compiled without raising the baseline architecture
+#if defined(__GNUC__) || defined(__clang__)
+#  define BR_TARGET(ISA) __attribute__((target(ISA)))
+#else
+#  define BR_TARGET(ISA)
+#endif
+
+/**** Scalar ****/
+static int l1Scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+static int packedL1Scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs((a[i] & 0x0F) - (b[i] & 0x0F)) +
+                    abs((a[i] >> 4)   - (b[i] >> 4));
+    return distance;
+}
+
+static float floatL1Scalar(const float *a, const float *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++)
+        distance += fabs(a[i]-b[i]);
+    return distance;
+}
+
+static float floatL2Scalar(const float *a, const float *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++) {
+        const float delta = a[i]-b[i];
+        distance += delta * delta;
+    }
+    return distance;
+}
+
+static void cosineTermsScalar(const float *a, const float *b, int size, float *dot, float *magA, float *magB)
+{
+    for (int i=0; i<size; i++) {
+        *dot += a[i] * b[i];
+        *magA += a[i] * a[i];
+        *magB += b[i] * b[i];
+    }
+}
+
+static float cosineScalar(const float *a, const float *b, int size)
+{
+    float dot = 0, magA = 0, magB = 0;
+    cosineTermsScalar(a, b, size, &dot, &magA, &magB);
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+static inline int popcount64(quint64 x)
+{
+    x = x - ((x >> 1) & Q_UINT64_C(0x5555555555555555));
+    x = (x & Q_UINT64_C(0x3333333333333333)) + ((x >> 2) & Q_UINT64_C(0x3333333333333333));
+    x = (x + (x >> 4)) & Q_UINT64_C(0x0F0F0F0F0F0F0F0F);
+    return int((x * Q_UINT64_C(0x0101010101010101)) >> 56);
+}
+
+static int int8L2Scalar(const qint8 *a, const qint8 *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++) {
+        const int x = a[i] - b[i];
+        distance += x*x;
+    }
+    return distance;
+}
+
+static int int8DotScalar(const qint8 *a, const qint8 *b, int size)
+{
+    int dot = 0;
+    for (int i=0; i<size; i++)
+        dot += a[i] * b[i];
+    return dot;
+}
+
+static float halfL2Scalar(const quint16 *a, const quint16 *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++) {
+        const float x = fromHalf(a[i]) - fromHalf(b[i]);
+        distance += x*x;
+    }
+    return distance;
+}
+
+static float halfDotScalar(const quint16 *a, const quint16 *b, int size)
+{
+    float dot = 0;
+    for (int i=0; i<size; i++)
+        dot += fromHalf(a[i]) * fromHalf(b[i]);
+    return dot;
+}
+
+static int hammingScalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0, i = 0;
+    for (; i+8<=size; i+=8) {
+        quint64 x, y;
+        memcpy(&x, a+i, 8);
+        memcpy(&y, b+i, 8);
+        distance += popcount64(x ^ y);
+    }
+    for (; i<size; i++)
+        distance += popcount64(a[i] ^ b[i]);
+    return distance;
+}
+
+#ifdef BR_X86
+
+/**** POPCNT ****/
+BR_TARGET("popcnt") static int hammingPOPCNT(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0, i = 0;
+#if defined(__x86_64__) || defined(_M_X64)
+    for (; i+8<=size; i+=8) {
+        quint64 x, y;
+        memcpy(&x, a+i, 8);
+        memcpy(&y, b+i, 8);
+        distance += int(_mm_popcnt_u64(x ^ y));
+    }
+#endif
+    for (; i+4<=size; i+=4) {
+        quint32 x, y;
+        memcpy(&x, a+i, 4);
+        memcpy(&y, b+i, 4);
+        distance += _mm_popcnt_u32(x ^ y);
+    }
+    for (; i<size; i++)
+        distance += _mm_popcnt_u32(a[i] ^ b[i]);
+    return distance;
+}
+
+/**** SSE2 ****/
+BR_TARGET("sse2") static int l1SSE2(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 16;
+    __m128i accumulate = _mm_setzero_si128();
+    for (int i=0; i<n; i+=16)
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)),
+                                                            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i))));
+    qint64 buffer[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer), accumulate);
+    return int(buffer[0] + buffer[1]) + l1Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("sse2") static int packedL1SSE2(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 16;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+    for (int i=0; i<n; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        const __m128i low = _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask));
+        const __m128i high = _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask));
+        accumulate = _mm_add_epi64(accumulate, _mm_add_epi64(low, high));
+    }
+    qint64 buffer[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer), accumulate);
+    return int(buffer[0] + buffer[1]) + packedL1Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("sse2") static float sum(__m128 v)
+{
+    float buffer[4];
+    _mm_storeu_ps(buffer, v);
+    return (buffer[0] + buffer[1]) + (buffer[2] + buffer[3]);
+}
+
+BR_TARGET("sse2") static float floatL1SSE2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 accumulate = _mm_setzero_ps();
+    for (int i=0; i<n; i+=4)
+        accumulate = _mm_add_ps(accumulate, _mm_and_ps(mask, _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i))));
+    return sum(accumulate) + floatL1Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("sse2") static float floatL2SSE2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    __m128 accumulate = _mm_setzero_ps();
+    for (int i=0; i<n; i+=4) {
+        const __m128 delta = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        accumulate = _mm_add_ps(accumulate, _mm_mul_ps(delta, delta));
+    }
+    return sum(accumulate) + floatL2Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("sse2") static float cosineSSE2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    __m128 dots = _mm_setzero_ps(), magAs = _mm_setzero_ps(), magBs = _mm_setzero_ps();
+    for (int i=0; i<n; i+=4) {
+        const __m128 A = _mm_loadu_ps(a+i);
+        const __m128 B = _mm_loadu_ps(b+i);
+        dots = _mm_add_ps(dots, _mm_mul_ps(A, B));
+        magAs = _mm_add_ps(magAs, _mm_mul_ps(A, A));
+        magBs = _mm_add_ps(magBs, _mm_mul_ps(B, B));
+    }
+    float dot = sum(dots), magA = sum(magAs), magB = sum(magBs);
+    cosineTermsScalar(a+n, b+n, size-n, &dot, &magA, &magB);
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+/**** AVX2 ****/
+BR_TARGET("avx2") static qint64 sum(__m256i v)
+{
+    qint64 buffer[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buffer), v);
+    return (buffer[0] + buffer[1]) + (buffer[2] + buffer[3]);
+}
+
+BR_TARGET("avx2") static float sum(__m256 v)
+{
+    float buffer[8];
+    _mm256_storeu_ps(buffer, v);
+    return ((buffer[0] + buffer[1]) + (buffer[2] + buffer[3])) + ((buffer[4] + buffer[5]) + (buffer[6] + buffer[7]));
+}
+
+BR_TARGET("avx2") static int sumInt32(__m256i v)
+{
+    qint32 buffer[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buffer), v);
+    return ((buffer[0] + buffer[1]) + (buffer[2] + buffer[3])) + ((buffer[4] + buffer[5]) + (buffer[6] + buffer[7]));
+}
+
+BR_TARGET("avx2") static int l1AVX2(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 32;
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<n; i+=32)
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)),
+                                                                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i))));
+    return int(sum(accumulate)) + l1SSE2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static int packedL1AVX2(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 32;
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<n; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+        const __m256i low = _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask));
+        const __m256i high = _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_add_epi64(low, high));
+    }
+    return int(sum(accumulate)) + packedL1SSE2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static float floatL1AVX2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 8;
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8)
+        accumulate = _mm256_add_ps(accumulate, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i))));
+    return sum(accumulate) + floatL1SSE2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static float floatL2AVX2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 8;
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8) {
+        const __m256 delta = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(delta, delta));
+    }
+    return sum(accumulate) + floatL2SSE2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static float cosineAVX2(const float *a, const float *b, int size)
+{
+    const int n = size - size % 8;
+    __m256 dots = _mm256_setzero_ps(), magAs = _mm256_setzero_ps(), magBs = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8) {
+        const __m256 A = _mm256_loadu_ps(a+i);
+        const __m256 B = _mm256_loadu_ps(b+i);
+        dots = _mm256_add_ps(dots, _mm256_mul_ps(A, B));
+        magAs = _mm256_add_ps(magAs, _mm256_mul_ps(A, A));
+        magBs = _mm256_add_ps(magBs, _mm256_mul_ps(B, B));
+    }
+    float dot = sum(dots), magA = sum(magAs), magB = sum(magBs);
+    cosineTermsScalar(a+n, b+n, size-n, &dot, &magA, &magB);
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+BR_TARGET("avx2") static int hammingAVX2(const uchar *a, const uchar *b, int size)
+{
+    // Short codes are cheaper as a few scalar population counts, every AVX2 processor has POPCNT
+    if (size <= 64) return hammingPOPCNT(a, b, size);
+
+    // Per-nibble population count lookup
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const int n = size - size % 32;
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<n; i+=32) {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)),
+                                           _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i)));
+        const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, mask)),
+                                               _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    return int(sum(accumulate)) + hammingPOPCNT(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static int int8L2AVX2(const qint8 *a, const qint8 *b, int size)
+{
+    // Differences fit in 16 bits and pairs of their squares in 32 bits
+    const int n = size - size % 16;
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<n; i+=16) {
+        const __m256i x = _mm256_sub_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i))),
+                                           _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i))));
+        accumulate = _mm256_add_epi32(accumulate, _mm256_madd_epi16(x, x));
+    }
+    return sumInt32(accumulate) + int8L2Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2") static int int8DotAVX2(const qint8 *a, const qint8 *b, int size)
+{
+    const int n = size - size % 16;
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<n; i+=16)
+        accumulate = _mm256_add_epi32(accumulate, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i))),
+                                                                    _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)))));
+    return sumInt32(accumulate) + int8DotScalar(a+n, b+n, size-n);
+}
+
+// Every AVX2 processor also converts half precision with F16C
+BR_TARGET("avx2,f16c") static float halfL2AVX2(const quint16 *a, const quint16 *b, int size)
+{
+    const int n = size - size % 8;
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8) {
+        const __m256 x = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i))),
+                                       _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i))));
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(x, x));
+    }
+    return sum(accumulate) + halfL2Scalar(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx2,f16c") static float halfDotAVX2(const quint16 *a, const quint16 *b, int size)
+{
+    const int n = size - size % 8;
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8)
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i))),
+                                                             _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i)))));
+    return sum(accumulate) + halfDotScalar(a+n, b+n, size-n);
+}
+
+#ifdef BR_AVX512
+
+/**** AVX-512BW ****/
+BR_TARGET("avx512f,avx512bw") static qint64 sum(__m512i v)
+{
+    qint64 buffer[8];
+    _mm512_storeu_si512(buffer, v);
+    return ((buffer[0] + buffer[1]) + (buffer[2] + buffer[3])) + ((buffer[4] + buffer[5]) + (buffer[6] + buffer[7]));
+}
+
+BR_TARGET("avx512f,avx512bw") static float sum(__m512 v)
+{
+    float buffer[16];
+    _mm512_storeu_ps(buffer, v);
+    float result = 0;
+    for (int i=0; i<16; i++)
+        result += buffer[i];
+    return result;
+}
+
+BR_TARGET("avx512f,avx512bw") static int l1AVX512(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 64;
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<n; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i)));
+    return int(sum(accumulate)) + l1AVX2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx512f,avx512bw") static int packedL1AVX512(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 64;
+    const __m512i mask = _mm512_set1_epi32(0x0F0F0F0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<n; i+=64) {
+        const __m512i A = _mm512_loadu_si512(a+i);
+        const __m512i B = _mm512_loadu_si512(b+i);
+        const __m512i low = _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask));
+        const __m512i high = _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask), _mm512_and_si512(_mm512_srli_epi16(B, 4), mask));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_add_epi64(low, high));
+    }
+    return int(sum(accumulate)) + packedL1AVX2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx512f,avx512bw") static float floatL1AVX512(const float *a, const float *b, int size)
+{
+    const int n = size - size % 16;
+    const __m512i mask = _mm512_set1_epi32(0x7FFFFFFF);
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<n; i+=16) {
+        const __m512 delta = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        accumulate = _mm512_add_ps(accumulate, _mm512_castsi512_ps(_mm512_and_si512(mask, _mm512_castps_si512(delta))));
+    }
+    return sum(accumulate) + floatL1AVX2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx512f,avx512bw") static float floatL2AVX512(const float *a, const float *b, int size)
+{
+    const int n = size - size % 16;
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<n; i+=16) {
+        const __m512 delta = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        accumulate = _mm512_add_ps(accumulate, _mm512_mul_ps(delta, delta));
+    }
+    return sum(accumulate) + floatL2AVX2(a+n, b+n, size-n);
+}
+
+BR_TARGET("avx512f,avx512bw") static float cosineAVX512(const float *a, const float *b, int size)
+{
+    const int n = size - size % 16;
+    __m512 dots = _mm512_setzero_ps(), magAs = _mm512_setzero_ps(), magBs = _mm512_setzero_ps();
+    for (int i=0; i<n; i+=16) {
+        const __m512 A = _mm512_loadu_ps(a+i);
+        const __m512 B = _mm512_loadu_ps(b+i);
+        dots = _mm512_add_ps(dots, _mm512_mul_ps(A, B));
+        magAs = _mm512_add_ps(magAs, _mm512_mul_ps(A, A));
+        magBs = _mm512_add_ps(magBs, _mm512_mul_ps(B, B));
+    }
+    float dot = sum(dots), magA = sum(magAs), magB = sum(magBs);
+    cosineTermsScalar(a+n, b+n, size-n, &dot, &magA, &magB);
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+BR_TARGET("avx512f,avx512bw") static int hammingAVX512(const uchar *a, const uchar *b, int size)
+{
+    // Per-nibble population count lookup replicated across each 128-bit lane
+    const __m512i lookup = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+    const __m512i mask = _mm512_set1_epi32(0x0F0F0F0F);
+    const int n = size - size % 64;
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<n; i+=64) {
+        const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i));
+        const __m512i counts = _mm512_add_epi8(_mm512_shuffle_epi8(lookup, _mm512_and_si512(x, mask)),
+                                               _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(x, 4), mask)));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(counts, _mm512_setzero_si512()));
+    }
+    return int(sum(accumulate)) + hammingAVX2(a+n, b+n, size-n);
+}
+
+#ifdef BR_AVX512_VPOPCNTDQ
+BR_TARGET("avx512f,avx512bw,avx512vpopcntdq") static int hammingVPOPCNTDQ(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 64;
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<n; i+=64) {
+        const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_popcnt_epi64(x));
+    }
+    return int(sum(accumulate)) + hammingAVX2(a+n, b+n, size-n);
+}
+#endif // BR_AVX512_VPOPCNTDQ
+
+#endif // BR_AVX512
+
+static void cpuFeatures(bool *sse2, bool *popcnt, bool *avx2, bool *avx512bw, bool *vpopcntdq)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    *sse2 = __builtin_cpu_supports("sse2");
+    *popcnt = __builtin_cpu_supports("popcnt");
+    *avx2 = __builtin_cpu_supports("avx2");
+#  ifdef BR_AVX512
+    *avx512bw = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#  else
+    *avx512bw = false;
+#  endif
+#  ifdef BR_AVX512_VPOPCNTDQ
+    *vpopcntdq = *avx512bw && __builtin_cpu_supports("avx512vpopcntdq");
+#  else
+    *vpopcntdq = false;
+#  endif
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int ids = info[0];
+    __cpuid(info, 1);
+    *sse2 = (info[3] & (1 << 26)) != 0;
+    *popcnt = (info[2] & (1 << 23)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    *avx2 = *avx512bw = *vpopcntdq = false;
+    if (ids >= 7) {
+        __cpuidex(info, 7, 0);
+        *avx2 = ((info[1] & (1 << 5)) != 0) && ((xcr0 & 0x06) == 0x06);
+        *avx512bw = ((info[1] & (1 << 16)) != 0) && ((info[1] & (1 << 30)) != 0) && ((xcr0 & 0xE6) == 0xE6);
+        *vpopcntdq = *avx512bw && ((info[2] & (1 << 14)) != 0);
+    }
+#else
+    *sse2 = *popcnt = *avx2 = *avx512bw = *vpopcntdq = false;
+#endif
+}
+
+#endif // BR_X86
+
+#ifdef BR_NEON
+
+/**** NEON ****/
+static inline quint32 sum(uint32x4_t v)
+{
+    return (vgetq_lane_u32(v, 0) + vgetq_lane_u32(v, 1)) + (vgetq_lane_u32(v, 2) + vgetq_lane_u32(v, 3));
+}
+
+static inline float sum(float32x4_t v)
+{
+    return (vgetq_lane_f32(v, 0) + vgetq_lane_f32(v, 1)) + (vgetq_lane_f32(v, 2) + vgetq_lane_f32(v, 3));
+}
+
+static int l1NEON(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 16;
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    for (int i=0; i<n; i+=16)
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i))));
+    return int(sum(accumulate)) + l1Scalar(a+n, b+n, size-n);
+}
+
+static int packedL1NEON(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 16;
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    for (int i=0; i<n; i+=16) {
+        const uint8x16_t A = vld1q_u8(a+i);
+        const uint8x16_t B = vld1q_u8(b+i);
+        const uint8x16_t delta = vaddq_u8(vabdq_u8(vandq_u8(A, mask), vandq_u8(B, mask)),
+                                          vabdq_u8(vshrq_n_u8(A, 4), vshrq_n_u8(B, 4)));
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(delta));
+    }
+    return int(sum(accumulate)) + packedL1Scalar(a+n, b+n, size-n);
+}
+
+static float floatL1NEON(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    float32x4_t accumulate = vdupq_n_f32(0);
+    for (int i=0; i<n; i+=4)
+        accumulate = vaddq_f32(accumulate, vabdq_f32(vld1q_f32(a+i), vld1q_f32(b+i)));
+    return sum(accumulate) + floatL1Scalar(a+n, b+n, size-n);
+}
+
+static float floatL2NEON(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    float32x4_t accumulate = vdupq_n_f32(0);
+    for (int i=0; i<n; i+=4) {
+        const float32x4_t delta = vsubq_f32(vld1q_f32(a+i), vld1q_f32(b+i));
+        accumulate = vmlaq_f32(accumulate, delta, delta);
+    }
+    return sum(accumulate) + floatL2Scalar(a+n, b+n, size-n);
+}
+
+static float cosineNEON(const float *a, const float *b, int size)
+{
+    const int n = size - size % 4;
+    float32x4_t dots = vdupq_n_f32(0), magAs = vdupq_n_f32(0), magBs = vdupq_n_f32(0);
+    for (int i=0; i<n; i+=4) {
+        const float32x4_t A = vld1q_f32(a+i);
+        const float32x4_t B = vld1q_f32(b+i);
+        dots = vmlaq_f32(dots, A, B);
+        magAs = vmlaq_f32(magAs, A, A);
+        magBs = vmlaq_f32(magBs, B, B);
+    }
+    float dot = sum(dots), magA = sum(magAs), magB = sum(magBs);
+    cosineTermsScalar(a+n, b+n, size-n, &dot, &magA, &magB);
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+static int hammingNEON(const uchar *a, const uchar *b, int size)
+{
+    const int n = size - size % 16;
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    for (int i=0; i<n; i+=16)
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(vcntq_u8(veorq_u8(vld1q_u8(a+i), vld1q_u8(b+i)))));
+    return int(sum(accumulate)) + hammingScalar(a+n, b+n, size-n);
+}
+
+#endif // BR_NEON
+
+/**** Fixed sizes ****/
+// Specializations of the kernels above for one size, whose loops have constant trip counts and no tails.
+// They accumulate in the same order as the generic kernels, so they return identical results.
+template <int Size> static int l1Fixed(const uchar *a, const uchar *b, int)
+{
+    return l1Scalar(a, b, Size);
+}
+
+template <int Size> static float floatL1Fixed(const float *a, const float *b, int)
+{
+    return floatL1Scalar(a, b, Size);
+}
+
+template <int Size> static float floatL2Fixed(const float *a, const float *b, int)
+{
+    return floatL2Scalar(a, b, Size);
+}
+
+#ifdef BR_X86
+
+template <int Size> BR_TARGET("sse2") static int l1SSE2Fixed(const uchar *a, const uchar *b, int)
+{
+    __m128i accumulate = _mm_setzero_si128();
+    for (int i=0; i<Size; i+=16)
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)),
+                                                            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i))));
+    qint64 buffer[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer), accumulate);
+    return int(buffer[0] + buffer[1]);
+}
+
+template <int Size> BR_TARGET("sse2") static float floatL1SSE2Fixed(const float *a, const float *b, int)
+{
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 accumulate = _mm_setzero_ps();
+    for (int i=0; i<Size; i+=4)
+        accumulate = _mm_add_ps(accumulate, _mm_and_ps(mask, _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i))));
+    return sum(accumulate);
+}
+
+template <int Size> BR_TARGET("sse2") static float floatL2SSE2Fixed(const float *a, const float *b, int)
+{
+    __m128 accumulate = _mm_setzero_ps();
+    for (int i=0; i<Size; i+=4) {
+        const __m128 delta = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        accumulate = _mm_add_ps(accumulate, _mm_mul_ps(delta, delta));
+    }
+    return sum(accumulate);
+}
+
+template <int Size> BR_TARGET("avx2") static int l1AVX2Fixed(const uchar *a, const uchar *b, int)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<Size; i+=32)
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)),
+                                                                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i))));
+    return int(sum(accumulate));
+}
+
+template <int Size> BR_TARGET("avx2") static float floatL1AVX2Fixed(const float *a, const float *b, int)
+{
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<Size; i+=8)
+        accumulate = _mm256_add_ps(accumulate, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i))));
+    return sum(accumulate);
+}
+
+template <int Size> BR_TARGET("avx2") static float floatL2AVX2Fixed(const float *a, const float *b, int)
+{
+    __m256 accumulate = _mm256_setzero_ps();
+    for (int i=0; i<Size; i+=8) {
+        const __m256 delta = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(delta, delta));
+    }
+    return sum(accumulate);
+}
+
+#ifdef BR_AVX512
+
+template <int Size> BR_TARGET("avx512f,avx512bw") static int l1AVX512Fixed(const uchar *a, const uchar *b, int)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<Size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i)));
+    return int(sum(accumulate));
+}
+
+template <int Size> BR_TARGET("avx512f,avx512bw") static float floatL1AVX512Fixed(const float *a, const float *b, int)
+{
+    const __m512i mask = _mm512_set1_epi32(0x7FFFFFFF);
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<Size; i+=16) {
+        const __m512 delta = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        accumulate = _mm512_add_ps(accumulate, _mm512_castsi512_ps(_mm512_and_si512(mask, _mm512_castps_si512(delta))));
+    }
+    return sum(accumulate);
+}
+
+template <int Size> BR_TARGET("avx512f,avx512bw") static float floatL2AVX512Fixed(const float *a, const float *b, int)
+{
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<Size; i+=16) {
+        const __m512 delta = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        accumulate = _mm512_add_ps(accumulate, _mm512_mul_ps(delta, delta));
+    }
+    return sum(accumulate);
+}
+
+#endif // BR_AVX512
+
+#endif // BR_X86
+
+// Instruction set of the kernels picked by initializeDistanceKernels()
+enum InstructionSet { ScalarSet, SSE2Set, AVX2Set, AVX512Set, NEONSet };
+static InstructionSet instructionSet = ScalarSet;
+
+template <int Size>
+static void specialize(DistanceKernels *kernels)
+{
+    switch (instructionSet) {
+#ifdef BR_X86
+#  ifdef BR_AVX512
+      case AVX512Set:
+        kernels->l1 = l1AVX512Fixed<Size>;
+        kernels->floatL1 = floatL1AVX512Fixed<Size>;
+        kernels->floatL2 = floatL2AVX512Fixed<Size>;
+        break;
+#  endif // BR_AVX512
+      case AVX2Set:
+        kernels->l1 = l1AVX2Fixed<Size>;
+        kernels->floatL1 = floatL1AVX2Fixed<Size>;
+        kernels->floatL2 = floatL2AVX2Fixed<Size>;
+        break;
+      case SSE2Set:
+        kernels->l1 = l1SSE2Fixed<Size>;
+        kernels->floatL1 = floatL1SSE2Fixed<Size>;
+        kernels->floatL2 = floatL2SSE2Fixed<Size>;
+        break;
+#endif // BR_X86
+      case ScalarSet:
+        kernels->l1 = l1Fixed<Size>;
+        kernels->floatL1 = floatL1Fixed<Size>;
+        kernels->floatL2 = floatL2Fixed<Size>;
+        break;
+      default: // The generic NEON kernels already outpace scalar code
+        break;
+    }
+}
+
+bool specializeDistanceKernels(int size, DistanceKernels *kernels)
+{
+    *kernels = distanceKernels;
+    switch (size) {
+#define BR_SPECIALIZE(SIZE) case SIZE: specialize<SIZE>(kernels); return true;
+      BR_SPECIALIZED_SIZES(BR_SPECIALIZE)
+#undef BR_SPECIALIZE
+      default: return false;
+    }
+}
+
+DistanceKernels distanceKernels = { "Scalar", l1Scalar, packedL1Scalar, floatL1Scalar, floatL2Scalar, cosineScalar, hammingScalar,
+                                     int8L2Scalar, int8DotScalar, halfL2Scalar, halfDotScalar };
+
+void initializeDistanceKernels()
+{
+#if defined(BR_X86)
+    bool sse2, popcnt, avx2, avx512bw, vpopcntdq;
+    cpuFeatures(&sse2, &popcnt, &avx2, &avx512bw, &vpopcntdq);
+#  ifdef BR_AVX512
+    if (avx512bw) {
+        const DistanceKernels kernels = { "AVX-512BW", l1AVX512, packedL1AVX512, floatL1AVX512, floatL2AVX512, cosineAVX512, hammingAVX512,
+                                          int8L2AVX2, int8DotAVX2, halfL2AVX2, halfDotAVX2 };
+        distanceKernels = kernels;
+        instructionSet = AVX512Set;
+#    ifdef BR_AVX512_VPOPCNTDQ
+        if (vpopcntdq) distanceKernels.hamming = hammingVPOPCNTDQ;
+#    endif // BR_AVX512_VPOPCNTDQ
+        return;
+    }
+#  endif // BR_AVX512
+    if (avx2) {
+        const DistanceKernels kernels = { "AVX2", l1AVX2, packedL1AVX2, floatL1AVX2, floatL2AVX2, cosineAVX2, hammingAVX2,
+                                          int8L2AVX2, int8DotAVX2, halfL2AVX2, halfDotAVX2 };
+        distanceKernels = kernels;
+        instructionSet = AVX2Set;
+    } else if (sse2) {
+        const DistanceKernels kernels = { "SSE2", l1SSE2, packedL1SSE2, floatL1SSE2, floatL2SSE2, cosineSSE2, popcnt ? hammingPOPCNT : hammingScalar,
+                                          int8L2Scalar, int8DotScalar, halfL2Scalar, halfDotScalar };
+        distanceKernels = kernels;
+        instructionSet = SSE2Set;
+    }
+#elif defined(BR_NEON)
+    const DistanceKernels kernels = { "NEON", l1NEON, packedL1NEON, floatL1NEON, floatL2NEON, cosineNEON, hammingNEON,
+                                      int8L2Scalar, int8DotScalar, halfL2Scalar, halfDotScalar };
+    distanceKernels = kernels;
+    instructionSet = NEONSet;
+#endif
+}
@@ -18,6 +18,12 @@
 #define DISTANCE_SSE_H
 
 #include <QDebug>
+#include <QList>
+#include <QPair>
+#include <QVector>
+#include <algorithm>
+#include <functional>
+#include <string.h>
 
 #ifdef __SSE__
 
@@ -31,45 +37,223 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
+#endif // __SSE__
+
+/*!
+ * \brief Distance kernels for the fastest instruction set supported by the host CPU.
+ *
+ * Every kernel handles arbitrary sizes, including tails that are not a multiple of the vector width.
+ * \see initializeDistanceKernels
+ */
+struct DistanceKernels
 {
-    size = size / sizeof(__m128i);
-    __m128i accumulate = _mm_setzero_si128();
+    const char *name; /*!< \brief Instruction set used by the kernels. */
+    int (*l1)(const uchar *a, const uchar *b, int size); /*!< \brief 8-bit L1 distance. */
+    int (*packedL1)(const uchar *a, const uchar *b, int size); /*!< \brief 4-bit L1 distance of nibble-packed bytes. */
+    float (*floatL1)(const float *a, const float *b, int size); /*!< \brief 32-bit L1 distance. */
+    float (*floatL2)(const float *a, const float *b, int size); /*!< \brief 32-bit squared L2 distance. */
+    float (*cosine)(const float *a, const float *b, int size); /*!< \brief 32-bit cosine similarity. */
+    int (*hamming)(const uchar *a, const uchar *b, int size); /*!< \brief Number of differing bits. */
+    int (*int8L2)(const qint8 *a, const qint8 *b, int size); /*!< \brief 8-bit signed squared L2 distance. */
+    int (*int8Dot)(const qint8 *a, const qint8 *b, int size); /*!< \brief 8-bit signed dot product. */
+    float (*halfL2)(const quint16 *a, const quint16 *b, int size); /*!< \brief 16-bit float squared L2 distance. */
+    float (*halfDot)(const quint16 *a, const quint16 *b, int size); /*!< \brief 16-bit float dot product. */
+};
+
+extern DistanceKernels distanceKernels;
+
+/*!
+ * \brief Selects the kernels matching the host CPU, called once by br::Context::initialize().
+ *
+ * AVX-512BW and AVX2 are detected at run time on x86, NEON is used whenever the target architecture provides it.
+ * Until this function is called the portable scalar kernels are used.
+ */
+void initializeDistanceKernels();
+
+/*!
+ * \brief Template sizes, in elements, that distance kernels are specialized for.
+ */
+#define BR_SPECIALIZED_SIZES(X) X(64) X(128) X(256) X(512) X(768) X(1024)
+
+/*!
+ * \brief Copies #distanceKernels to \em kernels, with the 8-bit L1, 32-bit L1 and 32-bit squared L2 kernels
+ * compiled for exactly \em size elements if it is one of #BR_SPECIALIZED_SIZES.
+ *
+ * The specialized kernels have no tail handling and ignore their size argument.
+ * Distances select them once per batch, when the template size is known, rather than per pair.
+ * \return \c true if \em size is specialized.
+ */
+bool specializeDistanceKernels(int size, DistanceKernels *kernels);
 
-    for (int i=0; i<size; i++) {
-        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
-        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
-        __m128i sad = _mm_sad_epu8(A, B);
-        accumulate = _mm_add_epi64(sad, accumulate);
+/*!
+ * \brief Elements summed between checks of the bound in boundedSum().
+ */
+enum { BoundedBlock = 64 };
+
+/*!
+ * \brief Orders the blocks of #BoundedBlock elements of templates with \em size elements by decreasing total variance,
+ * so boundedSum() accumulates the most discriminative dimensions of \em rows first.
+ */
+template <typename T>
+QVector<int> varianceOrder(const QList<const T*> &rows, int size)
+{
+    const int blocks = (size + BoundedBlock - 1) / BoundedBlock;
+    QVector< QPair<double,int> > variances(blocks);
+    for (int k=0; k<blocks; k++) {
+        double variance = 0;
+        for (int j=k*BoundedBlock; j<std::min(size, (k+1)*BoundedBlock); j++) {
+            double sum = 0, sumSquares = 0;
+            foreach (const T *row, rows) {
+                sum += row[j];
+                sumSquares += double(row[j]) * row[j];
+            }
+            variance += sumSquares/rows.size() - (sum/rows.size())*(sum/rows.size());
+        }
+        variances[k] = QPair<double,int>(variance, k);
     }
+    std::stable_sort(variances.begin(), variances.end(), std::greater< QPair<double,int> >());
 
-    int64_t buff[2];
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
+    QVector<int> order(blocks);
+    for (int k=0; k<blocks; k++)
+        order[k] = variances[k].second;
+    return order;
 }
 
-#else
+/*!
+ * \brief Sums an additive distance over the blocks of \em a and \em b in \em order, returning early once the sum exceeds \em bound.
+ *
+ * Full blocks are summed with \em block, e.g. a kernel from specializeDistanceKernels() for #BoundedBlock, and a trailing partial block with \em tail.
+ * If \em order doesn't have one entry per block, as before training, the blocks are summed in sequence.
+ * \return The distance if it is at most \em bound, otherwise a partial sum greater than \em bound.
+ */
+template <typename T, typename R>
+inline R boundedSum(R (*block)(const T*, const T*, int), R (*tail)(const T*, const T*, int), const T *a, const T *b, int size, const QVector<int> &order, float bound)
+{
+    const int blocks = (size + BoundedBlock - 1) / BoundedBlock;
+    const bool ordered = (order.size() == blocks);
+    R sum = 0;
+    for (int k=0; k<blocks; k++) {
+        const int begin = (ordered ? order[k] : k) * BoundedBlock;
+        const int n = std::min(int(BoundedBlock), size - begin);
+        sum += (n == BoundedBlock) ? block(a+begin, b+begin, n) : tail(a+begin, b+begin, n);
+        if (sum > bound) break;
+    }
+    return sum;
+}
 
 inline float l1(const uchar *a, const uchar *b, int size)
 {
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
-    return distance;
+    return distanceKernels.l1(a, b, size);
 }
 
-#endif
-
 inline float packed_l1(const uchar *a, const uchar *b, int size)
 {
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
+    return distanceKernels.packedL1(a, b, size);
+}
+
+inline float l1(const float *a, const float *b, int size)
+{
+    return distanceKernels.floatL1(a, b, size);
+}
+
+inline float squared_l2(const float *a, const float *b, int size)
+{
+    return distanceKernels.floatL2(a, b, size);
+}
+
+inline float cosine(const float *a, const float *b, int size)
+{
+    return distanceKernels.cosine(a, b, size);
+}
+
+inline float hamming(const uchar *a, const uchar *b, int size)
+{
+    return distanceKernels.hamming(a, b, size);
+}
+
+inline float squared_l2(const qint8 *a, const qint8 *b, int size)
+{
+    return distanceKernels.int8L2(a, b, size);
+}
+
+inline float dot(const qint8 *a, const qint8 *b, int size)
+{
+    return distanceKernels.int8Dot(a, b, size);
+}
+
+inline float squared_l2(const quint16 *a, const quint16 *b, int size)
+{
+    return distanceKernels.halfL2(a, b, size);
+}
+
+inline float dot(const quint16 *a, const quint16 *b, int size)
+{
+    return distanceKernels.halfDot(a, b, size);
+}
+
+/*!
+ * \brief Rounds to the nearest IEEE 754 half precision value, ties to even.
+ */
+inline quint16 toHalf(float value)
+{
+    quint32 x;
+    memcpy(&x, &value, 4);
+    const quint32 sign = (x >> 16) & 0x8000;
+    const int exponent = int((x >> 23) & 0xFF) - 127 + 15;
+    quint32 mantissa = x & 0x7FFFFF;
+
+    if (((x >> 23) & 0xFF) == 0xFF) return quint16(sign | 0x7C00 | (mantissa ? 0x200 : 0)); // Infinity or NaN
+    if (exponent >= 31) return quint16(sign | 0x7C00); // Overflow
+    if (exponent <= 0) {
+        // Subnormal
+        if (exponent < -10) return quint16(sign);
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        quint32 half = mantissa >> shift;
+        const quint32 remainder = mantissa & ((1u << shift) - 1);
+        const quint32 halfway = 1u << (shift - 1);
+        if ((remainder > halfway) || ((remainder == halfway) && (half & 1))) half++;
+        return quint16(sign | half);
+    }
+
+    // A carry out of the mantissa correctly rounds up to the next exponent
+    quint32 half = sign | (quint32(exponent) << 10) | (mantissa >> 13);
+    const quint32 remainder = mantissa & 0x1FFF;
+    if ((remainder > 0x1000) || ((remainder == 0x1000) && (half & 1))) half++;
+    return quint16(half);
+}
+
+/*!
+ * \brief Expands an IEEE 754 half precision value.
+ */
+inline float fromHalf(quint16 half)
+{
+    const quint32 sign = quint32(half & 0x8000) << 16;
+    const int exponent = (half >> 10) & 0x1F;
+    quint32 mantissa = half & 0x3FF;
+
+    quint32 x;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            x = sign;
+        } else {
+            // Normalize the subnormal
+            int shift = -1;
+            do {
+                shift++;
+                mantissa <<= 1;
+            } while (!(mantissa & 0x400));
+            x = sign | (quint32(127 - 15 - shift) << 23) | ((mantissa & 0x3FF) << 13);
+        }
+    } else if (exponent == 31) {
+        x = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        x = sign | (quint32(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
 
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
-    return distance;
+    float value;
+    memcpy(&value, &x, 4);
+    return value;
 }
 
 #endif // DISTANCE_SSE_H
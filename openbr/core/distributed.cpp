@@ -0,0 +1,99 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef BR_DISTRIBUTED
+#include <mpi.h>
+#endif // BR_DISTRIBUTED
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/distributed.h"
+
+using namespace br;
+
+static int processRank = 0;
+static int processCount = 1;
+
+void Distributed::initialize(int &argc, char *argv[])
+{
+#ifdef BR_DISTRIBUTED
+    int initialized;
+    MPI_Initialized(&initialized);
+    if (!initialized) MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &processRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &processCount);
+    if (!Globals->quiet) qDebug("OpenBR distributed process %d of %d", processRank, processCount);
+#else // BR_DISTRIBUTED
+    (void) argc;
+    (void) argv;
+#endif // BR_DISTRIBUTED
+}
+
+void Distributed::finalize()
+{
+#ifdef BR_DISTRIBUTED
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (!finalized) MPI_Finalize();
+#endif // BR_DISTRIBUTED
+}
+
+int Distributed::rank()
+{
+    return processRank;
+}
+
+int Distributed::size()
+{
+    return processCount;
+}
+
+void Distributed::send(const QByteArray &data, int destination, int tag)
+{
+#ifdef BR_DISTRIBUTED
+    MPI_Send(const_cast<char*>(data.data()), data.size(), MPI_BYTE, destination, tag, MPI_COMM_WORLD);
+#else // BR_DISTRIBUTED
+    (void) data;
+    qFatal("Can't send to rank %d with tag %d without BR_DISTRIBUTED.", destination, tag);
+#endif // BR_DISTRIBUTED
+}
+
+QByteArray Distributed::receive(int source, int tag)
+{
+#ifdef BR_DISTRIBUTED
+    MPI_Status status;
+    MPI_Probe(source, tag, MPI_COMM_WORLD, &status);
+    int count;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    QByteArray data(count, Qt::Uninitialized);
+    MPI_Recv(data.data(), count, MPI_BYTE, source, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return data;
+#else // BR_DISTRIBUTED
+    qFatal("Can't receive from rank %d with tag %d without BR_DISTRIBUTED.", source, tag);
+    return QByteArray();
+#endif // BR_DISTRIBUTED
+}
+
+void Distributed::broadcast(QByteArray &data)
+{
+#ifdef BR_DISTRIBUTED
+    int count = data.size();
+    MPI_Bcast(&count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (processRank != 0) data = QByteArray(count, Qt::Uninitialized);
+    MPI_Bcast(data.data(), count, MPI_BYTE, 0, MPI_COMM_WORLD);
+#else // BR_DISTRIBUTED
+    (void) data;
+#endif // BR_DISTRIBUTED
+}
@@ -0,0 +1,49 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __DISTRIBUTED_H
+#define __DISTRIBUTED_H
+
+#include <QByteArray>
+
+namespace br
+{
+
+/*!
+ * \brief Message passing between the processes of a \c BR_DISTRIBUTED run.
+ *
+ * Work is divided between processes by block, block \em i belongs to rank <tt>i % size()</tt>.
+ * Rank 0 gathers the results and is the only process that writes outputs.
+ * Without \c BR_DISTRIBUTED there is a single process of rank 0.
+ */
+namespace Distributed
+{
+    void initialize(int &argc, char *argv[]); /*!< \brief Called by br::Context::initialize(). */
+    void finalize(); /*!< \brief Called by br::Context::finalize(). */
+
+    int rank(); /*!< \brief Rank of this process. */
+    int size(); /*!< \brief Number of processes. */
+    inline bool enabled() { return size() > 1; } /*!< \brief \c true if work should be divided between processes. */
+    inline int owner(int block) { return block % size(); } /*!< \brief Rank responsible for \em block. */
+
+    void send(const QByteArray &data, int destination, int tag); /*!< \brief Blocking send to \em destination. */
+    QByteArray receive(int source, int tag); /*!< \brief Blocking receive from \em source. */
+    void broadcast(QByteArray &data); /*!< \brief Replaces \em data with that of rank 0. */
+}
+
+} // namespace br
+
+#endif // __DISTRIBUTED_H
@@ -17,95 +17,165 @@
 #include <QFile>
 #include <QList>
 #include <QStringList>
+#include <algorithm>
 #include <limits>
 #include <vector>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/bee.h"
-#include "openbr/core/common.h"
 #include "openbr/core/fuse.h"
+#include "openbr/core/parallel.h"
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+// Scores are fused a bounded block of rows at a time
+static const int Block_Elements = 1 << 22;
+
+enum FusionMethod { Max, Min, Sum, Replace, Difference, None };
+
+// Running statistics of the finite, non-DontCare scores of one matrix
+struct ScoreStatistics
+{
+    qint64 count;
+    double mean, m2;
+    float min, max;
+
+    ScoreStatistics()
+        : count(0), mean(0), m2(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    void merge(const ScoreStatistics &other)
+    {
+        if (other.count == 0) return;
+        const double delta = other.mean - mean;
+        const qint64 total = count + other.count;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (double(count) * double(other.count) / total);
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double stddev() const
+    {
+        return (count == 0) ? 0 : sqrt(m2 / count);
+    }
+};
+
+// Per-matrix normalization val' = scale*clamp(val, lower, upper) + shift, mapping infinities to the extremes
+struct Normalization
+{
+    float lower, upper, scale, shift;
+    Normalization() : lower(-std::numeric_limits<float>::infinity()), upper(std::numeric_limits<float>::infinity()), scale(1), shift(0) {}
+};
+
+static bool usable(float val, BEE::Mask_t mask)
+{
+    return (mask != BEE::DontCare) &&
+           (val != -std::numeric_limits<float>::infinity()) &&
+           (val !=  std::numeric_limits<float>::infinity());
+}
+
+static void accumulate(Mat scores, Mat mask, ScoreStatistics *stats)
 {
-    if (method == "None") return;
-
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::infinity()) ||
-                (val ==  std::numeric_limits<float>::infinity()))
-                continue;
-            vals.append(val);
+    // Two passes over the rows keep the deviations well conditioned
+    double sum = 0;
+    for (int i=0; i<scores.rows; i++) {
+        const float *s = scores.ptr<float>(i);
+        const BEE::Mask_t *m = mask.ptr<BEE::Mask_t>(i);
+        for (int j=0; j<scores.cols; j++) {
+            if (!usable(s[j], m[j])) continue;
+            stats->count++;
+            sum += s[j];
+            stats->min = std::min(stats->min, s[j]);
+            stats->max = std::max(stats->max, s[j]);
         }
     }
+    if (stats->count == 0) return;
+    stats->mean = sum / stats->count;
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
+    for (int i=0; i<scores.rows; i++) {
+        const float *s = scores.ptr<float>(i);
+        const BEE::Mask_t *m = mask.ptr<BEE::Mask_t>(i);
+        for (int j=0; j<scores.cols; j++) {
+            if (!usable(s[j], m[j])) continue;
+            const double delta = s[j] - stats->mean;
+            stats->m2 += delta * delta;
+        }
+    }
+}
 
-    if (method == "MinMax") {
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::infinity()) val = 0;
-                else if (val ==  std::numeric_limits<float>::infinity()) val = 1;
-                else                                                     val = (val - min) / (max - min);
+static void fuseRows(QList<Mat> scores, Mat mask, Mat fused, const QPair<FusionMethod, QList<float> > *method, const QList<Normalization> *normalizations)
+{
+    const int columns = fused.cols;
+    if (columns == 0) return;
+    std::vector< std::vector<float> > normalized(scores.size(), std::vector<float>(columns));
+
+    for (int i=0; i<fused.rows; i++) {
+        const BEE::Mask_t *m = mask.ptr<BEE::Mask_t>(i);
+        for (int k=0; k<scores.size(); k++) {
+            const float *s = scores[k].ptr<float>(i);
+            float *n = &normalized[k][0];
+            const Normalization &norm = (*normalizations)[k];
+            for (int j=0; j<columns; j++) {
+                const float val = norm.scale * std::min(std::max(s[j], norm.lower), norm.upper) + norm.shift;
+                n[j] = (m[j] == BEE::DontCare) ? s[j] : val;
             }
         }
-    } else if (method == "ZScore") {
-        if (stddev == 0) qFatal("Stddev is 0.");
-                for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::infinity()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::infinity()) val = (max - mean) / stddev;
-                else                                                     val = (val - mean) / stddev;
+
+        float *f = fused.ptr<float>(i);
+        const float *a = &normalized[0][0];
+        const float *b = (scores.size() > 1) ? &normalized[1][0] : a;
+        switch (method->first) {
+          case Max:
+            for (int j=0; j<columns; j++) f[j] = std::max(a[j], b[j]);
+            for (int k=2; k<scores.size(); k++)
+                for (int j=0; j<columns; j++) f[j] = std::max(f[j], normalized[k][j]);
+            break;
+          case Min:
+            for (int j=0; j<columns; j++) f[j] = std::min(a[j], b[j]);
+            for (int k=2; k<scores.size(); k++)
+                for (int j=0; j<columns; j++) f[j] = std::min(f[j], normalized[k][j]);
+            break;
+          case Sum: {
+            const QList<float> &weights = method->second;
+            for (int j=0; j<columns; j++) f[j] = weights[0]*a[j] + weights[1]*b[j];
+            for (int k=2; k<scores.size(); k++) {
+                const float weight = weights[k];
+                for (int j=0; j<columns; j++) f[j] += weight*normalized[k][j];
             }
+          } break;
+          case Replace:
+            for (int j=0; j<columns; j++) f[j] = (m[j] != BEE::DontCare) ? b[j] : a[j];
+            break;
+          case Difference:
+            for (int j=0; j<columns; j++) f[j] = a[j] - b[j];
+            break;
+          case None:
+            for (int j=0; j<columns; j++) f[j] = a[j];
+            break;
         }
-    } else {
-        qFatal("Invalid normalization method %s.", qPrintable(method));
     }
 }
 
-void br::Fuse(const QStringList &inputSimmats, const QString &mask, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+static QPair<FusionMethod, QList<float> > parseFusion(const QString &fusion, int matrices)
 {
-    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
-    QList<Mat> matrices;
-    foreach (const QString &simmat, inputSimmats)
-        matrices.append(BEE::readSimmat(simmat));
-    if ((matrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((matrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
-    Mat matrix_mask = BEE::readMask(mask);
+    if ((matrices < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((matrices > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
 
-    for (int i=0; i<matrices.size(); i++)
-        normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-    Mat fused;
+    QList<float> weights;
     if (fusion == "Max") {
-        max(matrices[0], matrices[1], fused);
-        for (int i=2; i<matrices.size(); i++)
-            max(fused, matrices[i], fused);
+        return qMakePair(Max, weights);
     } else if (fusion == "Min") {
-        min(matrices[0], matrices[1], fused);
-        for (int i=2; i<matrices.size(); i++)
-            min(fused, matrices[i], fused);
+        return qMakePair(Min, weights);
     } else if (fusion.startsWith("Sum")) {
-        QList<float> weights;
         QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
         if (words.size() == 0) {
-            for (int k=0; k<matrices.size(); k++)
+            for (int k=0; k<matrices; k++)
                 weights.append(1);
-        } else if (words.size() == matrices.size()) {
+        } else if (words.size() == matrices) {
             bool ok;
-            for (int k=0; k<matrices.size(); k++) {
+            for (int k=0; k<matrices; k++) {
                 float weight = words[k].toFloat(&ok);
                 if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
                 weights.append(weight);
@@ -113,22 +183,122 @@ void br::Fuse(const QStringList &inputSimmats, const QString &mask, const QStrin
         } else {
             qFatal("Number of weights does not match number of similarity matrices.");
         }
-
-        addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-        for (int i=2; i<matrices.size(); i++)
-            addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
+        return qMakePair(Sum, weights);
     } else if (fusion == "Replace") {
-        if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-        fused = matrices.first().clone();
-        matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
+        if (matrices != 2) qFatal("Replace fusion requires exactly two matrices.");
+        return qMakePair(Replace, weights);
     } else if (fusion == "Difference") {
-        if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-        subtract(matrices[0], matrices[1], fused);
+        if (matrices != 2) qFatal("Difference fusion requires exactly two matrices.");
+        return qMakePair(Difference, weights);
     } else if (fusion == "None") {
-        fused = matrices[0];
-    } else {
-        qFatal("Invalid fusion method %s.", qPrintable(fusion));
+        return qMakePair(None, weights);
+    }
+
+    qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    return qMakePair(None, weights);
+}
+
+static Normalization makeNormalization(const ScoreStatistics &stats, const QString &method)
+{
+    Normalization normalization;
+    if (stats.count == 0) qFatal("No scores to normalize.");
+    normalization.lower = stats.min;
+    normalization.upper = stats.max;
+
+    if (method == "MinMax") {
+        normalization.scale = 1 / (stats.max - stats.min);
+        normalization.shift = -stats.min * normalization.scale;
+    } else if (method == "ZScore") {
+        const double stddev = stats.stddev();
+        if (stddev == 0) qFatal("Stddev is 0.");
+        normalization.scale = 1 / stddev;
+        normalization.shift = -stats.mean / stddev;
+    }
+    return normalization;
+}
+
+void br::Fuse(const QStringList &inputSimmats, const QString &mask, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+{
+    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
+    if ((normalization != "None") && (normalization != "MinMax") && (normalization != "ZScore"))
+        qFatal("Invalid normalization method %s.", qPrintable(normalization));
+    const QPair<FusionMethod, QList<float> > method = parseFusion(fusion, inputSimmats.size());
+
+    QList< QSharedPointer<BEE::MatrixReader> > readers;
+    foreach (const QString &simmat, inputSimmats) {
+        readers.append(QSharedPointer<BEE::MatrixReader>(new BEE::MatrixReader(simmat, false)));
+        if ((readers.last()->rows != readers.first()->rows) || (readers.last()->columns != readers.first()->columns))
+            qFatal("Similarity matrix size mismatch.");
     }
+    const int rows = readers.first()->rows;
+    const int columns = readers.first()->columns;
 
-    BEE::writeSimmat(fused, outputSimmat);
+    br::File maskFile(mask);
+    maskFile.set("rows", rows);
+    maskFile.set("columns", columns);
+    BEE::MatrixReader maskReader(maskFile, true);
+    if ((maskReader.rows != rows) || (maskReader.columns != columns)) qFatal("Simmat/Mask size mismatch.");
+
+    const int blockRows = std::max(1, Block_Elements / std::max(1, columns));
+    const int threads = std::max(1, abs(br::Globals->parallelism));
+
+    // First pass computes the normalization statistics for every matrix
+    QList<Normalization> normalizations;
+    for (int k=0; k<readers.size(); k++)
+        normalizations.append(Normalization());
+
+    if (normalization != "None") {
+        QList<ScoreStatistics> stats;
+        for (int k=0; k<readers.size(); k++)
+            stats.append(ScoreStatistics());
+
+        for (int row=0; row<rows; row+=blockRows) {
+            const Mat maskBlock = maskReader.read(blockRows);
+            const int step = (maskBlock.rows + threads - 1) / threads;
+            std::vector<ScoreStatistics> partial(readers.size() * threads);
+
+            br::TaskGroup tasks;
+            for (int k=0; k<readers.size(); k++) {
+                const Mat scores = readers[k]->read(blockRows);
+                for (int t=0; t<threads; t++) {
+                    const int begin = t*step, end = std::min(maskBlock.rows, begin+step);
+                    if (begin >= end) break;
+                    if (br::Globals->parallelism) tasks.run(&accumulate, scores.rowRange(begin, end), maskBlock.rowRange(begin, end), &partial[k*threads+t]);
+                    else                                    accumulate(scores.rowRange(begin, end), maskBlock.rowRange(begin, end), &partial[k*threads+t]);
+                }
+            }
+            tasks.wait();
+
+            for (int k=0; k<readers.size(); k++)
+                for (int t=0; t<threads; t++)
+                    stats[k].merge(partial[k*threads+t]);
+        }
+
+        for (int k=0; k<readers.size(); k++) {
+            normalizations[k] = makeNormalization(stats[k], normalization);
+            readers[k]->reset();
+        }
+        maskReader.reset();
+    }
+
+    // Second pass normalizes and fuses each block straight into the output
+    BEE::MatrixWriter writer(outputSimmat, rows, columns, false);
+    for (int row=0; row<rows; row+=blockRows) {
+        const Mat maskBlock = maskReader.read(blockRows);
+        QList<Mat> scores;
+        for (int k=0; k<readers.size(); k++)
+            scores.append(readers[k]->read(blockRows));
+        Mat fused = writer.block(row, maskBlock.rows);
+
+        const int step = (maskBlock.rows + threads - 1) / threads;
+        br::TaskGroup tasks;
+        for (int begin=0; begin<maskBlock.rows; begin+=step) {
+            const int end = std::min(maskBlock.rows, begin+step);
+            QList<Mat> subscores;
+            foreach (const Mat &m, scores)
+                subscores.append(m.rowRange(begin, end));
+            if (br::Globals->parallelism) tasks.run(&fuseRows, subscores, maskBlock.rowRange(begin, end), fused.rowRange(begin, end), &method, &normalizations);
+            else                                    fuseRows(subscores, maskBlock.rowRange(begin, end), fused.rowRange(begin, end), &method, &normalizations);
+        }
+    }
 }
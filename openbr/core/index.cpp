@@ -0,0 +1,349 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDataStream>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/index.h"
+#include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
+#include "openbr/core/qtutils.h"
+
+using namespace br;
+using namespace cv;
+
+/*!
+ * \brief Keeps loaded indexes resident between searches.
+ */
+class IndexManager : public Initializer
+{
+    Q_OBJECT
+
+public:
+    static QHash<QString, QSharedPointer<InvertedIndex> > indexes;
+    static QHash<QString, QSharedPointer<MultiIndexHash> > hashes;
+    static QMutex indexesLock;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        indexes.clear();
+        hashes.clear();
+    }
+};
+
+QHash<QString, QSharedPointer<InvertedIndex> > IndexManager::indexes;
+QHash<QString, QSharedPointer<MultiIndexHash> > IndexManager::hashes;
+QMutex IndexManager::indexesLock;
+
+BR_REGISTER(Initializer, IndexManager)
+
+// Failures to enroll and empty templates aren't indexed, so searches never return them
+static bool indexable(const Template &t)
+{
+    return !t.file.failed() && (t.size() == 1) && (t.m().data != NULL);
+}
+
+/* InvertedIndex - public methods */
+QSharedPointer<InvertedIndex> InvertedIndex::fromGallery(const File &gallery)
+{
+    QMutexLocker locker(&IndexManager::indexesLock);
+    const QString key = gallery.name;
+    if (IndexManager::indexes.contains(key))
+        return IndexManager::indexes[key];
+
+    QSharedPointer<InvertedIndex> index(new InvertedIndex());
+    index->templates = TemplateList::fromGallery(gallery);
+    if (!index->load(gallery)) {
+        index->train(gallery.get<int>("index", 0));
+        index->store(gallery);
+    }
+
+    IndexManager::indexes.insert(key, index);
+    return index;
+}
+
+void InvertedIndex::build(const File &gallery, int lists)
+{
+    InvertedIndex index;
+    index.templates = TemplateList::fromGallery(gallery);
+    index.train(lists);
+    index.store(gallery);
+
+    QMutexLocker locker(&IndexManager::indexesLock);
+    IndexManager::indexes.remove(gallery.name);
+}
+
+QVector<int> InvertedIndex::candidates(const Template &query, int probes) const
+{
+    const Mat v = vector(query);
+    if (v.cols != centroids.cols) qFatal("Query %s doesn't match the index dimensionality.", qPrintable(query.file.flat()));
+
+    QVector< QPair<float,int> > nearest(centroids.rows);
+    for (int i=0; i<centroids.rows; i++)
+        nearest[i] = QPair<float,int>(squared_l2(v.ptr<float>(), centroids.ptr<float>(i), v.cols), i);
+    probes = std::max(1, std::min(probes, nearest.size()));
+    std::partial_sort(nearest.begin(), nearest.begin()+probes, nearest.end());
+
+    QVector<int> result;
+    for (int i=0; i<probes; i++)
+        result += lists[nearest[i].second];
+    return result;
+}
+
+float InvertedIndex::score(const Template &a, const Template &b)
+{
+    if (!indexable(a) || !indexable(b)) return -std::numeric_limits<float>::max();
+    const Mat va = vector(a), vb = vector(b);
+    if (va.cols != vb.cols) return -std::numeric_limits<float>::max();
+    return -std::sqrt(squared_l2(va.ptr<float>(), vb.ptr<float>(), va.cols));
+}
+
+/* InvertedIndex - private methods */
+QString InvertedIndex::indexFile(const File &gallery)
+{
+    return gallery.name + ".ivf";
+}
+
+Mat InvertedIndex::vector(const Template &t)
+{
+    if (t.size() != 1) qFatal("Can't index multi-matrix template %s.", qPrintable(t.file.flat()));
+    Mat m = t.m().isContinuous() ? t.m() : t.m().clone();
+    m = m.reshape(1, 1);
+    if (m.type() == CV_32FC1) return m;
+    Mat v;
+    m.convertTo(v, CV_32F);
+    return v;
+}
+
+void InvertedIndex::train(int numLists)
+{
+    QVector<int> indexed;
+    for (int i=0; i<templates.size(); i++)
+        if (indexable(templates[i]))
+            indexed.append(i);
+    const int n = indexed.size();
+    if (n == 0) qFatal("Can't index an empty gallery.");
+    if (numLists <= 0) numLists = std::max(1, int(std::sqrt(double(n))));
+    numLists = std::min(numLists, n);
+
+    // A few dozen samples per centroid is enough for k-means to converge
+    const int samples = std::min(n, 64*numLists);
+    const int dims = vector(templates[indexed.first()]).cols;
+    Mat data(samples, dims, CV_32FC1);
+    for (int i=0; i<samples; i++) {
+        const Mat v = vector(templates[indexed[int(qint64(i)*n/samples)]]);
+        if (v.cols != dims) qFatal("Can't index templates of differing length.");
+        v.copyTo(data.row(i));
+    }
+
+    qDebug("Indexing %d of %d templates in %d lists", n, templates.size(), numLists);
+    Mat labels;
+    kmeans(data, numLists, labels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 1, KMEANS_PP_CENTERS, centroids);
+
+    const int size = templates.size();
+    QVector<int> assignments(size);
+    const int chunk = 1024;
+    TaskGroup tasks;
+    for (int i=0; i<size; i+=chunk)
+        if (Globals->parallelism) tasks.run(this, &InvertedIndex::assign, i, std::min(size, i+chunk), assignments.data());
+        else                                                      assign(i, std::min(size, i+chunk), assignments.data());
+    tasks.wait();
+
+    lists = QVector< QVector<int> >(numLists);
+    for (int i=0; i<size; i++)
+        if (assignments[i] != -1)
+            lists[assignments[i]].append(i);
+}
+
+void InvertedIndex::assign(int begin, int end, int *assignments) const
+{
+    for (int i=begin; i<end; i++)
+        assignments[i] = indexable(templates[i]) ? nearest(vector(templates[i])) : -1;
+}
+
+int InvertedIndex::nearest(const Mat &v) const
+{
+    if (v.cols != centroids.cols) qFatal("Can't index templates of differing length.");
+    int best = 0;
+    float bestDistance = std::numeric_limits<float>::max();
+    for (int i=0; i<centroids.rows; i++) {
+        const float distance = squared_l2(v.ptr<float>(), centroids.ptr<float>(i), v.cols);
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+bool InvertedIndex::load(const File &gallery)
+{
+    const QFileInfo indexInfo(indexFile(gallery));
+    if (!indexInfo.exists() || (indexInfo.lastModified() < QFileInfo(gallery.name).lastModified()))
+        return false;
+
+    QByteArray data;
+    QtUtils::readFile(indexInfo.filePath(), data);
+    QDataStream stream(data);
+    quint32 version;
+    qint32 count;
+    stream >> version >> count;
+    if ((version != Version) || (count != templates.size()))
+        return false;
+
+    stream >> centroids >> lists;
+    return true;
+}
+
+void InvertedIndex::store(const File &gallery) const
+{
+    QByteArray data;
+    QDataStream stream(&data, QFile::WriteOnly);
+    stream << quint32(Version) << qint32(templates.size()) << centroids << lists;
+    QtUtils::writeFile(indexFile(gallery), data);
+}
+
+/* MultiIndexHash - public methods */
+QSharedPointer<MultiIndexHash> MultiIndexHash::fromGallery(const File &gallery)
+{
+    QMutexLocker locker(&IndexManager::indexesLock);
+    const QString key = gallery.name;
+    if (IndexManager::hashes.contains(key))
+        return IndexManager::hashes[key];
+
+    QSharedPointer<MultiIndexHash> index(new MultiIndexHash());
+    index->templates = TemplateList::fromGallery(gallery);
+    index->build();
+
+    IndexManager::hashes.insert(key, index);
+    return index;
+}
+
+QVector<int> MultiIndexHash::candidates(const Template &query, int radius) const
+{
+    const uchar *q = code(query, bytes);
+    if (q == NULL) qFatal("Query %s isn't a %d byte code.", qPrintable(query.file.flat()), bytes);
+
+    // By the pigeonhole principle every code within the radius is found on some table
+    const int tables = ids.size();
+    const int probes = masksWithin[std::min(int(SubstringBits), std::max(0, radius) / tables)];
+    QVector<int> found;
+    for (int t=0; t<tables; t++) {
+        const quint16 s = substring(q, t);
+        for (int k=0; k<probes; k++) {
+            const int bucket = s ^ masks[k];
+            for (int j=offsets[t][bucket]; j<offsets[t][bucket+1]; j++)
+                found.append(ids[t][j]);
+        }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+
+    // A code near the query on one substring may still be too far overall
+    QVector< QPair<int,int> > within;
+    foreach (int i, found) {
+        const int distance = distanceKernels.hamming(code(templates[i], bytes), q, bytes);
+        if (distance <= radius) within.append(QPair<int,int>(distance, i));
+    }
+    std::sort(within.begin(), within.end());
+
+    QVector<int> result(within.size());
+    for (int i=0; i<within.size(); i++)
+        result[i] = within[i].second;
+    return result;
+}
+
+/* MultiIndexHash - private methods */
+const uchar *MultiIndexHash::code(const Template &t, int bytes)
+{
+    if (t.file.failed() || (t.size() != 1) || !t.m().isContinuous() || (int(t.m().total() * t.m().elemSize()) != bytes))
+        return NULL;
+    return t.m().data;
+}
+
+quint16 MultiIndexHash::substring(const uchar *code, int table)
+{
+    return quint16(code[2*table]) | quint16(code[2*table+1] << 8);
+}
+
+void MultiIndexHash::build()
+{
+    int first = 0;
+    while ((first < templates.size()) && !indexable(templates[first]))
+        first++;
+    if (first == templates.size()) qFatal("Can't index an empty gallery.");
+    bytes = int(templates[first].m().total() * templates[first].m().elemSize());
+    if ((bytes == 0) || (bytes % (SubstringBits/8) != 0))
+        qFatal("Can't hash %d byte codes in %d bit substrings.", bytes, int(SubstringBits));
+
+    masks.resize(Buckets);
+    for (int i=0; i<Buckets; i++)
+        masks[i] = quint16(i);
+    QVector<int> bits(Buckets, 0);
+    for (int i=1; i<Buckets; i++)
+        bits[i] = bits[i >> 1] + (i & 1);
+    masksWithin = QVector<int>(SubstringBits+1, 0);
+    for (int i=0; i<Buckets; i++)
+        masksWithin[bits[i]]++;
+    for (int k=1; k<=SubstringBits; k++)
+        masksWithin[k] += masksWithin[k-1];
+    QVector<int> next(SubstringBits+1, 0);
+    for (int k=1; k<=SubstringBits; k++)
+        next[k] = masksWithin[k-1];
+    for (int i=0; i<Buckets; i++)
+        masks[next[bits[i]]++] = quint16(i);
+
+    const int tables = bytes / (SubstringBits/8);
+    if (Globals->verbose) qDebug("Hashing %d codes in %d tables", templates.size(), tables);
+    offsets = QVector< QVector<int> >(tables);
+    ids = QVector< QVector<int> >(tables);
+    TaskGroup tasks;
+    for (int t=0; t<tables; t++)
+        if (Globals->parallelism) tasks.run(this, &MultiIndexHash::buildTable, t);
+        else                                                  buildTable(t);
+    tasks.wait();
+}
+
+void MultiIndexHash::buildTable(int table)
+{
+    // Counting sort the codes into contiguous buckets, skipping failures to enroll and templates that aren't codes
+    QVector<int> &offset = offsets[table];
+    offset = QVector<int>(Buckets+1, 0);
+    for (int i=0; i<templates.size(); i++)
+        if (const uchar *c = code(templates[i], bytes))
+            offset[substring(c, table)+1]++;
+    for (int b=0; b<Buckets; b++)
+        offset[b+1] += offset[b];
+
+    QVector<int> next = offset;
+    ids[table] = QVector<int>(offset[Buckets]);
+    for (int i=0; i<templates.size(); i++)
+        if (const uchar *c = code(templates[i], bytes))
+            ids[table][next[substring(c, table)]++] = i;
+}
+
+#include "index.moc"
@@ -0,0 +1,99 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __INDEX_H
+#define __INDEX_H
+
+#include <QSharedPointer>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Inverted file index over a gallery of fixed length single matrix templates.
+ *
+ * Templates are assigned to their nearest k-means centroid at build time.
+ * A search only visits the templates assigned to the \em probes centroids nearest the query.
+ * Failures to enroll and empty templates aren't assigned to any centroid, so searches omit them.
+ * The index is stored next to the gallery as <tt>gallery.ivf</tt> and rebuilt when the gallery changes.
+ */
+class InvertedIndex
+{
+public:
+    TemplateList templates; /*!< \brief The indexed gallery. */
+
+    /*!
+     * \brief Returns the cached index for \em gallery, loading or building it on first use.
+     *
+     * The \c index metadata of \em gallery sets the number of centroids to build, by default the square root of the gallery size.
+     */
+    static QSharedPointer<InvertedIndex> fromGallery(const File &gallery);
+    static void build(const File &gallery, int lists); /*!< \brief Builds and stores the index for \em gallery. */
+
+    QVector<int> candidates(const Template &query, int probes) const; /*!< \brief Indices of the templates to compare against \em query. */
+    static float score(const Template &a, const Template &b); /*!< \brief Negative L2 distance used in place of a br::Distance. */
+
+private:
+    enum { Version = 1 };
+    cv::Mat centroids;
+    QVector< QVector<int> > lists;
+
+    static QString indexFile(const File &gallery);
+    static cv::Mat vector(const Template &t);
+    void train(int numLists);
+    void assign(int begin, int end, int *assignments) const;
+    int nearest(const cv::Mat &v) const;
+    bool load(const File &gallery);
+    void store(const File &gallery) const;
+};
+
+/*!
+ * \brief Multi-index hashing of a gallery of binary codes for Hamming radius search \cite norouzi12.
+ *
+ * Codes are split into 16-bit substrings that each index their own table.
+ * A code within Hamming distance \em r of the query is within <tt>r/m</tt> bits of it on at least one of its \em m substrings,
+ * so a search probes only the table buckets near the query's substrings instead of comparing every code.
+ * The index is built in one pass over the gallery when first used, failures to enroll and templates that aren't codes are left out.
+ */
+class MultiIndexHash
+{
+public:
+    TemplateList templates; /*!< \brief The indexed gallery. */
+
+    static QSharedPointer<MultiIndexHash> fromGallery(const File &gallery); /*!< \brief Returns the cached index for \em gallery, building it on first use. */
+    QVector<int> candidates(const Template &query, int radius) const; /*!< \brief Indices of the templates within Hamming distance \em radius of \em query, nearest first. */
+
+private:
+    enum { SubstringBits = 16,
+           Buckets = 1 << SubstringBits };
+    int bytes;
+    QVector< QVector<int> > offsets; // Per table, where each bucket starts in ids
+    QVector< QVector<int> > ids;
+    QVector<quint16> masks; // Every substring mask, fewest bits first
+    QVector<int> masksWithin; // Number of masks with at most i bits
+
+    static const uchar *code(const Template &t, int bytes);
+    static quint16 substring(const uchar *code, int table);
+    void build();
+    void buildTable(int table);
+};
+
+} // namespace br
+
+#endif // __INDEX_H
@@ -0,0 +1,204 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <algorithm>
+#include <functional>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/parallel.h"
+
+using namespace br;
+
+namespace
+{
+
+// Jobs by the context they run under, so their outputs can find them from any worker thread
+QHash<Context*, Job*> runningJobs;
+QMutex runningJobsLock;
+
+} // namespace
+
+/* Job - public methods */
+Job *Job::enroll(const File &input, const File &gallery)
+{
+    return new Job(Enrolling, input, File(), gallery, 0);
+}
+
+Job *Job::compare(const File &targetGallery, const File &queryGallery, const File &output)
+{
+    return new Job(Comparing, targetGallery, queryGallery, output, 0);
+}
+
+Job *Job::search(const File &targetGallery, const File &queryGallery, int count)
+{
+    return new Job(Searching, targetGallery, queryGallery, File(".search"), count);
+}
+
+Job *Job::current()
+{
+    Context *context = ContextPointer::job();
+    if (context == NULL) return NULL;
+    QMutexLocker locker(&runningJobsLock);
+    return runningJobs.value(context, NULL);
+}
+
+Job::~Job()
+{
+    cancel();
+    wait();
+}
+
+void Job::cancel()
+{
+    context->cancel();
+}
+
+bool Job::isCancelled() const
+{
+    return context->cancelled();
+}
+
+float Job::progress() const
+{
+    return context->progress();
+}
+
+FileList Job::files() const
+{
+    QMutexLocker locker(&resultsLock);
+    return enrolled;
+}
+
+FileList Job::targets() const
+{
+    QMutexLocker locker(&resultsLock);
+    return targetFiles;
+}
+
+QList< QList<Job::Match> > Job::matches() const
+{
+    QMutexLocker locker(&resultsLock);
+    return best;
+}
+
+void Job::publish(const FileList &targets, const QList< QList<Match> > &matches)
+{
+    QMutexLocker locker(&resultsLock);
+    targetFiles = targets;
+    best = matches;
+    locker.unlock();
+    emit partialResults();
+}
+
+/* Job - private methods */
+Job::Job(Mode mode, const File &input, const File &query, const File &output, int count)
+    : mode(mode), input(input), query(query), output(output), count(count), context(Globals->fork())
+{
+    if (mode == Searching) this->output.set("limit", count);
+    start();
+}
+
+void Job::run()
+{
+    ContextScope scope(context.data());
+    QMutexLocker locker(&runningJobsLock);
+    runningJobs.insert(context.data(), this);
+    locker.unlock();
+
+    if (mode == Enrolling) {
+        const FileList files = Enroll(input, output);
+        QMutexLocker resultsLocker(&resultsLock);
+        enrolled = files;
+    } else {
+        Compare(input, query, output);
+    }
+
+    locker.relock();
+    runningJobs.remove(context.data());
+}
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Best matches of each query for the br::Job that started the comparison, published after every block.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Like br::topOutput each thread keeps a bounded heap per query, and the heaps are merged into the job's results as blocks complete.
+ */
+class searchOutput : public Output
+{
+    Q_OBJECT
+
+    typedef QVector< QVector<Job::Match> > Heaps; // One heap per query
+    Job *job;
+    int limit;
+    ThreadLocal<Heaps> threadHeaps;
+
+    ~searchOutput()
+    {
+        blockCompleted();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        job = Job::current();
+        limit = file.get<int>("limit", 20);
+        threadHeaps.reset(Heaps(queryFiles.size()));
+    }
+
+    void set(float value, int i, int j)
+    {
+        if (limit <= 0) return;
+        QVector<Job::Match> &heap = threadHeaps.local()[i];
+        if (heap.size() < limit) {
+            heap.append(Job::Match(value, j));
+            std::push_heap(heap.begin(), heap.end(), std::greater<Job::Match>());
+        } else if (value > heap.first().first) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Job::Match>());
+            heap.last() = Job::Match(value, j);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Job::Match>());
+        }
+    }
+
+    // No scores are being set between blocks, so the thread heaps can be read
+    void blockCompleted()
+    {
+        if (job == NULL) return;
+        const QList<Heaps*> heaps = threadHeaps.values();
+        QList< QList<Job::Match> > matches;
+        for (int i=0; i<queryFiles.size(); i++) {
+            QVector<Job::Match> candidates;
+            foreach (const Heaps *h, heaps)
+                candidates += (*h)[i];
+            const int n = std::min(limit, candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(), std::greater<Job::Match>());
+            matches.append(candidates.mid(0, n).toList());
+        }
+        job->publish(targetFiles, matches);
+    }
+};
+
+BR_REGISTER(Output, searchOutput)
+
+} // namespace br
+
+#include "job.moc"
@@ -0,0 +1,126 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <limits>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/kmeans.h"
+#include "openbr/core/parallel.h"
+
+using namespace br;
+using namespace cv;
+
+static const int Exact_Rows_Per_Center = 64; // Up to this many rows per center are clustered exactly
+static const int Batch_Size = 1024;
+static const int Batch_Iterations = 200;
+static const int Assignment_Chunk = 1024;
+
+namespace
+{
+
+struct Assignment
+{
+    const Mat *data, *centers;
+    int *labels;
+    float *distances;
+
+    void assign(int begin, int end) const
+    {
+        const int dims = data->cols;
+        for (int i=begin; i<end; i++) {
+            const float *row = data->ptr<float>(i);
+            float best = std::numeric_limits<float>::max();
+            int bestIndex = 0;
+            for (int j=0; j<centers->rows; j++) {
+                const float distance = squared_l2(row, centers->ptr<float>(j), dims);
+                if (distance < best) {
+                    best = distance;
+                    bestIndex = j;
+                }
+            }
+            labels[i] = bestIndex;
+            distances[i] = best;
+        }
+    }
+};
+
+} // namespace
+
+double br::NearestCenters(const Mat &data, const Mat &centers, Mat &labels)
+{
+    labels.create(data.rows, 1, CV_32SC1);
+    QVector<float> distances(data.rows);
+
+    Assignment assignment;
+    assignment.data = &data;
+    assignment.centers = &centers;
+    assignment.labels = labels.ptr<int>();
+    assignment.distances = distances.data();
+
+    if (data.rows <= Assignment_Chunk) {
+        assignment.assign(0, data.rows);
+    } else {
+        TaskGroup tasks;
+        for (int i=0; i<data.rows; i+=Assignment_Chunk)
+            if (Globals->parallelism) tasks.run(&assignment, &Assignment::assign, i, std::min(data.rows, i+Assignment_Chunk));
+            else                                assignment.assign(i, std::min(data.rows, i+Assignment_Chunk));
+        tasks.wait();
+    }
+
+    double compactness = 0;
+    foreach (float distance, distances)
+        compactness += distance;
+    return compactness;
+}
+
+double br::KMeans(const Mat &data, int k, Mat &labels, Mat &centers)
+{
+    if (data.type() != CV_32FC1) qFatal("Requires single channel 32-bit floating point matrix.");
+    if (data.rows <= Exact_Rows_Per_Center*k)
+        return kmeans(data, k, labels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+
+    RNG rng(0x5eed);
+
+    // Seed with k-means++ on an evenly spaced sample
+    const int samples = Exact_Rows_Per_Center*k;
+    Mat sample(samples, data.cols, CV_32FC1);
+    for (int i=0; i<samples; i++)
+        data.row(int(qint64(i)*data.rows/samples)).copyTo(sample.row(i));
+    Mat sampleLabels;
+    kmeans(sample, k, sampleLabels, TermCriteria(TermCriteria::MAX_ITER, 1, 0), 1, KMEANS_PP_CENTERS, centers);
+
+    // Refine with mini-batches, each center moves towards its members at a rate decaying with its count
+    QVector<qint64> counts(k, 0);
+    Mat batch(Batch_Size, data.cols, CV_32FC1);
+    Mat batchLabels;
+    for (int iteration=0; iteration<Batch_Iterations; iteration++) {
+        for (int i=0; i<Batch_Size; i++)
+            data.row(rng.uniform(0, data.rows)).copyTo(batch.row(i));
+        NearestCenters(batch, centers, batchLabels);
+
+        for (int i=0; i<Batch_Size; i++) {
+            const int label = batchLabels.at<int>(i);
+            const float rate = 1.f / ++counts[label];
+            float *center = centers.ptr<float>(label);
+            const float *row = batch.ptr<float>(i);
+            for (int j=0; j<data.cols; j++)
+                center[j] += rate * (row[j] - center[j]);
+        }
+    }
+
+    return NearestCenters(data, centers, labels);
+}
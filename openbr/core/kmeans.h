@@ -0,0 +1,39 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __KMEANS_H
+#define __KMEANS_H
+
+#include <opencv2/core/core.hpp>
+
+namespace br
+{
+    /*!
+     * \brief k-means clustering of the rows of a \c CV_32FC1 matrix.
+     *
+     * Small problems are solved exactly with \c cv::kmeans, 3 attempts of 10 iterations from k-means++ seeds.
+     * Larger ones seed k-means++ on a sample, then refine the centers with mini-batches and per-center learning rates.
+     * Either way \em labels receives the \c CV_32SC1 nearest center of every row and the compactness is returned.
+     */
+    double KMeans(const cv::Mat &data, int k, cv::Mat &labels, cv::Mat &centers);
+
+    /*!
+     * \brief Assigns each row of \em data to its nearest row of \em centers in parallel, returns the sum of squared distances.
+     */
+    double NearestCenters(const cv::Mat &data, const cv::Mat &centers, cv::Mat &labels);
+}
+
+#endif // __KMEANS_H
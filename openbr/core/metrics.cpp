@@ -0,0 +1,163 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMap>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+
+#include "metrics.h"
+
+using namespace br;
+
+namespace
+{
+
+// Upper bounds in seconds of the histogram buckets, the last bucket is unbounded
+const double Buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 };
+const int NumBuckets = sizeof(Buckets)/sizeof(Buckets[0]);
+
+struct Series
+{
+    enum Kind { Counter, Gauge, Histogram };
+    Kind kind;
+    double value; // Counter and gauge value, histogram sum
+    qint64 count;
+    QVector<qint64> buckets;
+
+    Series(Kind kind = Counter)
+        : kind(kind), value(0), count(0)
+    {
+        if (kind == Histogram) buckets = QVector<qint64>(NumBuckets, 0);
+    }
+};
+
+QMap<QString, Series> AllSeries; // Sorted so each family is reported contiguously
+QMutex SeriesLock;
+
+Series &series(const QString &name, Series::Kind kind)
+{
+    QMap<QString, Series>::iterator it = AllSeries.find(name);
+    if (it == AllSeries.end()) it = AllSeries.insert(name, Series(kind));
+    else if (it->kind != kind) qFatal("Metric %s changed type.", qPrintable(name));
+    return it.value();
+}
+
+void record(Series &s, double seconds)
+{
+    s.value += seconds;
+    s.count++;
+    for (int i=0; i<NumBuckets; i++)
+        if (seconds <= Buckets[i]) {
+            s.buckets[i]++;
+            break;
+        }
+}
+
+// Splits "name{labels}" into its family name and labels
+QString family(const QString &name, QString *labels)
+{
+    const int brace = name.indexOf('{');
+    if (brace == -1) {
+        *labels = QString();
+        return name;
+    }
+    *labels = name.mid(brace+1, name.size()-brace-2);
+    return name.left(brace);
+}
+
+QString withLabels(const QString &name, const QString &labels, const QString &extra = QString())
+{
+    QStringList all;
+    if (!labels.isEmpty()) all.append(labels);
+    if (!extra.isEmpty())  all.append(extra);
+    return all.isEmpty() ? name : name + "{" + all.join(",") + "}";
+}
+
+} // namespace
+
+void Metrics::increment(const QString &name, double value)
+{
+    QMutexLocker locker(&SeriesLock);
+    series(name, Series::Counter).value += value;
+}
+
+void Metrics::set(const QString &name, double value)
+{
+    QMutexLocker locker(&SeriesLock);
+    series(name, Series::Gauge).value = value;
+}
+
+void Metrics::observe(const QString &name, double seconds)
+{
+    QMutexLocker locker(&SeriesLock);
+    record(series(name, Series::Histogram), seconds);
+}
+
+void Metrics::observe(const QString &name, const QList<double> &seconds)
+{
+    if (seconds.isEmpty()) return;
+    QMutexLocker locker(&SeriesLock);
+    Series &s = series(name, Series::Histogram);
+    foreach (double sample, seconds)
+        record(s, sample);
+}
+
+double Metrics::value(const QString &name)
+{
+    QMutexLocker locker(&SeriesLock);
+    const QMap<QString, Series>::const_iterator it = AllSeries.constFind(name);
+    if (it == AllSeries.constEnd()) return 0;
+    return (it->kind == Series::Histogram) ? it->count : it->value;
+}
+
+QString Metrics::report()
+{
+    // Progress is read from the job state rather than recorded
+    if (Globals.process()) {
+        set("br_progress", std::max(0.f, Globals->progress()));
+        set("br_time_remaining_seconds", std::max(0, Globals->timeRemaining()));
+    }
+
+    static const char *types[] = { "counter", "gauge", "histogram" };
+    QMutexLocker locker(&SeriesLock);
+    QStringList lines;
+    QString previousFamily;
+    for (QMap<QString, Series>::const_iterator it = AllSeries.constBegin(); it != AllSeries.constEnd(); ++it) {
+        QString labels;
+        const QString name = family(it.key(), &labels);
+        if (name != previousFamily)
+            lines.append(QString("# TYPE %1 %2").arg(name, types[it->kind]));
+        previousFamily = name;
+
+        if (it->kind != Series::Histogram) {
+            lines.append(withLabels(name, labels) + " " + QString::number(it->value, 'g', 12));
+            continue;
+        }
+
+        qint64 cumulative = 0;
+        for (int i=0; i<NumBuckets; i++) {
+            cumulative += it->buckets[i];
+            lines.append(withLabels(name + "_bucket", labels, QString("le=\"%1\"").arg(Buckets[i])) + " " + QString::number(cumulative));
+        }
+        lines.append(withLabels(name + "_bucket", labels, "le=\"+Inf\"") + " " + QString::number(it->count));
+        lines.append(withLabels(name + "_sum", labels) + " " + QString::number(it->value, 'g', 12));
+        lines.append(withLabels(name + "_count", labels) + " " + QString::number(it->count));
+    }
+    return lines.join("\n") + "\n";
+}
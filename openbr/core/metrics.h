@@ -0,0 +1,47 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <QList>
+#include <QString>
+
+namespace br
+{
+
+/*!
+ * \brief Process-wide counters, gauges and latency histograms for monitoring long jobs.
+ *
+ * Series are named in the <a href="http://prometheus.io/">Prometheus</a> style,
+ * with optional labels, ex. <tt>br_failures_total{reason="FTE"}</tt>.
+ * Updates take a lock, so they should be made per block rather than per template.
+ */
+namespace Metrics
+{
+
+void increment(const QString &series, double value = 1); /*!< \brief Adds \em value to a counter. */
+void set(const QString &series, double value); /*!< \brief Sets a gauge. */
+void observe(const QString &series, double seconds); /*!< \brief Records a latency in a histogram. */
+void observe(const QString &series, const QList<double> &seconds); /*!< \brief Records a batch of latencies in a histogram under one lock. */
+double value(const QString &series); /*!< \brief The current value of a counter or gauge, or the sample count of a histogram, \c 0 if unknown. */
+QString report(); /*!< \brief Every series in the Prometheus text exposition format. */
+
+} // namespace Metrics
+
+} // namespace br
+
+#endif // __METRICS_H
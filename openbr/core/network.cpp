@@ -0,0 +1,346 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_EMBEDDED
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+#endif // BR_EMBEDDED
+#include <openbr/openbr_plugin.h>
+
+#include "network.h"
+
+using namespace br;
+
+bool Network::isUrl(const QString &name)
+{
+    return name.startsWith("http://") || name.startsWith("https://") || name.startsWith("www.");
+}
+
+static const char RangeTag[] = "#bytes=";
+static const char ValidatorTag[] = "#validator"; // Internal name whose reply is the object's ETag or Last-Modified
+
+QString Network::range(const QString &url, qint64 begin, qint64 end)
+{
+    return QString("%1%2%3-%4").arg(url, RangeTag, QString::number(begin), end < 0 ? QString() : QString::number(end));
+}
+
+#ifndef BR_EMBEDDED
+
+/*!
+ * \brief Issues requests from the network thread, where its connection pool lives.
+ */
+class Downloader : public QObject
+{
+    Q_OBJECT
+    QNetworkAccessManager *manager;
+    QQueue<QString> queued;
+    int inFlight;
+
+public:
+    Downloader() : manager(NULL), inFlight(0) {}
+
+public slots:
+    void enqueue(const QString &url);
+
+private slots:
+    void finished(QNetworkReply *reply);
+
+private:
+    void start();
+};
+
+/*!
+ * \ingroup initializers
+ * \brief Owns the network thread and the replies waiting to be claimed by br::Network::get().
+ * \author Josh Klontz \cite jklontz
+ */
+class NetworkManager : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QThread *stopping;
+        {
+            QMutexLocker locker(&lock);
+            stopping = thread;
+            thread = NULL;
+            downloader = NULL;
+            downloads.clear();
+            unclaimed.clear();
+            validators.clear();
+        }
+
+        // Replies finishing meanwhile take the lock, so wait without it, the downloader is deleted as the thread finishes
+        if (stopping == NULL) return;
+        stopping->quit();
+        stopping->wait();
+        delete stopping;
+    }
+
+public:
+    struct Download
+    {
+        bool done;
+        int waiting;
+        QByteArray data;
+        QString error;
+        Download() : done(false), waiting(0) {}
+    };
+
+    static QMutex lock;
+    static QWaitCondition completed;
+    static QHash<QString, Download> downloads;
+    static QQueue<QString> unclaimed; // Finished prefetches in completion order
+    static QThread *thread;
+    static Downloader *downloader;
+    static QHash<QString, QByteArray> validators; // Of the objects whose ranges were looked up in the cache
+
+    // Called with the lock held
+    static void request(const QString &url)
+    {
+        if (downloads.contains(url)) return;
+        downloads.insert(url, Download());
+
+        if (thread == NULL) {
+            thread = new QThread();
+            downloader = new Downloader();
+            downloader->moveToThread(thread);
+            QObject::connect(thread, SIGNAL(finished()), downloader, SLOT(deleteLater()));
+            thread->start();
+        }
+        QMetaObject::invokeMethod(downloader, "enqueue", Qt::QueuedConnection, Q_ARG(QString, url));
+    }
+
+    static void complete(const QString &url, const QByteArray &data, const QString &error)
+    {
+        QMutexLocker locker(&lock);
+        if (!downloads.contains(url)) return;
+        Download &download = downloads[url];
+        download.done = true;
+        download.data = data;
+        download.error = error;
+
+        if (download.waiting == 0) {
+            // Bound the memory held by prefetches that are never claimed
+            unclaimed.enqueue(url);
+            while (unclaimed.size() > Max_Unclaimed) {
+                const QString oldest = unclaimed.dequeue();
+                const QHash<QString, Download>::const_iterator it = downloads.find(oldest);
+                if ((it != downloads.end()) && it->done && (it->waiting == 0))
+                    downloads.remove(oldest);
+            }
+        }
+        completed.wakeAll();
+    }
+
+    enum { Max_In_Flight = 16,
+           Max_Unclaimed = 1024 };
+};
+
+QMutex NetworkManager::lock;
+QWaitCondition NetworkManager::completed;
+QHash<QString, NetworkManager::Download> NetworkManager::downloads;
+QQueue<QString> NetworkManager::unclaimed;
+QThread *NetworkManager::thread = NULL;
+Downloader *NetworkManager::downloader = NULL;
+QHash<QString, QByteArray> NetworkManager::validators;
+
+BR_REGISTER(Initializer, NetworkManager)
+
+// The object a range or validator name refers to
+static QString objectOf(const QString &name)
+{
+    if (name.endsWith(ValidatorTag)) return name.left(name.size() - int(sizeof(ValidatorTag)) + 1);
+    const int tag = name.lastIndexOf(RangeTag);
+    return (tag == -1) ? name : name.left(tag);
+}
+
+// A strong ETag, or else the Last-Modified date, identifying the version of the object in the reply
+static QByteArray validatorOf(const QNetworkReply *reply)
+{
+    const QByteArray etag = reply->rawHeader("ETag");
+    return (etag.isEmpty() || etag.startsWith("W/")) ? reply->rawHeader("Last-Modified") : etag;
+}
+
+// Ranges are only meaningful for one version of an object, so they are cached under its validator.
+// Empty if caching is disabled or the object's version can't be identified.
+static QString cachePath(const QString &name, const QByteArray &validator)
+{
+    if (Globals->networkCache.isEmpty() || name.endsWith(ValidatorTag)) return QString();
+    const bool ranged = name.lastIndexOf(RangeTag) != -1;
+    if (ranged && validator.isEmpty()) return QString();
+    const QByteArray key = ranged ? name.toUtf8() + "\n" + validator : name.toUtf8();
+    return QDir(Globals->networkCache).filePath(QString(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()));
+}
+
+// The current version of the object holding the range name, fetched once per object with a one byte range request
+static QByteArray currentValidator(const QString &name)
+{
+    if (Globals->networkCache.isEmpty() || (name.lastIndexOf(RangeTag) == -1)) return QByteArray();
+    const QString object = objectOf(name);
+    {
+        QMutexLocker locker(&NetworkManager::lock);
+        const QHash<QString, QByteArray>::const_iterator it = NetworkManager::validators.constFind(object);
+        if (it != NetworkManager::validators.constEnd()) return it.value();
+    }
+
+    QString error;
+    const QByteArray validator = Network::get(object + ValidatorTag, &error);
+    QMutexLocker locker(&NetworkManager::lock);
+    if (error.isEmpty()) NetworkManager::validators.insert(object, validator);
+    return validator;
+}
+
+static bool readCache(const QString &name, QByteArray *data)
+{
+    const QString path = cachePath(name, currentValidator(name));
+    if (path.isEmpty()) return false;
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) return false;
+    *data = file.readAll();
+    return true;
+}
+
+static void writeCache(const QString &name, const QByteArray &validator, const QByteArray &data)
+{
+    const QString path = cachePath(name, validator);
+    if (path.isEmpty()) return;
+
+    // Written aside and renamed so concurrent runs sharing the cache never read a partial copy
+    QDir().mkpath(Globals->networkCache);
+    QFile file(path + "." + QString::number(QCoreApplication::applicationPid()) + ".part");
+    if (!file.open(QFile::WriteOnly) || (file.write(data) != data.size())) {
+        qWarning("Can't write network cache: %s", qPrintable(file.fileName()));
+        file.remove();
+        return;
+    }
+    file.close();
+    QFile::remove(path);
+    if (!file.rename(path)) file.remove();
+}
+
+void Downloader::enqueue(const QString &url)
+{
+    if (manager == NULL) {
+        manager = new QNetworkAccessManager(this);
+        connect(manager, SIGNAL(finished(QNetworkReply*)), this, SLOT(finished(QNetworkReply*)));
+    }
+    queued.enqueue(url);
+    start();
+}
+
+void Downloader::finished(QNetworkReply *reply)
+{
+    inFlight--;
+    const QString url = reply->request().attribute(QNetworkRequest::User).toString();
+    const QString error = (reply->error() == QNetworkReply::NoError) ? QString() : QString("%1 (%2)").arg(reply->errorString(), QString::number(reply->error()));
+    const QByteArray validator = validatorOf(reply);
+    QByteArray data = url.endsWith(ValidatorTag) ? validator : reply->readAll();
+
+    // A server ignoring the Range header returns the whole object
+    const int tag = url.lastIndexOf(RangeTag);
+    if ((tag != -1) && error.isEmpty() && (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 200)) {
+        const QStringList bounds = url.mid(tag + int(sizeof(RangeTag)) - 1).split('-');
+        const qint64 begin = bounds[0].toLongLong();
+        data = bounds[1].isEmpty() ? data.mid(begin) : data.mid(begin, bounds[1].toLongLong() - begin + 1);
+    }
+
+    if (error.isEmpty()) writeCache(url, validator, data);
+    NetworkManager::complete(url, data, error);
+    reply->deleteLater();
+    start();
+}
+
+void Downloader::start()
+{
+    while ((inFlight < NetworkManager::Max_In_Flight) && !queued.isEmpty()) {
+        const QString url = queued.dequeue();
+        const QString object = objectOf(url);
+        QNetworkRequest request(QUrl(object.startsWith("www.") ? "http://" + object : object));
+        if (url.endsWith(ValidatorTag)) request.setRawHeader("Range", "bytes=0-0"); // A GET rather than HEAD so presigned URLs work
+        else if (object != url) request.setRawHeader("Range", url.mid(url.lastIndexOf(RangeTag) + 1).toLatin1());
+        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
+        request.setAttribute(QNetworkRequest::User, url);
+        manager->get(request);
+        inFlight++;
+    }
+}
+
+void Network::prefetch(const QStringList &urls)
+{
+    // Looking up a range's cached copy may fetch the object's validator, so it's done without the lock
+    QStringList uncached;
+    foreach (const QString &url, urls)
+        if (isUrl(url) && !QFileInfo(cachePath(url, currentValidator(url))).exists())
+            uncached.append(url);
+
+    QMutexLocker locker(&NetworkManager::lock);
+    foreach (const QString &url, uncached)
+        if (!NetworkManager::downloads.contains(url))
+            NetworkManager::request(url);
+}
+
+QByteArray Network::get(const QString &url, QString *error)
+{
+    QByteArray cached;
+    if (readCache(url, &cached)) {
+        if (error) error->clear();
+        return cached;
+    }
+
+    QMutexLocker locker(&NetworkManager::lock);
+    NetworkManager::request(url);
+    NetworkManager::downloads[url].waiting++;
+    while (!NetworkManager::downloads[url].done)
+        NetworkManager::completed.wait(&NetworkManager::lock);
+
+    NetworkManager::Download &download = NetworkManager::downloads[url];
+    const QByteArray data = download.data;
+    if (error) *error = download.error;
+    if (--download.waiting == 0) NetworkManager::downloads.remove(url);
+    return data;
+}
+
+#include "network.moc"
+
+#else // BR_EMBEDDED
+
+void Network::prefetch(const QStringList &urls)
+{
+    (void) urls;
+}
+
+QByteArray Network::get(const QString &url, QString *error)
+{
+    if (error) *error = "Network access is not available in embedded builds";
+    (void) url;
+    return QByteArray();
+}
+
+#endif // BR_EMBEDDED
@@ -0,0 +1,45 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __NETWORK_H
+#define __NETWORK_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+namespace br
+{
+
+/*!
+ * \brief Shared, pipelined HTTP fetching.
+ *
+ * One connection pool on a dedicated event loop thread serves every worker,
+ * keeping at most \c Max_In_Flight requests outstanding and queueing the rest.
+ * With br::Context::networkCache set, fetched objects are kept in that directory and read from it by later calls.
+ * Cached byte ranges are keyed on the \c ETag or \c Last-Modified of their object, checked once per object per process.
+ */
+namespace Network
+{
+    bool isUrl(const QString &name); /*!< \brief True if \em name should be fetched over the network. */
+    QString range(const QString &url, qint64 begin, qint64 end = -1); /*!< \brief Name of bytes [\em begin, \em end] of \em url for prefetch() and get(), \c -1 reads to the end of the object. */
+    void prefetch(const QStringList &urls); /*!< \brief Start fetching \em urls ahead of get(), names that aren't URLs are ignored. */
+    QByteArray get(const QString &url, QString *error = NULL); /*!< \brief Wait for \em url, using a prefetched reply or cached copy if there is one. */
+}
+
+} // namespace br
+
+#endif // __NETWORK_H
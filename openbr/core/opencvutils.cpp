@@ -14,10 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QBuffer>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "budget.h"
 #include "opencvutils.h"
 #include "qtutils.h"
 
@@ -285,11 +287,24 @@ QDataStream &operator>>(QDataStream &stream, Mat &m)
     // Read header
     int rows, cols, type;
     stream >> rows >> cols >> type;
-    m.create(rows, cols, type);
 
     // Read data
     int len;
     stream >> len;
+
+    // Matrices read from a mapped buffer reference the mapping instead of copying it
+    QBuffer *buffer = qobject_cast<QBuffer*>(stream.device());
+    if (buffer && buffer->property("mapped").toBool() && (len > 0)) {
+        const qint64 pos = buffer->pos();
+        if (pos + len > buffer->size()) qFatal("opencvutils.cpp operator>> Mat serialization failure.");
+        m = Mat(rows, cols, type, (void*)(buffer->data().constData() + pos));
+        buffer->seek(pos + len);
+        return stream;
+    }
+
+    m.release();
+    m.allocator = MatBudget::allocator();
+    m.create(rows, cols, type);
     if (len > 0) {
         if (!m.isContinuous()) qFatal("opencvutils.cpp operator>> Mat can't deserialize non-continuous matrices.");
         int written = stream.readRawData((char*)m.data, len);
@@ -0,0 +1,139 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+
+#include "packed.h"
+
+using namespace br;
+using namespace cv;
+
+PackedChunk::PackedChunk(const TemplateList &templates, int first, int rows, int cols, int type)
+    : first(first), count(templates.size()), bytes(size_t(rows) * cols * CV_ELEM_SIZE(type))
+{
+    const QVector<uchar> zeros(int(bytes), 0);
+    QVector<const uchar*> data(Group_Size);
+    QVector<uchar> mins(int(bytes)), maxs(int(bytes));
+
+    for (int g=0; g<count; g+=Group_Size) {
+        const int n = std::min(int(Group_Size), count-g);
+        for (int k=0; k<n; k++) {
+            const Template &t = templates[g+k];
+            if (t.isEmpty() || !t.m().data) {
+                data[k] = zeros.data();
+                continue;
+            }
+            const Mat &m = t.m();
+            if ((t.size() != 1) || (m.rows != rows) || (m.cols != cols) || (m.type() != type) || !m.isContinuous())
+                qFatal("Packed templates must be single continuous matrices of one size and type, %s isn't.", qPrintable(t.file.flat()));
+            data[k] = m.data;
+        }
+
+        std::fill(mins.begin(), mins.end(), uchar(255));
+        std::fill(maxs.begin(), maxs.end(), uchar(0));
+        for (int k=0; k<n; k++)
+            for (size_t j=0; j<bytes; j++) {
+                mins[j] = std::min(mins[j], data[k][j]);
+                maxs[j] = std::max(maxs[j], data[k][j]);
+            }
+        int range = 0;
+        for (size_t j=0; j<bytes; j++)
+            range = std::max(range, int(maxs[j]) - int(mins[j]));
+
+        Group group;
+        group.bits = 0;
+        while ((1 << group.bits) <= range) group.bits++;
+        group.offset = payload.size();
+        groups.append(group);
+
+        if (group.bits == 8) {
+            for (int k=0; k<n; k++)
+                payload.append((const char*) data[k], int(bytes));
+            continue;
+        }
+
+        payload.append((const char*) mins.data(), int(bytes));
+        if (group.bits == 0) continue;
+
+        const int start = payload.size();
+        payload.resize(start + int((size_t(n) * bytes * group.bits + 7) / 8));
+        uchar *out = (uchar*) payload.data() + start;
+        quint64 buffer = 0;
+        int used = 0;
+        for (int k=0; k<n; k++)
+            for (size_t j=0; j<bytes; j++) {
+                buffer |= quint64(data[k][j] - mins[j]) << used;
+                used += group.bits;
+                while (used >= 8) {
+                    *out++ = uchar(buffer);
+                    buffer >>= 8;
+                    used -= 8;
+                }
+            }
+        if (used > 0) *out = uchar(buffer);
+    }
+    payload.squeeze();
+}
+
+void PackedChunk::decode(int index, int n, uchar *dst) const
+{
+    while (n > 0) {
+        const int g = index / Group_Size, k = index % Group_Size;
+        const int m = std::min(n, std::min(int(Group_Size), count - g*Group_Size) - k);
+        const Group &group = groups[g];
+        const uchar *src = (const uchar*) payload.constData() + group.offset;
+
+        if (group.bits == 8) {
+            memcpy(dst, src + k*bytes, m*bytes);
+        } else if (group.bits == 0) {
+            for (int i=0; i<m; i++)
+                memcpy(dst + i*bytes, src, bytes);
+        } else {
+            // Fewer than 8 bits per value, so one byte always refills the buffer
+            const int bits = group.bits;
+            const quint64 mask = (quint64(1) << bits) - 1;
+            const size_t bit = size_t(k) * bytes * bits;
+            const uchar *in = src + bytes + bit/8;
+            quint64 buffer = *in++ >> (bit%8);
+            int available = 8 - int(bit%8);
+            uchar *out = dst;
+            for (int i=0; i<m; i++)
+                for (size_t j=0; j<bytes; j++) {
+                    if (available < bits) {
+                        buffer |= quint64(*in++) << available;
+                        available += 8;
+                    }
+                    *out++ = src[j] + uchar(buffer & mask);
+                    buffer >>= bits;
+                    available -= bits;
+                }
+        }
+
+        index += m;
+        dst += m*bytes;
+        n -= m;
+    }
+}
+
+void PackedData::decode(int index, int n, uchar *dst) const
+{
+    const int begin = first + index, end = begin + n;
+    foreach (const QSharedPointer<const PackedChunk> &chunk, chunks) {
+        const int from = std::max(begin, chunk->first), to = std::min(end, chunk->first + chunk->count);
+        if (from < to)
+            chunk->decode(from - chunk->first, to - from, dst + size_t(from - begin) * bytes());
+    }
+}
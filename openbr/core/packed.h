@@ -0,0 +1,80 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __PACKED_H
+#define __PACKED_H
+
+#include <QList>
+#include <QSharedPointer>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Immutable compressed matrices of consecutive single matrix templates of one size and type.
+ *
+ * Templates are packed in groups of #Group_Size.
+ * A group stores the minimum of each byte position over its templates, then every byte less its minimum
+ * in the fewest bits that hold the group's largest difference.
+ * Groups whose differences need all 8 bits, ex. floating point templates, are stored as is.
+ * Empty matrices, like those of failed templates, are packed as zeros.
+ */
+class PackedChunk
+{
+public:
+    enum { Group_Size = 64 };
+
+    int first; /*!< \brief Index of the first template in its gallery. */
+    int count; /*!< \brief Number of templates. */
+
+    PackedChunk(const TemplateList &templates, int first, int rows, int cols, int type);
+    size_t compressedBytes() const { return payload.size(); } /*!< \brief Bytes held by the chunk. */
+    void decode(int index, int n, uchar *dst) const; /*!< \brief Writes templates [\em index, \em index + \em n) of the chunk to \em dst back to back. */
+
+private:
+    struct Group
+    {
+        int bits;
+        size_t offset; // Of the group's minimums, or of its raw bytes if bits is 8
+    };
+
+    size_t bytes;
+    QVector<Group> groups;
+    QByteArray payload;
+};
+
+/*!
+ * \brief The compressed matrices of a br::TemplateList whose own matrices are empty, see br::TemplateList::packedData.
+ *
+ * br::Distance::compare() decodes the targets a tile at a time into a buffer of the comparing thread,
+ * so the decoded templates are still in cache while the queries are compared against them.
+ */
+struct PackedData
+{
+    int rows, cols, type;
+    int first; /*!< \brief Gallery index of the first template of the list. */
+    QList< QSharedPointer<const PackedChunk> > chunks; /*!< \brief Chunks covering the list. */
+
+    PackedData() : rows(0), cols(0), type(0), first(0) {}
+    size_t bytes() const { return size_t(rows) * cols * CV_ELEM_SIZE(type); } /*!< \brief Decoded bytes per template. */
+    void decode(int index, int n, uchar *dst) const; /*!< \brief Writes templates [\em index, \em index + \em n) of the list to \em dst back to back. */
+};
+
+} // namespace br
+
+#endif // __PACKED_H
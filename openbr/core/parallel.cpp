@@ -0,0 +1,642 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDateTime>
+#include <QFile>
+#include <QList>
+#include <QThread>
+#include <QThreadStorage>
+#include <openbr/openbr_plugin.h>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "budget.h"
+#include "parallel.h"
+#include "trace.h"
+
+using namespace br;
+
+namespace
+{
+
+class Worker;
+
+// CPUs of each NUMA node
+static QList< QList<int> > numaTopology()
+{
+    QList< QList<int> > nodes;
+#ifdef __linux__
+    for (int node=0; ; node++) {
+        QFile file(QString("/sys/devices/system/node/node%1/cpulist").arg(node));
+        if (!file.open(QFile::ReadOnly)) break;
+        QList<int> cpus;
+        foreach (const QString &range, QString(file.readAll()).trimmed().split(',', QString::SkipEmptyParts)) {
+            const QStringList bounds = range.split('-');
+            for (int cpu=bounds.first().toInt(); cpu<=bounds.last().toInt(); cpu++)
+                cpus.append(cpu);
+        }
+        if (!cpus.isEmpty()) nodes.append(cpus);
+    }
+#endif
+    return nodes;
+}
+
+static void pin(const QList<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    foreach (int cpu, cpus)
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        qWarning("Failed to pin worker thread.");
+#else
+    (void) cpus;
+#endif
+}
+
+/*!
+ * \brief Tasks waiting for the workers of one NUMA node.
+ */
+struct NodeQueue
+{
+    QList<int> cpus;
+    QMutex lock;
+    QList<Parallel::Task*> tasks;
+};
+
+/*!
+ * \brief Work-stealing scheduler shared by every br::TaskGroup of one Parallel::Executor.
+ *
+ * Each worker thread owns a deque of tasks.
+ * Tasks submitted from a worker are pushed onto its own deque and popped LIFO,
+ * tasks submitted from other threads go to a shared FIFO queue,
+ * and idle threads steal the oldest task from another worker's deque.
+ * With br::Context::numa workers are pinned round robin to the NUMA nodes,
+ * tasks for a node wait in its queue and are taken by other nodes' workers only when those have nothing else to do.
+ *
+ * The shared queue is split by Parallel::Priority and ordered by deadline.
+ * Interactive tasks are taken before a worker's own deque, lower classes after it.
+ * Tasks taken from anywhere but the worker's own deque are admitted against br::Context::concurrency of their class.
+ * Idle workers sleep until a task is submitted or an admitted task finishes, rather than spin on tasks held back by their cap.
+ */
+class Scheduler
+{
+public:
+    QList<Worker*> workers;
+    QList<NodeQueue*> nodes;
+    QMutex injectedLock;
+    QList<Parallel::Task*> injected[Parallel::Priorities]; // By priority, each ordered by deadline
+    QAtomicInt running[Parallel::Priorities]; // Admitted tasks of each priority still running
+    QAtomicInt queued;
+    QMutex sleepLock;
+    QWaitCondition wake;
+    QAtomicInt epoch; // Changed under sleepLock whenever a task is submitted or an admitted task finishes
+    bool stopping;
+
+    static QThreadStorage<Worker*> currentWorker; // NULL for threads that aren't workers
+
+    Scheduler(int threads, bool numa);
+    ~Scheduler();
+
+    static Scheduler *instance(Parallel::Executor executor = Parallel::Compute);
+    static void release();
+    static void admittedFinished(); // Wakes the workers, whose capped tasks may now be admitted
+
+    int self() const; // Index of the calling thread among this scheduler's workers, -1 for other threads
+    void submit(Parallel::Task *task);
+    Parallel::Task *take(int self, const TaskGroup *within = NULL); // Only tasks within the group if one is given
+
+private:
+    Parallel::Task *takeFrom(NodeQueue *node, const TaskGroup *within);
+    Parallel::Task *takeInjected(int priority, const TaskGroup *within);
+    bool admit(Parallel::Task *task, const TaskGroup *within);
+    void notify(bool all);
+
+private:
+    static Scheduler *schedulers[2]; // Indexed by Parallel::Executor
+    static QMutex schedulerLock;
+};
+
+class Worker : public QThread
+{
+public:
+    Scheduler *scheduler;
+    int index, node;
+    QMutex dequeLock;
+    QList<Parallel::Task*> deque;
+
+    Worker(Scheduler *scheduler, int index, int node)
+        : scheduler(scheduler), index(index), node(node) {}
+
+private:
+    void run()
+    {
+        Scheduler::currentWorker.setLocalData(this);
+        if (node >= 0) pin(scheduler->nodes[node]->cpus);
+        forever {
+            const int epoch = scheduler->epoch.load();
+            Parallel::Task *task = scheduler->take(index);
+            if (task) {
+                Parallel::execute(task);
+                continue;
+            }
+
+            // Nothing admissible, which includes queued tasks held back by their class's cap
+            QMutexLocker locker(&scheduler->sleepLock);
+            while ((scheduler->epoch.load() == epoch) && !scheduler->stopping)
+                scheduler->wake.wait(&scheduler->sleepLock);
+            if (scheduler->stopping) return;
+        }
+    }
+};
+
+QThreadStorage<Worker*> Scheduler::currentWorker;
+static QThreadStorage<int> admittedClasses; // Bit mask of the priority classes of the admitted tasks the calling thread is running
+
+struct CurrentGroup
+{
+    TaskGroup *group; // Of the task the calling thread is running, NULL outside of tasks
+    CurrentGroup() : group(NULL) {}
+};
+static QThreadStorage<CurrentGroup> currentGroup;
+Scheduler *Scheduler::schedulers[2] = { NULL, NULL };
+QMutex Scheduler::schedulerLock;
+
+Scheduler::Scheduler(int threads, bool numa)
+    : stopping(false)
+{
+    if (numa) {
+        const QList< QList<int> > topology = numaTopology();
+        if (topology.size() > 1)
+            foreach (const QList<int> &cpus, topology) {
+                nodes.append(new NodeQueue());
+                nodes.last()->cpus = cpus;
+            }
+    }
+
+    for (int i=0; i<threads; i++)
+        workers.append(new Worker(this, i, nodes.isEmpty() ? -1 : i % nodes.size()));
+    foreach (Worker *worker, workers)
+        worker->start();
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        QMutexLocker locker(&sleepLock);
+        stopping = true;
+        wake.wakeAll();
+    }
+    foreach (Worker *worker, workers)
+        worker->wait();
+    qDeleteAll(workers);
+    qDeleteAll(nodes);
+}
+
+Scheduler *Scheduler::instance(Parallel::Executor executor)
+{
+    QMutexLocker locker(&schedulerLock);
+    Scheduler *&scheduler = schedulers[executor];
+    if (scheduler == NULL) {
+        // The calling thread helps with compute tasks while it waits, so one fewer worker than Context::parallelism is needed.
+        // Threads only run I/O tasks while they wait on the group of those tasks, when they would be blocked anyway.
+        if (executor == Parallel::Compute) scheduler = new Scheduler(std::max(1, abs(Globals->parallelism)-1), Globals->numa);
+        else                               scheduler = new Scheduler(std::max(1, Globals->ioThreads), false);
+    }
+    return scheduler;
+}
+
+void Scheduler::admittedFinished()
+{
+    // Set once and only cleared at finalization, after the last task
+    for (int i=0; i<2; i++)
+        if (schedulers[i]) schedulers[i]->notify(true);
+}
+
+void Scheduler::release()
+{
+    QMutexLocker locker(&schedulerLock);
+    for (int i=0; i<2; i++) {
+        delete schedulers[i];
+        schedulers[i] = NULL;
+    }
+}
+
+int Scheduler::self() const
+{
+    Worker *worker = currentWorker.hasLocalData() ? currentWorker.localData() : NULL;
+    return (worker && (worker->scheduler == this)) ? worker->index : -1;
+}
+
+void Scheduler::submit(Parallel::Task *task)
+{
+    const int self = this->self();
+    if ((task->node >= 0) && (task->node < nodes.size())) {
+        QMutexLocker locker(&nodes[task->node]->lock);
+        nodes[task->node]->tasks.append(task);
+    } else if (self >= 0) {
+        QMutexLocker locker(&workers[self]->dequeLock);
+        workers[self]->deque.append(task);
+    } else {
+        QMutexLocker locker(&injectedLock);
+        QList<Parallel::Task*> &tasks = injected[task->priority];
+        int i = tasks.size();
+        while ((i > 0) && (tasks[i-1]->due > task->due)) i--;
+        tasks.insert(i, task);
+    }
+
+    queued.ref();
+    notify(false);
+}
+
+static inline bool isWithin(const Parallel::Task *task, const TaskGroup *within)
+{
+    return (within == NULL) || task->group->within(within);
+}
+
+Parallel::Task *Scheduler::take(int self, const TaskGroup *within)
+{
+    if (queued.load() == 0) return NULL;
+
+    // Latency critical work preempts bulk work at the next task boundary
+    if (Parallel::Task *task = takeInjected(Parallel::Interactive, within))
+        return task;
+
+    if (self >= 0) {
+        {
+            QMutexLocker locker(&workers[self]->dequeLock);
+            QList<Parallel::Task*> &deque = workers[self]->deque;
+            for (int i=deque.size()-1; i>=0; i--)
+                if (isWithin(deque[i], within)) {
+                    queued.deref();
+                    return deque.takeAt(i);
+                }
+        }
+
+        if (workers[self]->node >= 0)
+            if (Parallel::Task *task = takeFrom(nodes[workers[self]->node], within))
+                return task;
+    }
+
+    for (int priority=Parallel::Interactive-1; priority>=0; priority--)
+        if (Parallel::Task *task = takeInjected(priority, within))
+            return task;
+
+    for (int i=1; i<=workers.size(); i++) {
+        Worker *victim = workers[(std::max(self, 0) + i) % workers.size()];
+        QMutexLocker locker(&victim->dequeLock);
+        for (int j=0; j<victim->deque.size(); j++)
+            if (isWithin(victim->deque[j], within) && admit(victim->deque[j], within)) {
+                queued.deref();
+                return victim->deque.takeAt(j);
+            }
+    }
+
+    // Remote memory is slower, but better than an idle core
+    foreach (NodeQueue *node, nodes)
+        if (Parallel::Task *task = takeFrom(node, within))
+            return task;
+
+    return NULL;
+}
+
+Parallel::Task *Scheduler::takeFrom(NodeQueue *node, const TaskGroup *within)
+{
+    QMutexLocker locker(&node->lock);
+    for (int i=0; i<node->tasks.size(); i++)
+        if (isWithin(node->tasks[i], within) && admit(node->tasks[i], within)) {
+            queued.deref();
+            return node->tasks.takeAt(i);
+        }
+    return NULL;
+}
+
+Parallel::Task *Scheduler::takeInjected(int priority, const TaskGroup *within)
+{
+    QMutexLocker locker(&injectedLock);
+    QList<Parallel::Task*> &tasks = injected[priority];
+    for (int i=0; i<tasks.size(); i++) {
+        if (!isWithin(tasks[i], within)) continue;
+        if (!admit(tasks[i], within)) return NULL; // Later tasks of the class are held back by the same cap
+        queued.deref();
+        return tasks.takeAt(i);
+    }
+    return NULL;
+}
+
+// Counts the task against its class, returns false if the class is at its cap
+bool Scheduler::admit(Parallel::Task *task, const TaskGroup *within)
+{
+    // A thread waiting inside an admitted task of the class already holds one of its slots,
+    // so the tasks of the group it waits on always make progress. Other tasks are counted as usual.
+    if (within && (admittedClasses.localData() & (1 << task->priority))) return true;
+
+    QAtomicInt &counter = running[task->priority];
+    int current;
+    do {
+        current = counter.load();
+        if ((task->cap > 0) && (current >= task->cap)) return false;
+    } while (!counter.testAndSetOrdered(current, current+1));
+    task->running = &counter;
+    return true;
+}
+
+void Scheduler::notify(bool all)
+{
+    QMutexLocker locker(&sleepLock);
+    epoch.ref();
+    if (all) wake.wakeAll();
+    else     wake.wakeOne();
+}
+
+/*!
+ * \brief The single thread Parallel::confine() runs tasks on.
+ */
+class ConfinedThread : public QThread
+{
+    struct Call
+    {
+        Parallel::Task *task;
+        bool finished, failed;
+    };
+
+    QMutex lock;
+    QWaitCondition queued, finished;
+    QList<Call*> calls;
+    bool stopping;
+
+    static ConfinedThread *thread;
+    static QMutex threadLock;
+
+    ConfinedThread() : stopping(false) {}
+
+    void run()
+    {
+        QMutexLocker locker(&lock);
+        forever {
+            while (calls.isEmpty() && !stopping)
+                queued.wait(&lock);
+            if (calls.isEmpty()) return;
+
+            Call *call = calls.takeFirst();
+            locker.unlock();
+            try {
+                ContextScope scope(call->task->context);
+                call->task->run();
+            } catch (...) {
+                call->failed = true;
+            }
+            locker.relock();
+            call->finished = true;
+            finished.wakeAll();
+        }
+    }
+
+public:
+    static ConfinedThread *instance()
+    {
+        QMutexLocker locker(&threadLock);
+        if (thread == NULL) {
+            thread = new ConfinedThread();
+            thread->start();
+        }
+        return thread;
+    }
+
+    static void release()
+    {
+        QMutexLocker locker(&threadLock);
+        if (thread == NULL) return;
+        {
+            QMutexLocker threadLocker(&thread->lock);
+            thread->stopping = true;
+            thread->queued.wakeAll();
+        }
+        thread->wait();
+        delete thread;
+        thread = NULL;
+    }
+
+    // Returns false if the task threw
+    bool execute(Parallel::Task *task)
+    {
+        // Tasks confined from the confined thread itself, run directly
+        if (QThread::currentThread() == this) {
+            task->run();
+            return true;
+        }
+
+        Call call;
+        call.task = task;
+        call.finished = call.failed = false;
+        QMutexLocker locker(&lock);
+        calls.append(&call);
+        queued.wakeAll();
+        while (!call.finished)
+            finished.wait(&lock);
+        return !call.failed;
+    }
+};
+
+ConfinedThread *ConfinedThread::thread = NULL;
+QMutex ConfinedThread::threadLock;
+
+} // namespace
+
+/*!
+ * \ingroup initializers
+ * \brief Stops the workers of the shared task scheduler.
+ * \author Josh Klontz \cite jklontz
+ */
+class TaskSchedulerInitializer : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        Scheduler::release();
+        ConfinedThread::release();
+    }
+};
+
+BR_REGISTER(Initializer, TaskSchedulerInitializer)
+
+/* Parallel - global methods */
+void Parallel::execute(Task *task)
+{
+    TaskGroup *group = task->group;
+    {
+        // Workers run the tasks of every job
+        ContextScope scope(task->context);
+        const int admitted = admittedClasses.localData();
+        TaskGroup *const current = currentGroup.localData().group;
+        if (task->running) admittedClasses.setLocalData(admitted | (1 << task->priority));
+        currentGroup.localData().group = group;
+        task->run();
+        currentGroup.localData().group = current;
+        admittedClasses.setLocalData(admitted);
+    }
+    const bool capped = task->running && (task->cap > 0);
+    if (task->running) task->running->deref();
+    delete task;
+    if (capped) Scheduler::admittedFinished();
+    group->finish();
+}
+
+bool Parallel::help(TaskGroup *group)
+{
+    Scheduler *scheduler = Scheduler::instance(group ? group->executor : Compute);
+    Task *task = scheduler->take(scheduler->self(), group);
+    if (task == NULL) return false;
+    execute(task);
+    return true;
+}
+
+void Parallel::confine(Task *task)
+{
+    task->context = ContextPointer::job();
+    if (!ConfinedThread::instance()->execute(task))
+        throw std::runtime_error("Exception triggered in confined task.");
+}
+
+int Parallel::threadIndex()
+{
+    static QThreadStorage<int> index;
+    static QAtomicInt count;
+    if (!index.hasLocalData()) index.setLocalData(count.fetchAndAddRelaxed(1));
+    return index.localData();
+}
+
+int Parallel::nodes()
+{
+    return std::max(1, Scheduler::instance()->nodes.size());
+}
+
+/* TaskGroup - public methods */
+TaskGroup::TaskGroup(Parallel::Executor executor)
+    : pending(0), node(-1), executor(executor)
+{
+    static QAtomicInt count;
+    id = count.fetchAndAddRelaxed(1);
+    if (const TaskGroup *parent = currentGroup.localData().group) {
+        ancestors = parent->ancestors;
+        ancestors.append(parent->id);
+    }
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::wait()
+{
+    qint64 blocked = -1; // When the caller first ran out of work to help with, for tracing
+    while (pending.load() > 0) {
+        if (Parallel::help(this)) continue;
+
+        // Nothing left to steal, the remaining tasks are running on other threads
+        if ((blocked < 0) && Trace::enabled()) blocked = Trace::now();
+        QMutexLocker locker(&mutex);
+        if (pending.load() > 0)
+            finished.wait(&mutex, 1);
+    }
+    if (blocked >= 0) Trace::record("wait", "TaskGroup::wait", blocked);
+
+    // Synchronize with the thread that finished the last task before the group is destroyed
+    QMutexLocker locker(&mutex);
+}
+
+/* TaskGroup - private methods */
+void TaskGroup::submit(Parallel::Task *task)
+{
+    task->group = this;
+    task->context = ContextPointer::job();
+    task->node = node;
+
+    const Context *context = Globals;
+    if (context) {
+        task->priority = std::min(std::max(context->priority, int(Parallel::Background)), int(Parallel::Interactive));
+        task->cap = context->concurrency;
+        if (context->deadline > 0) task->due = QDateTime::currentMSecsSinceEpoch() + context->deadline;
+    }
+    pending.ref();
+    Scheduler::instance(executor)->submit(task);
+}
+
+void TaskGroup::finish()
+{
+    QMutexLocker locker(&mutex);
+    if (!pending.deref())
+        finished.wakeAll();
+}
+
+/* AlignedData - public methods */
+AlignedData::AlignedData(size_t size_)
+    : data(NULL), size(size_), ledger(NULL), kilobytes(0)
+{
+    if (!MemoryLedger::reserve(qint64(size), &ledger, &kilobytes)) {
+        // Page aligned, which satisfies both alignments below
+        spill.reset(new SpillData(size));
+        data = spill->data;
+        return;
+    }
+
+    const size_t alignment = (size >= Huge_Page) ? Huge_Page : 64;
+#ifdef _WIN32
+    data = (uchar*) _aligned_malloc(std::max(size, size_t(1)), alignment);
+#else
+    void *memory = NULL;
+    if (posix_memalign(&memory, alignment, std::max(size, size_t(1))) == 0)
+        data = (uchar*) memory;
+#endif
+    if (data == NULL) qFatal("Failed to allocate %s aligned bytes.", qPrintable(QString::number(size)));
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Fewer TLB misses while scanning large galleries
+    if (alignment == Huge_Page) madvise(data, size, MADV_HUGEPAGE);
+#endif
+}
+
+AlignedData::~AlignedData()
+{
+    if (spill) return;
+    MemoryLedger::release(ledger, kilobytes);
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+int AlignedData::node(const uchar *address) const
+{
+    if ((partitions.size() < 2) || (address < data) || (address >= data + size)) return -1;
+    return int(std::upper_bound(partitions.begin(), partitions.end(), address) - partitions.begin()) - 1;
+}
+
+#include "parallel.moc"
@@ -0,0 +1,530 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QVector>
+#include <QWaitCondition>
+#include <limits>
+
+namespace br
+{
+
+class Context;
+class SpillData;
+class TaskGroup;
+struct MemoryLedger;
+
+namespace Parallel
+{
+
+/*!
+ * \brief The worker pools a br::TaskGroup can run its tasks on.
+ *
+ * Blocking reads go to the I/O workers so they don't hold up the compute workers.
+ */
+enum Executor
+{
+    Compute, /*!< br::Context::parallelism workers, including the threads waiting on a group. */
+    IO /*!< br::Context::ioThreads workers, plus the threads waiting on a group, which run its own tasks in the meantime. */
+};
+
+/*!
+ * \brief Classes of br::Context::priority, queued tasks of a higher class are started first.
+ */
+enum Priority
+{
+    Background, /*!< Bulk work that may wait. */
+    Normal, /*!< The default. */
+    Interactive, /*!< Latency critical work, such as a verification, which preempts other work at the next task boundary. */
+    Priorities
+};
+
+/*!
+ * \brief A unit of work executed by the shared scheduler.
+ */
+struct Task
+{
+    TaskGroup *group;
+    Context *context; // Job context of the submitting thread, see br::ContextScope
+    int node; // NUMA node whose workers should run the task, -1 for any worker
+    int priority, cap; // Parallel::Priority and br::Context::concurrency of the submitting context
+    qint64 due; // Milliseconds since epoch by which the task should start, see br::Context::deadline
+    QAtomicInt *running; // Counter of started tasks of the priority class the task was admitted against, NULL if uncounted
+    Task() : group(NULL), context(NULL), node(-1), priority(Normal), cap(0), due(std::numeric_limits<qint64>::max()), running(NULL) {}
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+/*!
+ * \brief Runs \em task on the calling thread and notifies its group.
+ */
+void execute(Task *task);
+
+/*!
+ * \brief Runs one queued task on the calling thread, returns \c false if there was nothing to run.
+ *
+ * Workers pop their own most recently queued task first and otherwise steal the oldest task from another thread.
+ * If \em group is given only its tasks and those of groups created by its tasks are run, on the scheduler of its Parallel::Executor,
+ * otherwise any compute task is run, which is only safe for a thread that holds no locks and isn't running a task.
+ */
+bool help(TaskGroup *group = NULL);
+
+/*!
+ * \brief Runs \em task on a dedicated thread shared by every caller and blocks until it finishes.
+ *
+ * Calls are serialized in arrival order, for code that isn't reentrant or must stay on one thread, such as HighGUI windows.
+ * Exceptions thrown by the task are rethrown to the caller as \c std::runtime_error.
+ * Unlike TaskGroup::run(), the caller keeps ownership of \em task.
+ */
+void confine(Task *task);
+
+/*!
+ * \brief Returns a small integer that is unique to the calling thread for the lifetime of the process.
+ */
+int threadIndex();
+
+/*!
+ * \brief Returns the number of NUMA nodes the workers are pinned to.
+ *
+ * This is \c 1 unless br::Context::numa was set when the scheduler started on a multi-node Linux host.
+ */
+int nodes();
+
+template <typename R>
+struct FunctionTask0 : public Task
+{
+    R (*function)();
+
+    FunctionTask0(R (*function)()) : function(function) {}
+    void run() { function(); }
+};
+
+template <typename R, typename O, typename C>
+struct MemberTask0 : public Task
+{
+    O *object;
+    R (C::*method)();
+
+    MemberTask0(O *object, R (C::*method)()) : object(object), method(method) {}
+    void run() { (object->*method)(); }
+};
+
+template <typename R, typename O, typename C>
+struct ConstMemberTask0 : public Task
+{
+    const O *object;
+    R (C::*method)() const;
+
+    ConstMemberTask0(const O *object, R (C::*method)() const) : object(object), method(method) {}
+    void run() { (object->*method)(); }
+};
+
+template <typename R, typename P1, typename A1>
+struct FunctionTask1 : public Task
+{
+    R (*function)(P1);
+    A1 a1;
+    FunctionTask1(R (*function)(P1), const A1 &a1) : function(function), a1(a1) {}
+    void run() { function(a1); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename A1>
+struct MemberTask1 : public Task
+{
+    O *object;
+    R (C::*method)(P1);
+    A1 a1;
+    MemberTask1(O *object, R (C::*method)(P1), const A1 &a1) : object(object), method(method), a1(a1) {}
+    void run() { (object->*method)(a1); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename A1>
+struct ConstMemberTask1 : public Task
+{
+    const O *object;
+    R (C::*method)(P1) const;
+    A1 a1;
+    ConstMemberTask1(const O *object, R (C::*method)(P1) const, const A1 &a1) : object(object), method(method), a1(a1) {}
+    void run() { (object->*method)(a1); }
+};
+
+template <typename R, typename P1, typename P2, typename A1, typename A2>
+struct FunctionTask2 : public Task
+{
+    R (*function)(P1, P2);
+    A1 a1;
+    A2 a2;
+    FunctionTask2(R (*function)(P1, P2), const A1 &a1, const A2 &a2) : function(function), a1(a1), a2(a2) {}
+    void run() { function(a1, a2); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename A1, typename A2>
+struct MemberTask2 : public Task
+{
+    O *object;
+    R (C::*method)(P1, P2);
+    A1 a1;
+    A2 a2;
+    MemberTask2(O *object, R (C::*method)(P1, P2), const A1 &a1, const A2 &a2) : object(object), method(method), a1(a1), a2(a2) {}
+    void run() { (object->*method)(a1, a2); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename A1, typename A2>
+struct ConstMemberTask2 : public Task
+{
+    const O *object;
+    R (C::*method)(P1, P2) const;
+    A1 a1;
+    A2 a2;
+    ConstMemberTask2(const O *object, R (C::*method)(P1, P2) const, const A1 &a1, const A2 &a2) : object(object), method(method), a1(a1), a2(a2) {}
+    void run() { (object->*method)(a1, a2); }
+};
+
+template <typename R, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+struct FunctionTask3 : public Task
+{
+    R (*function)(P1, P2, P3);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    FunctionTask3(R (*function)(P1, P2, P3), const A1 &a1, const A2 &a2, const A3 &a3) : function(function), a1(a1), a2(a2), a3(a3) {}
+    void run() { function(a1, a2, a3); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+struct MemberTask3 : public Task
+{
+    O *object;
+    R (C::*method)(P1, P2, P3);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    MemberTask3(O *object, R (C::*method)(P1, P2, P3), const A1 &a1, const A2 &a2, const A3 &a3) : object(object), method(method), a1(a1), a2(a2), a3(a3) {}
+    void run() { (object->*method)(a1, a2, a3); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+struct ConstMemberTask3 : public Task
+{
+    const O *object;
+    R (C::*method)(P1, P2, P3) const;
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    ConstMemberTask3(const O *object, R (C::*method)(P1, P2, P3) const, const A1 &a1, const A2 &a2, const A3 &a3) : object(object), method(method), a1(a1), a2(a2), a3(a3) {}
+    void run() { (object->*method)(a1, a2, a3); }
+};
+
+template <typename R, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+struct FunctionTask4 : public Task
+{
+    R (*function)(P1, P2, P3, P4);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    FunctionTask4(R (*function)(P1, P2, P3, P4), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4) : function(function), a1(a1), a2(a2), a3(a3), a4(a4) {}
+    void run() { function(a1, a2, a3, a4); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+struct MemberTask4 : public Task
+{
+    O *object;
+    R (C::*method)(P1, P2, P3, P4);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    MemberTask4(O *object, R (C::*method)(P1, P2, P3, P4), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4) : object(object), method(method), a1(a1), a2(a2), a3(a3), a4(a4) {}
+    void run() { (object->*method)(a1, a2, a3, a4); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+struct ConstMemberTask4 : public Task
+{
+    const O *object;
+    R (C::*method)(P1, P2, P3, P4) const;
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    ConstMemberTask4(const O *object, R (C::*method)(P1, P2, P3, P4) const, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4) : object(object), method(method), a1(a1), a2(a2), a3(a3), a4(a4) {}
+    void run() { (object->*method)(a1, a2, a3, a4); }
+};
+
+template <typename R, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+struct FunctionTask5 : public Task
+{
+    R (*function)(P1, P2, P3, P4, P5);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    A5 a5;
+    FunctionTask5(R (*function)(P1, P2, P3, P4, P5), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5) : function(function), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+    void run() { function(a1, a2, a3, a4, a5); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+struct MemberTask5 : public Task
+{
+    O *object;
+    R (C::*method)(P1, P2, P3, P4, P5);
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    A5 a5;
+    MemberTask5(O *object, R (C::*method)(P1, P2, P3, P4, P5), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5) : object(object), method(method), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+    void run() { (object->*method)(a1, a2, a3, a4, a5); }
+};
+
+template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+struct ConstMemberTask5 : public Task
+{
+    const O *object;
+    R (C::*method)(P1, P2, P3, P4, P5) const;
+    A1 a1;
+    A2 a2;
+    A3 a3;
+    A4 a4;
+    A5 a5;
+    ConstMemberTask5(const O *object, R (C::*method)(P1, P2, P3, P4, P5) const, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5) : object(object), method(method), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+    void run() { (object->*method)(a1, a2, a3, a4, a5); }
+};
+
+} // namespace Parallel
+
+/*!
+ * \brief Fork/join interface to the shared work-stealing scheduler.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Replaces the \c QFutureSynchronizer / \c QtConcurrent::run idiom:
+ * \code
+ * TaskGroup tasks;
+ * for (int i=0; i<data.size(); i++)
+ *     tasks.run(this, &MyTransform::_project, &data[i]);
+ * tasks.wait();
+ * \endcode
+ * Arguments are copied like \c QtConcurrent::run.
+ * A thread waiting on a group executes its queued tasks, and those of the groups its tasks create, until the group completes,
+ * so nested groups neither deadlock nor create more threads than br::Context::parallelism.
+ * Unrelated tasks never run on a waiting thread, so a task may wait on a group while it holds a lock the group's tasks don't take.
+ * Groups constructed with Parallel::IO run their tasks on separate I/O workers instead, for reads that would otherwise block a compute thread.
+ */
+class TaskGroup
+{
+    QAtomicInt pending;
+    QMutex mutex;
+    QWaitCondition finished;
+    int node;
+    Parallel::Executor executor;
+    int id;
+    QVector<int> ancestors; // Ids of the groups whose tasks created this one, copied so a group may outlive them
+
+    void submit(Parallel::Task *task);
+    void finish();
+    friend void Parallel::execute(Parallel::Task *task);
+    friend bool Parallel::help(TaskGroup *group);
+
+public:
+    TaskGroup(Parallel::Executor executor = Parallel::Compute); /*!< \brief Tasks run on the workers of \em executor. */
+    ~TaskGroup(); /*!< \brief Calls wait(). */
+    void wait(); /*!< \brief Blocks until every task in the group has finished, executing its queued tasks in the meantime. */
+    bool within(const TaskGroup *group) const /*!< \brief \c true if this is \em group or was created by one of its tasks, directly or not. */
+    {
+        return (group->id == id) || ancestors.contains(group->id);
+    }
+    void setNode(int node) { this->node = node; } /*!< \brief Later tasks prefer the workers of NUMA \em node, \c -1 (default) for any worker, idle workers of other nodes still take them. */
+
+    template <typename R>
+    void run(R (*function)())
+    { submit(new Parallel::FunctionTask0<R>(function)); }
+
+    template <typename R, typename O, typename C>
+    void run(O *object, R (C::*method)())
+    { submit(new Parallel::MemberTask0<R, O, C>(object, method)); }
+
+    template <typename R, typename O, typename C>
+    void run(const O *object, R (C::*method)() const)
+    { submit(new Parallel::ConstMemberTask0<R, O, C>(object, method)); }
+
+    template <typename R, typename P1, typename A1>
+    void run(R (*function)(P1), const A1 &a1)
+    { submit(new Parallel::FunctionTask1<R, P1, A1>(function, a1)); }
+
+    template <typename R, typename O, typename C, typename P1, typename A1>
+    void run(O *object, R (C::*method)(P1), const A1 &a1)
+    { submit(new Parallel::MemberTask1<R, O, C, P1, A1>(object, method, a1)); }
+
+    template <typename R, typename O, typename C, typename P1, typename A1>
+    void run(const O *object, R (C::*method)(P1) const, const A1 &a1)
+    { submit(new Parallel::ConstMemberTask1<R, O, C, P1, A1>(object, method, a1)); }
+
+    template <typename R, typename P1, typename P2, typename A1, typename A2>
+    void run(R (*function)(P1, P2), const A1 &a1, const A2 &a2)
+    { submit(new Parallel::FunctionTask2<R, P1, P2, A1, A2>(function, a1, a2)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename A1, typename A2>
+    void run(O *object, R (C::*method)(P1, P2), const A1 &a1, const A2 &a2)
+    { submit(new Parallel::MemberTask2<R, O, C, P1, P2, A1, A2>(object, method, a1, a2)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename A1, typename A2>
+    void run(const O *object, R (C::*method)(P1, P2) const, const A1 &a1, const A2 &a2)
+    { submit(new Parallel::ConstMemberTask2<R, O, C, P1, P2, A1, A2>(object, method, a1, a2)); }
+
+    template <typename R, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+    void run(R (*function)(P1, P2, P3), const A1 &a1, const A2 &a2, const A3 &a3)
+    { submit(new Parallel::FunctionTask3<R, P1, P2, P3, A1, A2, A3>(function, a1, a2, a3)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+    void run(O *object, R (C::*method)(P1, P2, P3), const A1 &a1, const A2 &a2, const A3 &a3)
+    { submit(new Parallel::MemberTask3<R, O, C, P1, P2, P3, A1, A2, A3>(object, method, a1, a2, a3)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+    void run(const O *object, R (C::*method)(P1, P2, P3) const, const A1 &a1, const A2 &a2, const A3 &a3)
+    { submit(new Parallel::ConstMemberTask3<R, O, C, P1, P2, P3, A1, A2, A3>(object, method, a1, a2, a3)); }
+
+    template <typename R, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+    void run(R (*function)(P1, P2, P3, P4), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4)
+    { submit(new Parallel::FunctionTask4<R, P1, P2, P3, P4, A1, A2, A3, A4>(function, a1, a2, a3, a4)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+    void run(O *object, R (C::*method)(P1, P2, P3, P4), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4)
+    { submit(new Parallel::MemberTask4<R, O, C, P1, P2, P3, P4, A1, A2, A3, A4>(object, method, a1, a2, a3, a4)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename A1, typename A2, typename A3, typename A4>
+    void run(const O *object, R (C::*method)(P1, P2, P3, P4) const, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4)
+    { submit(new Parallel::ConstMemberTask4<R, O, C, P1, P2, P3, P4, A1, A2, A3, A4>(object, method, a1, a2, a3, a4)); }
+
+    template <typename R, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+    void run(R (*function)(P1, P2, P3, P4, P5), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5)
+    { submit(new Parallel::FunctionTask5<R, P1, P2, P3, P4, P5, A1, A2, A3, A4, A5>(function, a1, a2, a3, a4, a5)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+    void run(O *object, R (C::*method)(P1, P2, P3, P4, P5), const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5)
+    { submit(new Parallel::MemberTask5<R, O, C, P1, P2, P3, P4, P5, A1, A2, A3, A4, A5>(object, method, a1, a2, a3, a4, a5)); }
+
+    template <typename R, typename O, typename C, typename P1, typename P2, typename P3, typename P4, typename P5, typename A1, typename A2, typename A3, typename A4, typename A5>
+    void run(const O *object, R (C::*method)(P1, P2, P3, P4, P5) const, const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5)
+    { submit(new Parallel::ConstMemberTask5<R, O, C, P1, P2, P3, P4, P5, A1, A2, A3, A4, A5>(object, method, a1, a2, a3, a4, a5)); }
+};
+
+/*!
+ * \brief One copy of a value per thread, for accumulating results without locks.
+ *
+ * Each thread gets its own copy of the initial value the first time it calls local().
+ * The copies returned by values() stay valid until reset(), which must only be called once the threads using their copies are done.
+ */
+template <typename T>
+class ThreadLocal
+{
+    enum { Slots = 256 }; // Threads with larger indices fall back to a locked hash
+    T initial;
+    QAtomicPointer<T> slots[Slots];
+    QHash<int, T*> overflow;
+    QList<T*> copies;
+    mutable QMutex lock;
+
+    T *create()
+    {
+        T *copy = new T(initial);
+        copies.append(copy);
+        return copy;
+    }
+
+public:
+    explicit ThreadLocal(const T &initial = T()) : initial(initial) {}
+    ~ThreadLocal() { qDeleteAll(copies); }
+
+    T &local() /*!< \brief The calling thread's copy. */
+    {
+        const int index = Parallel::threadIndex();
+        if (index < Slots) {
+            T *copy = slots[index].loadAcquire();
+            if (copy == NULL) {
+                QMutexLocker locker(&lock);
+                copy = create();
+                slots[index].storeRelease(copy);
+            }
+            return *copy;
+        }
+
+        QMutexLocker locker(&lock);
+        T *&copy = overflow[index];
+        if (copy == NULL) copy = create();
+        return *copy;
+    }
+
+    QList<T*> values() const /*!< \brief Every copy made so far. */
+    {
+        QMutexLocker locker(&lock);
+        return copies;
+    }
+
+    void reset(const T &initial) /*!< \brief Discards the copies, later calls to local() start from \em initial. */
+    {
+        QMutexLocker locker(&lock);
+        qDeleteAll(copies);
+        copies.clear();
+        overflow.clear();
+        for (int i=0; i<Slots; i++)
+            slots[i].storeRelease(NULL);
+        this->initial = initial;
+    }
+};
+
+/*!
+ * \brief Storage of br::TemplateList::align().
+ *
+ * Allocations of a huge page or more are huge page aligned and advised to be backed by huge pages.
+ * When Parallel::nodes() is more than one, each node's partition of the templates is first written by that node's workers
+ * so its pages are local to them.
+ * Allocations are charged to Context::memoryLimit, those that don't fit are backed by a br::SpillData instead.
+ */
+struct AlignedData
+{
+    enum { Huge_Page = 2*1024*1024 };
+
+    uchar *data;
+    size_t size;
+    QVector<const uchar*> partitions; /*!< \brief First address of each node's partition. */
+    QSharedPointer<AlignedData> previous; /*!< \brief The chunk before this one in an arena, kept alive by this one. */
+
+    explicit AlignedData(size_t size);
+    ~AlignedData();
+    int node(const uchar *address) const; /*!< \brief The node whose partition holds \em address, \c -1 if the data isn't partitioned. */
+
+private:
+    MemoryLedger *ledger;
+    int kilobytes;
+    QScopedPointer<SpillData> spill;
+    Q_DISABLE_COPY(AlignedData)
+};
+
+} // namespace br
+
+#endif // __PARALLEL_H
@@ -27,13 +27,18 @@
 #include <QStringList>
 #include <QVector>
 #include <QtAlgorithms>
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <opencv2/core/core.hpp>
 #include <assert.h>
+#include <cmath>
 
 #include "plot.h"
 #include "version.h"
 #include "openbr/core/bee.h"
 #include "openbr/core/common.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
 #undef FAR // Windows preprecessor definition
@@ -72,17 +77,7 @@ static QStringList getPivots(const QString &file, bool headers)
     return str.split("_");
 }
 
-struct Comparison
-{
-    float score;
-    int target, query;
-    bool genuine;
-
-    Comparison() {}
-    Comparison(float _score, int _target, int _query, bool _genuine)
-        : score(_score), target(_target), query(_query), genuine(_genuine) {}
-    inline bool operator<(const Comparison &other) const { return score > other.score; }
-};
+static const int Max_Points = 500;
 
 struct OperatingPoint
 {
@@ -109,92 +104,12 @@ static float getTAR(const QList<OperatingPoint> &operatingPoints, float FAR)
     return m * FAR + b;
 }
 
-float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
+static float writeEvaluation(int rows, int columns, qint64 genuineCount, qint64 impostorCount, QList<OperatingPoint> operatingPoints,
+                             const QVector<float> &genuines, const QVector<float> &impostors, float minGenuineScore, float minImpostorScore,
+                             const QVector<int> &firstGenuineReturns, const QString &csv, const QStringList &intervals = QStringList())
 {
-    qDebug("Evaluating %s with %s", qPrintable(simmat), qPrintable(mask));
-
-    const int Max_Points = 500;
     float result = -1;
 
-    // Read files
-    const Mat scores = BEE::readSimmat(simmat);
-    File maskFile(mask);
-    maskFile.set("rows", scores.rows);
-    maskFile.set("columns", scores.cols);
-    const Mat masks = BEE::readMask(maskFile);
-    if (scores.size() != masks.size()) qFatal("Simmat/Mask size mismatch.");
-
-    // Make comparisons
-    QList<Comparison> comparisons; comparisons.reserve(scores.rows*scores.cols);
-    int genuineCount = 0, impostorCount = 0, numNaNs = 0;
-    for (int i=0; i<scores.rows; i++) {
-        for (int j=0; j<scores.cols; j++) {
-            const BEE::Mask_t mask_val = masks.at<BEE::Mask_t>(i,j);
-            const BEE::Simmat_t simmat_val = scores.at<BEE::Simmat_t>(i,j);
-            if (mask_val == BEE::DontCare) continue;
-            if (simmat_val != simmat_val) { numNaNs++; continue; }
-            comparisons.append(Comparison(simmat_val, j, i, mask_val == BEE::Match));
-            if (comparisons.last().genuine) genuineCount++;
-            else                            impostorCount++;
-        }
-    }
-
-    if (numNaNs > 0) qWarning("Encountered %d NaN scores!", numNaNs);
-    if (genuineCount == 0) qFatal("No genuine scores!");
-    if (impostorCount == 0) qFatal("No impostor scores!");
-
-    // Sort comparisons by simmat_val (score)
-    std::sort(comparisons.begin(), comparisons.end());
-
-    double genuineSum = 0, impostorSum = 0;
-    QList<OperatingPoint> operatingPoints;
-    QList<float> genuines, impostors;
-    QVector<int> firstGenuineReturns(scores.rows, 0);
-
-    int falsePositives = 0, previousFalsePositives = 0;
-    int truePositives = 0, previousTruePositives = 0;
-    int index = 0;
-    float minGenuineScore = std::numeric_limits<float>::max();
-    float minImpostorScore = std::numeric_limits<float>::max();
-
-    while (index < comparisons.size()) {
-        float thresh = comparisons[index].score;
-        // Compute genuine and imposter statistics at a threshold
-        while ((index < comparisons.size()) &&
-               (comparisons[index].score == thresh)) {
-            const Comparison &comparison = comparisons[index];
-            if (comparison.genuine) {
-                truePositives++;
-                genuineSum += comparison.score;
-                genuines.append(comparison.score);
-                if (firstGenuineReturns[comparison.query] < 1)
-                    firstGenuineReturns[comparison.query] = abs(firstGenuineReturns[comparison.query]) + 1;
-                if ((comparison.score != -std::numeric_limits<float>::max()) &&
-                    (comparison.score < minGenuineScore))
-                    minGenuineScore = comparison.score;
-            } else {
-                falsePositives++;
-                impostorSum += comparison.score;
-                impostors.append(comparison.score);
-                if (firstGenuineReturns[comparison.query] < 1)
-                    firstGenuineReturns[comparison.query]--;
-                if ((comparison.score != -std::numeric_limits<float>::max()) &&
-                    (comparison.score < minImpostorScore))
-                    minImpostorScore = comparison.score;
-            }
-            index++;
-        }
-
-        if ((falsePositives > previousFalsePositives) &&
-             (truePositives > previousTruePositives)) {
-            // Restrict the extreme ends of the curve
-            if ((falsePositives >= 10) && (falsePositives < impostorCount/2))
-                operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
-            previousFalsePositives = falsePositives;
-            previousTruePositives = truePositives;
-        }
-    }
-
     if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
     if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
     if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
@@ -202,11 +117,11 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
     // Write Metadata table
     QStringList lines;
     lines.append("Plot,X,Y");
-    lines.append("Metadata,"+QString::number(scores.cols)+",Gallery");
-    lines.append("Metadata,"+QString::number(scores.rows)+",Probe");
+    lines.append("Metadata,"+QString::number(columns)+",Gallery");
+    lines.append("Metadata,"+QString::number(rows)+",Probe");
     lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
     lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
-    lines.append("Metadata,"+QString::number(scores.cols*scores.rows-(genuineCount+impostorCount))+",Ignored");
+    lines.append("Metadata,"+QString::number(qint64(columns)*qint64(rows)-(genuineCount+impostorCount))+",Ignored");
 
     // Write Detection Error Tradeoff (DET), PRE, REC
     int points = qMin(operatingPoints.size(), Max_Points);
@@ -249,7 +164,6 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
         lines.append(QString("KDEImpostor,%1,%2").arg(QString::number(f), QString::number(Common::KernelDensityEstimation(sampledImpostorScores, f, hImpostor))));
 
     // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 25;
     float maxRankRate;
     for (int i=1; i<=Max_Retrieval; i++) {
         int realizedReturns = 0, possibleReturns = 0;
@@ -261,11 +175,451 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
         if (i==(Max_Retrieval)) maxRankRate = float(realizedReturns)/possibleReturns;
     }
 
+    lines.append(intervals);
     if (!csv.isEmpty()) QtUtils::writeFile(csv, lines);
     qDebug("TAR @ FAR = 0.01: %.3f\nRetrieval Rate at Rank 25: %.3f", result, maxRankRate);
     return result;
 }
 
+// Keeps genuine scores exactly and bins impostor scores, reading a block of rows at a time
+static float evaluateStream(BEE::MatrixReader &scores, BEE::MatrixReader &masks, int bins, const QString &csv)
+{
+    if ((scores.rows != masks.rows) || (scores.columns != masks.columns)) qFatal("Simmat/Mask size mismatch.");
+    const int blockRows = std::max(1, (1 << 24) / std::max(1, scores.columns));
+
+    // The first pass finds the range of impostor scores to bin
+    float minImpostor = std::numeric_limits<float>::max();
+    float maxImpostor = -std::numeric_limits<float>::max();
+    for (Mat s = scores.read(blockRows), m = masks.read(blockRows); !s.empty(); s = scores.read(blockRows), m = masks.read(blockRows)) {
+        for (int i=0; i<s.rows; i++) {
+            for (int j=0; j<s.cols; j++) {
+                const float score = s.at<BEE::Simmat_t>(i,j);
+                if ((m.at<BEE::Mask_t>(i,j) != BEE::NonMatch) || (score != score) || (score == -std::numeric_limits<float>::max())) continue;
+                minImpostor = std::min(minImpostor, score);
+                maxImpostor = std::max(maxImpostor, score);
+            }
+        }
+    }
+    if (minImpostor > maxImpostor) minImpostor = maxImpostor = 0;
+    scores.reset();
+    masks.reset();
+
+    const double width = (maxImpostor > minImpostor) ? (double(maxImpostor) - minImpostor) / bins : 1;
+    qDebug("Impostor score resolution: %g (%d bins)", width, bins);
+
+    QVector<qint64> histogram(bins, 0);
+    QVector<float> genuines;
+    QVector<int> firstGenuineReturns(scores.rows, 0);
+    qint64 numNaNs = 0;
+    int row = 0;
+    for (Mat s = scores.read(blockRows), m = masks.read(blockRows); !s.empty(); s = scores.read(blockRows), m = masks.read(blockRows)) {
+        for (int i=0; i<s.rows; i++, row++) {
+            // The best genuine score of the query determines its retrieval rank
+            bool hasGenuine = false;
+            float bestGenuine = -std::numeric_limits<float>::max();
+            for (int j=0; j<s.cols; j++) {
+                const float score = s.at<BEE::Simmat_t>(i,j);
+                if ((m.at<BEE::Mask_t>(i,j) == BEE::Match) && (score == score)) {
+                    bestGenuine = hasGenuine ? std::max(bestGenuine, score) : score;
+                    hasGenuine = true;
+                }
+            }
+
+            int impostorsAbove = 0;
+            for (int j=0; j<s.cols; j++) {
+                const BEE::Mask_t mask_val = m.at<BEE::Mask_t>(i,j);
+                const float score = s.at<BEE::Simmat_t>(i,j);
+                if (mask_val == BEE::DontCare) continue;
+                if (score != score) { numNaNs++; continue; }
+                if (mask_val == BEE::Match) {
+                    genuines.append(score);
+                } else {
+                    histogram[std::max(0, std::min(bins-1, int((double(score) - minImpostor) / width)))]++;
+                    if (!hasGenuine || (score > bestGenuine))
+                        impostorsAbove++;
+                }
+            }
+            firstGenuineReturns[row] = hasGenuine ? impostorsAbove + 1 : -impostorsAbove;
+        }
+    }
+
+    return EvaluateHistogram(scores.rows, scores.columns, genuines, histogram, minImpostor, width, firstGenuineReturns, numNaNs, csv);
+}
+
+// Smallest score other than -FLT_MAX, which marks failures to enroll
+static float minScore(const QVector<float> &descending)
+{
+    for (int i=descending.size()-1; i>=0; i--)
+        if (descending[i] != -std::numeric_limits<float>::max())
+            return descending[i];
+    return std::numeric_limits<float>::max();
+}
+
+float EvaluateHistogram(int rows, int columns, QVector<float> genuines, const QVector<qint64> &histogram, float minImpostor, double width,
+                        const QVector<int> &firstGenuineReturns, qint64 numNaNs, const QString &csv)
+{
+    const int bins = histogram.size();
+    const qint64 genuineCount = genuines.size();
+    qint64 impostorCount = 0;
+    foreach (qint64 count, histogram)
+        impostorCount += count;
+
+    if (numNaNs > 0) qWarning("Encountered %lld NaN scores!", numNaNs);
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
+
+    // Sweep the threshold down from the highest impostor bin
+    std::sort(genuines.begin(), genuines.end(), std::greater<float>());
+    QList<OperatingPoint> operatingPoints;
+    qint64 falsePositives = 0, previousFalsePositives = 0;
+    qint64 truePositives = 0, previousTruePositives = 0;
+    for (int b=bins-1; b>=0; b--) {
+        if (histogram[b] == 0) continue;
+        const float thresh = minImpostor + b*width;
+        falsePositives += histogram[b];
+        while ((truePositives < genuines.size()) && (genuines[int(truePositives)] >= thresh))
+            truePositives++;
+
+        if ((falsePositives > previousFalsePositives) &&
+             (truePositives > previousTruePositives)) {
+            // Restrict the extreme ends of the curve
+            if ((falsePositives >= 10) && (falsePositives < impostorCount/2))
+                operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    // Impostor quantiles are recovered from the histogram at bin centers
+    QVector<float> impostors;
+    const int points = int(std::min(qint64(Max_Points), impostorCount));
+    int bin = bins-1;
+    qint64 seen = histogram[bin];
+    for (int i=0; i<points; i++) {
+        const qint64 rank = (points > 1) ? qint64(double(i) / double(points-1) * double(impostorCount-1)) : 0;
+        while (seen <= rank) seen += histogram[--bin];
+        impostors.append(minImpostor + (bin + 0.5)*width);
+    }
+
+    return writeEvaluation(rows, columns, genuineCount, impostorCount, operatingPoints, genuines, impostors,
+                           minScore(genuines), minImpostor, firstGenuineReturns, csv);
+}
+
+// A score tagged with its query, the row of a genuine score or ~row of an impostor score
+struct RankedScore
+{
+    float score;
+    int row;
+    RankedScore() {}
+    RankedScore(float score, int row) : score(score), row(row) {}
+    bool operator>(const RankedScore &other) const { return score > other.score; }
+};
+
+// Scores of a block of rows and the retrieval rank of each of its queries
+struct ScoreBlock
+{
+    const Mat *scores, *masks;
+    int begin, end;
+    QVector<int> *firstGenuineReturns;
+    QVector<float> genuines, impostors; // Descending
+    bool ranked;
+    QVector<RankedScore> ranks; // Descending, when ranked
+    qint64 numNaNs;
+
+    ScoreBlock() {}
+    ScoreBlock(const Mat *scores, const Mat *masks, int begin, int end, QVector<int> *firstGenuineReturns, bool ranked)
+        : scores(scores), masks(masks), begin(begin), end(end), firstGenuineReturns(firstGenuineReturns), ranked(ranked), numNaNs(0) {}
+};
+
+static void scanScores(ScoreBlock *block)
+{
+    const int columns = block->scores->cols;
+    for (int i=block->begin; i<block->end; i++) {
+        const BEE::Simmat_t *s = block->scores->ptr<BEE::Simmat_t>(i);
+        const BEE::Mask_t *m = block->masks->ptr<BEE::Mask_t>(i);
+
+        // A query's rank is one more than the impostors scoring above its best genuine, no sort needed
+        bool hasGenuine = false;
+        float bestGenuine = -std::numeric_limits<float>::max();
+        for (int j=0; j<columns; j++) {
+            if (m[j] == BEE::DontCare) continue;
+            const float score = s[j];
+            if (score != score) { block->numNaNs++; continue; }
+            if (m[j] == BEE::Match) {
+                block->genuines.append(score);
+                bestGenuine = hasGenuine ? std::max(bestGenuine, score) : score;
+                hasGenuine = true;
+            } else {
+                block->impostors.append(score);
+            }
+            if (block->ranked) block->ranks.append(RankedScore(score, (m[j] == BEE::Match) ? i : ~i));
+        }
+
+        int impostorsAbove = 0;
+        for (int j=0; j<columns; j++)
+            if ((m[j] == BEE::NonMatch) && (s[j] == s[j]) && (!hasGenuine || (s[j] > bestGenuine)))
+                impostorsAbove++;
+        (*block->firstGenuineReturns)[i] = hasGenuine ? impostorsAbove + 1 : -impostorsAbove;
+    }
+
+    std::sort(block->genuines.begin(), block->genuines.end(), std::greater<float>());
+    std::sort(block->impostors.begin(), block->impostors.end(), std::greater<float>());
+    if (block->ranked) std::sort(block->ranks.begin(), block->ranks.end(), std::greater<RankedScore>());
+}
+
+template <typename T>
+static void mergePair(const QVector<T> *a, const QVector<T> *b, QVector<T> *merged)
+{
+    merged->resize(a->size() + b->size());
+    std::merge(a->begin(), a->end(), b->begin(), b->end(), merged->begin(), std::greater<T>());
+}
+
+// Merges descending lists pairwise, each round in parallel
+template <typename T>
+static QVector<T> mergeScores(QList< QVector<T> > lists)
+{
+    if (lists.isEmpty()) return QVector<T>();
+    while (lists.size() > 1) {
+        QList< QVector<T> > merged;
+        for (int i=0; i<lists.size(); i += 2)
+            merged.append(QVector<T>());
+
+        TaskGroup tasks;
+        for (int i=0; i+1<lists.size(); i += 2) {
+            if (Globals->parallelism) tasks.run(&mergePair<T>, (const QVector<T>*) &lists[i], (const QVector<T>*) &lists[i+1], &merged[i/2]);
+            else                      mergePair(&lists[i], &lists[i+1], &merged[i/2]);
+        }
+        tasks.wait();
+
+        if (lists.size() % 2 == 1) merged.last() = lists.last();
+        lists = merged;
+    }
+    return lists.first();
+}
+
+// Sweeps both descending lists together, one distinct threshold at a time
+static float evaluateSorted(int rows, int columns, const QVector<float> &genuines, const QVector<float> &impostors,
+                            const QVector<int> &firstGenuineReturns, qint64 numNaNs, const QString &csv,
+                            const QStringList &intervals = QStringList())
+{
+    const qint64 genuineCount = genuines.size();
+    const qint64 impostorCount = impostors.size();
+
+    if (numNaNs > 0) qWarning("Encountered %lld NaN scores!", numNaNs);
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
+
+    QList<OperatingPoint> operatingPoints;
+    qint64 falsePositives = 0, previousFalsePositives = 0;
+    qint64 truePositives = 0, previousTruePositives = 0;
+    while ((truePositives < genuineCount) || (falsePositives < impostorCount)) {
+        float thresh;
+        if      (truePositives == genuineCount)   thresh = impostors[falsePositives];
+        else if (falsePositives == impostorCount) thresh = genuines[truePositives];
+        else                                      thresh = std::max(genuines[truePositives], impostors[falsePositives]);
+        while ((truePositives < genuineCount) && (genuines[truePositives] == thresh)) truePositives++;
+        while ((falsePositives < impostorCount) && (impostors[falsePositives] == thresh)) falsePositives++;
+
+        if ((falsePositives > previousFalsePositives) &&
+             (truePositives > previousTruePositives)) {
+            // Restrict the extreme ends of the curve
+            if ((falsePositives >= 10) && (falsePositives < impostorCount/2))
+                operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    return writeEvaluation(rows, columns, genuineCount, impostorCount, operatingPoints, genuines, impostors,
+                           minScore(genuines), minScore(impostors), firstGenuineReturns, csv, intervals);
+}
+
+static const float Bootstrap_FARs[] = { 0.001f, 0.01f }; // The FAR/TAR bar chart's operating points
+static const int Bootstrap_Points = sizeof(Bootstrap_FARs) / sizeof(float);
+
+// Metrics of one bootstrap replicate, NaN where the replicate has no genuine or impostor scores
+struct Replicate
+{
+    const QVector<RankedScore> *ranks;
+    const QVector<int> *firstGenuineReturns;
+    int seed;
+    float TAR[Bootstrap_Points], EER, retrieval[Max_Retrieval];
+};
+
+// Draws the replicate's queries with replacement and weighs each score by how often its query was drawn,
+// so the scores sorted once are swept instead of resampled and sorted again
+static void resample(Replicate *replicate)
+{
+    const QVector<RankedScore> &ranks = *replicate->ranks;
+    const QVector<int> &firstGenuineReturns = *replicate->firstGenuineReturns;
+    const int rows = firstGenuineReturns.size();
+    QVector<int> weights(rows, 0);
+    RNG rng(replicate->seed);
+    for (int i=0; i<rows; i++)
+        weights[rng.uniform(0, rows)]++;
+
+    const float NaN = std::numeric_limits<float>::quiet_NaN();
+    qint64 genuineTotal = 0, impostorTotal = 0;
+    foreach (const RankedScore &rank, ranks) {
+        if (rank.row >= 0) genuineTotal += weights[rank.row];
+        else               impostorTotal += weights[~rank.row];
+    }
+
+    // Each TAR is the highest reached without exceeding its FAR, the EER is taken where FRR first falls to FAR
+    for (int k=0; k<Bootstrap_Points; k++)
+        replicate->TAR[k] = NaN;
+    replicate->EER = NaN;
+    if ((genuineTotal > 0) && (impostorTotal > 0)) {
+        qint64 truePositives = 0, falsePositives = 0;
+        float TAR = 0;
+        int i = 0;
+        while (i < ranks.size()) {
+            const float thresh = ranks[i].score;
+            for (; (i < ranks.size()) && (ranks[i].score == thresh); i++) {
+                if (ranks[i].row >= 0) truePositives += weights[ranks[i].row];
+                else                   falsePositives += weights[~ranks[i].row];
+            }
+
+            const float FAR = float(falsePositives) / impostorTotal;
+            for (int k=0; k<Bootstrap_Points; k++)
+                if ((replicate->TAR[k] != replicate->TAR[k]) && (FAR > Bootstrap_FARs[k]))
+                    replicate->TAR[k] = TAR;
+            TAR = float(truePositives) / genuineTotal;
+            if ((replicate->EER != replicate->EER) && (1 - TAR <= FAR))
+                replicate->EER = (FAR + 1 - TAR) / 2;
+        }
+        for (int k=0; k<Bootstrap_Points; k++)
+            if (replicate->TAR[k] != replicate->TAR[k])
+                replicate->TAR[k] = TAR;
+    }
+
+    // Retrieval rates follow the CMC curve in writeEvaluation()
+    qint64 possibleReturns = 0;
+    QVector<qint64> realizedReturns(Max_Retrieval+1, 0);
+    for (int i=0; i<rows; i++) {
+        if (weights[i] == 0) continue;
+        if (firstGenuineReturns[i] > 0) possibleReturns += weights[i];
+        if (firstGenuineReturns[i] <= Max_Retrieval) realizedReturns[std::max(1, firstGenuineReturns[i])] += weights[i];
+    }
+    for (int k=1; k<=Max_Retrieval; k++) {
+        if (k > 1) realizedReturns[k] += realizedReturns[k-1];
+        replicate->retrieval[k-1] = (possibleReturns > 0) ? float(realizedReturns[k]) / possibleReturns : NaN;
+    }
+}
+
+// Appends the percentile interval of the replicates' values as <name>Lower and <name>Upper rows at x
+static void appendInterval(const QVector<float> &values, float confidence, const QString &name, const QString &x, QStringList &lines)
+{
+    QVector<float> sorted;
+    foreach (float value, values)
+        if (value == value) sorted.append(value);
+    if (sorted.isEmpty()) return;
+
+    std::sort(sorted.begin(), sorted.end());
+    const double alpha = (1 - confidence) / 2;
+    lines.append(QString("%1Lower,%2,%3").arg(name, x, QString::number(sorted[int(std::floor(alpha * (sorted.size()-1)))])));
+    lines.append(QString("%1Upper,%2,%3").arg(name, x, QString::number(sorted[int(std::ceil((1-alpha) * (sorted.size()-1)))])));
+}
+
+// Confidence intervals of the bar chart TARs, the EER and the CMC curve, from replicates resampling the queries in parallel
+static QStringList bootstrap(const QVector<RankedScore> &ranks, const QVector<int> &firstGenuineReturns, int replicates, float confidence)
+{
+    qDebug("Bootstrapping %d replicates for %g%% confidence intervals", replicates, 100*confidence);
+    QVector<Replicate> samples(replicates);
+    TaskGroup tasks;
+    for (int i=0; i<replicates; i++) {
+        samples[i].ranks = &ranks;
+        samples[i].firstGenuineReturns = &firstGenuineReturns;
+        samples[i].seed = i+1;
+        if (Globals->parallelism) tasks.run(&resample, &samples[i]);
+        else                      resample(&samples[i]);
+    }
+    tasks.wait();
+
+    QStringList lines;
+    QVector<float> values(replicates);
+    for (int k=0; k<Bootstrap_Points; k++) {
+        for (int i=0; i<replicates; i++) values[i] = samples[i].TAR[k];
+        appendInterval(values, confidence, "TAR", QString::number(Bootstrap_FARs[k]), lines);
+    }
+    for (int i=0; i<replicates; i++) values[i] = samples[i].EER;
+    appendInterval(values, confidence, "EER", "0", lines);
+    for (int k=0; k<Max_Retrieval; k++) {
+        for (int i=0; i<replicates; i++) values[i] = samples[i].retrieval[k];
+        appendInterval(values, confidence, "Rank", QString::number(k+1), lines);
+    }
+    return lines;
+}
+
+
+float EvaluateScores(int rows, int columns, QVector<float> genuines, QVector<float> impostors,
+                     const QVector<int> &firstGenuineReturns, qint64 numNaNs, const QString &csv)
+{
+    std::sort(genuines.begin(), genuines.end(), std::greater<float>());
+    std::sort(impostors.begin(), impostors.end(), std::greater<float>());
+    return evaluateSorted(rows, columns, genuines, impostors, firstGenuineReturns, numNaNs, csv);
+}
+
+float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
+{
+    qDebug("Evaluating %s with %s", qPrintable(simmat), qPrintable(mask));
+
+    // Open files
+    const File simmatFile(simmat);
+    BEE::MatrixReader scoreReader(simmatFile, false);
+    File maskFile(mask);
+    maskFile.set("rows", scoreReader.rows);
+    maskFile.set("columns", scoreReader.columns);
+    BEE::MatrixReader maskReader(maskFile, true);
+
+    // Matrices too large to sort every comparison in memory, or within the memory limit, are streamed, as are those with explicit bins
+    const qint64 comparisons = qint64(scoreReader.rows)*qint64(scoreReader.columns);
+    int bins = simmatFile.get<int>("bins", 0);
+    if ((bins <= 0) && ((comparisons > Max_Comparisons) ||
+                        ((Globals->memoryLimit > 0) && (comparisons*qint64(sizeof(float)) > qint64(Globals->memoryLimit) << 20))))
+        bins = Default_Bins;
+    const int replicates = simmatFile.get<int>("bootstrap", 0);
+    if (bins > 0) {
+        if (replicates > 0) qWarning("Bootstrapping needs every score in memory, evaluating %s without confidence intervals.", qPrintable(simmat));
+        return evaluateStream(scoreReader, maskReader, bins, csv);
+    }
+
+    // Views of the mapped files
+    const Mat scores = scoreReader.read(scoreReader.rows);
+    const Mat masks = maskReader.read(maskReader.rows);
+    if (scores.size() != masks.size()) qFatal("Simmat/Mask size mismatch.");
+
+    // Rows are scanned in parallel blocks, each sorting its own scores
+    QVector<int> firstGenuineReturns(scores.rows, 0);
+    const int blockRows = std::max(1, (1 << 20) / std::max(1, scores.cols));
+    QList<ScoreBlock> blocks;
+    for (int i=0; i<scores.rows; i += blockRows)
+        blocks.append(ScoreBlock(&scores, &masks, i, std::min(i+blockRows, scores.rows), &firstGenuineReturns, replicates > 0));
+
+    TaskGroup tasks;
+    for (int i=0; i<blocks.size(); i++) {
+        if (Globals->parallelism) tasks.run(&scanScores, &blocks[i]);
+        else                      scanScores(&blocks[i]);
+    }
+    tasks.wait();
+
+    QList< QVector<float> > genuineBlocks, impostorBlocks;
+    QList< QVector<RankedScore> > rankBlocks;
+    qint64 numNaNs = 0;
+    foreach (const ScoreBlock &block, blocks) {
+        genuineBlocks.append(block.genuines);
+        impostorBlocks.append(block.impostors);
+        rankBlocks.append(block.ranks);
+        numNaNs += block.numNaNs;
+    }
+    blocks.clear();
+
+    QStringList intervals;
+    if (replicates > 0) intervals = bootstrap(mergeScores(rankBlocks), firstGenuineReturns, replicates, simmatFile.get<float>("confidence", 0.95f));
+    rankBlocks.clear();
+    return evaluateSorted(scores.rows, scores.cols, mergeScores(genuineBlocks), mergeScores(impostorBlocks), firstGenuineReturns, numNaNs, csv, intervals);
+}
+
 static QString getScale(const QString &mode, const QString &title, int vals)
 {
     if      (vals > 12) return " + scale_"+mode+"_discrete(\""+title+"\")";
@@ -294,13 +648,24 @@ static bool sortFiles(const QString &fileA, const QString &fileB)
     return fileA < fileB;
 }
 
+// Appends the file's pivots to each row of one CSV
+static void readTable(const QString *fileName, const QStringList *pivots, QStringList *rows)
+{
+    *rows = QtUtils::readLines(*fileName);
+    rows->removeAll(QString());
+    if (rows->isEmpty()) qFatal("Empty plot file %s.", qPrintable(*fileName));
+    const QString suffix = pivots->isEmpty() ? QString() : "," + pivots->join(",");
+    for (int i=1; i<rows->size(); i++)
+        (*rows)[i].append(suffix);
+}
+
 struct RPlot
 {
     QString basename, suffix;
     QFile file;
     QStringList pivotHeaders;
     QVector< QSet<QString> > pivotItems;
-    bool flip;
+    bool flip, dataOnly;
 
     struct Pivot
     {
@@ -325,39 +690,64 @@ struct RPlot
         suffix = fileInfo.suffix();
         if (suffix.isEmpty()) suffix = "pdf";
 
+        // A csv destination is just the combined data, for dashboards, and R isn't run
+        dataOnly = (suffix == "csv");
+
+        // Retrieve pivots, if the number of pivots don't match abandon the directory/filename labeling scheme
+        pivotHeaders = getPivots(files.first(), true);
+        QList<QStringList> pivots;
+        foreach (const QString &fileName, files)
+            pivots.append(getPivots(fileName, false));
+        foreach (const QStringList &filePivots, pivots)
+            if (filePivots.size() != pivotHeaders.size()) {
+                pivotHeaders = QStringList() << "File";
+                for (int i=0; i<files.size(); i++)
+                    pivots[i] = QStringList() << QFileInfo(files[i]).completeBaseName();
+                break;
+            }
+        pivotItems = QVector< QSet<QString> >(pivotHeaders.size());
+        foreach (const QStringList &filePivots, pivots)
+            for (int i=0; i<filePivots.size(); i++)
+                pivotItems[i].insert(filePivots[i]);
+
+        // Read files in parallel and combine them into one table, so R reads a single CSV
+        QList<QStringList> tables;
+        for (int i=0; i<files.size(); i++)
+            tables.append(QStringList());
+        TaskGroup tasks;
+        for (int i=0; i<files.size(); i++) {
+            if (Globals->parallelism) tasks.run(&readTable, &files[i], &pivots[i], &tables[i]);
+            else                      readTable(&files[i], &pivots[i], &tables[i]);
+        }
+        tasks.wait();
+
+        const QString header = tables.first().first();
+        QStringList lines;
+        lines.append(header + "," + pivotHeaders.join(","));
+        for (int i=0; i<tables.size(); i++) {
+            if (tables[i].first() != header) qFatal("%s has different columns than %s.", qPrintable(files[i]), qPrintable(files.first()));
+            lines.append(tables[i].mid(1));
+        }
+        tables.clear();
+        const QString data = dataOnly ? basename+".csv" : basename+"_Data.csv";
+        QtUtils::writeFile(data, lines);
+        if (dataOnly) return;
+
         file.setFileName(basename+".R");
         bool success = file.open(QFile::WriteOnly);
         if (!success) qFatal("Failed to open %s for writing.", qPrintable(file.fileName()));
 
+        QStringList pivotClasses;
+        foreach (const QString &pivotHeader, pivotHeaders)
+            pivotClasses.append(QString("%1=\"character\"").arg(pivotHeader));
         file.write("# Load libraries\n"
                    "library(ggplot2)\n"
                    "library(gplots)\n"
                    "library(reshape)\n"
                    "library(scales)\n"
                    "\n"
-                   "# Read CSVs\n"
-                   "data <- NULL\n");
-
-        // Read files and retrieve pivots
-        pivotHeaders = getPivots(files.first(), true);
-        pivotItems = QVector< QSet<QString> >(pivotHeaders.size());
-        foreach (const QString &fileName, files) {
-            QStringList pivots = getPivots(fileName, false);
-            
-            // If the number of pivots don't match, abandon the directory/filename labeling scheme
-            if (pivots.size() != pivotHeaders.size()) {
-                pivots.clear();
-                pivots.push_back(QFileInfo(fileName).completeBaseName());
-                pivotHeaders.clear();
-                pivotHeaders.push_back("File");
-            } 
-            file.write(qPrintable(QString("tmp <- read.csv(\"%1\")\n").arg(fileName).replace("\\", "\\\\")));
-            for (int i=0; i<pivots.size(); i++) {
-                pivotItems[i].insert(pivots[i]);
-                file.write(qPrintable(QString("tmp$%1 <- \"%2\"\n").arg(pivotHeaders[i], pivots[i])));
-            }
-            file.write("data <- rbind(data, tmp)\n");
-        }
+                   "# Read CSVs\n");
+        file.write(qPrintable(QString("data <- read.csv(\"%1\", colClasses=c(%2))\n").arg(QString(data).replace("\\", "\\\\"), pivotClasses.join(", "))));
 
         // Format data
         if (isEvalFormat)
@@ -371,6 +761,8 @@ struct RPlot
                        "SD <- data[grep(\"SD\",data$Plot),-c(1)]\n"
                        "BC <- data[grep(\"BC\",data$Plot),-c(1)]\n"
                        "CMC <- data[grep(\"CMC\",data$Plot),-c(1)]\n"
+                       "TARLower <- data[grep(\"TARLower\",data$Plot),-c(1)]\n"
+                       "TARUpper <- data[grep(\"TARUpper\",data$Plot),-c(1)]\n"
                        "FAR$Error <- \"FAR\"\n"
                        "FRR$Error <- \"FRR\"\n"
                        "ERR <- rbind(FAR, FRR)\n"
@@ -382,7 +774,11 @@ struct RPlot
                        "ERR$Y <- as.numeric(as.character(ERR$Y))\n"
                        "SD$Y <- as.factor(unique(as.character(SD$Y)))\n"
                        "BC$Y <- as.numeric(as.character(BC$Y))\n"
-                       "CMC$Y <- as.numeric(as.character(CMC$Y))\n");
+                       "CMC$Y <- as.numeric(as.character(CMC$Y))\n"
+                       "BCCI <- merge(TARLower, TARUpper, by=setdiff(names(TARLower), \"Y\"), suffixes=c(\"Lower\",\"Upper\"))\n"
+                       "BCCI$YLower <- as.numeric(as.character(BCCI$YLower))\n"
+                       "BCCI$YUpper <- as.numeric(as.character(BCCI$YUpper))\n"
+                       "rm(TARLower, TARUpper)\n");
 
         // Open output device
         file.write(qPrintable(QString("\n"
@@ -434,6 +830,7 @@ struct RPlot
 
     bool finalize(bool show = false)
     {
+        if (dataOnly) return true;
         file.write("dev.off()\n");
         if (suffix != "pdf") file.write(qPrintable(QString("unlink(\"%1.%2\")").arg(basename, suffix)));
         file.close();
@@ -454,6 +851,7 @@ bool Plot(const QStringList &files, const br::File &destination, bool show)
     qDebug("Plotting %d file(s) to %s", files.size(), qPrintable(destination));
 
     RPlot p(files, destination);
+    if (p.dataOnly) return p.finalize(show);
 
     p.file.write(qPrintable(QString("qplot(X, 1-Y, data=DET%1").arg((p.major.smooth || p.minor.smooth) ? ", geom=\"smooth\", method=loess, level=0.99" : ", geom=\"line\"") +
                             (p.major.size > 1 ? QString(", colour=factor(%1)").arg(p.major.header) : QString()) +
@@ -497,6 +895,7 @@ bool Plot(const QStringList &files, const br::File &destination, bool show)
                             (p.major.size > 1 ? getScale("fill", p.major.header, p.major.size) : QString()) +
                             (p.minor.size > 1 ? QString(" + facet_grid(%2 ~ X)").arg(p.minor.header) : QString(" + facet_wrap(~ X)")) +
                             QString(" + scale_y_continuous(labels=percent) + theme(legend.position=\"none\", axis.text.x=element_text(angle=-90, hjust=0))%1").arg((p.major.smooth || p.minor.smooth) ? "" : " + geom_text(data=BC, aes(label=Y, y=0.05))") +
+                            ((p.major.smooth || p.minor.smooth) ? QString() : QString(" + geom_errorbar(data=BCCI, aes(x=factor(%1), ymin=YLower, ymax=YUpper), inherit.aes=FALSE, width=0.25)").arg(p.major.header)) +
                             QString("\nggsave(\"%1\")\n").arg(p.subfile("BC"))));
 
     p.file.write(qPrintable(QString("qplot(X, Y, data=ERR%1, linetype=Error").arg((p.major.smooth || p.minor.smooth) ? ", geom=\"smooth\", method=loess, level=0.99" : ", geom=\"line\"") +
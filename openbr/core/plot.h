@@ -25,8 +25,18 @@
 namespace br
 {
 
+const int Max_Retrieval = 25; // Deepest rank of the CMC curve
+const qint64 Max_Comparisons = qint64(1) << 28; // Larger evaluations bin their impostor scores
+const int Default_Bins = 1 << 16;
+
 void Confusion(const QString &file, float score, int &true_positives, int &false_positives, int &true_negatives, int &false_negatives);
 float Evaluate(const QString &simmat, const QString &mask, const QString &csv = ""); // Returns TAR @ FAR = 0.01
+
+// Evaluate() from scores already split by mask, firstGenuineReturns[i] is the rank of query i's best genuine match or <= 0 without one
+float EvaluateScores(int rows, int columns, QVector<float> genuines, QVector<float> impostors,
+                     const QVector<int> &firstGenuineReturns, qint64 numNaNs, const QString &csv = "");
+float EvaluateHistogram(int rows, int columns, QVector<float> genuines, const QVector<qint64> &impostorHistogram, float minImpostor, double binWidth,
+                        const QVector<int> &firstGenuineReturns, qint64 numNaNs, const QString &csv = "");
 bool Plot(const QStringList &files, const br::File &destination, bool show = false);
 bool PlotMetadata(const QStringList &files, const QString &destination, bool show = false);
 
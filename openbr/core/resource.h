@@ -17,6 +17,8 @@
 #ifndef __RESOURCE_H
 #define __RESOURCE_H
 
+#include <QAtomicPointer>
+#include <QElapsedTimer>
 #include <QHash>
 #include <QList>
 #include <QMutex>
@@ -25,6 +27,8 @@
 #include <QString>
 #include <QThread>
 
+#include "parallel.h"
+
 template <typename T>
 class ResourceMaker
 {
@@ -39,58 +43,173 @@ class DefaultResourceMaker : public ResourceMaker<T>
     T *make() const { return new T(); }
 };
 
+/*!
+ * \brief A pool of at most \em maxResources instances of \em T shared by threads.
+ *
+ * The instance a thread releases is kept for that thread's next acquire without locking the pool,
+ * idle instances bound to other threads are taken before new ones are made.
+ * Copies of a Resource share the same pool.
+ */
 template <typename T>
 class Resource
 {
-    QSharedPointer< ResourceMaker<T> > resourceMaker;
-    QSharedPointer< QList<T*> > availableResources;
-    QSharedPointer<QMutex> lock;
-    QSharedPointer<QSemaphore> totalResources;
+    struct Pool
+    {
+        QSharedPointer< ResourceMaker<T> > resourceMaker;
+        QList<T*> availableResources;
+        QMutex lock;
+        QSemaphore totalResources;
+        int maxResources;
+        br::ThreadLocal< QAtomicPointer<T> > boundResources; // The instance each thread released last
+        QAtomicInt created, acquisitions, waits;
+        qint64 waitTime;
+        QAtomicInt warmUpPending; // Set by warmUp(), cleared by the acquire() that makes the instances
+        int warmUpCount;
+
+        Pool(ResourceMaker<T> *rm)
+            : resourceMaker(rm), totalResources(QThread::idealThreadCount()), maxResources(QThread::idealThreadCount()), waitTime(0), warmUpCount(-1) {}
+
+        ~Pool()
+        {
+            qDeleteAll(availableResources);
+            foreach (QAtomicPointer<T> *bound, boundResources.values())
+                delete bound->load();
+        }
+    };
+
+    QSharedPointer<Pool> pool;
 
 public:
+    struct Statistics
+    {
+        int created; /*!< \brief Instances made. */
+        int acquisitions; /*!< \brief Calls to acquire(). */
+        int waits; /*!< \brief Acquisitions that blocked because every instance was in use. */
+        qint64 waitTime; /*!< \brief Nanoseconds spent blocked. */
+    };
+
     Resource(ResourceMaker<T> *rm = new DefaultResourceMaker<T>())
-        : resourceMaker(rm)
-        , availableResources(new QList<T*>())
-        , lock(new QMutex())
-        , totalResources(new QSemaphore(QThread::idealThreadCount()))
+        : pool(new Pool(rm))
     {}
 
-    ~Resource()
-    {
-        qDeleteAll(*availableResources);
-    }
-
     T *acquire() const
     {
-        totalResources->acquire();
-        lock->lock();
+        if (pool->warmUpPending.loadAcquire()) makeWarm();
 
-        if (availableResources->isEmpty())
-            availableResources->append(resourceMaker->make());
-        T* resource = availableResources->takeFirst();
+        if (!pool->totalResources.tryAcquire()) {
+            QElapsedTimer timer; timer.start();
+            pool->totalResources.acquire();
+            QMutexLocker locker(&pool->lock);
+            pool->waits.ref();
+            pool->waitTime += timer.nsecsElapsed();
+        }
+        pool->acquisitions.ref();
 
-        lock->unlock();
+        T *resource = pool->boundResources.local().fetchAndStoreAcquire(NULL);
+        if (resource) return resource;
 
-        return resource;
+        QMutexLocker locker(&pool->lock);
+        if (!pool->availableResources.isEmpty())
+            return pool->availableResources.takeFirst();
+        foreach (QAtomicPointer<T> *bound, pool->boundResources.values()) {
+            resource = bound->fetchAndStoreAcquire(NULL);
+            if (resource) return resource;
+        }
+
+        pool->created.ref();
+        return pool->resourceMaker->make();
     }
 
     void release(T *resource) const
     {
-        lock->lock();
-        availableResources->append(resource);
-        lock->unlock();
-        totalResources->release();
+        // Bind the instance to this thread before another thread can be let in
+        T *previous = pool->boundResources.local().fetchAndStoreRelease(resource);
+        if (previous) {
+            QMutexLocker locker(&pool->lock);
+            pool->availableResources.append(previous);
+        }
+        pool->totalResources.release();
     }
 
     void setResourceMaker(ResourceMaker<T> *maker)
     {
-        resourceMaker = QSharedPointer< ResourceMaker<T> >(maker);
+        QMutexLocker locker(&pool->lock);
+        pool->resourceMaker = QSharedPointer< ResourceMaker<T> >(maker);
     }
 
     void setMaxResources(int max)
     {
-        totalResources = QSharedPointer<QSemaphore>(new QSemaphore(max));
+        // Waits for instances in use beyond the new maximum to be released
+        int current;
+        {
+            QMutexLocker locker(&pool->lock);
+            current = pool->maxResources;
+            pool->maxResources = max;
+        }
+        if      (max > current) pool->totalResources.release(max - current);
+        else if (max < current) pool->totalResources.acquire(current - max);
     }
+
+    /*!
+     * \brief Makes instances until \em count, by default the maximum, exist so early acquisitions don't pay for construction.
+     *
+     * They are made by the first acquire() of the pool rather than here,
+     * so initializing a transform that is never used, or each copy of it, makes none.
+     */
+    void warmUp(int count = -1) const
+    {
+        QMutexLocker locker(&pool->lock);
+        pool->warmUpCount = count;
+        pool->warmUpPending.storeRelease(1);
+    }
+
+private:
+    void makeWarm() const
+    {
+        QMutexLocker locker(&pool->lock);
+        if (!pool->warmUpPending.load()) return; // Another thread made them
+        const int count = ((pool->warmUpCount < 0) || (pool->warmUpCount > pool->maxResources)) ? pool->maxResources : pool->warmUpCount;
+        while (pool->created.load() < count) {
+            pool->created.ref();
+            pool->availableResources.append(pool->resourceMaker->make());
+        }
+        pool->warmUpPending.storeRelease(0);
+    }
+
+public:
+    Statistics statistics() const
+    {
+        QMutexLocker locker(&pool->lock);
+        Statistics statistics;
+        statistics.created = pool->created.load();
+        statistics.acquisitions = pool->acquisitions.load();
+        statistics.waits = pool->waits.load();
+        statistics.waitTime = pool->waitTime;
+        return statistics;
+    }
+};
+
+/*!
+ * \brief An instance acquired from a Resource for the lifetime of the lock.
+ *
+ * Vendor SDK wrappers use it so every exit path returns the context to the pool.
+ */
+template <typename T>
+class ResourceLock
+{
+    const Resource<T> &resource;
+    T *instance;
+
+    ResourceLock(const ResourceLock &);
+    ResourceLock &operator=(const ResourceLock &);
+
+public:
+    explicit ResourceLock(const Resource<T> &resource)
+        : resource(resource), instance(resource.acquire()) {}
+    ~ResourceLock() { resource.release(instance); }
+
+    T *operator->() const { return instance; }
+    T &operator*() const { return *instance; }
 };
 
 #endif //__RESOURCE_H
@@ -0,0 +1,336 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QStringList>
+#include <QThreadPool>
+#ifndef BR_EMBEDDED
+#include <QLocalServer>
+#include <QLocalSocket>
+#endif // BR_EMBEDDED
+#include <algorithm>
+#include <functional>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/metrics.h"
+#include "openbr/core/qtutils.h"
+#include "openbr/core/server.h"
+
+using namespace br;
+
+#ifndef BR_EMBEDDED
+
+// Client input is checked before it reaches the calls below, which qFatal on it and would stop the server for every client.
+
+static bool balanced(const QString &description)
+{
+    QString open;
+    bool inQuote = false;
+    foreach (const QChar &c, description) {
+        if (c == '\'') inQuote = !inQuote;
+        if (inQuote) continue;
+        int index = QString("([<{").indexOf(c);
+        if (index >= 0) {
+            open.append(c);
+        } else if ((index = QString(")]>}").indexOf(c)) >= 0) {
+            if (open.isEmpty() || (open[open.size()-1] != QString("([<{")[index])) return false;
+            open.chop(1);
+        }
+    }
+    return open.isEmpty() && !inQuote;
+}
+
+// The first plugin named by the top level of a transform or distance description that isn't registered, empty if there is none
+template <typename T>
+static QString unknownPlugin(const QString &description)
+{
+    foreach (QString word, QtUtils::parse(QString(description).replace("!", "+"), '+')) {
+        foreach (const QString &branch, QtUtils::parse(word, '/')) {
+            if (branch.isEmpty()) return "an empty " + QString(T::staticMetaObject.className()).remove("br::");
+            if ((branch.startsWith('{') && branch.endsWith('}')) ||
+                (branch.startsWith('<') && branch.endsWith('>')) ||
+                (branch.startsWith('(') && branch.endsWith(')'))) {
+                const QString inner = unknownPlugin<T>(branch.mid(1, branch.size()-2));
+                if (!inner.isEmpty()) return inner;
+                continue;
+            }
+            const QString name = branch.left(branch.indexOf('(')).trimmed();
+            if (!Factory<T>::names().contains(name) && !Globals->abbreviations.contains(name)) return name;
+        }
+    }
+    return QString();
+}
+
+// Why loading the algorithm would fail, empty if it looks loadable
+static QString invalidAlgorithm(const QString &algorithm)
+{
+    if (algorithm.isEmpty()) return "No algorithm set.";
+
+    // Resolved in the same order as AlgorithmCore::init()
+    if (QFileInfo(Globals->sdkPath + "/share/openbr/models/algorithms/" + algorithm).exists() || QFileInfo(algorithm).exists()) return QString();
+    if (Globals->abbreviations.contains(algorithm)) return invalidAlgorithm(Globals->abbreviations[algorithm]);
+
+    if (!balanced(algorithm)) return "Unbalanced brackets in algorithm " + algorithm;
+    const QStringList words = QtUtils::parse(algorithm, ':');
+    if (words.size() > 2) return "Invalid algorithm format: " + algorithm;
+    QString unknown = unknownPlugin<Transform>(words[0]);
+    if (unknown.isEmpty() && (words.size() > 1)) unknown = unknownPlugin<Distance>(words[1]);
+    return unknown.isEmpty() ? QString() : "Unknown plugin " + unknown + " in algorithm " + algorithm;
+}
+
+// Why the file can't be read, empty if it can, memory galleries and URLs are left to their gallery
+static QString missingFile(const File &file)
+{
+    if ((file.suffix() == "mem") || file.name.contains("://")) return QString();
+    return QFileInfo(file.name).exists() ? QString() : "No such file " + file.name;
+}
+
+/*!
+ * \brief Accepts newline delimited requests on a local socket, keeping algorithms and galleries resident between them.
+ *
+ * Each connection is served by its own thread with its own br::Context, so requests from different clients run concurrently
+ * without sharing progress or settings changed with \c set.
+ * Every request is answered by zero or more result lines followed by a final \c OK or \c ERROR line.
+ */
+class Server : public QLocalServer
+{
+    struct ResidentGallery
+    {
+        TemplateList templates;
+        QDateTime lastModified;
+    };
+
+    QHash<QString, ResidentGallery> galleries;
+    QMutex galleriesLock;
+    QThreadPool connections;
+
+public:
+    QAtomicInt stopped;
+
+    Server()
+        : stopped(0)
+    {
+        // Connections spend most of their life idle, they shouldn't compete with Globals->parallelism.
+        connections.setMaxThreadCount(256);
+    }
+
+    ~Server()
+    {
+        connections.waitForDone();
+    }
+
+    QStringList handle(const QStringList &words)
+    {
+        if (words.isEmpty()) return error("Empty request.");
+        const QString &command = words.first();
+        const QStringList args = words.mid(1);
+
+        if (command == "ping") {
+            return ok();
+        } else if (command == "metrics") {
+            return Metrics::report().trimmed().split('\n') + ok();
+        } else if (command == "enroll") {
+            if (args.size() != 2) return error("Usage: enroll <input> <gallery>");
+            QString invalid = missingFile(args[0]);
+            if (invalid.isEmpty()) invalid = invalidAlgorithm(File(args[1]).get<QString>("algorithm", Globals->algorithm));
+            if (!invalid.isEmpty()) return error(invalid);
+            const FileList enrolled = Enroll(args[0], args[1]);
+            unload(args[1]);
+            return ok(QString::number(enrolled.size()));
+        } else if (command == "compare") {
+            if (args.size() != 3) return error("Usage: compare <target_gallery> <query_gallery> <output>");
+            QString invalid = missingFile(args[0]);
+            if (invalid.isEmpty()) invalid = missingFile(args[1]);
+            if (invalid.isEmpty()) invalid = invalidAlgorithm(File(args[2]).get<QString>("algorithm", Globals->algorithm));
+            if (!invalid.isEmpty()) return error(invalid);
+            Compare(args[0], args[1], args[2]);
+            return ok();
+        } else if (command == "search") {
+            if ((args.size() < 2) || (args.size() > 3)) return error("Usage: search <target_gallery> <query> [limit]");
+            bool valid = true;
+            const int limit = (args.size() == 3) ? args[2].toInt(&valid) : 1;
+            if (!valid || (limit < 1)) return error("Invalid limit: " + args[2]);
+            return search(args[0], args[1], limit);
+        } else if (command == "set") {
+            if ((args.size() < 1) || (args.size() > 2)) return error("Usage: set <key> [value]");
+            Globals->setProperty(args[0], (args.size() == 2) ? args[1] : QString());
+            return ok();
+        } else if (command == "unload") {
+            if (args.size() != 1) return error("Usage: unload <gallery>");
+            unload(args[0]);
+            return ok();
+        } else if (command == "shutdown") {
+            stopped.store(1);
+            return ok();
+        } else {
+            return error("Unrecognized request '" + command + "'");
+        }
+    }
+
+private:
+    static QStringList ok(const QString &message = QString())
+    {
+        return QStringList() << (message.isEmpty() ? "OK" : "OK " + message);
+    }
+
+    static QStringList error(const QString &message)
+    {
+        return QStringList() << "ERROR " + message;
+    }
+
+    void incomingConnection(quintptr descriptor);
+
+    QStringList search(const File &gallery, const File &query, int limit)
+    {
+        const QString algorithm = query.get<QString>("algorithm", Globals->algorithm);
+        QString invalid = invalidAlgorithm(algorithm);
+        if (invalid.isEmpty()) invalid = missingFile(gallery);
+        if (invalid.isEmpty()) invalid = missingFile(query);
+        if (!invalid.isEmpty()) return error(invalid);
+
+        QSharedPointer<Transform> transform = Transform::fromAlgorithm(algorithm);
+        QSharedPointer<Distance> distance = Distance::fromAlgorithm(algorithm);
+        if (distance.isNull()) return error(algorithm + " is a classifier.");
+
+        const TemplateList targets = resident(gallery);
+        TemplateList queries = TemplateList::fromGallery(query);
+        queries >> *transform;
+
+        QStringList reply;
+        foreach (const Template &q, queries) {
+            if (q.file.failed()) continue;
+            const QList<float> scores = distance->compare(targets, q);
+
+            QList< QPair<float,int> > ranked; ranked.reserve(scores.size());
+            for (int i=0; i<scores.size(); i++)
+                ranked.append(QPair<float,int>(scores[i], i));
+            const int count = std::min(limit, ranked.size());
+            std::partial_sort(ranked.begin(), ranked.begin()+count, ranked.end(), std::greater< QPair<float,int> >());
+
+            for (int i=0; i<count; i++)
+                reply.append(q.file.name + "," + targets[ranked[i].second].file.name + "," + QString::number(ranked[i].first));
+        }
+
+        return reply + ok(QString::number(queries.size()));
+    }
+
+    TemplateList resident(const File &gallery)
+    {
+        // Memory galleries are already resident and may change between requests
+        if (gallery.suffix() == "mem") return TemplateList::fromGallery(gallery);
+
+        const QString key = gallery.flat();
+        const QDateTime lastModified = QFileInfo(gallery.name).lastModified();
+
+        QMutexLocker locker(&galleriesLock);
+        if (galleries.contains(key) && (galleries[key].lastModified == lastModified))
+            return galleries[key].templates;
+        locker.unlock();
+
+        // Load outside the lock so requests against other galleries aren't stalled
+        ResidentGallery residentGallery;
+        residentGallery.templates = TemplateList::fromGallery(gallery);
+        residentGallery.lastModified = lastModified;
+
+        locker.relock();
+        galleries.insert(key, residentGallery);
+        return residentGallery.templates;
+    }
+
+    void unload(const File &gallery)
+    {
+        QMutexLocker locker(&galleriesLock);
+        galleries.remove(gallery.flat());
+    }
+};
+
+/*!
+ * \brief Serves the requests of one client.
+ */
+class Connection : public QRunnable
+{
+    Server *server;
+    quintptr descriptor;
+
+public:
+    Connection(Server *server_, quintptr descriptor_)
+        : server(server_), descriptor(descriptor_) {}
+
+private:
+    void run()
+    {
+        QLocalSocket socket;
+        if (!socket.setSocketDescriptor(descriptor)) {
+            qWarning("Failed to open connection: %s", qPrintable(socket.errorString()));
+            return;
+        }
+
+        // Settings and progress are private to this client
+        QScopedPointer<Context> context(Globals->fork());
+        ContextScope scope(context.data());
+
+        // Poll so that a shutdown request from another client is noticed
+        while (!server->stopped.load() && (socket.state() == QLocalSocket::ConnectedState)) {
+            if (!socket.canReadLine() && !socket.waitForReadyRead(100))
+                continue;
+
+            while (socket.canReadLine()) {
+                const QString line = QString::fromLocal8Bit(socket.readLine()).trimmed();
+                if (line.isEmpty()) continue;
+                const QStringList reply = server->handle(QtUtils::parse(line, ' '));
+                socket.write((reply.join("\n") + "\n").toLocal8Bit());
+                socket.waitForBytesWritten(-1);
+            }
+        }
+
+        socket.disconnectFromServer();
+    }
+};
+
+void Server::incomingConnection(quintptr descriptor)
+{
+    connections.start(new Connection(this, descriptor));
+}
+
+void br::Serve(const QString &name)
+{
+    Server server;
+    QLocalServer::removeServer(name);
+    if (!server.listen(name))
+        qFatal("Failed to listen on %s: %s", qPrintable(name), qPrintable(server.errorString()));
+
+    qDebug("Serving on %s", qPrintable(server.fullServerName()));
+    while (!server.stopped.load())
+        server.waitForNewConnection(100);
+    server.close();
+}
+
+#else // BR_EMBEDDED
+
+void br::Serve(const QString &name)
+{
+    (void) name;
+    qFatal("Server mode is not available in embedded builds.");
+}
+
+#endif // BR_EMBEDDED
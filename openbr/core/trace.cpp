@@ -0,0 +1,125 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+#include "parallel.h"
+#include "trace.h"
+
+using namespace br;
+
+namespace
+{
+
+enum { Max_Events = 1 << 20 }; // Per thread, later spans are counted as dropped
+
+struct Event
+{
+    const char *category;
+    QString name;
+    qint64 begin, end;
+};
+
+struct Events
+{
+    int thread;
+    QVector<Event> events;
+    qint64 dropped;
+    Events() : thread(-1), dropped(0) {}
+};
+
+ThreadLocal<Events> AllEvents;
+
+struct Clock : public QElapsedTimer
+{
+    Clock() { start(); }
+};
+
+Clock TraceClock;
+
+QByteArray escaped(const QString &string)
+{
+    QByteArray result;
+    foreach (const QChar &c, string) {
+        if      (c == '"')  result += "\\\"";
+        else if (c == '\\') result += "\\\\";
+        else if (c < ' ')   result += QString("\\u%1").arg(c.unicode(), 4, 16, QChar('0')).toLatin1();
+        else                result += QString(c).toUtf8();
+    }
+    return result;
+}
+
+} // namespace
+
+bool Trace::enabled()
+{
+    const Context *context = Globals;
+    return context && !context->trace.isEmpty();
+}
+
+qint64 Trace::now()
+{
+    return TraceClock.nsecsElapsed();
+}
+
+void Trace::record(const char *category, const QString &name, qint64 begin, qint64 end)
+{
+    if (end < 0) end = now();
+    Events &local = AllEvents.local();
+    if (local.thread == -1) local.thread = Parallel::threadIndex();
+    if (local.events.size() >= Max_Events) {
+        local.dropped++;
+        return;
+    }
+
+    Event event;
+    event.category = category;
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    local.events.append(event);
+}
+
+void Trace::write(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly)) {
+        qWarning("Can't write trace: %s", qPrintable(fileName));
+        return;
+    }
+
+    qint64 dropped = 0;
+    bool first = true;
+    file.write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    foreach (const Events *events, AllEvents.values()) {
+        dropped += events->dropped;
+        foreach (const Event &event, events->events) {
+            file.write(first ? "" : ",\n");
+            first = false;
+            file.write("{\"name\":\"" + escaped(event.name) + "\",\"cat\":\"" + event.category +
+                       "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + QByteArray::number(events->thread) +
+                       ",\"ts\":" + QByteArray::number(event.begin/1e3, 'f', 3) +
+                       ",\"dur\":" + QByteArray::number((event.end - event.begin)/1e3, 'f', 3) + "}");
+        }
+    }
+    file.write("\n]}\n");
+
+    if (dropped > 0) qWarning("Trace dropped %lld spans past %d per thread.", dropped, int(Max_Events));
+    AllEvents.reset(Events());
+}
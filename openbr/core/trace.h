@@ -0,0 +1,68 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <QString>
+
+namespace br
+{
+
+/*!
+ * \brief Timeline of what every thread was doing, written as Chrome trace-event JSON.
+ *
+ * Spans are recorded while br::Context::trace names an output file, and written to it by br::Context::finalize().
+ * Open the file in <tt>chrome://tracing</tt> or <a href="https://ui.perfetto.dev">Perfetto</a>.
+ * Each thread buffers its own spans, so recording takes no lock.
+ */
+namespace Trace
+{
+
+bool enabled(); /*!< \brief True if spans are being recorded. */
+qint64 now(); /*!< \brief Nanoseconds on the trace clock. */
+void record(const char *category, const QString &name, qint64 begin, qint64 end = -1); /*!< \brief Records a span from \em begin to \em end, \c -1 for now(), on the calling thread. */
+void write(const QString &file); /*!< \brief Writes and discards every recorded span. */
+
+/*!
+ * \brief Records a span over its lifetime if tracing is enabled.
+ */
+class Scope
+{
+    const char *category;
+    QString name;
+    qint64 begin;
+
+public:
+    Scope(const char *category, const QString &name)
+        : category(category), begin(-1)
+    {
+        if (!enabled()) return;
+        this->name = name;
+        begin = now();
+    }
+
+    ~Scope()
+    {
+        if (begin >= 0) record(category, name, begin);
+    }
+};
+
+} // namespace Trace
+
+} // namespace br
+
+#endif // __TRACE_H
@@ -26,6 +26,8 @@ static QSharedPointer<Transform> frvt2012_transform;
 static QSharedPointer<Transform> frvt2012_age_transform;
 static QSharedPointer<Transform> frvt2012_gender_transform;
 static const int frvt2012_template_size = 768;
+static cv::Mat frvt2012_gallery; // One face template per row
+static QVector<int> frvt2012_gallery_offsets; // First row of each gallery template, and the row count last
 
 static void initialize(const string &configuration_location)
 {
@@ -73,6 +75,38 @@ int32_t convert_multiface_to_enrollment_template(const MULTIFACE &input_faces, u
     return convert_multiface_to_verification_template(input_faces, template_size, proprietary_template, quality);
 }
 
+int32_t convert_multifaces_to_enrollment_templates(const vector<MULTIFACE> &input_faces, vector<uint32_t> &template_sizes, uint8_t* proprietary_templates)
+{
+    // Enroll every face together, each tagged with the MULTIFACE it came from
+    TemplateList templates;
+    for (size_t i=0; i<input_faces.size(); i++)
+        foreach (const ONEFACE &oneface, input_faces[i]) {
+            templates.append(templateFromONEFACE(oneface));
+            templates.last().file.set("MultiFace", int(i));
+        }
+    templates >> *frvt2012_transform.data();
+
+    // Detection may yield zero or several templates per face, group them by their MULTIFACE
+    QVector<TemplateList> enrolled(int(input_faces.size()));
+    foreach (const Template &t, templates) {
+        if (t.file.failed() || (t.m().total() * t.m().elemSize() != size_t(frvt2012_template_size))) continue;
+        const int index = t.file.get<int>("MultiFace", -1);
+        if ((index >= 0) && (index < enrolled.size())) enrolled[index].append(t);
+    }
+
+    // A MULTIFACE without any enrolled face gets an empty template
+    template_sizes.clear();
+    uint8_t *output = proprietary_templates;
+    foreach (const TemplateList &faces, enrolled) {
+        foreach (const Template &t, faces) {
+            memcpy(output, t.m().data, frvt2012_template_size);
+            output += frvt2012_template_size;
+        }
+        template_sizes.push_back(faces.size() * frvt2012_template_size);
+    }
+    return 0;
+}
+
 int32_t convert_multiface_to_verification_template(const MULTIFACE &input_faces, uint32_t &template_size, uint8_t* proprietary_template, uint8_t &quality)
 {
     // Enroll templates
@@ -92,6 +126,17 @@ int32_t convert_multiface_to_verification_template(const MULTIFACE &input_faces,
     return 0;
 }
 
+// Average distance over every pair of faces, normalized to a similarity
+static double similarity(const uint8_t *verification_template, int num_verification, const uint8_t *enrollment_template, int num_enrollment)
+{
+    double similarity = 0;
+    for (int i=0; i<num_verification; i++)
+        for (int j=0; j<num_enrollment; j++)
+            similarity += l1(&verification_template[i*frvt2012_template_size], &enrollment_template[j*frvt2012_template_size], frvt2012_template_size);
+    similarity /= num_verification * num_enrollment;
+    return std::max(0.0, -0.00112956 * (similarity - 6389.75)); // Yes this is a hard coded hack taken from FaceRecognition score normalization
+}
+
 int32_t match_templates(const uint8_t* verification_template, const uint32_t verification_template_size, const uint8_t* enrollment_template, const uint32_t enrollment_template_size, double &similarity)
 {
     const int num_verification = verification_template_size / frvt2012_template_size;
@@ -103,12 +148,38 @@ int32_t match_templates(const uint8_t* verification_template, const uint32_t ver
         return 2;
     }
 
-    similarity = 0;
-    for (int i=0; i<num_verification; i++)
-        for (int j=0; j<num_enrollment; j++)
-            similarity += l1(&verification_template[i*frvt2012_template_size], &enrollment_template[j*frvt2012_template_size], frvt2012_template_size);
-    similarity /= num_verification * num_enrollment;
-    similarity = std::max(0.0, -0.00112956 * (similarity - 6389.75)); // Yes this is a hard coded hack taken from FaceRecognition score normalization
+    similarity = ::similarity(verification_template, num_verification, enrollment_template, num_enrollment);
+    return 0;
+}
+
+int32_t set_gallery(const uint8_t* enrollment_templates, const vector<uint32_t> &template_sizes)
+{
+    frvt2012_gallery_offsets.clear();
+    int rows = 0;
+    foreach (uint32_t size, template_sizes) {
+        frvt2012_gallery_offsets.append(rows);
+        rows += size / frvt2012_template_size;
+    }
+    frvt2012_gallery_offsets.append(rows);
+
+    // OpenCV allocates aligned, contiguous rows
+    frvt2012_gallery.create(rows, frvt2012_template_size, CV_8UC1);
+    if (rows > 0) memcpy(frvt2012_gallery.data, enrollment_templates, rows * frvt2012_template_size);
+    return 0;
+}
+
+int32_t search_gallery(const uint8_t* verification_template, const uint32_t verification_template_size, vector<double> &similarities)
+{
+    const int num_verification = verification_template_size / frvt2012_template_size;
+    const int gallery_size = std::max(0, frvt2012_gallery_offsets.size() - 1);
+    similarities.assign(gallery_size, -1);
+    if (num_verification == 0) return 2;
+
+    for (int i=0; i<gallery_size; i++) {
+        const int num_enrollment = frvt2012_gallery_offsets[i+1] - frvt2012_gallery_offsets[i];
+        if (num_enrollment == 0) continue;
+        similarities[i] = similarity(verification_template, num_verification, frvt2012_gallery.ptr(frvt2012_gallery_offsets[i]), num_enrollment);
+    }
     return 0;
 }
 
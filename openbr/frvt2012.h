@@ -262,6 +262,52 @@ BR_EXPORT int32_t match_templates(const uint8_t* verification_template,
                                   const uint32_t enrollment_template_size,
                                   double &similarity);
 
+/*!
+ * \brief Enrolls several MULTIFACEs with one pass through the algorithm.
+ * Equivalent to calling convert_multiface_to_enrollment_template() on each, but the faces are enrolled together.
+ * \param[in] input_faces
+ * The MULTIFACEs to enroll.
+ * \param[out] template_sizes
+ * The size, in bytes, of each output template.
+ * \param[out] proprietary_templates
+ * The output templates, one after the other.
+ * The caller allocates the total number of faces times the value from get_max_template_sizes().
+ * \return
+ *  0 Success
+ */
+BR_EXPORT int32_t convert_multifaces_to_enrollment_templates(const std::vector<MULTIFACE> &input_faces,
+                                                             std::vector<uint32_t> &template_sizes,
+                                                             uint8_t* proprietary_templates);
+
+/*!
+ * \brief Copies enrollment templates into a resident gallery for search_gallery().
+ * Replaces the previous gallery.
+ * \param[in] enrollment_templates
+ * Templates from convert_multiface_to_enrollment_template() one after the other.
+ * \param[in] template_sizes
+ * The size, in bytes, of each template.
+ * \return
+ *  0 Success
+ */
+BR_EXPORT int32_t set_gallery(const uint8_t* enrollment_templates,
+                              const std::vector<uint32_t> &template_sizes);
+
+/*!
+ * \brief Compares a verification template against every template in the resident gallery.
+ * \param[in] verification_template
+ * A template from convert_multiface_to_verification_template().
+ * \param[in] verification_template_size
+ * The size, in bytes, of the verification template.
+ * \param[out] similarities
+ * One score per gallery template, the same as match_templates() would give, -1 for failed templates.
+ * \return
+ *  0 Success
+ *  2 The verification template was the result of failed feature extraction
+ */
+BR_EXPORT int32_t search_gallery(const uint8_t* verification_template,
+                                 const uint32_t verification_template_size,
+                                 std::vector<double> &similarities);
+
 /*!
  * \brief Class D estimator abstraction.
  */
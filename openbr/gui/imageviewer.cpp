@@ -37,21 +37,31 @@ void br::ImageViewer::setDefaultText(const QString &text)
 void br::ImageViewer::setImage(const QString &file, bool async)
 {
     src = QImage(file);
+    sourceSize = QSize();
     updatePixmap(async);
 }
 
 void br::ImageViewer::setImage(const QImage &image, bool async)
 {
 	src = image.copy();
+    sourceSize = QSize();
     updatePixmap(async);
 }
 
 void br::ImageViewer::setImage(const QPixmap &pixmap, bool async)
 {
     src = pixmap.toImage();
+    sourceSize = QSize();
     updatePixmap(async);
 }
 
+void br::ImageViewer::setThumbnail(const QImage &thumbnail, const QSize &sourceSize)
+{
+    src = thumbnail;
+    this->sourceSize = sourceSize;
+    updatePixmap();
+}
+
 /*** PRIVATE ***/
 void br::ImageViewer::updatePixmap(bool async)
 {
@@ -24,6 +24,7 @@
 #include <QMutex>
 #include <QPixmap>
 #include <QResizeEvent>
+#include <QSize>
 #include <QString>
 #include <QWidget>
 #include <openbr/openbr_export.h>
@@ -43,12 +44,14 @@ public:
     void setImage(const QString &file, bool async = false);
     void setImage(const QImage &image, bool async = false);
     void setImage(const QPixmap &pixmap, bool async = false);
+    void setThumbnail(const QImage &thumbnail, const QSize &sourceSize); // Image coordinates stay those of the source
     bool isNull() const { return src.isNull(); }
-    int imageWidth() const { return src.width(); }
-    int imageHeight() const { return src.height(); }
+    int imageWidth() const { return sourceSize.isValid() ? sourceSize.width() : src.width(); }
+    int imageHeight() const { return sourceSize.isValid() ? sourceSize.height() : src.height(); }
 
 protected:
     QImage src;
+    QSize sourceSize;
 
 protected slots:
     void keyPressEvent(QKeyEvent *event);
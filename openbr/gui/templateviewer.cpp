@@ -3,15 +3,16 @@
 #include <QPainter>
 #include <QPen>
 #include <QUrl>
-#include <QtConcurrentRun>
 #include <openbr/openbr.h>
 
 #include "templateviewer.h"
+#include "thumbnailer.h"
 
 using namespace br;
 
 /*** STATIC ***/
 const int NumLandmarks = 2;
+const QSize ThumbnailSize(256, 256);
 
 static bool lessThan(const QPointF &a, const QPointF &b)
 {
@@ -28,6 +29,8 @@ TemplateViewer::TemplateViewer(QWidget *parent)
     setText("<b>Drag Photo or Folder Here</b>\n");
     format = "Registered";
     editable = true;
+    ticket = -1;
+    connect(Thumbnailer::instance(), SIGNAL(ready(int,QImage,QSize)), this, SLOT(thumbnailReady(int,QImage,QSize)));
     setFile(File());
     update();
 }
@@ -45,12 +48,15 @@ void TemplateViewer::setFile(const File &file_)
         landmarks.append(QPointF());
     nearestLandmark = -1;
 
-    QtConcurrent::run(this, &TemplateViewer::refreshImage);
+    refreshImage();
 }
 
 void TemplateViewer::setEditable(bool enabled)
 {
+    // Editing places landmarks, so it needs the whole image rather than a thumbnail
+    const bool changed = (editable != enabled);
     editable = enabled;
+    if (changed && !file.isNull()) refreshImage();
     update();
 }
 
@@ -63,28 +69,26 @@ void TemplateViewer::setMousePoint(const QPointF &mousePoint)
 void TemplateViewer::setFormat(const QString &format)
 {
     this->format = format;
-    QtConcurrent::run(this, &TemplateViewer::refreshImage);
+    refreshImage();
+}
+
+/*** PRIVATE SLOTS ***/
+void TemplateViewer::thumbnailReady(int ticket, QImage image, QSize sourceSize)
+{
+    if (ticket != this->ticket) return;
+    this->ticket = -1;
+    setThumbnail(image, sourceSize);
 }
 
 /*** PRIVATE ***/
 void TemplateViewer::refreshImage()
 {
-    if (file.isNull() || (format == "Photo")) {
-        setImage(file, true);
-    } else {
-        const QString path = QString(br_scratch_path()) + "/thumbnails";
-        const QString hash = file.hash()+format;
-        const QString processedFile = path+"/"+file.baseName()+hash+".png";
-        if (!QFileInfo(processedFile).exists()) {
-            if (format == "Registered")
-                Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=RegisterAffine]");
-            else if (format == "Enhanced")
-                Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=ContrastEnhanced]");
-            else if (format == "Features")
-                Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=ColoredLBP]");
-        }
-        setImage(processedFile, true);
-    }
+    // A file scrolled out of view is cancelled before it is decoded
+    if (ticket != -1) Thumbnailer::instance()->cancel(ticket);
+    ticket = -1;
+
+    if (file.isNull()) setImage(QImage());
+    else               ticket = Thumbnailer::instance()->request(file, format, editable ? QSize() : ThumbnailSize);
 }
 
 QPointF TemplateViewer::getImagePoint(const QPointF &sp) const
@@ -8,6 +8,7 @@
 #include <QList>
 #include <QMouseEvent>
 #include <QPointF>
+#include <QSize>
 #include <QString>
 #include <QWidget>
 #include <openbr/openbr_plugin.h>
@@ -26,6 +27,7 @@ class BR_EXPORT TemplateViewer : public br::ImageViewer
     bool editable;
     QList<QPointF> landmarks;
     int nearestLandmark;
+    int ticket; // Outstanding br::Thumbnailer request, -1 if none
 
 public:
     explicit TemplateViewer(QWidget *parent = 0);
@@ -36,6 +38,9 @@ public slots:
     void setMousePoint(const QPointF &mousePoint);
     void setFormat(const QString &format);
 
+private slots:
+    void thumbnailReady(int ticket, QImage image, QSize sourceSize);
+
 private:
     void refreshImage();
     QPointF getImagePoint(const QPointF &sp) const;
@@ -1,13 +1,19 @@
+#include <QApplication>
+
 #include "templateviewergrid.h"
 
 using namespace br;
 
+/*** STATIC ***/
+static const int Max_Columns = 8;
+
 /**** TEMPLATE_VIEWER_GRID ****/
 /*** PUBLIC ***/
 TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
-    : QWidget(parent)
+    : QWidget(parent), sbRows(Qt::Vertical), format("Registered"), columns(1)
 {
     setLayout(&gridLayout);
+    connect(&sbRows, SIGNAL(valueChanged(int)), this, SLOT(showRows(int)));
     setFiles(FileList(16));
     setFiles(FileList(1));
 }
@@ -15,9 +21,12 @@ TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
 /*** PUBLIC SLOTS ***/
 void TemplateViewerGrid::setFiles(const FileList &files)
 {
-    const int size = std::max(1, (int)ceil(sqrt((float)files.size())));
+    this->files = files;
+    columns = std::min(int(Max_Columns), std::max(1, (int)ceil(sqrt((float)files.size()))));
+    const int size = columns;
     while (templateViewers.size() < size*size) {
         templateViewers.append(QSharedPointer<TemplateViewer>(new TemplateViewer()));
+        templateViewers.last()->setFormat(format);
         connect(templateViewers.last().data(), SIGNAL(newInput(br::File)), this, SIGNAL(newInput(br::File)));
         connect(templateViewers.last().data(), SIGNAL(newInput(QImage)), this, SIGNAL(newInput(QImage)));
         connect(templateViewers.last().data(), SIGNAL(newMousePoint(QPointF)), this, SIGNAL(newMousePoint(QPointF)));
@@ -34,21 +43,28 @@ void TemplateViewerGrid::setFiles(const FileList &files)
         if (i < size*size) {
             gridLayout.addWidget(templateViewers[i].data(), i/size, i%size, 1, 1);
             templateViewers[i]->setVisible(true);
-        }
-
-        if (i < files.size()) {
-            templateViewers[i]->setFile(files[i]);
         } else {
-            templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
-            templateViewers[i]->setFile(QString());
+            // Viewers outside the grid hold no file, so they neither load nor keep an image
+            templateViewers[i]->setFile(File());
         }
-
         templateViewers[i]->setEditable(files.size() == 1);
     }
+
+    // Rows beyond the first page are reached by scrolling
+    const int rows = (files.size() + size - 1) / size;
+    gridLayout.addWidget(&sbRows, 0, size, size, 1);
+    sbRows.setVisible(rows > size);
+    sbRows.blockSignals(true);
+    sbRows.setRange(0, std::max(0, rows - size));
+    sbRows.setPageStep(size);
+    sbRows.setValue(0);
+    sbRows.blockSignals(false);
+    showRows(0);
 }
 
 void TemplateViewerGrid::setFormat(const QString &format)
 {
+    this->format = format;
     foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
         templateViewer->setFormat(format);
 }
@@ -59,4 +75,26 @@ void TemplateViewerGrid::setMousePoint(const QPointF &mousePoint)
         templateViewer->setMousePoint(mousePoint);
 }
 
+/*** PROTECTED ***/
+void TemplateViewerGrid::wheelEvent(QWheelEvent *event)
+{
+    if (sbRows.isVisible()) QApplication::sendEvent(&sbRows, event);
+    else                    QWidget::wheelEvent(event);
+}
+
+/*** PRIVATE SLOTS ***/
+void TemplateViewerGrid::showRows(int firstRow)
+{
+    const int size = columns;
+    for (int i=0; i<size*size; i++) {
+        const int index = firstRow*size + i;
+        if (index < files.size()) {
+            templateViewers[i]->setFile(files[index]);
+        } else {
+            templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
+            templateViewers[i]->setFile(QString());
+        }
+    }
+}
+
 #include "moc_templateviewergrid.cpp"
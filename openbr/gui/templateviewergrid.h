@@ -3,7 +3,9 @@
 
 #include <QGridLayout>
 #include <QList>
+#include <QScrollBar>
 #include <QSharedPointer>
+#include <QWheelEvent>
 #include <openbr/openbr_plugin.h>
 
 #include "templateviewer.h"
@@ -11,12 +13,21 @@
 namespace br
 {
 
+/*!
+ * \brief A square grid of templates that only realizes the rows in view.
+ *
+ * Galleries larger than the grid scroll a row at a time, reusing the same viewers for the newly visible files.
+ */
 class BR_EXPORT TemplateViewerGrid : public QWidget
 {
     Q_OBJECT
 
     QGridLayout gridLayout;
+    QScrollBar sbRows;
     QList< QSharedPointer<TemplateViewer> > templateViewers;
+    br::FileList files;
+    QString format;
+    int columns;
 
 public:
     explicit TemplateViewerGrid(QWidget *parent = 0);
@@ -26,6 +37,12 @@ public slots:
     void setFormat(const QString &format);
     void setMousePoint(const QPointF &mousePoint);
 
+protected:
+    void wheelEvent(QWheelEvent *event);
+
+private slots:
+    void showRows(int firstRow);
+
 signals:
     void newInput(br::File input);
     void newInput(QImage input);
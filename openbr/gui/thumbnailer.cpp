@@ -0,0 +1,192 @@
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+#include <openbr/openbr.h>
+#include <openbr/openbr_plugin.h>
+
+#include "thumbnailer.h"
+
+using namespace br;
+
+/*** STATIC ***/
+static const int Memory_Kilobytes = 64 * 1024;
+static const qint64 Disk_Bytes = qint64(256) * 1024 * 1024;
+
+class ThumbnailJob : public QRunnable
+{
+    Thumbnailer *thumbnailer;
+    int ticket;
+    File file;
+    QString format;
+    QSize size;
+
+public:
+    ThumbnailJob(Thumbnailer *thumbnailer, int ticket, const File &file, const QString &format, const QSize &size)
+        : thumbnailer(thumbnailer), ticket(ticket), file(file), format(format), size(size) {}
+
+    void run()
+    {
+        thumbnailer->load(ticket, file, format, size);
+    }
+};
+
+// The size of the image a thumbnail was made from travels with it as PNG text
+static QSize sourceSize(const QImage &image)
+{
+    const QStringList words = image.text("SourceSize").split("x");
+    if (words.size() != 2) return image.size();
+    return QSize(words[0].toInt(), words[1].toInt());
+}
+
+/*** PUBLIC ***/
+Thumbnailer *Thumbnailer::instance()
+{
+    static Thumbnailer thumbnailer;
+    return &thumbnailer;
+}
+
+int Thumbnailer::request(const File &file, const QString &format, const QSize &size)
+{
+    QMutexLocker locker(&lock);
+    const int ticket = tickets++;
+    pending.insert(ticket);
+    pool.start(new ThumbnailJob(this, ticket, file, format, size), ticket);
+    return ticket;
+}
+
+void Thumbnailer::cancel(int ticket)
+{
+    QMutexLocker locker(&lock);
+    pending.remove(ticket);
+}
+
+void Thumbnailer::load(int ticket, const File &file, const QString &format, const QSize &size)
+{
+    if (!isPending(ticket)) return;
+
+    const bool thumbnail = size.isValid();
+    const QString key = QString(QCryptographicHash::hash((file.hash()+format+QString("%1x%2").arg(size.width()).arg(size.height())).toUtf8(), QCryptographicHash::Md5).toHex());
+    QImage image = thumbnail ? cached(key) : QImage();
+
+    if (image.isNull()) {
+        const QString source = render(file, format);
+        if (!isPending(ticket)) return;
+
+        // Decode straight to the thumbnail size rather than scaling the full image
+        QImageReader reader(source);
+        const QSize original = reader.size();
+        if (thumbnail && original.isValid())
+            reader.setScaledSize(original.scaled(size, Qt::KeepAspectRatio).boundedTo(original));
+        image = reader.read();
+        if (image.isNull()) image = QImage(source);
+        if (!image.isNull()) {
+            const QSize full = original.isValid() ? original : image.size();
+            image.setText("SourceSize", QString("%1x%2").arg(full.width()).arg(full.height()));
+            if (thumbnail) store(key, image);
+        }
+    }
+
+    QMutexLocker locker(&lock);
+    if (!pending.remove(ticket)) return;
+    locker.unlock();
+    emit ready(ticket, image, sourceSize(image));
+}
+
+/*** PRIVATE ***/
+Thumbnailer::Thumbnailer()
+    : tickets(0), scanned(false), diskTotal(0)
+{
+    pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount()/2));
+    memory.setMaxCost(Memory_Kilobytes);
+    path = QString(br_scratch_path()) + "/thumbnails";
+}
+
+bool Thumbnailer::isPending(int ticket)
+{
+    QMutexLocker locker(&lock);
+    return pending.contains(ticket);
+}
+
+// The image to display for a format, enrolling it into the scratch directory when needed
+QString Thumbnailer::render(const File &file, const QString &format) const
+{
+    if (format == "Photo") return file.name;
+
+    const QString hash = file.hash()+format;
+    const QString processedFile = path+"/"+file.baseName()+hash+".png";
+    if (!QFileInfo(processedFile).exists()) {
+        if (format == "Registered")
+            Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=RegisterAffine]");
+        else if (format == "Enhanced")
+            Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=ContrastEnhanced]");
+        else if (format == "Features")
+            Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=ColoredLBP]");
+    }
+    return processedFile;
+}
+
+QImage Thumbnailer::cached(const QString &key)
+{
+    QMutexLocker locker(&lock);
+    if (QImage *image = memory.object(key))
+        return *image;
+
+    scan();
+    if (!diskBytes.contains(key)) return QImage();
+    diskOrder.removeOne(key);
+    diskOrder.append(key);
+    locker.unlock();
+
+    const QImage image(path+"/"+key+".thumb.png");
+    if (!image.isNull()) {
+        locker.relock();
+        memory.insert(key, new QImage(image), image.byteCount()/1024 + 1);
+    }
+    return image;
+}
+
+void Thumbnailer::store(const QString &key, const QImage &image)
+{
+    const QString file = path+"/"+key+".thumb.png";
+    QDir().mkpath(path);
+    const bool saved = image.save(file);
+
+    QMutexLocker locker(&lock);
+    memory.insert(key, new QImage(image), image.byteCount()/1024 + 1);
+    if (!saved) return;
+
+    scan();
+    diskTotal -= diskBytes.value(key, 0);
+    diskOrder.removeOne(key);
+    diskOrder.append(key);
+    diskBytes.insert(key, QFileInfo(file).size());
+    diskTotal += diskBytes[key];
+
+    // Evict the least recently used thumbnails once the directory is over budget
+    while ((diskTotal > Disk_Bytes) && (diskOrder.size() > 1)) {
+        const QString evicted = diskOrder.takeFirst();
+        diskTotal -= diskBytes.take(evicted);
+        QFile::remove(path+"/"+evicted+".thumb.png");
+    }
+}
+
+// Thumbnails left by earlier sessions are ordered by modification time, requires lock
+void Thumbnailer::scan()
+{
+    if (scanned) return;
+    scanned = true;
+    foreach (const QFileInfo &info, QDir(path).entryInfoList(QStringList("*.thumb.png"), QDir::Files, QDir::Time | QDir::Reversed)) {
+        const QString key = info.fileName().left(info.fileName().size() - QString(".thumb.png").size());
+        diskOrder.append(key);
+        diskBytes.insert(key, info.size());
+        diskTotal += info.size();
+    }
+}
+
+#include "moc_thumbnailer.cpp"
@@ -0,0 +1,59 @@
+#ifndef __THUMBNAILER_H
+#define __THUMBNAILER_H
+
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Decodes gallery thumbnails on a small thread pool, caching them in memory and in br_scratch_path()/thumbnails.
+ *
+ * The newest requests start first so the cells on screen load before those scrolled past,
+ * and cancelled requests are dropped before they are decoded.
+ */
+class BR_EXPORT Thumbnailer : public QObject
+{
+    Q_OBJECT
+    QThreadPool pool;
+    QMutex lock; // Guards the members below
+    QCache<QString, QImage> memory; // Cost in kilobytes
+    QSet<int> pending;
+    int tickets;
+    QString path;
+    bool scanned;
+    QStringList diskOrder; // Least recently used first
+    QHash<QString, qint64> diskBytes;
+    qint64 diskTotal;
+
+public:
+    static Thumbnailer *instance();
+    int request(const br::File &file, const QString &format, const QSize &size = QSize()); /*!< \brief Returns the ticket of the eventual ready() signal, an empty \em size loads the whole image. */
+    void cancel(int ticket);
+    void load(int ticket, const br::File &file, const QString &format, const QSize &size); /*!< \brief Called on the pool. */
+
+signals:
+    void ready(int ticket, QImage image, QSize sourceSize);
+
+private:
+    Thumbnailer();
+    bool isPending(int ticket);
+    QString render(const br::File &file, const QString &format) const;
+    QImage cached(const QString &key);
+    void store(const QString &key, const QImage &image);
+    void scan();
+};
+
+} // namespace br
+
+#endif // __THUMBNAILER_H
@@ -14,16 +14,99 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <algorithm>
+#include <limits>
+#include <opencv2/highgui/highgui.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
 #include "core/classify.h"
 #include "core/cluster.h"
+#include "core/codec.h"
 #include "core/fuse.h"
+#include "core/metrics.h"
+#include "core/parallel.h"
 #include "core/plot.h"
 #include "core/qtutils.h"
+#include "core/server.h"
 
 using namespace br;
+using namespace cv;
+
+struct br_template_list
+{
+    TemplateList templates;
+};
+
+static int enrollImage(const Mat &image, const char *algorithm, unsigned char *template_data, int template_size)
+{
+    const QByteArray data = TemplateCodec::encode(EnrollTemplate(Template(image), algorithm));
+    if (data.size() <= template_size) memcpy(template_data, data.constData(), data.size());
+    return data.size();
+}
+
+static bool isEnrolled(const Template &t)
+{
+    return !t.file.failed() && !t.isEmpty();
+}
+
+// Scores one query against the enrolled subset of a template list, see br_compare_template_lists
+struct ListComparison
+{
+    QSharedPointer<Distance> distance;
+    QSharedPointer<TargetFilter> filter;
+    TemplateList targets; // Enrolled templates only
+    QVector<int> columns; // Index of each of targets in the original list
+    int width;
+
+    ListComparison(const TemplateList &templates, const char *algorithm)
+        : width(templates.size())
+    {
+        distance = Distance::fromAlgorithm(strlen(algorithm) ? QString(algorithm) : Globals->algorithm);
+        if (distance.isNull()) qFatal("In-memory comparison requires an algorithm with a distance.");
+
+        for (int i=0; i<templates.size(); i++)
+            if (isEnrolled(templates[i])) {
+                targets.append(templates[i]);
+                columns.append(i);
+            }
+        filter = distance->prefilter(targets);
+    }
+
+    void compare(const Template &query, float *scores) const
+    {
+        if ((targets.size() < width) || !isEnrolled(query))
+            std::fill(scores, scores+width, -std::numeric_limits<float>::max());
+        if (targets.isEmpty() || !isEnrolled(query)) return;
+
+        // Write straight into the caller's buffer unless failures leave gaps to skip
+        QVector<float> gathered;
+        float *row = scores;
+        if (targets.size() < width) {
+            gathered.resize(targets.size());
+            row = gathered.data();
+        }
+
+        if (filter) filter->compareBatch(targets, query, row, 0, targets.size());
+        else        distance->compareBatch(targets, query, row, 0, targets.size());
+
+        for (int i=0; i<gathered.size(); i++)
+            scores[columns[i]] = gathered[i];
+    }
+};
+
+// Orders indices by descending score
+struct ScoreOrder
+{
+    const float *scores;
+    ScoreOrder(const float *scores_) : scores(scores_) {}
+    bool operator()(int a, int b) const { return scores[a] > scores[b]; }
+};
+
+static void compareListQuery(const ListComparison *comparison, const Template &query, float *scores)
+{
+    comparison->compare(query, scores);
+}
 
 const char *br_about()
 {
@@ -31,6 +114,11 @@ const char *br_about()
     return about.data();
 }
 
+void br_aggregate(const char *input_gallery, const char *output_gallery)
+{
+    Aggregate(File(input_gallery), File(output_gallery));
+}
+
 void br_cat(int num_input_galleries, const char *input_galleries[], const char *output_gallery)
 {
     Cat(QtUtils::toStringList(num_input_galleries, input_galleries), output_gallery);
@@ -41,6 +129,11 @@ void br_cluster(int num_simmats, const char *simmats[], float aggressiveness, co
     ClusterGallery(QtUtils::toStringList(num_simmats, simmats), aggressiveness, csv);
 }
 
+void br_cluster_gallery(const char *gallery, int k, float aggressiveness, const char *csv)
+{
+    ClusterNeighbors(File(gallery), k, aggressiveness, csv);
+}
+
 void br_combine_masks(int num_input_masks, const char *input_masks[], const char *output_mask, const char *method)
 {
     BEE::combineMasks(QtUtils::toStringList(num_input_masks, input_masks), output_mask, method);
@@ -51,6 +144,24 @@ void br_compare(const char *target_gallery, const char *query_gallery, const cha
     Compare(File(target_gallery), File(query_gallery), File(output));
 }
 
+void br_compare_template_lists(br_template_list_handle target, br_template_list_handle query, float *scores, const char *algorithm)
+{
+    const ListComparison comparison(target->templates, algorithm);
+
+    TaskGroup tasks;
+    for (int i=0; i<query->templates.size(); i++)
+        if (Globals->parallelism) tasks.run(&compareListQuery, &comparison, query->templates[i], scores + i*comparison.width);
+        else                                compareListQuery (&comparison, query->templates[i], scores + i*comparison.width);
+    tasks.wait();
+}
+
+float br_compare_templates(const unsigned char *target, int target_size, const unsigned char *query, int query_size, const char *algorithm)
+{
+    return CompareTemplates(TemplateCodec::decode(QByteArray::fromRawData((const char*)target, target_size)),
+                            TemplateCodec::decode(QByteArray::fromRawData((const char*)query, query_size)),
+                            algorithm);
+}
+
 void br_confusion(const char *file, float score, int *true_positives, int *false_positives, int *true_negatives, int *false_negatives)
 {
     return Confusion(file, score, *true_positives, *false_positives, *true_negatives, *false_negatives);
@@ -61,6 +172,11 @@ void br_convert(const char *input, const char *output)
     Convert(File(input), File(output));
 }
 
+void br_deduplicate(const char *target_gallery, const char *query_gallery, const char *csv)
+{
+    Deduplicate(File(target_gallery), File(query_gallery), File(csv));
+}
+
 void br_enroll(const char *input, const char *gallery)
 {
     Enroll(File(input), File(gallery));
@@ -72,6 +188,31 @@ void br_enroll_n(int num_inputs, const char *inputs[], const char *gallery)
     else                Enroll(File(inputs[0]), gallery);
 }
 
+int br_enroll_image(const unsigned char *data, int rows, int cols, int channels, const char *algorithm, unsigned char *template_data, int template_size)
+{
+    return enrollImage(Mat(rows, cols, CV_8UC(channels), (void*)data), algorithm, template_data, template_size);
+}
+
+int br_enroll_image_to_list(br_template_list_handle templates, const unsigned char *data, int rows, int cols, int channels, const char *algorithm)
+{
+    const Mat image(rows, cols, CV_8UC(channels), (void*)data);
+    Template t = EnrollTemplate(Template(image), algorithm);
+
+    // The caller only lends the pixels for this call, so a template still viewing them must own a copy
+    for (int i=0; i<t.size(); i++)
+        if (t[i].datastart == image.datastart) t[i] = t[i].clone();
+
+    templates->templates.append(t);
+    return isEnrolled(t) ? templates->templates.size()-1 : -1;
+}
+
+int br_enroll_encoded(const unsigned char *data, int size, const char *algorithm, unsigned char *template_data, int template_size)
+{
+    const Mat image = imdecode(Mat(1, size, CV_8UC1, (void*)data), 1);
+    if (!image.data) qWarning("Unable to decode %d byte image.", size);
+    return enrollImage(image, algorithm, template_data, template_size);
+}
+
 float br_eval(const char *simmat, const char *mask, const char *csv)
 {
     return Evaluate(simmat, mask, csv);
@@ -97,6 +238,11 @@ void br_finalize()
     Context::finalize();
 }
 
+void br_free_template_list(br_template_list_handle templates)
+{
+    delete templates;
+}
+
 void br_fuse(int num_input_simmats, const char *input_simmats[], const char *mask,
              const char *normalization, const char *fusion, const char *output_simmat)
 {
@@ -123,6 +269,23 @@ void br_make_mask(const char *target_input, const char *query_input, const char
     BEE::makeMask(target_input, query_input, mask);
 }
 
+void br_merge_matrices(int num_fragments, const char *fragments[], const char *simmat)
+{
+    BEE::mergeMatrices(QtUtils::toStringList(num_fragments, fragments), simmat);
+}
+
+const char *br_metrics()
+{
+    static QByteArray report;
+    report = Metrics::report().toLocal8Bit();
+    return report.data();
+}
+
+double br_metric(const char *series)
+{
+    return Metrics::value(series);
+}
+
 const char *br_most_recent_message()
 {
     static QByteArray byteArray;
@@ -130,6 +293,11 @@ const char *br_most_recent_message()
     return byteArray.data();
 }
 
+br_template_list_handle br_new_template_list()
+{
+    return new br_template_list();
+}
+
 const char *br_objects(const char *abstractions, const char *implementations, bool parameters)
 {
     static QByteArray objects;
@@ -182,6 +350,13 @@ bool br_plot_metadata(int num_files, const char *files[], const char *columns, b
     return PlotMetadata(QtUtils::toStringList(num_files, files), columns, show);
 }
 
+const char *br_profile_report()
+{
+    static QByteArray byteArray;
+    byteArray = Globals->profileReport().toLocal8Bit();
+    return byteArray.data();
+}
+
 float br_progress()
 {
     return Globals->progress();
@@ -204,7 +379,7 @@ void br_read_line(int *argc, const char ***argv)
 
 void br_reformat(const char *target_input, const char *query_input, const char *simmat, const char *output)
 {
-    Output::reformat(TemplateList::fromGallery(target_input).files(), TemplateList::fromGallery(query_input).files(), simmat, output);
+    Output::reformat(FileList::fromGallery(target_input), FileList::fromGallery(query_input), simmat, output);
 }
 
 const char *br_scratch_path()
@@ -220,11 +395,67 @@ const char *br_sdk_path()
     return sdkPath.data();
 }
 
+void br_search(const char *target_gallery, const char *query_gallery, int count, const char *csv)
+{
+    Search(target_gallery, query_gallery, count, csv);
+}
+
+int br_search_template_list(br_template_list_handle target, br_template_list_handle query, int query_index, int count,
+                            int *indices, float *scores, const char *algorithm)
+{
+    if ((query_index < 0) || (query_index >= query->templates.size()))
+        qFatal("Query index %d out of range [0, %d).", query_index, query->templates.size());
+
+    const ListComparison comparison(target->templates, algorithm);
+    QVector<float> all(comparison.width);
+    comparison.compare(query->templates[query_index], all.data());
+
+    // Only the best count need ordering, failures to enroll aren't matches
+    QVector<int> order; order.reserve(comparison.width);
+    for (int i=0; i<comparison.width; i++)
+        if (!target->templates[i].file.failed())
+            order.append(i);
+    const int matches = (count < 0) ? order.size() : std::min(count, order.size());
+    std::partial_sort(order.begin(), order.begin()+matches, order.end(), ScoreOrder(all.constData()));
+
+    for (int i=0; i<matches; i++) {
+        indices[i] = order[i];
+        scores[i] = all[order[i]];
+    }
+    return matches;
+}
+
+void br_serve(const char *name)
+{
+    Serve(name);
+}
+
 void br_set_property(const char *key, const char *value)
 {
     Globals->setProperty(key, value);
 }
 
+int br_template_list_append(br_template_list_handle templates, const unsigned char *template_data, int template_size)
+{
+    templates->templates.append(TemplateCodec::decode(QByteArray::fromRawData((const char*)template_data, template_size)));
+    return templates->templates.size()-1;
+}
+
+const unsigned char *br_template_list_data(br_template_list_handle templates, int index, int *size)
+{
+    *size = 0;
+    if ((index < 0) || (index >= templates->templates.size())) return NULL;
+    const Template &t = templates->templates[index];
+    if (t.isEmpty() || !t.m().isContinuous()) return NULL;
+    *size = int(t.m().total() * t.m().elemSize());
+    return t.m().data;
+}
+
+int br_template_list_size(br_template_list_handle templates)
+{
+    return templates->templates.size();
+}
+
 int br_time_remaining()
 {
     return Globals->timeRemaining();
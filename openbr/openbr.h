@@ -66,6 +66,16 @@ extern "C" {
  *  @{
  */
 
+/*!
+ * \brief Opaque handle to an in-memory list of enrolled templates.
+ *
+ * Template lists let callers enroll and compare without writing galleries or matrices to the file system.
+ * Create one with \ref br_new_template_list and release it with \ref br_free_template_list.
+ * A handle may be read from several threads concurrently, but must not be modified while it is read.
+ * \see br_enroll_image_to_list br_compare_template_lists br_search_template_list
+ */
+typedef struct br_template_list *br_template_list_handle;
+
 /*!
  * \brief Wraps br::Context::about()
  * \note \ref managed_return_value
@@ -73,6 +83,23 @@ extern "C" {
  */
 BR_EXPORT const char *br_about();
 
+/*!
+ * \brief Reduces a gallery to one or a few representative templates per subject.
+ *
+ * Templates are grouped by the \c key metadata field of \em output_gallery, default \c Label.
+ * Set \c method on \em output_gallery to choose the representatives:
+ *  - \c Mean (default) - The renormalized mean of the unit length members, for single matrix floating point templates.
+ *  - \c Medoid - The member most similar to the others by the algorithm's distance.
+ *  - \c Centers - The medoid and then, up to \c count in total, the member least similar to its nearest representative so far.
+ *                 The representatives are the matrices of one template, compare them with the \c Max distance to score a probe by its best representative.
+ *
+ * Representative templates are named after their subject and record their number of \c Members.
+ * Templates without the key, or that failed to enroll, are copied as is.
+ * \param input_gallery The br::Gallery file to aggregate, enrolled first if it isn't already.
+ * \param output_gallery The br::Gallery file to contain the representative templates.
+ */
+BR_EXPORT void br_aggregate(const char *input_gallery, const char *output_gallery);
+
 /*!
  * \brief Wraps br::Cat()
  */
@@ -89,6 +116,18 @@ BR_EXPORT void br_cat(int num_input_galleries, const char *input_galleries[], co
  */
 BR_EXPORT void br_cluster(int num_simmats, const char *simmats[], float aggressiveness, const char *csv);
 
+/*!
+ * \brief Clusters a gallery into a list of subjects without writing any similarity matrices.
+ *
+ * The gallery, enrolled first if it isn't already, is compared against itself a pair of blocks at a time
+ * and only the \em k most similar templates of each are kept, then clustered as in \ref br_cluster.
+ * \param gallery The br::Gallery file to cluster.
+ * \param k The number of neighbors to keep for each template, \ref br_cluster keeps \c 20.
+ * \param aggressiveness The higher the aggressiveness the larger the clusters. Suggested range is [0,10].
+ * \param csv The cluster results file to generate. Results are stored one row per cluster and use gallery indices.
+ */
+BR_EXPORT void br_cluster_gallery(const char *gallery, int k, float aggressiveness, const char *csv);
+
 /*!
  * \brief Combines several equal-sized mask matrices.
  * \param num_input_masks Size of \c input_masks
@@ -110,10 +149,41 @@ BR_EXPORT void br_combine_masks(int num_input_masks, const char *input_masks[],
  *                      A value of '.' reuses the target gallery as the query gallery.
  * \param output Optional br::Output file to contain the results of comparing the templates.
  *               The default behavior is to print scores to the terminal.
+ *               Set \c rowBlocks and \c colBlocks, as in <tt>scores.mtx[rowBlocks=0:4,colBlocks=8:]</tt>,
+ *               to compare only the query and target blocks in the half-open ranges, so one comparison can be split across jobs.
+ *               The output then covers just those rows and columns, <tt>.mtx</tt> fragments are joined with \ref br_merge_matrices.
+ *               Set \c incremental on a <tt>.mtx</tt> output, as in <tt>scores.mtx[incremental]</tt>, to reuse the scores it already holds
+ *               for templates whose name and contents are unchanged, so only the rows and columns of new templates are compared.
+ *               The templates are keyed in <tt>scores.mtx.keys</tt>, and both galleries are read into memory.
  * \see br_enroll
  */
 BR_EXPORT void br_compare(const char *target_gallery, const char *query_gallery, const char *output = "");
 
+/*!
+ * \brief Compares each template in \em query to each template in \em target, in memory.
+ *
+ * Templates that failed to enroll score <tt>-FLT_MAX</tt>.
+ * \param target Templates to make up the columns of \em scores.
+ * \param query Templates to make up the rows of \em scores.
+ * \param algorithm The algorithm to compare with, the default is the \c algorithm property.
+ * \param scores Caller-owned buffer of <tt>br_template_list_size(query) * br_template_list_size(target)</tt> floats
+ *               to receive the row-major similarity matrix.
+ * \see br_compare br_search_template_list
+ */
+BR_EXPORT void br_compare_template_lists(br_template_list_handle target, br_template_list_handle query, float *scores, const char *algorithm = "");
+
+/*!
+ * \brief Compares two templates produced by \ref br_enroll_image or \ref br_enroll_encoded.
+ * \param target The serialized target template.
+ * \param target_size Size of \em target in bytes.
+ * \param query The serialized query template.
+ * \param query_size Size of \em query in bytes.
+ * \param algorithm The algorithm to compare with, the default is the \c algorithm property.
+ * \return The comparison score.
+ * \see br::CompareTemplates
+ */
+BR_EXPORT float br_compare_templates(const unsigned char *target, int target_size, const unsigned char *query, int query_size, const char *algorithm = "");
+
 /*!
  * \brief Computes the confusion matrix for a dataset at a particular threshold.
  *
@@ -133,11 +203,27 @@ BR_EXPORT void br_confusion(const char *file, float score,
  */
 BR_EXPORT void br_convert(const char *input, const char *output);
 
+/*!
+ * \brief Groups templates with identical bytes, without comparing every pair.
+ *
+ * Finds the same pairs as \ref br_compare with an algorithm using \c Identical, such as \c MD5, \c SHA1 or \c FileName,
+ * but hashes each template once so the time is linear in the size of the galleries.
+ * \param target_gallery The br::Gallery file to find duplicates in.
+ * \param query_gallery The br::Gallery file of templates to find in \em target_gallery, or <tt>"."</tt> to find duplicates within \em target_gallery.
+ * \param csv Optional file to write <tt>Group,Gallery,File</tt> rows to, one row per member of each group.
+ *            Groups within a gallery have at least two members, groups across galleries at least one target and one query.
+ *            The default behavior is to print the rows to the terminal.
+ * \see br_compare
+ */
+BR_EXPORT void br_deduplicate(const char *target_gallery, const char *query_gallery, const char *csv = "");
+
 /*!
  * \brief Constructs template(s) from an input.
  * \param input The br::Input set of images to enroll.
  * \param gallery The br::Gallery file to contain the enrolled templates.
  *                By default the gallery will be held in memory and \em input can used as a gallery in \ref br_compare.
+ *                Set \c blocks, as in <tt>part.gal[blocks=16:32]</tt>, to enroll only the input blocks in the half-open range,
+ *                the partial galleries are joined in block order with \ref br_cat.
  * \see br_enroll_n
  */
 BR_EXPORT void br_enroll(const char *input, const char *gallery = "");
@@ -148,10 +234,59 @@ BR_EXPORT void br_enroll(const char *input, const char *gallery = "");
  */
 BR_EXPORT void br_enroll_n(int num_inputs, const char *inputs[], const char *gallery = "");
 
+/*!
+ * \brief Enrolls a single image held in memory, bypassing input files and galleries.
+ *
+ * The image is read in place for the duration of the call and the template is returned synchronously,
+ * which makes this the lowest latency path for real-time verification.
+ * \param data Row-major 8-bit pixels, interleaved BGR when \em channels is \c 3.
+ * \param rows Image height.
+ * \param cols Image width.
+ * \param channels Number of interleaved channels per pixel.
+ * \param algorithm The algorithm to enroll with, the default is the \c algorithm property.
+ * \param template_data Buffer to receive the serialized template.
+ * \param template_size Size of \em template_data in bytes.
+ * \return The size of the serialized template in bytes.
+ *         Nothing is written if it exceeds \em template_size, so the call may be repeated with a larger buffer.
+ * \see br_enroll_encoded br_compare_templates
+ */
+BR_EXPORT int br_enroll_image(const unsigned char *data, int rows, int cols, int channels, const char *algorithm,
+                              unsigned char *template_data, int template_size);
+
+/*!
+ * \brief Enrolls a single encoded image, such as JPEG or PNG bytes, held in memory.
+ * \param data The encoded image.
+ * \param size Size of \em data in bytes.
+ * \see br_enroll_image
+ */
+BR_EXPORT int br_enroll_encoded(const unsigned char *data, int size, const char *algorithm,
+                                unsigned char *template_data, int template_size);
+
+/*!
+ * \brief Enrolls a single image held in memory and appends the template to \em templates.
+ *
+ * Like \ref br_enroll_image the pixels are read in place for the duration of the call,
+ * but the template stays in memory and is never serialized.
+ * A template is appended even if enrollment fails so that indices match the order of enrollment.
+ * \param templates The list to append to.
+ * \param data Row-major 8-bit pixels, interleaved BGR when \em channels is \c 3.
+ * \param rows Image height.
+ * \param cols Image width.
+ * \param channels Number of interleaved channels per pixel.
+ * \param algorithm The algorithm to enroll with, the default is the \c algorithm property.
+ * \return The index of the appended template, or \c -1 if enrollment failed.
+ * \see br_template_list_append
+ */
+BR_EXPORT int br_enroll_image_to_list(br_template_list_handle templates, const unsigned char *data, int rows, int cols, int channels,
+                                      const char *algorithm = "");
+
 /*!
  * \brief Creates a \c .csv file containing performance metrics from evaluating the similarity matrix using the mask matrix.
  * \param simmat The \ref simmat to use.
+ *               <tt>scores.mtx[bootstrap=1000,confidence=0.95]</tt> also writes confidence intervals of the FAR/TAR bar chart, EER and CMC curve
+ *               to \em csv, from replicates resampling the queries with replacement.
  * \param mask The \ref mask to use.
+ *             <tt>Labels[target=<gallery>,query=<gallery>]</tt> computes the mask from gallery labels as it is read, instead of reading a mask file.
  * \param csv Optional \c .csv file to contain performance metrics.
  * \return True accept rate at a false accept rate of one in one hundred.
  * \see br_plot
@@ -188,6 +323,11 @@ BR_EXPORT void br_eval_regression(const char *predicted_input, const char *truth
  */
 BR_EXPORT void br_finalize();
 
+/*!
+ * \brief Releases a list created by \ref br_new_template_list.
+ */
+BR_EXPORT void br_free_template_list(br_template_list_handle templates);
+
 /*!
  * \brief Perform score level fusion on similarity matrices.
  * \param num_input_simmats Size of \em input_simmats.
@@ -229,10 +369,43 @@ BR_EXPORT bool br_is_classifier(const char *algorithm);
  * \param target_input The target br::Input.
  * \param query_input The query br::Input.
  * \param mask The file to contain the resulting \ref mask.
+ *             Set \c runLength, as in <tt>genuines.mask[runLength=true]</tt>, to store each row as runs of equal values,
+ *             which every reader of masks accepts.
  * \see br_combine_masks
  */
 BR_EXPORT void br_make_mask(const char *target_input, const char *query_input, const char *mask);
 
+/*!
+ * \brief Assembles the \ref simmat fragments of a comparison split into block ranges.
+ *
+ * Each fragment is the <tt>.mtx</tt> output of a \ref br_compare restricted with \c rowBlocks and \c colBlocks,
+ * its header records where it belongs, so fragments may be given in any order.
+ * \param num_fragments Size of \c fragments.
+ * \param fragments Array of \ref simmat fragments.
+ * \param simmat The file to contain the complete \ref simmat.
+ * \see br_compare
+ */
+BR_EXPORT void br_merge_matrices(int num_fragments, const char *fragments[], const char *simmat);
+
+/*!
+ * \brief Returns the process metrics in the <a href="http://prometheus.io/">Prometheus</a> text exposition format.
+ *
+ * Counters include templates enrolled, failures to enroll by reason (\c FTE or \c FTO), comparisons and gallery bytes read.
+ * Gauges include progress, the enrollment queue depth and the wall clock throughput of the last enrollment and comparison.
+ * Histograms record gallery read, enrollment and comparison latencies,
+ * and the latency of each transform and distance while br::Context::profile is enabled.
+ * \note \ref managed_return_value
+ * \see br_metric br_progress
+ */
+BR_EXPORT const char *br_metrics();
+
+/*!
+ * \brief Returns the current value of one series reported by \ref br_metrics, or the sample count of a histogram.
+ * \param series The series name including any labels, ex. <tt>br_failures_total{reason="FTE"}</tt>.
+ * \return The value, \c 0 if the series has not been recorded.
+ */
+BR_EXPORT double br_metric(const char *series);
+
 /*!
  * \brief Returns the most recent line sent to stderr.
  * \note \ref managed_return_value
@@ -240,6 +413,12 @@ BR_EXPORT void br_make_mask(const char *target_input, const char *query_input, c
  */
 BR_EXPORT const char *br_most_recent_message();
 
+/*!
+ * \brief Creates an empty template list.
+ * \see br_free_template_list
+ */
+BR_EXPORT br_template_list_handle br_new_template_list();
+
 /*!
  * \brief Returns names and parameters for the requested objects.
  *
@@ -265,6 +444,7 @@ BR_EXPORT const char *br_objects(const char *abstractions = ".*", const char *im
  * -# Error Rate (ERR) curve
  *
  * Several files will be created:
+ * - <i>destination</i><tt>_Data.csv</tt> which combines every input file, with a column for each pivot, and is read once by the R script.
  * - <i>destination</i><tt>.R</tt> which is the auto-generated R script used to render the figures.
  * - <i>destination</i><tt>.pdf</tt> which has all of the figures in one file (convenient for attaching in an email).
  * - <i>destination</i><tt>_ROC.pdf</tt>, ..., <i>destination</i><tt>_ERR.pdf</tt> which has each figure in a separate file (convenient for including in a presentation).
@@ -274,6 +454,7 @@ BR_EXPORT const char *br_objects(const char *abstractions = ".*", const char *im
  * \param destination Basename for the resulting figures.
  * \param show Open <i>destination</i>.pdf using the system's default PDF viewer.
  * \return Returns \c true on success. Returns false on a failure to compile the figures due to a missing, out of date, or incomplete \c R installation.
+ * \note A <tt>.csv</tt> \em destination only writes the combined data file, without running R, for dashboards that do their own rendering.
  * \note This function requires a current <a href="http://www.r-project.org/">R</a> installation with the following packages:
  * \code install.packages(c("ggplot2", "gplots", "reshape", "scales")) \endcode
  * \see br_plot_metadata
@@ -296,6 +477,13 @@ BR_EXPORT bool br_plot(int num_files, const char *files[], const char *destinati
  */
 BR_EXPORT bool br_plot_metadata(int num_files, const char *files[], const char *columns, bool show = false);
 
+/*!
+ * \brief Wraps br::Context::profileReport()
+ * \note \ref managed_return_value
+ * \see br_set_property
+ */
+BR_EXPORT const char *br_profile_report();
+
 /*!
  * \brief Wraps br::Context::progress()
  * \see br_most_recent_message br_time_remaining
@@ -336,11 +524,90 @@ BR_EXPORT const char *br_scratch_path();
  */
 BR_EXPORT const char *br_sdk_path();
 
+/*!
+ * \brief Finds the best matches for each query without comparing against the whole target gallery.
+ *
+ * Only the targets in the inverted file lists nearest each query are compared.
+ * The index is built when enrolling to a gallery with \c index metadata, for example <tt>targets.gal[index=1024]</tt>,
+ * or on the first search otherwise, and stored next to the gallery as <tt>targets.gal.ivf</tt>.
+ * Use the \c probes metadata of the target gallery to set the number of lists searched (default 8)
+ * and <tt>rerank=false</tt> to rank candidates by L2 distance instead of the algorithm's br::Distance.
+ * Binary codes, such as those of the \c pHash algorithm, are instead searched within a Hamming radius by multi-index hashing
+ * when the target gallery has \c radius metadata, for example <tt>targets.gal[radius=8]</tt>.
+ * \param target_gallery The br::Gallery file to search, its templates must be single fixed length matrices.
+ * \param query_gallery The br::Gallery file of templates to search for.
+ * \param count The number of matches to return for each query.
+ * \param csv Optional file to write <tt>Query,Target,Score</tt> rows to.
+ *            The default behavior is to print the rows to the terminal.
+ * \see br_compare
+ */
+BR_EXPORT void br_search(const char *target_gallery, const char *query_gallery, int count, const char *csv = "");
+
+/*!
+ * \brief Finds the best matches in \em target for one template of \em query, in memory.
+ * \param target Templates to search.
+ * \param query The list holding the template to search for.
+ * \param query_index Index of the template in \em query.
+ * \param count The maximum number of matches to return, a negative value returns every match.
+ * \param indices Caller-owned buffer of \em count ints, or the size of \em target if \em count is negative,
+ *                to receive the indices of the matching templates in \em target, best first.
+ * \param scores Caller-owned buffer of as many floats to receive the corresponding scores.
+ * \param algorithm The algorithm to compare with, the default is the \c algorithm property.
+ * \return The number of matches written, less than \em count if \em target is smaller.
+ *         Templates in \em target that failed to enroll are never matches.
+ * \see br_compare_template_lists
+ */
+BR_EXPORT int br_search_template_list(br_template_list_handle target, br_template_list_handle query, int query_index, int count,
+                                      int *indices, float *scores, const char *algorithm = "");
+
+/*!
+ * \brief Serves requests on a local socket until a client sends \c shutdown.
+ *
+ * Algorithms and target galleries stay loaded between requests, avoiding the start up cost of a new process per request.
+ * Each line sent by a client is one request, answered by zero or more result lines and a final \c OK or \c ERROR line:
+ * - \c enroll <input> <gallery>
+ * - \c compare <target_gallery> <query_gallery> <output>
+ * - \c search <target_gallery> <query> [limit], replying \c query,target,score for the \em limit best matches
+ * - \c set <key> [value], changing br::Context properties for later requests from the same client only
+ * - \c unload <gallery>
+ * - \c metrics, replying \ref br_metrics lines
+ * - \c ping
+ * - \c shutdown
+ *
+ * Set the \c algorithm metadata of a gallery, for example <tt>query.jpg[algorithm=FaceRecognition]</tt>, to override br::Context::algorithm for one request.
+ * Clients are served concurrently.
+ * \param name The local socket name to listen on.
+ * \note Unavailable in \c BR_EMBEDDED builds.
+ */
+BR_EXPORT void br_serve(const char *name);
+
 /*!
  *\brief Wraps br::Context::setProperty()
  */
 BR_EXPORT void br_set_property(const char *key, const char *value);
 
+/*!
+ * \brief Appends a template serialized by \ref br_enroll_image or \ref br_enroll_encoded to \em templates.
+ * \return The index of the appended template.
+ */
+BR_EXPORT int br_template_list_append(br_template_list_handle templates, const unsigned char *template_data, int template_size);
+
+/*!
+ * \brief Returns a pointer to the feature vector of a template without copying it.
+ *
+ * The pointer remains valid until the list is modified or released.
+ * \param templates The list holding the template.
+ * \param index Index of the template in \em templates.
+ * \param size Receives the size of the feature vector in bytes, \c 0 if the template is empty or not contiguous.
+ * \return The first matrix of the template, or \c NULL if \em size is \c 0.
+ */
+BR_EXPORT const unsigned char *br_template_list_data(br_template_list_handle templates, int index, int *size);
+
+/*!
+ * \brief Returns the number of templates in \em templates.
+ */
+BR_EXPORT int br_template_list_size(br_template_list_handle templates);
+
 /*!
  * \brief Wraps br::Context::timeRemaining()
  * \see br_most_recent_message br_progress
@@ -14,18 +14,20 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QFutureSynchronizer>
+#include <QAtomicInt>
+#include <QElapsedTimer>
 #include <QMetaProperty>
+#include <QMutex>
 #include <QPointF>
 #include <QRect>
 #include <QRegExp>
 #include <QSettings>
+#include <QThread>
 #include <QThreadPool>
-#include <QtConcurrentRun>
-#ifdef BR_DISTRIBUTED
-#include <mpi.h>
-#endif // BR_DISTRIBUTED
+#include <QThreadStorage>
+#include <QWaitCondition>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <openbr/openbr_plugin.h>
 
@@ -34,14 +36,40 @@
 #endif
 
 #include "version.h"
+#include "core/arena.h"
 #include "core/bee.h"
+#include "core/budget.h"
 #include "core/common.h"
+#include "core/distance_sse.h"
+#include "core/distributed.h"
+#include "core/metrics.h"
 #include "core/opencvutils.h"
+#include "core/packed.h"
+#include "core/parallel.h"
 #include "core/qtutils.h"
+#include "core/trace.h"
 
 using namespace br;
 using namespace cv;
 
+// Index of every declared br::Context property by name, so metadata lookups
+// falling back to the global context don't scan the meta object.
+static QHash<QString,int> contextProperties()
+{
+    QHash<QString,int> properties;
+    for (int i=0; i<Context::staticMetaObject.propertyCount(); i++)
+        properties.insert(QString::fromLatin1(Context::staticMetaObject.property(i).name()), i);
+    return properties;
+}
+
+static const QHash<QString,int> ContextProperties = contextProperties();
+
+// Initializers whose startup() waits for one of their plugins to be made, see br::Initializer::plugins()
+static QHash<QString, QSharedPointer<Initializer> > PendingInitializers;
+static QList< QSharedPointer<Initializer> > StartedInitializers;
+static QAtomicInt PendingStartups;
+static QMutex InitializersLock(QMutex::Recursive); // startup() may itself make plugins
+
 /* File - public methods */
 // Note that the convention for displaying metadata is as follows:
 // [] for lists in which argument order does not matter (e.g. [FTO=false, Index=0]),
@@ -77,8 +105,14 @@ QString File::hash() const
 
 void File::append(const QMap<QString,QVariant> &metadata)
 {
-    foreach (const QString &key, metadata.keys())
-        set(key, metadata[key]);
+    // Values in another file's metadata are already normalized by set(), so an empty file can share them
+    if (m_metadata.isEmpty()) {
+        m_metadata = metadata;
+        return;
+    }
+
+    for (QMap<QString,QVariant>::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it)
+        set(it.key(), it.value());
 }
 
 void File::append(const File &other)
@@ -119,12 +153,14 @@ QString File::resolved() const
 
 bool File::contains(const QString &key) const
 {
-    return m_metadata.contains(key) || Globals->contains(key);
+    return m_metadata.contains(key) || ContextProperties.contains(key);
 }
 
 QVariant File::value(const QString &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : Globals->property(qPrintable(key));
+    QVariant variant;
+    if (!lookup(key, variant)) variant = Globals->property(qPrintable(key)); // Dynamic properties
+    return variant;
 }
 
 void File::set(const QString &key, const QVariant &value)
@@ -149,8 +185,8 @@ void File::set(const QString &key, const QVariant &value)
 
 bool File::getBool(const QString &key) const
 {
-    if (!contains(key)) return false;
-    QVariant variant = value(key);
+    QVariant variant;
+    if (!lookup(key, variant)) return false;
     if (variant.isNull() || !variant.canConvert<bool>()) return true;
     return variant.value<bool>();
 }
@@ -162,13 +198,23 @@ QString File::subject(int label)
 
 float File::label() const
 {
-    const QVariant variant = value("Label");
+    // Templates nearly always carry their own label, so the context's properties are only consulted without one
+    static const QString key("Label");
+    QMap<QString,QVariant>::const_iterator it = m_metadata.constFind(key);
+    const QVariant variant = (it != m_metadata.constEnd()) ? it.value() : value(key);
     if (variant.isNull()) return -1;
 
-    if (Globals->classes.contains(variant.toString()))
-        return Globals->classes.value(variant.toString());
-
+    // Numbers are only interned as subjects when their text has a leading zero, see set()
     bool ok;
+    if (variant.type() != QVariant::String) {
+        const float val = variant.toFloat(&ok);
+        if (ok && !((val > 0) && (val < 1))) return val;
+    }
+
+    const QHash<QString,int> &classes = Globals->classes;
+    QHash<QString,int>::const_iterator code = classes.constFind(variant.toString());
+    if (code != classes.constEnd()) return code.value();
+
     const float val = variant.toFloat(&ok);
     return ok ? val : -1;
 }
@@ -187,24 +233,26 @@ QList<QPointF> File::namedPoints() const
 QList<QPointF> File::points() const
 {
     QList<QPointF> points;
-    foreach (const QVariant &point, m_metadata["Points"].toList())
+    foreach (const QVariant &point, m_metadata.value(QStringLiteral("Points")).toList())
         points.append(point.toPointF());
     return points;
 }
 
 void File::appendPoint(const QPointF &point)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QVariant &variant = m_metadata[QStringLiteral("Points")];
+    QList<QVariant> newPoints = variant.toList();
     newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    variant = newPoints;
 }
 
 void File::appendPoints(const QList<QPointF> &points)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QVariant &variant = m_metadata[QStringLiteral("Points")];
+    QList<QVariant> newPoints = variant.toList();
     foreach (const QPointF &point, points)
         newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    variant = newPoints;
 }
 
 QList<QRectF> File::namedRects() const
@@ -221,27 +269,43 @@ QList<QRectF> File::namedRects() const
 QList<QRectF> File::rects() const
 {
     QList<QRectF> rects;
-    foreach (const QVariant &rect, m_metadata["Rects"].toList())
+    foreach (const QVariant &rect, m_metadata.value(QStringLiteral("Rects")).toList())
         rects.append(rect.toRect());
     return rects;
 }
 
 void File::appendRect(const QRectF &rect)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QVariant &variant = m_metadata[QStringLiteral("Rects")];
+    QList<QVariant> newRects = variant.toList();
     newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    variant = newRects;
 }
 
 void File::appendRects(const QList<QRectF> &rects)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QVariant &variant = m_metadata[QStringLiteral("Rects")];
+    QList<QVariant> newRects = variant.toList();
     foreach (const QRectF &rect, rects)
         newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    variant = newRects;
 }
 
 /* File - private methods */
+bool File::lookup(const QString &key, QVariant &value) const
+{
+    QMap<QString,QVariant>::const_iterator it = m_metadata.constFind(key);
+    if (it != m_metadata.constEnd()) {
+        value = it.value();
+        return true;
+    }
+
+    const int index = ContextProperties.value(key, -1);
+    if (index == -1) return false;
+    value = Context::staticMetaObject.property(index).read(Globals);
+    return true;
+}
+
 void File::init(const QString &file)
 {
     name = file;
@@ -418,15 +482,21 @@ TemplateList TemplateList::fromGallery(const br::File &gallery)
     TemplateList templates;
     foreach (const br::File &file, gallery.split()) {
         QScopedPointer<Gallery> i(Gallery::make(file));
-        TemplateList newTemplates = i->read();
-        newTemplates = newTemplates.mid(gallery.get<int>("pos", 0), gallery.get<int>("length", -1));
-
-        const int step = gallery.get<int>("step", 1);
-        if (step > 1) {
-            TemplateList downsampled; downsampled.reserve(newTemplates.size()/step);
-            for (int i=0; i<newTemplates.size(); i+=step)
-                downsampled.append(newTemplates[i]);
-            newTemplates = downsampled;
+
+        // Select pos, length and step while reading, so unselected templates aren't kept and reading stops after the last
+        const int pos = gallery.get<int>("pos", 0);
+        const int length = gallery.get<int>("length", -1);
+        const int step = std::max(1, gallery.get<int>("step", 1));
+        TemplateList newTemplates;
+        int index = 0;
+        bool done = false;
+        while (!done && ((length < 0) || (index < pos+length))) {
+            const TemplateList block = i->readBlock(&done);
+            for (int j=0; j<block.size(); j++, index++)
+                if ((index >= pos) && ((length < 0) || (index < pos+length)) && ((index-pos) % step == 0)) {
+                    newTemplates.append(block[j]);
+                    MatBudget::hold(newTemplates.last()); // Only copies matrices not deserialized under the limit, like decoded images
+                }
         }
 
         if (gallery.get<bool>("reduce", false)) newTemplates = newTemplates.reduced();
@@ -437,10 +507,13 @@ TemplateList TemplateList::fromGallery(const br::File &gallery)
         if (newTemplates.isEmpty())
             newTemplates.append(file);
 
-        // Propogate metadata
+        // Propogate metadata, merged once and shared by templates without metadata of their own
+        File shared;
+        shared.append(gallery.localMetadata());
+        shared.append(file.localMetadata());
+        const QMap<QString,QVariant> sharedMetadata = shared.localMetadata();
         for (int i=0; i<newTemplates.size(); i++) {
-            newTemplates[i].file.append(gallery.localMetadata());
-            newTemplates[i].file.append(file.localMetadata());
+            if (!sharedMetadata.isEmpty()) newTemplates[i].file.append(sharedMetadata);
             newTemplates[i].file.set("Index", i+templates.size());
             if (crossValidate > 0) newTemplates[i].file.set("Cross_Validation_Partition", rand()%crossValidate);
         }
@@ -458,6 +531,48 @@ TemplateList TemplateList::fromGallery(const br::File &gallery)
     return templates;
 }
 
+FileList FileList::fromGallery(const br::File &gallery)
+{
+    // Reducing and merging need the templates themselves
+    if (gallery.get<bool>("reduce", false) || gallery.get<bool>("merge", false))
+        return TemplateList::fromGallery(gallery).files();
+
+    FileList files;
+    foreach (const br::File &file, gallery.split()) {
+        QScopedPointer<Gallery> i(Gallery::make(file));
+        const FileList all = i->files();
+
+        const int pos = gallery.get<int>("pos", 0);
+        const int length = gallery.get<int>("length", -1);
+        const int step = std::max(1, gallery.get<int>("step", 1));
+        FileList newFiles;
+        for (int index=pos; (index < all.size()) && ((length < 0) || (index < pos+length)); index += step)
+            newFiles.append(all[index]);
+
+        const int crossValidate = gallery.get<int>("crossValidate");
+        if (crossValidate > 0) srand(0);
+
+        // If file is a Format not a Gallery
+        if (newFiles.isEmpty())
+            newFiles.append(file);
+
+        // Propogate metadata, the same way as TemplateList::fromGallery()
+        File shared;
+        shared.append(gallery.localMetadata());
+        shared.append(file.localMetadata());
+        const QMap<QString,QVariant> sharedMetadata = shared.localMetadata();
+        for (int i=0; i<newFiles.size(); i++) {
+            if (!sharedMetadata.isEmpty()) newFiles[i].append(sharedMetadata);
+            newFiles[i].set("Index", i+files.size());
+            if (crossValidate > 0) newFiles[i].set("Cross_Validation_Partition", rand()%crossValidate);
+        }
+
+        files += newFiles;
+    }
+
+    return files;
+}
+
 TemplateList TemplateList::relabel(const TemplateList &tl)
 {
     QHash<int,int> labels;
@@ -471,6 +586,58 @@ TemplateList TemplateList::relabel(const TemplateList &tl)
     return result;
 }
 
+// Copies templates [begin, end) to their offsets in data
+static void copyAligned(TemplateList *templates, uchar *data, const size_t *offsets, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        Mat &m = (*templates)[i];
+        if (!m.data) continue;
+        memcpy(data + offsets[i], m.ptr(), offsets[i+1] - offsets[i]);
+        m = Mat(m.rows, m.cols, m.type(), data + offsets[i]);
+    }
+}
+
+void TemplateList::align()
+{
+    if (!empty() && first().size() > 1) return;
+
+    bool isUniform = true;
+    QVector<size_t> offsets(size()+1, 0);
+    for (int i=0; i<size(); i++) {
+        const Template &t = at(i);
+        if (t.size() > 1) qFatal("Can't handle multi-matrix template %s.", qPrintable(t.file.flat()));
+
+        const Mat &m = t;
+        size_t size = 0;
+        if (m.data) {
+            size = m.total() * m.elemSize();
+            if (!m.isContinuous()) qFatal("Requires continuous matrix data of size %d for %s.", (int)size, qPrintable(t.file.flat()));
+        }
+        offsets[i+1] = offsets[i] + size;
+        isUniform = isUniform &&
+                    (m.rows == first().m().rows) &&
+                    (m.cols == first().m().cols) &&
+                    (m.type() == first().m().type());
+    }
+
+    // Each NUMA node copies its own partition so the pages are first touched, and placed, there
+    QSharedPointer<AlignedData> data(new AlignedData(offsets.last()));
+    const int nodes = std::min(Parallel::nodes(), std::max(1, size()));
+    detach();
+    TaskGroup tasks;
+    for (int k=0; k<nodes; k++) {
+        const int begin = k*size()/nodes, end = (k+1)*size()/nodes;
+        data->partitions.append(data->data + offsets[begin]);
+        tasks.setNode(k);
+        if (nodes > 1) tasks.run(&copyAligned, this, data->data, (const size_t*)offsets.data(), begin, end);
+        else           copyAligned(this, data->data, offsets.data(), begin, end);
+    }
+    tasks.wait();
+
+    uniform = isUniform;
+    alignedData = data;
+}
+
 /* Object - public methods */
 QStringList Object::parameters() const
 {
@@ -752,21 +919,119 @@ void Object::init(const File &file_)
     init();
 }
 
+void Object::copy(const Object &prototype)
+{
+    file = prototype.file;
+    firstAvailablePropertyIdx = prototype.firstAvailablePropertyIdx;
+    setObjectName(prototype.objectName());
+
+    // Configuration, the properties that aren't stored, is copied and child plugins are copied recursively.
+    // Other stored properties are trained state, they start from their defaults as they would when parsing the description.
+    // Start from 1 to skip QObject::objectName
+    for (int i=1; i<metaObject()->propertyCount(); i++) {
+        QMetaProperty property = metaObject()->property(i);
+        if (!property.isWritable()) continue;
+
+        const QString type = property.typeName();
+        if (property.isStored(&prototype) && !isPluginType(type)) {
+            if (property.isResettable() && !property.reset(this))
+                qFatal("Failed to reset %s::%s", metaObject()->className(), property.name());
+            continue;
+        }
+
+        const QVariant value = property.read(&prototype);
+        QVariant variant;
+        if (type == "QList<br::Transform*>") {
+            QList<Transform*> values;
+            foreach (Transform *transform, value.value< QList<Transform*> >()) {
+                values.append(transform->clone());
+                values.last()->setParent(this);
+            }
+            variant.setValue(values);
+        } else if (type == "QList<br::Distance*>") {
+            QList<Distance*> values;
+            foreach (Distance *distance, value.value< QList<Distance*> >()) {
+                values.append(Factory<Distance>::copy(distance));
+                values.last()->setParent(this);
+            }
+            variant.setValue(values);
+        } else if (type == "br::Transform*") {
+            Transform *transform = value.value<Transform*>();
+            if (transform) {
+                transform = transform->clone();
+                transform->setParent(this);
+            }
+            variant.setValue(transform);
+        } else if (type == "br::Distance*") {
+            Distance *distance = value.value<Distance*>();
+            if (distance) {
+                distance = Factory<Distance>::copy(distance);
+                distance->setParent(this);
+            }
+            variant.setValue(distance);
+        } else {
+            variant = value;
+        }
+
+        if (!property.write(this, variant))
+            qFatal("Failed to copy %s::%s", metaObject()->className(), property.name());
+    }
+
+    // Stored properties set by the description
+    foreach (QString key, file.localKeys()) {
+        if (key.startsWith("_Arg")) {
+            const int index = key.mid(4).toInt() + firstAvailablePropertyIdx;
+            if (index >= metaObject()->propertyCount()) continue;
+            key = metaObject()->property(index).name();
+        }
+        const int index = metaObject()->indexOfProperty(qPrintable(key));
+        if (index == -1) continue;
+        const QMetaProperty property = metaObject()->property(index);
+        if (property.isStored(&prototype) && !isPluginType(property.typeName()))
+            setProperty(key, file.value(key).toString());
+    }
+
+    init();
+}
+
+bool Object::isPluginType(const QString &type)
+{
+    return (type == "QList<br::Transform*>") || (type == "QList<br::Distance*>") ||
+           (type == "br::Transform*") || (type == "br::Distance*");
+}
+
 /* Context - public methods */
+br::Context::Context()
+    : memoryLedger(new MemoryLedger())
+{}
+
+br::Context::~Context()
+{
+    // Buffers still charged to the ledger keep it alive
+    if (!memoryLedger->refs.deref()) delete memoryLedger;
+}
+
 int br::Context::blocks(int size) const
 {
     return std::ceil(1.f*size/blockSize);
 }
 
-bool br::Context::contains(const QString &name)
+Context *br::Context::fork() const
 {
-    QByteArray bytes = name.toLocal8Bit();
-    const char * c_name = bytes.constData();
+    Context *job = new Context();
+    for (int i=Context::staticMetaObject.propertyOffset(); i<Context::staticMetaObject.propertyCount(); i++) {
+        const QMetaProperty property = Context::staticMetaObject.property(i);
+        property.write(job, property.read(this));
+    }
+    job->abbreviations = abbreviations;
+    job->classes = classes;
+    job->currentStep = job->totalSteps = 0;
+    return job;
+}
 
-    for (int i=0; i<metaObject()->propertyCount(); i++)
-        if (!strcmp(c_name, metaObject()->property(i).name()))
-            return true;
-    return false;
+bool br::Context::contains(const QString &name)
+{
+    return ContextProperties.contains(name);
 }
 
 void br::Context::printStatus()
@@ -782,17 +1047,95 @@ void br::Context::printStatus()
     }
 }
 
+namespace
+{
+
+struct ProfileEntry
+{
+    qint64 calls, nsecs, templates;
+    double bytes;
+    QList<double> latencies; // Not yet reported to br::Metrics
+    ProfileEntry() : calls(0), nsecs(0), templates(0), bytes(0) {}
+};
+
+// Reports the buffered latencies of every stage, call with profileLock held
+void flushProfileMetrics()
+{
+    for (QHash<QString, ProfileEntry>::iterator it = profileEntries.begin(); it != profileEntries.end(); ++it) {
+        Metrics::observe("br_stage_seconds{stage=\"" + it.key() + "\"}", it->latencies);
+        it->latencies.clear();
+    }
+}
+
+QHash<QString, ProfileEntry> profileEntries;
+QMutex profileLock;
+
+} // namespace
+
+void br::Context::addProfile(const QString &name, qint64 nsecs, size_t bytes, int templates)
+{
+    QMutexLocker locker(&profileLock);
+    ProfileEntry &entry = profileEntries[name];
+    entry.calls++;
+    entry.nsecs += nsecs;
+    entry.bytes += bytes;
+    entry.templates += templates;
+
+    // Stages are profiled per template, so report to br::Metrics once per block
+    entry.latencies.append(nsecs/1e9);
+    if (entry.latencies.size() < blockSize) return;
+    QList<double> batch;
+    batch.swap(entry.latencies);
+    locker.unlock();
+
+    Metrics::observe("br_stage_seconds{stage=\"" + name + "\"}", batch);
+}
+
+QString br::Context::profileReport() const
+{
+    QMutexLocker locker(&profileLock);
+    flushProfileMetrics();
+    typedef QPair<qint64,QString> SortPair;
+    QList<SortPair> sorted;
+    foreach (const QString &name, profileEntries.keys())
+        sorted.append(SortPair(profileEntries[name].nsecs, name));
+    std::sort(sorted.begin(), sorted.end(), std::greater<SortPair>());
+
+    QStringList lines;
+    lines.append("Name,Calls,Time (ms),Time/Call (ms),Output Bytes,Output Templates");
+    foreach (const SortPair &pair, sorted) {
+        const ProfileEntry &entry = profileEntries[pair.second];
+        lines.append(QString("%1,%2,%3,%4,%5,%6").arg(pair.second, QString::number(entry.calls),
+                                                     QString::number(entry.nsecs/1e6), QString::number(entry.nsecs/1e6/entry.calls),
+                                                     QString::number(entry.bytes, 'g', 12), QString::number(entry.templates)));
+    }
+    return lines.join("\n");
+}
+
 float br::Context::progress() const
 {
     if (totalSteps == 0) return -1;
     return currentStep / totalSteps;
 }
 
+void br::Context::cancel()
+{
+    cancelFlag.storeRelease(1);
+}
+
+bool br::Context::cancelled() const
+{
+    return cancelFlag.loadAcquire() != 0;
+}
+
 void br::Context::setProperty(const QString &key, const QString &value)
 {
     Object::setProperty(key, value);
     qDebug("Set %s%s", qPrintable(key), value.isEmpty() ? "" : qPrintable(" to " + value));
 
+    // The thread pool and log file belong to the process, job contexts only change their own settings
+    if (this != Globals.process()) return;
+
     if (key == "parallelism") {
         const int maxThreads = std::max(1, QThread::idealThreadCount());
         QThreadPool::globalInstance()->setMaxThreadCount(parallelism ? std::min(maxThreads, abs(parallelism)) : maxThreads);
@@ -834,25 +1177,19 @@ void br::Context::initialize(int &argc, char *argv[], const QString &sdkPath)
 #endif
     }
 
-    if (Globals == NULL) {
+    if (Globals.process() == NULL) {
         Globals = new Context();
         Globals->init(File());
     }
 
     initializeQt(sdkPath);
 
-#ifdef BR_DISTRIBUTED
-    int rank, size;
-    MPI_Init(&argc, &argv);
-    MPI_Cobr_rank(MPI_CObr_WORLD, &rank);
-    MPI_Cobr_size(MPI_CObr_WORLD, &size);
-    if (!quiet) qDebug() << "OpenBR distributed process" << rank << "of" << size;
-#endif // BR_DISTRIBUTED
+    Distributed::initialize(argc, argv);
 }
 
 void br::Context::initializeQt(QString sdkPath)
 {
-    if (Globals == NULL) {
+    if (Globals.process() == NULL) {
         Globals = new Context();
         Globals->init(File());
     }
@@ -869,6 +1206,7 @@ void br::Context::initializeQt(QString sdkPath)
     qRegisterMetaType< QList<br::Distance*> >();
     qRegisterMetaType< cv::Mat >();
 
+    Messages->resume();
     qInstallMessageHandler(messageHandler);
 
     // Search for SDK
@@ -893,10 +1231,26 @@ void br::Context::initializeQt(QString sdkPath)
 
     Globals->sdkPath = sdkPath;
 
+    // Select the distance kernels for this CPU
+    initializeDistanceKernels();
+    if (Globals->verbose) qDebug("Using %s distance kernels", distanceKernels.name);
+
     // Trigger registered initializers
     QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
-    foreach (const QSharedPointer<Initializer> &initializer, initializers)
+    foreach (const QSharedPointer<Initializer> &initializer, initializers) {
         initializer->initialize();
+
+        const QStringList plugins = initializer->plugins();
+        if (plugins.isEmpty()) {
+            initializer->startup();
+            StartedInitializers.append(initializer);
+        } else {
+            QMutexLocker locker(&InitializersLock);
+            foreach (const QString &plugin, plugins)
+                PendingInitializers.insert(plugin, initializer);
+            PendingStartups.store(PendingInitializers.size());
+        }
+    }
 }
 
 void br::Context::finalize()
@@ -904,19 +1258,56 @@ void br::Context::finalize()
     // Is anyone still running?
     QThreadPool::globalInstance()->waitForDone();
 
+    if (Globals->profile) {
+        qDebug("%s", qPrintable(Globals->profileReport()));
+        if (Globals->arena) {
+            const MatArena::Statistics arena = MatArena::statistics();
+            qDebug("Matrix arena: %lld allocations, %lld reuses, %lld releases", arena.allocations, arena.reuses, arena.releases);
+        }
+    }
+
     // Trigger registered finalizers
+    {
+        QMutexLocker locker(&InitializersLock);
+        foreach (const QSharedPointer<Initializer> &initializer, StartedInitializers)
+            initializer->shutdown();
+        StartedInitializers.clear();
+        PendingInitializers.clear();
+        PendingStartups.store(0);
+    }
+
     QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
 
-#ifdef BR_DISTRIBUTED
-    MPI_Finalize();
-#endif // BR_DISTRIBUTED
+    Distributed::finalize();
+
+    if (!Globals->trace.isEmpty())
+        Trace::write(Globals->trace);
+
+    // Write buffered messages while the log file is still open
+    Messages->stop();
 
-    delete Globals;
+    delete Globals.process();
     Globals = NULL;
 }
 
+void br::Context::startup(const QString &plugin)
+{
+    if (PendingStartups.load() == 0) return;
+
+    QMutexLocker locker(&InitializersLock);
+    const QSharedPointer<Initializer> initializer = PendingInitializers.value(plugin);
+    if (initializer.isNull()) return;
+
+    foreach (const QString &name, initializer->plugins())
+        PendingInitializers.remove(name);
+    PendingStartups.store(PendingInitializers.size());
+    if (Globals->verbose) qDebug("Starting %s", initializer->metaObject()->className());
+    initializer->startup();
+    StartedInitializers.append(initializer);
+}
+
 QString br::Context::about()
 {
     return QString("%1 %2 %3").arg(PRODUCT_NAME, PRODUCT_VERSION, LEGAL_COPYRIGHT);
@@ -932,13 +1323,161 @@ QString br::Context::scratchPath()
     return QString("%1/%2-%3.%4").arg(QDir::homePath(), PRODUCT_NAME, QString::number(PRODUCT_VERSION_MAJOR), QString::number(PRODUCT_VERSION_MINOR));
 }
 
-void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+namespace
+{
+
+/*!
+ * \brief Writes messages to \c stderr and the log file without serializing the threads raising them.
+ *
+ * Debug messages are appended to a buffer of the calling thread and written by a background flusher,
+ * so verbose worker threads only contend with the flusher for their own buffer.
+ * Warnings and errors flush the calling thread's buffer and are written immediately,
+ * a warning raised more than #Max_Repeats times is suppressed and counted instead.
+ */
+class MessageLog : public QThread
 {
-    // Something about this method is not thread safe, and will lead to crashes if qDebug
-    // statements are called from multiple threads. Unless we lock the whole thing...
-    static QMutex generalLock;
-    QMutexLocker locker(&generalLock);
+    struct Buffer
+    {
+        QMutex lock; // Only contended by the flusher
+        QByteArray text;
+    };
+
+    enum State { Idle, Running, Stopped };
+    QAtomicInt state;
+    QThreadStorage< QSharedPointer<Buffer> > localBuffers;
+    QList< QSharedPointer<Buffer> > buffers; // Outlive their threads so no message is lost
+    QMutex buffersLock, sinkLock, warningsLock, wakeLock;
+    QWaitCondition wake;
+    QHash<QString, int> warnings; // Times each warning was raised
+
+public:
+    enum { Flush_Interval_ms = 100, Max_Buffer_Bytes = 1 << 16, Max_Repeats = 10 };
+
+    MessageLog() : state(Idle) {}
+
+    void debug(const QString &txt)
+    {
+        if (state.load() == Stopped) return write(txt);
+
+        Buffer *buffer = local();
+        buffer->lock.lock();
+        buffer->text.append(txt.toLocal8Bit());
+        const bool full = buffer->text.size() > Max_Buffer_Bytes;
+        buffer->lock.unlock();
+        if (full) flush(buffer);
+    }
+
+    // Returns the text to write for the nth repeat of a warning, or an empty string once it is suppressed
+    QString warning(const QString &txt)
+    {
+        int count;
+        {
+            QMutexLocker locker(&warningsLock);
+            count = ++warnings[txt];
+        }
+        if (count < Max_Repeats) return txt;
+        if (count == Max_Repeats) return QString(txt).insert(txt.size()-1, " (further repeats suppressed)");
+        return QString();
+    }
+
+    // Writes immediately, after any earlier messages of the calling thread
+    void write(const QString &txt)
+    {
+        if (localBuffers.hasLocalData()) flush(localBuffers.localData().data());
+        QMutexLocker locker(&sinkLock);
+        sink(txt.toLocal8Bit());
+    }
+
+    void flushAll()
+    {
+        QList< QSharedPointer<Buffer> > pending;
+        {
+            QMutexLocker locker(&buffersLock);
+            pending = buffers;
+        }
+        foreach (const QSharedPointer<Buffer> &buffer, pending)
+            flush(buffer.data());
+    }
+
+    // Called by br::Context::finalize(), later messages are written synchronously
+    void stop()
+    {
+        if (state.fetchAndStoreOrdered(Stopped) == Running) {
+            {
+                QMutexLocker locker(&wakeLock);
+                wake.wakeAll();
+            }
+            wait();
+        }
+        flushAll();
+
+        QMutexLocker locker(&warningsLock);
+        for (QHash<QString, int>::const_iterator it = warnings.constBegin(); it != warnings.constEnd(); ++it)
+            if (it.value() > Max_Repeats)
+                write(QString("Suppressed %1 repeats of: %2").arg(QString::number(it.value() - Max_Repeats), it.key()));
+        warnings.clear();
+    }
+
+    // Called by br::Context::initialize()
+    void resume()
+    {
+        state.testAndSetOrdered(Stopped, Idle);
+    }
+
+private:
+    Buffer *local()
+    {
+        if (!localBuffers.hasLocalData()) {
+            QSharedPointer<Buffer> buffer(new Buffer());
+            localBuffers.setLocalData(buffer);
+            QMutexLocker locker(&buffersLock);
+            buffers.append(buffer);
+            if (state.testAndSetOrdered(Idle, Running)) start();
+        }
+        return localBuffers.localData().data();
+    }
+
+    void flush(Buffer *buffer)
+    {
+        QByteArray text;
+        buffer->lock.lock();
+        text.swap(buffer->text);
+        buffer->lock.unlock();
+        if (text.isEmpty()) return;
+        QMutexLocker locker(&sinkLock);
+        sink(text);
+    }
+
+    // Callers hold sinkLock
+    static void sink(const QByteArray &text)
+    {
+        std::cerr.write(text.constData(), text.size());
+        Context *process = Globals.process();
+        if (process && process->logFile.isWritable()) {
+            process->logFile.write(text);
+            process->logFile.flush();
+        }
+    }
 
+    void run()
+    {
+        QMutexLocker locker(&wakeLock);
+        while (state.load() == Running) {
+            wake.wait(&wakeLock, Flush_Interval_ms);
+            locker.unlock();
+            flushAll();
+            locker.relock();
+        }
+    }
+};
+
+MessageLog *Messages = new MessageLog(); // Never deleted, messages may be raised during static destruction
+QMutex MostRecentMessageLock;
+
+} // namespace
+
+void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
     QString txt;
     switch (type) {
       case QtDebugMsg:
@@ -946,7 +1485,8 @@ void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &conte
         txt = QString("%1\n").arg(msg);
         break;
       case QtWarningMsg:
-        txt = QString("Warning: %1\n").arg(msg);
+        txt = Messages->warning(QString("Warning: %1\n").arg(msg));
+        if (txt.isEmpty()) return;
         break;
       case QtCriticalMsg:
         txt = QString("Critical: %1\n").arg(msg);
@@ -956,39 +1496,121 @@ void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &conte
         break;
     }
 
-    std::cerr << txt.toStdString();
-    Globals->mostRecentMessage = txt;
+    {
+        QMutexLocker locker(&MostRecentMessageLock);
+        Globals->mostRecentMessage = txt;
+    }
 
-    if (Globals->logFile.isWritable()) {
-        Globals->logFile.write(qPrintable(txt));
-        Globals->logFile.flush();
+    if (type == QtDebugMsg) {
+        Messages->debug(txt);
+    } else {
+        if (type == QtFatalMsg) Messages->flushAll();
+        Messages->write(txt);
     }
 
     if (type == QtFatalMsg) {
         // Write debug output then close
         qDebug("  File: %s\n  Function: %s\n  Line: %d", qPrintable(context.file), qPrintable(context.function), context.line);
-        Globals->finalize();
+        Context::finalize();
         //QCoreApplication::exit(-1);
         abort();
     }
 }
 
-Context *br::Globals = NULL;
+namespace
+{
+
+struct JobContext
+{
+    Context *context;
+    JobContext() : context(NULL) {}
+};
+
+QThreadStorage<JobContext> JobContexts;
+QAtomicInt JobThreads; // Threads with a job context, so the common case skips the thread storage lookup
+
+} // namespace
+
+ContextPointer br::Globals;
+
+/* ContextPointer - public methods */
+Context *ContextPointer::current() const
+{
+    if (JobThreads.load() == 0) return processContext;
+    Context *context = job();
+    return context ? context : processContext;
+}
+
+Context *ContextPointer::job()
+{
+    return JobContexts.hasLocalData() ? JobContexts.localData().context : NULL;
+}
+
+/* ContextScope - public methods */
+ContextScope::ContextScope(Context *context)
+    : previous(ContextPointer::job())
+{
+    if (context == previous) return;
+    if (!previous) JobThreads.ref();
+    if (!context) JobThreads.deref();
+    JobContexts.localData().context = context;
+}
+
+ContextScope::~ContextScope()
+{
+    Context *context = ContextPointer::job();
+    if (context == previous) return;
+    if (!context) JobThreads.ref();
+    if (!previous) JobThreads.deref();
+    JobContexts.localData().context = previous;
+}
 
 /* Output - public methods */
-void Output::setBlock(int rowBlock, int columnBlock)
+void Output::setBlock(int rowBlock, int columnBlock, bool mirror)
 {
     offset = QPoint((columnBlock == -1) ? 0 : Globals->blockSize*columnBlock,
                     (rowBlock == -1) ? 0 : Globals->blockSize*rowBlock);
-    if (!next.isNull()) next->setBlock(rowBlock, columnBlock);
+    this->mirror = mirror;
+    if (!next.isNull()) next->setBlock(rowBlock, columnBlock, mirror);
 }
 
 void Output::setRelative(float value, int i, int j)
 {
     set(value, i+offset.y(), j+offset.x());
+    if (mirror && (i+offset.y() != j+offset.x())) set(value, j+offset.x(), i+offset.y());
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+void Output::setRelative(const float *scores, int i, int j, int count)
+{
+    const int row = i+offset.y(), column = j+offset.x();
+    setRow(scores, row, column, count);
+    if (mirror)
+        for (int k=0; k<count; k++)
+            if (row != column+k)
+                set(scores[k], column+k, row);
+    if (!next.isNull()) next->setRelative(scores, i, j, count);
+}
+
+bool Output::triangular() const
+{
+    return mirror && (offset.x() == offset.y());
+}
+
+float Output::cutoff(int i)
+{
+    // Mirrored scores are set in another row, so they must be exact
+    if (mirror) return -std::numeric_limits<float>::max();
+    const float value = rowCutoff(i+offset.y());
+    return next.isNull() ? value : std::min(value, next->cutoff(i));
+}
+
+void Output::completeBlock()
+{
+    blockCompleted();
+    if (!next.isNull()) next->completeBlock();
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1003,20 +1625,54 @@ Output *Output::make(const File &file, const FileList &targetFiles, const FileLi
     return output;
 }
 
+static void readBand(BEE::MatrixReader *reader, int rows, Mat *band)
+{
+    *band = reader->read(rows);
+}
+
+static void setRows(Output *output, const Mat &band, int begin, int end)
+{
+    for (int i=begin; i<end; i++)
+        output->setRelative(band.ptr<float>(i), i, 0, band.cols);
+}
+
 void Output::reformat(const FileList &targetFiles, const FileList &queryFiles, const File &simmat, const File &output)
 {
     qDebug("Reformating %s to %s", qPrintable(simmat.flat()), qPrintable(output.flat()));
 
-    Mat m = BEE::readSimmat(simmat);
-
-    QSharedPointer<Output> o(Factory<Output>::make(output));
-    o->initialize(targetFiles, queryFiles);
+    BEE::MatrixReader reader(simmat, false);
+    if ((reader.rows != queryFiles.size()) || (reader.columns != targetFiles.size()))
+        qFatal("%s is %dx%d, expected %dx%d.", qPrintable(simmat.flat()), reader.rows, reader.columns, queryFiles.size(), targetFiles.size());
+
+    QScopedPointer<Output> o(Output::make(output, targetFiles, queryFiles));
+
+    // Each band of rows is one output block, its rows are set in parallel while the next band is read
+    const int bandRows = std::max(1, Globals->blockSize);
+    const int threads = std::max(1, Globals->parallelism);
+    Mat band = reader.read(bandRows), next;
+    for (int block=0; !band.empty(); block++) {
+        TaskGroup io(Parallel::IO);
+        io.run(&readBand, &reader, bandRows, &next);
+
+        o->setBlock(block, -1);
+        const int step = (band.rows + threads - 1) / threads;
+        TaskGroup tasks;
+        for (int begin=0; begin<band.rows; begin+=step)
+            tasks.run(&setRows, o.data(), band, begin, std::min(band.rows, begin+step));
+        tasks.wait();
+        o->completeBlock();
+
+        io.wait();
+        band = next;
+        next = Mat();
+    }
+}
 
-    const int rows = queryFiles.size();
-    const int columns = targetFiles.size();
-    for (int i=0; i<rows; i++)
-        for (int j=0; j<columns; j++)
-            o->setRelative(m.at<float>(i,i), i, j);
+/* Output - private methods */
+void Output::setRow(const float *scores, int i, int j, int count)
+{
+    for (int k=0; k<count; k++)
+        set(scores[k], i, j+k);
 }
 
 /* Output - protected methods */
@@ -1024,6 +1680,7 @@ void Output::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
     this->targetFiles = targetFiles;
     this->queryFiles = queryFiles;
+    mirror = false;
     selfSimilar = (queryFiles == targetFiles) && (targetFiles.size() > 1) && (queryFiles.size() > 1);
 }
 
@@ -1053,6 +1710,11 @@ void MatrixOutput::set(float value, int i, int j)
     data.at<float>(i,j) = value;
 }
 
+void MatrixOutput::setRow(const float *scores, int i, int j, int count)
+{
+    memcpy(data.ptr<float>(i) + j, scores, count * sizeof(float));
+}
+
 BR_REGISTER(Output, MatrixOutput)
 
 /* Gallery - public methods */
@@ -1089,27 +1751,51 @@ Gallery *Gallery::make(const File &file)
     return gallery;
 }
 
-static TemplateList Downsample(const TemplateList &templates, const Transform *transform)
+static bool Downsamples(const Transform *transform)
+{
+    return (transform->classes != std::numeric_limits<int>::max()) ||
+           (transform->instances != std::numeric_limits<int>::max()) ||
+           (transform->fraction < 1);
+}
+
+// Templates bucketed by label in one pass over the training data,
+// shared by the transforms downsampling the same templates
+struct DownsampleIndex
+{
+    int size;
+    QMap<int,int> counts, successes; // Templates per label, all of them or only those that didn't fail
+    QHash<int, QVector<int> > indices; // Templates per label that enrolled, in order
+
+    DownsampleIndex(const TemplateList &templates)
+        : size(templates.size())
+    {
+        for (int i=0; i<templates.size(); i++) {
+            const File &file = templates[i].file;
+            const int label = file.label();
+            counts[label]++;
+            if (!file.failed())
+                successes[label]++;
+            if (!file.get<bool>("FTE", false))
+                indices[label].append(i);
+        }
+    }
+};
+
+static TemplateList Downsample(const TemplateList &templates, const Transform *transform, const DownsampleIndex &index)
 {
     // Return early when no downsampling is required
-    if ((transform->classes == std::numeric_limits<int>::max()) &&
-        (transform->instances == std::numeric_limits<int>::max()) &&
-        (transform->fraction >= 1))
+    if (!Downsamples(transform))
         return templates;
 
     const bool atLeast = transform->instances < 0;
     const int instances = abs(transform->instances);
 
-    QList<int> allLabels = templates.labels<int>();
-    QList<int> uniqueLabels = allLabels.toSet().toList();
-    qSort(uniqueLabels);
-
-    QMap<int,int> counts = templates.labelCounts(instances != std::numeric_limits<int>::max());
+    QMap<int,int> counts = (instances != std::numeric_limits<int>::max()) ? index.successes : index.counts;
     if ((instances != std::numeric_limits<int>::max()) && (transform->classes != std::numeric_limits<int>::max()))
         foreach (int label, counts.keys())
             if (counts[label] < instances)
                 counts.remove(label);
-    uniqueLabels = counts.keys();
+    QList<int> uniqueLabels = counts.keys();
     if ((transform->classes != std::numeric_limits<int>::max()) && (uniqueLabels.size() < transform->classes))
         qWarning("Downsample requested %d classes but only %d are available.", transform->classes, uniqueLabels.size());
 
@@ -1122,16 +1808,11 @@ static TemplateList Downsample(const TemplateList &templates, const Transform *t
 
     TemplateList downsample;
     for (int i=0; i<selectedLabels.size(); i++) {
-        const int selectedLabel = selectedLabels[i];
-        QList<int> indices;
-        for (int j=0; j<allLabels.size(); j++)
-            if ((allLabels[j] == selectedLabel) && (!templates.value(j).file.get<bool>("FTE", false)))
-                indices.append(j);
-
+        QVector<int> indices = index.indices.value(selectedLabels[i]);
         std::random_shuffle(indices.begin(), indices.end());
         const int max = atLeast ? indices.size() : std::min(indices.size(), instances);
         for (int j=0; j<max; j++)
-            downsample.append(templates.value(indices[j]));
+            downsample.append(templates[indices[j]]);
     }
 
     if (transform->fraction < 1) {
@@ -1196,29 +1877,86 @@ private:
         while (transforms.size() < templatesList.size())
             transforms.append(transforms.first()->clone());
 
-        for (int i=0; i<templatesList.size(); i++)
-            templatesList[i] = Downsample(templatesList[i], transforms[i]);
+        // Lists holding a matrix of every template share their labels, so they share an index too
+        QSharedPointer<DownsampleIndex> index;
+        for (int i=0; i<templatesList.size(); i++) {
+            if (!Downsamples(transforms[i])) continue;
+            if (index.isNull() || (index->size != data.size()) || (templatesList[i].size() != data.size()))
+                index = QSharedPointer<DownsampleIndex>(new DownsampleIndex(templatesList[i]));
+            templatesList[i] = Downsample(templatesList[i], transforms[i], *index);
+        }
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<templatesList.size(); i++) {
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
-            else                                                          _train (transforms[i], &templatesList[i]);
+            if (Globals->parallelism) tasks.run(_train, transforms[i], &templatesList[i]);
+            else                                _train (transforms[i], &templatesList[i]);
         }
-        futures.waitForFinished();
+        tasks.wait();
+    }
+
+    static void _project(const Transform *transform, const TemplateList *src, TemplateList *dst)
+    {
+        transform->project(*src, *dst);
     }
 
     void project(const Template &src, Template &dst) const
     {
+        // Matrices sharing a transform are projected as one batch, and the batches run concurrently
+        const int batches = std::min(src.size(), transforms.size());
+        QVector<TemplateList> inputs(batches), outputs(batches);
+        for (int i=0; i<src.size(); i++)
+            inputs[i%batches].append(Template(src.file, src[i]));
+
+        if ((batches < 2) || (Globals->parallelism == 0)) {
+            for (int i=0; i<batches; i++)
+                _project(transforms[i], &inputs[i], &outputs[i]);
+        } else {
+            TaskGroup tasks;
+            for (int i=0; i<batches; i++)
+                tasks.run(_project, (const Transform*) transforms[i], &inputs[i], &outputs[i]);
+            tasks.wait();
+        }
+
         dst.file = src.file;
         QList<Mat> mats;
         for (int i=0; i<src.size(); i++) {
-            transforms[i%transforms.size()]->project(Template(src.file, src[i]), dst);
-            mats.append(dst);
-            dst.clear();
+            const TemplateList &output = outputs[i%batches];
+            if (output.size() != inputs[i%batches].size()) qFatal("Independent projection size mismatch.");
+            const Template &projected = output[i/batches];
+            dst.file.append(projected.file.localMetadata());
+            mats.append(projected.isEmpty() ? Mat() : projected.m());
         }
         dst.append(mats);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        // Single matrix templates all go to the first transform, so its own batched projection can be used
+        foreach (const Template &t, src)
+            if (t.size() != 1) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        TemplateList projected;
+        transforms.first()->project(src, projected);
+        if (projected.size() != src.size()) qFatal("Independent projection size mismatch.");
+        for (int i=0; i<projected.size(); i++) {
+            // Outputs that didn't start from the source file get the metadata project(Template) would have started them with
+            if (projected[i].file.name.isEmpty()) {
+                File file = src[i].file;
+                file.append(projected[i].file.localMetadata());
+                projected[i].file = file;
+            }
+        }
+        dst.append(projected);
+    }
+
+    int tileHalo() const
+    {
+        return transforms.first()->tileHalo();
+    }
+
     void store(QDataStream &stream) const
     {
         const int size = transforms.size();
@@ -1238,6 +1976,69 @@ private:
     }
 };
 
+/*!
+ * \brief Runs the project() calls of a thread-confined transform on the confined thread.
+ */
+class Confined : public MetaTransform
+{
+    Transform *transform;
+
+    struct ProjectTask : public Parallel::Task
+    {
+        const Transform *transform;
+        const Template *src;
+        Template *dst;
+        ProjectTask(const Transform *transform, const Template *src, Template *dst) : transform(transform), src(src), dst(dst) {}
+        void run() { transform->project(*src, *dst); }
+    };
+
+public:
+    /*!
+     * \brief Confined
+     * \param transform
+     */
+    Confined(Transform *transform)
+        : transform(transform)
+    {
+        transform->setParent(this);
+        file = transform->file;
+        trainable = transform->trainable;
+        setObjectName(transform->objectName());
+    }
+
+private:
+    Transform *clone() const
+    {
+        return new Confined(transform->clone());
+    }
+
+    void train(const TemplateList &data)
+    {
+        transform->train(data);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        ProjectTask task(transform, &src, &dst);
+        Parallel::confine(&task);
+    }
+
+    bool processesFailures() const
+    {
+        return transform->processesFailures();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
 /* Transform - public methods */
 Transform::Transform(bool _independent, bool _trainable)
 {
@@ -1248,6 +2049,25 @@ Transform::Transform(bool _independent, bool _trainable)
     fraction = 1;
 }
 
+// Descriptions are parsed once, algorithms construct the same plugins many times
+static File parseDescription(const QString &str)
+{
+    static const int Max_Parsed = 1024; // Descriptions built on the fly, like those of br_enroll_image_to_list calls, would otherwise accumulate
+    static QHash<QString,File> parsed;
+    static QMutex parsedLock;
+
+    QMutexLocker locker(&parsedLock);
+    QHash<QString,File>::const_iterator it = parsed.constFind(str);
+    if (it != parsed.constEnd()) return it.value();
+    locker.unlock();
+
+    const File file = "." + str;
+    locker.relock();
+    if (parsed.size() >= Max_Parsed) parsed.clear();
+    parsed.insert(str, file);
+    return file;
+}
+
 Transform *Transform::make(QString str, QObject *parent)
 {
     // Check for custom transforms
@@ -1282,18 +2102,37 @@ Transform *Transform::make(QString str, QObject *parent)
     if (str.startsWith('(') && str.endsWith(')'))
         return make(str.mid(1, str.size()-2), parent);
 
-    File f = "." + str;
-    Transform *transform = Factory<Transform>::make(f);
+    Transform *transform = Factory<Transform>::make(parseDescription(str));
 
-    if (transform->independent)
+    const bool independent = transform->independent;
+    if (transform->threadConfined())
+        transform = new Confined(transform);
+    if (independent)
         transform = new Independent(transform);
     transform->setParent(parent);
     return transform;
 }
 
+/* Transform - private methods */
+void Transform::profiledProject(const Template &src, Template &dst) const
+{
+    Trace::Scope span("transform", objectName());
+    QElapsedTimer timer; timer.start();
+    project(src, dst);
+    if (Globals->profile) Globals->addProfile(objectName(), timer.nsecsElapsed(), dst.bytes(), 1);
+}
+
+void Transform::profiledProject(const TemplateList &src, TemplateList &dst) const
+{
+    Trace::Scope span("transform", objectName());
+    QElapsedTimer timer; timer.start();
+    project(src, dst);
+    if (Globals->profile) Globals->addProfile(objectName(), timer.nsecsElapsed(), dst.bytes<size_t>(), dst.size());
+}
+
 Transform *Transform::clone() const
 {
-    Transform *clone = Factory<Transform>::make(file.flat());
+    Transform *clone = Factory<Transform>::copy(this);
     clone->classes = classes;
     clone->instances = instances;
     clone->fraction = fraction;
@@ -1318,9 +2157,8 @@ void Transform::project(const TemplateList &src, TemplateList &dst) const
 
     // There are certain conditions where we should process the templates in serial,
     // but generally we'd prefer to process them in parallel.
-    if ((src.size() < 2) ||
-        (QThreadPool::globalInstance()->activeThreadCount() >= QThreadPool::globalInstance()->maxThreadCount()) ||
-        (Globals->parallelism == 0)) {
+    // Nested calls are safe because a waiting TaskGroup executes queued tasks itself.
+    if ((src.size() < 2) || (Globals->parallelism == 0)) {
 
         foreach (const Template &t, src) {
             dst.append(Template());
@@ -1329,10 +2167,10 @@ void Transform::project(const TemplateList &src, TemplateList &dst) const
     } else {
         for (int i=0; i<src.size(); i++)
             dst.append(Template());
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<dst.size(); i++)
-            futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
-        futures.waitForFinished();
+            tasks.run(_project, this, &src[i], &dst[i]);
+        tasks.wait();
     }
 }
 
@@ -1352,14 +2190,17 @@ void Transform::backProject(const TemplateList &dst, TemplateList &src) const
     src.reserve(dst.size());
     for (int i=0; i<dst.size(); i++) src.append(Template());
 
-    QFutureSynchronizer<void> futures;
+    TaskGroup tasks;
     for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(_backProject, this, &dst[i], &src[i]));
-        else                                                          _backProject (this, &dst[i], &src[i]);
-    futures.waitForFinished();
+        if (Globals->parallelism) tasks.run(_backProject, this, &dst[i], &src[i]);
+        else                                _backProject (this, &dst[i], &src[i]);
+    tasks.wait();
 }
 
 /* Distance - public methods */
+// Conservative estimate of the per-core cache available to hold the templates of a tile
+static const size_t TileBytes = 256*1024;
+
 Distance *Distance::make(QString str, QObject *parent)
 {
     // Check for custom transforms
@@ -1372,42 +2213,223 @@ Distance *Distance::make(QString str, QObject *parent)
             return make("Pipe([" + words.join(",") + "])", parent);
     }
 
-    File f = "." + str;
-    Distance *distance = Factory<Distance>::make(f);
+    Distance *distance = Factory<Distance>::make(parseDescription(str));
 
     distance->setParent(parent);
     return distance;
 }
 
+// Excludes the pairs with a failed template, ahead of the distance's own filter
+struct FailureFilter : public TargetFilter
+{
+    QVector<uchar> failed;
+    QSharedPointer<TargetFilter> next;
+
+    void admit(const Template &query, int offset, int count, uchar *keep) const
+    {
+        if (query.file.failed()) {
+            std::fill(keep, keep+count, 0);
+            return;
+        }
+        for (int i=0; i<count; i++)
+            keep[i] &= !failed[offset+i];
+        if (next) next->admit(query, offset, count, keep);
+    }
+};
+
+static QSharedPointer<TargetFilter> excludeFailures(const Distance *distance, const TemplateList &target, const TemplateList &query, const QSharedPointer<TargetFilter> &filter)
+{
+    bool any = false;
+    foreach (const Template &t, query)
+        if (t.file.failed()) {
+            any = true;
+            break;
+        }
+
+    QVector<uchar> failed(target.size());
+    for (int i=0; i<target.size(); i++) {
+        failed[i] = target[i].file.failed();
+        any = any || failed[i];
+    }
+    if (!any) return filter;
+
+    QSharedPointer<FailureFilter> failureFilter(new FailureFilter());
+    failureFilter->failed = failed;
+    failureFilter->next = filter;
+    failureFilter->scorer = filter ? filter->scorer : distance;
+    return failureFilter;
+}
+
 void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
 {
-    const bool stepTarget = target.size() > query.size();
-    const int totalSize = std::max(target.size(), query.size());
-    int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<totalSize; i+=stepSize) {
-        const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
-        const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
-        const int targetOffset = stepTarget ? i : 0;
-        const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+    if (target.isEmpty() || query.isEmpty()) return;
+
+    // Walk the comparison in (query tile x target tile) blocks sized so that both tiles
+    // remain in cache while every pair between them is compared.
+    const int threads = std::max(1, abs(Globals->parallelism));
+    int targetTileSize = tileSize(target, TileBytes/2);
+    int queryTileSize = tileSize(query, TileBytes/8);
+
+    // Shrink the tiles until there are enough of them to keep every thread busy
+    while (((targetTileSize > 1) || (queryTileSize > 1)) &&
+           (ceil(float(target.size())/targetTileSize) * ceil(float(query.size())/queryTileSize) < 4*threads)) {
+        if (targetTileSize >= queryTileSize) targetTileSize = (targetTileSize+1)/2;
+        else                                 queryTileSize = (queryTileSize+1)/2;
+    }
+
+    // Metadata filters are indexed once for the whole target gallery,
+    // and pairs with a failed template are excluded without being scored
+    const QSharedPointer<TargetFilter> filter = excludeFailures(this, target, query, prefilter(target));
+
+    // Tiles below the diagonal of a mirrored self-comparison are filled in from the tiles above it
+    const bool triangular = output->triangular() && (target.size() == query.size());
+
+    TaskGroup tasks;
+    for (int i=0; i<query.size(); i+=queryTileSize) {
+        for (int j=0; j<target.size(); j+=targetTileSize) {
+            const QRect tile(j, i, std::min(targetTileSize, target.size()-j), std::min(queryTileSize, query.size()-i));
+            if (triangular && (tile.right() < tile.top())) continue;
+            if (target.alignedData && !target.packedData) tasks.setNode(target.alignedData->node(target[j].m().data)); // Compare the targets where they reside
+            if (target.packedData) {
+                if (Globals->parallelism) tasks.run(this, &Distance::comparePacked, target, query, output, tile, (const TargetFilter*)filter.data());
+                else                                                 comparePacked (target, query, output, tile, filter.data());
+            } else if (triangular && (tile.left() < tile.bottom())) {
+                if (Globals->parallelism) tasks.run(this, &Distance::compareTriangle, target, query, output, tile, (const TargetFilter*)filter.data());
+                else                                                 compareTriangle (target, query, output, tile, filter.data());
+            } else {
+                if (Globals->parallelism) tasks.run(this, &Distance::compareBlock, target, query, output, tile, (const TargetFilter*)filter.data());
+                else                                                 compareBlock (target, query, output, tile, filter.data());
+            }
+        }
     }
-    futures.waitForFinished();
+    tasks.wait();
 }
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
 {
-    QList<float> scores; scores.reserve(targets.size());
-    foreach (const Template &target, targets)
-        scores.append(compare(target, query));
-    return scores;
+    QElapsedTimer timer; timer.start();
+    QVector<float> scores(targets.size());
+    const QSharedPointer<TargetFilter> filter = prefilter(targets);
+    if (filter) filter->compareBatch(targets, query, scores.data(), 0, targets.size());
+    else        compareBatch(targets, query, scores.data(), 0, targets.size());
+    if (Globals->profile) Globals->addProfile(objectName(), timer.nsecsElapsed(), 0, scores.size());
+    return scores.toList();
+}
+
+void Distance::compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+{
+    for (int i=0; i<count; i++)
+        scores[i] = compare(targets[offset+i], query);
+}
+
+/* TargetFilter - public methods */
+void TargetFilter::compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+{
+    QVector<uchar> keep(count, 1);
+    admit(query, offset, count, keep.data());
+
+    int i = 0;
+    while (i < count) {
+        if (!keep[i]) {
+            scores[i++] = -std::numeric_limits<float>::max();
+            continue;
+        }
+
+        int j = i;
+        while ((j < count) && keep[j]) j++;
+        if (scorer) scorer->compareBatchBounded(targets, query, scores+i, offset+i, j-i, lower, upper);
+        else        std::fill(scores+i, scores+j, 0.f);
+        i = j;
+    }
+}
+
+/* Distance - protected methods */
+const uchar *Distance::contiguousData(const TemplateList &targets, const Template &query, int offset, size_t *stride)
+{
+    if (!targets.uniform || (offset >= targets.size()) || (query.size() != 1))
+        return NULL;
+
+    const Mat &t = targets[offset].m();
+    const Mat &q = query.m();
+    if (!t.data || !q.data || !q.isContinuous() || (t.type() != q.type()) || (t.total() != q.total()))
+        return NULL;
+
+    // Uniform galleries may pad each template, e.g. to keep mapped payloads aligned
+    *stride = (offset+1 < targets.size()) ? size_t(targets[offset+1].m().data - t.data) : t.total() * t.elemSize();
+    return t.data;
+}
+
+void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const
+{
+    QVector<float> scores(tile.width());
+    for (int i=tile.y(); i<tile.y()+tile.height(); i++) {
+        // Scores the output would discard needn't be exact
+        const float lower = output->cutoff(i);
+        if (filter) filter->compareBatch(target, query[i], scores.data(), tile.x(), tile.width(), lower);
+        else        compareBatchBounded(target, query[i], scores.data(), tile.x(), tile.width(), lower, std::numeric_limits<float>::max());
+        output->setRelative(scores.data(), i, tile.x(), tile.width());
+    }
 }
 
 /* Distance - private methods */
-void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+int Distance::tileSize(const TemplateList &templates, size_t bytes)
+{
+    const size_t templateBytes = std::max(size_t(1), templates.packedData ? templates.packedData->bytes() : templates.first().bytes());
+    return std::max(1, std::min(templates.size(), int(bytes / templateBytes)));
+}
+
+// Decoded tiles of packed targets, reused by each thread
+static ThreadLocal<Mat> PackedTiles;
+
+void Distance::comparePacked(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const
+{
+    const PackedData &packed = *target.packedData;
+    const size_t bytes = packed.bytes();
+    Mat &buffer = PackedTiles.local();
+    if (buffer.total() < bytes * tile.width())
+        buffer.create(1, int(bytes * tile.width()), CV_8UC1);
+    packed.decode(tile.x(), tile.width(), buffer.data);
+
+    TemplateList decoded;
+    decoded.reserve(tile.width());
+    for (int j=0; j<tile.width(); j++)
+        decoded.append(Template(target[tile.x()+j].file, Mat(packed.rows, packed.cols, packed.type, buffer.data + j*bytes)));
+    decoded.uniform = true;
+
+    // Filters index the whole target list, scorers see only the decoded tile
+    const Distance *scorer = filter ? filter->scorer : this;
+    QVector<float> scores(tile.width());
+    QVector<uchar> keep(tile.width());
+    for (int i=tile.y(); i<tile.y()+tile.height(); i++) {
+        const float lower = output->cutoff(i);
+        const float upper = std::numeric_limits<float>::max();
+        if (filter) {
+            std::fill(keep.begin(), keep.end(), uchar(1));
+            filter->admit(query[i], tile.x(), tile.width(), keep.data());
+            int j = 0;
+            while (j < tile.width()) {
+                if (!keep[j]) {
+                    scores[j++] = -std::numeric_limits<float>::max();
+                    continue;
+                }
+                int k = j;
+                while ((k < tile.width()) && keep[k]) k++;
+                if (scorer) scorer->compareBatchBounded(decoded, query[i], scores.data()+j, j, k-j, lower, upper);
+                else        std::fill(scores.data()+j, scores.data()+k, 0.f);
+                j = k;
+            }
+        } else {
+            compareBatchBounded(decoded, query[i], scores.data(), 0, tile.width(), lower, upper);
+        }
+        output->setRelative(scores.data(), i, tile.x(), tile.width());
+    }
+}
+
+void Distance::compareTriangle(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const
 {
-    for (int i=0; i<query.size(); i++)
-        for (int j=0; j<target.size(); j++)
-            output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    for (int i=tile.top(); i<=tile.bottom(); i++) {
+        const int left = std::max(tile.left(), i);
+        if (left <= tile.right())
+            compareBlock(target, query, output, QRect(left, i, tile.right()+1-left, 1), filter);
+    }
 }
@@ -17,6 +17,7 @@
 #ifndef __OPENBR_PLUGIN_H
 #define __OPENBR_PLUGIN_H
 
+#include <QAtomicInt>
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
@@ -26,9 +27,12 @@
 #include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QPoint>
 #include <QPointF>
+#include <QRect>
 #include <QRectF>
+#include <QReadWriteLock>
 #include <QScopedPointer>
 #include <QSharedPointer>
 #include <QString>
@@ -37,6 +41,7 @@
 #include <QTime>
 #include <QVariant>
 #include <QVector>
+#include <limits>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr.h>
 
@@ -200,8 +205,8 @@ struct BR_EXPORT File
     template <typename T>
     T get(const QString &key) const
     {
-        if (!contains(key)) qFatal("Missing key: %s", qPrintable(key));
-        QVariant variant = value(key);
+        QVariant variant;
+        if (!lookup(key, variant)) qFatal("Missing key: %s", qPrintable(key));
         if (!variant.canConvert<T>()) qFatal("Can't convert: %s", qPrintable(key));
         return variant.value<T>();
     }
@@ -213,8 +218,8 @@ struct BR_EXPORT File
     template <typename T>
     T get(const QString &key, const T &defaultValue) const
     {
-        if (!contains(key)) return defaultValue;
-        QVariant variant = value(key);
+        QVariant variant;
+        if (!lookup(key, variant)) return defaultValue;
         if (!variant.canConvert<T>()) return defaultValue;
         return variant.value<T>();
     }
@@ -229,14 +234,14 @@ struct BR_EXPORT File
     QList<QPointF> points() const; /*!< \brief Returns the file's points list. */
     void appendPoint(const QPointF &point); /*!< \brief Adds a point to the file's point list. */
     void appendPoints(const QList<QPointF> &points); /*!< \brief Adds landmarks to the file's landmark list. */
-    inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); } /*!< \brief Clears the file's landmark list. */
+    inline void clearPoints() { m_metadata[QStringLiteral("Points")] = QList<QVariant>(); } /*!< \brief Clears the file's landmark list. */
     inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); } /*!< \brief Overwrites the file's landmark list. */
 
     QList<QRectF> namedRects() const; /*!< \brief Returns rects convertible from metadata values. */
     QList<QRectF> rects() const; /*!< \brief Returns the file's rects list. */
     void appendRect(const QRectF &rect); /*!< \brief Adds a rect to the file's rect list. */
     void appendRects(const QList<QRectF> &rects); /*!< \brief Adds rects to the file's rect list. */
-    inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); } /*!< \brief Clears the file's rect list. */
+    inline void clearRects() { m_metadata[QStringLiteral("Rects")] = QList<QVariant>(); } /*!< \brief Clears the file's rect list. */
     inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
 
 private:
@@ -245,6 +250,7 @@ private:
     BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, File &file);
 
     void init(const QString &file);
+    bool lookup(const QString &key, QVariant &value) const; /*!< \brief Resolves \em key with a single search of the metadata, then the global properties. */
     QString toString(const QVariant &variant) const;
     void fromString(const QString &key, const QString &value);
 };
@@ -271,6 +277,8 @@ struct BR_EXPORT FileList : public QList<File>
     QList<float> labels() const; /*!< \brief Returns br::File::label() for each file in the list. */
     QList<int> crossValidationPartitions() const; /*!< \brief Returns the cross-validation partition (default=0) for each file in the list. */
     int failures() const; /*!< \brief Returns the number of files with br::File::failed(). */
+
+    static FileList fromGallery(const File &gallery); /*!< \brief Create a file list from a br::Gallery without reading template data where the gallery supports it. */
 };
 
 /*!
@@ -337,6 +345,10 @@ BR_EXPORT QDataStream &operator<<(QDataStream &stream, const Template &t);
  */
 BR_EXPORT QDataStream &operator>>(QDataStream &stream, Template &t);
 
+struct AlignedData;
+struct MemoryLedger;
+struct PackedData;
+
 /*!
  * \brief A list of templates.
  *
@@ -344,14 +356,16 @@ BR_EXPORT QDataStream &operator>>(QDataStream &stream, Template &t);
  */
 struct TemplateList : public QList<Template>
 {
-    bool uniform; /*!< \brief Reserved for internal use. True if all templates are aligned and of the same size and type. */
-    QVector<uchar> alignedData; /*!< \brief Reserved for internal use. */
+    bool uniform; /*!< \brief Reserved for internal use. True if all templates are aligned, of the same size and type, and stored at a constant stride. */
+    QSharedPointer<AlignedData> alignedData; /*!< \brief Reserved for internal use. */
+    QSharedPointer<PackedData> packedData; /*!< \brief Reserved for internal use. The compressed matrices of templates whose own matrices are empty, see br::PackedData. */
 
     TemplateList() : uniform(false) {}
     TemplateList(const QList<Template> &templates) : uniform(false) { append(templates); } /*!< \brief Initialize the template list from another template list. */
     TemplateList(const QList<File> &files) : uniform(false) { foreach (const File &file, files) append(file); } /*!< \brief Initialize the template list from a file list. */
     BR_EXPORT static TemplateList fromGallery(const File &gallery); /*!< \brief Create a template list from a br::Gallery. */
     BR_EXPORT static TemplateList relabel(const TemplateList &tl); /*!< \brief Ensure labels are in the range [0,numClasses-1]. */
+    BR_EXPORT void align(); /*!< \brief Copy single matrix templates into #alignedData at a constant stride and set #uniform. */
 
     /*!
      * \brief Returns the total number of bytes in all the templates.
@@ -412,6 +426,18 @@ struct TemplateList : public QList<Template>
         return labelCounts;
     }
 
+    /*!
+     * \brief Returns the templates that haven't failed (see br::File::failed()), for training.
+     */
+    TemplateList unfailed() const
+    {
+        TemplateList unfailed; unfailed.reserve(size());
+        foreach (const Template &t, *this)
+            if (!t.file.failed())
+                unfailed.append(t);
+        return unfailed;
+    }
+
     /*!
      * \brief Merge all the templates together.
      */
@@ -455,6 +481,8 @@ private:
     template <typename T> friend struct Factory;
     friend class Context;
     void init(const File &file); /*!< \brief Initializes the plugin's properties from the file's metadata. */
+    void copy(const Object &prototype); /*!< \brief Initializes the plugin's properties from those of \em prototype, see br::Factory::copy(). */
+    static bool isPluginType(const QString &type); /*!< \brief \c true if properties of \em type hold child transforms or distances. */
 };
 
 /*!
@@ -473,6 +501,9 @@ class BR_EXPORT Context : public Object
     QFile logFile;
 
 public:
+    Context();
+    ~Context();
+
     /*!
      * \brief Path to <tt>share/openbr/openbr.bib</tt>
      */
@@ -503,12 +534,110 @@ public:
     Q_PROPERTY(int parallelism READ get_parallelism WRITE set_parallelism RESET reset_parallelism)
     BR_PROPERTY(int, parallelism, std::max(1, QThread::idealThreadCount()))
 
+    /*!
+     * \brief Pin worker threads to NUMA nodes and split aligned galleries across them, read when the first task is scheduled.
+     *
+     * Each node's workers then compare the targets held in that node's memory.
+     */
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa)
+    BR_PROPERTY(bool, numa, false)
+
+    /*!
+     * \brief The number of threads reading images and galleries, read when the first read is scheduled.
+     *
+     * These threads spend most of their time blocked on disk or network, so they are counted separately from #parallelism.
+     */
+    Q_PROPERTY(int ioThreads READ get_ioThreads WRITE set_ioThreads RESET reset_ioThreads)
+    BR_PROPERTY(int, ioThreads, 4)
+
+    /*!
+     * \brief The br::Parallel::Priority class of the tasks this context submits, \c 1 (default) is br::Parallel::Normal.
+     *
+     * Interactive tasks are taken before any other work once a worker finishes its current task,
+     * so a verification submitted during bulk enrollment waits for at most one block.
+     */
+    Q_PROPERTY(int priority READ get_priority WRITE set_priority RESET reset_priority)
+    BR_PROPERTY(int, priority, 1)
+
+    /*!
+     * \brief Milliseconds after submission by which the tasks of this context should start, \c 0 (default) for no deadline.
+     *
+     * Within a priority class, queued tasks with the earliest deadline start first and tasks without one start last.
+     */
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline)
+    BR_PROPERTY(int, deadline, 0)
+
+    /*!
+     * \brief Most workers that may start tasks of this context's priority class at once, \c 0 (default) is unbounded.
+     *
+     * Caps background jobs so they can't occupy every worker.
+     * A task waiting on a nested br::TaskGroup runs the nested tasks of its class without counting them again, so it always makes progress.
+     */
+    Q_PROPERTY(int concurrency READ get_concurrency WRITE set_concurrency RESET reset_concurrency)
+    BR_PROPERTY(int, concurrency, 0)
+
     /*!
      * \brief The maximum number of templates to process in parallel.
      */
     Q_PROPERTY(int blockSize READ get_blockSize WRITE set_blockSize RESET reset_blockSize)
     BR_PROPERTY(int, blockSize, parallelism * ((sizeof(void*) == 4) ? 128 : 1024))
 
+    /*!
+     * \brief Megabytes of target templates to keep in memory across query blocks during comparison, \c 0 disables caching.
+     */
+    Q_PROPERTY(int targetCache READ get_targetCache WRITE set_targetCache RESET reset_targetCache)
+    BR_PROPERTY(int, targetCache, (sizeof(void*) == 4) ? 256 : 2048)
+
+    /*!
+     * \brief Megabytes of target and query templates comparison may hold in memory at once, \c 0 (default) uses #blockSize as is.
+     *
+     * When set, each comparison derives its block size from the average template size of its galleries,
+     * so small templates are compared in large blocks and large templates in blocks that fit.
+     */
+    Q_PROPERTY(int memoryBudget READ get_memoryBudget WRITE set_memoryBudget RESET reset_memoryBudget)
+    BR_PROPERTY(int, memoryBudget, 0)
+
+    /*!
+     * \brief Megabytes of templates this context may hold in memory at once, \c 0 (default) is unbounded.
+     *
+     * Matrices deserialized from galleries and read by TemplateList::fromGallery(), gallery chunks held by memGallery,
+     * matrices held by br::CacheTransform and score matrices evaluated by br::Evaluate() are charged to the limit,
+     * and what doesn't fit is spilled to mapped temporary files instead of growing the process.
+     */
+    Q_PROPERTY(int memoryLimit READ get_memoryLimit WRITE set_memoryLimit RESET reset_memoryLimit)
+    BR_PROPERTY(int, memoryLimit, 0)
+
+    /*!
+     * \brief Log of templates projected through the untrainable leading transforms of each br::PipeTransform, empty (default) disables caching.
+     */
+    Q_PROPERTY(QString prefixCache READ get_prefixCache WRITE set_prefixCache RESET reset_prefixCache)
+    BR_PROPERTY(QString, prefixCache, "")
+
+    /*!
+     * \brief Local directory keeping a copy of every object fetched over the network, empty (default) disables caching.
+     *
+     * Images and gallery byte ranges are read from the copy on later runs instead of being fetched again, see br::Network::get().
+     * Byte ranges are kept per version of their object, identified by its \c ETag or \c Last-Modified header, and aren't cached for objects with neither.
+     */
+    Q_PROPERTY(QString networkCache READ get_networkCache WRITE set_networkCache RESET reset_networkCache)
+    BR_PROPERTY(QString, networkCache, "")
+
+    /*!
+     * \brief Directory of per-stage training checkpoints written by br::PipeTransform, empty (default) disables checkpointing.
+     *
+     * Each trained stage is stored under a key of its description, the descriptions of the stages before it and a digest of the training files,
+     * and a later run training the same pipeline on the same files loads it instead of training it again.
+     * Pipes nested in other transforms also digest the projected matrices they are given.
+     */
+    Q_PROPERTY(QString checkpoints READ get_checkpoints WRITE set_checkpoints RESET reset_checkpoints)
+    BR_PROPERTY(QString, checkpoints, "")
+
+    /*!
+     * \brief true to also checkpoint the projected training data each trainable stage is given, see #checkpoints.
+     */
+    Q_PROPERTY(bool checkpointData READ get_checkpointData WRITE set_checkpointData RESET reset_checkpointData)
+    BR_PROPERTY(bool, checkpointData, false)
+
     /*!
      * \brief true if backProject should be used instead of project (the algorithm should be inverted)
      */
@@ -578,6 +707,33 @@ public:
     Q_PROPERTY(int crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate)
     BR_PROPERTY(int, crossValidate, 0)
 
+    /*!
+     * \brief If \c true call counts, wall time and output sizes are recorded for every transform and distance, \c false by default.
+     * \see profileReport
+     */
+    Q_PROPERTY(bool profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(bool, profile, false)
+
+    /*!
+     * \brief Chrome trace-event JSON file of every transform, stream stage, barrier wait, gallery I/O and output block, written by finalize(), empty (default) disables tracing.
+     * \see br::Trace
+     */
+    Q_PROPERTY(QString trace READ get_trace WRITE set_trace RESET reset_trace)
+    BR_PROPERTY(QString, trace, "")
+
+    /*!
+     * \brief If \c true transforms draw their output matrices from per-thread buffer caches, \c false by default.
+     * \see br::MatArena
+     */
+    Q_PROPERTY(bool arena READ get_arena WRITE set_arena RESET reset_arena)
+    BR_PROPERTY(bool, arena, false)
+
+    /*!
+     * \brief zlib level used when storing models, \c 0 by default to store them uncompressed so they can be memory mapped when loaded.
+     */
+    Q_PROPERTY(int modelCompression READ get_modelCompression WRITE set_modelCompression RESET reset_modelCompression)
+    BR_PROPERTY(int, modelCompression, 0)
+
     QHash<QString,QString> abbreviations; /*!< \brief Used by br::Transform::make() to expand abbreviated algorithms into their complete definitions. */
     QHash<QString,int> classes; /*!< \brief Used by classifiers to associate text class labels with unique integers IDs. */
     QTime startTime; /*!< \brief Used to estimate timeRemaining(). */
@@ -588,6 +744,15 @@ public:
      */
     int blocks(int size) const;
 
+    /*!
+     * \brief Returns a new context for an independent job, starting from the properties, abbreviations and classes of this one.
+     *
+     * Make it current with br::ContextScope so the job's progress and settings don't interfere with other jobs.
+     * The caller takes ownership.
+     * \see br::ContextScope
+     */
+    Context *fork() const;
+
     /*!
      * \brief Returns true if \em name is queryable using <a href="http://doc.qt.digia.com/qt/qobject.html#property">QObject::property</a>
      * \param name The property key to check for existance.
@@ -602,6 +767,23 @@ public:
      */
     void printStatus();
 
+    /*!
+     * \brief Accumulates a profiling sample, used internally when #profile is enabled.
+     *
+     * Latencies reach the \c br_stage_seconds metric once per #blockSize samples of a stage, or when profileReport() is called.
+     * \param name The transform or distance that was called.
+     * \param nsecs Wall time of the call, including any nested calls.
+     * \param bytes Bytes of matrix data in the output.
+     * \param templates Number of output templates or scores.
+     */
+    void addProfile(const QString &name, qint64 nsecs, size_t bytes, int templates);
+
+    /*!
+     * \brief Returns a CSV table of the samples recorded while #profile was enabled, sorted by total time.
+     * \see profile
+     */
+    QString profileReport() const;
+
     /*!
      * \brief Returns the completion percentage of a call to br::Train(), br::Enroll() or br::Compare().
      * \return float Fraction completed.
@@ -610,6 +792,17 @@ public:
      */
     float progress() const;
 
+    /*!
+     * \brief Asks the br::Train(), br::Enroll() or br::Compare() running under this context to stop at its next block.
+     * \see cancelled br::Job
+     */
+    void cancel();
+
+    /*!
+     * \brief Returns \c true once cancel() has been called.
+     */
+    bool cancelled() const;
+
     /*!
      * \brief Set a global property.
      * \param key Global property key.
@@ -686,6 +879,12 @@ public:
      */
     static void finalize();
 
+    /*!
+     * \brief Runs the deferred br::Initializer::startup() of any initializer listing \em plugin, called by br::Factory::make().
+     * \see br::Initializer::plugins
+     */
+    static void startup(const QString &plugin);
+
     /*!
      * \brief Returns a string with the name, version, and copyright of the project.
      * \return A string suitable for printing to the terminal or displaying in a dialog box.
@@ -709,15 +908,64 @@ public:
     static QString scratchPath();
 
 private:
+    QAtomicInt cancelFlag;
+    MemoryLedger *memoryLedger;
+    friend struct MemoryLedger;
     static void messageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg);
 };
 
+/*!
+ * \brief Resolves br::Globals to the context of the calling thread's job.
+ *
+ * Threads default to the process context allocated by Context::initialize().
+ * br::ContextScope installs a job context for the calling thread,
+ * and work submitted to a br::TaskGroup runs under the context of the thread that submitted it.
+ */
+class BR_EXPORT ContextPointer
+{
+    Context *processContext;
+
+public:
+    ContextPointer() : processContext(NULL) {}
+    ContextPointer &operator=(Context *context) { processContext = context; return *this; } /*!< \brief Set the process context. */
+    Context *operator->() const { return current(); }
+    operator Context*() const { return current(); }
+
+    Context *current() const; /*!< \brief The job context of the calling thread, otherwise the process context. */
+    Context *process() const { return processContext; } /*!< \brief The process context. */
+    static Context *job(); /*!< \brief The job context of the calling thread, \c NULL if there isn't one. */
+};
+
 /*!
  * \brief The globally available settings.
  *
  * Initialized by Context::initialize() and destroyed with Context::finalize().
  */
-BR_EXPORT extern Context *Globals;
+BR_EXPORT extern ContextPointer Globals;
+
+/*!
+ * \brief Makes a job context current for the calling thread until the scope ends.
+ *
+ * \code
+ * QScopedPointer<br::Context> job(br::Globals->fork());
+ * job->blockSize = 256;
+ * br::ContextScope scope(job.data());
+ * br::Enroll(input, gallery); // Progress is tracked in job, not the process context
+ * \endcode
+ * Scopes nest, and a \c NULL context restores the process context.
+ * \see br::Context::fork
+ */
+class BR_EXPORT ContextScope
+{
+    Context *previous;
+
+public:
+    explicit ContextScope(Context *context);
+    ~ContextScope();
+
+private:
+    Q_DISABLE_COPY(ContextScope)
+};
 
 /*!
  * \brief For run time construction of objects from strings.
@@ -737,18 +985,33 @@ struct Factory
      */
     static T *make(const File &file)
     {
-        QString name = file.suffix();
-        if (!names().contains(name)) {
-            if      (names().contains("Empty") && name.isEmpty()) name = "Empty";
-            else if (names().contains("Default"))                 name = "Default";
-            else    qFatal("%s registry does not contain object named: %s", qPrintable(baseClassName()), qPrintable(name));
-        }
-        if (registry->contains("_"+name)) name.prepend('_'); // Hook to override with "native" implementation
+        const QString name = resolve(file);
+        Context::startup(name);
         T *object = registry->value(name)->_make();
         object->init(file);
         return object;
     }
 
+    /*!
+     * \brief Constructs a plugin configured like \em prototype.
+     *
+     * Configuration properties, those with \c STORED \c false, are copied directly and child plugins are copied recursively,
+     * instead of reparsing the prototype's description. Other stored properties are trained state and aren't copied,
+     * like the clone of a parsed description they hold their defaults or the values the description gives them.
+     * Falls back to make() if \em prototype isn't the plugin its file names.
+     */
+    static T *copy(const T *prototype)
+    {
+        const QString name = resolve(prototype->file);
+        T *object = registry->value(name)->_make();
+        if (qstrcmp(object->metaObject()->className(), prototype->metaObject()->className())) {
+            delete object;
+            return make(prototype->file.flat());
+        }
+        object->copy(*prototype);
+        return object;
+    }
+
     /*!
      * \brief Constructs all the available plugins.
      */
@@ -798,6 +1061,18 @@ private:
 
     static QString baseClassName() { return QString(T::staticMetaObject.className()).remove("br::"); }
     virtual T *_make() const = 0;
+
+    static QString resolve(const File &file)
+    {
+        QString name = file.suffix();
+        if (!names().contains(name)) {
+            if      (names().contains("Empty") && name.isEmpty()) name = "Empty";
+            else if (names().contains("Default"))                 name = "Default";
+            else    qFatal("%s registry does not contain object named: %s", qPrintable(baseClassName()), qPrintable(name));
+        }
+        if (registry->contains("_"+name)) name.prepend('_'); // Hook to override with "native" implementation
+        return name;
+    }
 };
 
 template <class T> QMap<QString, Factory<T>*>* Factory<T>::registry = 0;
@@ -831,6 +1106,9 @@ br::FactoryInstance<br::ABSTRACTION, IMPLEMENTATION>;
 /*!
  * \ingroup initializers
  * \brief Plugin base class for initializing resources.
+ *
+ * Expensive initialization, like starting a vendor SDK, belongs in startup().
+ * It is deferred until one of plugins() is first made so applications that never use them don't pay for it.
  */
 class BR_EXPORT Initializer : public Object
 {
@@ -840,6 +1118,9 @@ public:
     virtual ~Initializer() {}
     virtual void initialize() const = 0;  /*!< \brief Called once at the end of br::Context::initialize(). */
     virtual void finalize() const {}  /*!< \brief Called once at the beginning of br::Context::finalize(). */
+    virtual QStringList plugins() const { return QStringList(); } /*!< \brief Names of the plugins requiring startup(), if empty startup() is called right after initialize(). */
+    virtual void startup() const {} /*!< \brief Called once when the first of plugins() is made. */
+    virtual void shutdown() const {} /*!< \brief Called before finalize() if startup() was called. */
 };
 
 /*!
@@ -865,11 +1146,15 @@ public:
     bool selfSimilar; /*!< \brief \c true if the \em targetFiles == \em queryFiles, \c false otherwise. */
 
     virtual ~Output() {}
-    void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
+    void setBlock(int rowBlock, int columnBlock, bool mirror = false); /*!< \brief Set the current block, if \em mirror setRelative() also sets the transposed score of a symmetric self-comparison. */
     void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    void setRelative(const float *scores, int i, int j, int count); /*!< \brief Set the \em count consecutive scores of row \em i starting at column \em j relative to the current block, each chained output receives the row once. */
+    bool triangular() const; /*!< \brief \c true if only the scores on and above the diagonal of the current block need be set because the rest are mirrored. */
+    float cutoff(int i); /*!< \brief Scores of row \em i relative to the current block below this value can't change any chained output, see br::Distance::compareBatchBounded(). */
+    void completeBlock(); /*!< \brief Called once every score of the current block has been set. */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
-    static void reformat(const FileList &targetFiles, const FileList &queryFiles, const File &simmat, const File &output); /*!< \brief Create an output from a similarity matrix and file lists. */
+    static void reformat(const FileList &targetFiles, const FileList &queryFiles, const File &simmat, const File &output); /*!< \brief Create an output from a similarity matrix and file lists, streamed a block of rows at a time. */
 
 protected:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
@@ -877,7 +1162,11 @@ protected:
 private:
     QSharedPointer<Output> next;
     QPoint offset;
+    bool mirror;
     virtual void set(float value, int i, int j) = 0;
+    virtual void setRow(const float *scores, int i, int j, int count); /*!< \brief Reimplement to store consecutive scores of a row at once, the default calls set() for each. */
+    virtual void blockCompleted() {} /*!< \brief Reimplement to publish partial results between blocks. */
+    virtual float rowCutoff(int i) { (void) i; return -std::numeric_limits<float>::max(); } /*!< \brief Reimplement to return the score that values of row \em i must reach to be kept, called from the thread that will set them. */
 };
 
 /*!
@@ -898,10 +1187,11 @@ public:
 
 protected:
     QString toString(int row, int column) const; /*!< \brief Converts the value requested similarity score to a string. */
+    void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Allocates #data. */
 
 private:
-    void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
+    void setRow(const float *scores, int i, int j, int count);
 };
 
 /*!
@@ -946,10 +1236,11 @@ class BR_EXPORT Gallery : public Object
 public:
     virtual ~Gallery() {}
     TemplateList read(); /*!< \brief Retrieve all the stored templates. */
-    FileList files(); /*!< \brief Retrieve all the stored template files. */
+    virtual FileList files(); /*!< \brief Retrieve all the stored template files, reimplement to avoid reading template data. */
     virtual TemplateList readBlock(bool *done) = 0; /*!< \brief Retrieve a portion of the stored templates. */
     void writeBlock(const TemplateList &templates); /*!< \brief Serialize a template list. */
     virtual void write(const Template &t) = 0; /*!< \brief Serialize a template. */
+    virtual bool append(const FileList &sources) { (void) sources; return false; } /*!< \brief Append the templates of \em sources, selected by their \c pos, \c length and \c step, by copying their serialized bytes. Reimplement where the formats allow it, returns \c false without writing anything to have the templates re-serialized instead. */
     static Gallery *make(const File &file); /*!< \brief Make a gallery from a file list. */
 
 private:
@@ -1041,6 +1332,26 @@ public:
      */
     virtual bool timeVarying() const { return false; }
 
+    /*!
+     * \brief Pixels of context a tile needs on each side for project() of the tile to match projecting the whole image,
+     * or -1 if the transform can't be applied to tiles.
+     * Tile-safe transforms output matrices the size of their input and don't change the file metadata.
+     * \see TileTransform
+     */
+    virtual int tileHalo() const { return -1; }
+
+    /*!
+     * \brief Does project() need to run on a single thread? Transform::make() then routes its calls through Parallel::confine(),
+     * so non-reentrant code doesn't require disabling br::Context::parallelism for the whole algorithm.
+     */
+    virtual bool threadConfined() const { return false; }
+
+    /*!
+     * \brief Should project() still be applied to templates that have failed (see br::File::failed())?
+     * br::PipeTransform passes failed templates around the transforms that don't, so they skip the rest of the algorithm.
+     */
+    virtual bool processesFailures() const { return false; }
+
     /*!
      * \brief Convenience function equivalent to project().
      */
@@ -1048,7 +1359,8 @@ public:
     {
         Template dst;
         dst.file = src.file;
-        project(src, dst);
+        if (Globals->profile || !Globals->trace.isEmpty()) profiledProject(src, dst);
+        else                                                project(src, dst);
         return dst;
     }
 
@@ -1058,13 +1370,18 @@ public:
     inline TemplateList operator()(const TemplateList &src) const
     {
         TemplateList dst;
-        project(src, dst);
+        if (Globals->profile || !Globals->trace.isEmpty()) profiledProject(src, dst);
+        else                                                project(src, dst);
         return dst;
     }
 
 protected:
     Transform(bool independent = true, bool trainable = true); /*!< \brief Construct a transform. */
     inline Transform *make(const QString &description) { return make(description, this); } /*!< \brief Make a subtransform. */
+
+private:
+    void profiledProject(const Template &src, Template &dst) const; /*!< \brief Calls project() and records a sample with br::Context::addProfile() and a br::Trace span. */
+    void profiledProject(const TemplateList &src, TemplateList &dst) const; /*!< \brief Calls project() and records a sample with br::Context::addProfile() and a br::Trace span. */
 };
 
 /*!
@@ -1236,6 +1553,25 @@ protected:
  * \brief Plugins that compare templates.
  */
 
+class Distance;
+
+/*!
+ * \brief Excludes targets from comparison using an index of their metadata built once per gallery.
+ *
+ * Returned by br::Distance::prefilter() for distances that would otherwise score excluded pairs \c -FLT_MAX.
+ * Admitted targets are scored by #scorer in contiguous runs, so its batch kernels still apply.
+ */
+struct BR_EXPORT TargetFilter
+{
+    const Distance *scorer; /*!< \brief Scores admitted pairs, or \c NULL to score them \c 0. */
+
+    TargetFilter() : scorer(NULL) {}
+    virtual ~TargetFilter() {}
+    virtual void admit(const Template &query, int offset, int count, uchar *keep) const = 0; /*!< \brief Clear \em keep[i] if the target at \em offset + \em i is excluded for \em query. */
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count,
+                      float lower = -std::numeric_limits<float>::max(), float upper = std::numeric_limits<float>::max()) const; /*!< \brief br::Distance::compareBatchBounded() that only scores admitted targets. */
+};
+
 /*!
  * \ingroup distances
  * \brief Plugin base class for comparing templates.
@@ -1253,12 +1589,55 @@ public:
     virtual void compare(const TemplateList &target, const TemplateList &query, Output *output) const; /*!< \brief Compare two template lists. */
     QList<float> compare(const TemplateList &targets, const Template &query) const; /*!< \brief Compute the normalized distance between a template and a template list. */
     virtual float compare(const Template &a, const Template &b) const = 0; /*!< \brief Compute the distance between two templates. */
+    virtual float compareMatrices(const cv::Mat &a, const cv::Mat &b) const { return compare(Template(a), Template(b)); } /*!< \brief Compute the distance between two single matrix templates without constructing them, used to compare multi-matrix templates region by region. */
+    virtual void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const; /*!< \brief Compare \em query against the \em count targets starting at \em offset, writing one score per target. */
+    virtual void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const { (void) lower; (void) upper; compareBatch(targets, query, scores, offset, count); } /*!< \brief compareBatch() where only scores within [\em lower, \em upper] must be exact, the rest need only fall on the same side of the range, so additive distances can stop accumulating early. */
+    virtual QSharedPointer<TargetFilter> prefilter(const TemplateList &targets) const { (void) targets; return QSharedPointer<TargetFilter>(); } /*!< \brief A br::TargetFilter over \em targets if this distance only excludes comparisons by metadata, \c NULL otherwise. */
+    virtual bool symmetric() const { return false; } /*!< \brief Reimplement to return \c true if <tt>compare(a, b) == compare(b, a)</tt>, so self-comparisons compute one triangle and mirror it. */
 
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
+    static const uchar *contiguousData(const TemplateList &targets, const Template &query, int offset, size_t *stride); /*!< \brief Returns the packed data starting at \em targets[offset] if the targets are aligned (see br::TemplateList::uniform) and match \em query in size and type, \c NULL otherwise. */
+    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const; /*!< \brief Compare the templates within a (target, query) tile, e.g. as a single matrix product. */
 
 private:
-    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
+    static int tileSize(const TemplateList &templates, size_t bytes); /*!< \brief Number of templates that fit in \em bytes. */
+    void compareTriangle(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const; /*!< \brief Compare the part of a tile on and above the diagonal one row at a time. */
+    void comparePacked(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const; /*!< \brief Decode the targets of a tile of compressed targets, see br::PackedData, and compare them one row at a time. */
+};
+
+/*!
+ * \brief A gallery held resident in memory to answer concurrent 1:N searches.
+ *
+ * Enrolled templates are packed into aligned segments (see br::TemplateList::align) that are never modified once published.
+ * add() and remove() publish a new list of segments, so search() only holds a lock while copying the list
+ * and concurrent queries compare without contending with each other or with updates.
+ * \see Search
+ */
+class BR_EXPORT ResidentGallery
+{
+    Q_DISABLE_COPY(ResidentGallery)
+
+public:
+    typedef QPair<float, File> Match; /*!< \brief A score and the file of the matching template. */
+
+    ResidentGallery(const QString &algorithm = QString()); /*!< \brief Compare with the distance of \em algorithm, the default is br::Context::algorithm. */
+    void add(const TemplateList &templates); /*!< \brief Add enrolled templates, failures to enroll are skipped. */
+    int remove(const QString &name); /*!< \brief Remove the templates enrolled from \em name, returning the number removed. */
+    int size() const; /*!< \brief Number of resident templates. */
+    QList<Match> search(const Template &query, int count) const; /*!< \brief The \em count best matches of an enrolled \em query, best first. */
+
+private:
+    enum { Max_Segments = 16,
+           Search_Batch = 1024 }; // Targets compared between updates of a search's cutoff
+    typedef QSharedPointer<const TemplateList> Segment;
+    QSharedPointer<Distance> distance;
+    QList<Segment> segments;
+    mutable QReadWriteLock segmentsLock;
+    QMutex updateLock;
+
+    void publish(const QList<Segment> &updated);
+    static Segment pack(const TemplateList &templates);
 };
 
 /*!
@@ -1281,12 +1660,98 @@ BR_EXPORT void Train(const File &input, const File &model);
  */
 BR_EXPORT FileList Enroll(const File &input, const File &gallery = File());
 
+/*!
+ * \brief High-level function for enrolling a single in-memory template without touching the file system.
+ * \see br_enroll_image
+ */
+BR_EXPORT Template EnrollTemplate(const Template &input, const QString &algorithm = QString());
+
+/*!
+ * \brief High-level function for comparing two enrolled templates.
+ * \see br_compare_templates
+ */
+BR_EXPORT float CompareTemplates(const Template &target, const Template &query, const QString &algorithm = QString());
+
 /*!
  * \brief High-level function for comparing galleries.
  * \see br_compare
  */
 BR_EXPORT void Compare(const File &targetGallery, const File &queryGallery, const File &output);
 
+/*!
+ * \brief High-level function for finding the best matches in a gallery using its br::InvertedIndex.
+ * \see br_search
+ */
+BR_EXPORT void Search(const File &targetGallery, const File &queryGallery, int count, const File &output);
+
+/*!
+ * \brief High-level function for clustering a gallery by the nearest neighbors of each template.
+ * \see br_cluster_gallery
+ */
+BR_EXPORT void ClusterNeighbors(const File &gallery, int k, float aggressiveness, const QString &csv);
+
+/*!
+ * \brief High-level function for reducing a gallery to representative templates of each subject.
+ * \see br_aggregate
+ */
+BR_EXPORT void Aggregate(const File &inputGallery, const File &outputGallery);
+
+/*!
+ * \brief High-level function for grouping identical templates with a hash join.
+ * \see br_deduplicate
+ */
+BR_EXPORT void Deduplicate(const File &targetGallery, const File &queryGallery, const File &output);
+
+/*!
+ * \brief Runs br::Enroll() or br::Compare() on a background thread under its own forked br::Context.
+ *
+ * progress() and cancel() act on the job's context alone, and a cancelled job stops between blocks.
+ * Jobs started with search() also keep the best matches of every query,
+ * emitting partialResults() after each block so a viewer can show ranks while the comparison runs.
+ * \code
+ * br::Job *job = br::Job::search("gallery.gal", "probe.jpg", 20);
+ * connect(job, SIGNAL(partialResults()), viewer, SLOT(refresh()));
+ * connect(job, SIGNAL(finished()), job, SLOT(deleteLater()));
+ * \endcode
+ */
+class BR_EXPORT Job : public QThread
+{
+    Q_OBJECT
+
+public:
+    typedef QPair<float, int> Match; /*!< \brief A score and the index of the matching target. */
+
+    static Job *enroll(const File &input, const File &gallery = File()); /*!< \brief Start enrolling \em input. */
+    static Job *compare(const File &targetGallery, const File &queryGallery, const File &output); /*!< \brief Start comparing the galleries into \em output. */
+    static Job *search(const File &targetGallery, const File &queryGallery, int count); /*!< \brief Start comparing the galleries, keeping the best \em count targets of every query. */
+    static Job *current(); /*!< \brief The job the calling thread is working for, \c NULL if none. */
+    ~Job(); /*!< \brief Cancels the job and waits for it to stop. */
+
+    void cancel(); /*!< \brief Stop at the next block. */
+    bool isCancelled() const;
+    float progress() const; /*!< \brief See br::Context::progress(). */
+    FileList files() const; /*!< \brief The files enrolled by an enroll() job. */
+    FileList targets() const; /*!< \brief The targets that matches() index into. */
+    QList< QList<Match> > matches() const; /*!< \brief The best matches found so far for each query of a search() job, best first. */
+    void publish(const FileList &targets, const QList< QList<Match> > &matches); /*!< \brief Used by the search output to report progress. */
+
+signals:
+    void partialResults(); /*!< \brief matches() has improved. */
+
+private:
+    enum Mode { Enrolling, Comparing, Searching };
+    Mode mode;
+    File input, query, output;
+    int count;
+    QScopedPointer<Context> context;
+    FileList enrolled, targetFiles;
+    QList< QList<Match> > best;
+    mutable QMutex resultsLock;
+
+    Job(Mode mode, const File &input, const File &query, const File &output, int count);
+    void run();
+};
+
 /*!
  * \brief To convert between matrix/template formats.
  * \param input The input matrix or template.
@@ -1299,6 +1764,9 @@ BR_EXPORT void Convert(const File &input, const File &output);
  * \param inputGalleries List of galleries to concatenate.
  * \param outputGallery Gallery to store the concatenated result.
  * \note outputGallery must not be in inputGalleries.
+ *
+ * Only the templates selected by each input's \c pos, \c length and \c step are copied, as in <tt>shard.mgal[pos=1000,length=500]</tt>.
+ * Formats that support Gallery::append() copy serialized bytes instead of decoding every template.
  */
 BR_EXPORT void Cat(const QStringList &inputGalleries, const QString &outputGallery);
 
@@ -36,19 +36,21 @@ class AlgorithmsInitializer : public Initializer
         Globals->abbreviations.insert("AgeRegression", "FaceDetection!<FaceClassificationRegistration>!<FaceClassificationExtraction>+<AgeRegressor>+Discard");
         Globals->abbreviations.insert("FaceQuality", "Open!Cascade(FrontalFace)+ASEFEyes+Affine(64,64,0.25,0.35)+ImageQuality+Cvt(Gray)+DFFS+Discard");
         Globals->abbreviations.insert("MedianFace", "Open!Cascade(FrontalFace)+ASEFEyes+Affine(256,256,0.37,0.45)+Center(Median)");
-        Globals->abbreviations.insert("BlurredFaceDetection", "Open+LimitSize(1024)+SkinMask/(Cvt(Gray)+GradientMask)+And+Morph(Erode,16)+LargestConvexArea");
+        Globals->abbreviations.insert("BlurredFaceDetection", "Open+LimitSize(1024)+Tile(SkinMask/(Cvt(Gray)+GradientMask)+And+Morph(Erode,16),512)+LargestConvexArea");
         Globals->abbreviations.insert("DrawFaceDetection", "Open+Cascade(FrontalFace)!ASEFEyes+Draw");
         Globals->abbreviations.insert("ShowFaceDetection", "DrawFaceDetection!Show");
         Globals->abbreviations.insert("OpenBR", "FaceRecognition");
         Globals->abbreviations.insert("GenderEstimation", "GenderClassification");
         Globals->abbreviations.insert("AgeEstimation", "AgeRegression");
-        Globals->abbreviations.insert("FaceRecognitionHoG", "Open+Cvt(Gray)+Cascade(FrontalFace)+ASEFEyes+Affine(64,64,0.25,0.35)+Gradient+Bin(0,360,8,true)+Merge+Integral+IntegralSampler+ProductQuantization(2,L1,true):ProductQuantization(true)");
+        Globals->abbreviations.insert("FaceRecognitionHoG", "Open+Cvt(Gray)+Cascade(FrontalFace)+ASEFEyes+Affine(64,64,0.25,0.35)+IntegralHoG+ProductQuantization(2,L1,true):ProductQuantization(true)");
 
         // Generic Image Processing
-        Globals->abbreviations.insert("SIFT", "Open+KeyPointDetector(SIFT)+KeyPointDescriptor(SIFT):KeyPointMatcher(BruteForce)");
-        Globals->abbreviations.insert("SURF", "Open+KeyPointDetector(SURF)+KeyPointDescriptor(SURF):KeyPointMatcher(BruteForce)");
-        Globals->abbreviations.insert("SmallSIFT", "Open+LimitSize(512)+KeyPointDetector(SIFT)+KeyPointDescriptor(SIFT):KeyPointMatcher(BruteForce)");
-        Globals->abbreviations.insert("SmallSURF", "Open+LimitSize(512)+KeyPointDetector(SURF)+KeyPointDescriptor(SURF):KeyPointMatcher(BruteForce)");
+        Globals->abbreviations.insert("SIFT", "Open+KeyPoint(SIFT):KeyPointMatcher(BruteForce)");
+        Globals->abbreviations.insert("SURF", "Open+KeyPoint(SURF):KeyPointMatcher(BruteForce)");
+        Globals->abbreviations.insert("SmallSIFT", "Open+LimitSize(512)+KeyPoint(SIFT):KeyPointMatcher(BruteForce)");
+        Globals->abbreviations.insert("SmallSURF", "Open+LimitSize(512)+KeyPoint(SURF):KeyPointMatcher(BruteForce)");
+        Globals->abbreviations.insert("ORB", "Open+KeyPoint(ORB):KeyPointMatcher(BruteForce-Hamming)");
+        Globals->abbreviations.insert("BRISK", "Open+KeyPoint(BRISK):KeyPointMatcher(BruteForce-Hamming)");
         Globals->abbreviations.insert("ColorHist", "Open+LimitSize(512)!EnsureChannels(3)+SplitChannels+Hist(256,0,8)+Cat+Normalize(L1):L2");
         Globals->abbreviations.insert("ImageRetrieval", "Open+Cvt(Gray)+Cascade(FrontalFace)+ASEFEyes+Affine(88,88,0.25,0.35)+Gradient+Bin(0,360,8,true)+Merge+Integral+IntegralSampler+WordWise(RowWisePCA(8)+RowWiseMeanCenter+Binarize,RowWisePCA)+Sentence:SentenceSimilarity");
 
@@ -56,17 +58,18 @@ class AlgorithmsInitializer : public Initializer
         Globals->abbreviations.insert("FileName", "Name+Identity:Identical");
         Globals->abbreviations.insert("MD5", "Open+CryptographicHash(Md5):Identical");
         Globals->abbreviations.insert("SHA1", "Open+CryptographicHash(Sha1):Identical");
+        Globals->abbreviations.insert("pHash", "Open+PerceptualHash:Hamming");
 
         // Miscellaneous
         Globals->abbreviations.insert("Display", "Open+Identity+Show+Discard");
         Globals->abbreviations.insert("RegisterAffine", "Open+Affine(256,256,0.37,0.45)");
-        Globals->abbreviations.insert("ContrastEnhanced", "Open+Affine(256,256,0.37,0.45)+Cvt(Gray)+Blur(1.1)+Gamma(0.2)+DoG(1,2)+ContrastEq(0.1,10)");
-        Globals->abbreviations.insert("ColoredLBP", "Open+Affine(128,128,0.37,0.45)+Cvt(Gray)+Blur(1.1)+Gamma(0.2)+DoG(1,2)+ContrastEq(0.1,10)+LBP(1,2)+ColoredU2");
+        Globals->abbreviations.insert("ContrastEnhanced", "Open+Affine(256,256,0.37,0.45)+Cvt(Gray)+TanTriggs");
+        Globals->abbreviations.insert("ColoredLBP", "Open+Affine(128,128,0.37,0.45)+Cvt(Gray)+TanTriggs+LBP(1,2)+ColoredU2");
 
         // Transforms
         Globals->abbreviations.insert("FaceDetection", "(Open+Cvt(Gray)+Cascade(FrontalFace))");
-        Globals->abbreviations.insert("DenseLBP", "(Blur(1.1)+Gamma(0.2)+DoG(1,2)+ContrastEq(0.1,10)+LBP(1,2)+RectRegions(8,8,6,6)+Hist(59))");
-        Globals->abbreviations.insert("DenseSIFT", "(Grid(10,10)+SIFTDescriptor(12)+ByRow)");
+        Globals->abbreviations.insert("DenseLBP", "(TanTriggs+LBPHist(1,2,width=8,height=8,widthStep=6,heightStep=6))");
+        Globals->abbreviations.insert("DenseSIFT", "(Grid(10,10)+DenseSIFTDescriptor(12)+ByRow)");
         Globals->abbreviations.insert("FaceRecognitionRegistration", "(ASEFEyes+Affine(88,88,0.25,0.35)+FTE(DFFS,instances=1))");
         Globals->abbreviations.insert("FaceRecognitionExtraction", "(Mask+DenseSIFT/DenseLBP+PCA(0.95,instances=1)+Normalize(L2)+Cat)");
         Globals->abbreviations.insert("FaceRecognitionEmbedding", "(Dup(12)+RndSubspace(0.05,1)+LDA(0.98,instances=-2)+Cat+PCA(768,instances=1))");
@@ -14,6 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/objdetect/objdetect.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -25,60 +29,279 @@ using namespace cv;
 namespace br
 {
 
-class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
+/*!
+ * \brief Returns the path of the cascade named \em model, also used by the GPU cascade in gpucascade.cpp.
+ *
+ * Any other \em model is the path of a cascade file, for example one compressed as \c .xml.gz.
+ */
+QString CascadeModel(const QString &model)
 {
-    QString file;
+    const QString models = Globals->sdkPath + "/share/openbr/models/";
+    if      (model == "Ear")            return models + "haarcascades/haarcascade_ear.xml";
+    else if (model == "Eye")            return models + "haarcascades/haarcascade_eye_tree_eyeglasses.xml";
+    else if (model == "FrontalFace")    return models + "haarcascades/haarcascade_frontalface_alt2.xml";
+    else if (model == "ProfileFace")    return models + "haarcascades/haarcascade_profileface.xml";
+    else if (model == "FrontalFaceLBP") return models + "lbpcascades/lbpcascade_frontalface.xml";
+    else if (model == "ProfileFaceLBP") return models + "lbpcascades/lbpcascade_profileface.xml";
+    if (!QFileInfo(model).exists()) qFatal("Invalid model: %s", qPrintable(model));
+    return model;
+}
 
-public:
-    CascadeResourceMaker(const QString &model)
+/*!
+ * \brief Parses each cascade model once per process, every CascadeClassifier instance is read from the parsed tree.
+ *
+ * Models in OpenCV's old Haar format are converted once to the current cascade format,
+ * which can be read from a parsed file.
+ */
+class CascadeModels : public Initializer
+{
+    Q_OBJECT
+
+    static QHash<QString, QSharedPointer<FileStorage> > models;
+    static QMutex lock;
+
+    void initialize() const {}
+
+    void finalize() const
     {
-        file = Globals->sdkPath + "/share/openbr/models/";
-        if      (model == "Ear")         file += "haarcascades/haarcascade_ear.xml";
-        else if (model == "Eye")         file += "haarcascades/haarcascade_eye_tree_eyeglasses.xml";
-        else if (model == "FrontalFace") file += "haarcascades/haarcascade_frontalface_alt2.xml";
-        else if (model == "ProfileFace") file += "haarcascades/haarcascade_profileface.xml";
-        else                             qFatal("Invalid model.");
+        QMutexLocker locker(&lock);
+        models.clear();
     }
 
-private:
-    CascadeClassifier *make() const
+    // Writes a cascade loaded by cvLoad() in the format CascadeClassifier::read() expects,
+    // with a feature for every node as old cascades keep them per node
+    static QSharedPointer<FileStorage> convert(const CvHaarClassifierCascade *cascade)
+    {
+        int depth = 1;
+        for (int i=0; i<cascade->count; i++)
+            for (int j=0; j<cascade->stage_classifier[i].count; j++)
+                depth = std::max(depth, cascade->stage_classifier[i].classifier[j].count);
+
+        FileStorage fs(".xml", FileStorage::WRITE + FileStorage::MEMORY);
+        fs << "cascade" << "{";
+        fs << "stageType" << "BOOST" << "featureType" << "HAAR";
+        fs << "height" << cascade->orig_window_size.height << "width" << cascade->orig_window_size.width;
+        fs << "stageParams" << "{" << "maxDepth" << depth << "}";
+        fs << "featureParams" << "{" << "maxCatCount" << 0 << "}";
+        fs << "stageNum" << cascade->count;
+
+        QList<const CvHaarFeature*> features;
+        fs << "stages" << "[";
+        for (int i=0; i<cascade->count; i++) {
+            const CvHaarStageClassifier &stage = cascade->stage_classifier[i];
+            fs << "{" << "maxWeakCount" << stage.count << "stageThreshold" << stage.threshold << "weakClassifiers" << "[";
+            for (int j=0; j<stage.count; j++) {
+                const CvHaarClassifier &tree = stage.classifier[j];
+                fs << "{" << "internalNodes" << "[:";
+                for (int k=0; k<tree.count; k++) {
+                    fs << tree.left[k] << tree.right[k] << features.size() << tree.threshold[k];
+                    features.append(&tree.haar_feature[k]);
+                }
+                fs << "]" << "leafValues" << "[:";
+                for (int k=0; k<=tree.count; k++)
+                    fs << tree.alpha[k];
+                fs << "]" << "}";
+            }
+            fs << "]" << "}";
+        }
+        fs << "]";
+
+        fs << "features" << "[";
+        foreach (const CvHaarFeature *feature, features) {
+            fs << "{" << "rects" << "[";
+            for (int i=0; (i<CV_HAAR_FEATURE_MAX) && (feature->rect[i].weight != 0); i++) {
+                const CvRect &r = feature->rect[i].r;
+                fs << "[:" << r.x << r.y << r.width << r.height << feature->rect[i].weight << "]";
+            }
+            fs << "]" << "tilted" << feature->tilted << "}";
+        }
+        fs << "]" << "}";
+
+        return QSharedPointer<FileStorage>(new FileStorage(fs.releaseAndGetString(), FileStorage::READ + FileStorage::MEMORY));
+    }
+
+    static QSharedPointer<FileStorage> parse(const QString &file)
+    {
+        QSharedPointer<FileStorage> fs(new FileStorage(file.toStdString(), FileStorage::READ));
+        if (!fs->isOpened())
+            qFatal("Failed to load: %s", qPrintable(file));
+
+        CascadeClassifier cascade;
+        if (cascade.read(fs->getFirstTopLevelNode()))
+            return fs;
+
+        fs->release();
+        CvHaarClassifierCascade *old = (CvHaarClassifierCascade*) cvLoad(qPrintable(file));
+        if (!old)
+            qFatal("Failed to load: %s", qPrintable(file));
+        fs = convert(old);
+        cvReleaseHaarClassifierCascade(&old);
+        return fs;
+    }
+
+public:
+    static CascadeClassifier *make(const QString &file)
     {
+        QMutexLocker locker(&lock);
+        QSharedPointer<FileStorage> &fs = models[file];
+        if (fs.isNull())
+            fs = parse(file);
+
         CascadeClassifier *cascade = new CascadeClassifier();
-        if (!cascade->load(file.toStdString()))
+        if (!cascade->read(fs->getFirstTopLevelNode()))
             qFatal("Failed to load: %s", qPrintable(file));
         return cascade;
     }
 };
 
+QHash<QString, QSharedPointer<FileStorage> > CascadeModels::models;
+QMutex CascadeModels::lock;
+
+BR_REGISTER(Initializer, CascadeModels)
+
+class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
+{
+    QString file;
+
+public:
+    CascadeResourceMaker(const QString &model)
+        : file(CascadeModel(model)) {}
+
+private:
+    CascadeClassifier *make() const
+    {
+        return CascadeModels::make(file);
+    }
+};
 
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV cascade classifier
  * \author Josh Klontz \cite jklontz
+ *
+ * Every model in \em model and \em models searches the same grayscale image,
+ * detections overlapping those of an earlier model are dropped.
+ * The \c minSize and \c maxSize metadata override the detection scale range,
+ * and a \c ROI rect in the metadata, for example the previous detection in a video,
+ * restricts the search to that region grown by \em margin times its size on every side.
+ *
+ * The \c LBP models, ex. \c FrontalFaceLBP, trade some accuracy for several times faster detection.
+ * When \em detectWidth is set, regions wider than it are searched downscaled to that width,
+ * and with \em refine each detection is then searched for again at full resolution in its neighborhood.
+ *
+ * \see GPUCascadeTransform
  */
 class CascadeTransform : public UntrainableTransform
 {
     Q_OBJECT
     Q_PROPERTY(QString model READ get_model WRITE set_model RESET reset_model STORED false)
     Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
+    Q_PROPERTY(int maxSize READ get_maxSize WRITE set_maxSize RESET reset_maxSize STORED false)
+    Q_PROPERTY(QStringList models READ get_models WRITE set_models RESET reset_models STORED false)
+    Q_PROPERTY(float margin READ get_margin WRITE set_margin RESET reset_margin STORED false)
+    Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
+    Q_PROPERTY(int detectWidth READ get_detectWidth WRITE set_detectWidth RESET reset_detectWidth STORED false)
+    Q_PROPERTY(bool refine READ get_refine WRITE set_refine RESET reset_refine STORED false)
     BR_PROPERTY(QString, model, "FrontalFace")
     BR_PROPERTY(int, minSize, 64)
+    BR_PROPERTY(int, maxSize, 0)
+    BR_PROPERTY(QStringList, models, QStringList())
+    BR_PROPERTY(float, margin, 0.5)
+    BR_PROPERTY(float, scaleFactor, 1.2)
+    BR_PROPERTY(int, minNeighbors, 5)
+    BR_PROPERTY(int, detectWidth, 0)
+    BR_PROPERTY(bool, refine, true)
 
-    Resource<CascadeClassifier> cascadeResource;
+    QList< QSharedPointer< Resource<CascadeClassifier> > > cascadeResources;
 
     void init()
     {
-        cascadeResource.setResourceMaker(new CascadeResourceMaker(model));
+        cascadeResources.clear();
+        foreach (const QString &name, QStringList(model) + models) {
+            cascadeResources.append(QSharedPointer< Resource<CascadeClassifier> >(new Resource<CascadeClassifier>()));
+            cascadeResources.last()->setResourceMaker(new CascadeResourceMaker(name));
+            cascadeResources.last()->warmUp();
+        }
+    }
+
+    static bool overlaps(const Rect &rect, const vector<Rect> &rects)
+    {
+        foreach (const Rect &other, rects)
+            if ((rect & other).area() > std::min(rect.area(), other.area()) / 2)
+                return true;
+        return false;
+    }
+
+    // Searches the neighborhood of a detection mapped up from the downscaled image at full resolution, returns it unchanged if nothing is found
+    Rect refined(CascadeClassifier *cascade, const Mat &image, const Rect &rect) const
+    {
+        if (!refine) return rect;
+        const int dx = rect.width/4, dy = rect.height/4;
+        const Rect neighborhood = Rect(rect.x - dx, rect.y - dy, rect.width + 2*dx, rect.height + 2*dy) & Rect(0, 0, image.cols, image.rows);
+        vector<Rect> detections;
+        cascade->detectMultiScale(image(neighborhood), detections, scaleFactor, std::max(1, minNeighbors/2), CV_HAAR_FIND_BIGGEST_OBJECT,
+                                  Size(rect.width*3/4, rect.height*3/4), Size(rect.width*4/3 + 1, rect.height*4/3 + 1));
+        if (detections.empty()) return rect;
+        return detections.front() + neighborhood.tl();
     }
 
     void project(const Template &src, Template &dst) const
     {
-        CascadeClassifier *cascade = cascadeResource.acquire();
+        const bool enrollAll = src.file.get<bool>("enrollAll", false);
+        const int minFace = src.file.get<int>("minSize", minSize);
+        const int maxFace = src.file.get<int>("maxSize", maxSize);
+
+        // Converted once for every model instead of inside each detectMultiScale
+        Mat gray;
+        if (src.m().channels() == 3) cvtColor(src, gray, CV_BGR2GRAY);
+        else                         gray = src;
+
+        Rect roi(0, 0, gray.cols, gray.rows);
+        if (src.file.contains("ROI")) {
+            const Rect prior = OpenCVUtils::toRect(src.file.get<QRectF>("ROI"));
+            const int dx = margin * prior.width, dy = margin * prior.height;
+            const Rect grown = Rect(prior.x - dx, prior.y - dy, prior.width + 2*dx, prior.height + 2*dy) & roi;
+            if (grown.area() > 0) roi = grown;
+        }
+        const Mat region = gray(roi);
+
+        // Search a downscaled copy of large regions
+        const double scale = ((detectWidth > 0) && (region.cols > detectWidth)) ? double(region.cols) / detectWidth : 1;
+        Mat small;
+        if (scale > 1) resize(region, small, Size(detectWidth, qRound(region.rows / scale)), 0, 0, INTER_AREA);
+        else           small = region;
+
+        const int flags = enrollAll ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT;
+        const int minSmall = qRound(minFace / scale), maxSmall = qRound(maxFace / scale);
         vector<Rect> rects;
-        cascade->detectMultiScale(src, rects, 1.2, 5, src.file.get<bool>("enrollAll", false) ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT, Size(minSize, minSize));
-        cascadeResource.release(cascade);
+        for (int i=0; i<cascadeResources.size(); i++) {
+            CascadeClassifier *cascade = cascadeResources[i]->acquire();
+            vector<Rect> detections;
+            if ((region.cols >= minFace) && (region.rows >= minFace))
+                cascade->detectMultiScale(small, detections, scaleFactor, minNeighbors, flags, Size(minSmall, minSmall), Size(maxSmall, maxSmall));
+
+            if (scale > 1)
+                for (size_t j=0; j<detections.size(); j++)
+                    detections[j] = refined(cascade, region, Rect(qRound(detections[j].x*scale), qRound(detections[j].y*scale),
+                                                                  qRound(detections[j].width*scale), qRound(detections[j].height*scale)));
+            cascadeResources[i]->release(cascade);
+
+            foreach (Rect rect, detections) {
+                rect.x += roi.x;
+                rect.y += roi.y;
+                if (!overlaps(rect, rects)) rects.push_back(rect);
+            }
+        }
+
+        if (!enrollAll && (rects.size() > 1)) {
+            Rect biggest = rects[0];
+            foreach (const Rect &rect, rects)
+                if (rect.area() > biggest.area()) biggest = rect;
+            rects = vector<Rect>(1, biggest);
+        }
 
-        if (!src.file.get<bool>("enrollAll", false) && rects.empty())
+        if (!enrollAll && rects.empty())
             rects.push_back(Rect(0, 0, src.m().cols, src.m().rows));
 
         foreach (const Rect &rect, rects) {
@@ -17,6 +17,7 @@
 #include <openbr/openbr_plugin.h>
 #include <opencv2/flann/flann.hpp>
 
+#include "openbr/core/kmeans.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -28,12 +29,16 @@ namespace br
  * \ingroup transforms
  * \brief Wraps OpenCV kmeans
  * \author Josh Klontz \cite jklontz
+ *
+ * Large training sets are clustered with mini-batches, see br::KMeans().
  */
 class KMeansTransform : public Transform
 {
     Q_OBJECT
     Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k)
+    Q_PROPERTY(bool kdTree READ get_kdTree WRITE set_kdTree RESET reset_kdTree STORED false)
     BR_PROPERTY(int, k, 1)
+    BR_PROPERTY(bool, kdTree, false)
 
     Mat centers;
     QSharedPointer<flann::Index> index;
@@ -41,23 +46,31 @@ class KMeansTransform : public Transform
 
     void reindex()
     {
-        index = QSharedPointer<flann::Index>(new flann::Index(centers, flann::LinearIndexParams()));
+        // The exhaustive search is vectorized and lock free, an approximate tree only pays off for large k
+        index.clear();
+        if (!kdTree) return;
+        index = QSharedPointer<flann::Index>(new flann::Index(centers, flann::KDTreeIndexParams(4)));
         indexLock = QSharedPointer<QMutex>(new QMutex());
     }
 
     void train(const TemplateList &data)
     {
         Mat bestLabels;
-        const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), k, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+        const double compactness = KMeans(OpenCVUtils::toMatByRow(data.data()), k, bestLabels, centers);
         reindex();
         qDebug("KMeans compactness = %f", compactness);
     }
 
     void project(const Template &src, Template &dst) const
     {
+        if (index.isNull()) {
+            NearestCenters(src, centers, dst);
+            return;
+        }
+
         Mat dists;
         indexLock->lock();
-        index->knnSearch(src, dst, dists, 1);
+        index->knnSearch(src, dst, dists, 1, flann::SearchParams(32));
         indexLock->unlock();
     }
 
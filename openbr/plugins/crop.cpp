@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -57,7 +58,7 @@ class ResizeTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        resize(src, dst, Size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows));
+        resize(src, MatArena::output(dst), Size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows));
     }
 };
 
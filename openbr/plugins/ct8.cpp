@@ -285,12 +285,18 @@ struct CT8Context
         return FRsdk::Position(point.x(), point.y());
     }
 
+    FRsdk::FIR build(const Template &t) const
+    {
+        return firBuilder->build((FRsdk::Byte *) t.m().data, t.m().cols);
+    }
+
+    FRsdk::FacialMatchingEngine *facialMatchingEngine;
+
 protected:
     FRsdk::Face::Finder *faceFinder;
     FRsdk::Eyes::Finder *eyesFinder;
     CT8EnrollmentProcessorResource enrollmentProcessors;
     FRsdk::FIRBuilder *firBuilder;
-    FRsdk::FacialMatchingEngine *facialMatchingEngine;
 };
 
 /*!
@@ -410,27 +416,49 @@ BR_REGISTER(Transform, CT8EnrollTransform)
  * \author Josh Klontz \cite jklontz
  * \author Charles Otto \cite caotto
  */
-struct CT8Compare : public Distance,
-                    public CT8Context
+struct CT8Compare : public Distance
 {
     Q_OBJECT
 
+    // One matching engine per comparing thread
+    Resource<CT8Context> contexts;
+
     // Compare pre-extracted facevacs templates
     float compare(const Template &srcA, const Template &srcB) const
     {
         float score = -std::numeric_limits<float>::max();
         if (!srcA.m().data || !srcB.m().data) return score;
 
+        ResourceLock<CT8Context> context(contexts);
         try {
-            FRsdk::FIR firA = firBuilder->build( (FRsdk::Byte *) srcA.m().data, srcA.m().cols);
-            FRsdk::FIR firB = firBuilder->build( (FRsdk::Byte *) srcB.m().data, srcB.m().cols);
-            score = (float)facialMatchingEngine->compare(firA, firB);
+            FRsdk::FIR firA = context->build(srcA);
+            FRsdk::FIR firB = context->build(srcB);
+            score = (float)context->facialMatchingEngine->compare(firA, firB);
         } catch (std::exception &e) {
             qFatal("CT8Compare Exception: %s", e.what());
         }
 
         return score;
     }
+
+    // The query FIR is built once for the whole batch
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        std::fill(scores, scores+count, -std::numeric_limits<float>::max());
+        if (!query.m().data) return;
+
+        ResourceLock<CT8Context> context(contexts);
+        try {
+            FRsdk::FIR queryFIR = context->build(query);
+            for (int i=0; i<count; i++) {
+                const Template &target = targets[offset+i];
+                if (!target.m().data) continue;
+                scores[i] = (float)context->facialMatchingEngine->compare(context->build(target), queryFIR);
+            }
+        } catch (std::exception &e) {
+            qFatal("CT8Compare Exception: %s", e.what());
+        }
+    }
 };
 
 BR_REGISTER(Distance, CT8Compare)
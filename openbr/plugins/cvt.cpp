@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -52,9 +53,14 @@ private:
     BR_PROPERTY(Code, code, Gray)
     BR_PROPERTY(int, channel, -1)
 
+    int tileHalo() const
+    {
+        return 0;
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        if (src.m().channels() > 1) cvtColor(src, dst, code);
+        if (src.m().channels() > 1) cvtColor(src, MatArena::output(dst), code);
         else                        dst = src;
 
         if (channel != -1) {
@@ -78,7 +84,7 @@ class CvtFloatTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_32F);
+        src.m().convertTo(MatArena::output(dst), CV_32F);
     }
 };
 
@@ -14,12 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QFutureSynchronizer>
-#include <QtConcurrentRun>
+#include <QScopedPointer>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/distance_sse.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -56,10 +56,21 @@ private:
 
     float compare(const Template &a, const Template &b) const
     {
-        if ((a.m().size != b.m().size) ||
-            (a.m().type() != b.m().type()))
+        return compareMatrices(a.m(), b.m());
+    }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        if ((a.size != b.size) ||
+            (a.type() != b.type()))
                 return -std::numeric_limits<float>::max();
 
+        // Contiguous single channel floats are handled by the vectorized kernels
+        const bool vectorized = (a.type() == CV_32FC1) && a.isContinuous() && b.isContinuous();
+        const float *aData = (const float*)a.data;
+        const float *bData = (const float*)b.data;
+        const int size = a.total();
+
         float result = std::numeric_limits<float>::max();
         switch (metric) {
           case Correlation:
@@ -77,13 +88,13 @@ private:
             result = norm(a, b, NORM_INF);
             break;
           case L1:
-            result = norm(a, b, NORM_L1);
+            result = vectorized ? l1(aData, bData, size) : norm(a, b, NORM_L1);
             break;
           case L2:
-            result = norm(a, b, NORM_L2);
+            result = vectorized ? sqrt(squared_l2(aData, bData, size)) : norm(a, b, NORM_L2);
             break;
           case Cosine:
-            return cosine(a, b);
+            return vectorized ? ::cosine(aData, bData, size) : cosine(a, b);
           default:
             qFatal("Invalid metric");
         }
@@ -112,6 +123,11 @@ private:
 
         return dot / (sqrt(magA)*sqrt(magB));
     }
+
+    bool symmetric() const
+    {
+        return metric != ChiSquared;
+    }
 };
 
 BR_REGISTER(Distance, DistDistance)
@@ -135,6 +151,16 @@ class DefaultDistance : public Distance
     {
         return distance->compare(a, b);
     }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        return distance->compareMatrices(a, b);
+    }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
 };
 
 BR_REGISTER(Distance, DefaultDistance)
@@ -156,11 +182,11 @@ class PipeDistance : public Distance
 
     void train(const TemplateList &data)
     {
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         foreach (br::Distance *distance, distances)
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
-            else                                                          distance->train(data);
-        futures.waitForFinished();
+            if (Globals->parallelism) tasks.run(distance, &Distance::train, data);
+            else                                distance->train(data);
+        tasks.wait();
     }
 
     float compare(const Template &a, const Template &b) const
@@ -173,10 +199,344 @@ class PipeDistance : public Distance
         }
         return result;
     }
+
+    struct Chain : public TargetFilter
+    {
+        QList< QSharedPointer<TargetFilter> > filters;
+
+        void admit(const Template &query, int offset, int count, uchar *keep) const
+        {
+            foreach (const QSharedPointer<TargetFilter> &filter, filters)
+                filter->admit(query, offset, count, keep);
+        }
+    };
+
+    // When every distance before the last only filters by metadata, excluded targets are never scored
+    QSharedPointer<TargetFilter> prefilter(const TemplateList &targets) const
+    {
+        if (distances.size() < 2) return QSharedPointer<TargetFilter>();
+
+        QSharedPointer<Chain> chain(new Chain());
+        for (int i=0; i<distances.size()-1; i++) {
+            const QSharedPointer<TargetFilter> filter = distances[i]->prefilter(targets);
+            if (!filter) return QSharedPointer<TargetFilter>();
+            chain->filters.append(filter);
+        }
+        chain->scorer = distances.last();
+        return chain;
+    }
+
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric()) return false;
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, PipeDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Coarse-to-fine search where each stage only rescores the best targets kept by the previous stage.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The first br::Distance scores every target.
+ * Each later distance rescores only the best \em keep[i-1] targets of the stage before it,
+ * and a value of \em keep between 0 and 1 keeps that fraction of the targets instead.
+ * Rejected targets score -FLT_MAX and the rest score with the last distance.
+ * Targets are ranked per query across the whole gallery, so pair this with a top-K br::Output such as \c .rank or \c .rr.
+ */
+class CascadeDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(QList<br::Distance*> distances READ get_distances WRITE set_distances RESET reset_distances)
+    Q_PROPERTY(QList<float> keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
+    BR_PROPERTY(QList<br::Distance*>, distances, QList<br::Distance*>())
+    BR_PROPERTY(QList<float>, keep, QList<float>())
+
+    struct Better
+    {
+        const float *scores;
+        Better(const float *scores) : scores(scores) {}
+        bool operator()(int a, int b) const { return scores[a] > scores[b]; }
+    };
+
+    void train(const TemplateList &data)
+    {
+        TaskGroup tasks;
+        foreach (br::Distance *distance, distances)
+            if (Globals->parallelism) tasks.run(distance, &Distance::train, data);
+            else                                distance->train(data);
+        tasks.wait();
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        float result = -std::numeric_limits<float>::max();
+        foreach (br::Distance *distance, distances) {
+            result = distance->compare(a, b);
+            if (result == -std::numeric_limits<float>::max())
+                return result;
+        }
+        return result;
+    }
+
+    // Rank each query against every target rather than one tile at a time
+    void compare(const TemplateList &targets, const TemplateList &queries, Output *output) const
+    {
+        // Compressed targets are only decoded a tile at a time
+        if (targets.packedData) {
+            Distance::compare(targets, queries, output);
+            return;
+        }
+
+        TaskGroup tasks;
+        for (int i=0; i<queries.size(); i++)
+            if (Globals->parallelism) tasks.run(this, &CascadeDistance::search, targets, queries[i], i, output);
+            else                                                  search(targets, queries[i], i, output);
+        tasks.wait();
+    }
+
+    void search(const TemplateList &targets, const Template &query, int row, Output *output) const
+    {
+        QVector<float> scores(targets.size());
+        compareBatch(targets, query, scores.data(), 0, targets.size());
+        output->setRelative(scores.data(), row, 0, targets.size());
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        if (distances.isEmpty()) qFatal("Cascade requires at least one distance.");
+        if (keep.size() != distances.size()-1) qFatal("Cascade expects one keep value for each stage after the first.");
+
+        distances.first()->compareBatch(targets, query, scores, offset, count);
+
+        QVector<int> candidates(count);
+        for (int i=0; i<count; i++)
+            candidates[i] = i;
+
+        for (int stage=1; stage<distances.size(); stage++) {
+            const float k = keep[stage-1];
+            const int n = std::min(candidates.size(), (k > 0 && k < 1) ? int(ceil(k*candidates.size())) : int(k));
+            std::partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(), Better(scores));
+            for (int i=n; i<candidates.size(); i++)
+                scores[candidates[i]] = -std::numeric_limits<float>::max();
+            candidates.resize(n);
+
+            // Rescore runs of adjacent survivors together so batch kernels still apply
+            std::sort(candidates.begin(), candidates.end());
+            int i = 0;
+            while (i < n) {
+                if (scores[candidates[i]] == -std::numeric_limits<float>::max()) {
+                    i++;
+                    continue;
+                }
+                int j = i+1;
+                while ((j < n) && (candidates[j] == candidates[j-1]+1) && (scores[candidates[j]] != -std::numeric_limits<float>::max())) j++;
+                distances[stage]->compareBatch(targets, query, scores+candidates[i], offset+candidates[i], j-i);
+                i = j;
+            }
+        }
+    }
+};
+
+BR_REGISTER(Distance, CascadeDistance)
+
+/*!
+ * \ingroup distances
+ * \brief Score level fusion of several distances as they compare, rather than br::Fuse over their saved matrices.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Distance \em i compares matrix \em i of templates with one matrix per distance, such as those enrolled by a fork of algorithms,
+ * and the whole templates otherwise.
+ * Each distance's scores are normalized with parameters learned during training as in br::Fuse,
+ * then combined by \em fusion, where Sum optionally takes one weight per distance.
+ * A comparison that fails with any distance scores -FLT_MAX.
+ */
+class FuseDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Normalization)
+    Q_ENUMS(Fusion)
+    Q_PROPERTY(QList<br::Distance*> distances READ get_distances WRITE set_distances RESET reset_distances)
+    Q_PROPERTY(Normalization normalization READ get_normalization WRITE set_normalization RESET reset_normalization STORED false)
+    Q_PROPERTY(Fusion fusion READ get_fusion WRITE set_fusion RESET reset_fusion STORED false)
+    Q_PROPERTY(QList<float> weights READ get_weights WRITE set_weights RESET reset_weights STORED false)
+
+public:
+    /*!< */
+    enum Normalization { None,
+                         MinMax,
+                         ZScore };
+
+    /*!< */
+    enum Fusion { Sum,
+                  Max,
+                  Min };
+
+private:
+    BR_PROPERTY(QList<br::Distance*>, distances, QList<br::Distance*>())
+    BR_PROPERTY(Normalization, normalization, ZScore)
+    BR_PROPERTY(Fusion, fusion, Sum)
+    BR_PROPERTY(QList<float>, weights, QList<float>())
+
+    // val' = scale*clamp(val, lower, upper) + shift
+    struct Scaling
+    {
+        float lower, upper, scale, shift;
+        Scaling() : lower(-std::numeric_limits<float>::max()), upper(std::numeric_limits<float>::max()), scale(1), shift(0) {}
+        float operator()(float val) const { return scale * std::min(std::max(val, lower), upper) + shift; }
+    };
+
+    QList<Scaling> scalings;
+
+    Template part(const Template &t, int i) const
+    {
+        return (t.size() == distances.size()) ? Template(t.file, t[i]) : t;
+    }
+
+    TemplateList part(const TemplateList &templates, int i, int offset, int count) const
+    {
+        TemplateList parts; parts.reserve(count);
+        for (int j=offset; j<offset+count; j++)
+            parts.append(part(templates[j], i));
+        return parts;
+    }
+
+    bool split(const TemplateList &templates, const Template &query) const
+    {
+        if (query.size() == distances.size()) return true;
+        foreach (const Template &t, templates)
+            if (t.size() == distances.size()) return true;
+        return false;
+    }
+
+    void init()
+    {
+        if (distances.isEmpty()) qFatal("Fuse requires at least one distance.");
+        if ((fusion == Sum) && !weights.isEmpty() && (weights.size() != distances.size()))
+            qFatal("Number of weights does not match number of distances.");
+        while (weights.size() < distances.size()) weights.append(1);
+        while (scalings.size() < distances.size()) scalings.append(Scaling());
+    }
+
+    void train(const TemplateList &data)
+    {
+        TaskGroup tasks;
+        for (int i=0; i<distances.size(); i++)
+            if (Globals->parallelism) tasks.run(this, &FuseDistance::trainDistance, data, i);
+            else                                                trainDistance(data, i);
+        tasks.wait();
+    }
+
+    // Trains one distance, then learns its normalization from the scores of a sample of the training pairs
+    void trainDistance(const TemplateList &data, int i)
+    {
+        const TemplateList samples = part(data, i, 0, data.size());
+        distances[i]->train(samples);
+        if (normalization == None) return;
+
+        const TemplateList subset = samples.mid(0, 2000);
+        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(subset.size()), FileList(subset.size())));
+        matrixOutput->setBlock(0, 0, distances[i]->symmetric());
+        distances[i]->compare(subset, subset, matrixOutput.data());
+
+        double sum = 0, sumSquares = 0;
+        qint64 count = 0;
+        float low = std::numeric_limits<float>::max(), high = -std::numeric_limits<float>::max();
+        for (int r=0; r<subset.size(); r++) {
+            for (int c=0; c<r; c++) {
+                const float val = matrixOutput.data()->data.at<float>(r, c);
+                if ((val == -std::numeric_limits<float>::max()) || (val != val) ||
+                    (val == std::numeric_limits<float>::infinity()) || (val == -std::numeric_limits<float>::infinity())) continue;
+                sum += val;
+                sumSquares += double(val)*val;
+                low = std::min(low, val);
+                high = std::max(high, val);
+                count++;
+            }
+        }
+        if (count == 0) qFatal("No scores to normalize.");
+
+        Scaling scaling;
+        scaling.lower = low;
+        scaling.upper = high;
+        if (normalization == MinMax) {
+            scaling.scale = (high > low) ? 1 / (high - low) : 1;
+            scaling.shift = -low * scaling.scale;
+        } else {
+            const double mean = sum / count;
+            const double stddev = sqrt(std::max(0.0, sumSquares / count - mean*mean));
+            if (stddev == 0) qFatal("Stddev is 0.");
+            scaling.scale = 1 / stddev;
+            scaling.shift = -mean / stddev;
+        }
+        scalings[i] = scaling;
+    }
+
+    float fuse(float fused, float val, int i) const
+    {
+        val = scalings[i](val);
+        if (i == 0) return (fusion == Sum) ? weights[0]*val : val;
+        switch (fusion) {
+          case Sum: return fused + weights[i]*val;
+          case Max: return std::max(fused, val);
+          case Min: return std::min(fused, val);
+        }
+        return fused;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        float fused = 0;
+        for (int i=0; i<distances.size(); i++) {
+            const float val = distances[i]->compare(part(a, i), part(b, i));
+            if (val == -std::numeric_limits<float>::max()) return val;
+            fused = fuse(fused, val, i);
+        }
+        return fused;
+    }
+
+    // Each distance scores the whole batch before it is folded in, so batch kernels still apply
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        const bool splitting = split(targets, query);
+        QVector<float> vals(count);
+        for (int i=0; i<distances.size(); i++) {
+            if (splitting) distances[i]->compareBatch(part(targets, i, offset, count), part(query, i), vals.data(), 0, count);
+            else           distances[i]->compareBatch(targets, query, vals.data(), offset, count);
+            for (int j=0; j<count; j++) {
+                if ((i > 0) && (scores[j] == -std::numeric_limits<float>::max())) continue;
+                scores[j] = (vals[j] == -std::numeric_limits<float>::max()) ? vals[j] : fuse(scores[j], vals[j], i);
+            }
+        }
+    }
+
+    void store(QDataStream &stream) const
+    {
+        Distance::store(stream);
+        foreach (const Scaling &scaling, scalings)
+            stream << scaling.lower << scaling.upper << scaling.scale << scaling.shift;
+    }
+
+    void load(QDataStream &stream)
+    {
+        Distance::load(stream);
+        for (int i=0; i<scalings.size(); i++)
+            stream >> scalings[i].lower >> scalings[i].upper >> scalings[i].scale >> scalings[i].shift;
+    }
+
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric()) return false;
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, FuseDistance)
+
 /*!
  * \ingroup distances
  * \brief Average distance of multiple matrices
@@ -197,8 +557,9 @@ class AverageDistance : public Distance
     {
         if (a.size() != b.size()) qFatal("Comparison size mismatch");
 
+        // Regions are compared in place, the inner distance never wraps them in templates
         float score = 0;
-        for (int i = 0; i < a.size(); i++) score += distance->compare(a[i],b[i]);
+        for (int i = 0; i < a.size(); i++) score += distance->compareMatrices(a[i], b[i]);
 
         return score/(float)a.size();
     }
@@ -206,19 +567,124 @@ class AverageDistance : public Distance
 
 BR_REGISTER(Distance, AverageDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Best score between any pair of matrices of two templates.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Compares the representatives of subjects aggregated with \ref br_aggregate \c method=Centers,
+ * so a probe scores as its most similar representative.
+ */
+class MaxDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        float best = -std::numeric_limits<float>::max();
+        for (int i=0; i<a.size(); i++)
+            for (int j=0; j<b.size(); j++)
+                best = std::max(best, distance->compareMatrices(a[i], b[j]));
+        return best;
+    }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
+};
+
+BR_REGISTER(Distance, MaxDistance)
+
 /*!
  * \ingroup distances
  * \brief Fast 8-bit L1 distance
  * \author Josh Klontz \cite jklontz
+ *
+ * If \c reorder, training learns an order of the dimensions by decreasing variance
+ * so bounded comparisons (see br::Distance::compareBatchBounded()) can stop after fewer of them.
  */
 class ByteL1Distance : public Distance
 {
     Q_OBJECT
+    Q_PROPERTY(bool reorder READ get_reorder WRITE set_reorder RESET reset_reorder STORED false)
+    BR_PROPERTY(bool, reorder, false)
+
+    QVector<int> order;
+
+    void train(const TemplateList &src)
+    {
+        if (!reorder || src.isEmpty()) return;
+        const int size = src.first().m().total();
+        QList<const uchar*> rows;
+        foreach (const Template &t, src)
+            if ((t.m().type() == CV_8UC1) && (int(t.m().total()) == size) && t.m().isContinuous())
+                rows.append(t.m().data);
+        if (!rows.isEmpty()) order = varianceOrder(rows, size);
+    }
 
     float compare(const Template &a, const Template &b) const
     {
         return l1(a.m().data, b.m().data, a.m().total());
     }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        return l1(a.data, b.data, a.total());
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if (data == NULL) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const uchar *queryData = query.m().data;
+        const int size = query.m().total();
+        DistanceKernels kernels;
+        specializeDistanceKernels(size, &kernels);
+        for (int i=0; i<count; i++)
+            scores[i] = kernels.l1(data + i*stride, queryData, size);
+    }
+
+    void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+    {
+        // Partial sums only grow, so only an upper bound on the distance lets a comparison stop
+        (void) lower;
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (upper == std::numeric_limits<float>::max()))
+            return compareBatch(targets, query, scores, offset, count);
+
+        const uchar *queryData = query.m().data;
+        const int size = query.m().total();
+        DistanceKernels kernels;
+        specializeDistanceKernels(BoundedBlock, &kernels);
+        for (int i=0; i<count; i++)
+            scores[i] = boundedSum(kernels.l1, distanceKernels.l1, data + i*stride, queryData, size, order, upper);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        if (reorder) stream << order;
+    }
+
+    void load(QDataStream &stream)
+    {
+        if (reorder) stream >> order;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ByteL1Distance)
@@ -236,14 +702,181 @@ class HalfByteL1Distance : public Distance
     {
         return packed_l1(a.m().data, b.m().data, a.m().total());
     }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        return packed_l1(a.data, b.data, a.total());
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if (data == NULL) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const uchar *queryData = query.m().data;
+        const int size = query.m().total();
+        for (int i=0; i<count; i++)
+            scores[i] = packed_l1(data + i*stride, queryData, size);
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, HalfByteL1Distance)
 
+/*!
+ * \ingroup distances
+ * \brief Hamming distance between bit-packed binary codes, negated so that more similar codes score higher.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Uses the hardware population count when available, a 256-bit code costs four POPCNT instructions.
+ * \see BinarizeTransform
+ */
+class HammingDistance : public Distance
+{
+    Q_OBJECT
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return compareMatrices(a.m(), b.m());
+    }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        const size_t bytes = a.total() * a.elemSize();
+        if (bytes != b.total() * b.elemSize()) return -std::numeric_limits<float>::max();
+        return -hamming(a.data, b.data, bytes);
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if (data == NULL) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const uchar *queryData = query.m().data;
+        const int bytes = query.m().total() * query.m().elemSize();
+        for (int i=0; i<count; i++)
+            scores[i] = -hamming(data + i*stride, queryData, bytes);
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, HammingDistance)
+
+/*!
+ * \ingroup distances
+ * \brief Fast comparison of half precision templates from br::HalfTransform.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Returns the negative squared L2 distance, or the dot product if \em dot is \c true.
+ */
+class HalfDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool dot READ get_dot WRITE set_dot RESET reset_dot STORED false)
+    BR_PROPERTY(bool, dot, false)
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return compareMatrices(a.m(), b.m());
+    }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        if ((a.type() != CV_16UC1) || (a.total() != b.total())) return -std::numeric_limits<float>::max();
+        return score(a.ptr<quint16>(), b.ptr<quint16>(), a.total());
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (query.m().type() != CV_16UC1)) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const quint16 *queryData = query.m().ptr<quint16>();
+        const int size = query.m().total();
+        for (int i=0; i<count; i++)
+            scores[i] = score(reinterpret_cast<const quint16*>(data + i*stride), queryData, size);
+    }
+
+    float score(const quint16 *a, const quint16 *b, int size) const
+    {
+        return dot ? ::dot(a, b, size) : -squared_l2(a, b, size);
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, HalfDistance)
+
+/*!
+ * \ingroup distances
+ * \brief Fast comparison of signed byte templates from br::QuantizeInt8Transform.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Returns the negative squared L2 distance, or the dot product if \em dot is \c true.
+ * Scores are proportional to those of the unquantized templates only if they share one scale, the br::QuantizeInt8Transform default.
+ */
+class Int8Distance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool dot READ get_dot WRITE set_dot RESET reset_dot STORED false)
+    BR_PROPERTY(bool, dot, false)
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return compareMatrices(a.m(), b.m());
+    }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        if ((a.type() != CV_8SC1) || (a.total() != b.total())) return -std::numeric_limits<float>::max();
+        return score(a.ptr<qint8>(), b.ptr<qint8>(), a.total());
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (query.m().type() != CV_8SC1)) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const qint8 *queryData = query.m().ptr<qint8>();
+        const int size = query.m().total();
+        for (int i=0; i<count; i++)
+            scores[i] = score(reinterpret_cast<const qint8*>(data + i*stride), queryData, size);
+    }
+
+    float score(const qint8 *a, const qint8 *b, int size) const
+    {
+        return dot ? ::dot(a, b, size) : -squared_l2(a, b, size);
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, Int8Distance)
+
 /*!
  * \ingroup distances
  * \brief Returns \c true if the templates are identical, \c false otherwise.
  * \author Josh Klontz \cite jklontz
+ *
+ * To find every identical pair, br_deduplicate() hashes each template once instead of comparing all pairs.
  */
 class IdenticalDistance : public Distance
 {
@@ -251,14 +884,22 @@ class IdenticalDistance : public Distance
 
     float compare(const Template &a, const Template &b) const
     {
-        const Mat &am = a.m();
-        const Mat &bm = b.m();
+        return compareMatrices(a.m(), b.m());
+    }
+
+    float compareMatrices(const Mat &am, const Mat &bm) const
+    {
         const size_t size = am.total() * am.elemSize();
         if (size != bm.total() * bm.elemSize()) return 0;
         for (size_t i=0; i<size; i++)
             if (am.data[i] != bm.data[i]) return 0;
         return 1;
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, IdenticalDistance)
@@ -115,18 +115,17 @@ class EditTransform : public UntrainableTransform
     void init()
     {
         draw = make("Draw");
-        Globals->setProperty("parallelism", "0"); // Can only work in single threaded mode
+    }
+
+    bool threadConfined() const
+    {
+        return true;
     }
 
     void project(const Template &src, Template &dst) const
     {
         dst = src;
 
-        if (Globals->parallelism) {
-            qWarning("Edit::project() only works in single threaded mode.");
-            return;
-        }
-
         currentTemplateLock.lock();
         currentTemplate = src;
         OpenCVUtils::showImage(src, "Edit", false);
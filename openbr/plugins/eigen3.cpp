@@ -14,20 +14,329 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicInt>
 #include <Eigen/Dense>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/common.h"
+#include "openbr/core/distance_sse.h"
 #include "openbr/core/eigenutils.h"
+#include "openbr/core/parallel.h"
 
 namespace br
 {
 
+static const int Projection_Block = 256; // Templates per matrix product
+
+static void projectBlock(const Eigen::MatrixXf *projection, const Eigen::VectorXf *mean, const TemplateList *src, TemplateList *dst, int begin)
+{
+    const int dimsIn = mean->rows();
+    const int dimsOut = projection->cols();
+    const int count = std::min(Projection_Block, src->size()-begin);
+
+    // Each output is one row of a shared block
+    cv::Mat out(count, dimsOut, CV_32FC1);
+    Eigen::Map<Eigen::MatrixXf> outMap(out.ptr<float>(), dimsOut, count);
+
+    // Templates that are consecutive rows of one block, like batched AffineTransform crops or an earlier projection, are read in place
+    const float *first = (*src)[begin].m().ptr<float>();
+    bool consecutive = true;
+    for (int i=1; (i<count) && consecutive; i++)
+        consecutive = ((*src)[begin+i].m().ptr<float>() == first + size_t(i)*dimsIn);
+
+    if (consecutive) {
+        const Eigen::VectorXf projectedMean = projection->transpose() * *mean;
+        outMap.noalias() = projection->transpose() * Eigen::Map<const Eigen::MatrixXf>(first, dimsIn, count);
+        outMap.colwise() -= projectedMean;
+    } else {
+        Eigen::MatrixXf data(dimsIn, count);
+        for (int i=0; i<count; i++)
+            data.col(i) = Eigen::Map<const Eigen::VectorXf>((*src)[begin+i].m().ptr<float>(), dimsIn) - *mean;
+        outMap.noalias() = projection->transpose() * data;
+    }
+    for (int i=0; i<count; i++)
+        (*dst)[begin+i] = out.row(i);
+}
+
+/*!
+ * \brief Projects each template with one matrix product per block of templates,
+ * so the projection is streamed once per block rather than once per template.
+ *
+ * Returns \c false without projecting if any template is not a continuous \c CV_32FC1 matrix of the expected size.
+ */
+static bool projectBatch(const Eigen::MatrixXf &projection, const Eigen::VectorXf &mean, const TemplateList &src, TemplateList &dst)
+{
+    if (src.size() < 2) return false;
+    foreach (const Template &t, src)
+        if (t.isEmpty() || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (int(t.m().total()) != mean.rows()))
+            return false;
+
+    dst.reserve(dst.size() + src.size());
+    TemplateList projected;
+    for (int i=0; i<src.size(); i++)
+        projected.append(Template(src[i].file));
+
+    TaskGroup tasks;
+    for (int begin=0; begin<src.size(); begin+=Projection_Block)
+        if (Globals->parallelism) tasks.run(projectBlock, &projection, &mean, &src, &projected, begin);
+        else                                projectBlock (&projection, &mean, &src, &projected, begin);
+    tasks.wait();
+
+    dst.append(projected);
+    return true;
+}
+
+/*!
+ * \brief An 8-bit fixed-point copy of a projection, for devices short on memory bandwidth and floating point throughput.
+ *
+ * The weights of each output dimension are scaled to [-127, 127] on their own,
+ * and each centered input is scaled to [-127, 127] as it is projected,
+ * so the dot products accumulate in 32-bit integers and are rescaled once per output.
+ * The weights take a quarter of the memory of the floating point projection.
+ */
+struct FixedProjection
+{
+    int dimsIn, dimsOut;
+    QVector<qint8> weights; // Row i holds the weights of output i
+    QVector<float> scales; // Of each row of weights
+    Eigen::VectorXf mean;
+
+    FixedProjection() : dimsIn(0), dimsOut(0) {}
+
+    bool isNull() const
+    {
+        return weights.isEmpty();
+    }
+
+    void set(const Eigen::MatrixXf &projection, const Eigen::VectorXf &mean) // One output per column
+    {
+        dimsIn = projection.rows();
+        dimsOut = projection.cols();
+        this->mean = mean;
+        weights.resize(dimsIn*dimsOut);
+        scales.resize(dimsOut);
+        for (int i=0; i<dimsOut; i++) {
+            const float maxWeight = projection.col(i).cwiseAbs().maxCoeff();
+            scales[i] = (maxWeight > 0) ? maxWeight / 127 : 1;
+            for (int j=0; j<dimsIn; j++)
+                weights[i*dimsIn + j] = qint8(qRound(projection(j,i) / scales[i]));
+        }
+    }
+
+    bool project(const Template &src, Template &dst) const
+    {
+        const cv::Mat &m = src.m();
+        if ((m.type() != CV_32FC1) || !m.isContinuous() || (int(m.total()) != dimsIn)) return false;
+
+        const float *in = m.ptr<float>();
+        QVector<float> centered(dimsIn);
+        float maxValue = 0;
+        for (int j=0; j<dimsIn; j++) {
+            centered[j] = in[j] - mean[j];
+            maxValue = std::max(maxValue, std::abs(centered[j]));
+        }
+        const float scale = (maxValue > 0) ? maxValue / 127 : 1;
+        QVector<qint8> values(dimsIn);
+        for (int j=0; j<dimsIn; j++)
+            values[j] = qint8(qRound(centered[j] / scale));
+
+        cv::Mat out(1, dimsOut, CV_32FC1);
+        float *outData = out.ptr<float>();
+        const qint8 *x = values.constData();
+        for (int i=0; i<dimsOut; i++) {
+            // Simple enough for the compiler to vectorize into widening multiply-adds
+            const qint8 *w = weights.constData() + i*dimsIn;
+            qint32 sum = 0;
+            for (int j=0; j<dimsIn; j++)
+                sum += qint32(w[j]) * qint32(x[j]);
+            outData[i] = sum * scales[i] * scale;
+        }
+        dst = out;
+        return true;
+    }
+};
+
+/*!
+ * \brief Sample count, mean and scatter matrix, accumulated block by block and merged exactly.
+ */
+struct Scatter
+{
+    qint64 count;
+    Eigen::VectorXd mean;
+    Eigen::MatrixXd scatter; // Sum of the outer products of the deviations from the mean
+
+    Scatter() : count(0) {}
+
+    void add(const Eigen::MatrixXd &samples) // One sample per column
+    {
+        Scatter block;
+        block.count = samples.cols();
+        block.mean = samples.rowwise().mean();
+        const Eigen::MatrixXd deviations = samples.colwise() - block.mean;
+        block.scatter.noalias() = deviations * deviations.transpose();
+        merge(block);
+    }
+
+    void merge(const Scatter &other)
+    {
+        if (other.count == 0) return;
+        if (count == 0) { *this = other; return; }
+        const double total = count + other.count;
+        const Eigen::VectorXd delta = other.mean - mean;
+        scatter += other.scatter + delta * delta.transpose() * (count * (other.count / total));
+        mean += delta * (other.count / total);
+        count += other.count;
+    }
+};
+
+static const int Scatter_Block = 1024; // Samples per partial sum
+static const int Max_Partials = 4; // Each holds a dims x dims matrix, so they aren't one per thread
+
+// Adds blocks claimed from next to partial until data runs out
+static void accumulateScatter(const TemplateList *data, const Eigen::MatrixXd *classMeans, const QList<int> *classes, QAtomicInt *next, Scatter *partial)
+{
+    const int dims = data->first().m().rows * data->first().m().cols;
+    for (int begin = next->fetchAndAddOrdered(Scatter_Block); begin < data->size(); begin = next->fetchAndAddOrdered(Scatter_Block)) {
+        const int count = std::min(Scatter_Block, data->size()-begin);
+        Eigen::MatrixXd samples(dims, count);
+        for (int i=0; i<count; i++) {
+            samples.col(i) = Eigen::Map<const Eigen::VectorXf>((*data)[begin+i].m().ptr<float>(), dims).cast<double>();
+            if (classMeans != NULL) samples.col(i) -= classMeans->col((*classes)[begin+i]);
+        }
+        partial->add(samples);
+    }
+}
+
+/*!
+ * \brief Scatter of \em data in parallel partial sums, with each sample's class mean removed when \em classMeans is provided.
+ *
+ * At most \c Max_Partials tasks claim blocks of samples as they go, bounding the partial scatter matrices alive at once.
+ */
+static Scatter computeScatter(const TemplateList &data, const Eigen::MatrixXd *classMeans = NULL, const QList<int> *classes = NULL)
+{
+    const int blocks = (data.size() + Scatter_Block - 1) / Scatter_Block;
+    QVector<Scatter> partials(std::max(1, std::min(Globals->parallelism ? Max_Partials : 1, blocks)));
+    QAtomicInt next(0);
+    TaskGroup tasks;
+    for (int i=0; i<partials.size(); i++)
+        if (Globals->parallelism) tasks.run(accumulateScatter, &data, classMeans, classes, &next, &partials[i]);
+        else                                accumulateScatter (&data, classMeans, classes, &next, &partials[i]);
+    tasks.wait();
+
+    Scatter total;
+    foreach (const Scatter &partial, partials)
+        total.merge(partial);
+    return total;
+}
+
+/*!
+ * \brief Indices of the samples of each class, the samples of class \em c are <tt>members[starts[c], starts[c+1])</tt>.
+ */
+struct ClassMembers
+{
+    QVector<int> members, starts;
+
+    ClassMembers(const QList<int> &classes, int numClasses)
+        : members(classes.size()), starts(numClasses+1, 0)
+    {
+        // Counting sort, samples keep their order within a class
+        foreach (int c, classes) starts[c+1]++;
+        for (int c=0; c<numClasses; c++) starts[c+1] += starts[c];
+        QVector<int> next = starts;
+        for (int i=0; i<classes.size(); i++) members[next[classes[i]]++] = i;
+    }
+};
+
+static void accumulateClassMeans(const TemplateList *data, const ClassMembers *classMembers, int firstClass, int lastClass, Eigen::MatrixXd *classMeans)
+{
+    const int dims = classMeans->rows();
+    for (int c=firstClass; c<lastClass; c++) {
+        Eigen::VectorXd sum = Eigen::VectorXd::Zero(dims);
+        const int begin = classMembers->starts[c], end = classMembers->starts[c+1];
+        for (int k=begin; k<end; k++)
+            sum += Eigen::Map<const Eigen::VectorXf>((*data)[classMembers->members[k]].m().ptr<float>(), dims).cast<double>();
+        classMeans->col(c) = (end > begin) ? Eigen::VectorXd(sum / (end - begin)) : sum;
+    }
+}
+
+/*!
+ * \brief Mean of each class of \em data, one column per class.
+ *
+ * Each task sums whole classes into their own columns, so no partial sums need merging,
+ * and the classes are split into ranges holding about the same number of samples.
+ */
+static Eigen::MatrixXd computeClassMeans(const TemplateList &data, const QList<int> &classes, int numClasses)
+{
+    const int dims = data.first().m().rows * data.first().m().cols;
+    Eigen::MatrixXd classMeans(dims, numClasses);
+    const ClassMembers classMembers(classes, numClasses);
+
+    TaskGroup tasks;
+    int first = 0;
+    for (int c=0; c<numClasses; c++) {
+        if ((c+1 < numClasses) && (classMembers.starts[c+1] - classMembers.starts[first] < Scatter_Block)) continue;
+        if (Globals->parallelism) tasks.run(accumulateClassMeans, &data, &classMembers, first, c+1, &classMeans);
+        else                                accumulateClassMeans (&data, &classMembers, first, c+1, &classMeans);
+        first = c+1;
+    }
+    tasks.wait();
+    return classMeans;
+}
+
+static void centerBlock(const TemplateList *data, const Eigen::MatrixXd *classMeans, const QList<int> *classes, int begin, Eigen::MatrixXd *centered)
+{
+    const int dims = centered->rows();
+    const int end = std::min(begin + Scatter_Block, data->size());
+    for (int i=begin; i<end; i++)
+        centered->col(i) = Eigen::Map<const Eigen::VectorXf>((*data)[i].m().ptr<float>(), dims).cast<double>() - classMeans->col((*classes)[i]);
+}
+
+static const int Eigen_Oversample = 16; // Extra random directions drawn beyond the wanted rank
+static const int Eigen_Power_Iterations = 2;
+
+/*!
+ * \brief Leading eigenpairs of a symmetric positive semi-definite matrix by randomized subspace iteration.
+ *
+ * Finds at least \em count eigenpairs holding at least \em fraction of the trace, in increasing order like \c Eigen::SelfAdjointEigenSolver.
+ * Returns \c false when so many are needed that the full decomposition is cheaper.
+ */
+static bool leadingEigen(const Eigen::MatrixXd &matrix, int count, double fraction, Eigen::MatrixXd &eVals, Eigen::MatrixXd &eVecs)
+{
+    const int n = matrix.rows();
+    const double trace = matrix.trace();
+    for (int rank = count + Eigen_Oversample; 2*rank < n; rank *= 2) {
+        Eigen::MatrixXd basis = matrix * Eigen::MatrixXd::Random(n, rank);
+        for (int i=0; i<=Eigen_Power_Iterations; i++) {
+            Eigen::HouseholderQR<Eigen::MatrixXd> qr(basis);
+            basis = qr.householderQ() * Eigen::MatrixXd::Identity(n, rank);
+            if (i < Eigen_Power_Iterations) basis = matrix * basis;
+        }
+
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(basis.transpose() * matrix * basis);
+
+        // The trailing oversampled directions are the least accurate, drop them
+        const int found = rank - Eigen_Oversample;
+        const Eigen::VectorXd values = eSolver.eigenvalues().tail(found);
+        if ((found < count) || (values.sum() < fraction * trace))
+            continue;
+
+        eVals = values;
+        eVecs = basis * eSolver.eigenvectors().rightCols(found);
+        return true;
+    }
+    return false;
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
  * \author Brendan Klare \cite bklare
  * \author Josh Klontz \cite jklontz
+ *
+ * When there are at least as many samples as dimensions the covariance is accumulated in blocks instead of from a copy of the data.
+ * Set \em gallery to stream the training samples from a gallery of features rather than holding them in memory.
+ * Set \em randomized to find only the leading components with a randomized eigensolver when \em keep is a count or a fraction.
+ * Set \em fixedPoint to project with an 8-bit copy of the eigenvectors, see br::FixedProjection.
  */
 class PCATransform : public Transform
 {
@@ -39,6 +348,9 @@ protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(QString gallery READ get_gallery WRITE set_gallery RESET reset_gallery STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
+    Q_PROPERTY(bool fixedPoint READ get_fixedPoint WRITE set_fixedPoint RESET reset_fixedPoint STORED false)
 
     /*!
      *     keep <  0: All eigenvalues are retained.
@@ -49,9 +361,13 @@ protected:
     BR_PROPERTY(float, keep, 0.95)
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
+    BR_PROPERTY(QString, gallery, QString())
+    BR_PROPERTY(bool, randomized, false)
+    BR_PROPERTY(bool, fixedPoint, false)
 
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
+    FixedProjection fixed; // Of eVecs when fixedPoint
 
     int originalRows;
 
@@ -87,6 +403,11 @@ private:
 
     void train(const TemplateList &trainingSet)
     {
+        if (!gallery.isEmpty()) {
+            trainGallery();
+            return;
+        }
+
         if (trainingSet.first().m().type() != CV_32FC1)
             qFatal("Requires single channel 32-bit floating point matrices.");
 
@@ -94,6 +415,11 @@ private:
         int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
         const int instances = trainingSet.size();
 
+        if ((keep != 0) && (dimsIn <= instances)) {
+            train(computeScatter(trainingSet));
+            return;
+        }
+
         // Map into 64-bit Eigen matrix
         Eigen::MatrixXd data(dimsIn, instances);
         for (int i=0; i<instances; i++)
@@ -102,8 +428,30 @@ private:
         train(data);
     }
 
+    void trainGallery()
+    {
+        QScopedPointer<Gallery> g(Gallery::make(gallery));
+        Scatter total;
+        bool done = false;
+        originalRows = -1;
+        while (!done) {
+            const TemplateList block = g->readBlock(&done);
+            if (block.isEmpty()) continue;
+            if (block.first().m().type() != CV_32FC1)
+                qFatal("Requires single channel 32-bit floating point matrices.");
+            if (originalRows == -1) originalRows = block.first().m().rows;
+            total.merge(computeScatter(block));
+        }
+        if (total.count == 0) qFatal("No training samples in %s.", qPrintable(gallery));
+        if (total.count < total.mean.rows()) qFatal("Streamed training needs at least as many samples as dimensions.");
+        train(total);
+    }
+
     void project(const Template &src, Template &dst) const
     {
+        if (!fixed.isNull() && fixed.project(src, dst))
+            return;
+
         dst = cv::Mat(1, keep, CV_32FC1);
 
         // Map Eigen into OpenCV
@@ -114,6 +462,12 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!fixed.isNull() || !projectBatch(eVecs, mean, src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -122,6 +476,7 @@ private:
     void load(QDataStream &stream)
     {
         stream >> keep >> drop >> whiten >> originalRows >> mean >> eVals >> eVecs;
+        if (fixedPoint) fixed.set(eVecs, mean);
     }
 
 protected:
@@ -132,6 +487,7 @@ protected:
         const bool dominantEigenEstimation = (dimsIn > instances);
 
         Eigen::MatrixXd allEVals, allEVecs;
+        double totalEnergy;
         if (keep != 0) {
             // Compute and remove mean
             mean = Eigen::VectorXf(dimsIn);
@@ -143,23 +499,51 @@ protected:
             if (dominantEigenEstimation) cov = data.transpose() * data / (instances-1.0);
             else                         cov = data * data.transpose() / (instances-1.0);
 
-            // Compute eigendecomposition. Returns eigenvectors/eigenvalues in increasing order by eigenvalue.
-            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(cov);
-            allEVals = eSolver.eigenvalues();
-            allEVecs = eSolver.eigenvectors();
+            totalEnergy = eigen(cov, allEVals, allEVecs);
             if (dominantEigenEstimation) allEVecs = data * allEVecs;
         } else {
             // Null case
             mean = Eigen::VectorXf::Zero(dimsIn);
             allEVecs = Eigen::MatrixXd::Identity(dimsIn, dimsIn);
             allEVals = Eigen::VectorXd::Ones(dimsIn);
+            totalEnergy = dimsIn;
+        }
+
+        keepLeading(allEVals, allEVecs, dimsIn, totalEnergy);
+    }
+
+    void train(const Scatter &scatter)
+    {
+        const int dimsIn = scatter.mean.rows();
+        mean = scatter.mean.cast<float>();
+
+        Eigen::MatrixXd allEVals, allEVecs;
+        const double totalEnergy = eigen(scatter.scatter / (scatter.count-1.0), allEVals, allEVecs);
+        keepLeading(allEVals, allEVecs, dimsIn, totalEnergy);
+    }
+
+    // Eigenvectors/eigenvalues in increasing order by eigenvalue, returns the sum of all the eigenvalues.
+    double eigen(const Eigen::MatrixXd &cov, Eigen::MatrixXd &allEVals, Eigen::MatrixXd &allEVecs) const
+    {
+        if (randomized && (keep > 0)) {
+            const int count = (keep < 1) ? drop+1 : (int)keep + drop;
+            const double fraction = (keep < 1) ? keep : 0;
+            if (leadingEigen(cov, count, fraction, allEVals, allEVecs))
+                return cov.trace();
         }
 
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(cov);
+        allEVals = eSolver.eigenvalues();
+        allEVecs = eSolver.eigenvectors();
+        return allEVals.sum();
+    }
+
+    void keepLeading(const Eigen::MatrixXd &allEVals, const Eigen::MatrixXd &allEVecs, int dimsIn, double totalEnergy)
+    {
         if (keep <= 0) {
             keep = dimsIn - drop;
         } else if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const double totalEnergy = allEVals.sum();
             if (totalEnergy == 0) {
                 keep = 0;
             } else {
@@ -186,6 +570,8 @@ protected:
             if (whiten) eVecs.col(i) /= sqrt(eVals(i));
         }
 
+        if (fixedPoint) fixed.set(eVecs, mean);
+
         // Debug output
         if (Globals->verbose) qDebug() << "PCA Training:\n\tDimsIn =" << dimsIn << "\n\tKeep =" << keep;
     }
@@ -249,11 +635,16 @@ class RowWisePCATransform : public PCATransform
     {
         dst = cv::Mat(src.m().rows, keep, CV_32FC1);
 
-        for (int i=0; i<src.m().rows; i++) {
-            Eigen::Map<const Eigen::MatrixXf> inMap(src.m().ptr<float>(i), src.m().cols, 1);
-            Eigen::Map<Eigen::MatrixXf> outMap(dst.m().ptr<float>(i), keep, 1);
-            outMap = eVecs.transpose() * (inMap - mean);
-        }
+        // Each row is a column of the mapped input, project them all with one matrix product
+        const cv::Mat m = src.m().isContinuous() ? src.m() : src.m().clone();
+        Eigen::Map<const Eigen::MatrixXf> inMap(m.ptr<float>(), m.cols, m.rows);
+        Eigen::Map<Eigen::MatrixXf> outMap(dst.m().ptr<float>(), keep, m.rows);
+        outMap.noalias() = eVecs.transpose() * (inMap.colwise() - mean);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        Transform::project(src, dst);
     }
 };
 
@@ -310,6 +701,8 @@ BR_REGISTER(Transform, DFFSTransform)
  * \brief Projects input into learned Linear Discriminant Analysis subspace.
  * \author Brendan Klare \cite bklare
  * \author Josh Klontz \cite jklontz
+ *
+ * Set \em fixedPoint to project with an 8-bit copy of the projection, see br::FixedProjection.
  */
 class LDATransform : public Transform
 {
@@ -318,14 +711,17 @@ class LDATransform : public Transform
     Q_PROPERTY(bool pcaWhiten READ get_pcaWhiten WRITE set_pcaWhiten RESET reset_pcaWhiten STORED false)
     Q_PROPERTY(int directLDA READ get_directLDA WRITE set_directLDA RESET reset_directLDA STORED false)
     Q_PROPERTY(float directDrop READ get_directDrop WRITE set_directDrop RESET reset_directDrop STORED false)
+    Q_PROPERTY(bool fixedPoint READ get_fixedPoint WRITE set_fixedPoint RESET reset_fixedPoint STORED false)
     BR_PROPERTY(float, pcaKeep, 0.98)
     BR_PROPERTY(bool, pcaWhiten, false)
     BR_PROPERTY(int, directLDA, 0)
     BR_PROPERTY(float, directDrop, 0.1)
+    BR_PROPERTY(bool, fixedPoint, false)
 
     int dimsOut;
     Eigen::VectorXf mean;
     Eigen::MatrixXf projection;
+    FixedProjection fixed; // Of projection when fixedPoint
 
     void train(const TemplateList &_trainingSet)
     {
@@ -350,16 +746,25 @@ class LDATransform : public Transform
         QMap<int, int> classCounts = trainingSet.labelCounts();
         const int numClasses = classCounts.size();
 
-        // Map Eigen into OpenCV
-        Eigen::MatrixXd data = Eigen::MatrixXd(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Eigen::Map<const Eigen::MatrixXf>(ldaTrainingSet[i].m().ptr<float>(), dimsIn, 1).cast<double>();
+        // Compute class means
+        Eigen::MatrixXd classMeans = computeClassMeans(ldaTrainingSet, classes, numClasses);
 
-        // Removing class means
-        Eigen::MatrixXd classMeans = Eigen::MatrixXd::Zero(dimsIn, numClasses);
-        for (int i=0; i<instances; i++)  classMeans.col(classes[i]) += data.col(i);
-        for (int i=0; i<numClasses; i++) classMeans.col(i) /= classCounts[i];
-        for (int i=0; i<instances; i++)  data.col(i) -= classMeans.col(classes[i]);
+        // The within-class samples are only copied when there are fewer of them than dimensions,
+        // otherwise their scatter is accumulated directly.
+        const bool dominantEigenEstimation = (dimsIn > instances);
+        Eigen::MatrixXd data;
+        Scatter within;
+        if (dominantEigenEstimation) {
+            // Map Eigen into OpenCV and remove class means, each task fills its own columns
+            data = Eigen::MatrixXd(dimsIn, instances);
+            TaskGroup tasks;
+            for (int begin=0; begin<instances; begin+=Scatter_Block)
+                if (Globals->parallelism) tasks.run(centerBlock, &ldaTrainingSet, &classMeans, &classes, begin, &data);
+                else                                centerBlock (&ldaTrainingSet, &classMeans, &classes, begin, &data);
+            tasks.wait();
+        } else {
+            within = computeScatter(ldaTrainingSet, &classMeans, &classes);
+        }
 
         PCATransform space1;
 
@@ -371,7 +776,8 @@ class LDATransform : public Transform
             // one per class), the total rank of the covariance/scatter
             // matrix that will be computed in PCA is bound by instances - numClasses.
             space1.keep = std::min(dimsIn, instances-numClasses);
-            space1.train(data);
+            if (dominantEigenEstimation) space1.train(data);
+            else                         space1.train(within);
 
             // Divide each eigenvector by sqrt of eigenvalue.
             // This has the effect of whitening the within-class scatter.
@@ -382,7 +788,8 @@ class LDATransform : public Transform
         {
             space1.drop = instances - numClasses;
             space1.keep = std::min(dimsIn, instances) - space1.drop;
-            space1.train(data);
+            if (dominantEigenEstimation) space1.train(data);
+            else                         space1.train(within);
         }
         else
         {
@@ -394,7 +801,8 @@ class LDATransform : public Transform
             // to discard Null space). We keep the Null space b/c this is where
             // the within-class scatter goes to zero, i.e. it is very useful.
             space1.keep = dimsIn;
-            space1.train(data);
+            if (dominantEigenEstimation) space1.train(data);
+            else                         space1.train(within);
 
             if (dimsIn > instances - numClasses) {
                 // Here, we are replacing the eigenvalue of the  null space
@@ -463,10 +871,14 @@ class LDATransform : public Transform
         // Compute final projection matrix
         projection = ((space2.eVecs.transpose() * space1.eVecs.transpose()) * pca.eVecs.transpose()).transpose();
         dimsOut = dim2;
+        if (fixedPoint) fixed.set(projection, mean);
     }
 
     void project(const Template &src, Template &dst) const
     {
+        if (!fixed.isNull() && fixed.project(src, dst))
+            return;
+
         dst = cv::Mat(1, dimsOut, CV_32FC1);
 
         // Map Eigen into OpenCV
@@ -477,6 +889,12 @@ class LDATransform : public Transform
         outMap = projection.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!fixed.isNull() || !projectBatch(projection, mean, src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep << directLDA << directDrop << dimsOut << mean << projection;
@@ -485,6 +903,7 @@ class LDATransform : public Transform
     void load(QDataStream &stream)
     {
         stream >> pcaKeep >> directLDA >> directDrop >> dimsOut >> mean >> projection;
+        if (fixedPoint) fixed.set(projection, mean);
     }
 };
 
@@ -494,10 +913,28 @@ BR_REGISTER(Transform, LDATransform)
  * \ingroup distances
  * \brief L1 distance computed using eigen.
  * \author Josh Klontz \cite jklontz
+ *
+ * If \c reorder, training learns an order of the dimensions by decreasing variance
+ * so bounded comparisons (see br::Distance::compareBatchBounded()) can stop after fewer of them.
  */
 class L1Distance : public Distance
 {
     Q_OBJECT
+    Q_PROPERTY(bool reorder READ get_reorder WRITE set_reorder RESET reset_reorder STORED false)
+    BR_PROPERTY(bool, reorder, false)
+
+    QVector<int> order;
+
+    void train(const TemplateList &src)
+    {
+        if (!reorder || src.isEmpty()) return;
+        const int size = src.first().m().rows * src.first().m().cols;
+        QList<const float*> rows;
+        foreach (const Template &t, src)
+            if ((t.m().type() == CV_32FC1) && (t.m().rows * t.m().cols == size) && t.m().isContinuous())
+                rows.append((const float*)t.m().data);
+        if (!rows.isEmpty()) order = varianceOrder(rows, size);
+    }
 
     float compare(const Template &a, const Template &b) const
     {
@@ -506,6 +943,60 @@ class L1Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
         return (aMap-bMap).cwiseAbs().sum();
     }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0))
+            return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const int size = query.m().rows * query.m().cols;
+        DistanceKernels kernels;
+        if (specializeDistanceKernels(size, &kernels)) {
+            // Common template sizes have kernels without tails
+            const float *queryData = (const float*)query.m().data;
+            for (int i=0; i<count; i++)
+                scores[i] = kernels.floatL1((const float*)(data + i*stride), queryData, size);
+            return;
+        }
+
+        Eigen::Map<const Eigen::MatrixXf, 0, Eigen::OuterStride<> > targetsMap((const float*)data, size, count, Eigen::OuterStride<>(stride / sizeof(float)));
+        Eigen::Map<const Eigen::VectorXf> queryMap((const float*)query.m().data, size);
+        Eigen::Map<Eigen::RowVectorXf>(scores, count) = (targetsMap.colwise() - queryMap).cwiseAbs().colwise().sum();
+    }
+
+    void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+    {
+        // Partial sums only grow, so only an upper bound on the distance lets a comparison stop
+        (void) lower;
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0) || (upper == std::numeric_limits<float>::max()))
+            return compareBatch(targets, query, scores, offset, count);
+
+        const float *queryData = (const float*)query.m().data;
+        const int size = query.m().rows * query.m().cols;
+        DistanceKernels kernels;
+        specializeDistanceKernels(BoundedBlock, &kernels);
+        for (int i=0; i<count; i++)
+            scores[i] = boundedSum(kernels.floatL1, distanceKernels.floatL1, (const float*)(data + i*stride), queryData, size, order, upper);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        if (reorder) stream << order;
+    }
+
+    void load(QDataStream &stream)
+    {
+        if (reorder) stream >> order;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L1Distance)
@@ -514,10 +1005,28 @@ BR_REGISTER(Distance, L1Distance)
  * \ingroup distances
  * \brief L2 distance computed using eigen.
  * \author Josh Klontz \cite jklontz
+ *
+ * If \c reorder, training learns an order of the dimensions by decreasing variance
+ * so bounded comparisons (see br::Distance::compareBatchBounded()) can stop after fewer of them.
  */
 class L2Distance : public Distance
 {
     Q_OBJECT
+    Q_PROPERTY(bool reorder READ get_reorder WRITE set_reorder RESET reset_reorder STORED false)
+    BR_PROPERTY(bool, reorder, false)
+
+    QVector<int> order;
+
+    void train(const TemplateList &src)
+    {
+        if (!reorder || src.isEmpty()) return;
+        const int size = src.first().m().rows * src.first().m().cols;
+        QList<const float*> rows;
+        foreach (const Template &t, src)
+            if ((t.m().type() == CV_32FC1) && (t.m().rows * t.m().cols == size) && t.m().isContinuous())
+                rows.append((const float*)t.m().data);
+        if (!rows.isEmpty()) order = varianceOrder(rows, size);
+    }
 
     float compare(const Template &a, const Template &b) const
     {
@@ -526,10 +1035,140 @@ class L2Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
         return (aMap-bMap).squaredNorm();
     }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0))
+            return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const int size = query.m().rows * query.m().cols;
+        DistanceKernels kernels;
+        if (specializeDistanceKernels(size, &kernels)) {
+            // Common template sizes have kernels without tails
+            const float *queryData = (const float*)query.m().data;
+            for (int i=0; i<count; i++)
+                scores[i] = kernels.floatL2((const float*)(data + i*stride), queryData, size);
+            return;
+        }
+
+        Eigen::Map<const Eigen::MatrixXf, 0, Eigen::OuterStride<> > targetsMap((const float*)data, size, count, Eigen::OuterStride<>(stride / sizeof(float)));
+        Eigen::Map<const Eigen::VectorXf> queryMap((const float*)query.m().data, size);
+        Eigen::Map<Eigen::RowVectorXf>(scores, count) = (targetsMap.colwise() - queryMap).colwise().squaredNorm();
+    }
+
+    void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+    {
+        // Partial sums only grow, so only an upper bound on the distance lets a comparison stop
+        (void) lower;
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0) || (upper == std::numeric_limits<float>::max()))
+            return compareBatch(targets, query, scores, offset, count);
+
+        const float *queryData = (const float*)query.m().data;
+        const int size = query.m().rows * query.m().cols;
+        DistanceKernels kernels;
+        specializeDistanceKernels(BoundedBlock, &kernels);
+        for (int i=0; i<count; i++)
+            scores[i] = boundedSum(kernels.floatL2, distanceKernels.floatL2, (const float*)(data + i*stride), queryData, size, order, upper);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        if (reorder) stream << order;
+    }
+
+    void load(QDataStream &stream)
+    {
+        if (reorder) stream >> order;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L2Distance)
 
+/*!
+ * \ingroup distances
+ * \brief Dot product computed a tile at a time as one matrix product using eigen.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Intended for normalized floating point embeddings, where the dot product is the cosine similarity.
+ * If \em squaredL2 is \c true the squared L2 distance is recovered from the same product, matching br::L2Distance.
+ */
+class DotProductDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool squaredL2 READ get_squaredL2 WRITE set_squaredL2 RESET reset_squaredL2 STORED false)
+    BR_PROPERTY(bool, squaredL2, false)
+
+    float compare(const Template &a, const Template &b) const
+    {
+        const int size = a.m().rows * a.m().cols;
+        Eigen::Map<Eigen::VectorXf> aMap((float*)a.m().data, size);
+        Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
+        return squaredL2 ? (aMap-bMap).squaredNorm() : aMap.dot(bMap);
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0))
+            return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const int size = query.m().rows * query.m().cols;
+        Eigen::Map<const Eigen::MatrixXf, 0, Eigen::OuterStride<> > targetsMap((const float*)data, size, count, Eigen::OuterStride<>(stride / sizeof(float)));
+        Eigen::Map<const Eigen::VectorXf> queryMap((const float*)query.m().data, size);
+        if (squaredL2) Eigen::Map<Eigen::RowVectorXf>(scores, count) = (targetsMap.colwise() - queryMap).colwise().squaredNorm();
+        else           Eigen::Map<Eigen::VectorXf>(scores, count) = targetsMap.transpose() * queryMap;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile, const TargetFilter *filter) const
+    {
+        size_t stride;
+        const Template &first = query[tile.y()];
+        const uchar *data = filter ? NULL : contiguousData(target, first, tile.x(), &stride);
+        if ((data == NULL) || (stride % sizeof(float) != 0) || (first.m().depth() != CV_32F))
+            return Distance::compareBlock(target, query, output, tile, filter);
+
+        // Gather the query tile, queries are rarely aligned and only a few are compared at a time
+        const int size = first.m().rows * first.m().cols;
+        Eigen::MatrixXf queries(size, tile.height());
+        for (int i=0; i<tile.height(); i++) {
+            const Template &q = query[tile.y()+i];
+            if ((q.size() != 1) || (q.m().type() != first.m().type()) || (q.m().rows * q.m().cols != size) || !q.m().isContinuous())
+                return Distance::compareBlock(target, query, output, tile, filter);
+            queries.col(i) = Eigen::Map<const Eigen::VectorXf>(q.m().ptr<float>(), size);
+        }
+
+        Eigen::Map<const Eigen::MatrixXf, 0, Eigen::OuterStride<> > targetsMap((const float*)data, size, tile.width(), Eigen::OuterStride<>(stride / sizeof(float)));
+        Eigen::MatrixXf scores = targetsMap.transpose() * queries;
+        if (squaredL2) {
+            // |t-q|^2 = |t|^2 + |q|^2 - 2 t.q
+            scores *= -2;
+            scores.colwise() += targetsMap.colwise().squaredNorm().transpose();
+            scores.rowwise() += queries.colwise().squaredNorm();
+        }
+
+        // Each column of the product is a contiguous row of scores
+        for (int i=0; i<tile.height(); i++)
+            output->setRelative(scores.col(i).data(), tile.y()+i, tile.x(), tile.width());
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, DotProductDistance)
+
 } // namespace br
 
 #include "eigen3.moc"
@@ -37,6 +37,7 @@
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 
 using namespace cv;
 
@@ -60,6 +61,22 @@ class ASEFEyesTransform : public UntrainableTransform
     Rect left_rect, right_rect;
     int width, height;
 
+    // Buffers reused by each thread across faces
+    struct Workspace
+    {
+        Mat gray, image_tile, image, left_corr, right_corr;
+    };
+    mutable ThreadLocal<Workspace> workspaces;
+
+    // Rolls the filter down so the correlation rows of the search window start at row zero
+    static Mat rollRows(const Mat &filter, int rows)
+    {
+        Mat rolled(filter.size(), filter.type());
+        filter.rowRange(filter.rows-rows, filter.rows).copyTo(rolled.rowRange(0, rows));
+        filter.rowRange(0, filter.rows-rows).copyTo(rolled.rowRange(rows, filter.rows));
+        return rolled;
+    }
+
 public:
     ASEFEyesTransform()
     {
@@ -135,9 +152,10 @@ public:
         left_filter_dft  = Mat(r, c, CV_32F);
         right_filter_dft = Mat(r, c, CV_32F);
 
-        // Compute the filters in the Fourier domain
-        dft(left_filter, left_filter_dft, CV_DXT_FORWARD);
-        dft(right_filter, right_filter_dft, CV_DXT_FORWARD);
+        // Compute the filters in the Fourier domain,
+        // rolled so that only the first rows of each inverse transform are needed
+        dft(rollRows(left_filter, left_rect.y), left_filter_dft, CV_DXT_FORWARD);
+        dft(rollRows(right_filter, right_rect.y), right_filter_dft, CV_DXT_FORWARD);
 
         // Create the look up table for the log transform
         lut = Mat(256, 1, CV_32F);
@@ -148,37 +166,35 @@ private:
     void project(const Template &src, Template &dst) const
     {
         Rect roi = OpenCVUtils::toRect(src.file.rects().first());
+        Workspace &w = workspaces.local();
+        Mat &gray = w.gray;
 
-        Mat gray;
         OpenCVUtils::cvtGray(src.m()(roi), gray);
 
-        Mat image_tile;
         // (r,c) == (128, 128) EyeLocatorASEF128x128.fel
-        resize(gray, image_tile, Size(height, width));
+        resize(gray, w.image_tile, Size(height, width));
 
         // _preprocess
-        Mat image;
-        LUT(image_tile, lut, image);
+        LUT(w.image_tile, lut, w.image);
 
-        // correlate
-        Mat left_corr, right_corr;
-        dft(image, image, CV_DXT_FORWARD);
-        mulSpectrums(image, left_filter_dft, left_corr, 0, true);
-        mulSpectrums(image, right_filter_dft, right_corr, 0, true);
-        dft(left_corr, left_corr, CV_DXT_INV_SCALE);
-        dft(right_corr, right_corr, CV_DXT_INV_SCALE);
+        // correlate, only computing the rows of the inverse covering the search windows
+        dft(w.image, w.image, CV_DXT_FORWARD);
+        mulSpectrums(w.image, left_filter_dft, w.left_corr, 0, true);
+        mulSpectrums(w.image, right_filter_dft, w.right_corr, 0, true);
+        dft(w.left_corr, w.left_corr, CV_DXT_INV_SCALE, left_rect.height);
+        dft(w.right_corr, w.right_corr, CV_DXT_INV_SCALE, right_rect.height);
 
         // locateEyes
         double minVal, maxVal;
         Point minLoc, maxLoc;
 
         // left_rect == (23, 35)  (32, 32) EyeLocatorASEF128x128.fel
-        minMaxLoc(left_corr(left_rect), &minVal, &maxVal, &minLoc, &maxLoc);
+        minMaxLoc(w.left_corr(Rect(left_rect.x, 0, left_rect.width, left_rect.height)), &minVal, &maxVal, &minLoc, &maxLoc);
         float first_eye_x = (left_rect.x + maxLoc.x)*gray.cols/width+roi.x;
         float first_eye_y = (left_rect.y + maxLoc.y)*gray.rows/height+roi.y;
 
         // right_rect == (71, 32)  (32, 32) EyeLocatorASEF128x128.fel
-        minMaxLoc(right_corr(right_rect), &minVal, &maxVal, &minLoc, &maxLoc);
+        minMaxLoc(w.right_corr(Rect(right_rect.x, 0, right_rect.width, right_rect.height)), &minVal, &maxVal, &minLoc, &maxLoc);
         float second_eye_x = (right_rect.x + maxLoc.x)*gray.cols/width+roi.x;
         float second_eye_y = (right_rect.y + maxLoc.y)*gray.rows/height+roi.y;
 
@@ -17,6 +17,8 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/tanh_sse.h"
 
 using namespace cv;
@@ -24,6 +26,16 @@ using namespace cv;
 namespace br
 {
 
+static Size gaussianKernelSize(double sigma)
+{
+    // Inverts OpenCV's conversion from kernel size to sigma:
+    // sigma = ((ksize-1)*0.5 - 1)*0.3 + 0.8
+    // See documentation for cv::getGaussianKernel()
+    int ksize = ((sigma - 0.8) / 0.3 + 1) * 2 + 1;
+    if (ksize % 2 == 0) ksize++;
+    return Size(ksize, ksize);
+}
+
 /*!
  * \ingroup transforms
  * \brief Gamma correction
@@ -63,9 +75,15 @@ class BlurTransform : public UntrainableTransform
     Q_PROPERTY(float sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
     BR_PROPERTY(float, sigma, 1)
 
+    int tileHalo() const
+    {
+        // The widest kernel GaussianBlur() derives from sigma, for floating point source
+        return (cvRound(sigma*4*2 + 1) | 1)/2;
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        GaussianBlur(src, dst, Size(0,0), sigma);
+        GaussianBlur(src, MatArena::output(dst), Size(0,0), sigma);
     }
 };
 
@@ -86,20 +104,10 @@ class DoGTransform : public UntrainableTransform
 
     Size ksize0, ksize1;
 
-    static Size getKernelSize(double sigma)
-    {
-        // Inverts OpenCV's conversion from kernel size to sigma:
-        // sigma = ((ksize-1)*0.5 - 1)*0.3 + 0.8
-        // See documentation for cv::getGaussianKernel()
-        int ksize = ((sigma - 0.8) / 0.3 + 1) * 2 + 1;
-        if (ksize % 2 == 0) ksize++;
-        return Size(ksize, ksize);
-    }
-
     void init()
     {
-        ksize0 = getKernelSize(sigma0);
-        ksize1 = getKernelSize(sigma1);
+        ksize0 = gaussianKernelSize(sigma0);
+        ksize1 = gaussianKernelSize(sigma1);
     }
 
     void project(const Template &src, Template &dst) const
@@ -125,38 +133,52 @@ class CSDNTransform : public UntrainableTransform
 {
     Q_OBJECT
 
-    Q_PROPERTY(float s READ get_s WRITE set_s RESET reset_s STORED false)
+    Q_PROPERTY(int s READ get_s WRITE set_s RESET reset_s STORED false)
     BR_PROPERTY(int, s, 16)
 
-    void project(const Template &src, Template &dst) const
+    // Subtracts the mean of the window [j-s/2, j+s/2) x [i-s/2, i+s/2), clipped to the image, read from the integral image
+    void normalizeRows(const Mat *src, const Mat *integral, int begin, int end, Mat *dst) const
     {
-        if (src.m().channels() != 1) qFatal("Expected single channel source matrix.");
-
-        const int nRows = src.m().rows;
-        const int nCols = src.m().cols;
-
-        Mat m;
-        src.m().convertTo(m, CV_32FC1);
-
         const int surround = s/2;
-
-        for ( int i = 0; i < nRows; i++ )
-        {
-            for ( int j = 0; j < nCols; j++ )
-            {
-                int width = min( j+surround, nCols ) - max( 0, j-surround );
-                int height = min( i+surround, nRows ) - max( 0, i-surround );
-
-                Rect_<int> ROI(max(0, j-surround), max(0, i-surround), width, height);
-
-                Scalar_<float> avg = mean(m(ROI));
-
-                m.at<float>(i,j) = m.at<float>(i,j) - avg[0];
+        const int nRows = src->rows;
+        const int nCols = src->cols;
+        for (int i=begin; i<end; i++) {
+            const int top = std::max(0, i-surround);
+            const int bottom = std::min(i+surround, nRows);
+            const double *itop = integral->ptr<double>(top);
+            const double *ibottom = integral->ptr<double>(bottom);
+            const float *in = src->ptr<float>(i);
+            float *out = dst->ptr<float>(i);
+            for (int j=0; j<nCols; j++) {
+                const int left = std::max(0, j-surround);
+                const int right = std::min(j+surround, nCols);
+                const int area = (bottom-top) * (right-left);
+                const double sum = ibottom[right] - ibottom[left] - itop[right] + itop[left];
+                out[j] = (area > 0) ? in[j] - float(sum / area) : in[j];
             }
         }
+    }
 
-     dst = m;
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().channels() != 1) qFatal("Expected single channel source matrix.");
 
+        Mat m, sums;
+        src.m().convertTo(m, CV_32FC1);
+        integral(m, sums, CV_64F);
+
+        Mat &out = MatArena::output(dst);
+        out.create(m.size(), CV_32FC1);
+
+        // Large images are split into bands of rows
+        const int band = std::max(1, (1 << 18) / std::max(1, m.cols));
+        TaskGroup tasks;
+        for (int i=0; i<m.rows; i += band) {
+            const int end = std::min(i+band, m.rows);
+            if (Globals->parallelism && (m.rows > band)) tasks.run(this, &CSDNTransform::normalizeRows, &m, &sums, i, end, &out);
+            else                                         normalizeRows(&m, &sums, i, end, &out);
+        }
+        tasks.wait();
     }
 };
 
@@ -220,6 +242,102 @@ class ContrastEqTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, ContrastEqTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Tan and Triggs preprocessing, equivalent to <tt>Blur(sigma)+Gamma(gamma)+DoG(sigma0,sigma1)+ContrastEq(a,t)</tt>.
+ *
+ * The difference of gaussians and both contrast equalization stages are fused into three passes over one scratch image,
+ * which comes from br::MatArena along with the blurs.
+ * Arithmetic matches the separate transforms operation for operation, so the output is the same.
+ * \author Josh Klontz \cite jklontz
+ * \see ContrastEqTransform
+ */
+class TanTriggsTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(float sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
+    Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
+    Q_PROPERTY(float sigma0 READ get_sigma0 WRITE set_sigma0 RESET reset_sigma0 STORED false)
+    Q_PROPERTY(float sigma1 READ get_sigma1 WRITE set_sigma1 RESET reset_sigma1 STORED false)
+    Q_PROPERTY(float a READ get_a WRITE set_a RESET reset_a STORED false)
+    Q_PROPERTY(float t READ get_t WRITE set_t RESET reset_t STORED false)
+    BR_PROPERTY(float, sigma, 1.1)
+    BR_PROPERTY(float, gamma, 0.2)
+    BR_PROPERTY(float, sigma0, 1)
+    BR_PROPERTY(float, sigma1, 2)
+    BR_PROPERTY(float, a, 0.1)
+    BR_PROPERTY(float, t, 10)
+
+    Mat lut;
+    Size ksize0, ksize1;
+
+    void init()
+    {
+        lut.create(256, 1, CV_32FC1);
+        if (gamma == 0) for (int i=0; i<256; i++) lut.at<float>(i,0) = log((float)i);
+        else            for (int i=0; i<256; i++) lut.at<float>(i,0) = pow(i, gamma);
+        ksize0 = gaussianKernelSize(sigma0);
+        ksize1 = gaussianKernelSize(sigma1);
+    }
+
+    // Same expression as ContrastEqTransform, pow() and mean() over the whole image
+    float denominator(Mat &powers) const
+    {
+        pow(powers, a, powers);
+        return pow((float)mean(powers)[0], 1.f/a);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().channels() != 1) qFatal("Expected single channel source matrix.");
+
+        Mat blurred, corrected, g0, g1, powers;
+        GaussianBlur(src, MatArena::output(blurred), Size(0,0), sigma);
+        LUT(blurred, lut, MatArena::output(corrected));
+        GaussianBlur(corrected, MatArena::output(g0), ksize0, 0);
+        GaussianBlur(corrected, MatArena::output(g1), ksize1, 0);
+        MatArena::output(powers).create(g0.size(), CV_32FC1);
+
+        const int nRows = g0.rows;
+        const int nCols = g0.cols;
+
+        // Difference of gaussians, kept in g0
+        for (int i=0; i<nRows; i++) {
+            float *d = g0.ptr<float>(i);
+            const float *b = g1.ptr<float>(i);
+            float *p = powers.ptr<float>(i);
+            for (int j=0; j<nCols; j++) {
+                d[j] = d[j] - b[j];
+                p[j] = std::abs(d[j]);
+            }
+        }
+
+        // Stage 1, kept in g0
+        const float scale1 = 1/denominator(powers);
+        for (int i=0; i<nRows; i++) {
+            float *d = g0.ptr<float>(i);
+            float *p = powers.ptr<float>(i);
+            for (int j=0; j<nCols; j++) {
+                d[j] = d[j]*scale1 + 0.f;
+                p[j] = std::min(std::abs(d[j]), t);
+            }
+        }
+
+        // Stage 2 and hyperbolic tangent
+        const float scale2 = 1/denominator(powers);
+        Mat &m = MatArena::output(dst);
+        m.create(nRows, nCols, CV_32FC1);
+        for (int i=0; i<nRows; i++) {
+            const float *d = g0.ptr<float>(i);
+            float *o = m.ptr<float>(i);
+            for (int j=0; j<nCols; j++)
+                o[j] = fast_tanh(d[j]*scale2 + 0.f);
+        }
+    }
+};
+
+BR_REGISTER(Transform, TanTriggsTransform)
+
 /*!
  * \ingroup transforms
  * \brief Raise each element to the specified power.
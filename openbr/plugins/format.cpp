@@ -14,16 +14,16 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicInt>
 #include <QDate>
 #ifndef BR_EMBEDDED
-#include <QNetworkAccessManager>
-#include <QNetworkReply>
 #include <QtXml>
 #endif // BR_EMBEDDED
 #include <opencv2/highgui/highgui.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/bee.h"
+#include "openbr/core/network.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
@@ -36,6 +36,7 @@ namespace br
  * \ingroup formats
  * \brief Read all frames of a video using OpenCV 
  * \author Charles Otto \cite caotto
+ * \note Every frame is decoded into memory, use br::aviGallery to stream long videos.
  */
 class videoFormat : public Format
 {
@@ -185,10 +186,47 @@ class csvFormat : public Format
 
 BR_REGISTER(Format, csvFormat)
 
+// Which of the paths tried by resolveImagePath() last existed, tried first since files in a gallery tend to resolve alike
+static QAtomicInt LastCandidate;
+
+static QString candidatePath(const File &file, int candidate)
+{
+    switch (candidate) {
+      case 0:  return file.name;
+      case 1:  return file.get<QString>("path") + "/" + file.name;
+      case 2:  return file.fileName();
+      default: return file.get<QString>("path") + "/" + file.fileName();
+    }
+}
+
+/*!
+ * \brief Returns the path of an image named by \em file, or an empty string if there isn't one.
+ *
+ * The name is tried as is, relative to \c path, and by its file name alone in both places.
+ */
+QString resolveImagePath(const File &file)
+{
+    const int last = LastCandidate.load();
+    QString fileName = candidatePath(file, last);
+    if (QFileInfo(fileName).exists()) return fileName;
+    for (int i=0; i<4; i++) {
+        if (i == last) continue;
+        fileName = candidatePath(file, i);
+        if (QFileInfo(fileName).exists()) {
+            LastCandidate.store(i);
+            return fileName;
+        }
+    }
+    return QString();
+}
+
 /*!
  * \ingroup formats
  * \brief Reads image files.
  * \author Josh Klontz \cite jklontz
+ *
+ * Images are decoded in grayscale if \c DecodeGray is set, see br::OpenTransform.
+ * Files that aren't images are read as videos.
  */
 class DefaultFormat : public Format
 {
@@ -198,39 +236,23 @@ class DefaultFormat : public Format
     {
         Template t;
 
-        if (file.name.startsWith("http://") || file.name.startsWith("www.")) {
-#ifndef BR_EMBEDDED
-            QNetworkAccessManager networkAccessManager;
-            QNetworkRequest request(file.name);
-            request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
-            QNetworkReply *reply = networkAccessManager.get(request);
-
-            while (!reply->isFinished()) QCoreApplication::processEvents();
-            if (reply->error()) qWarning("Url::read %s (%s).\n", qPrintable(reply->errorString()), qPrintable(QString::number(reply->error())));
-
-            QByteArray data = reply->readAll();
-            delete reply;
-
-            Mat m = imdecode(Mat(1, data.size(), CV_8UC1, data.data()), 1);
-            if (m.data) t.append(m);
-#endif // BR_EMBEDDED
-        } else {
-            QString fileName = file.name;
-            if (!QFileInfo(fileName).exists()) {
-                fileName = file.get<QString>("path") + "/" + file.name;
-                if (!QFileInfo(fileName).exists()) {
-                    fileName = file.fileName();
-                    if (!QFileInfo(fileName).exists()) {
-                        fileName = file.get<QString>("path") + "/" + file.fileName();
-                        if (!QFileInfo(fileName).exists()) return t;
-                    }
-                }
+        if (Network::isUrl(file.name)) {
+            // Shares the connection pool, and any prefetch, with every other worker
+            QString error;
+            QByteArray data = Network::get(file.name, &error);
+            if (!error.isEmpty()) qWarning("Url::read %s.\n", qPrintable(error));
+            if (!data.isEmpty()) {
+                Mat m = imdecode(Mat(1, data.size(), CV_8UC1, data.data()), 1);
+                if (m.data) t.append(m);
             }
+        } else {
+            const QString fileName = resolveImagePath(file);
+            if (fileName.isEmpty()) return t;
 
-            Mat m = imread(fileName.toStdString());
+            Mat m = imread(fileName.toStdString(), file.get<bool>("DecodeGray", false) ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
             if (m.data) {
                 t.append(m);
-            } else {
+            } else if (!isImage(fileName)) {
                 videoFormat videoReader;
                 videoReader.file = file;
                 t = videoReader.read();
@@ -240,6 +262,13 @@ class DefaultFormat : public Format
         return t;
     }
 
+    // Still images that fail to decode aren't retried as videos
+    static bool isImage(const QString &fileName)
+    {
+        static const QStringList suffixes = QStringList() << "bmp" << "jpeg" << "jpg" << "pgm" << "png" << "ppm" << "tif" << "tiff";
+        return suffixes.contains(QFileInfo(fileName).suffix().toLower());
+    }
+
     void write(const Template &t) const
     {
         if (t.size() > 1) {
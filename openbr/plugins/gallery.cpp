@@ -15,70 +15,1222 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtConcurrentRun>
+#include <QMutex>
+#include <QQueue>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QWaitCondition>
 #ifndef BR_EMBEDDED
-#include <QNetworkAccessManager>
-#include <QNetworkReply>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QSqlRecord>
 #endif // BR_EMBEDDED
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <opencv2/highgui/highgui.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "NaturalStringCompare.h"
 #include "openbr/core/bee.h"
+#include "openbr/core/codec.h"
+#include "openbr/core/columns.h"
+#include "openbr/core/metrics.h"
+#include "openbr/core/network.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/packed.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
 namespace br
 {
 
+// Serialized bytes at source copied to offset in a destination gallery, see Gallery::append()
+struct ByteRun
+{
+    const uchar *source;
+    qint64 offset, bytes;
+};
+
+static void copyBytes(const uchar *source, uchar *destination, qint64 bytes)
+{
+    memcpy(destination, source, size_t(bytes));
+}
+
+// Runs are contiguous and in order, starting at or before the end of destination.
+// They are copied into a mapping of the destination in pieces spread across the I/O workers, or written in order if it can't be mapped.
+static bool copyRuns(QFile &destination, const QList<ByteRun> &runs)
+{
+    if (runs.isEmpty()) return true;
+    const qint64 begin = runs.first().offset;
+    const qint64 end = runs.last().offset + runs.last().bytes;
+    if (!destination.resize(end)) return false;
+
+    uchar *mapped = destination.map(begin, end - begin);
+    if (!mapped) {
+        if (!destination.resize(begin)) return false;
+        foreach (const ByteRun &run, runs)
+            if (!destination.seek(run.offset) || (destination.write((const char*)run.source, run.bytes) != run.bytes))
+                return false;
+        return true;
+    }
+
+    const qint64 piece = qint64(1) << 26;
+    TaskGroup tasks(Parallel::IO);
+    foreach (const ByteRun &run, runs)
+        for (qint64 i=0; i<run.bytes; i+=piece)
+            tasks.run(&copyBytes, run.source + i, mapped + (run.offset - begin) + i, std::min(piece, run.bytes - i));
+    tasks.wait();
+    destination.unmap(mapped);
+    return true;
+}
+
+/*!
+ * \ingroup galleries
+ * \brief A binary gallery.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Templates are written with br::TemplateCodec, set \c compress to deflate each template
+ * or \c legacy to write the plain br::Template stream read by older releases.
+ * Galleries in either encoding, or a mix of both from appending, are read.
+ *
+ * Set \c columns to also keep a br::MetadataColumns sidecar, written when the gallery is closed from the metadata of the templates written to it.
+ * files() reads metadata from the sidecar instead of the templates while it matches the gallery's size and modification time.
+ *
+ * Whole \c .gal galleries starting with a br::TemplateCodec segment are appended by copying their bytes,
+ * as they read the same after any other stream.
+ */
+class galGallery : public Gallery
+{
+    Q_OBJECT
+    QFile gallery;
+    QDataStream stream;
+    TemplateCodec reader, writer;
+    bool legacy, columns, written;
+    FileList writtenFiles; // Metadata for the sidecar, accumulated as it is written
+    bool stale; // The gallery held templates when opened that aren't in writtenFiles
+
+    ~galGallery()
+    {
+        if (!columns || !written) return;
+        gallery.flush();
+        MetadataColumns sidecar = MetadataColumns::fromFiles(stale ? readFiles() : writtenFiles);
+        sidecar.stamp(QFileInfo(gallery.fileName()));
+        sidecar.save(MetadataColumns::sidecar(gallery.fileName()));
+    }
+
+    void init()
+    {
+        gallery.setFileName(file);
+        if (file.get<bool>("remove", false))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+        if (!gallery.open(QFile::ReadWrite | QFile::Append))
+            qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
+        stream.setDevice(&gallery);
+        writer = TemplateCodec(file.get<bool>("compress", false) ? TemplateCodec::Compressed : 0);
+        legacy = file.get<bool>("legacy", false);
+        columns = file.get<bool>("columns", false);
+        written = false;
+        writtenFiles.clear();
+        stale = false;
+        if (columns && (gallery.size() > 0)) {
+            MetadataColumns sidecar;
+            if (sidecar.load(MetadataColumns::sidecar(gallery.fileName())) && sidecar.describes(QFileInfo(gallery.fileName())))
+                writtenFiles = sidecar.files();
+            else
+                stale = true;
+        }
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (stream.atEnd()) {
+            gallery.seek(0);
+            reader.reset();
+        }
+
+        TemplateList templates;
+        Template t;
+        while ((templates.size() < Globals->blockSize) && reader.read(stream, t))
+            templates.append(t);
+
+        *done = stream.atEnd();
+        return templates;
+    }
+
+    FileList files()
+    {
+        gallery.flush();
+        MetadataColumns sidecar;
+        if (sidecar.load(MetadataColumns::sidecar(gallery.fileName())) && sidecar.describes(QFileInfo(gallery.fileName())))
+            return sidecar.files();
+        return readFiles();
+    }
+
+    FileList readFiles()
+    {
+        gallery.seek(0);
+        reader.reset();
+
+        FileList files;
+        File file;
+        while (reader.readFile(stream, file))
+            files.append(file);
+
+        return files;
+    }
+
+    void write(const Template &t)
+    {
+        if (legacy) stream << t;
+        else        writer.write(stream, t);
+        if (columns) writtenFiles.append(t.file);
+        written = true;
+    }
+
+    bool append(const FileList &sources)
+    {
+        if (legacy) return false;
+
+        // Templates can't be selected without decoding them, as the keys of a segment are spelled out only once
+        QList< QSharedPointer<QFile> > inputs;
+        foreach (const File &source, sources) {
+            if ((source.suffix() != "gal") || Network::isUrl(source.name) ||
+                source.contains("pos") || source.contains("length") || source.contains("step")) return false;
+            QSharedPointer<QFile> input(new QFile(source.name));
+            if (!input->open(QFile::ReadOnly)) return false;
+            if ((input->size() > 0) && !TemplateCodec::startsSegment(input->peek(4))) return false;
+            inputs.append(input);
+        }
+
+        gallery.flush();
+        QList<ByteRun> runs;
+        qint64 offset = gallery.size();
+        foreach (const QSharedPointer<QFile> &input, inputs) {
+            if (input->size() == 0) continue;
+            const uchar *data = input->map(0, input->size());
+            if (!data) qFatal("Can't map gallery: %s", qPrintable(input->fileName()));
+            const ByteRun run = { data, offset, input->size() };
+            runs.append(run);
+            offset += run.bytes;
+        }
+
+        if (!copyRuns(gallery, runs))
+            qFatal("Failed to write gallery: %s", qPrintable(gallery.fileName()));
+        if (!runs.isEmpty()) writer.reset(); // The copied segments define their own keys, so the next template starts a new segment
+        if (columns)
+            foreach (const QSharedPointer<QFile> &input, inputs) {
+                input->seek(0);
+                QDataStream inputStream(input.data());
+                TemplateCodec inputReader;
+                File inputFile;
+                while (inputReader.readFile(inputStream, inputFile))
+                    writtenFiles.append(inputFile);
+            }
+        written = true;
+        return true;
+    }
+};
+
+BR_REGISTER(Gallery, galGallery)
+
+/*!
+ * \ingroup initializers
+ * \brief Initialization support for kvGallery.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Compactions run on the global thread pool after a gallery is closed.
+ * Opening a gallery waits for its pending compaction, and the context waits for all of them when it is finalized.
+ */
+class KeyedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    static QHash<QString, QFuture<void> > compactions;
+    static QMutex lock;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        foreach (QFuture<void> compaction, compactions)
+            compaction.waitForFinished();
+        compactions.clear();
+    }
+
+public:
+    /*!
+     * \brief The newest record of each template name in a keyed gallery.
+     */
+    struct Index
+    {
+        QHash<QString,int> latest;
+        QSet<QString> deleted;
+        int records;
+
+        Index() : records(0) {}
+
+        void insert(const File &file)
+        {
+            latest[file.name] = records++;
+            if (file.get<bool>("Deleted", false)) deleted.insert(file.name);
+            else                                  deleted.remove(file.name);
+        }
+
+        bool live(const File &file, int record) const
+        {
+            return (latest.value(file.name, -1) == record) && !deleted.contains(file.name);
+        }
+
+        int garbage() const
+        {
+            return records - (latest.size() - deleted.size());
+        }
+    };
+
+    static void wait(const QString &fileName)
+    {
+        QFuture<void> compaction;
+        {
+            QMutexLocker locker(&lock);
+            compaction = compactions.value(fileName);
+        }
+        compaction.waitForFinished();
+    }
+
+    static void compact(const QString &fileName, int flags)
+    {
+        QMutexLocker locker(&lock);
+        compactions.insert(fileName, QtConcurrent::run(&KeyedGalleries::rewrite, fileName, flags));
+    }
+
+private:
+    static void rewrite(const QString &fileName, int flags)
+    {
+        QFile src(fileName);
+        if (!src.open(QFile::ReadOnly)) return;
+        QDataStream in(&src);
+        TemplateCodec reader;
+
+        Index index;
+        File file;
+        while (reader.readFile(in, file))
+            index.insert(file);
+
+        src.seek(0);
+        reader.reset();
+        QFile dst(fileName + ".tmp");
+        if (!dst.open(QFile::WriteOnly))
+            qFatal("Can't open gallery: %s", qPrintable(dst.fileName()));
+        QDataStream out(&dst);
+        TemplateCodec writer(flags);
+
+        Template t;
+        for (int record=0; reader.read(in, t); record++)
+            if (index.live(t.file, record))
+                writer.write(out, t);
+
+        src.close();
+        dst.close();
+        if (!QFile::remove(fileName) || !QFile::rename(dst.fileName(), fileName))
+            qWarning("Failed to compact gallery: %s", qPrintable(fileName));
+    }
+};
+
+QHash<QString, QFuture<void> > KeyedGalleries::compactions;
+QMutex KeyedGalleries::lock;
+
+BR_REGISTER(Initializer, KeyedGalleries)
+
+/*!
+ * \ingroup galleries
+ * \brief A binary gallery keyed by file name that supports updates and deletes.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Records are appended with br::TemplateCodec like galGallery.
+ * Writing a template whose name is already in the gallery replaces it,
+ * and writing a template with \c Deleted metadata set records a tombstone that removes it.
+ * Only the newest live record of each name is read.
+ * When the gallery is closed after writes that leave more than \c compact (default 0.5) of the records superseded,
+ * the live records are rewritten in the background.
+ * Set \c compress to deflate each template.
+ */
+class kvGallery : public Gallery
+{
+    Q_OBJECT
+    QFile gallery;
+    QDataStream stream;
+    TemplateCodec reader, writer;
+    KeyedGalleries::Index index;
+    int flags, record;
+    bool modified;
+
+    ~kvGallery()
+    {
+        if (!modified) return;
+        gallery.close();
+        if (index.garbage() > file.get<float>("compact", 0.5) * index.records)
+            KeyedGalleries::compact(gallery.fileName(), flags);
+    }
+
+    void init()
+    {
+        KeyedGalleries::wait(file);
+        gallery.setFileName(file);
+        if (file.get<bool>("remove", false))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+        if (!gallery.open(QFile::ReadWrite | QFile::Append))
+            qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
+        stream.setDevice(&gallery);
+        flags = file.get<bool>("compress", false) ? TemplateCodec::Compressed : 0;
+        writer = TemplateCodec(flags);
+        modified = false;
+
+        File f;
+        while (reader.readFile(stream, f))
+            index.insert(f);
+        record = index.records;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (stream.atEnd()) {
+            gallery.seek(0);
+            reader.reset();
+            record = 0;
+        }
+
+        TemplateList templates;
+        Template t;
+        while ((templates.size() < Globals->blockSize) && reader.read(stream, t))
+            if (index.live(t.file, record++))
+                templates.append(t);
+
+        *done = stream.atEnd();
+        return templates;
+    }
+
+    FileList files()
+    {
+        gallery.seek(0);
+        reader.reset();
+
+        FileList files;
+        File f;
+        for (record=0; reader.readFile(stream, f); record++)
+            if (index.live(f, record))
+                files.append(f);
+
+        return files;
+    }
+
+    void write(const Template &t)
+    {
+        const bool tombstone = t.file.get<bool>("Deleted", false);
+        writer.write(stream, tombstone ? Template(t.file) : t);
+        index.insert(t.file);
+        modified = true;
+    }
+};
+
+BR_REGISTER(Gallery, kvGallery)
+
+/*!
+ * \ingroup initializers
+ * \brief Initialization support for mgalGallery.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Mapped template data is referenced by templates that outlive the gallery that read them,
+ * so mappings are only released when the context is finalized.
+ */
+class MappedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    struct Mapping
+    {
+        QSharedPointer<QFile> file;
+        const uchar *data;
+        qint64 size;
+    };
+
+    static QHash<QString, Mapping> mappings;
+    static QList<Mapping> retired;
+    static QMutex lock;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        mappings.clear();
+        retired.clear();
+    }
+
+public:
+    /*!
+     * \brief Returns a read-only mapping of the entire file, remapping it if the file size changed since it was last mapped.
+     */
+    static const uchar *map(const QString &fileName, qint64 *size)
+    {
+        QMutexLocker locker(&lock);
+        *size = QFileInfo(fileName).size();
+        if (*size == 0) return NULL;
+
+        Mapping &mapping = mappings[fileName];
+        if (mapping.file.isNull() || (mapping.size != *size)) {
+            if (!mapping.file.isNull()) retired.append(mapping);
+            mapping.file = QSharedPointer<QFile>(new QFile(fileName));
+            if (!mapping.file->open(QFile::ReadOnly))
+                qFatal("Can't open gallery: %s", qPrintable(fileName));
+            mapping.size = *size;
+            mapping.data = mapping.file->map(0, mapping.size);
+            if (mapping.data == NULL)
+                qFatal("Can't map gallery: %s", qPrintable(fileName));
+        }
+
+        return mapping.data;
+    }
+
+    /*!
+     * \brief Forces the next call to map() to remap the file, called before the file is modified.
+     */
+    static void invalidate(const QString &fileName)
+    {
+        QMutexLocker locker(&lock);
+        if (mappings.contains(fileName))
+            retired.append(mappings.take(fileName));
+    }
+};
+
+QHash<QString, MappedGalleries::Mapping> MappedGalleries::mappings;
+QList<MappedGalleries::Mapping> MappedGalleries::retired;
+QMutex MappedGalleries::lock;
+
+BR_REGISTER(Initializer, MappedGalleries)
+
+/*!
+ * \ingroup galleries
+ * \brief A memory-mapped, indexed binary gallery.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The file consists of a fixed size header, the matrix payloads each starting on a 64-byte boundary,
+ * and a table of contents holding the br::File and matrix headers of every template.
+ * Opening the gallery only reads the table of contents,
+ * and br::Gallery::readBlock() returns matrices that point directly into the mapped payloads.
+ * Templates of identical size and type are reported as br::TemplateList::uniform so distances can run on the mapped data.
+ *
+ * Galleries named by a URL, such as an object in S3-compatible storage, are read with HTTP range requests instead of being mapped:
+ * the header and table of contents are fetched once, then each block's payloads as one range,
+ * with the ranges of the next \c prefetch blocks (default 4) requested in parallel ahead of time.
+ * Set br::Context::networkCache to keep the fetched ranges on local disk for later runs,
+ * they're reused only while the object's \c ETag or \c Last-Modified header is unchanged.
+ *
+ * Local \c .mgal galleries are appended by copying the payloads of the templates selected by their \c pos, \c length and \c step,
+ * contiguous payloads as one run, and rewriting only the table of contents.
+ *
+ * On Linux, set \c direct to read local payloads with \c O_DIRECT instead of mapping them, bypassing the page cache during large scans.
+ * Up to \c depth blocks (default 4) are read ahead by br::Parallel::IO tasks, each block with one large read into a page aligned buffer,
+ * and the returned matrices reference that buffer directly.
+ *
+ * \note Matrices read from a mapped gallery reference read-only memory.
+ */
+class mgalGallery : public Gallery
+{
+    Q_OBJECT
+
+    struct Matrix
+    {
+        qint32 rows, cols, type;
+        quint64 offset;
+    };
+
+    struct Entry
+    {
+        File file;
+        QList<Matrix> matrices;
+    };
+
+    // A block's payloads being read with O_DIRECT
+    struct DirectRead
+    {
+        int first, last;
+        qint64 begin; // File offset of the first byte read
+        qint64 length;
+        cv::Mat buffer;
+        uchar *data; // Page aligned start of the read in buffer
+        bool failed;
+        QSharedPointer<TaskGroup> task;
+    };
+
+    enum { HeaderSize = 64, Alignment = 64, Version = 1,
+           DirectAlignment = 4096,
+           BufferRow = 1 << 20 };
+
+    QList<Entry> entries;
+    quint64 tocOffset;
+    int index, queued, directFile;
+    bool remote, loaded, dirty;
+    QFile writer;
+    QQueue< QSharedPointer<DirectRead> > directReads;
+
+    ~mgalGallery()
+    {
+        flush();
+        directReads.clear(); // Waits for outstanding reads
+#ifdef __linux__
+        if (directFile >= 0) ::close(directFile);
+#endif
+    }
+
+    void init()
+    {
+        tocOffset = HeaderSize;
+        index = queued = 0;
+        directFile = -1;
+        loaded = dirty = false;
+        remote = Network::isUrl(file.name);
+        if (remote) return;
+
+        QFile gallery(file);
+        if (file.get<bool>("remove", false))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (remote) return readRemoteBlock(done);
+        flush();
+        qint64 size;
+        const uchar *data = load(&size);
+        if (file.get<bool>("direct", false) && openDirect()) return readDirectBlock(done);
+
+        const int last = std::min(index + Globals->blockSize, entries.size());
+        const TemplateList templates = makeBlock(index, last, cv::Mat(), data, 0);
+        index = last;
+
+        *done = (index >= entries.size());
+        if (*done) index = 0;
+        return templates;
+    }
+
+    // Templates [first, last) with payloads at data, which holds the file from offset begin and is kept alive by buffer if it has data
+    TemplateList makeBlock(int first, int last, const cv::Mat &buffer, const uchar *data, qint64 begin) const
+    {
+        TemplateList templates;
+        bool uniform = true;
+        for (int i=first; i<last; i++) {
+            const Entry &entry = entries[i];
+            Template t(entry.file);
+            foreach (const Matrix &matrix, entry.matrices)
+                t.append(matrix.rows*matrix.cols == 0 ? cv::Mat(matrix.rows, matrix.cols, matrix.type)
+                                                      : view(buffer, data + (qint64(matrix.offset) - begin), matrix));
+
+            if (uniform && !templates.isEmpty()) {
+                const Template &previous = templates.last();
+                uniform = (t.size() == 1) && (previous.size() == 1) &&
+                          (t.m().rows == previous.m().rows) && (t.m().cols == previous.m().cols) && (t.m().type() == previous.m().type()) &&
+                          (t.m().data == previous.m().data + stride(previous.m()));
+            }
+            templates.append(t);
+        }
+        templates.uniform = uniform && !templates.isEmpty() && (templates.first().size() == 1) && templates.first().m().data;
+        return templates;
+    }
+
+    // A contiguous buffer of at least bytes, shaped as rows of BufferRow bytes since cv::Mat dimensions are ints
+    static cv::Mat allocate(qint64 bytes)
+    {
+        const qint64 rows = std::max((bytes + BufferRow - 1) / BufferRow, qint64(1));
+        return cv::Mat(int(rows), BufferRow, CV_8UC1);
+    }
+
+    // A matrix at data that shares the reference count of buffer, so templates copied out of the block keep it alive
+    static cv::Mat view(const cv::Mat &buffer, const uchar *data, const Matrix &matrix)
+    {
+        cv::Mat m(matrix.rows, matrix.cols, matrix.type, (void*)data);
+        if (buffer.refcount) {
+            m.refcount = buffer.refcount;
+            m.datastart = buffer.datastart;
+            m.allocator = buffer.allocator;
+            CV_XADD(m.refcount, 1);
+        }
+        return m;
+    }
+
+    FileList files()
+    {
+        flush();
+        qint64 size;
+        if (remote) loadRemote();
+        else        load(&size);
+
+        FileList files; files.reserve(entries.size());
+        foreach (const Entry &entry, entries)
+            files.append(entry.file);
+        return files;
+    }
+
+    void write(const Template &t)
+    {
+        if (remote)
+            qFatal("Can't write to remote gallery: %s", qPrintable(file.flat()));
+
+        openWriter();
+
+        Entry entry;
+        entry.file = t.file;
+        foreach (const cv::Mat &m, t) {
+            const cv::Mat c = m.isContinuous() ? m : m.clone();
+            Matrix matrix;
+            matrix.rows = c.rows;
+            matrix.cols = c.cols;
+            matrix.type = c.type();
+            matrix.offset = tocOffset;
+
+            const qint64 bytes = c.total() * c.elemSize();
+            writer.seek(tocOffset);
+            if (writer.write((const char*)c.data, bytes) != bytes)
+                qFatal("Failed to write gallery: %s", qPrintable(writer.fileName()));
+            tocOffset = align(tocOffset + bytes);
+            entry.matrices.append(matrix);
+        }
+
+        entries.append(entry);
+        dirty = true;
+    }
+
+    bool append(const FileList &sources)
+    {
+        if (remote) return false;
+
+        QList< QSharedPointer<Gallery> > inputs;
+        foreach (const File &source, sources) {
+            if ((source.suffix() != "mgal") || Network::isUrl(source.name)) return false;
+            QSharedPointer<Gallery> input(Gallery::make(source));
+            if (!qobject_cast<mgalGallery*>(input.data())) return false;
+            inputs.append(input);
+        }
+
+        openWriter();
+        QList<ByteRun> runs;
+        for (int i=0; i<inputs.size(); i++) {
+            mgalGallery *input = qobject_cast<mgalGallery*>(inputs[i].data());
+            input->flush();
+            qint64 size;
+            const uchar *data = input->load(&size);
+
+            const int pos = sources[i].get<int>("pos", 0);
+            const int length = sources[i].get<int>("length", -1);
+            const int step = std::max(1, sources[i].get<int>("step", 1));
+            bool started = false; // Runs don't continue across inputs
+            for (int index=pos; (index < input->entries.size()) && ((length < 0) || (index < pos+length)); index += step) {
+                Entry entry = input->entries[index];
+
+                // The payloads of a template are adjacent, so they move by one offset
+                quint64 begin = std::numeric_limits<quint64>::max(), end = 0;
+                foreach (const Matrix &matrix, entry.matrices) {
+                    const quint64 bytes = quint64(matrix.rows) * quint64(matrix.cols) * quint64(CV_ELEM_SIZE(matrix.type));
+                    if (bytes == 0) continue;
+                    begin = std::min(begin, matrix.offset);
+                    end = std::max(end, align(matrix.offset + bytes));
+                }
+
+                if (end > begin) {
+                    if (!started || (runs.last().source + runs.last().bytes != data + begin)) {
+                        const ByteRun run = { data + begin, qint64(tocOffset), 0 };
+                        runs.append(run);
+                    }
+                    runs.last().bytes += end - begin;
+                    for (int j=0; j<entry.matrices.size(); j++)
+                        entry.matrices[j].offset = entry.matrices[j].offset - begin + tocOffset;
+                    tocOffset += end - begin;
+                    started = true;
+                }
+                entries.append(entry);
+            }
+        }
+
+        if (!copyRuns(writer, runs))
+            qFatal("Failed to write gallery: %s", qPrintable(writer.fileName()));
+        dirty = true;
+        return true;
+    }
+
+    void openWriter()
+    {
+        if (writer.isOpen()) return;
+        qint64 size;
+        load(&size);
+        MappedGalleries::invalidate(file);
+        writer.setFileName(file);
+        if (!writer.open(QFile::ReadWrite))
+            qFatal("Can't open gallery: %s", qPrintable(writer.fileName()));
+        // The table of contents is rewritten on flush, truncating it doesn't affect mapped payloads
+        writer.resize(tocOffset);
+        if (tocOffset == HeaderSize) writeHeader(0);
+    }
+
+    const uchar *load(qint64 *size)
+    {
+        const uchar *data = MappedGalleries::map(file, size);
+        if (loaded) return data;
+        loaded = true;
+        if (*size == 0) return data;
+
+        const quint64 count = readHeader(QByteArray::fromRawData((const char*)data, std::min(*size, qint64(HeaderSize))), *size);
+        readTableOfContents(QByteArray::fromRawData((const char*)data + tocOffset, *size - tocOffset), count);
+        return data;
+    }
+
+    void loadRemote()
+    {
+        if (loaded) return;
+        loaded = true;
+
+        // The object size isn't known up front, so the header is checked against the table of contents offset alone
+        const quint64 count = readHeader(fetch(Network::range(file.name, 0, HeaderSize-1)), std::numeric_limits<qint64>::max());
+        readTableOfContents(fetch(Network::range(file.name, tocOffset)), count);
+    }
+
+    QByteArray fetch(const QString &range) const
+    {
+        QString error;
+        const QByteArray data = Network::get(range, &error);
+        if (!error.isEmpty())
+            qFatal("Can't read gallery %s: %s", qPrintable(file.flat()), qPrintable(error));
+        return data;
+    }
+
+    // Returns the template count, sets tocOffset
+    quint64 readHeader(const QByteArray &data, qint64 size)
+    {
+        QDataStream header(data);
+        QByteArray magic(8, 0);
+        quint32 version;
+        quint64 count;
+        header.readRawData(magic.data(), magic.size());
+        header >> version >> tocOffset >> count;
+        if ((header.status() != QDataStream::Ok) || (magic != QByteArray("BRMGAL\0\0", 8)) || (version != quint32(Version)) || (tocOffset > quint64(size)))
+            qFatal("Invalid gallery: %s", qPrintable(file.flat()));
+        return count;
+    }
+
+    void readTableOfContents(const QByteArray &data, quint64 count)
+    {
+        QDataStream toc(data);
+        entries.reserve(count);
+        for (quint64 i=0; i<count; i++) {
+            Entry entry;
+            quint32 matrices;
+            toc >> entry.file >> matrices;
+            for (quint32 j=0; j<matrices; j++) {
+                Matrix matrix;
+                toc >> matrix.rows >> matrix.cols >> matrix.type >> matrix.offset;
+                entry.matrices.append(matrix);
+            }
+            entries.append(entry);
+        }
+        if (toc.status() != QDataStream::Ok)
+            qFatal("Corrupt gallery table of contents: %s", qPrintable(file.flat()));
+    }
+
+    TemplateList readRemoteBlock(bool *done)
+    {
+        loadRemote();
+        const int blockSize = Globals->blockSize;
+        const int end = std::min(index + blockSize, entries.size());
+
+        // Payloads are laid out in table of contents order, so every block is one contiguous range
+        QStringList upcoming;
+        for (int i=1; i<=file.get<int>("prefetch", 4); i++) {
+            qint64 begin, last;
+            if (payloadSpan(std::min(index + i*blockSize, entries.size()), std::min(index + (i+1)*blockSize, entries.size()), &begin, &last))
+                upcoming.append(Network::range(file.name, begin, last - 1));
+        }
+        Network::prefetch(upcoming);
+
+        qint64 begin, last;
+        const QString range = payloadSpan(index, end, &begin, &last) ? Network::range(file.name, begin, last - 1) : QString();
+        const QByteArray data = range.isEmpty() ? QByteArray() : fetch(range);
+        if (data.size() < last - begin)
+            qFatal("Truncated gallery payload: %s", qPrintable(file.flat()));
+
+        // One copy out of the downloaded range, at an alignment that keeps the payload stride
+        const cv::Mat buffer = allocate(qint64(data.size()) + Alignment);
+        uchar *aligned = cv::alignPtr(buffer.data, Alignment);
+        memcpy(aligned, data.constData(), data.size());
+        const TemplateList templates = makeBlock(index, end, buffer, aligned, begin);
+        index = end;
+
+        *done = (index >= entries.size());
+        if (*done) index = 0;
+        return templates;
+    }
+
+    // Bytes [begin, end) hold the payloads of entries [first, last), false if there are none
+    bool payloadSpan(int first, int last, qint64 *begin, qint64 *end) const
+    {
+        *begin = *end = -1;
+        for (int i=first; i<last; i++)
+            foreach (const Matrix &matrix, entries[i].matrices) {
+                const qint64 bytes = qint64(matrix.rows)*matrix.cols*CV_ELEM_SIZE(matrix.type);
+                if (bytes == 0) continue;
+                if (*begin == -1) *begin = matrix.offset;
+                *end = std::max(*end, qint64(matrix.offset) + bytes);
+            }
+        return *begin != -1;
+    }
+
+    bool openDirect()
+    {
+#ifdef __linux__
+        if (directFile == -1) {
+            directFile = ::open(qPrintable(file.name), O_RDONLY | O_DIRECT);
+            if (directFile == -1) {
+                qWarning("Can't open %s for direct reads, mapping it instead.", qPrintable(file.name));
+                directFile = -2;
+            }
+        }
+        return directFile >= 0;
+#else
+        return false;
+#endif
+    }
+
+    TemplateList readDirectBlock(bool *done)
+    {
+        // Keep up to depth blocks in flight, starting over at the current index after a reset
+        if (directReads.isEmpty()) queued = index;
+        const int depth = std::max(1, file.get<int>("depth", 4));
+        while ((directReads.size() < depth) && (queued < entries.size())) {
+            const int last = std::min(queued + Globals->blockSize, entries.size());
+            directReads.enqueue(startDirectRead(queued, last));
+            queued = last;
+        }
+
+        TemplateList templates;
+        if (!directReads.isEmpty()) {
+            const QSharedPointer<DirectRead> read = directReads.dequeue();
+            read->task->wait();
+            if (read->failed)
+                qFatal("Failed to read gallery: %s", qPrintable(file.flat()));
+            templates = makeBlock(read->first, read->last, read->buffer, read->data, read->begin);
+            index = read->last;
+        }
+
+        *done = (index >= entries.size());
+        if (*done) {
+            index = 0;
+            directReads.clear();
+        }
+        return templates;
+    }
+
+    QSharedPointer<DirectRead> startDirectRead(int first, int last)
+    {
+        QSharedPointer<DirectRead> read(new DirectRead());
+        read->first = first;
+        read->last = last;
+        read->data = NULL;
+        read->failed = false;
+        read->task = QSharedPointer<TaskGroup>(new TaskGroup(Parallel::IO));
+
+        qint64 begin, end;
+        if (!payloadSpan(first, last, &begin, &end)) {
+            read->begin = read->length = 0;
+            return read;
+        }
+
+        // O_DIRECT requires the offset, length and address to be aligned
+        read->begin = begin / DirectAlignment * DirectAlignment;
+        read->length = (end - read->begin + DirectAlignment - 1) / DirectAlignment * DirectAlignment;
+        read->buffer = allocate(read->length + DirectAlignment);
+        read->data = cv::alignPtr(read->buffer.data, DirectAlignment);
+        read->task->run(&mgalGallery::directRead, directFile, read.data(), end - read->begin);
+        return read;
+    }
+
+    // Reads at least required bytes, the aligned length may run past the end of the file
+    static void directRead(int fd, DirectRead *read, qint64 required)
+    {
+#ifdef __linux__
+        qint64 done = 0;
+        while (done < read->length) {
+            const ssize_t bytes = ::pread(fd, read->data + done, size_t(read->length - done), off_t(read->begin + done));
+            if (bytes <= 0) break;
+            done += bytes;
+        }
+        read->failed = (done < required);
+#else
+        (void) fd; (void) read; (void) required;
+#endif
+    }
+
+    void flush()
+    {
+        if (!dirty) return;
+
+        writer.seek(tocOffset);
+        QDataStream toc(&writer);
+        foreach (const Entry &entry, entries) {
+            toc << entry.file << quint32(entry.matrices.size());
+            foreach (const Matrix &matrix, entry.matrices)
+                toc << matrix.rows << matrix.cols << matrix.type << matrix.offset;
+        }
+        writeHeader(entries.size());
+        writer.flush();
+        dirty = false;
+    }
+
+    void writeHeader(quint64 count)
+    {
+        writer.seek(0);
+        QByteArray header;
+        QDataStream stream(&header, QIODevice::WriteOnly);
+        stream.writeRawData("BRMGAL\0\0", 8);
+        stream << quint32(Version) << tocOffset << count;
+        header.append(QByteArray(HeaderSize - header.size(), 0));
+        writer.write(header);
+    }
+
+    static quint64 align(quint64 offset)
+    {
+        return (offset + Alignment - 1) / Alignment * Alignment;
+    }
+
+    static qint64 stride(const cv::Mat &m)
+    {
+        return align(m.total() * m.elemSize());
+    }
+};
+
+BR_REGISTER(Gallery, mgalGallery)
+
 /*!
  * \ingroup galleries
- * \brief A binary gallery.
+ * \brief A gallery set striped across several shard galleries that are read and written concurrently.
  * \author Josh Klontz \cite jklontz
+ *
+ * The manifest is a text file with a <tt>BRSHARDS 1 stripe</tt> header line followed by a <tt>file count base</tt> line per shard,
+ * where \em base is the index of the shard's first template.
+ * Template \em i is stored in shard <tt>(i / stripe) % shards</tt>, so every run of \em stripe templates goes to the next shard.
+ *
+ * New sets have \c shards shard files (default 4) named after the manifest and in its directory,
+ * written in the \c format gallery (default \c gal) with a stripe of br::Context::blockSize.
+ * Each shard is written by its own br::Parallel::IO task as its stripes fill,
+ * and reading refills every shard's read-ahead buffer concurrently.
+ * Writing to an existing set appends to it.
  */
-class galGallery : public Gallery
+class shardsGallery : public Gallery
 {
     Q_OBJECT
-    QFile gallery;
-    QDataStream stream;
+
+    struct Shard
+    {
+        QString fileName;
+        qint64 count, base;
+        QSharedPointer<Gallery> gallery;
+        TemplateList buffer; // Read ahead, or the stripe being written
+        bool done;
+        QSharedPointer<TaskGroup> writes; // Serializes the writes to this shard
+        Shard() : count(0), base(-1), done(false), writes(new TaskGroup(Parallel::IO)) {}
+    };
+
+    QList< QSharedPointer<Shard> > shards;
+    qint64 stripe, total, position;
+    bool loaded, written;
+
+    ~shardsGallery()
+    {
+        if (!written) return;
+        foreach (const QSharedPointer<Shard> &shard, shards)
+            if (!shard->buffer.isEmpty()) submit(shard.data());
+        foreach (const QSharedPointer<Shard> &shard, shards) {
+            shard->writes->wait();
+            shard->gallery.clear(); // Closes the shard
+        }
+
+        QStringList lines;
+        lines.append(QString("BRSHARDS 1 %1").arg(stripe));
+        foreach (const QSharedPointer<Shard> &shard, shards)
+            lines.append(QString("%1 %2 %3").arg(shard->fileName, QString::number(shard->count), QString::number(shard->base)));
+        QtUtils::writeFile(file.name, lines);
+    }
 
     void init()
     {
-        gallery.setFileName(file);
-        if (file.get<bool>("remove", false))
-            gallery.remove();
-        QtUtils::touchDir(gallery);
-        if (!gallery.open(QFile::ReadWrite | QFile::Append))
-            qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
-        stream.setDevice(&gallery);
+        stripe = total = position = 0;
+        loaded = written = false;
+        if (!file.get<bool>("remove", false)) return;
+
+        load();
+        foreach (const QSharedPointer<Shard> &shard, shards)
+            QFile::remove(path(shard.data()));
+        QFile::remove(file.name);
+        shards.clear();
+        stripe = total = 0;
     }
 
     TemplateList readBlock(bool *done)
     {
-        if (stream.atEnd())
-            gallery.seek(0);
+        load();
 
         TemplateList templates;
-        while ((templates.size() < Globals->blockSize) && !stream.atEnd()) {
-            Template m;
-            stream >> m;
-            templates.append(m);
+        while ((templates.size() < Globals->blockSize) && (position < total)) {
+            Shard *shard = shards[(position / stripe) % shards.size()].data();
+            if (shard->buffer.isEmpty()) fill();
+            if (shard->buffer.isEmpty())
+                qFatal("Shard %s holds fewer templates than listed in %s.", qPrintable(shard->fileName), qPrintable(file.name));
+
+            const int count = int(std::min(std::min(stripe - position % stripe, total - position),
+                                           qint64(std::min(shard->buffer.size(), Globals->blockSize - templates.size()))));
+            templates.append(shard->buffer.mid(0, count));
+            shard->buffer.erase(shard->buffer.begin(), shard->buffer.begin() + count);
+            position += count;
         }
 
-        *done = stream.atEnd();
+        *done = (position >= total);
+        if (*done) {
+            position = 0;
+            foreach (const QSharedPointer<Shard> &shard, shards) {
+                shard->buffer.clear();
+                shard->done = false;
+            }
+        }
         return templates;
     }
 
+    FileList files()
+    {
+        load();
+
+        QVector<FileList> shardFiles(shards.size());
+        TaskGroup reads(Parallel::IO);
+        for (int i=0; i<shards.size(); i++)
+            if (shards[i]->count > 0) {
+                gallery(shards[i].data());
+                reads.run(&shardsGallery::readFiles, shards[i].data(), &shardFiles[i]);
+            }
+        reads.wait();
+
+        FileList files;
+        files.reserve(total);
+        QVector<int> next(shards.size(), 0);
+        for (qint64 i=0; i<total; i++) {
+            const int k = (i / stripe) % shards.size();
+            if (next[k] >= shardFiles[k].size())
+                qFatal("Shard %s holds fewer templates than listed in %s.", qPrintable(shards[k]->fileName), qPrintable(file.name));
+            files.append(shardFiles[k][next[k]++]);
+        }
+        return files;
+    }
+
     void write(const Template &t)
     {
-        stream << t;
+        load();
+        if (shards.isEmpty()) {
+            const QFileInfo info(file.name);
+            stripe = Globals->blockSize;
+            for (int i=0; i<std::max(1, file.get<int>("shards", 4)); i++) {
+                QSharedPointer<Shard> shard(new Shard());
+                shard->fileName = QString("%1.%2.%3").arg(info.completeBaseName(), QString::number(i), file.get<QString>("format", "gal"));
+                QFile::remove(path(shard.data())); // Left over from a set whose manifest was deleted
+                shards.append(shard);
+            }
+        }
+
+        Shard *shard = shards[(total / stripe) % shards.size()].data();
+        if (shard->base < 0) shard->base = total;
+        shard->buffer.append(t);
+        shard->count++;
+        total++;
+        written = true;
+        if (total % stripe == 0) submit(shard);
+    }
+
+    void load()
+    {
+        if (loaded) return;
+        loaded = true;
+        if (!QFileInfo(file.name).exists()) return;
+
+        const QStringList lines = QtUtils::readLines(file.name);
+        const QStringList header = lines.isEmpty() ? QStringList() : lines.first().split(' ');
+        if ((header.size() != 3) || (header[0] != "BRSHARDS") || (header[1] != "1") || (header[2].toLongLong() <= 0))
+            qFatal("Invalid gallery set manifest: %s", qPrintable(file.name));
+        stripe = header[2].toLongLong();
+
+        for (int i=1; i<lines.size(); i++) {
+            const QStringList words = lines[i].split(' ');
+            if (words.size() != 3) qFatal("Invalid gallery set manifest line: %s", qPrintable(lines[i]));
+            QSharedPointer<Shard> shard(new Shard());
+            shard->fileName = words[0];
+            shard->count = words[1].toLongLong();
+            shard->base = words[2].toLongLong();
+            total += shard->count;
+            shards.append(shard);
+        }
+        for (int i=0; i<shards.size(); i++)
+            if ((shards[i]->count > 0) && (shards[i]->base != i*stripe))
+                qFatal("Shard %s doesn't start at template %lld of %s.", qPrintable(shards[i]->fileName), i*stripe, qPrintable(file.name));
+    }
+
+    QString path(const Shard *shard) const
+    {
+        return QFileInfo(file.name).dir().filePath(shard->fileName);
+    }
+
+    Gallery *gallery(Shard *shard) const
+    {
+        if (shard->gallery.isNull()) shard->gallery = QSharedPointer<Gallery>(Gallery::make(path(shard)));
+        return shard->gallery.data();
+    }
+
+    // Refills the read-ahead of every shard holding less than a stripe, concurrently
+    void fill()
+    {
+        TaskGroup reads(Parallel::IO);
+        foreach (const QSharedPointer<Shard> &shard, shards)
+            if (!shard->done && (shard->buffer.size() < stripe) && (shard->count > 0)) {
+                gallery(shard.data());
+                reads.run(&shardsGallery::readShard, shard.data());
+            }
+        reads.wait();
+    }
+
+    // Hands the shard's filled stripe to its writer, after the previous stripe written to it
+    void submit(Shard *shard)
+    {
+        gallery(shard);
+        shard->writes->wait();
+        shard->writes->run(&shardsGallery::writeShard, shard->gallery, shard->buffer);
+        shard->buffer.clear();
+    }
+
+    static void readShard(Shard *shard)
+    {
+        shard->buffer.append(shard->gallery->readBlock(&shard->done));
+    }
+
+    static void readFiles(Shard *shard, FileList *files)
+    {
+        *files = shard->gallery->files();
+    }
+
+    static void writeShard(QSharedPointer<Gallery> gallery, TemplateList templates)
+    {
+        gallery->writeBlock(templates);
     }
 };
 
-BR_REGISTER(Gallery, galGallery)
+BR_REGISTER(Gallery, shardsGallery)
 
 /*!
  * \ingroup galleries
@@ -176,6 +1328,16 @@ BR_REGISTER(Gallery, DefaultGallery)
  * \ingroup galleries
   * \brief Treat a video as a gallery, making a single template from each frame
   * \author Charles Otto \cite caotto
+  *
+  * Frames are decoded as they are read, br::Gallery::readBlock() returns at most br::Context::blockSize of them,
+  * each tagged with its \c FrameNumber.
+  * Set \c startFrame to seek before the first frame and \c frameStride to keep only every n-th frame,
+  * skipped frames are grabbed without being decoded.
+  *
+  * Written frames are encoded by a br::Parallel::IO task at \c fps frames per second (default 30),
+  * so enrollment continues while the encoder catches up.
+  * At most \c queue frames (default 16) wait to be encoded, after which br::Gallery::write() blocks.
+  * Frames are encoded in the order they are written.
   */
 class aviGallery : public  Gallery
 {
@@ -183,42 +1345,76 @@ class aviGallery : public  Gallery
 
     TemplateList output_set;
     QScopedPointer<cv::VideoWriter> videoOut;
+    QScopedPointer<cv::VideoCapture> videoReader;
+    int frameNumber;
+
+    // Frames waiting for the encoder task, at most one of which runs at a time
+    QMutex framesLock;
+    QWaitCondition framesChanged;
+    QQueue<cv::Mat> frames;
+    bool encoding;
+    TaskGroup encoder;
 
     ~aviGallery()
     {
+        encoder.wait();
         if (videoOut && videoOut->isOpened()) videoOut->release();
     }
 
+public:
+    aviGallery() : encoding(false), encoder(Parallel::IO) {}
+
+private:
+
     TemplateList readBlock(bool * done)
     {
-        std::string fname = file.name.toStdString();
         *done = true;
 
         TemplateList output;
         if (!file.exists())
             return output;
 
-        cv::VideoCapture videoReader(file.name.toStdString());
+        const int stride = std::max(1, file.get<int>("frameStride", 1));
+        if (videoReader.isNull()) {
+            videoReader.reset(new cv::VideoCapture(file.name.toStdString()));
+            if (!videoReader->isOpened()) {
+                qWarning("Failed to open %s for reading", qPrintable(file.name));
+                videoReader.reset();
+                return output;
+            }
 
-        bool open = videoReader.isOpened();
+            frameNumber = file.get<int>("startFrame", 0);
+            if (frameNumber > 0) videoReader->set(CV_CAP_PROP_POS_FRAMES, frameNumber);
+        }
 
-        while (open) {
+        bool open = true;
+        while (open && (output.size() < Globals->blockSize)) {
             cv::Mat frame;
-            
-            open = videoReader.read(frame);
+            open = videoReader->read(frame);
             if (!open) break;
-            output.append(Template());
-            output.back() = frame.clone();
+
+            Template t(file);
+            t.file.set("FrameNumber", frameNumber);
+            t.append(frame.clone()); // The capture reuses its frame buffer
+            output.append(t);
+
+            frameNumber++;
+            for (int i=1; open && (i<stride); i++, frameNumber++)
+                open = videoReader->grab();
         }
 
-        return TemplateList();
+        // Start over on the next call once the video is exhausted
+        *done = !open;
+        if (*done) videoReader.reset();
+        return output;
     }
 
     void write(const Template & t)
     {
         if (videoOut.isNull() || !videoOut->isOpened()) {
+            encoder.wait(); // The encoder may still be using the previous writer
             int fourcc = OpenCVUtils::getFourcc(); 
-            videoOut.reset(new cv::VideoWriter(qPrintable(file.name), fourcc, 30, t.m().size()));
+            videoOut.reset(new cv::VideoWriter(qPrintable(file.name), fourcc, file.get<double>("fps", 30), t.m().size()));
         }
 
         if (!videoOut->isOpened()) {
@@ -226,13 +1422,181 @@ class aviGallery : public  Gallery
             return;
         }
 
+        const int capacity = std::max(1, file.get<int>("queue", 16));
+        QMutexLocker locker(&framesLock);
         foreach(const cv::Mat & m, t) {
+            while (frames.size() >= capacity)
+                framesChanged.wait(&framesLock);
+            frames.enqueue(m); // Transforms produce new matrices rather than modifying their inputs, so sharing is safe
+        }
+
+        if (!encoding) {
+            encoding = true;
+            encoder.run(this, &aviGallery::encode);
+        }
+    }
+
+    void encode()
+    {
+        QMutexLocker locker(&framesLock);
+        while (!frames.isEmpty()) {
+            const cv::Mat m = frames.dequeue();
+            framesChanged.wakeAll();
+            locker.unlock();
             videoOut->write(m);
+            locker.relock();
         }
+        encoding = false;
     }
 };
 BR_REGISTER(Gallery, aviGallery)
 
+/*!
+ * \brief The templates of a memGallery, stored in a growable arena of aligned chunks.
+ *
+ * Matrices are copied in place after the last template, each starting on a 64 byte boundary (16 for smaller matrices),
+ * so templates of one size and type are stored at a constant stride and single matrix galleries compare as uniform.
+ * Chunks are never moved or reallocated, so blocks already read stay valid while templates are appended,
+ * and each chunk at least doubles the capacity so appending a template costs its own bytes.
+ *
+ * A \em compressed gallery instead packs the matrices of each append into an immutable br::PackedChunk
+ * and keeps only the files in #templates.
+ */
+struct MemoryGallery
+{
+    enum { Min_Chunk = 1 << 20 };
+
+    TemplateList templates;
+    QSharedPointer<AlignedData> chunk; // The newest chunk, which keeps the older ones alive
+    size_t used; // Bytes used in the newest chunk
+
+    bool compressed;
+    PackedData packed; // Every chunk of a compressed gallery
+
+    MemoryGallery() : used(0), compressed(false) {}
+
+    // The packed matrices of templates [first, first + count)
+    QSharedPointer<PackedData> packedBlock(int first, int count) const
+    {
+        QSharedPointer<PackedData> block(new PackedData(packed));
+        block->first = first;
+        block->chunks.clear();
+        foreach (const QSharedPointer<const PackedChunk> &chunk, packed.chunks)
+            if ((chunk->first < first + count) && (chunk->first + chunk->count > first))
+                block->chunks.append(chunk);
+        return block;
+    }
+
+    void appendPacked(const TemplateList &input)
+    {
+        // The first matrix sets the size and type of the gallery
+        if (packed.rows == 0)
+            foreach (const Template &t, input)
+                if (!t.isEmpty() && t.m().data) {
+                    packed.rows = t.m().rows;
+                    packed.cols = t.m().cols;
+                    packed.type = t.m().type();
+                    break;
+                }
+
+        if (packed.rows > 0) {
+            packed.chunks.append(QSharedPointer<const PackedChunk>(new PackedChunk(input, templates.size(), packed.rows, packed.cols, packed.type)));
+            Metrics::increment("br_memory_gallery_packed_bytes_total", packed.chunks.last()->compressedBytes());
+        }
+        foreach (const Template &t, input)
+            templates.append(Template(t.file));
+    }
+
+    void append(const TemplateList &input)
+    {
+        if (compressed) {
+            appendPacked(input);
+            return;
+        }
+
+        // Lay out every matrix first, after the newest chunk's templates if they fit and at the start of a new chunk otherwise
+        QList<Mat> sources;
+        foreach (const Template &t, input)
+            foreach (const Mat &m, t)
+                sources.append(m.isContinuous() ? m : m.clone());
+        QVector<size_t> offsets(sources.size());
+        size_t end = chunk.isNull() ? 0 : layout(sources, used, offsets);
+        if (chunk.isNull() || (end > chunk->size)) {
+            const size_t bytes = layout(sources, 0, offsets);
+            QSharedPointer<AlignedData> next(new AlignedData(std::max(bytes, std::max(size_t(Min_Chunk), chunk.isNull() ? 0 : 2*chunk->size))));
+            next->previous = chunk;
+            chunk = next;
+            used = 0;
+            end = bytes;
+        }
+        uchar *data = chunk->data;
+
+        // A bulk load into a fresh chunk is copied by each NUMA node's workers, see br::AlignedData
+        const int nodes = (used == 0) ? std::min(Parallel::nodes(), std::max(1, sources.size())) : 1;
+        TaskGroup tasks;
+        for (int k=0; k<nodes; k++) {
+            const int begin = k*sources.size()/nodes, end = (k+1)*sources.size()/nodes;
+            if (nodes == 1) {
+                copyMatrices(&sources, data, offsets.data(), begin, end);
+                break;
+            }
+            chunk->partitions.append(data + offsets[begin]);
+            tasks.setNode(k);
+            tasks.run(&MemoryGallery::copyMatrices, (const QList<Mat>*)&sources, data, (const size_t*)offsets.data(), begin, end);
+        }
+        tasks.wait();
+
+        int index = 0;
+        foreach (const Template &t, input) {
+            Template aligned(t.file);
+            foreach (const Mat &m, t) {
+                aligned.append(m.data ? Mat(m.rows, m.cols, m.type(), data + offsets[index]) : m);
+                index++;
+            }
+            templates.append(aligned);
+        }
+        used = end;
+    }
+
+    // Single matrix templates of one size and type at a constant stride
+    static bool uniform(const TemplateList &templates)
+    {
+        if (templates.isEmpty() || (templates.first().size() != 1) || !templates.first().m().data) return false;
+        const Mat &first = templates.first().m();
+        const ptrdiff_t stride = (templates.size() > 1) ? templates[1].m().data - first.data : 0;
+        for (int i=1; i<templates.size(); i++) {
+            const Template &t = templates[i];
+            if ((t.size() != 1) || (t.m().rows != first.rows) || (t.m().cols != first.cols) || (t.m().type() != first.type()) ||
+                (t.m().data - templates[i-1].m().data != stride))
+                return false;
+        }
+        return (templates.size() == 1) || (stride >= ptrdiff_t(first.total() * first.elemSize()));
+    }
+
+private:
+    // Sets the offsets of sources from the start of a chunk, placing them from base on, and returns the end of the last one
+    static size_t layout(const QList<Mat> &sources, size_t base, QVector<size_t> &offsets)
+    {
+        size_t end = base;
+        for (int i=0; i<sources.size(); i++) {
+            const Mat &m = sources[i];
+            const size_t size = m.data ? m.total() * m.elemSize() : 0;
+            const size_t alignment = (size >= 64) ? 64 : 16;
+            offsets[i] = (end + alignment - 1) / alignment * alignment;
+            end = offsets[i] + size;
+        }
+        return end;
+    }
+
+    static void copyMatrices(const QList<Mat> *sources, uchar *data, const size_t *offsets, int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            const Mat &m = (*sources)[i];
+            if (m.data) memcpy(data + offsets[i], m.data, m.total() * m.elemSize());
+        }
+    }
+};
+
 /*!
  * \ingroup initializers
  * \brief Initialization support for memGallery.
@@ -246,16 +1610,17 @@ class MemoryGalleries : public Initializer
 
     void finalize() const
     {
+        QWriteLocker locker(&lock);
         galleries.clear();
     }
 
 public:
-    static QHash<File, TemplateList> galleries; /*!< TODO */
-    static QHash<File, bool> aligned; /*!< TODO */
+    static QHash<File, MemoryGallery> galleries; /*!< \brief The templates of each memGallery. */
+    static QReadWriteLock lock; /*!< \brief Guards \ref galleries, galleries may be read by concurrent requests while another appends. */
 };
 
-QHash<File, TemplateList> MemoryGalleries::galleries;
-QHash<File, bool> MemoryGalleries::aligned;
+QHash<File, MemoryGallery> MemoryGalleries::galleries;
+QReadWriteLock MemoryGalleries::lock;
 
 BR_REGISTER(Initializer, MemoryGalleries)
 
@@ -263,6 +1628,11 @@ BR_REGISTER(Initializer, MemoryGalleries)
  * \ingroup galleries
  * \brief A gallery held in memory.
  * \author Josh Klontz \cite jklontz
+ *
+ * With the \c compress option, ex. <tt>targets.gal.mem[compress=true]</tt>, single matrix templates of one size and type are held bit-packed,
+ * see br::PackedChunk, and only decoded a cache-sized tile at a time as they are compared.
+ * Quantized templates whose bytes vary little within groups of templates take a fraction of the memory.
+ * The templates read from a compressed gallery hold no matrices, only br::Distance::compare() sees them.
  */
 class memGallery : public Gallery
 {
@@ -272,72 +1642,141 @@ class memGallery : public Gallery
     void init()
     {
         block = 0;
+        QWriteLocker locker(&MemoryGalleries::lock);
+        const bool loaded = MemoryGalleries::galleries.contains(file);
+        if (!loaded && file.get<bool>("compress", false))
+            MemoryGalleries::galleries[file].compressed = true;
+
         File galleryFile = file.name.mid(0, file.name.size()-4);
-        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
+        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !loaded) {
             QSharedPointer<Gallery> gallery(Factory<Gallery>::make(galleryFile));
-            MemoryGalleries::galleries[file] = gallery->read();
-            align(MemoryGalleries::galleries[file]);
-            MemoryGalleries::aligned[file] = true;
+            MemoryGalleries::galleries[file].append(gallery->read());
         }
     }
 
     TemplateList readBlock(bool *done)
     {
-        if (!MemoryGalleries::aligned[file]) {
-            align(MemoryGalleries::galleries[file]);
-            MemoryGalleries::aligned[file] = true;
+        QReadLocker locker(&MemoryGalleries::lock);
+        QHash<File, MemoryGallery>::const_iterator gallery = MemoryGalleries::galleries.constFind(file);
+        if (gallery == MemoryGalleries::galleries.constEnd()) {
+            *done = true;
+            return TemplateList();
         }
 
-        TemplateList templates = MemoryGalleries::galleries[file].mid(block*Globals->blockSize, Globals->blockSize);
+        TemplateList templates = gallery->templates.mid(block*Globals->blockSize, Globals->blockSize);
+        if (gallery->compressed) {
+            templates.packedData = gallery->packedBlock(block*Globals->blockSize, templates.size());
+        } else {
+            templates.uniform = MemoryGallery::uniform(templates);
+            templates.alignedData = gallery->chunk;
+        }
         *done = (templates.size() < Globals->blockSize);
         block = *done ? 0 : block+1;
         return templates;
     }
 
+    FileList files()
+    {
+        QReadLocker locker(&MemoryGalleries::lock);
+        return MemoryGalleries::galleries.value(file).templates.files();
+    }
+
     void write(const Template &t)
     {
-        MemoryGalleries::galleries[file].append(t);
-        MemoryGalleries::aligned[file] = false;
+        QWriteLocker locker(&MemoryGalleries::lock);
+        MemoryGalleries::galleries[file].append(TemplateList() << t);
     }
+};
+
+BR_REGISTER(Gallery, memGallery)
+
+/*!
+ * \brief Reads a text gallery a block of lines at a time.
+ *
+ * Empty lines are skipped and the others simplified, as in QtUtils::readLines().
+ */
+class LineReader
+{
+    QFile file;
+    bool header;
 
-    static void align(TemplateList &templates)
+    bool next(QString &line)
     {
-        if (!templates.empty() && templates[0].size() > 1) return;
+        while (!file.atEnd()) {
+            QByteArray raw = file.readLine();
+            if (raw.endsWith('\n')) raw.chop(1);
+            if (raw.isEmpty()) continue;
+            line = QString::fromUtf8(raw).simplified();
+            return true;
+        }
+        return false;
+    }
 
-        bool uniform = true;
-        QVector<uchar> alignedData(templates.bytes<size_t>());
-        size_t offset = 0;
-        for (int i=0; i<templates.size(); i++) {
-            Template &t = templates[i];
-            if (t.size() > 1) qFatal("Can't handle multi-matrix template %s.", qPrintable(t.file.flat()));
-
-            cv::Mat &m = t;
-            if (m.data) {
-                const size_t size = m.total() * m.elemSize();
-                if (!m.isContinuous()) qFatal("Requires continuous matrix data of size %d for %s.", (int)size, qPrintable(t.file.flat()));
-                memcpy(&(alignedData.data()[offset]), m.ptr(), size);
-                m = cv::Mat(m.rows, m.cols, m.type(), &(alignedData.data()[offset]));
-                offset += size;
-            }
-            uniform = uniform &&
-                      (m.rows == templates.first().m().rows) &&
-                      (m.cols == templates.first().m().cols) &&
-                      (m.type() == templates.first().m().type());
+public:
+    explicit LineReader(bool header_ = false) : header(header_) {}
+
+    // Reads up to maxLines, starting over after the last line
+    QStringList read(const QString &fileName, int maxLines, bool *done)
+    {
+        if (!file.isOpen() || file.atEnd()) {
+            file.close();
+            file.setFileName(fileName);
+            if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading. Check file permissions.", qPrintable(fileName));
+            QString skipped;
+            if (header) next(skipped);
         }
 
-        templates.uniform = uniform;
-        templates.alignedData = alignedData;
+        QStringList lines;
+        QString line;
+        while ((lines.size() < maxLines) && next(line))
+            lines.append(line);
+        *done = file.atEnd();
+        return lines;
     }
-
 };
 
-BR_REGISTER(Gallery, memGallery)
+typedef File (*LineParser)(const QString &line, int fileIndex);
+
+static const int Parse_Chunk = 4096; // Lines per parsing task
+
+static void parseChunk(LineParser parser, QStringList lines, int fileIndex, FileList *files)
+{
+    files->reserve(lines.size());
+    foreach (const QString &line, lines)
+        files->append(parser(line, fileIndex));
+}
+
+/*!
+ * \brief Parses lines into files in parallel chunks, a line's file depends only on the line.
+ */
+static FileList parseLines(LineParser parser, const QStringList &lines, int fileIndex)
+{
+    const int chunks = (lines.size() + Parse_Chunk - 1) / Parse_Chunk;
+    if (!Globals->parallelism || (chunks < 2)) {
+        FileList files;
+        parseChunk(parser, lines, fileIndex, &files);
+        return files;
+    }
+
+    QVector<FileList> parsed(chunks);
+    TaskGroup tasks;
+    for (int i=0; i<chunks; i++)
+        tasks.run(parseChunk, parser, lines.mid(i*Parse_Chunk, Parse_Chunk), fileIndex, &parsed[i]);
+    tasks.wait();
+
+    FileList files;
+    files.reserve(lines.size());
+    foreach (const FileList &chunk, parsed)
+        files.append(chunk);
+    return files;
+}
 
 /*!
  * \ingroup galleries
  * \brief Treats each line as a file.
  * \author Josh Klontz \cite jklontz
  *
+ * Lines are read and parsed br::Context::blockSize at a time.
  * Columns should be comma separated with first row containing headers.
  * The first column in the file should be the path to the file to enroll.
  * Other columns will be treated as file metadata.
@@ -350,14 +1789,17 @@ class csvGallery : public Gallery
     Q_PROPERTY(int fileIndex READ get_fileIndex WRITE set_fileIndex RESET reset_fileIndex)
     BR_PROPERTY(int, fileIndex, 0)
 
-    FileList files;
+    FileList written;
+    LineReader reader;
+
+    csvGallery() : reader(true) {}
 
     ~csvGallery()
     {
-        if (files.isEmpty()) return;
+        if (written.isEmpty()) return;
 
         QMap<QString,QVariant> samples;
-        foreach (const File &file, files)
+        foreach (const File &file, written)
             foreach (const QString &key, file.localKeys())
                 if (!samples.contains(key))
                     samples.insert(key, file.value(key));
@@ -367,7 +1809,7 @@ class csvGallery : public Gallery
         samples.remove("Rects");
 
         QStringList lines;
-        lines.reserve(files.size()+1);
+        lines.reserve(written.size()+1);
 
         { // Make header
             QStringList words;
@@ -378,7 +1820,7 @@ class csvGallery : public Gallery
         }
 
         // Make table
-        foreach (const File &file, files) {
+        foreach (const File &file, written) {
             QStringList words;
             words.append(file.name);
             foreach (const QString &key, samples.keys())
@@ -392,24 +1834,29 @@ class csvGallery : public Gallery
     TemplateList readBlock(bool *done)
     {
         *done = true;
-        TemplateList templates;
-        if (!file.exists()) return templates;
+        if (!file.exists()) return TemplateList();
+        return TemplateList(parseLines(parse, reader.read(file, Globals->blockSize, done), fileIndex));
+    }
 
-        QStringList lines = QtUtils::readLines(file);
-        if (!lines.isEmpty()) lines.removeFirst(); // Remove header
+    FileList files()
+    {
+        FileList files;
+        if (!file.exists()) return files;
 
-        foreach (const QString &line, lines) {
-            QStringList words = line.split(',');
-            if (words.isEmpty()) continue;
-            templates.append(File(words[fileIndex], words.size() > 1 ? words.takeLast() : ""));
-        }
+        LineReader all(true);
+        bool done;
+        return parseLines(parse, all.read(file, std::numeric_limits<int>::max(), &done), fileIndex);
+    }
 
-        return templates;
+    static File parse(const QString &line, int fileIndex)
+    {
+        QStringList words = line.split(',');
+        return File(words[fileIndex], words.size() > 1 ? words.takeLast() : "");
     }
 
     void write(const Template &t)
     {
-        files.append(t.file);
+        written.append(t.file);
     }
 
     static QString getCSVElement(const QString &key, const QVariant &value, bool header)
@@ -448,6 +1895,7 @@ class txtGallery : public Gallery
     Q_OBJECT
 
     QStringList lines;
+    LineReader reader;
 
     ~txtGallery()
     {
@@ -457,13 +1905,23 @@ class txtGallery : public Gallery
     TemplateList readBlock(bool *done)
     {
         *done = true;
-        TemplateList templates;
-        if (!file.exists()) return templates;
+        if (!file.exists()) return TemplateList();
+        return TemplateList(parseLines(parse, reader.read(file, Globals->blockSize, done), 0));
+    }
 
-        foreach (const QString &line, QtUtils::readLines(file))
-            templates.append(File(line));
-        *done = true;
-        return templates;
+    FileList files()
+    {
+        FileList files;
+        if (!file.exists()) return files;
+
+        LineReader all;
+        bool done;
+        return parseLines(parse, all.read(file, std::numeric_limits<int>::max(), &done), 0);
+    }
+
+    static File parse(const QString &line, int)
+    {
+        return File(line);
     }
 
     void write(const Template &t)
@@ -484,23 +1942,33 @@ class xmlGallery : public Gallery
     Q_OBJECT
     Q_PROPERTY(bool ignoreMetadata READ get_ignoreMetadata WRITE set_ignoreMetadata RESET reset_ignoreMetadata STORED false)
     BR_PROPERTY(bool, ignoreMetadata, false)
-    FileList files;
+    FileList written;
+    QScopedPointer<BEE::SigsetReader> reader;
 
     ~xmlGallery()
     {
-        if (!files.isEmpty())
-            BEE::writeSigset(file, files, ignoreMetadata);
+        if (!written.isEmpty())
+            BEE::writeSigset(file, written, ignoreMetadata);
     }
 
     TemplateList readBlock(bool *done)
     {
-        *done = true;
-        return TemplateList(BEE::readSigset(file, ignoreMetadata));
+        // Start over after the last file
+        if (reader.isNull() || reader->atEnd())
+            reader.reset(new BEE::SigsetReader(file, ignoreMetadata));
+        const FileList files = reader->read(Globals->blockSize);
+        *done = reader->atEnd();
+        return TemplateList(files);
+    }
+
+    FileList files()
+    {
+        return BEE::readSigset(file, ignoreMetadata);
     }
 
     void write(const Template &t)
     {
-        files.append(t.file);
+        written.append(t.file);
     }
 };
 
@@ -510,68 +1978,151 @@ BR_REGISTER(Gallery, xmlGallery)
  * \ingroup galleries
  * \brief Database input.
  * \author Josh Klontz \cite jklontz
+ *
+ * The connection is opened once per gallery.
+ * An \c import CSV is streamed into a new table with prepared batches inside a single transaction.
+ * Set \c stream to page through the query result br::Context::blockSize rows at a time in query order,
+ * otherwise the whole result is grouped by label and optionally subset.
  */
 class dbGallery : public Gallery
 {
     Q_OBJECT
 
-    TemplateList readBlock(bool *done)
+#ifndef BR_EMBEDDED
+    QSqlDatabase db;
+    QScopedPointer<QSqlQuery> cursor;
+
+    ~dbGallery()
     {
-        TemplateList templates;
-        br::File import = file.get<QString>("import", "");
-        QString query = file.get<QString>("query");
-        QString subset = file.get<QString>("subset", "");
+        cursor.reset();
+        const QString connection = db.connectionName();
+        db.close();
+        db = QSqlDatabase();
+        if (!connection.isEmpty()) QSqlDatabase::removeDatabase(connection);
+    }
 
-#ifndef BR_EMBEDDED
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
+    void open()
+    {
+        if (db.isOpen()) return;
+        db = QSqlDatabase::addDatabase("QSQLITE", QString("dbGallery_%1").arg(quintptr(this)));
         db.setDatabaseName(file);
         if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
 
-        if (!import.isNull()) {
-            qDebug("Parsing %s", qPrintable(import.name));
-            QStringList lines = QtUtils::readLines(import);
-            QList<QStringList> cells; cells.reserve(lines.size());
-            const QRegExp re("\\s*,\\s*");
-            foreach (const QString &line, lines) {
-                cells.append(line.split(re));
-                if (cells.last().size() != cells.first().size()) qFatal("Column count mismatch.");
-            }
+        const br::File import = file.get<QString>("import", "");
+        if (!import.isNull()) importTable(import);
+    }
+
+    void importTable(const br::File &import)
+    {
+        qDebug("Importing %s", qPrintable(import.name));
+        LineReader reader;
+        bool done;
+        QStringList lines = reader.read(import, Import_Batch, &done);
+        if (lines.size() < 2) qFatal("Expected a header and at least one row in %s.", qPrintable(import.name));
+
+        // Column types are decided by the first row
+        const QRegExp re("\\s*,\\s*");
+        const QStringList names = lines.takeFirst().split(re);
+        const QStringList first = lines.first().split(re);
+        if (first.size() != names.size()) qFatal("Column count mismatch.");
+        QStringList columns, qMarks;
+        QList<bool> numeric;
+        for (int i=0; i<names.size(); i++) {
+            bool isNumeric;
+            first[i].toInt(&isNumeric);
+            numeric.append(isNumeric);
+            columns.append(names[i] + (isNumeric ? " INTEGER" : " STRING"));
+            qMarks.append("?");
+        }
+
+        const QString &table = import.baseName();
+        qDebug("Creating table %s", qPrintable(table));
+        QSqlQuery q(db);
+        if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
 
-            QStringList columns, qMarks;
+        // SQLite would otherwise commit and sync every row
+        if (!db.transaction()) qFatal("%s.", qPrintable(db.lastError().text()));
+        if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+
+        while (!lines.isEmpty()) {
             QList<QVariantList> variantLists;
-            for (int i=0; i<cells[0].size(); i++) {
-                bool isNumeric;
-                cells[1][i].toInt(&isNumeric);
-                columns.append(cells[0][i] + (isNumeric ? " INTEGER" : " STRING"));
-                qMarks.append("?");
-
-                QVariantList variantList; variantList.reserve(lines.size()-1);
-                for (int j=1; j<lines.size(); j++) {
-                    if (isNumeric) variantList << cells[j][i].toInt();
-                    else           variantList << cells[j][i];
+            for (int i=0; i<names.size(); i++) {
+                variantLists.append(QVariantList());
+                variantLists.last().reserve(lines.size());
+            }
+
+            foreach (const QString &line, lines) {
+                const QStringList cells = line.split(re);
+                if (cells.size() != names.size()) qFatal("Column count mismatch.");
+                for (int i=0; i<cells.size(); i++) {
+                    if (numeric[i]) variantLists[i] << cells[i].toInt();
+                    else            variantLists[i] << cells[i];
                 }
-                variantLists.append(variantList);
             }
 
-            const QString &table = import.baseName();
-            qDebug("Creating table %s", qPrintable(table));
-            QSqlQuery q(db);
-            if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
-            if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
             foreach (const QVariantList &vl, variantLists)
                 q.addBindValue(vl);
             if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+            lines = done ? QStringList() : reader.read(import, Import_Batch, &done);
         }
 
-        QSqlQuery q(db);
+        if (!db.commit()) qFatal("%s.", qPrintable(db.lastError().text()));
+    }
+
+    void execute(QSqlQuery &q) const
+    {
+        QString query = file.get<QString>("query");
         if (query.startsWith('\'') && query.endsWith('\''))
             query = query.mid(1, query.size()-2);
         if (!q.exec(query))
             qFatal("%s.", qPrintable(q.lastError().text()));
         if ((q.record().count() == 0) || (q.record().count() > 3))
             qFatal("Query record expected one to three fields, got %d.", q.record().count());
+    }
+
+    TemplateList streamBlock(bool *done)
+    {
+        if (cursor.isNull()) {
+            cursor.reset(new QSqlQuery(db));
+            cursor->setForwardOnly(true);
+            execute(*cursor);
+        }
+
+        const int fields = cursor->record().count();
+        TemplateList templates;
+        while (templates.size() < Globals->blockSize) {
+            if (!cursor->next()) {
+                cursor.reset();
+                *done = true;
+                return templates;
+            }
+            // The filter parity of the grouped mode without a subset
+            if ((fields >= 3) && (qHash(cursor->value(2).toString()) % 2 != 0)) continue;
+            templates.append(File(cursor->value(0).toString(), fields >= 2 ? cursor->value(1).toString() : ""));
+        }
+        *done = false;
+        return templates;
+    }
+#endif // BR_EMBEDDED
+
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        TemplateList templates;
+        QString subset = file.get<QString>("subset", "");
+
+#ifndef BR_EMBEDDED
+        open();
+        if (file.get<bool>("stream", false)) {
+            if (!subset.isEmpty()) qFatal("A subset needs the whole query result and can't be streamed.");
+            return streamBlock(done);
+        }
+
+        QSqlQuery q(db);
+        q.setForwardOnly(true);
+        execute(q);
         const bool hasMetadata = (q.record().count() >= 2);
         const bool hasFilter = (q.record().count() >= 3);
 
@@ -640,10 +2191,8 @@ class dbGallery : public Gallery
             }
         }
 
-        db.close();
 #endif // BR_EMBEDDED
 
-        *done = true;
         return templates;
     }
 
@@ -652,6 +2201,8 @@ class dbGallery : public Gallery
         (void) t;
         qFatal("Not supported.");
     }
+
+    enum { Import_Batch = 65536 }; // Rows bound per prepared batch
 };
 
 BR_REGISTER(Gallery, dbGallery)
@@ -673,16 +2224,14 @@ class googleGallery : public Gallery
         QString query = file.name.left(file.name.size()-7); // remove ".google"
 
 #ifndef BR_EMBEDDED
-        QNetworkAccessManager networkAccessManager;
-        for (int i=0; i<100; i+=20) { // Retrieve 100 images
-            QNetworkRequest request(search.arg(query, QString::number(i)));
-            QNetworkReply *reply = networkAccessManager.get(request);
-
-            while (!reply->isFinished())
-                QThread::yieldCurrentThread();
+        // Retrieve 100 images, the result pages are fetched concurrently
+        QStringList pages;
+        for (int i=0; i<100; i+=20)
+            pages.append(search.arg(query, QString::number(i)));
+        Network::prefetch(pages);
 
-            QString data(reply->readAll());
-            delete reply;
+        foreach (const QString &page, pages) {
+            QString data(Network::get(page));
 
             QStringList words = data.split("imgurl=");
             words.takeFirst(); // Remove header
@@ -694,6 +2243,7 @@ class googleGallery : public Gallery
                 templates.append(File(url,query));
             }
         }
+        Network::prefetch(templates.files().names());
 #endif // BR_EMBEDDED
 
         *done = true;
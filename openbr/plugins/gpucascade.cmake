@@ -0,0 +1,5 @@
+set(BR_WITH_OPENCV_GPU OFF CACHE BOOL "Build with OpenCV GPU (CUDA) face detection")
+
+if(${BR_WITH_OPENCV_GPU})
+  set(BR_THIRDPARTY_SRC ${BR_THIRDPARTY_SRC} plugins/gpucascade.cpp)
+endif()
@@ -0,0 +1,116 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <opencv2/gpu/gpu.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/opencvutils.h"
+#include "openbr/core/resource.h"
+
+using namespace cv;
+
+namespace br
+{
+
+QString CascadeModel(const QString &model); // cascade.cpp
+
+class GPUCascadeResourceMaker : public ResourceMaker<gpu::CascadeClassifier_GPU>
+{
+    QString file;
+
+public:
+    GPUCascadeResourceMaker(const QString &model)
+        : file(CascadeModel(model)) {}
+
+private:
+    gpu::CascadeClassifier_GPU *make() const
+    {
+        gpu::CascadeClassifier_GPU *cascade = new gpu::CascadeClassifier_GPU();
+        if (!cascade->load(file.toStdString()))
+            qFatal("Failed to load: %s", qPrintable(file));
+        return cascade;
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Wraps OpenCV's CUDA cascade classifier, a drop-in replacement for CascadeTransform on a single model.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Requires OpenCV built with CUDA and \c BR_WITH_OPENCV_GPU.
+ * Haar models must be in the old format, such as the default \c FrontalFace, LBP models are supported as is.
+ */
+class GPUCascadeTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString model READ get_model WRITE set_model RESET reset_model STORED false)
+    Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
+    Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
+    BR_PROPERTY(QString, model, "FrontalFace")
+    BR_PROPERTY(int, minSize, 64)
+    BR_PROPERTY(float, scaleFactor, 1.2)
+    BR_PROPERTY(int, minNeighbors, 5)
+
+    Resource<gpu::CascadeClassifier_GPU> cascadeResource;
+
+    void init()
+    {
+        if (gpu::getCudaEnabledDeviceCount() == 0)
+            qFatal("No CUDA device available for GPUCascade.");
+        cascadeResource.setResourceMaker(new GPUCascadeResourceMaker(model));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const bool enrollAll = src.file.get<bool>("enrollAll", false);
+        const int minFace = src.file.get<int>("minSize", minSize);
+
+        Mat gray;
+        if (src.m().channels() == 3) cvtColor(src, gray, CV_BGR2GRAY);
+        else                         gray = src;
+
+        vector<Rect> rects;
+        if ((gray.cols >= minFace) && (gray.rows >= minFace)) {
+            gpu::CascadeClassifier_GPU *cascade = cascadeResource.acquire();
+            const gpu::GpuMat image(gray);
+            gpu::GpuMat objects;
+            cascade->findLargestObject = !enrollAll;
+            const int count = cascade->detectMultiScale(image, objects, scaleFactor, minNeighbors, Size(minFace, minFace));
+            Mat detections;
+            if (count > 0) objects.colRange(0, count).download(detections);
+            cascadeResource.release(cascade);
+
+            for (int i=0; i<count; i++)
+                rects.push_back(detections.ptr<Rect>()[i]);
+        }
+
+        if (!enrollAll && rects.empty())
+            rects.push_back(Rect(0, 0, src.m().cols, src.m().rows));
+
+        foreach (const Rect &rect, rects) {
+            dst += src;
+            dst.file.appendRect(OpenCVUtils::fromRect(rect));
+        }
+    }
+};
+
+BR_REGISTER(Transform, GPUCascadeTransform)
+
+} // namespace br
+
+#include "gpucascade.moc"
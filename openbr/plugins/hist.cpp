@@ -25,9 +25,58 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Bin of each 8-bit value, the same as calcHist() with a uniform range, values outside [min, max) map to \em dims.
+ */
+static QVector<int> binLUT(float min, float max, int dims)
+{
+    QVector<int> lut(256);
+    const double a = dims / (double(max) - min);
+    const double b = -min * a;
+    for (int v=0; v<256; v++) {
+        const int bin = cvFloor(v*a + b);
+        lut[v] = ((bin >= 0) && (bin < dims) && (v >= min) && (v < max)) ? bin : dims;
+    }
+    return lut;
+}
+
+/*!
+ * \brief Counts an 8-bit image with one histogram per channel into \em counts.
+ *
+ * Consecutive pixels go to four interleaved sub-histograms, so repeated values don't stall on the same counter.
+ * Each histogram has \em dims+1 bins, the last collecting values outside the range.
+ */
+static void countChannels(const Mat &m, const int *lut, int dims, qint32 *counts)
+{
+    const int channels = m.channels();
+    const int stride = channels*(dims+1);
+    QVector<qint32> sub(4*stride, 0);
+    qint32 *s0 = sub.data(), *s1 = s0+stride, *s2 = s1+stride, *s3 = s2+stride;
+    for (int r=0; r<m.rows; r++) {
+        const uchar *p = m.ptr<uchar>(r);
+        const int n = m.cols*channels;
+        int i = 0;
+        if (channels == 1) {
+            for (; i+4<=n; i+=4) {
+                s0[lut[p[i  ]]]++;
+                s1[lut[p[i+1]]]++;
+                s2[lut[p[i+2]]]++;
+                s3[lut[p[i+3]]]++;
+            }
+        }
+        for (; i<n; i++)
+            s0[(i%channels)*(dims+1) + lut[p[i]]]++;
+    }
+    for (int i=0; i<stride; i++)
+        counts[i] += s0[i] + s1[i] + s2[i] + s3[i];
+}
+
 /*!
  * \ingroup transforms
  * \brief Histograms the matrix
+ *
+ * 8-bit matrices are counted with integer histograms in one pass over the interleaved channels,
+ * others are split and passed to calcHist().
  * \author Josh Klontz \cite jklontz
  */
 class HistTransform : public UntrainableTransform
@@ -40,9 +89,30 @@ class HistTransform : public UntrainableTransform
     BR_PROPERTY(float, min, 0)
     BR_PROPERTY(int, dims, -1)
 
+    int bins;
+    QVector<int> lut;
+
+    void init()
+    {
+        bins = dims == -1 ? max - min : dims;
+        lut = binLUT(min, max, bins);
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        const int dims = this->dims == -1 ? max - min : this->dims;
+        const int dims = bins;
+
+        if (src.m().depth() == CV_8U) {
+            const int channels = src.m().channels();
+            QVector<qint32> counts(channels*(dims+1), 0);
+            countChannels(src, lut.constData(), dims, counts.data());
+            Mat m(channels, dims, CV_32FC1);
+            for (int i=0; i<channels; i++)
+                for (int j=0; j<dims; j++)
+                    m.at<float>(i,j) = counts[i*(dims+1)+j];
+            dst += m;
+            return;
+        }
 
         std::vector<Mat> mv;
         split(src, mv);
@@ -64,6 +134,85 @@ class HistTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, HistTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Histograms each rectangular region of an 8-bit matrix in one pass.
+ *
+ * Equivalent to RectRegions(width,height,widthStep,heightStep)+Hist(max,min,dims) with integer counting,
+ * the regions are output in the same order as RectRegions.
+ * \author Josh Klontz \cite jklontz
+ */
+class RectHistTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(float max READ get_max WRITE set_max RESET reset_max STORED false)
+    Q_PROPERTY(float min READ get_min WRITE set_min RESET reset_min STORED false)
+    Q_PROPERTY(int dims READ get_dims WRITE set_dims RESET reset_dims STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(float, max, 256)
+    BR_PROPERTY(float, min, 0)
+    BR_PROPERTY(int, dims, -1)
+
+    int bins;
+    QVector<int> lut;
+
+    void init()
+    {
+        bins = dims == -1 ? max - min : dims;
+        lut = binLUT(min, max, bins);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat &m = src;
+        if (m.depth() != CV_8U) qFatal("RectHist requires 8-bit matrices.");
+
+        const int widthStep = this->widthStep == -1 ? width : this->widthStep;
+        const int heightStep = this->heightStep == -1 ? height : this->heightStep;
+        const int nx = m.cols < width ? 0 : (m.cols - width)/widthStep + 1;
+        const int ny = m.rows < height ? 0 : (m.rows - height)/heightStep + 1;
+        if ((nx == 0) || (ny == 0)) return;
+
+        // Region (x, y) is histogram x*ny + y, each with dims+1 bins per channel
+        const int channels = m.channels();
+        const int stride = channels*(bins+1);
+        QVector<qint32> counts(nx*ny*stride, 0);
+        const int *lut = this->lut.constData();
+
+        const int rows = (ny-1)*heightStep + height;
+        for (int r=0; r<rows; r++) {
+            const int yBegin = r < height ? 0 : (r-height)/heightStep + 1;
+            const int yEnd = qMin(ny-1, r/heightStep);
+            const uchar *p = m.ptr<uchar>(r);
+            for (int x=0; x<nx; x++) {
+                const uchar *q = p + x*widthStep*channels;
+                for (int y=yBegin; y<=yEnd; y++) {
+                    qint32 *h = counts.data() + (x*ny+y)*stride;
+                    if (channels == 1) for (int c=0; c<width; c++) h[lut[q[c]]]++;
+                    else               for (int c=0; c<width*channels; c++) h[(c%channels)*(bins+1) + lut[q[c]]]++;
+                }
+            }
+        }
+
+        for (int i=0; i<nx*ny; i++) {
+            Mat hist(channels, bins, CV_32FC1);
+            for (int j=0; j<channels; j++)
+                for (int k=0; k<bins; k++)
+                    hist.at<float>(j,k) = counts[i*stride + j*(bins+1) + k];
+            dst += hist;
+        }
+    }
+};
+
+BR_REGISTER(Transform, RectHistTransform)
+
 /*!
  * \ingroup transforms
  * \brief Quantizes the values into bins.
@@ -87,10 +236,20 @@ class BinTransform : public UntrainableTransform
         src.m().convertTo(dst, bins > 256 ? CV_16U : CV_8U, bins/(max-min), floor);
         if (!split) return;
 
-        Mat input = dst;
+        // One pass sets each element in the output for its bin
+        const Mat input = dst;
         QList<Mat> outputs; outputs.reserve(bins);
         for (int i=0; i<bins; i++)
-            outputs.append(input == i); // Note: Matrix elements are 0 or 255
+            outputs.append(Mat(input.size(), CV_8UC1, Scalar(0)));
+        for (int r=0; r<input.rows; r++) {
+            QVector<uchar*> rows(bins);
+            for (int i=0; i<bins; i++)
+                rows[i] = outputs[i].ptr(r);
+            for (int c=0; c<input.cols; c++) {
+                const int bin = (input.depth() == CV_8U) ? input.at<uchar>(r,c) : input.at<ushort>(r,c);
+                if (bin < bins) rows[bin][c] = 255; // Note: Matrix elements are 0 or 255
+            }
+        }
         dst.clear(); dst.append(outputs);
     }
 };
@@ -146,18 +305,31 @@ class IntegralHistTransform : public UntrainableTransform
     {
         const Mat &m = src.m();
         if (m.type() != CV_8UC1) qFatal("IntegralHist requires 8UC1 matrices.");
+        if (bins < 256) {
+            double maxVal;
+            minMaxLoc(m, NULL, &maxVal);
+            if (maxVal >= bins) qFatal("IntegralHist value %g exceeds %d bins.", maxVal, bins);
+        }
 
-        Mat integral(m.rows/radius+1, (m.cols/radius+1)*bins, CV_32SC1);
-        integral.setTo(0);
+        // Cell (i, j) occupies columns [j*bins, (j+1)*bins), row and column 0 are zero
+        const int cells = m.cols/radius;
+        Mat integral(m.rows/radius+1, (cells+1)*bins, CV_32SC1, Scalar(0));
         for (int i=1; i<integral.rows; i++) {
-            for (int j=1; j<integral.cols; j+=bins) {
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i-1, j     +k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i  , j-bins+k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) -= integral.at<qint32>(i-1, j-bins+k);
-                for (int k=0; k<radius; k++)
-                    for (int l=0; l<radius; l++)
-                        integral.at<qint32>(i, j+m.at<quint8>((i-1)*radius+k,(j/bins-1)*radius+l))++;
+            qint32 *row = integral.ptr<qint32>(i);
+            const qint32 *above = integral.ptr<qint32>(i-1);
+
+            // Count this band of cells a pixel row at a time
+            for (int k=0; k<radius; k++) {
+                const uchar *p = m.ptr<uchar>((i-1)*radius+k);
+                for (int c=0; c<cells*radius; c++)
+                    row[(c/radius+1)*bins + p[c]]++;
             }
+
+            // Prefix sums along the row, then down the columns
+            for (int j=bins; j<integral.cols; j++)
+                row[j] += row[j-bins];
+            for (int j=bins; j<integral.cols; j++)
+                row[j] += above[j];
         }
         dst = integral;
     }
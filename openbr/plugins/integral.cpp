@@ -44,10 +44,15 @@ class IntegralSamplerTransform : public UntrainableTransform
     BR_PROPERTY(int, minSize, 6)
 
     void project(const Template &src, Template &dst) const
+    {
+        dst.m() = sample(src);
+    }
+
+protected:
+    Mat sample(const Mat &m) const
     {
         typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
         typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,1> > OutputDescriptor;
-        const Mat &m = src.m();
         if (m.depth() != CV_32S) qFatal("Expected CV_32S matrix depth.");
         const int channels = m.channels();
         const int rowStep = channels * m.cols;
@@ -88,7 +93,7 @@ class IntegralSamplerTransform : public UntrainableTransform
         if (descriptors != index)
             qFatal("Allocated %d descriptors but computed %d.", descriptors, index);
 
-        dst.m() = n;
+        return n;
     }
 };
 
@@ -127,6 +132,52 @@ private:
 
 BR_REGISTER(Transform, GradientTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Dense histogram of oriented gradients.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Equivalent to <tt>Gradient+Bin(0,360,bins,true)+Merge+Integral+IntegralSampler</tt>,
+ * but accumulates the integral histogram directly from the gradient angles without per-bin intermediates.
+ */
+class IntegralHoGTransform : public IntegralSamplerTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
+    BR_PROPERTY(int, bins, 8)
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().type() != CV_8UC1) qFatal("Requires CV_8UC1 input.");
+        Mat dx, dy, angle;
+        Sobel(src, dx, CV_32F, 1, 0);
+        Sobel(src, dy, CV_32F, 0, 1);
+
+        // Bins hold 255 per pixel to match the thresholded masks of Bin(split=true)
+        const float scale = float(bins)/360.f;
+        const int rows = dx.rows, cols = dx.cols;
+        Mat m = Mat::zeros(rows+1, cols+1, CV_32SC(bins));
+        QVector<qint32> rowSums(bins);
+        for (int i=0; i<rows; i++) {
+            phase(dx.row(i), dy.row(i), angle, true);
+            const float *angles = angle.ptr<float>();
+            const qint32 *above = m.ptr<qint32>(i) + bins;
+            qint32 *current = m.ptr<qint32>(i+1) + bins;
+            rowSums.fill(0);
+            for (int j=0; j<cols; j++) {
+                const int bin = saturate_cast<uchar>(angles[j]*scale - 0.5f);
+                if (bin < bins) rowSums[bin] += 255;
+                for (int k=0; k<bins; k++)
+                    current[j*bins+k] = above[j*bins+k] + rowSums[k];
+            }
+        }
+
+        dst.m() = sample(m);
+    }
+};
+
+BR_REGISTER(Transform, IntegralHoGTransform)
+
 /*!
  * \ingroup transforms
  * \brief Projects each row based on a computed word.
@@ -147,6 +198,7 @@ class WordWiseTransform : public Transform
         getWords->train(data);
         TemplateList bins;
         getWords->project(data, bins);
+        if (bins.size() != data.size()) qFatal("WordWise expected a word assignment for every template.");
 
         numWords = 0;
         foreach (const Template &t, bins) {
@@ -156,31 +208,37 @@ class WordWiseTransform : public Transform
         }
 
         TemplateList reworded; reworded.reserve(data.size());
-        foreach (const Template &t, data)
-            reworded.append(reword(t));
+        for (int i=0; i<data.size(); i++)
+            reworded.append(reword(data[i], bins[i]));
         byWord->train(reworded);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        byWord->project(reword(src), dst);
+        Template words;
+        getWords->project(src, words);
+        byWord->project(reword(src, words), dst);
     }
 
-    Template reword(const Template &src) const
+    // Counting sort of the rows by word into one buffer, each word's matrix is a view of its rows
+    Template reword(const Template &src, const Template &words) const
     {
-        Template words;
-        getWords->project(src, words);
-        QVector<int> wordCounts(numWords, 0);
+        const Mat &m = src.m();
+        QVector<int> offsets(numWords+1, 0);
         for (int i=0; i<words.m().rows; i++)
-            wordCounts[words.m().at<uchar>(i,0)]++;
+            offsets[words.m().at<uchar>(i,0)+1]++;
+        for (int i=0; i<numWords; i++)
+            offsets[i+1] += offsets[i];
+
+        Mat buffer(m.rows, m.cols, m.type());
+        const size_t rowBytes = m.cols * m.elemSize();
+        QVector<int> next = offsets;
+        for (int i=0; i<m.rows; i++)
+            memcpy(buffer.ptr(next[words.m().at<uchar>(i,0)]++), m.ptr(i), rowBytes);
+
         Template reworded(src.file); reworded.reserve(numWords);
         for (int i=0; i<numWords; i++)
-            reworded.append(Mat(wordCounts[i], src.m().cols, src.m().type()));
-        QVector<int> indicies(numWords, 0);
-        for (int i=0; i<src.m().rows; i++) {
-            const int word = words.m().at<uchar>(i,0);
-            src.m().row(i).copyTo(reworded[word].row(indicies[word]++));
-        }
+            reworded.append(buffer.rowRange(offsets[i], offsets[i+1]));
         return reworded;
     }
 };
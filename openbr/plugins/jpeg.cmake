@@ -0,0 +1,8 @@
+set(BR_WITH_LIBJPEG OFF CACHE BOOL "Build with libjpeg(-turbo) reduced resolution decoding")
+
+if(${BR_WITH_LIBJPEG})
+  find_package(JPEG REQUIRED)
+  include_directories(${JPEG_INCLUDE_DIR})
+  set(BR_THIRDPARTY_SRC ${BR_THIRDPARTY_SRC} plugins/jpeg.cpp)
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${JPEG_LIBRARIES})
+endif()
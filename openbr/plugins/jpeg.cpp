@@ -0,0 +1,156 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <QFile>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/network.h"
+
+using namespace cv;
+
+namespace br
+{
+
+QString resolveImagePath(const File &file);
+
+struct JPEGError
+{
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+static void onJPEGError(j_common_ptr info)
+{
+    longjmp(reinterpret_cast<JPEGError*>(info->err)->jump, 1);
+}
+
+// Decodes with DCT scaling to the smallest of 1/1, 1/2, 1/4 or 1/8 resolution whose larger dimension is at least size
+static bool decodeJPEG(const QByteArray &data, int size, bool gray, Mat &m, int *denominator)
+{
+    jpeg_decompress_struct info;
+    JPEGError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = onJPEGError;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, (unsigned char*)data.data(), data.size());
+    jpeg_read_header(&info, TRUE);
+
+    int scale = 1;
+    if (size > 0)
+        while ((scale < 8) && (int(std::max(info.image_width, info.image_height)) / (2*scale) >= size))
+            scale *= 2;
+    info.scale_num = 1;
+    info.scale_denom = scale;
+#ifdef JCS_EXTENSIONS
+    info.out_color_space = gray ? JCS_GRAYSCALE : JCS_EXT_BGR;
+#else
+    info.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+#endif // JCS_EXTENSIONS
+
+    jpeg_start_decompress(&info);
+    m.create(info.output_height, info.output_width, gray ? CV_8UC1 : CV_8UC3);
+    while (info.output_scanline < info.output_height) {
+        JSAMPROW row = m.ptr(info.output_scanline);
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+
+#ifndef JCS_EXTENSIONS
+    if (!gray) cvtColor(m, m, CV_RGB2BGR);
+#endif // JCS_EXTENSIONS
+    *denominator = scale;
+    return true;
+}
+
+/*!
+ * \ingroup formats
+ * \brief Reads JPEG images with libjpeg, decoding at reduced resolution or in grayscale when requested.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Uses the \c DecodeSize and \c DecodeGray hints from br::OpenTransform,
+ * scaling in the DCT domain is much cheaper than decoding at full resolution and downsampling.
+ * Files libjpeg can't convert, like CMYK images, are decoded by OpenCV instead.
+ * Urls are fetched through br::Network like br::DefaultFormat.
+ */
+class jpgFormat : public Format
+{
+    Q_OBJECT
+
+    Template read() const
+    {
+        Template t;
+        QByteArray data;
+        if (Network::isUrl(file.name)) {
+            QString error;
+            data = Network::get(file.name, &error);
+            if (!error.isEmpty()) qWarning("Url::read %s.\n", qPrintable(error));
+        } else {
+            const QString fileName = resolveImagePath(file);
+            if (fileName.isEmpty()) return t;
+
+            QFile f(fileName);
+            if (!f.open(QFile::ReadOnly)) return t;
+            data = f.readAll();
+            f.close();
+        }
+        if (data.isEmpty()) return t;
+
+        const bool gray = file.get<bool>("DecodeGray", false);
+        Mat m;
+        int scale = 1;
+        if (!decodeJPEG(data, file.get<int>("DecodeSize", 0), gray, m, &scale))
+            m = imdecode(Mat(1, data.size(), CV_8UC1, (void*)data.data()), gray ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
+        if (!m.data) return t;
+
+        t.append(m);
+        if (scale != 1) t.file.set("DecodeScale", 1.0/scale);
+        return t;
+    }
+
+    void write(const Template &t) const
+    {
+        imwrite(file.name.toStdString(), t);
+    }
+};
+
+BR_REGISTER(Format, jpgFormat)
+
+/*!
+ * \ingroup formats
+ * \brief br::jpgFormat for the \c .jpeg extension.
+ * \author Josh Klontz \cite jklontz
+ */
+class jpegFormat : public jpgFormat
+{
+    Q_OBJECT
+};
+
+BR_REGISTER(Format, jpegFormat)
+
+} // namespace br
+
+#include "jpeg.moc"
@@ -15,9 +15,12 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <opencv2/features2d/features2d.hpp>
+#include <opencv2/flann/flann.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/nonfree/nonfree.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/distance_sse.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -104,18 +107,73 @@ class KeyPointDescriptorTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, KeyPointDescriptorTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Wraps an OpenCV Feature2D to detect and describe key points in one pass.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Equivalent to KeyPointDetector followed by KeyPointDescriptor, except that the scale space is built once
+ * and descriptors are computed at the detected octave and orientation of each key point.
+ * Binary features like \c ORB and \c BRISK emit \c CV_8U descriptors to compare with <tt>KeyPointMatcher(BruteForce-Hamming)</tt>.
+ */
+class KeyPointTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString feature READ get_feature WRITE set_feature RESET reset_feature STORED false)
+    BR_PROPERTY(QString, feature, "SIFT")
+
+    Ptr<Feature2D> feature2D;
+
+    void init()
+    {
+        feature2D = Feature2D::create(feature.toStdString());
+        if (feature2D.empty())
+            qFatal("Failed to create Feature2D: %s", qPrintable(feature));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst.file = src.file;
+
+        std::vector<KeyPoint> keyPoints;
+        Mat descriptors;
+        try {
+            (*feature2D)(src, Mat(), keyPoints, descriptors);
+        } catch (...) {
+            qWarning("Key point detection failed for file %s", qPrintable(src.file.name));
+            dst.file.set("FTE", true);
+        }
+
+        QList<Rect> rects;
+        foreach (const KeyPoint &keyPoint, keyPoints)
+            rects.append(Rect(keyPoint.pt.x, keyPoint.pt.y, keyPoint.size, keyPoint.size));
+        dst.file.setRects(OpenCVUtils::fromRects(rects));
+        dst += descriptors;
+    }
+};
+
+BR_REGISTER(Transform, KeyPointTransform)
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV Key Point Matcher
  * \author Josh Klontz \cite jklontz
+ *
+ * \c BruteForce matching of float descriptors runs the ratio test with the vectorized L2 kernel on the caller's thread.
+ * Set \em index to instead build one approximate nearest neighbor index over the query's descriptors per row of comparisons,
+ * a k-d tree for float descriptors or LSH for binary ones, and search it with every target's descriptors.
  */
 class KeyPointMatcherTransform : public Distance
 {
     Q_OBJECT
     Q_PROPERTY(QString matcher READ get_matcher WRITE set_matcher RESET reset_matcher STORED false)
     Q_PROPERTY(float maxRatio READ get_maxRatio WRITE set_maxRatio RESET reset_maxRatio STORED false)
+    Q_PROPERTY(bool index READ get_index WRITE set_index RESET reset_index STORED false)
+    Q_PROPERTY(int checks READ get_checks WRITE set_checks RESET reset_checks STORED false)
     BR_PROPERTY(QString, matcher, "BruteForce")
     BR_PROPERTY(float, maxRatio, 0.8)
+    BR_PROPERTY(bool, index, false)
+    BR_PROPERTY(int, checks, 32)
 
     Ptr<DescriptorMatcher> descriptorMatcher;
 
@@ -129,18 +187,88 @@ class KeyPointMatcherTransform : public Distance
     float compare(const Template &a, const Template &b) const
     {
         if ((a.m().rows < 2) || (b.m().rows < 2)) return 0;
+        const Mat &query = (a.m().rows < b.m().rows) ? a.m() : b.m();
+        const Mat &train = (a.m().rows < b.m().rows) ? b.m() : a.m();
+
+        QVector<float> distances;
+        if ((query.cols == train.cols) && query.isContinuous() && train.isContinuous() &&
+            (((matcher == "BruteForce") && (query.type() == CV_32FC1) && (train.type() == CV_32FC1)) ||
+             ((matcher == "BruteForce-Hamming") && (query.type() == CV_8UC1) && (train.type() == CV_8UC1)))) {
+            bruteForce(query, train, distances);
+        } else {
+            std::vector< std::vector<DMatch> > matches;
+            descriptorMatcher->knnMatch(query, train, matches, 2);
+            foreach (const std::vector<DMatch> &match, matches)
+                if (!(match[0].distance / match[1].distance > maxRatio))
+                    distances.append(match[0].distance);
+        }
+        return similarity(distances);
+    }
 
-        std::vector< std::vector<DMatch> > matches;
-        if (a.m().rows < b.m().rows) descriptorMatcher->knnMatch(a, b, matches, 2);
-        else                         descriptorMatcher->knnMatch(b, a, matches, 2);
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        if (!index || (query.m().rows < 2))
+            return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const Mat &descriptors = query.m();
+        const bool binary = (descriptors.depth() == CV_8U);
+        flann::Index tree(descriptors, binary ? (const flann::IndexParams&)flann::LshIndexParams(6, 12, 1)
+                                              : (const flann::IndexParams&)flann::KDTreeIndexParams(4),
+                          binary ? cvflann::FLANN_DIST_HAMMING : cvflann::FLANN_DIST_L2);
+
+        Mat indices, dists;
+        QVector<float> distances;
+        for (int i=0; i<count; i++) {
+            const Mat &target = targets[offset+i].m();
+            if (target.rows < 2) {
+                scores[i] = 0;
+                continue;
+            }
+
+            tree.knnSearch(target, indices, dists, 2, flann::SearchParams(checks));
+            if (dists.type() != CV_32F) dists.convertTo(dists, CV_32F);
+            distances.clear();
+            for (int j=0; j<dists.rows; j++) {
+                // Squared L2 from the k-d tree
+                const float first = binary ? dists.at<float>(j, 0) : sqrt(dists.at<float>(j, 0));
+                const float second = binary ? dists.at<float>(j, 1) : sqrt(dists.at<float>(j, 1));
+                if (!(first / second > maxRatio))
+                    distances.append(first);
+            }
+            scores[i] = similarity(distances);
+        }
+    }
 
-        QList<float> distances;
-        foreach (const std::vector<DMatch> &match, matches) {
-            if (match[0].distance / match[1].distance > maxRatio) continue;
-            distances.append(match[0].distance);
+    // Exact two nearest neighbors of each query descriptor, equivalent to BruteForce or BruteForce-Hamming knnMatch(query, train, matches, 2)
+    void bruteForce(const Mat &query, const Mat &train, QVector<float> &distances) const
+    {
+        const bool binary = (query.depth() == CV_8U);
+        distances.reserve(query.rows);
+        for (int i=0; i<query.rows; i++) {
+            float first = std::numeric_limits<float>::max();
+            float second = std::numeric_limits<float>::max();
+            for (int j=0; j<train.rows; j++) {
+                const float distance = binary ? hamming(query.ptr<uchar>(i), train.ptr<uchar>(j), query.cols)
+                                              : squared_l2(query.ptr<float>(i), train.ptr<float>(j), query.cols);
+                if (distance < first) {
+                    second = first;
+                    first = distance;
+                } else if (distance < second) {
+                    second = distance;
+                }
+            }
+            if (!binary) {
+                first = sqrt(first);
+                second = sqrt(second);
+            }
+            if (!(first / second > maxRatio))
+                distances.append(first);
         }
-        qSort(distances);
+    }
 
+    static float similarity(QVector<float> &distances)
+    {
+        std::sort(distances.begin(), distances.end());
         float similarity = 0;
         for (int i=0; i<distances.size(); i++)
             similarity += 1.f/(1+distances[i])/(i+1);
@@ -178,6 +306,169 @@ class SIFTDescriptorTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, SIFTDescriptorTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief SIFTDescriptor specialized to keypoints sharing one size and orientation, like those from GridTransform.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Emits the same 128-D descriptors as SIFTDescriptor without building OpenCV's scale space.
+ * Image gradients are computed once per image and shared by overlapping windows,
+ * and the window's histogram bins and gaussian weights are computed once per transform.
+ */
+class DenseSIFTDescriptorTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
+    BR_PROPERTY(int, size, 1)
+
+    enum { Width = 4, Bins = 8 }; // Spatial bins per side and orientation bins per histogram, as in OpenCV
+
+    // A pixel offset within the descriptor window and where it lands in the histograms
+    struct Sample
+    {
+        int dr, dc;
+        float rbin, cbin, weight;
+    };
+
+    QVector<Sample> samples;
+    float angle;
+
+    // Mirrors calcSIFTDescriptor() in OpenCV for the first octave
+    void init()
+    {
+        // OpenCV orients provided keypoints at 360 - KeyPoint::angle, which is -1 by default
+        angle = 361;
+        const float histWidth = 3 * size * 0.5f;
+        const int radius = cvRound(histWidth * 1.4142135623730951f * (Width + 1) * 0.5f);
+        const float cosT = cosf(angle*(float)(CV_PI/180)) / histWidth;
+        const float sinT = sinf(angle*(float)(CV_PI/180)) / histWidth;
+        const float expScale = -1.f / (Width * Width * 0.5f);
+
+        samples.clear();
+        for (int i=-radius; i<=radius; i++)
+            for (int j=-radius; j<=radius; j++) {
+                const float cRot = j * cosT - i * sinT;
+                const float rRot = j * sinT + i * cosT;
+                Sample sample;
+                sample.dr = i;
+                sample.dc = j;
+                sample.rbin = rRot + Width/2 - 0.5f;
+                sample.cbin = cRot + Width/2 - 0.5f;
+                sample.weight = (cRot * cRot + rRot * rRot) * expScale;
+                if ((sample.rbin > -1) && (sample.rbin < Width) && (sample.cbin > -1) && (sample.cbin < Width))
+                    samples.append(sample);
+            }
+
+        for (int i=0; i<samples.size(); i++)
+            samples[i].weight = exp(samples[i].weight);
+    }
+
+    void describe(const Mat &magnitudes, const Mat &orientations, Point pt, float *dst) const
+    {
+        const int histStride = Bins + 2;
+        float hist[(Width+2)*(Width+2)*(Bins+2)];
+        std::fill(hist, hist + (Width+2)*(Width+2)*(Bins+2), 0.f);
+
+        const float binsPerDegree = Bins / 360.f;
+        foreach (const Sample &sample, samples) {
+            const int r = pt.y + sample.dr, c = pt.x + sample.dc;
+            if ((r <= 0) || (r >= magnitudes.rows-1) || (c <= 0) || (c >= magnitudes.cols-1))
+                continue;
+
+            float rbin = sample.rbin, cbin = sample.cbin;
+            float obin = (orientations.at<float>(r, c) - angle) * binsPerDegree;
+            const float mag = magnitudes.at<float>(r, c) * sample.weight;
+
+            const int r0 = cvFloor(rbin);
+            const int c0 = cvFloor(cbin);
+            int o0 = cvFloor(obin);
+            rbin -= r0;
+            cbin -= c0;
+            obin -= o0;
+            if (o0 < 0) o0 += Bins;
+            if (o0 >= Bins) o0 -= Bins;
+
+            // Tri-linear interpolation
+            const float vR1 = mag*rbin, vR0 = mag - vR1;
+            const float vRC11 = vR1*cbin, vRC10 = vR1 - vRC11;
+            const float vRC01 = vR0*cbin, vRC00 = vR0 - vRC01;
+            const float vRCO111 = vRC11*obin, vRCO110 = vRC11 - vRCO111;
+            const float vRCO101 = vRC10*obin, vRCO100 = vRC10 - vRCO101;
+            const float vRCO011 = vRC01*obin, vRCO010 = vRC01 - vRCO011;
+            const float vRCO001 = vRC00*obin, vRCO000 = vRC00 - vRCO001;
+
+            const int idx = ((r0+1)*(Width+2) + c0+1)*histStride + o0;
+            hist[idx] += vRCO000;
+            hist[idx+1] += vRCO001;
+            hist[idx+histStride] += vRCO010;
+            hist[idx+histStride+1] += vRCO011;
+            hist[idx+(Width+2)*histStride] += vRCO100;
+            hist[idx+(Width+2)*histStride+1] += vRCO101;
+            hist[idx+(Width+3)*histStride] += vRCO110;
+            hist[idx+(Width+3)*histStride+1] += vRCO111;
+        }
+
+        // Orientation histograms are circular
+        for (int i=0; i<Width; i++)
+            for (int j=0; j<Width; j++) {
+                const int idx = ((i+1)*(Width+2) + (j+1))*histStride;
+                hist[idx] += hist[idx+Bins];
+                hist[idx+1] += hist[idx+Bins+1];
+                for (int k=0; k<Bins; k++)
+                    dst[(i*Width + j)*Bins + k] = hist[idx+k];
+            }
+
+        // Clip at 0.2 of the norm, renormalize and scale to a byte range
+        const int length = Width*Width*Bins;
+        float norm = 0;
+        for (int k=0; k<length; k++)
+            norm += dst[k]*dst[k];
+        const float threshold = sqrt(norm) * 0.2f;
+        norm = 0;
+        for (int k=0; k<length; k++) {
+            dst[k] = std::min(dst[k], threshold);
+            norm += dst[k]*dst[k];
+        }
+        norm = 512.f / std::max(sqrt(norm), std::numeric_limits<float>::epsilon());
+        for (int k=0; k<length; k++)
+            dst[k] = saturate_cast<uchar>(dst[k]*norm);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        // The base of OpenCV's scale space, blurred from the assumed 0.5 to SIFT's 1.6
+        Mat gray;
+        if (src.m().channels() == 1) gray = src.m();
+        else                         cvtColor(src, gray, CV_BGR2GRAY);
+        Mat base;
+        gray.convertTo(base, CV_32F);
+        const float sigma = sqrtf(std::max(1.6f*1.6f - 0.5f*0.5f, 0.01f));
+        GaussianBlur(base, base, Size(), sigma, sigma);
+
+        // Central differences on the interior, shared by every window
+        Mat dx = Mat::zeros(base.size(), CV_32FC1), dy = Mat::zeros(base.size(), CV_32FC1);
+        for (int r=1; r<base.rows-1; r++) {
+            const float *above = base.ptr<float>(r-1), *row = base.ptr<float>(r), *below = base.ptr<float>(r+1);
+            float *x = dx.ptr<float>(r), *y = dy.ptr<float>(r);
+            for (int c=1; c<base.cols-1; c++) {
+                x[c] = row[c+1] - row[c-1];
+                y[c] = above[c] - below[c];
+            }
+        }
+        Mat magnitudes, orientations;
+        magnitude(dx, dy, magnitudes);
+        phase(dx, dy, orientations, true);
+
+        const QList<QPointF> points = src.file.points();
+        Mat m(points.size(), Width*Width*Bins, CV_32FC1);
+        for (int i=0; i<points.size(); i++)
+            describe(magnitudes, orientations, Point(cvRound(points[i].x()), cvRound(points[i].y())), m.ptr<float>(i));
+        dst += m;
+    }
+};
+
+BR_REGISTER(Transform, DenseSIFTDescriptorTransform)
+
 /*!
  * \ingroup transforms
  * \brief Add landmarks to the template in a grid layout
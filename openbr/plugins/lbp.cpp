@@ -18,11 +18,126 @@
 #include <limits>
 #include <openbr/openbr_plugin.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#  define BR_LBP_SSE2
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define BR_LBP_NEON
+#  include <arm_neon.h>
+#endif
+
 using namespace cv;
 
 namespace br
 {
 
+/*!
+ * \brief Writes the 8-bit pattern of every column in [begin, end) comparing the neighbors at distance radius to the center.
+ *
+ * Neighbors are visited clockwise from the top left, the top left neighbor being the most significant bit.
+ */
+template <typename T>
+static int lbpScalar(const T *above, const T *center, const T *below, int radius, int begin, int end, uchar *codes)
+{
+    for (int c=begin; c<end; c++) {
+        const T cval = center[c];
+        codes[c] = (above[c-radius] >= cval ? 128 : 0) |
+                   (above[c]        >= cval ? 64  : 0) |
+                   (above[c+radius] >= cval ? 32  : 0) |
+                   (center[c+radius] >= cval ? 16 : 0) |
+                   (below[c+radius] >= cval ? 8   : 0) |
+                   (below[c]        >= cval ? 4   : 0) |
+                   (below[c-radius] >= cval ? 2   : 0) |
+                   (center[c-radius] >= cval ? 1  : 0);
+    }
+    return end;
+}
+
+#if defined(BR_LBP_SSE2)
+
+static int lbpVector(const uchar *above, const uchar *center, const uchar *below, int radius, int begin, int end, uchar *codes)
+{
+    int c = begin;
+    for (; c+16<=end; c+=16) {
+        const __m128i cval = _mm_loadu_si128((const __m128i*)(center+c));
+        const uchar *neighbors[8] = { above+c-radius, above+c, above+c+radius, center+c+radius, below+c+radius, below+c, below+c-radius, center+c-radius };
+        __m128i code = _mm_setzero_si128();
+        for (int i=0; i<8; i++) {
+            // Unsigned n >= c is max(n, c) == n
+            const __m128i n = _mm_loadu_si128((const __m128i*)neighbors[i]);
+            code = _mm_or_si128(code, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(n, cval), n), _mm_set1_epi8(char(128 >> i))));
+        }
+        _mm_storeu_si128((__m128i*)(codes+c), code);
+    }
+    return c;
+}
+
+static int lbpVector(const float *above, const float *center, const float *below, int radius, int begin, int end, uchar *codes)
+{
+    int c = begin;
+    for (; c+16<=end; c+=16) {
+        __m128i quarters[4];
+        for (int q=0; q<4; q++) {
+            const int k = c + 4*q;
+            const __m128 cval = _mm_loadu_ps(center+k);
+            const float *neighbors[8] = { above+k-radius, above+k, above+k+radius, center+k+radius, below+k+radius, below+k, below+k-radius, center+k-radius };
+            __m128i code = _mm_setzero_si128();
+            for (int i=0; i<8; i++)
+                code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(neighbors[i]), cval)), _mm_set1_epi32(128 >> i)));
+            quarters[q] = code;
+        }
+        _mm_storeu_si128((__m128i*)(codes+c), _mm_packus_epi16(_mm_packs_epi32(quarters[0], quarters[1]),
+                                                                _mm_packs_epi32(quarters[2], quarters[3])));
+    }
+    return c;
+}
+
+#elif defined(BR_LBP_NEON)
+
+static int lbpVector(const uchar *above, const uchar *center, const uchar *below, int radius, int begin, int end, uchar *codes)
+{
+    int c = begin;
+    for (; c+16<=end; c+=16) {
+        const uint8x16_t cval = vld1q_u8(center+c);
+        const uchar *neighbors[8] = { above+c-radius, above+c, above+c+radius, center+c+radius, below+c+radius, below+c, below+c-radius, center+c-radius };
+        uint8x16_t code = vdupq_n_u8(0);
+        for (int i=0; i<8; i++)
+            code = vorrq_u8(code, vandq_u8(vcgeq_u8(vld1q_u8(neighbors[i]), cval), vdupq_n_u8(uchar(128 >> i))));
+        vst1q_u8(codes+c, code);
+    }
+    return c;
+}
+
+static int lbpVector(const float *above, const float *center, const float *below, int radius, int begin, int end, uchar *codes)
+{
+    int c = begin;
+    for (; c+8<=end; c+=8) {
+        uint32x4_t halves[2];
+        for (int h=0; h<2; h++) {
+            const int k = c + 4*h;
+            const float32x4_t cval = vld1q_f32(center+k);
+            const float *neighbors[8] = { above+k-radius, above+k, above+k+radius, center+k+radius, below+k+radius, below+k, below+k-radius, center+k-radius };
+            uint32x4_t code = vdupq_n_u32(0);
+            for (int i=0; i<8; i++)
+                code = vorrq_u32(code, vandq_u32(vcgeq_f32(vld1q_f32(neighbors[i]), cval), vdupq_n_u32(128 >> i)));
+            halves[h] = code;
+        }
+        vst1_u8(codes+c, vmovn_u16(vcombine_u16(vmovn_u32(halves[0]), vmovn_u32(halves[1]))));
+    }
+    return c;
+}
+
+#else
+
+template <typename T>
+static int lbpVector(const T *above, const T *center, const T *below, int radius, int begin, int end, uchar *codes)
+{
+    (void) above; (void) center; (void) below; (void) radius; (void) end; (void) codes;
+    return begin;
+}
+
+#endif
+
 /*!
  * \ingroup transforms
  * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
@@ -40,6 +155,7 @@ class LBPTransform : public UntrainableTransform
     BR_PROPERTY(int, maxTransitions, 8)
     BR_PROPERTY(bool, rotationInvariant, false)
 
+protected:
     uchar lut[256];
     uchar null;
 
@@ -95,33 +211,107 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
-    void project(const Template &src, Template &dst) const
+    // 8-bit images are compared directly, everything else as floats
+    static Mat input(const Mat &src)
+    {
+        if (src.channels() != 1) qFatal("Expected single channel source.");
+        if (src.type() == CV_8UC1) return src;
+        Mat m; src.convertTo(m, CV_32F);
+        return m;
+    }
+
+    template <typename T>
+    void typedRowIds(const Mat &m, int r, uchar *ids) const
+    {
+        const int begin = std::min(radius, m.cols), end = std::max(begin, m.cols-radius);
+        if ((r < radius) || (r >= m.rows-radius)) {
+            memset(ids, null, m.cols);
+            return;
+        }
+
+        const T *above = m.ptr<T>(r-radius), *center = m.ptr<T>(r), *below = m.ptr<T>(r+radius);
+        const int vectorized = lbpVector(above, center, below, radius, begin, end, ids);
+        lbpScalar(above, center, below, radius, vectorized, end, ids);
+        for (int c=begin; c<end; c++)
+            ids[c] = lut[ids[c]];
+        memset(ids, null, begin);
+        memset(ids+end, null, m.cols-end);
+    }
+
+    /* Writes the pattern ids of row r, pixels within radius of the border are the null pattern */
+    void rowIds(const Mat &m, int r, uchar *ids) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        if (m.type() == CV_8UC1) typedRowIds<uchar>(m, r, ids);
+        else                     typedRowIds<float>(m, r, ids);
+    }
 
+private:
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat m = input(src);
         Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
+        for (int r=0; r<m.rows; r++)
+            rowIds(m, r, n.ptr(r));
+        dst += n;
+    }
+};
+
+BR_REGISTER(Transform, LBPTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief LBP histograms of overlapping rectangular regions.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Equivalent to <tt>LBP+RectRegions+Hist</tt> with one bin per pattern,
+ * without materializing the pattern image or the regions.
+ * \see LBPTransform RectRegionsTransform HistTransform
+ */
+class LBPHistTransform : public LBPTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int widthStep = this->widthStep == -1 ? width : this->widthStep;
+        const int heightStep = this->heightStep == -1 ? height : this->heightStep;
+        const Mat m = input(src);
+        const int bins = null + 1;
+
+        // Regions are ordered by column then row, like RectRegions
+        QList<int> xs, ys;
+        for (int x=0; x <= m.cols - width; x += widthStep) xs.append(x);
+        for (int y=0; y <= m.rows - height; y += heightStep) ys.append(y);
+        if (xs.isEmpty() || ys.isEmpty()) return;
+
+        Mat hists(xs.size()*ys.size(), bins, CV_32FC1, Scalar(0));
+        std::vector<uchar> ids(m.cols);
+        for (int r=0; r<ys.last()+height; r++) {
+            rowIds(m, r, &ids[0]);
+            for (int j=0; j<ys.size(); j++) {
+                if ((r < ys[j]) || (r >= ys[j]+height)) continue;
+                for (int i=0; i<xs.size(); i++) {
+                    float *hist = hists.ptr<float>(i*ys.size()+j);
+                    for (int c=xs[i]; c<xs[i]+width; c++)
+                        hist[ids[c]]++;
+                }
             }
         }
 
-        dst += n;
+        for (int i=0; i<hists.rows; i++)
+            dst += hists.row(i).clone();
     }
 };
 
-BR_REGISTER(Transform, LBPTransform)
+BR_REGISTER(Transform, LBPHistTransform)
 
 /*!
  * \ingroup transforms
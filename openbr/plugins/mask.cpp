@@ -56,18 +56,28 @@ class GradientMaskTransform : public UntrainableTransform
     Q_PROPERTY(int delta READ get_delta WRITE set_delta RESET reset_delta STORED false)
     BR_PROPERTY(int, delta, 1)
 
+    int tileHalo() const
+    {
+        return 1;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const Mat &m = src.m();
         if (m.type() != CV_8UC1) qFatal("Requires 8UC1 matrices.");
         Mat n = Mat(m.rows, m.cols, CV_8UC1);
-        n.setTo(255);
         for (int i=0; i<m.rows; i++) {
+            const quint8 *above = m.ptr<quint8>(std::max(i-1, 0));
+            const quint8 *row = m.ptr<quint8>(i);
+            const quint8 *below = m.ptr<quint8>(std::min(i+1, m.rows-1));
+            quint8 *out = n.ptr<quint8>(i);
             for (int j=0; j<m.cols; j++) {
-                if ((i>0)        && (abs(m.at<quint8>(i-1,j)-m.at<quint8>(i,j)) > delta)) { n.at<quint8>(i,j) = 0; continue; }
-                if ((j+1<m.cols) && (abs(m.at<quint8>(i,j+1)-m.at<quint8>(i,j)) > delta)) { n.at<quint8>(i,j) = 0; continue; }
-                if ((i+1<m.rows) && (abs(m.at<quint8>(i+1,j)-m.at<quint8>(i,j)) > delta)) { n.at<quint8>(i,j) = 0; continue; }
-                if ((j>0)        && (abs(m.at<quint8>(i,j-1)-m.at<quint8>(i,j)) > delta)) { n.at<quint8>(i,j) = 0; continue; }
+                const int center = row[j];
+                const bool edge = ((i > 0) && (abs(above[j]-center) > delta)) ||
+                                  ((j+1 < m.cols) && (abs(row[j+1]-center) > delta)) ||
+                                  ((i+1 < m.rows) && (abs(below[j]-center) > delta)) ||
+                                  ((j > 0) && (abs(row[j-1]-center) > delta));
+                out[j] = edge ? 0 : 255;
             }
         }
         dst = n;
@@ -85,19 +95,25 @@ class SkinMaskTransform : public UntrainableTransform
 {
     Q_OBJECT
 
+    int tileHalo() const
+    {
+        return 0;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         Mat m;
         cvtColor(src, m, CV_BGR2YCrCb);
-        std::vector<Mat> mv;
-        split(m, mv);
         Mat mask = Mat(m.rows, m.cols, CV_8UC1);
 
+        // Reads the interleaved chroma directly rather than splitting the channels into more full size matrices
         for (int i=0; i<m.rows; i++) {
+            const Vec3b *pixels = m.ptr<Vec3b>(i);
+            quint8 *out = mask.ptr<quint8>(i);
             for (int j=0; j<m.cols; j++) {
-                int Cr= mv[1].at<quint8>(i,j);
-                int Cb =mv[2].at<quint8>(i,j);
-                mask.at<quint8>(i, j) = (Cr>130 && Cr<170) && (Cb>70 && Cb<125) ? 255 : 0;
+                const int Cr = pixels[j][1];
+                const int Cb = pixels[j][2];
+                out[j] = (Cr>130 && Cr<170) && (Cb>70 && Cb<125) ? 255 : 0;
             }
         }
 
@@ -141,6 +157,13 @@ private:
         kernel.setTo(255);
     }
 
+    int tileHalo() const
+    {
+        // An empty kernel is 3x3, compound operations apply it twice
+        const int radius = kernel.empty() ? 1 : std::max(kernel.rows, kernel.cols)/2;
+        return ((op == Erode) || (op == Dilate)) ? radius : 2*radius;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         morphologyEx(src, dst, op, kernel);
@@ -14,12 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QFutureSynchronizer>
-#include <QtConcurrentRun>
+#include <QCryptographicHash>
 #include <openbr/openbr_plugin.h>
+#include <cmath>
 
+#include "openbr/core/budget.h"
+#include "openbr/core/cache.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -27,9 +30,48 @@ using namespace cv;
 namespace br
 {
 
-static TemplateList Expanded(const TemplateList &templates)
+// Narrows m to a view of rect grown by margin on each side, shifting the child's points and rects into the view
+static void cropView(Template &child, const QRectF &rect, float margin)
+{
+    cv::Mat &m = child.m();
+    const cv::Rect bounds(0, 0, m.cols, m.rows);
+    const cv::Rect r = OpenCVUtils::toRect(rect);
+    const int dx = margin * r.width, dy = margin * r.height;
+    const cv::Rect view = cv::Rect(r.x - dx, r.y - dy, r.width + 2*dx, r.height + 2*dy) & bounds;
+    if ((view.area() == 0) || (view == bounds)) return;
+
+    m = m(view); // Shares the source buffer
+    const QPointF offset(view.x, view.y);
+    QList<QPointF> points = child.file.points();
+    for (int i=0; i<points.size(); i++) points[i] -= offset;
+    QList<QRectF> rects = child.file.rects();
+    for (int i=0; i<rects.size(); i++) rects[i].translate(-offset);
+    child.file.setPoints(points);
+    child.file.setRects(rects);
+    child.file.set("Origin", child.file.get<QPointF>("Origin", QPointF()) + offset);
+}
+
+// Maps the points and rects of templates narrowed by cropView() back to source coordinates
+static void restoreOrigins(TemplateList &templates)
+{
+    for (int i=0; i<templates.size(); i++) {
+        File &file = templates[i].file;
+        if (!file.contains("Origin")) continue;
+        const QPointF offset = file.get<QPointF>("Origin");
+        QList<QPointF> points = file.points();
+        for (int j=0; j<points.size(); j++) points[j] += offset;
+        QList<QRectF> rects = file.rects();
+        for (int j=0; j<rects.size(); j++) rects[j].translate(offset);
+        file.setPoints(points);
+        file.setRects(rects);
+        file.remove("Origin");
+    }
+}
+
+static TemplateList Expanded(const TemplateList &templates, float crop = -1)
 {
     TemplateList expanded;
+    expanded.reserve(templates.size());
     foreach (const Template &t, templates) {
         if (t.isEmpty()) {
             if (!t.file.get<bool>("enrollAll", false))
@@ -50,6 +92,8 @@ static TemplateList Expanded(const TemplateList &templates)
                 expanded.append(Template(t.file, t[i]));
                 expanded.last().file.setRects(rects.mid(i*rectStep, rectStep));
                 expanded.last().file.setPoints(points.mid(i*pointStep, pointStep));
+                if ((crop >= 0) && (rectStep == 1) && (t[i].dims == 2))
+                    cropView(expanded.last(), rects[i], crop);
             }
         }
     }
@@ -61,12 +105,64 @@ static void _train(Transform *transform, const TemplateList *data)
     transform->train(*data);
 }
 
+// Failed templates skip the transforms that don't process them
+static inline bool bypassed(const Template &t, const Transform *f)
+{
+    return t.file.failed() && !f->processesFailures();
+}
+
+// Failed templates leave a pipe with only their file, not the matrices of the stage they failed at
+static inline void stripFailure(Template &t)
+{
+    if (t.file.failed()) t.clear();
+}
+
+static void stripFailures(TemplateList &templates)
+{
+    for (int i=0; i<templates.size(); i++)
+        stripFailure(templates[i]);
+}
+
+// Projects the templates that aren't bypassed through f, leaving the failed ones in place.
+// If f changes the number of templates the failed ones follow its output.
+static void projectUnfailed(TemplateList &srcdst, const Transform *f)
+{
+    QList<int> active;
+    for (int i=0; i<srcdst.size(); i++)
+        if (!bypassed(srcdst[i], f))
+            active.append(i);
+
+    if (active.size() == srcdst.size()) {
+        srcdst >> *f;
+        return;
+    }
+    if (active.isEmpty()) return;
+
+    TemplateList subset; subset.reserve(active.size());
+    foreach (int i, active)
+        subset.append(srcdst[i]);
+    subset >> *f;
+
+    if (subset.size() == active.size()) {
+        for (int i=0; i<active.size(); i++)
+            srcdst[active[i]] = subset[i];
+    } else {
+        for (int i=0; i<srcdst.size(); i++)
+            if (bypassed(srcdst[i], f))
+                subset.append(srcdst[i]);
+        srcdst = subset;
+    }
+}
+
 /*!
  * \ingroup Transforms
  * \brief Transforms in series.
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is given to the first transform and the resulting br::Template is passed to the next transform, etc.
+ * If br::Context::prefixCache is set, the output of the leading untrainable transforms is cached by image content,
+ * so only the transforms after the prefix are rerun when they change.
+ * Points and rects of the views made by a cropping br::ExpandTransform in this pipe are mapped back to source coordinates after its last transform.
  *
  * \see ExpandTransform
  * \see ForkTransform
@@ -75,47 +171,272 @@ class PipeTransform : public CompositeTransform
 {
     Q_OBJECT    
 
-    void _projectPartial(Template *srcdst, int startIndex, int stopIndex)
+    int prefix; // Number of leading transforms whose output is cached
+    QString prefixDescription;
+    QSharedPointer<TemplateCache> prefixCache;
+    bool crops; // Contains an Expand that narrows templates to views
+
+    void init()
+    {
+        CompositeTransform::init();
+
+        crops = false;
+        foreach (const Transform *f, transforms)
+            if ((f->objectName() == "Expand") && (f->property("crop").toFloat() >= 0))
+                crops = true;
+
+        prefix = 0;
+        prefixCache.clear();
+        if (Globals->prefixCache.isEmpty()) return;
+
+        QStringList descriptions;
+        while ((prefix < transforms.size()) && !transforms[prefix]->trainable && !transforms[prefix]->timeVarying())
+            descriptions.append(transforms[prefix++]->description());
+        if (prefix == 0) return;
+
+        prefixDescription = descriptions.join("+");
+        prefixCache = TemplateCache::fromFile(Globals->prefixCache, 512);
+    }
+
+    // Projects src through the cached prefix, returns the index of the next transform to apply
+    int projectPrefix(const Template &src, Template &dst) const
+    {
+        const QByteArray key = TemplateCache::contentKey(src, prefixDescription);
+        if (!key.isEmpty() && prefixCache->find(key, dst)) return prefix;
+
+        dst = src;
+        for (int i=0; i<prefix; i++) {
+            if (bypassed(dst, transforms[i])) continue;
+            try {
+                dst >> *transforms[i];
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()));
+                dst = Template(src.file);
+                dst.file.set("FTE", true);
+            }
+        }
+
+        if (!key.isEmpty() && !dst.file.get<bool>("FTE", false)) prefixCache->insert(key, dst);
+        return prefix;
+    }
+
+    void _projectPrefix(const Template *src, Template *dst) const
+    {
+        projectPrefix(*src, *dst);
+    }
+
+    // Each transform needs its own halo around the context of the ones after it
+    int tileHalo() const
+    {
+        int halo = 0;
+        foreach (const Transform *f, transforms) {
+            const int h = f->tileHalo();
+            if (h < 0) return -1;
+            halo += h;
+        }
+        return halo;
+    }
+
+    // Projects srcdst through stages [startIndex, stopIndex), the cached prefix applies when stages are this pipe's own
+    void _projectPartial(Template *srcdst, const QList<Transform*> *stages, int startIndex, int stopIndex, bool own)
     {
+        if (own && (startIndex == 0) && (stopIndex >= prefix) && !prefixCache.isNull()) {
+            const Template src = *srcdst;
+            startIndex = projectPrefix(src, *srcdst);
+        }
+
         for (int i=startIndex; i<stopIndex; i++)
-            *srcdst >> *transforms[i];
+            if (!bypassed(*srcdst, stages->at(i)))
+                *srcdst >> *stages->at(i);
+        stripFailure(*srcdst);
+    }
+
+    // Project a block at a time, packing each finished block so that
+    //   at most one block of intermediate allocations is alive at once.
+    void projectBlocks(TemplateList &templates, const QList<Transform*> &stages, int startIndex, int stopIndex, bool own)
+    {
+        const int blockSize = std::max(1, Globals->blockSize);
+        for (int begin=0; begin<templates.size(); begin+=blockSize) {
+            const int end = std::min(templates.size(), begin+blockSize);
+            TaskGroup tasks;
+            for (int j=begin; j<end; j++)
+                if (Globals->parallelism) tasks.run(this, &PipeTransform::_projectPartial, &templates[j], &stages, startIndex, stopIndex, own);
+                else                                                      _projectPartial( &templates[j], &stages, startIndex, stopIndex, own);
+            tasks.wait();
+            pack(templates, begin, end);
+        }
+    }
+
+    // Moves the uniform single matrix templates in [begin, end) into one allocation,
+    // so stages trained afterwards see packed rows instead of scattered matrices.
+    // Failed templates are left out, they are stripped and not trained on.
+    static void pack(TemplateList &templates, int begin, int end)
+    {
+        QList<int> packed;
+        for (int j=begin; j<end; j++) {
+            const Template &t = templates[j];
+            if (t.file.failed()) continue;
+            const bool uniform = (t.size() == 1) &&
+                                 (t.first().data != NULL) &&
+                                 (t.first().dims == 2) &&
+                                 (packed.isEmpty() || ((t.first().size() == templates[packed.first()].first().size()) &&
+                                                       (t.first().type() == templates[packed.first()].first().type())));
+            if (!uniform) return;
+            packed.append(j);
+        }
+        if (packed.isEmpty()) return;
+
+        const cv::Mat &first = templates[packed.first()].first();
+        cv::Mat buffer(packed.size(), first.total(), first.type());
+        for (int j=0; j<packed.size(); j++) {
+            cv::Mat &m = templates[packed[j]].first();
+            cv::Mat row = buffer.row(j).reshape(0, m.rows);
+            m.copyTo(row);
+            m = row;
+        }
     }
 
     void train(const TemplateList &data)
+    {
+        train(data, QList<Transform*>(), Globals->checkpoints.isEmpty() ? QByteArray() : digest(data));
+    }
+
+    // Identifies training data by its file list and any matrices it already holds.
+    // A pipe wrapped by another transform is trained on data projected outside of it,
+    // so the matrices stand in for the stages it can't see.
+    static QByteArray digest(const TemplateList &data)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        foreach (const Template &t, data) {
+            hash.addData(t.file.flat().toUtf8());
+            foreach (const cv::Mat &m, t) {
+                const int header[] = { m.rows, m.cols, m.type() };
+                hash.addData((const char*)header, sizeof(header));
+                for (int i=0; i<m.rows; i++)
+                    hash.addData((const char*)m.ptr(i), int(m.cols*m.elemSize()));
+            }
+        }
+        return hash.result();
+    }
+
+    /*!
+     * Trains on data that has yet to be projected through \em pending, the transforms preceding this pipe in its parent.
+     *
+     * Training data stays lazy: it is only projected when a trainable transform needs it,
+     * and then only through the untrainable transforms since the last projection.
+     * A nested pipe is handed the unprojected data along with those transforms,
+     * so leading stages like Open materialize one block at a time inside it
+     * instead of all at once in the parent. The parent reprojects through the
+     * nested pipe afterwards only if a later transform still needs training.
+     *
+     * \em lineage identifies \em data, the training files and the stages already applied to them, and keys the checkpoints.
+     */
+    void train(const TemplateList &data, const QList<Transform*> &pending, const QByteArray &lineage)
     {
         if (!trainable) return;
 
         TemplateList copy(data);
-        int i = 0;
-        while (i < transforms.size()) {
-            fprintf(stderr, "\n%s", qPrintable(transforms[i]->objectName()));
-
-            // Conditional statement covers likely case that first transform is untrainable
-            if (transforms[i]->trainable) {
-                fprintf(stderr, " training...");
-                transforms[i]->train(copy);
+        const QList<Transform*> stages = pending + transforms;
+        const bool own = pending.isEmpty();
+        int projected = 0; // copy holds the input to stages[projected]
+        QByteArray applied = lineage; // Identifies copy
+        for (int i=pending.size(); i<stages.size(); i++) {
+            if (!stages[i]->trainable) continue;
+            fprintf(stderr, "\n%s", qPrintable(stages[i]->objectName()));
+
+            PipeTransform *pipe = dynamic_cast<PipeTransform*>(stages[i]);
+            if (pipe) {
+                pipe->train(copy, stages.mid(projected, i-projected), applied);
+                continue;
             }
 
-            // We project through any subsequent untrainable transforms at once
-            //   as a memory optimization in case any of these intermediate
-            //   transforms allocate a lot of memory (like OpenTransform)
-            //   then we don't want all the training templates to be processed
-            //   by that transform at once if we can avoid it.
-            int nextTrainableTransform = i+1;
-            while ((nextTrainableTransform < transforms.size()) &&
-                   !transforms[nextTrainableTransform]->trainable)
-                nextTrainableTransform++;
+            const QByteArray input = checkpointKey(applied, stages.mid(projected, i-projected));
+            const QString stage = checkpointPath(checkpointKey(input, stages.mid(i, 1)), "stage");
+            if (loadCheckpoint(stage, stages[i])) {
+                fprintf(stderr, " resumed from checkpoint.");
+                continue;
+            }
 
-            fprintf(stderr, " projecting...");
-            QFutureSynchronizer<void> futures;
-            for (int j=0; j<copy.size(); j++)
-                if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &copy[j], i, nextTrainableTransform));
-                else                                                                                _projectPartial( &copy[j], i, nextTrainableTransform);
-            futures.waitForFinished();
-            i = nextTrainableTransform;
+            if (projected < i) {
+                const QString projection = Globals->checkpointData ? checkpointPath(input, "data") : QString();
+                if (!loadCheckpoint(projection, copy)) {
+                    fprintf(stderr, " projecting...");
+                    projectBlocks(copy, stages, projected, i, own);
+                    storeCheckpoint(projection, copy);
+                }
+                projected = i;
+                applied = input;
+            }
+
+            fprintf(stderr, " training...");
+            stages[i]->train(copy.unfailed());
+            if (!stage.isEmpty()) {
+                QByteArray model;
+                QDataStream stream(&model, QFile::WriteOnly);
+                stages[i]->store(stream);
+                storeCheckpoint(stage, model);
+            }
         }
     }
 
+    // Identifies data identified by lineage after it is projected through stages,
+    // chained a stage at a time so the key doesn't depend on where projection was split
+    static QByteArray checkpointKey(QByteArray lineage, const QList<Transform*> &stages)
+    {
+        if (Globals->checkpoints.isEmpty()) return lineage;
+        foreach (const Transform *stage, stages)
+            lineage = QCryptographicHash::hash(lineage + stage->description().toUtf8(), QCryptographicHash::Sha1);
+        return lineage;
+    }
+
+    static QString checkpointPath(const QByteArray &key, const QString &suffix)
+    {
+        if (Globals->checkpoints.isEmpty()) return QString();
+        return QDir(Globals->checkpoints).filePath(QString("%1.%2").arg(QString(key.toHex()), suffix));
+    }
+
+    static bool loadCheckpoint(const QString &path, Transform *stage)
+    {
+        if (path.isEmpty() || !QFileInfo(path).exists()) return false;
+        QByteArray model;
+        QtUtils::readFile(path, model, true);
+        QDataStream stream(&model, QFile::ReadOnly);
+        stage->load(stream);
+        return true;
+    }
+
+    static bool loadCheckpoint(const QString &path, TemplateList &data)
+    {
+        if (path.isEmpty() || !QFileInfo(path).exists()) return false;
+        QByteArray projected;
+        QtUtils::readFile(path, projected, true);
+        QDataStream stream(&projected, QFile::ReadOnly);
+        TemplateList loaded;
+        stream >> static_cast<QList<Template>&>(loaded);
+        if (loaded.size() != data.size()) return false;
+        data = loaded;
+        return true;
+    }
+
+    static void storeCheckpoint(const QString &path, const TemplateList &data)
+    {
+        if (path.isEmpty()) return;
+        QByteArray projected;
+        QDataStream stream(&projected, QFile::WriteOnly);
+        stream << static_cast<const QList<Template>&>(data);
+        storeCheckpoint(path, projected);
+    }
+
+    // Written aside and renamed, so an interrupted run never leaves a partial checkpoint
+    static void storeCheckpoint(const QString &path, const QByteArray &data)
+    {
+        if (path.isEmpty()) return;
+        QtUtils::writeFile(path + ".part", data, -1);
+        QFile::remove(path);
+        if (!QFile::rename(path + ".part", path))
+            qWarning("Failed to store checkpoint %s.", qPrintable(path));
+    }
+
     void backProject(const Template &dst, Template &src) const
     {
         // Backprojecting a time-varying transform is probably not going to work.
@@ -159,6 +480,7 @@ class PipeTransform : public CompositeTransform
         {
             f->projectUpdate(dst);
         }
+        if (crops) restoreOrigins(dst);
     }
 
     virtual void finalize(TemplateList & output)
@@ -189,17 +511,38 @@ protected:
     // or if parallelism is disabled, handle them sequentially
    void _project(const TemplateList &src, TemplateList &dst) const
     {
-        dst = src;
-        foreach (const Transform *f, transforms) {
-            dst >> *f;
+        if (prefixCache.isNull()) {
+            dst = src;
+            foreach (const Transform *f, transforms)
+                projectUnfailed(dst, f);
+            stripFailures(dst);
+            if (crops) restoreOrigins(dst);
+            return;
         }
+
+        dst.clear();
+        for (int i=0; i<src.size(); i++)
+            dst.append(Template());
+        TaskGroup tasks;
+        for (int i=0; i<src.size(); i++)
+            if (Globals->parallelism) tasks.run(this, &PipeTransform::_projectPrefix, &src[i], &dst[i]);
+            else                                                      _projectPrefix( &src[i], &dst[i]);
+        tasks.wait();
+
+        for (int i=prefix; i<transforms.size(); i++)
+            projectUnfailed(dst, transforms[i]);
+        stripFailures(dst);
+        if (crops) restoreOrigins(dst);
     }
 
    // Single template const project, pass the template through each sub-transform, one after the other
    virtual void _project(const Template & src, Template & dst) const
    {
        dst = src;
-       foreach (const Transform *f, transforms) {
+       const int begin = prefixCache.isNull() ? 0 : projectPrefix(src, dst);
+       for (int i=begin; i<transforms.size(); i++) {
+           const Transform *f = transforms[i];
+           if (bypassed(dst, f)) continue;
            try {
                dst >> *f;
            } catch (...) {
@@ -208,6 +551,7 @@ protected:
                dst.file.set("FTE", true);
            }
        }
+       stripFailure(dst);
    }
 };
 
@@ -220,15 +564,30 @@ BR_REGISTER(Transform, PipeTransform)
  *
  * Each matrix in an input Template is expanded into its own template.
  *
+ * Set \em crop to narrow each template with a single rect, like the faces found by an \c enrollAll detector,
+ * to a view of that rect grown by \em crop times its size on each side.
+ * The views share the source image instead of each face carrying all of it through the following transforms,
+ * their points and rects are shifted into the view and the \c Origin metadata holds the view's offset in the source.
+ * The br::PipeTransform holding this transform shifts them back and removes \c Origin after its last transform,
+ * so the transforms following it here see view coordinates and its output is in source coordinates.
+ * The following transforms of a br::PipeTransform receive all the expanded templates as one br::TemplateList.
+ *
  * \see PipeTransform
  */
 class ExpandTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(float crop READ get_crop WRITE set_crop RESET reset_crop STORED false)
+    BR_PROPERTY(float, crop, -1)
+
+    bool processesFailures() const
+    {
+        return true; // Failures are kept or dropped per enrollAll
+    }
 
     virtual void project(const TemplateList &src, TemplateList &dst) const
     {
-        dst = Expanded(src);
+        dst = Expanded(src, crop);
     }
 
     virtual void project(const Template & src, Template & dst) const
@@ -251,6 +610,11 @@ class ContractTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
 
+    bool processesFailures() const
+    {
+        return true;
+    }
+
     virtual void project(const TemplateList &src, TemplateList &dst) const
     {
         //dst = Expanded(src);
@@ -278,22 +642,65 @@ BR_REGISTER(Transform, ContractTransform)
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is seperately given to each transform and the results are appended together.
+ * Set \em parallel to run the branches of each template as concurrent tasks sharing its matrices,
+ * which lowers the latency of projecting a single template.
  *
  * \see PipeTransform
  */
 class ForkTransform : public CompositeTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool parallel READ get_parallel WRITE set_parallel RESET reset_parallel STORED false)
+    BR_PROPERTY(bool, parallel, false)
+
+    struct Branch
+    {
+        Template dst;
+        TemplateList dstList;
+        bool failed;
+        Branch() : failed(false) {}
+    };
+
+    static void projectBranch(const Transform *f, const Template *src, Branch *branch)
+    {
+        try {
+            branch->dst = (*f)(*src);
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(src->file.flat()), qPrintable(f->objectName()));
+            branch->failed = true;
+        }
+    }
+
+    static void projectBranchList(const Transform *f, const TemplateList *src, Branch *branch)
+    {
+        f->project(*src, branch->dstList);
+    }
+
+    int tileHalo() const
+    {
+        int halo = 0;
+        foreach (const Transform *f, transforms) {
+            const int h = f->tileHalo();
+            if (h < 0) return -1;
+            halo = std::max(halo, h);
+        }
+        return halo;
+    }
+
+    bool concurrent() const
+    {
+        return parallel && Globals->parallelism && (transforms.size() > 1);
+    }
 
     void train(const TemplateList &data)
     {
         if (!trainable) return;
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<transforms.size(); i++) {
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
-            else                                                          _train (transforms[i], &data);
+            if (Globals->parallelism) tasks.run(_train, transforms[i], &data);
+            else                                _train (transforms[i], &data);
         }
-        futures.waitForFinished();
+        tasks.wait();
     }
 
     void backProject(const Template &dst, Template &src) const {Transform::backProject(dst, src);}
@@ -360,6 +767,24 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
+        if (concurrent()) {
+            QVector<Branch> branches(transforms.size());
+            TaskGroup tasks;
+            for (int i=0; i<transforms.size(); i++)
+                tasks.run(projectBranch, (const Transform*)transforms[i], &src, &branches[i]);
+            tasks.wait();
+
+            foreach (const Branch &branch, branches) {
+                if (branch.failed) {
+                    dst = Template(src.file);
+                    dst.file.set("FTE", true);
+                } else {
+                    dst.merge(branch.dst);
+                }
+            }
+            return;
+        }
+
         foreach (const Transform *f, transforms) {
             try {
                 dst.merge((*f)(src));
@@ -375,6 +800,21 @@ protected:
     {
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
+
+        if (concurrent()) {
+            QVector<Branch> branches(transforms.size());
+            TaskGroup tasks;
+            for (int i=0; i<transforms.size(); i++)
+                tasks.run(projectBranchList, (const Transform*)transforms[i], &src, &branches[i]);
+            tasks.wait();
+
+            foreach (const Branch &branch, branches) {
+                if (branch.dstList.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
+                for (int i=0; i<src.size(); i++) dst[i].merge(branch.dstList[i]);
+            }
+            return;
+        }
+
         foreach (const Transform *f, transforms) {
             TemplateList m;
             f->project(src, m);
@@ -389,49 +829,436 @@ BR_REGISTER(Transform, ForkTransform)
 
 /*!
  * \ingroup transforms
- * \brief Caches br::Transform::project() results.
+ * \brief Enrolls several algorithms at once, running the stages they start with only once.
+ *
+ * The transforms of \em algorithms, for example <tt>Heads([FaceRecognition,GenderClassification,AgeRegression])</tt>,
+ * are expanded to their stages and the longest run of stages they all begin with, like face detection, is projected once.
+ * Its output is then given to the remaining stages of each algorithm as a parallel br::ForkTransform,
+ * so every template holds the matrices and metadata of all the algorithms.
+ *
+ * \see ForkTransform
+ */
+class HeadsTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QStringList algorithms READ get_algorithms WRITE set_algorithms RESET reset_algorithms)
+    BR_PROPERTY(QStringList, algorithms, QStringList())
+
+    Transform *transform;
+
+public:
+    HeadsTransform() : transform(NULL) {}
+
+private:
+    // The stages of a transform description with abbreviations, groupings and '!' expanded
+    static QStringList stages(QString description)
+    {
+        if (Globals->abbreviations.contains(description))
+            return stages(Globals->abbreviations[description]);
+
+        description.replace("!", "+Expand+");
+        const QStringList words = QtUtils::parse(description, '+');
+        if (words.size() > 1) {
+            QStringList result;
+            foreach (const QString &word, words)
+                result.append(stages(word));
+            return result;
+        }
+
+        if (description.startsWith('(') && description.endsWith(')'))
+            return stages(description.mid(1, description.size()-2));
+        return words;
+    }
+
+    void init()
+    {
+        if (algorithms.isEmpty()) qFatal("Heads expects at least one algorithm.");
+
+        QList<QStringList> heads;
+        foreach (QString algorithm, algorithms) {
+            if (Globals->abbreviations.contains(algorithm))
+                algorithm = Globals->abbreviations[algorithm];
+            heads.append(stages(QtUtils::parse(algorithm, ':').first()));
+        }
+
+        QStringList prefix;
+        while (!heads.first().isEmpty()) {
+            const QString stage = heads.first().first();
+            bool shared = true;
+            foreach (const QStringList &head, heads)
+                shared = shared && !head.isEmpty() && (head.first() == stage);
+            if (!shared) break;
+            prefix.append(stage);
+            for (int i=0; i<heads.size(); i++)
+                heads[i].removeFirst();
+        }
+
+        QStringList branches;
+        foreach (const QStringList &head, heads)
+            branches.append("(" + (head.isEmpty() ? QString("Identity") : head.join("+")) + ")");
+        QString description = "Fork([" + branches.join(",") + "],parallel=true)";
+        if (!prefix.isEmpty())
+            description.prepend("(" + prefix.join("+") + ")+");
+
+        if (Globals->verbose) qDebug("Heads share %s", qPrintable(prefix.join("+")));
+        delete transform;
+        transform = Transform::make(description, this);
+        trainable = transform->trainable;
+    }
+
+    void train(const TemplateList &data)
+    {
+        transform->train(data);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        transform->project(src, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        transform->project(src, dst);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, HeadsTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Projects large images as overlapping tiles in parallel.
  * \author Josh Klontz \cite jklontz
+ *
+ * The image is split into tiles of at most \em size by \em size pixels,
+ * each extended on every side by the br::Transform::tileHalo() of \em transform.
+ * Tiles are projected concurrently and the center of each output is written straight into full size matrices.
+ * Images no larger than \em size, and transforms that aren't tile-safe, are projected whole.
+ * If any tile fails, or outputs different matrices than the first, the template is marked \c FTE.
+ *
+ * A \em size of \c 0 or less picks tiles of about 256 KB of input,
+ * so a chain of pointwise and neighborhood transforms like <tt>Tile(SkinMask+Morph+Blur,size=0)</tt>
+ * passes each tile from stage to stage while it is still in cache, rather than walking the whole frame once per stage.
  */
-class CacheTransform : public MetaTransform
+class TileTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, size, 1024)
 
-    static QHash<QString, Template> cache;
-    static QMutex cacheLock;
+    void init()
+    {
+        if (transform) trainable = transform->trainable;
+    }
 
-public:
-    ~CacheTransform()
+    void train(const TemplateList &data)
     {
-        if (cache.isEmpty()) return;
+        transform->train(data);
+    }
+
+    enum { Cache_Tile = 256*1024 }; // Input bytes per tile when size <= 0
 
-        // Write to cache
-        QFile file("Cache");
-        if (!file.open(QFile::WriteOnly))
-            qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
-        QDataStream stream(&file);
-        stream << cache;
-        file.close();
+    int tileHalo() const
+    {
+        return transform->tileHalo();
     }
 
-private:
+    struct Tile
+    {
+        Rect outer, inner; // With and without the halo
+        bool failed;
+    };
+
+    // False if the tile failed or its outputs don't match the types of the first tile's
+    bool projectTile(const Template *src, const Tile *tile, Template *dst, const QList<int> &types) const
+    {
+        Template input(src->file);
+        foreach (const Mat &m, *src)
+            input.append(m(tile->outer));
+        try {
+            transform->project(input, *dst);
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(src->file.flat()), qPrintable(transform->objectName()));
+            return false;
+        }
+        if (dst->file.failed()) return false;
+
+        bool valid = types.isEmpty() || (dst->size() == types.size());
+        for (int j=0; valid && (j<dst->size()); j++)
+            valid = (dst->at(j).size() == tile->outer.size()) && (types.isEmpty() || (dst->at(j).type() == types[j]));
+        if (!valid) qWarning("Tile expected %s to output the same number of matrices for every tile, each the size of its input.", qPrintable(transform->objectName()));
+        return valid;
+    }
+
+    // Projects a tile and copies its center into the matching region of the full size outputs
+    void writeTile(const Template *src, Tile *tile, const Template *dst) const
+    {
+        QList<int> types;
+        foreach (const Mat &m, *dst)
+            types.append(m.type());
+
+        Template output;
+        tile->failed = !projectTile(src, tile, &output, types);
+        if (tile->failed) return;
+        for (int j=0; j<output.size(); j++) {
+            Mat region = dst->at(j)(tile->inner);
+            output[j](tile->inner - tile->outer.tl()).copyTo(region);
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int halo = transform->tileHalo();
+        if ((halo < 0) || src.isEmpty()) {
+            transform->project(src, dst);
+            return;
+        }
+
+        int side = size;
+        if (side <= 0) {
+            size_t pixelBytes = 0;
+            foreach (const Mat &m, src)
+                pixelBytes += m.elemSize();
+            side = std::max(16, int(std::sqrt(double(Cache_Tile) / std::max(pixelBytes, size_t(1)))) - 2*halo);
+        }
+
+        if ((src.m().rows <= side) && (src.m().cols <= side)) {
+            transform->project(src, dst);
+            return;
+        }
+
+        const Size imageSize = src.m().size();
+        foreach (const Mat &m, src)
+            if (m.size() != imageSize) qFatal("Tile requires matrices of the same size.");
+
+        QVector<Tile> tiles;
+        const Rect image(0, 0, imageSize.width, imageSize.height);
+        for (int y=0; y<imageSize.height; y+=side)
+            for (int x=0; x<imageSize.width; x+=side) {
+                Tile tile;
+                tile.inner = Rect(x, y, std::min(side, imageSize.width-x), std::min(side, imageSize.height-y));
+                tile.outer = Rect(x-halo, y-halo, tile.inner.width+2*halo, tile.inner.height+2*halo) & image;
+                tile.failed = false;
+                tiles.append(tile);
+            }
+
+        // The first tile determines the outputs, the others are written straight into them instead of being held until stitching
+        Template first;
+        dst = Template(src.file);
+        if (!projectTile(&src, &tiles.first(), &first, QList<int>())) {
+            dst.file.set("FTE", true);
+            return;
+        }
+        const Tile &head = tiles.first();
+        foreach (const Mat &m, first) {
+            dst.append(Mat(imageSize, m.type()));
+            Mat region = dst.last()(head.inner);
+            m(head.inner - head.outer.tl()).copyTo(region);
+        }
+
+        TaskGroup tasks;
+        for (int i=1; i<tiles.size(); i++)
+            if (Globals->parallelism) tasks.run(this, &TileTransform::writeTile, &src, &tiles[i], (const Template*) &dst);
+            else                                                      writeTile( &src, &tiles[i], &dst);
+        tasks.wait();
+
+        // A template with any failed tile fails as a whole, rather than being stitched with holes
+        foreach (const Tile &tile, tiles)
+            if (tile.failed) {
+                dst = Template(src.file);
+                dst.file.set("FTE", true);
+                return;
+            }
+    }
+};
+
+BR_REGISTER(Transform, TileTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Projects only the regions around the \c Rects of a template, for expensive whole-image transforms like \c NLMeansDenoising.
+ *
+ * Each rect grown by \em padding times its size on every side is cut out and given to \em transform, concurrently,
+ * with its rect and points in region coordinates. The rects and points of the outputs are mapped back to image coordinates.
+ * With \em composite each output is pasted back into a copy of the image, otherwise the outputs of the regions are the matrices of the result.
+ * Templates without rects are passed on unchanged.
+ * \em transform is trained on the same regions it projects.
+ *
+ * \see TileTransform
+ */
+class InRectsTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(float padding READ get_padding WRITE set_padding RESET reset_padding STORED false)
+    Q_PROPERTY(bool composite READ get_composite WRITE set_composite RESET reset_composite STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(float, padding, 0.25)
+    BR_PROPERTY(bool, composite, true)
+
     void init()
     {
-        if (!transform) return;
+        if (transform) trainable = transform->trainable;
+    }
 
-        trainable = transform->trainable;
-        if (!cache.isEmpty()) return;
+    // Trains on the same cut-outs project() gives the transform
+    void train(const TemplateList &data)
+    {
+        TemplateList regions;
+        foreach (const Template &t, data) {
+            const QList<QRectF> rects = t.file.rects();
+            if (rects.isEmpty() || t.isEmpty()) {
+                regions.append(t);
+                continue;
+            }
 
-        // Read from cache
-        QFile file("Cache");
-        if (file.exists()) {
-            if (!file.open(QFile::ReadOnly))
-                qFatal("Unable to open %s for reading.", qPrintable(file.fileName()));
-            QDataStream stream(&file);
-            stream >> cache;
-            file.close();
+            const QList<Rect> outer = paddedRegions(t);
+            for (int i=0; i<rects.size(); i++)
+                if (outer[i].area() > 0)
+                    regions.append(cutOut(t, rects[i], outer[i]));
         }
+        transform->train(regions);
+    }
+
+    // Each rect grown by padding and clipped to the image
+    QList<Rect> paddedRegions(const Template &src) const
+    {
+        foreach (const Mat &m, src)
+            if (m.size() != src.m().size()) qFatal("InRects requires matrices of the same size.");
+
+        const Rect image(0, 0, src.m().cols, src.m().rows);
+        QList<Rect> outer;
+        foreach (const QRectF &rect, src.file.rects()) {
+            const Rect r = OpenCVUtils::toRect(rect);
+            const int dx = padding * r.width, dy = padding * r.height;
+            outer.append(Rect(r.x - dx, r.y - dy, r.width + 2*dx, r.height + 2*dy) & image);
+        }
+        return outer;
+    }
+
+    // The region of src at outer, with rect and the points in region coordinates
+    static Template cutOut(const Template &src, const QRectF &rect, const Rect &outer)
+    {
+        const QPointF offset(outer.x, outer.y);
+        Template region(src.file);
+        region.file.setRects(QList<QRectF>() << rect.translated(-offset));
+        QList<QPointF> points = src.file.points();
+        for (int i=0; i<points.size(); i++)
+            points[i] -= offset;
+        region.file.setPoints(points);
+        foreach (const Mat &m, src)
+            region.append(m(outer));
+        return region;
+    }
+
+    void projectRegion(const Template *src, QRectF rect, Rect outer, Template *dst) const
+    {
+        const QPointF offset(outer.x, outer.y);
+        transform->project(cutOut(*src, rect, outer), *dst);
+
+        QList<QRectF> rects = dst->file.rects();
+        for (int i=0; i<rects.size(); i++)
+            rects[i].translate(offset);
+        dst->file.setRects(rects);
+        QList<QPointF> points = dst->file.points();
+        for (int i=0; i<points.size(); i++)
+            points[i] += offset;
+        dst->file.setPoints(points);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const QList<QRectF> rects = src.file.rects();
+        if (rects.isEmpty() || src.isEmpty()) {
+            dst = src;
+            return;
+        }
+
+        const QList<Rect> outer = paddedRegions(src);
+        QVector<Template> regions(rects.size());
+        TaskGroup tasks;
+        for (int i=0; i<rects.size(); i++) {
+            if (outer[i].area() == 0) continue;
+            if (Globals->parallelism) tasks.run(this, &InRectsTransform::projectRegion, &src, rects[i], outer[i], &regions[i]);
+            else                                                          projectRegion( &src, rects[i], outer[i], &regions[i]);
+        }
+        tasks.wait();
+
+        dst.file = src.file;
+        QList<QRectF> dstRects;
+        QList<QPointF> dstPoints;
+        for (int i=0; i<regions.size(); i++) {
+            if (outer[i].area() == 0) continue;
+            dst.file.append(regions[i].file.localMetadata());
+            dstRects.append(regions[i].file.rects());
+            dstPoints.append(regions[i].file.points());
+        }
+        dst.file.setRects(dstRects);
+        dst.file.setPoints(dstPoints);
+
+        if (!composite) {
+            foreach (const Template &region, regions)
+                dst.append(region);
+            return;
+        }
+
+        foreach (const Mat &m, src)
+            dst.append(m.clone());
+        for (int i=0; i<regions.size(); i++) {
+            if (outer[i].area() == 0) continue;
+            if (regions[i].size() != dst.size())
+                qFatal("InRects expected %s to output a matrix for every input matrix.", qPrintable(transform->objectName()));
+            for (int j=0; j<dst.size(); j++) {
+                if ((regions[i][j].size() != outer[i].size()) || (regions[i][j].type() != dst[j].type()))
+                    qFatal("InRects expected %s to output a matrix the size and type of its input.", qPrintable(transform->objectName()));
+                regions[i][j].copyTo(dst[j](outer[i]));
+            }
+        }
+    }
+};
+
+BR_REGISTER(Transform, InRectsTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Caches br::Transform::project() results.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Results are keyed by file name and transform description and appended to \em log,
+ * so later runs reuse them without loading the whole cache.
+ * At most \em capacity megabytes of templates are kept in memory.
+ */
+class CacheTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(QString log READ get_log WRITE set_log RESET reset_log STORED false)
+    Q_PROPERTY(int capacity READ get_capacity WRITE set_capacity RESET reset_capacity STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(QString, log, "Cache.log")
+    BR_PROPERTY(int, capacity, 512)
+
+    QSharedPointer<TemplateCache> cache;
+    QString description;
+
+    void init()
+    {
+        if (!transform) return;
+
+        trainable = transform->trainable;
+        cache = TemplateCache::fromFile(log, capacity);
+        description = transform->description();
     }
 
     void train(const TemplateList &data)
@@ -441,22 +1268,17 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        const QString &file = src.file;
-        if (cache.contains(file)) {
-            dst = cache[file];
+        const QByteArray key = TemplateCache::key(src.file, description);
+        if (cache->find(key, dst)) {
             dst.file.setLabel(src.file.label());
         } else {
             transform->project(src, dst);
-            cacheLock.lock();
-            cache[file] = dst;
-            cacheLock.unlock();
+            MatBudget::hold(dst);
+            cache->insert(key, dst);
         }
     }
 };
 
-QHash<QString, Template> CacheTransform::cache;
-QMutex CacheTransform::cacheLock;
-
 BR_REGISTER(Transform, CacheTransform)
 
 /*!
@@ -598,6 +1420,8 @@ class DistributeTemplateTransform : public MetaTransform
 
 public:
 
+    bool timeVarying() const { return transform->timeVarying(); }
+
     void train(const TemplateList &data)
     {
         transform->train(data);
@@ -642,13 +1466,13 @@ public:
             output_buffer.append(TemplateList());
         }
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<src.size(); i++) {
             input_buffer[i].append(src[i]);
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(_projectList, transform, &input_buffer[i], &output_buffer[i]));
-            else                                                          _projectList( transform, &input_buffer[i], &output_buffer[i]);
+            if (Globals->parallelism) tasks.run(_projectList, transform, &input_buffer[i], &output_buffer[i]);
+            else                                _projectList( transform, &input_buffer[i], &output_buffer[i]);
         }
-        futures.waitForFinished();
+        tasks.wait();
 
         for (int i=0; i<src.size(); i++) dst.append(output_buffer[i]);
     }
@@ -14,10 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
 #include <opencv2/highgui/highgui.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 
 using namespace cv;
 
@@ -28,23 +30,68 @@ namespace br
  * \ingroup transforms
  * \brief Applies br::Format to br::Template::file::name and appends results.
  * \author Josh Klontz \cite jklontz
+ *
+ * \em size and \em gray are decoding hints for the downstream transforms, passed to the format as \c DecodeSize and \c DecodeGray.
+ * Formats that can decode at a reduced resolution, like br::jpgFormat, return images whose larger dimension is at least \em size
+ * and record the factor applied in \c DecodeScale, the template's points and rects are scaled by it to stay aligned with the image.
+ * Files are read on the br::Context::ioThreads workers, the calling thread runs other compute tasks until they arrive.
  */
 class OpenTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
+    Q_PROPERTY(bool gray READ get_gray WRITE set_gray RESET reset_gray STORED false)
+    BR_PROPERTY(int, size, 0)
+    BR_PROPERTY(bool, gray, false)
 
     void project(const Template &src, Template &dst) const
     {
+        // Templates enrolled from memory arrive already decoded
+        if (!src.isEmpty()) {
+            dst = src;
+            return;
+        }
+
         if (Globals->verbose) qDebug("Opening %s", qPrintable(src.file.flat()));
+        QList<File> files = src.file.split();
+        QVector<Template> templates(files.size());
+        TaskGroup reads(Parallel::IO);
+        for (int i=0; i<files.size(); i++) {
+            if (size > 0) files[i].set("DecodeSize", size);
+            if (gray) files[i].set("DecodeGray", true);
+            if (Globals->parallelism) reads.run(_read, files[i], &templates[i]);
+            else                                      _read(files[i], &templates[i]);
+        }
+        reads.wait();
+
         dst.file = src.file;
-        foreach (const File &file, src.file.split()) {
-            QScopedPointer<Format> format(Factory<Format>::make(file));
-            Template t = format->read();
-            if (t.isEmpty()) qWarning("Can't open %s from %s", qPrintable(file.flat()), qPrintable(QDir::currentPath()));
+        for (int i=0; i<files.size(); i++) {
+            const Template &t = templates[i];
+            if (t.isEmpty()) qWarning("Can't open %s from %s", qPrintable(files[i].flat()), qPrintable(QDir::currentPath()));
             dst.append(t);
             dst.file.append(t.file.localMetadata());
         }
         dst.file.set("FTO", dst.isEmpty());
+
+        // Landmarks from the sigset are in full resolution coordinates
+        const qreal scale = dst.file.get<qreal>("DecodeScale", 1);
+        if (scale != 1) {
+            QList<QPointF> points = dst.file.points();
+            for (int i=0; i<points.size(); i++)
+                points[i] *= scale;
+            dst.file.setPoints(points);
+
+            QList<QRectF> rects = dst.file.rects();
+            for (int i=0; i<rects.size(); i++)
+                rects[i] = QRectF(rects[i].topLeft()*scale, rects[i].size()*scale);
+            dst.file.setRects(rects);
+        }
+    }
+
+    static void _read(const File &file, Template *t)
+    {
+        QScopedPointer<Format> format(Factory<Format>::make(file));
+        *t = format->read();
     }
 };
 
@@ -67,18 +114,22 @@ class ShowTransform : public UntrainableMetaTransform
     void init()
     {
         uid = counter++;
-        Globals->setProperty("parallelism", "0"); // Can only work in single threaded mode
+    }
+
+    bool threadConfined() const
+    {
+        return true;
+    }
+
+    bool processesFailures() const
+    {
+        return true;
     }
 
     void project(const Template &src, Template &dst) const
     {
         dst = src;
 
-        if (Globals->parallelism) {
-            qWarning("Show::project() only works in single threaded mode.");
-            return;
-        }
-
         for (int i=0; i<src.size(); i++)
             OpenCVUtils::showImage(src[i], "Show" + (counter*src.size() > 1 ? "-" + QString::number(uid*src.size()+i) : QString()), false);
 
@@ -105,6 +156,11 @@ class PrintTransform : public UntrainableMetaTransform
     BR_PROPERTY(bool, data, false)
     BR_PROPERTY(bool, size, false)
 
+    bool processesFailures() const
+    {
+        return true;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = src;
@@ -189,6 +245,75 @@ class IdentityTransform : public UntrainableMetaTransform
 
 BR_REGISTER(Transform, IdentityTransform)
 
+// Spin rather than sleep so the stage really occupies its thread
+static void burn(int microseconds)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < 1000 * qint64(microseconds));
+}
+
+/*!
+ * \ingroup transforms
+ * \brief A no-op transform that keeps a thread busy for \em microseconds per template.
+ *
+ * Stands in for a CPU-bound stage when benchmarking the streaming engine.
+ * \see SequentialBurnTransform StreamTransform
+ */
+class BurnTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int microseconds READ get_microseconds WRITE set_microseconds RESET reset_microseconds STORED false)
+    BR_PROPERTY(int, microseconds, 1000)
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        burn(microseconds);
+    }
+};
+
+BR_REGISTER(Transform, BurnTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief A time-varying BurnTransform, sees every template in order and stamps it with its \c BurnCount.
+ *
+ * Stands in for a tracking-like stage that br::StreamTransform must run on one thread.
+ * \see BurnTransform StreamTransform
+ */
+class SequentialBurnTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int microseconds READ get_microseconds WRITE set_microseconds RESET reset_microseconds STORED false)
+    BR_PROPERTY(int, microseconds, 1000)
+
+public:
+    SequentialBurnTransform() : TimeVaryingTransform(false, false), count(0) {}
+
+    void train(const TemplateList &data) { (void) data; }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        dst = src;
+        for (int i=0; i<dst.size(); i++) {
+            burn(microseconds);
+            dst[i].file.set("BurnCount", count++);
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        count = 0;
+    }
+
+private:
+    qint64 count;
+};
+
+BR_REGISTER(Transform, SequentialBurnTransform)
+
 /*!
  * \ingroup transforms
  * \brief Removes all template's matrices.
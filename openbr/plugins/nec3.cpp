@@ -21,13 +21,22 @@ class NEC3Initializer : public Initializer
     Q_OBJECT
 
     void initialize() const
+    {
+        Globals->abbreviations.insert("NEC3", "Open!NEC3Enroll:NEC3Compare");
+    }
+
+    QStringList plugins() const
+    {
+        return QStringList() << "NEC3Enroll" << "NEC3Compare";
+    }
+
+    void startup() const
     {
         int result = NeoFacePro::Initialize();
         if (result != NFP_SUCCESS) qWarning("NEC3 Initialize error [%d]", result);
-        Globals->abbreviations.insert("NEC3", "Open!NEC3Enroll:NEC3Compare");
     }
 
-    void finalize() const
+    void shutdown() const
     {
         int result = NeoFacePro::Terminate();
         if (result != NFP_SUCCESS) qWarning("NEC3 Finalize error [%d]", result);
@@ -165,13 +174,27 @@ class NEC3Compare : public Distance
     {
         float score = -std::numeric_limits<float>::max();
         if (a.m().data && b.m().data) {
-            NeoFacePro::CVerifier *verifier = verifierResource.acquire();
+            ResourceLock<NeoFacePro::CVerifier> verifier(verifierResource);
             int result = verifier->Verify(a.m().data, b.m().data, &score);
             if (result != NFP_SUCCESS) qWarning("NEC3Compare verify error [%d]", result);
-            verifierResource.release(verifier);
         }
         return score;
     }
+
+    // One verifier acquisition for the whole batch
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        std::fill(scores, scores+count, -std::numeric_limits<float>::max());
+        if (!query.m().data) return;
+
+        ResourceLock<NeoFacePro::CVerifier> verifier(verifierResource);
+        for (int i=0; i<count; i++) {
+            const Template &target = targets[offset+i];
+            if (!target.m().data) continue;
+            int result = verifier->Verify(target.m().data, query.m().data, &scores[i]);
+            if (result != NFP_SUCCESS) qWarning("NEC3Compare verify error [%d]", result);
+        }
+    }
 };
 
 BR_REGISTER(Distance, NEC3Compare)
@@ -14,8 +14,6 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QFutureSynchronizer>
-#include <QtConcurrentRun>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <Eigen/Core>
@@ -23,6 +21,7 @@
 
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -97,43 +96,100 @@ private:
 
     Mat a, b; // dst = (src - b) / a
 
-    static void _train(Method method, const cv::Mat &m, Mat *ca, Mat *cb, int i)
+    // Column sums and sums of squares for Mean, or minima and maxima for Range, of rows [begin, end)
+    static void accumulate(Method method, const Mat *m, int begin, int end, Mat *partial)
     {
-        double A = 1, B = 0;
-        if      (method == Mean)   mean(m.col(i), &A, &B);
-        else if (method == Median) median(m.col(i), &A, &B);
-        else if (method == Range)  range(m.col(i), &A, &B);
-        else                       qFatal("Invalid method.");
-        ca->at<double>(0, i) = A;
-        cb->at<double>(0, i) = B;
+        const int cols = m->cols;
+        *partial = Mat(2, cols, CV_64FC1);
+        double *s0 = partial->ptr<double>(0), *s1 = partial->ptr<double>(1);
+        if (method == Mean) {
+            std::fill(s0, s0+cols, 0.0);
+            std::fill(s1, s1+cols, 0.0);
+            for (int i=begin; i<end; i++) {
+                const double *x = m->ptr<double>(i);
+                for (int j=0; j<cols; j++) {
+                    s0[j] += x[j];
+                    s1[j] += x[j]*x[j];
+                }
+            }
+        } else {
+            std::copy(m->ptr<double>(begin), m->ptr<double>(begin)+cols, s0);
+            std::copy(m->ptr<double>(begin), m->ptr<double>(begin)+cols, s1);
+            for (int i=begin+1; i<end; i++) {
+                const double *x = m->ptr<double>(i);
+                for (int j=0; j<cols; j++) {
+                    s0[j] = std::min(s0[j], x[j]);
+                    s1[j] = std::max(s1[j], x[j]);
+                }
+            }
+        }
+    }
+
+    // Interquartile range and median of each row [begin, end) of the transposed training data
+    static void medians(const Mat *mt, int begin, int end, double *a, double *b)
+    {
+        std::vector<double> vals(mt->cols);
+        for (int i=begin; i<end; i++) {
+            std::copy(mt->ptr<double>(i), mt->ptr<double>(i)+mt->cols, vals.begin());
+            std::sort(vals.begin(), vals.end());
+            a[i] = vals[3*vals.size()/4] - vals[1*vals.size()/4];
+            b[i] = vals[vals.size()/2];
+        }
     }
 
     void train(const TemplateList &data)
     {
         Mat m;
         OpenCVUtils::toMat(data.data()).convertTo(m, CV_64F);
+        const int channels = m.channels();
+        m = m.reshape(1, m.rows); // Channels interleaved along the columns
         const int dims = m.cols;
 
-        vector<Mat> mv, av, bv;
-        split(m, mv);
-        for (size_t c = 0; c < mv.size(); c++) {
-            av.push_back(Mat(1, dims, CV_64FC1));
-            bv.push_back(Mat(1, dims, CV_64FC1));
-        }
-
-        QFutureSynchronizer<void> futures;
+        Mat ma(1, dims, CV_64FC1), mb(1, dims, CV_64FC1);
+        double *A = ma.ptr<double>(), *B = mb.ptr<double>();
+        TaskGroup tasks;
         const bool parallel = (data.size() > 1000) && Globals->parallelism;
-        for (size_t c = 0; c < mv.size(); c++) {
-            for (int i=0; i<dims; i++)
-                if (parallel) futures.addFuture(QtConcurrent::run(_train, method, mv[c], &av[c], &bv[c], i));
-                else                                              _train (method, mv[c], &av[c], &bv[c], i);
-            av[c] = av[c].reshape(1, data.first().m().rows);
-            bv[c] = bv[c].reshape(1, data.first().m().rows);
+        if (method == Median) {
+            // Transposed so each dimension's values are contiguous, one task per block of dimensions
+            Mat mt;
+            transpose(m, mt);
+            const int blockSize = 64;
+            for (int i=0; i<dims; i+=blockSize)
+                if (parallel) tasks.run(medians, &mt, i, std::min(i+blockSize, dims), A, B);
+                else                    medians (&mt, i, std::min(i+blockSize, dims), A, B);
+            tasks.wait();
+        } else if ((method == Mean) || (method == Range)) {
+            // One pass over each block of rows, then the partial statistics are merged
+            const int blockSize = 1024;
+            QVector<Mat> partials((m.rows + blockSize - 1) / blockSize);
+            for (int i=0; i<partials.size(); i++)
+                if (parallel) tasks.run(accumulate, method, &m, i*blockSize, std::min((i+1)*blockSize, m.rows), &partials[i]);
+                else                    accumulate (method, &m, i*blockSize, std::min((i+1)*blockSize, m.rows), &partials[i]);
+            tasks.wait();
+
+            for (int j=0; j<dims; j++) {
+                double s0 = partials.first().at<double>(0, j), s1 = partials.first().at<double>(1, j);
+                for (int i=1; i<partials.size(); i++) {
+                    const double p0 = partials[i].at<double>(0, j), p1 = partials[i].at<double>(1, j);
+                    if (method == Mean) { s0 += p0; s1 += p1; }
+                    else                { s0 = std::min(s0, p0); s1 = std::max(s1, p1); }
+                }
+
+                if (method == Mean) {
+                    const double mean = s0 / m.rows;
+                    A[j] = sqrt(std::max(s1 / m.rows - mean*mean, 0.0));
+                    B[j] = mean;
+                } else {
+                    A[j] = s1 - s0;
+                    B[j] = s0;
+                }
+            }
+        } else {
+            qFatal("Invalid method.");
         }
-        futures.waitForFinished();
 
-        merge(av, a);
-        merge(bv, b);
+        a = ma.reshape(channels, data.first().m().rows);
+        b = mb.reshape(channels, data.first().m().rows);
         a.convertTo(a, data.first().m().type());
         b.convertTo(b, data.first().m().type());
         OpenCVUtils::saveImage(a, Globals->property("CENTER_TRAIN_A").toString());
@@ -155,32 +211,6 @@ private:
     {
         stream >> a >> b;
     }
-
-    static void mean(const Mat &src, double *a, double *b)
-    {
-        Scalar mean, stddev;
-        meanStdDev(src, mean, stddev);
-        *a = stddev[0];
-        *b = mean[0];
-    }
-
-    static void median(const Mat &src, double *a, double *b)
-    {
-        QVector<double> vals; vals.reserve(src.rows);
-        for (int i=0; i<src.rows; i++)
-            vals.append(src.at<double>(i, 0));
-        double q1, q3;
-        *b = Common::Median(vals, &q1, &q3);
-        *a = q3 - q1;
-    }
-
-    static void range(const Mat &src, double *a, double *b)
-    {
-        double min, max;
-        minMaxLoc(src, &min, &max);
-        *a = max - min;
-        *b = min;
-    }
 };
 
 BR_REGISTER(Transform, CenterTransform)
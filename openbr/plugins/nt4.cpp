@@ -53,13 +53,22 @@ class NT4Initializer : public Initializer
 
     void initialize() const
     {
-        NCoreOnStart();
         Globals->abbreviations.insert("NT4Face", "Open+NT4DetectFace!NT4EnrollFace:NT4Compare");
         Globals->abbreviations.insert("NT4Iris", "Open+NT4EnrollIris:NT4Compare");
+    }
+
+    QStringList plugins() const
+    {
+        return QStringList() << "NT4DetectFace" << "NT4EnrollFace" << "NT4EnrollIris" << "NT4Compare";
+    }
+
+    void startup() const
+    {
+        NCoreOnStart();
         manageLicenses(true);
     }
 
-    void finalize() const
+    void shutdown() const
     {
         manageLicenses(false);
         NCoreOnExitEx(false);
@@ -278,6 +287,11 @@ public:
     NT4DetectFace() : UntrainableTransform(true) {}
 
 private:
+    void init()
+    {
+        contexts.warmUp();
+    }
+
     void project(const Template &src, Template &dst) const
     {
         HNGrayscaleImage grayscaleImage;
@@ -324,6 +338,11 @@ public:
     NT4EnrollFace() : UntrainableTransform(true) {}
 
 private:
+    void init()
+    {
+        contexts.warmUp();
+    }
+
     void project(const Template &src, Template &dst) const
     {
         if (!src.m().data) {
@@ -424,9 +443,31 @@ class NT4Compare : public Distance
 
     Resource<NT4Context> contexts;
 
+    // Identifies every target against the query with one NMIdentifyStartEx()
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        std::fill(scores, scores+count, -std::numeric_limits<float>::max());
+        const Mat &q = query;
+        if (!q.data) return;
+
+        ResourceLock<NT4Context> context(contexts);
+        NResult result = NMIdentifyStartEx(context->matcher, q.data, q.rows*q.cols, NULL);
+        if (NFailed(result)) qFatal("NT4Compare::compareBatch NMIdentifyStart() failed, result=%i.", result);
+        for (int i=0; i<count; i++) {
+            const Mat &t = targets[offset+i];
+            if (!t.data) continue;
+            NInt pScore;
+            result = NMIdentifyNextEx(context->matcher, t.data, t.rows*t.cols, NULL, &pScore);
+            if (NFailed(result)) qFatal("NT4Compare::compareBatch NMIdentifyNext() failed, result=%i.", result);
+            scores[i] = float(pScore);
+        }
+        result = NMIdentifyEnd(context->matcher);
+        if (NFailed(result)) qFatal("NT4Compare::compareBatch NMIdentifyEnd() failed, result=%i.", result);
+    }
+
     float compare(const br::Template &a, const br::Template &b) const
     {
-        NT4Context *context = contexts.acquire();
+        ResourceLock<NT4Context> context(contexts);
 
         NResult result;
 
@@ -450,7 +491,6 @@ class NT4Compare : public Distance
             if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyEnd() failed, result=%i.", result);
         }
 
-        contexts.release(context);
         return score;
     }
 };
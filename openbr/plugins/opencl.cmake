@@ -0,0 +1,8 @@
+set(BR_WITH_OPENCL OFF CACHE BOOL "Build with OpenCL comparison")
+
+if(${BR_WITH_OPENCL})
+  find_package(OpenCL REQUIRED)
+  include_directories(${OPENCL_INCLUDE_DIRS})
+  set(BR_THIRDPARTY_SRC ${BR_THIRDPARTY_SRC} plugins/opencl.cpp)
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${OPENCL_LIBRARIES})
+endif()
@@ -0,0 +1,413 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include <QMutex>
+#include <openbr/openbr_plugin.h>
+
+using namespace cv;
+
+namespace br
+{
+
+extern QVector<Mat> ProductQuantizationLUTs;
+
+// One work item per (target, query) pair, targets are at a constant byte stride in the resident gallery
+static const char *Kernels =
+"__kernel void byteL1(__global const uchar *targets, uint stride, uint begin, uint width, __global const uchar *queries, uint size, __global float *scores, int bayesian)\n"
+"{\n"
+"    const uint t = get_global_id(0);\n"
+"    if (t >= width) return;\n"
+"    const uint q = get_global_id(1);\n"
+"    __global const uchar *a = targets + (size_t)(begin+t)*stride;\n"
+"    __global const uchar *b = queries + (size_t)q*size;\n"
+"    uint distance = 0;\n"
+"    for (uint i=0; i<size; i++)\n"
+"        distance += abs_diff(a[i], b[i]);\n"
+"    scores[(size_t)q*width + t] = distance;\n"
+"}\n"
+"\n"
+"__kernel void l2(__global const uchar *targets, uint stride, uint begin, uint width, __global const float *queries, uint size, __global float *scores, int bayesian)\n"
+"{\n"
+"    const uint t = get_global_id(0);\n"
+"    if (t >= width) return;\n"
+"    const uint q = get_global_id(1);\n"
+"    __global const float *a = (__global const float*)(targets + (size_t)(begin+t)*stride);\n"
+"    __global const float *b = queries + (size_t)q*size;\n"
+"    float distance = 0;\n"
+"    for (uint i=0; i<size; i++) {\n"
+"        const float x = a[i] - b[i];\n"
+"        distance += x*x;\n"
+"    }\n"
+"    scores[(size_t)q*width + t] = distance;\n"
+"}\n"
+"\n"
+"__kernel void dotProduct(__global const uchar *targets, uint stride, uint begin, uint width, __global const float *queries, uint size, __global float *scores, int bayesian)\n"
+"{\n"
+"    const uint t = get_global_id(0);\n"
+"    if (t >= width) return;\n"
+"    const uint q = get_global_id(1);\n"
+"    __global const float *a = (__global const float*)(targets + (size_t)(begin+t)*stride);\n"
+"    __global const float *b = queries + (size_t)q*size;\n"
+"    float product = 0;\n"
+"    for (uint i=0; i<size; i++)\n"
+"        product += a[i] * b[i];\n"
+"    scores[(size_t)q*width + t] = product;\n"
+"}\n"
+"\n"
+"__kernel void productQuantization(__global const uchar *targets, uint stride, uint begin, uint width, __global const float *tables, uint size, __global float *scores, int bayesian)\n"
+"{\n"
+"    const uint t = get_global_id(0);\n"
+"    if (t >= width) return;\n"
+"    const uint q = get_global_id(1);\n"
+"    __global const uchar *a = targets + (size_t)(begin+t)*stride;\n"
+"    __global const float *table = tables + (size_t)q*size*256;\n"
+"    float distance = 0;\n"
+"    for (uint i=0; i<size; i++)\n"
+"        distance += table[i*256 + a[i]];\n"
+"    scores[(size_t)q*width + t] = bayesian ? distance : -log(distance+1);\n"
+"}\n";
+
+static const char *KernelNames[] = { "byteL1", "l2", "dotProduct", "productQuantization" };
+
+/*!
+ * \ingroup initializers
+ * \brief Shared OpenCL device state and the galleries resident on it.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The first GPU found is set up on first use and released when the context is finalized.
+ * Galleries stay resident between comparisons, keyed by their host address, size and a checksum of their full contents,
+ * so a gallery rewritten in place is uploaded again,
+ * and the least recently used are evicted beyond half of the device memory.
+ */
+class OpenCLDevice : public Initializer
+{
+    Q_OBJECT
+
+    struct Resident
+    {
+        const uchar *data;
+        size_t bytes;
+        quint64 checksum;
+        cl_mem buffer;
+    };
+
+    static QMutex lock;
+    static bool initialized;
+    static cl_context context;
+    static cl_command_queue queue;
+    static cl_program program;
+    static cl_kernel kernels[4];
+    static QList<Resident> residents; // Least recently used first
+    static size_t residentBytes, capacity;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        release();
+        initialized = false;
+    }
+
+    static void release()
+    {
+        foreach (const Resident &resident, residents)
+            clReleaseMemObject(resident.buffer);
+        residents.clear();
+        residentBytes = 0;
+        for (int i=0; i<4; i++)
+            if (kernels[i]) { clReleaseKernel(kernels[i]); kernels[i] = NULL; }
+        if (program) { clReleaseProgram(program); program = NULL; }
+        if (queue)   { clReleaseCommandQueue(queue); queue = NULL; }
+        if (context) { clReleaseContext(context); context = NULL; }
+    }
+
+    // Called with the lock held
+    static bool setup()
+    {
+        if (initialized) return context != NULL;
+        initialized = true;
+
+        cl_platform_id platforms[8];
+        cl_uint numPlatforms = 0;
+        if (clGetPlatformIDs(8, platforms, &numPlatforms) != CL_SUCCESS) numPlatforms = 0;
+        cl_device_id device = NULL;
+        for (cl_uint i=0; (i<std::min(numPlatforms, cl_uint(8))) && (device == NULL); i++)
+            if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS)
+                device = NULL;
+        if (device == NULL) {
+            qWarning("No OpenCL GPU found, comparing on the CPU.");
+            return false;
+        }
+
+        cl_ulong memory = 0;
+        cl_int error = clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(memory), &memory, NULL);
+        capacity = size_t(memory / 2);
+        if (error == CL_SUCCESS) context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+        if (error == CL_SUCCESS) queue = clCreateCommandQueue(context, device, 0, &error);
+        if (error == CL_SUCCESS) program = clCreateProgramWithSource(context, 1, &Kernels, NULL, &error);
+        if (error == CL_SUCCESS) error = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+        for (int i=0; (i<4) && (error == CL_SUCCESS); i++)
+            kernels[i] = clCreateKernel(program, KernelNames[i], &error);
+        if (error != CL_SUCCESS) {
+            qWarning("Failed to initialize OpenCL (error %d), comparing on the CPU.", error);
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    // Called with the lock held
+    static cl_mem resident(const uchar *data, size_t bytes, quint64 sum)
+    {
+        for (int i=0; i<residents.size(); i++)
+            if ((residents[i].data == data) && (residents[i].bytes == bytes) && (residents[i].checksum == sum)) {
+                residents.move(i, residents.size()-1);
+                return residents.last().buffer;
+            }
+
+        if (bytes > capacity) return NULL;
+        while (residentBytes + bytes > capacity) {
+            residentBytes -= residents.first().bytes;
+            clReleaseMemObject(residents.takeFirst().buffer);
+        }
+
+        cl_int error;
+        cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, (void*)data, &error);
+        if (error != CL_SUCCESS) return NULL;
+        const Resident r = { data, bytes, sum, buffer };
+        residents.append(r);
+        residentBytes += bytes;
+        return buffer;
+    }
+
+public:
+    /*!
+     * \brief FNV-1a over every 64-bit word of the \em bytes at \em data, identifying a gallery's contents.
+     */
+    static quint64 checksum(const uchar *data, size_t bytes)
+    {
+        quint64 hash = 14695981039346656037ULL ^ bytes;
+        size_t i = 0;
+        for (; i+sizeof(quint64)<=bytes; i+=sizeof(quint64)) {
+            quint64 word;
+            memcpy(&word, data+i, sizeof(quint64));
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; i<bytes; i++)
+            hash = (hash ^ data[i]) * 1099511628211ULL;
+        return hash;
+    }
+
+    /*!
+     * \brief Scores \em queryCount packed \em queries against targets [\em begin, \em begin + \em width) of the gallery at \em data.
+     *
+     * Scores are written query-major into \em scores, \em sum is the gallery's checksum().
+     * Returns \c false if no device is available or it failed, in which case the caller should compare on the CPU.
+     */
+    static bool compare(int kernel, const uchar *data, size_t bytes, quint64 sum, size_t stride, int begin, int width,
+                        const QByteArray &queries, int queryCount, int size, bool bayesian, float *scores)
+    {
+        QMutexLocker locker(&lock);
+        if (!setup()) return false;
+        cl_mem gallery = resident(data, bytes, sum);
+        if (gallery == NULL) return false;
+
+        cl_int error;
+        cl_mem queryBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, queries.size(), (void*)queries.data(), &error);
+        if (error != CL_SUCCESS) return false;
+        const size_t scoreBytes = size_t(width) * queryCount * sizeof(float);
+        cl_mem scoreBuffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, scoreBytes, NULL, &error);
+        if (error != CL_SUCCESS) {
+            clReleaseMemObject(queryBuffer);
+            return false;
+        }
+
+        const cl_uint clStride = stride, clBegin = begin, clWidth = width, clSize = size;
+        const cl_int clBayesian = bayesian;
+        cl_kernel k = kernels[kernel];
+        clSetKernelArg(k, 0, sizeof(cl_mem), &gallery);
+        clSetKernelArg(k, 1, sizeof(cl_uint), &clStride);
+        clSetKernelArg(k, 2, sizeof(cl_uint), &clBegin);
+        clSetKernelArg(k, 3, sizeof(cl_uint), &clWidth);
+        clSetKernelArg(k, 4, sizeof(cl_mem), &queryBuffer);
+        clSetKernelArg(k, 5, sizeof(cl_uint), &clSize);
+        clSetKernelArg(k, 6, sizeof(cl_mem), &scoreBuffer);
+        clSetKernelArg(k, 7, sizeof(cl_int), &clBayesian);
+
+        const size_t global[2] = { size_t((width + Work_Group - 1) / Work_Group * Work_Group), size_t(queryCount) };
+        error = clEnqueueNDRangeKernel(queue, k, 2, NULL, global, NULL, 0, NULL, NULL);
+        if (error == CL_SUCCESS) error = clEnqueueReadBuffer(queue, scoreBuffer, CL_TRUE, 0, scoreBytes, scores, 0, NULL, NULL);
+        clReleaseMemObject(scoreBuffer);
+        clReleaseMemObject(queryBuffer);
+        if (error != CL_SUCCESS) qWarning("OpenCL comparison failed (error %d), comparing on the CPU.", error);
+        return error == CL_SUCCESS;
+    }
+
+    enum { Work_Group = 64 };
+};
+
+QMutex OpenCLDevice::lock;
+bool OpenCLDevice::initialized = false;
+cl_context OpenCLDevice::context = NULL;
+cl_command_queue OpenCLDevice::queue = NULL;
+cl_program OpenCLDevice::program = NULL;
+cl_kernel OpenCLDevice::kernels[4] = { NULL, NULL, NULL, NULL };
+QList<OpenCLDevice::Resident> OpenCLDevice::residents;
+size_t OpenCLDevice::residentBytes = 0;
+size_t OpenCLDevice::capacity = 0;
+
+BR_REGISTER(Initializer, OpenCLDevice)
+
+/*!
+ * \ingroup distances
+ * \brief Compares aligned galleries on an OpenCL GPU.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Scores match the CPU distance for \em metric:
+ * br::ByteL1Distance, br::L2Distance, br::DotProductDistance or br::ProductQuantizationDistance.
+ * The gallery is uploaded once and stays resident across comparisons, queries are sent in blocks and dense score tiles are written to the br::Output.
+ * Galleries that aren't aligned, and contexts without a GPU, are compared by the CPU distance.
+ */
+class OpenCLDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Metric)
+    Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
+    Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
+
+public:
+    /*!< */
+    enum Metric { ByteL1,
+                  L2,
+                  DotProduct,
+                  ProductQuantization };
+
+private:
+    BR_PROPERTY(Metric, metric, L2)
+    BR_PROPERTY(bool, bayesian, false)
+
+    Distance *cpu;
+
+    void init()
+    {
+        static const char *CPUDistances[] = { "ByteL1", "L2", "DotProduct", "ProductQuantization" };
+        cpu = make(QString(CPUDistances[metric]) + ((metric == ProductQuantization) && bayesian ? "(bayesian=true)" : ""));
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return cpu->compare(a, b);
+    }
+
+    float compareMatrices(const Mat &a, const Mat &b) const
+    {
+        return cpu->compareMatrices(a, b);
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        cpu->compareBatch(targets, query, scores, offset, count);
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        if (target.isEmpty() || query.isEmpty()) return;
+
+        size_t stride;
+        const Mat &first = query.first().m();
+        const uchar *data = contiguousData(target, query.first(), 0, &stride);
+        const bool bytes = (metric == ByteL1) || (metric == ProductQuantization);
+        if ((data == NULL) || (first.depth() != (bytes ? CV_8U : CV_32F)) || (!bytes && (stride % sizeof(float) != 0)) ||
+            ((metric == ProductQuantization) && ProductQuantizationLUTs.isEmpty()))
+            return cpu->compare(target, query, output);
+        const int size = first.total() * first.channels();
+        const size_t galleryBytes = stride * (target.size()-1) + first.total() * first.elemSize();
+        const quint64 sum = OpenCLDevice::checksum(data, galleryBytes);
+
+        // Bound the device score buffer
+        const int targetBlock = std::max(1, int(Score_Bytes / (Query_Block * sizeof(float))));
+        QVector<float> scores(Query_Block * std::min(targetBlock, target.size()));
+
+        for (int i=0; i<query.size(); i+=Query_Block) {
+            const int queryCount = std::min(int(Query_Block), query.size()-i);
+            QByteArray queries;
+            if (!pack(query, i, queryCount, size, &queries)) {
+                compareOnCPU(target, query, output, i, queryCount);
+                continue;
+            }
+
+            for (int j=0; j<target.size(); j+=targetBlock) {
+                const int width = std::min(targetBlock, target.size()-j);
+                if (!OpenCLDevice::compare(metric, data, galleryBytes, sum, stride, j, width, queries, queryCount, size, bayesian, scores.data())) {
+                    compareOnCPU(target, query, output, i, queryCount);
+                    break;
+                }
+                for (int k=0; k<queryCount; k++)
+                    output->setRelative(scores.data() + k*width, i+k, j, width);
+            }
+        }
+    }
+
+    // Packs the queries as the kernel reads them, the product quantization kernel reads each query's gathered LUT columns
+    bool pack(const TemplateList &query, int begin, int count, int size, QByteArray *queries) const
+    {
+        const Mat &first = query[begin].m();
+        const int queryBytes = (metric == ProductQuantization) ? size*256*sizeof(float) : first.total()*first.elemSize();
+        queries->resize(count * queryBytes);
+        for (int i=0; i<count; i++) {
+            const Template &t = query[begin+i];
+            if ((t.size() != 1) || (t.m().type() != first.type()) || (int(t.m().total() * t.m().channels()) != size) || !t.m().isContinuous())
+                return false;
+
+            char *dst = queries->data() + i*queryBytes;
+            if (metric == ProductQuantization) {
+                const float *lut = (const float*)ProductQuantizationLUTs[0].data;
+                const uchar *codes = t.m().data;
+                float *table = (float*)dst;
+                for (int j=0; j<size; j++)
+                    for (int k=0; k<256; k++)
+                        table[j*256+k] = lut[j*256*256 + k*256+codes[j]];
+            } else {
+                memcpy(dst, t.m().data, queryBytes);
+            }
+        }
+        return true;
+    }
+
+    void compareOnCPU(const TemplateList &target, const TemplateList &query, Output *output, int begin, int count) const
+    {
+        QVector<float> scores(target.size());
+        for (int i=begin; i<begin+count; i++) {
+            cpu->compareBatch(target, query[i], scores.data(), 0, target.size());
+            output->setRelative(scores.data(), i, 0, target.size());
+        }
+    }
+
+    enum { Query_Block = 256,
+           Score_Bytes = 64*1024*1024 };
+};
+
+BR_REGISTER(Distance, OpenCLDistance)
+
+} // namespace br
+
+#include "opencl.moc"
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicInt>
 #include <QByteArray>
 #include <QCoreApplication>
 #include <QDebug>
@@ -29,9 +30,13 @@
 #endif // BR_EMBEDDED
 #include <QMutex>
 #include <QPair>
+#include <QSharedPointer>
 #include <QVector>
 #include <QtGlobal>
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <assert.h>
@@ -40,6 +45,8 @@
 #include "openbr/core/bee.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
+#include "openbr/core/plot.h"
 #include "openbr/core/qtutils.h"
 
 namespace br
@@ -65,27 +72,203 @@ class DefaultOutput : public MatrixOutput
 
 BR_REGISTER(Output, DefaultOutput)
 
+/*!
+ * \brief Writes text to a file, the terminal or br::Context::buffer, like QtUtils::writeFile() but incrementally.
+ *
+ * Chunks are whole lines ending in a newline.
+ * The final newline is withheld so the result matches the lines joined by QtUtils::writeFile().
+ */
+class TextWriter
+{
+    enum Destination { ToFile, ToTerminal, ToBuffer };
+    Destination destination;
+    QFile output;
+    QByteArray buffer;
+    bool pendingNewline;
+
+public:
+    explicit TextWriter(const QString &file)
+        : pendingNewline(false)
+    {
+        const QString baseName = QFileInfo(file).baseName();
+        if      (baseName == "terminal") destination = ToTerminal;
+        else if (baseName == "buffer")   destination = ToBuffer;
+        else {
+            destination = ToFile;
+            output.setFileName(file);
+            QtUtils::touchDir(output);
+            if (!output.open(QFile::WriteOnly))
+                qFatal("Failed to open %s for writing.", qPrintable(file));
+        }
+    }
+
+    ~TextWriter()
+    {
+        if      (destination == ToTerminal) fputc('\n', stdout);
+        else if (destination == ToBuffer)   Globals->buffer = buffer;
+    }
+
+    void write(const QByteArray &lines)
+    {
+        if (lines.isEmpty()) return;
+        if (pendingNewline) append("\n", 1);
+        append(lines.constData(), lines.size()-1);
+        pendingNewline = true;
+    }
+
+private:
+    void append(const char *data, int size)
+    {
+        if      (destination == ToFile)     output.write(data, size);
+        else if (destination == ToTerminal) fwrite(data, 1, size, stdout);
+        else                                buffer.append(data, size);
+    }
+};
+
+/*!
+ * \brief Formats one line or more per query for TextWriter.
+ *
+ * Blocks of query rows are formatted in parallel and written in order as they finish,
+ * so the text is never held in memory in full.
+ */
+class RowFormatter
+{
+public:
+    virtual ~RowFormatter() {}
+    virtual void formatRow(int row, QByteArray &text) const = 0; /*!< \brief Appends the lines of \em row, each ending in a newline. */
+
+    void writeRows(const QString &file, const QByteArray &header, int rows, int rowWidth) const
+    {
+        TextWriter writer(file);
+        if (!header.isEmpty()) writer.write(header + "\n");
+
+        // Roughly 64K scores per block, and enough blocks in flight to keep every thread busy
+        const int rowsPerBlock = std::max(1, 65536 / std::max(1, rowWidth));
+        const int blocksPerBatch = 4*std::max(1, Globals->parallelism);
+        for (int batch=0; batch<rows; batch+=rowsPerBlock*blocksPerBatch) {
+            QVector<QByteArray> blocks(blocksPerBatch);
+            TaskGroup tasks;
+            for (int k=0; k<blocksPerBatch; k++) {
+                const int begin = batch + k*rowsPerBlock;
+                if (begin >= rows) break;
+                const int end = std::min(begin + rowsPerBlock, rows);
+                if (Globals->parallelism) tasks.run(this, &RowFormatter::formatRows, begin, end, &blocks[k]);
+                else                                                      formatRows (begin, end, &blocks[k]);
+            }
+            tasks.wait();
+
+            foreach (const QByteArray &block, blocks)
+                writer.write(block);
+        }
+    }
+
+    static void appendNumber(QByteArray &text, float value)
+    {
+        // Same digits as QString::number(), without the intermediate QString
+        char digits[32];
+        const int size = qsnprintf(digits, sizeof(digits), "%g", value);
+        text.append(digits, size);
+    }
+
+private:
+    void formatRows(int begin, int end, QByteArray *text) const
+    {
+        for (int i=begin; i<end; i++)
+            formatRow(i, *text);
+    }
+};
+
+/*!
+ * \brief Base class of text outputs that format the similarity matrix one query row at a time.
+ */
+class TextMatrixOutput : public MatrixOutput, public RowFormatter
+{
+protected:
+    virtual QByteArray header() const { return QByteArray(); } /*!< \brief Optional first line, without a newline. */
+
+    void writeText() const
+    {
+        writeRows(file, header(), queryFiles.size(), targetFiles.size());
+    }
+};
+
+typedef QPair<float,int> Candidate; // (score, target index)
+
+/*!
+ * \brief Returns the \em limit best of \em count scores that are at least \em threshold, best first.
+ *
+ * Selects with a bounded heap while scanning the row, so the row is neither copied nor sorted.
+ * Ties are ordered by descending index, like Common::Sort().
+ */
+static QVector<Candidate> topCandidates(const float *scores, int count, int limit, float threshold)
+{
+    QVector<Candidate> heap;
+    if (limit <= 0) return heap;
+    heap.reserve(std::min(limit, count));
+    for (int j=0; j<count; j++) {
+        const Candidate candidate(scores[j], j);
+        if (scores[j] < threshold) continue;
+        if (heap.size() < limit) {
+            heap.append(candidate);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+        } else if (candidate > heap.first()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+            heap.last() = candidate;
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+    return heap;
+}
+
+// The rank list line shared by br::rrOutput and br::topOutput
+static void appendRankList(const File &query, const FileList &targetFiles, const QVector<Candidate> &candidates, bool byLine, QByteArray &text)
+{
+    QStringList files;
+    if (!byLine) files.append(query);
+    foreach (const Candidate &candidate, candidates) {
+        File target = targetFiles[candidate.second];
+        target.set("Score", QString::number(candidate.first));
+        files.append(target.flat());
+    }
+    text.append(files.join(byLine ? "\n" : ",").toLocal8Bit());
+    text.append('\n');
+}
+
 /*!
  * \ingroup outputs
  * \brief Comma separated values output.
  * \author Josh Klontz \cite jklontz
  */
-class csvOutput : public MatrixOutput
+class csvOutput : public TextMatrixOutput
 {
     Q_OBJECT
+    QVector<bool> labelColumns;
 
     ~csvOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        lines.append("File," + targetFiles.names().join(","));
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList words;
-            for (int j=0; j<targetFiles.size(); j++)
-                words.append(toString(i,j));
-            lines.append(queryFiles[i].name+","+words.join(","));
+        labelColumns.resize(targetFiles.size());
+        for (int j=0; j<targetFiles.size(); j++)
+            labelColumns[j] = (targetFiles[j] == "Label");
+        writeText();
+    }
+
+    QByteArray header() const
+    {
+        return ("File," + targetFiles.names().join(",")).toLocal8Bit();
+    }
+
+    void formatRow(int row, QByteArray &text) const
+    {
+        text.append(queryFiles[row].name.toLocal8Bit());
+        const float *scores = data.ptr<float>(row);
+        for (int j=0; j<targetFiles.size(); j++) {
+            text.append(',');
+            if (labelColumns[j]) text.append(File::subject(scores[j]).toLocal8Bit());
+            else                 appendNumber(text, scores[j]);
         }
-        QtUtils::writeFile(file, lines);
+        text.append('\n');
     }
 };
 
@@ -96,40 +279,53 @@ BR_REGISTER(Output, csvOutput)
  * \brief One score per row.
  * \author Josh Klontz \cite jklontz
  */
-class meltOutput : public MatrixOutput
+class meltOutput : public TextMatrixOutput
 {
     Q_OBJECT
+    bool genuineOnly, impostorOnly;
+    QByteArray keys, values;
+    QList<float> queryLabels, targetLabels;
+    QVector<QByteArray> queryNames, targetNames; // Encoded once rather than per pair
 
     ~meltOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const bool genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
-        const bool impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
+        impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
 
         QMap<QString,QVariant> args = file.localMetadata();
         args.remove("Genuine");
         args.remove("Impostor");
 
-        QString keys; foreach (const QString &key, args.keys()) keys += "," + key;
-        QString values; foreach (const QVariant &value, args.values()) values += "," + value.toString();
+        foreach (const QString &key, args.keys()) keys += "," + key.toLocal8Bit();
+        foreach (const QVariant &value, args.values()) values += "," + value.toString().toLocal8Bit();
 
-        QStringList lines;
-        if (file.baseName() != "terminal") lines.append(QString("Query,Target,Mask,Similarity%1").arg(keys));
-        QList<float> queryLabels = queryFiles.labels();
-        QList<float> targetLabels = targetFiles.labels();
-        for (int i=0; i<queryFiles.size(); i++) {
-            for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
-                const bool genuine = queryLabels[i] == targetLabels[j];
-                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
-                lines.append(QString("%1,%2,%3,%4%5").arg(queryFiles[i],
-                                                          targetFiles[j],
-                                                          QString::number(genuine),
-                                                          QString::number(data.at<float>(i,j)),
-                                                          values));
-            }
-        }
+        queryLabels = queryFiles.labels();
+        targetLabels = targetFiles.labels();
+        foreach (const File &query, queryFiles) queryNames.append(query.name.toLocal8Bit() + ",");
+        foreach (const File &target, targetFiles) targetNames.append(target.name.toLocal8Bit() + ",");
+        writeText();
+    }
 
-        QtUtils::writeFile(file, lines);
+    QByteArray header() const
+    {
+        if (file.baseName() == "terminal") return QByteArray();
+        return "Query,Target,Mask,Similarity" + keys;
+    }
+
+    void formatRow(int i, QByteArray &text) const
+    {
+        const float *scores = data.ptr<float>(i);
+        for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
+            const bool genuine = queryLabels[i] == targetLabels[j];
+            if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
+            text.append(queryNames[i]);
+            text.append(targetNames[j]);
+            text.append(genuine ? "1," : "0,");
+            appendNumber(text, scores[j]);
+            text.append(values);
+            text.append('\n');
+        }
     }
 };
 
@@ -139,15 +335,30 @@ BR_REGISTER(Output, meltOutput)
  * \ingroup outputs
  * \brief \ref simmat output.
  * \author Josh Klontz \cite jklontz
+ *
+ * Scores are written straight into the memory mapped file as blocks complete,
+ * so the matrix doesn't have to fit in memory and finished rows survive a crash.
+ * The \c targetSigset and \c querySigset names recorded in the header default to \c Unknown_Target and \c Unknown_Query.
+ * Set \c quantize to 8 or 16, as in <tt>scores.mtx[quantize=16]</tt>, to store scores as integers that keep their order,
+ * and \c compress to also zlib compress them, see BEE::MatrixWriter.
  */
 class mtxOutput : public MatrixOutput
 {
     Q_OBJECT
+    QSharedPointer<BEE::MatrixWriter> writer;
 
-    ~mtxOutput()
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        BEE::writeSimmat(data, file.name);
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) {
+            MatrixOutput::initialize(targetFiles, queryFiles);
+            return;
+        }
+
+        Output::initialize(targetFiles, queryFiles);
+        writer = QSharedPointer<BEE::MatrixWriter>(new BEE::MatrixWriter(file, queryFiles.size(), targetFiles.size(), false,
+                                                                         file.get<QString>("targetSigset", "Unknown_Target"),
+                                                                         file.get<QString>("querySigset", "Unknown_Query")));
+        data = writer->block(0, writer->rows);
     }
 };
 
@@ -158,38 +369,100 @@ BR_REGISTER(Output, mtxOutput)
  * \brief Rank retrieval output.
  * \author Josh Klontz \cite jklontz Scott Klum \cite sklum
  */
-class rrOutput : public MatrixOutput
+class rrOutput : public TextMatrixOutput
 {
     Q_OBJECT
+    int limit;
+    bool byLine;
+    float threshold;
 
     ~rrOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const int limit = file.get<int>("limit", 20);
-        const bool byLine = file.get<bool>("byLine", false);
-        const float threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        limit = file.get<int>("limit", 20);
+        byLine = file.get<bool>("byLine", false);
+        threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        writeText();
+    }
 
-        QStringList lines;
+    void formatRow(int i, QByteArray &text) const
+    {
+        appendRankList(queryFiles[i], targetFiles, topCandidates(data.ptr<float>(i), targetFiles.size(), limit, threshold), byLine, text);
+    }
+};
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList files;
-            if (!byLine) files.append(queryFiles[i]);
-
-            typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
-                if (pair.first < threshold) break;
-                File target = targetFiles[pair.second];
-                target.set("Score", QString::number(pair.first));
-                files.append(target.flat());
-            }
-            lines.append(files.join(byLine ? "\n" : ","));
+BR_REGISTER(Output, rrOutput)
+
+/*!
+ * \ingroup outputs
+ * \brief Rank retrieval output that keeps only the top \c limit scores per query.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Produces the same file as br::rrOutput without allocating the full similarity matrix.
+ * Each thread accumulates a bounded min-heap per query, and the heaps are merged when the output is destroyed.
+ */
+class topOutput : public Output, public RowFormatter
+{
+    Q_OBJECT
+
+    typedef QVector< QVector<Candidate> > Heaps; // one heap per query
+
+    int limit;
+    bool byLine;
+    float threshold;
+    ThreadLocal<Heaps> threadHeaps;
+
+    ~topOutput()
+    {
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+        writeRows(file, QByteArray(), queryFiles.size(), limit*threadHeaps.values().size());
+    }
+
+    void formatRow(int i, QByteArray &text) const
+    {
+        QVector<Candidate> candidates;
+        foreach (const Heaps *heaps, threadHeaps.values())
+            candidates += (*heaps)[i];
+        const int n = std::min(limit, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(), std::greater<Candidate>());
+        candidates.resize(n);
+        appendRankList(queryFiles[i], targetFiles, candidates, byLine, text);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        limit = file.get<int>("limit", 20);
+        byLine = file.get<bool>("byLine", false);
+        threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        threadHeaps.reset(Heaps(queryFiles.size()));
+    }
+
+    void set(float value, int i, int j)
+    {
+        if ((value < threshold) || (limit <= 0)) return;
+
+        QVector<Candidate> &heap = threadHeaps.local()[i];
+        if (heap.size() < limit) {
+            heap.append(Candidate(value, j));
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+        } else if (value > heap.first().first) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+            heap.last() = Candidate(value, j);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
         }
+    }
 
-        QtUtils::writeFile(file, lines);
+    float rowCutoff(int i)
+    {
+        // Once this thread's heap is full only scores above its minimum are kept
+        if (limit <= 0) return threshold;
+        const QVector<Candidate> &heap = threadHeaps.local()[i];
+        return (heap.size() < limit) ? threshold : std::max(threshold, heap.first().first);
     }
 };
 
-BR_REGISTER(Output, rrOutput)
+BR_REGISTER(Output, topOutput)
 
 /*!
  * \ingroup outputs
@@ -266,35 +539,66 @@ class rankOutput : public MatrixOutput
 {
     Q_OBJECT
 
+    struct Match
+    {
+        int rank, position;
+        Match() : rank(0), position(-1) {}
+    };
+
+    QStringList targetLabels;
+
     ~rankOutput()
     {
         if (targetFiles.isEmpty() || queryFiles.isEmpty()) return;
 
-        QList<int> ranks;
-        QList<int> positions;
-        QList<float> scores;
-        QStringList lines;
+        targetLabels.reserve(targetFiles.size());
+        foreach (const File &target, targetFiles)
+            targetLabels.append(target.get<QString>("Label"));
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                if(targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                    ranks.append(rank);
-                    positions.append(pair.second);
-                    scores.append(pair.first);
-                    break;
-                }
-                rank++;
+        QVector<Match> matches(queryFiles.size());
+        TaskGroup tasks;
+        for (int i=0; i<queryFiles.size(); i++)
+            if (Globals->parallelism) tasks.run(this, &rankOutput::rank, i, &matches[i]);
+            else                                                  rank (i, &matches[i]);
+        tasks.wait();
+
+        QList<int> ranks, queries;
+        for (int i=0; i<matches.size(); i++)
+            if (matches[i].position >= 0) {
+                ranks.append(matches[i].rank);
+                queries.append(i);
             }
-        }
 
+        QStringList lines;
         typedef QPair<int,int> RankPair;
-        foreach (const RankPair &pair, Common::Sort(ranks, false))
-            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
+        foreach (const RankPair &pair, Common::Sort(ranks, false)) {
+            const int query = queries[pair.second];
+            const int position = matches[query].position;
+            lines.append(queryFiles[query].name + " " + QString::number(pair.first) + " " + QString::number(data.at<float>(query, position)) + " " + targetFiles[position].name);
+        }
 
         QtUtils::writeFile(file, lines);
     }
+
+    // The rank of the first genuine match in the descending sort of the row, found in two linear passes instead of a sort
+    void rank(int i, Match *match) const
+    {
+        const QString label = queryFiles[i].get<QString>("Label");
+        const float *scores = data.ptr<float>(i);
+
+        Candidate best(0, -1);
+        for (int j=0; j<targetFiles.size(); j++)
+            if ((targetLabels[j] == label) && ((best.second < 0) || (Candidate(scores[j], j) > best)))
+                best = Candidate(scores[j], j);
+        if (best.second < 0) return;
+
+        int ahead = 0;
+        for (int j=0; j<targetFiles.size(); j++)
+            if (Candidate(scores[j], j) > best) ahead++;
+
+        match->rank = ahead + 1;
+        match->position = best.second;
+    }
 };
 
 BR_REGISTER(Output, rankOutput)
@@ -384,6 +688,14 @@ class tailOutput : public Output
         lastValue = comparisons.last().value;
         comparisonsLock.unlock();
     }
+
+    float rowCutoff(int i)
+    {
+        (void) i;
+        QMutexLocker locker(&comparisonsLock);
+        if (comparisons.size() < atLeast) return -std::numeric_limits<float>::max();
+        return std::min(threshold, lastValue);
+    }
 };
 
 BR_REGISTER(Output, tailOutput)
@@ -399,9 +711,11 @@ class bestOutput : public Output
 
     typedef QPair< float, QPair<int, int> > BestMatch;
     QList<BestMatch> bestMatches;
+    ThreadLocal< QList<BestMatch> > threadMatches;
 
     ~bestOutput()
     {
+        merge();
         if (file.isNull() || bestMatches.isEmpty()) return;
         qSort(bestMatches);
         QStringList lines; lines.reserve(bestMatches.size()+1);
@@ -417,21 +731,31 @@ class bestOutput : public Output
         bestMatches.reserve(queryFiles.size());
         for (int i=0; i<queryFiles.size(); i++)
             bestMatches.append(BestMatch(-std::numeric_limits<float>::max(), QPair<int,int>(-1, -1)));
+        threadMatches.reset(bestMatches);
     }
 
     void set(float value, int i, int j)
     {
-        static QMutex lock;
-
         // Return early for self similar matrices
         if (selfSimilar && (i == j)) return;
 
-        if (value > bestMatches[i].first) {
-            lock.lock();
-            if (value > bestMatches[i].first)
-                bestMatches[i] = BestMatch(value, QPair<int,int>(i,j));
-            lock.unlock();
-        }
+        QList<BestMatch> &matches = threadMatches.local();
+        if (value > matches[i].first)
+            matches[i] = BestMatch(value, QPair<int,int>(i,j));
+    }
+
+    float rowCutoff(int i)
+    {
+        return threadMatches.local()[i].first;
+    }
+
+    void merge()
+    {
+        foreach (const QList<BestMatch> *matches, threadMatches.values())
+            for (int i=0; i<matches->size(); i++)
+                if ((*matches)[i].first > bestMatches[i].first)
+                    bestMatches[i] = (*matches)[i];
+        threadMatches.reset(bestMatches);
     }
 };
 
@@ -448,9 +772,14 @@ class histOutput : public Output
 
     float min, max, step;
     QVector<int> bins;
+    ThreadLocal< QVector<int> > threadBins;
 
     ~histOutput()
     {
+        foreach (const QVector<int> *counts, threadBins.values())
+            for (int i=0; i<bins.size(); i++)
+                bins[i] += (*counts)[i];
+
         if (file.isNull() || bins.isEmpty()) return;
         QStringList counts;
         foreach (int count, bins)
@@ -466,6 +795,7 @@ class histOutput : public Output
         max = file.get<float>("max", 5);
         step = file.get<float>("step", 0.1);
         bins = QVector<int>((max-min)/step, 0);
+        threadBins.reset(bins);
     }
 
     void set(float value, int i, int j)
@@ -473,12 +803,197 @@ class histOutput : public Output
         (void) i;
         (void) j;
         if ((value < min) || (value >= max)) return;
-        bins[(value-min)/step]++; // This should technically be locked to ensure atomic increment
+        threadBins.local()[(value-min)/step]++;
     }
 };
 
 BR_REGISTER(Output, histOutput)
 
+/*!
+ * \ingroup outputs
+ * \brief Evaluates the comparison as it runs and writes the same CSV as br::Evaluate.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Pairs are genuine when their labels agree, as in br::meltOutput, so no similarity matrix or mask is written.
+ * Each thread keeps its genuine scores, impostor scores and the top impostors of every query it touched.
+ * Comparisons larger than br::Max_Comparisons, or any with a \c bins count, histogram their impostor scores instead.
+ * The bin range is \c min to \c max when given and otherwise estimated from the first impostors seen, padded on both sides.
+ */
+class evalOutput : public Output
+{
+    Q_OBJECT
+
+    // Enough of a query's scores to recover the rank of its best genuine match
+    struct QueryRank
+    {
+        bool hasGenuine;
+        float bestGenuine;
+        QVector<float> impostors; // Min-heap of the highest Max_Retrieval scores
+        QueryRank() : hasGenuine(false), bestGenuine(-std::numeric_limits<float>::max()) {}
+    };
+
+    struct Scores
+    {
+        QVector<float> genuines, impostors; // Impostors are only kept until the bins are fixed
+        QVector<qint64> histogram;
+        QVector<QueryRank> ranks;
+        qint64 numNaNs;
+        Scores() : numNaNs(0) {}
+    };
+
+    enum { Range_Samples = 1 << 16 };
+
+    QList<float> queryLabels, targetLabels;
+    int bins;
+    float minImpostor;
+    double width;
+    QAtomicInt binned; // Set once minImpostor and width are fixed
+    QMutex rangeLock;
+    ThreadLocal<Scores> threadScores;
+
+    ~evalOutput()
+    {
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+
+        const QList<Scores*> scores = threadScores.values();
+        if ((bins > 0) && !binned.loadAcquire()) {
+            QVector<float> samples;
+            foreach (const Scores *s, scores)
+                samples += s->impostors;
+            fixRange(samples, false);
+        }
+
+        QVector<float> genuines, impostors;
+        QVector<qint64> histogram(std::max(bins, 0), 0);
+        qint64 numNaNs = 0;
+        foreach (Scores *s, scores) {
+            if (bins > 0) flush(*s);
+            genuines += s->genuines;
+            impostors += s->impostors;
+            for (int b=0; b<s->histogram.size(); b++)
+                histogram[b] += s->histogram[b];
+            numNaNs += s->numNaNs;
+        }
+
+        QVector<int> firstGenuineReturns(queryFiles.size(), 0);
+        for (int i=0; i<queryFiles.size(); i++) {
+            QueryRank rank;
+            foreach (const Scores *s, scores) {
+                const QueryRank &local = s->ranks[i];
+                if (local.hasGenuine) rank.bestGenuine = rank.hasGenuine ? std::max(rank.bestGenuine, local.bestGenuine) : local.bestGenuine;
+                rank.hasGenuine = rank.hasGenuine || local.hasGenuine;
+                rank.impostors += local.impostors;
+            }
+            if (!rank.hasGenuine) continue;
+
+            // Every thread kept its own top impostors, so the overall top Max_Retrieval are among them
+            std::sort(rank.impostors.begin(), rank.impostors.end(), std::greater<float>());
+            int impostorsAbove = 0;
+            while ((impostorsAbove < std::min(int(Max_Retrieval), rank.impostors.size())) && (rank.impostors[impostorsAbove] > rank.bestGenuine))
+                impostorsAbove++;
+            firstGenuineReturns[i] = impostorsAbove + 1;
+        }
+        threadScores.reset(Scores());
+
+        if (bins > 0) EvaluateHistogram(queryFiles.size(), targetFiles.size(), genuines, histogram, minImpostor, width, firstGenuineReturns, numNaNs, file.name);
+        else          EvaluateScores(queryFiles.size(), targetFiles.size(), genuines, impostors, firstGenuineReturns, numNaNs, file.name);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        queryLabels = queryFiles.labels();
+        targetLabels = targetFiles.labels();
+
+        bins = file.get<int>("bins", 0);
+        if ((bins <= 0) && (qint64(queryFiles.size())*qint64(targetFiles.size()) > Max_Comparisons))
+            bins = Default_Bins;
+        if ((bins > 0) && file.contains("min") && file.contains("max")) {
+            QVector<float> range;
+            range.append(file.get<float>("min"));
+            range.append(file.get<float>("max"));
+            fixRange(range, false);
+        }
+
+        Scores initial;
+        initial.ranks = QVector<QueryRank>(queryFiles.size());
+        initial.histogram = QVector<qint64>(std::max(bins, 0), 0);
+        threadScores.reset(initial);
+    }
+
+    void set(float value, int i, int j)
+    {
+        if (selfSimilar && (j <= i)) return;
+
+        Scores &scores = threadScores.local();
+        if (value != value) { scores.numNaNs++; return; }
+
+        QueryRank &rank = scores.ranks[i];
+        if (queryLabels[i] == targetLabels[j]) {
+            scores.genuines.append(value);
+            rank.bestGenuine = rank.hasGenuine ? std::max(rank.bestGenuine, value) : value;
+            rank.hasGenuine = true;
+            return;
+        }
+
+        if (rank.impostors.size() < Max_Retrieval) {
+            rank.impostors.append(value);
+            std::push_heap(rank.impostors.begin(), rank.impostors.end(), std::greater<float>());
+        } else if (value > rank.impostors.first()) {
+            std::pop_heap(rank.impostors.begin(), rank.impostors.end(), std::greater<float>());
+            rank.impostors.last() = value;
+            std::push_heap(rank.impostors.begin(), rank.impostors.end(), std::greater<float>());
+        }
+
+        if ((bins > 0) && binned.loadAcquire()) {
+            scores.histogram[bin(value)]++;
+        } else {
+            scores.impostors.append(value);
+            if ((bins > 0) && (scores.impostors.size() >= Range_Samples)) {
+                fixRange(scores.impostors, true);
+                flush(scores);
+            }
+        }
+    }
+
+    int bin(float score) const
+    {
+        return std::max(0, std::min(bins-1, int((double(score) - minImpostor) / width)));
+    }
+
+    // Moves a thread's kept impostor scores into its histogram
+    void flush(Scores &scores) const
+    {
+        foreach (float score, scores.impostors)
+            scores.histogram[bin(score)]++;
+        scores.impostors.clear();
+    }
+
+    // The first caller decides the bins, padding an estimate by its own span so later outliers rarely clamp
+    void fixRange(const QVector<float> &samples, bool pad)
+    {
+        QMutexLocker locker(&rangeLock);
+        if (binned.loadAcquire()) return;
+
+        float low = std::numeric_limits<float>::max();
+        float high = -std::numeric_limits<float>::max();
+        foreach (float score, samples) {
+            if (score == -std::numeric_limits<float>::max()) continue;
+            low = std::min(low, score);
+            high = std::max(high, score);
+        }
+        if (low > high) low = high = 0;
+
+        const double span = pad ? double(high) - low : 0;
+        minImpostor = low - span;
+        width = (high > low) ? (double(high) + span - minImpostor) / bins : 1;
+        qDebug("Impostor score resolution: %g (%d bins)", width, bins);
+        binned.storeRelease(1);
+    }
+};
+
+BR_REGISTER(Output, evalOutput)
+
 } // namespace br
 
 #include "output.moc"
@@ -1,96 +1,83 @@
-#include <opencv2/core/core.hpp>
-#include <pHash.h>
-#include <mm_plugin.h>
-
-using namespace mm;
-
-/**** PHASH ****/
-class pHashEnroll : public UntrainableFeature
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <openbr/openbr_plugin.h>
+
+using namespace cv;
+
+namespace br
 {
-    void project(const Matrix &src, Matrix &dst) const
-    {
-        CImg<uint8_t> cImg(src.data, src.cols, src.rows, 1, src.channels());
-        cv::Mat m(1, sizeof(ulong64), CV_8UC1);
-        ulong64 hash;
-        if (ph_dct_imagehash(cImg, hash) == -1)
-            qFatal("pHashEnroll::project ph_dct_imagehash failure for file %s.", qPrintable(src.metadata.fileName));
-        memcpy(m.data, &hash, sizeof(ulong64));
-        dst = Matrix(m, src.metadata);
-    }
 
-    /*** Taken from pHash, modified to take in a CImg instead of a file. ***/
-    static CImg<float>* ph_dct_matrix(const int N){
-        CImg<float> *ptr_matrix = new CImg<float>(N,N,1,1,1/sqrt((float)N));
-        const float c1 = sqrt(2.0/N);
-        for (int x=0;x<N;x++){
-            for (int y=1;y<N;y++){
-                *ptr_matrix->data(x,y) = c1*cos((cimg::PI/2/N)*y*(2*x+1));
-            }
-        }
-        return ptr_matrix;
-    }
+/*!
+ * \ingroup transforms
+ * \brief The 64-bit DCT perceptual image hash of pHash \cite zauner10.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The luminance is smoothed by a 7x7 box filter and resized to 32x32.
+ * Bit \em i of the hash is set if the <em>i</em>th of the 8x8 lowest frequency DCT coefficients, excluding the first row and column,
+ * is above their median. Hashes are packed little-endian into one 8-byte row, compare them with br::HammingDistance.
+ * \see MultiIndexHash
+ */
+class PerceptualHashTransform : public UntrainableTransform
+{
+    Q_OBJECT
 
-    static int ph_dct_imagehash(CImg<uint8_t> src, ulong64 &hash)
+    void project(const Template &src, Template &dst) const
     {
-        CImg<float> meanfilter(7,7,1,1,1);
-        CImg<float> img;
-        if (src.spectrum() == 3){
-            img = src.RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-        } else if (src.spectrum() == 4){
-            int width = img.width();
-            int height = img.height();
-            int depth = img.depth();
-            img = src.crop(0,0,0,0,width-1,height-1,depth-1,2).RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-        } else {
-            img = src.channel(0).get_convolve(meanfilter);
+        dst = src;
+        const Mat &m = src;
+        if (m.empty()) {
+            dst.file.set("FTE", true);
+            return;
         }
 
-        img.resize(32,32);
-        CImg<float> *C  = ph_dct_matrix(32);
-        CImg<float> Ctransp = C->get_transpose();
-
-        CImg<float> dctImage = (*C)*img*Ctransp;
-
-        CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');;
-
-        float median = subsec.median();
-        ulong64 one = 0x0000000000000001;
-        hash = 0x0000000000000000;
-        for (int i=0;i< 64;i++){
-            float current = subsec(i);
-            if (current > median)
-                hash |= one;
-            one = one << 1;
-        }
-
-        delete C;
-
-        return 0;
+        Mat gray;
+        if      (m.channels() == 3) cvtColor(m, gray, CV_BGR2GRAY);
+        else if (m.channels() == 4) cvtColor(m, gray, CV_BGRA2GRAY);
+        else                        gray = m;
+
+        Mat smoothed, resized, coefficients;
+        gray.convertTo(smoothed, CV_32F);
+        blur(smoothed, smoothed, Size(7, 7));
+        resize(smoothed, resized, Size(32, 32), 0, 0, INTER_AREA);
+        dct(resized, coefficients);
+
+        float values[64];
+        for (int y=0; y<8; y++)
+            for (int x=0; x<8; x++)
+                values[y*8+x] = coefficients.at<float>(y+1, x+1);
+
+        float sorted[64];
+        std::copy(values, values+64, sorted);
+        std::nth_element(sorted, sorted+32, sorted+64);
+        const float upper = sorted[32];
+        const float median = (*std::max_element(sorted, sorted+32) + upper) / 2;
+
+        Mat hash(1, 8, CV_8UC1, Scalar(0));
+        for (int i=0; i<64; i++)
+            if (values[i] > median)
+                hash.at<uchar>(0, i/8) |= uchar(1 << (i%8));
+        dst = Template(src.file, hash);
     }
 };
 
-MM_REGISTER(Feature, pHashEnroll, false)
+BR_REGISTER(Transform, PerceptualHashTransform)
 
+} // namespace br
 
-/**** PHASH_COMPARE ****/
-class pHashCompare : public ComparerBase
-{
-    float compare(const cv::Mat &a, const cv::Mat &b) const
-    {
-        return 1.f - 1.f * ph_hamming_distance(*reinterpret_cast<ulong64*>(a.data), *reinterpret_cast<ulong64*>(b.data)) / 64;
-    }
-};
-
-MM_REGISTER(Comparer, pHashCompare, false)
-
-
-/**** PHASH ****/
-class pHash : public Algorithm
-{
-    QString algorithm() const
-    {
-        return "Open+pHashEnroll:Identity:pHashCompare";
-    }
-};
-
-MM_REGISTER(Algorithm, pHash, false)
+#include "phash.moc"
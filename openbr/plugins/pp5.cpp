@@ -45,12 +45,21 @@ class PP5Initializer : public Initializer
 
     void initialize() const
     {
-        TRY(ppr_initialize_sdk(qPrintable(Globals->sdkPath + "/share/openbr/models/pp5/"), my_license_id, my_license_key))
         Globals->abbreviations.insert("PP5","Open!PP5Enroll:PP5Compare");
         Globals->abbreviations.insert("PP5Register", "Open+PP5Enroll(true)+RenameFirst([eyeL,PP5_Landmark0_Right_Eye],Affine_0)+RenameFirst([eyeR,PP5_Landmark1_Left_Eye],Affine_1)");
     }
 
-    void finalize() const
+    QStringList plugins() const
+    {
+        return QStringList() << "PP5Enroll" << "PP5Compare";
+    }
+
+    void startup() const
+    {
+        TRY(ppr_initialize_sdk(qPrintable(Globals->sdkPath + "/share/openbr/models/pp5/"), my_license_id, my_license_key))
+    }
+
+    void shutdown() const
     {
         ppr_finalize_sdk();
     }
@@ -220,6 +229,11 @@ class PP5Enroll : public UntrainableTransform
     BR_PROPERTY(bool, detectOnly, false)
     Resource<PP5Context> contexts;
 
+    void init()
+    {
+        contexts.warmUp();
+    }
+
     void project(const Template &src, Template &dst) const
     {
         PP5Context *context = contexts.acquire();
@@ -273,10 +287,12 @@ BR_REGISTER(Transform, PP5Enroll)
  * \author E. Taborsky \cite mmtaborsky
  */
 class PP5Compare : public Distance
-                 , public PP5Context
 {
     Q_OBJECT
 
+    // Blocks of the similarity matrix are compared concurrently, each with its own context
+    Resource<PP5Context> contexts;
+
     float compare(const Template &target, const Template &query) const
     {
         (void) target;
@@ -287,12 +303,14 @@ class PP5Compare : public Distance
 
     void compare(const TemplateList &target, const TemplateList &query, Output *output) const
     {
+        ResourceLock<PP5Context> pp5(contexts);
+        const ppr_context_type &context = pp5->context;
         ppr_gallery_type target_gallery, query_gallery;
         ppr_create_gallery(context, &target_gallery);
         ppr_create_gallery(context, &query_gallery);
         QList<int> target_face_ids, query_face_ids;
-        enroll(target, &target_gallery, target_face_ids);
-        enroll(query, &query_gallery, query_face_ids);
+        enroll(*pp5, target, &target_gallery, target_face_ids);
+        enroll(*pp5, query, &query_gallery, query_face_ids);
 
         ppr_similarity_matrix_type similarity_matrix;
         TRY(ppr_compare_galleries(context, query_gallery, target_gallery, &similarity_matrix))
@@ -314,14 +332,14 @@ class PP5Compare : public Distance
         ppr_free_gallery(query_gallery);
     }
 
-    void enroll(const TemplateList &templates, ppr_gallery_type *gallery, QList<int> &face_ids) const
+    static void enroll(const PP5Context &pp5, const TemplateList &templates, ppr_gallery_type *gallery, QList<int> &face_ids)
     {
         int face_id = 0;
         foreach (const Template &src, templates) {
             if (src.m().data) {
                 ppr_face_type face;
-                createFace(src, &face);
-                TRY(ppr_add_face(context, gallery, face, face_id, face_id))
+                pp5.createFace(src, &face);
+                TRY(ppr_add_face(pp5.context, gallery, face, face_id, face_id))
                 face_ids.append(face_id);
                 face_id++;
                 ppr_free_face(face);
@@ -1,6 +1,7 @@
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/common.h"
+#include "openbr/core/parallel.h"
 
 namespace br
 {
@@ -9,6 +10,10 @@ namespace br
  * \ingroup transforms
  * \brief Impostor Uniqueness Measure \cite klare12
  * \author Josh Klontz \cite jklontz
+ *
+ * The impostor set is aligned once and each probe is batch compared against all of it,
+ * same-label scores are masked out of the statistics rather than removed from a copy.
+ * If \em samples is positive the impostor set is an evenly spaced sample of that many training templates.
  */
 class ImpostorUniquenessMeasureTransform : public Transform
 {
@@ -16,35 +21,63 @@ class ImpostorUniquenessMeasureTransform : public Transform
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(double mean READ get_mean WRITE set_mean RESET reset_mean)
     Q_PROPERTY(double stddev READ get_stddev WRITE set_stddev RESET reset_stddev)
+    Q_PROPERTY(int samples READ get_samples WRITE set_samples RESET reset_samples STORED false)
     BR_PROPERTY(br::Distance*, distance, Distance::make("Dist(L2)", this))
     BR_PROPERTY(double, mean, 0)
     BR_PROPERTY(double, stddev, 1)
+    BR_PROPERTY(int, samples, 0)
     TemplateList impostors;
+    QVector<int> labels; // Of the impostors
 
-    float calculateIUM(const Template &probe, const TemplateList &gallery) const
+    float calculateIUM(const Template &probe) const
     {
+        const QList<float> scores = distance->compare(impostors, probe);
         const int probeLabel = probe.file.label();
-        TemplateList subset = gallery;
-        for (int j=subset.size()-1; j>=0; j--)
-            if (subset[j].file.label() == probeLabel)
-                subset.removeAt(j);
+        float min = std::numeric_limits<float>::max(), max = -std::numeric_limits<float>::max();
+        double sum = 0;
+        int count = 0;
+        for (int j=0; j<scores.size(); j++) {
+            if (labels[j] == probeLabel) continue;
+            min = std::min(min, scores[j]);
+            max = std::max(max, scores[j]);
+            sum += scores[j];
+            count++;
+        }
+        if (count == 0) return 0;
+        return (max-sum/count)/(max-min);
+    }
 
-        QList<float> scores = distance->compare(subset, probe);
-        float min, max;
-        Common::MinMax(scores, &min, &max);
-        double mean;
-        Common::Mean(scores, &mean);
-        return (max-mean)/(max-min);
+    void calculateIUMs(const TemplateList *probes, int begin, int end, float *iums) const
+    {
+        for (int i=begin; i<end; i++)
+            iums[i] = calculateIUM((*probes)[i]);
+    }
+
+    void prepare()
+    {
+        impostors.align();
+        labels = impostors.labels<int>().toVector();
     }
 
     void train(const TemplateList &data)
     {
         distance->train(data);
-        impostors = data;
+        if ((samples > 0) && (samples < data.size())) {
+            impostors.clear();
+            for (int i=0; i<samples; i++)
+                impostors.append(data[int(qint64(i) * data.size() / samples)]);
+        } else {
+            impostors = data;
+        }
+        prepare();
 
-        QList<float> iums; iums.reserve(impostors.size());
-        for (int i=0; i<data.size(); i++)
-            iums.append(calculateIUM(impostors[i], impostors));
+        QVector<float> iums(data.size());
+        const int step = std::max(1, data.size() / (4*std::max(1, abs(Globals->parallelism))));
+        TaskGroup tasks;
+        for (int i=0; i<data.size(); i+=step)
+            if (Globals->parallelism) tasks.run(this, &ImpostorUniquenessMeasureTransform::calculateIUMs, &data, i, std::min(i+step, data.size()), iums.data());
+            else                                                                          calculateIUMs(&data, i, std::min(i+step, data.size()), iums.data());
+        tasks.wait();
 
         Common::MeanStdDev(iums, &mean, &stddev);
     }
@@ -52,7 +85,7 @@ class ImpostorUniquenessMeasureTransform : public Transform
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        float ium = calculateIUM(src, impostors);
+        float ium = calculateIUM(src);
         dst.file.set("Impostor_Uniqueness_Measure", ium);
         dst.file.set("Impostor_Uniqueness_Measure_Bin", ium < mean-stddev ? 0 : (ium < mean+stddev ? 1 : 2));
     }
@@ -67,11 +100,89 @@ class ImpostorUniquenessMeasureTransform : public Transform
     {
         distance->load(stream);
         stream >> mean >> stddev >> impostors;
+        prepare();
     }
 };
 
 BR_REGISTER(Transform, ImpostorUniquenessMeasureTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Cohort score statistics of each template for br::CohortNormDistance.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The cohort is an evenly spaced sample of \em samples training templates, or all of them if \em samples isn't positive.
+ * Each template is batch compared against the aligned cohort once as it is enrolled,
+ * and the mean and standard deviation of its scores are stored as \c Cohort_Mean and \c Cohort_StdDev.
+ * Cohort members with the template's label, and failed comparisons, are left out of the statistics.
+ */
+class CohortTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int samples READ get_samples WRITE set_samples RESET reset_samples STORED false)
+    BR_PROPERTY(br::Distance*, distance, Distance::make("Dist(L2)", this))
+    BR_PROPERTY(int, samples, 500)
+    TemplateList cohort;
+    QVector<int> labels; // Of the cohort
+
+    void prepare()
+    {
+        cohort.align();
+        labels = cohort.labels<int>().toVector();
+    }
+
+    void train(const TemplateList &data)
+    {
+        distance->train(data);
+        cohort.clear();
+        if ((samples > 0) && (samples < data.size())) {
+            for (int i=0; i<samples; i++)
+                cohort.append(data[int(qint64(i) * data.size() / samples)]);
+        } else {
+            cohort = data;
+        }
+        prepare();
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        QVector<float> scores(cohort.size());
+        if (!cohort.isEmpty()) distance->compareBatch(cohort, src, scores.data(), 0, cohort.size());
+
+        const int label = src.file.label();
+        double sum = 0, squares = 0;
+        int count = 0;
+        for (int j=0; j<scores.size(); j++) {
+            if ((labels[j] == label) || (scores[j] == -std::numeric_limits<float>::max())) continue;
+            sum += scores[j];
+            squares += scores[j]*scores[j];
+            count++;
+        }
+
+        const double mean = (count > 0) ? sum / count : 0;
+        const double variance = (count > 1) ? (squares - count*mean*mean) / (count - 1) : 0;
+        dst.file.set("Cohort_Mean", mean);
+        dst.file.set("Cohort_StdDev", sqrt(std::max(0.0, variance)));
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+        stream << cohort;
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+        stream >> cohort;
+        prepare();
+    }
+};
+
+BR_REGISTER(Transform, CohortTransform)
+
 /* Kernel Density Estimator */
 struct KDE
 {
@@ -87,8 +198,8 @@ struct KDE
         double h = Common::KernelDensityBandwidth(scores);
         const int size = 255;
         bins.reserve(size);
-        for (int i=0; i<size; i++)
-            bins.append(Common::KernelDensityEstimation(scores, min + (max-min)*i/(size-1), h));
+        foreach (double density, Common::KernelDensityEstimation(scores, min, max, size, h))
+            bins.append(density);
     }
 
     float operator()(float score, bool gaussian = true) const
@@ -96,7 +207,7 @@ struct KDE
         if (gaussian) return 1/(stddev*sqrt(2*CV_PI))*exp(-0.5*pow((score-mean)/stddev, 2));
         if (score <= min) return bins.first();
         if (score >= max) return bins.last();
-        const float x = (score-min)/(max-min)*bins.size();
+        const float x = (score-min)/(max-min)*(bins.size()-1);
         const float y1 = bins[floor(x)];
         const float y2 = bins[ceil(x)];
         return y1 + (y2-y1)*(x-floor(x));
@@ -117,15 +228,45 @@ QDataStream &operator>>(QDataStream &stream, KDE &kde)
 struct MP
 {
     KDE genuine, impostor;
-    MP() {}
+    MP() : low(0), step(1) {}
     MP(const QList<float> &genuineScores, const QList<float> &impostorScores)
-        : genuine(genuineScores), impostor(impostorScores) {}
+        : genuine(genuineScores), impostor(impostorScores), low(0), step(1) {}
     float operator()(float score, bool gaussian = true) const
     {
         const float g = genuine(score, gaussian);
         const float s = g / (impostor(score, gaussian) + g);
         return s;
     }
+
+    /*!
+     * Tabulates operator() at \em size evenly spaced raw scores spanning the training scores,
+     * after which calibrate() interpolates the table instead of evaluating the densities.
+     */
+    void compile(bool gaussian, int size)
+    {
+        table.clear();
+        if (size < 2) return;
+        low = std::min(genuine.min, impostor.min);
+        const float high = std::max(genuine.max, impostor.max);
+        if (!(high > low)) return;
+        step = (high - low) / (size - 1);
+        table.resize(size);
+        for (int i=0; i<size; i++)
+            table[i] = operator()(low + i*step, gaussian);
+    }
+
+    float calibrate(float score, bool gaussian) const
+    {
+        const float x = (score - low) / step;
+        if (table.isEmpty() || !(x >= 0) || (x >= table.size()-1))
+            return operator()(score, gaussian); // Outside the tabulated range
+        const int i = int(x);
+        return table[i] + (table[i+1]-table[i])*(x-i);
+    }
+
+private:
+    QVector<float> table;
+    float low, step;
 };
 
 QDataStream &operator<<(QDataStream &stream, const MP &nmp)
@@ -148,8 +289,10 @@ class MatchProbabilityDistance : public Distance
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool gaussian READ get_gaussian WRITE set_gaussian RESET reset_gaussian STORED false)
+    Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
     BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
     BR_PROPERTY(bool, gaussian, true)
+    BR_PROPERTY(int, bins, 4096)
 
     MP mp;
 
@@ -159,6 +302,7 @@ class MatchProbabilityDistance : public Distance
 
         const QList<int> labels = src.labels<int>();
         QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(src.size()), FileList(src.size())));
+        matrixOutput->setBlock(0, 0, distance->symmetric());
         distance->compare(src, src, matrixOutput.data());
 
         QList<float> genuineScores, impostorScores;
@@ -174,13 +318,22 @@ class MatchProbabilityDistance : public Distance
         }
 
         mp = MP(genuineScores, impostorScores);
+        mp.compile(gaussian, bins);
     }
 
     float compare(const Template &target, const Template &query) const
     {
         float rawScore = distance->compare(target, query);
         if (rawScore == -std::numeric_limits<float>::max()) return rawScore;
-        return mp(rawScore, gaussian);
+        return mp.calibrate(rawScore, gaussian);
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        distance->compareBatch(targets, query, scores, offset, count);
+        for (int i=0; i<count; i++)
+            if (scores[i] != -std::numeric_limits<float>::max())
+                scores[i] = mp.calibrate(scores[i], gaussian);
     }
 
     void store(QDataStream &stream) const
@@ -193,6 +346,12 @@ class MatchProbabilityDistance : public Distance
     {
         distance->load(stream);
         stream >> mp;
+        mp.compile(gaussian, bins);
+    }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
     }
 };
 
@@ -218,6 +377,7 @@ class UnitDistance : public Distance
         const TemplateList samples = templates.mid(0, 2000);
         const QList<float> sampleLabels = samples.labels<float>();
         QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(samples.size()), FileList(samples.size())));
+        matrixOutput->setBlock(0, 0, distance->symmetric());
         Distance::compare(samples, samples, matrixOutput.data());
 
         double genuineAccumulator, impostorAccumulator;
@@ -255,10 +415,164 @@ class UnitDistance : public Distance
     {
         return a * (distance->compare(target, query) - b);
     }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        distance->compareBatch(targets, query, scores, offset, count);
+        for (int i=0; i<count; i++)
+            scores[i] = a * (scores[i] - b);
+    }
+
+    void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+    {
+        // Map the bounds back through the normalization, which reverses their order when a < 0
+        const float max = std::numeric_limits<float>::max();
+        if (a == 0) return compareBatch(targets, query, scores, offset, count);
+        float rawLower = (lower == -max) ? -max : lower/a + b;
+        float rawUpper = (upper ==  max) ?  max : upper/a + b;
+        if (a < 0) {
+            std::swap(rawLower, rawUpper);
+            if (rawLower ==  max) rawLower = -max;
+            if (rawUpper == -max) rawUpper =  max;
+        }
+
+        distance->compareBatchBounded(targets, query, scores, offset, count, rawLower, rawUpper);
+        for (int i=0; i<count; i++)
+            scores[i] = a * (scores[i] - b);
+    }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
 };
 
 BR_REGISTER(Distance, UnitDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Cohort score normalization of a distance, using the statistics stored by br::CohortTransform.
+ * \author Josh Klontz \cite jklontz
+ *
+ * \em method \c Z normalizes each score by the target's \c Cohort_Mean and \c Cohort_StdDev, \c T by the query's,
+ * and \c ZT averages the two, which is symmetric.
+ * Both sides computed their statistics once as they were enrolled, so comparing costs no extra comparisons.
+ * Templates without statistics are left unnormalized.
+ * Comparing template lists reads each target's statistics once rather than for every query.
+ */
+class CohortNormDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Method)
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance)
+    Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+
+public:
+    /*!< */
+    enum Method { Z,
+                  T,
+                  ZT };
+
+private:
+    BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
+    BR_PROPERTY(Method, method, ZT)
+
+    // score' = weight*(score - mean)/stddev, the weight is 1/2 for each side of ZT
+    struct Norm
+    {
+        float mean, scale;
+        Norm() : mean(0), scale(0) {}
+        Norm(const File &file, bool used, float weight) : mean(0), scale(0)
+        {
+            if (!used) return;
+            const float stddev = file.get<float>("Cohort_StdDev", 0);
+            if (!file.contains("Cohort_Mean") || !(stddev > 0)) {
+                scale = weight;
+                return;
+            }
+            mean = file.get<float>("Cohort_Mean");
+            scale = weight / stddev;
+        }
+        float operator()(float score) const { return scale * (score - mean); }
+    };
+
+    float weight() const
+    {
+        return (method == ZT) ? 0.5f : 1.0f;
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    static void normalize(float *scores, int count, const Norm *targets, const Norm &query)
+    {
+        for (int i=0; i<count; i++)
+            if (scores[i] != -std::numeric_limits<float>::max())
+                scores[i] = targets[i](scores[i]) + query(scores[i]);
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        float score = distance->compare(target, query);
+        const Norm t(target.file, method != T, weight());
+        normalize(&score, 1, &t, Norm(query.file, method != Z, weight()));
+        return score;
+    }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        distance->compareBatch(targets, query, scores, offset, count);
+        QVector<Norm> norms(count);
+        for (int i=0; i<count; i++)
+            norms[i] = Norm(targets[offset+i].file, method != T, weight());
+        normalize(scores, count, norms.data(), Norm(query.file, method != Z, weight()));
+    }
+
+    void compare(const TemplateList &targets, const TemplateList &queries, Output *output) const
+    {
+        // Compressed targets are only decoded a tile at a time
+        if (targets.packedData) {
+            Distance::compare(targets, queries, output);
+            return;
+        }
+
+        QVector<Norm> norms(targets.size());
+        for (int i=0; i<targets.size(); i++)
+            norms[i] = Norm(targets[i].file, method != T, weight());
+
+        // Scores left of the diagonal of a mirrored self-comparison are filled in from the scores right of it
+        const bool triangular = output->triangular() && (targets.size() == queries.size());
+
+        TaskGroup tasks;
+        for (int i=0; i<queries.size(); i++) {
+            const int begin = triangular ? i : 0;
+            if (Globals->parallelism) tasks.run(this, &CohortNormDistance::search, targets, queries[i], i, begin, &norms, output);
+            else                                                       search(targets, queries[i], i, begin, &norms, output);
+        }
+        tasks.wait();
+    }
+
+    // Scores the query against the targets from begin on
+    void search(const TemplateList &targets, const Template &query, int row, int begin, const QVector<Norm> *norms, Output *output) const
+    {
+        const int count = targets.size() - begin;
+        if (count <= 0) return;
+        QVector<float> scores(count);
+        distance->compareBatch(targets, query, scores.data(), begin, count);
+        normalize(scores.data(), count, norms->data() + begin, Norm(query.file, method != Z, weight()));
+        output->setRelative(scores.data(), row, begin, count);
+    }
+
+    bool symmetric() const
+    {
+        return (method == ZT) && distance->symmetric();
+    }
+};
+
+BR_REGISTER(Distance, CohortNormDistance)
+
 } // namespace br
 
 #include "quality.moc"
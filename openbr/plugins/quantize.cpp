@@ -14,12 +14,13 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QFutureSynchronizer>
-#include <QtConcurrentRun>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/common.h"
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/kmeans.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 
 using namespace cv;
 
@@ -30,35 +31,180 @@ namespace br
  * \ingroup transforms
  * \brief Approximate floats as uchar.
  * \author Josh Klontz \cite jklontz
+ *
+ * If \em normalize is \c true the input is first scaled to unit L1 norm, giving the same result as Normalize(L1)+Quantize without a floating point intermediate.
+ * If \em pack is \c true the high nibbles of consecutive pairs are packed into one byte as Pack does, compare the result with br::HalfByteL1Distance.
  */
 class QuantizeTransform : public Transform
 {
     Q_OBJECT
     Q_PROPERTY(float a READ get_a WRITE set_a RESET reset_a)
     Q_PROPERTY(float b READ get_b WRITE set_b RESET reset_b)
+    Q_PROPERTY(bool normalize READ get_normalize WRITE set_normalize RESET reset_normalize STORED false)
+    Q_PROPERTY(bool pack READ get_pack WRITE set_pack RESET reset_pack STORED false)
     BR_PROPERTY(float, a, 1)
     BR_PROPERTY(float, b, 0)
+    BR_PROPERTY(bool, normalize, false)
+    BR_PROPERTY(bool, pack, false)
+
+    // The scale cv::normalize() applies for unit L1 norm
+    static float l1Scale(const Mat &m)
+    {
+        const double l1 = norm(m, NORM_L1);
+        return l1 > DBL_EPSILON ? 1/l1 : 0;
+    }
 
     void train(const TemplateList &data)
     {
         double minVal, maxVal;
-        minMaxLoc(OpenCVUtils::toMat(data.data()), &minVal, &maxVal);
+        if (normalize) {
+            minVal = std::numeric_limits<double>::max();
+            maxVal = -std::numeric_limits<double>::max();
+            foreach (const Template &t, data) {
+                double tMin, tMax;
+                minMaxLoc(t.m(), &tMin, &tMax);
+                const float scale = l1Scale(t);
+                minVal = std::min(minVal, double(float(tMin) * scale));
+                maxVal = std::max(maxVal, double(float(tMax) * scale));
+            }
+        } else {
+            minMaxLoc(OpenCVUtils::toMat(data.data()), &minVal, &maxVal);
+        }
         a = 255.0/(maxVal-minVal);
         b = -a*minVal;
     }
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_8U, a, b);
+        if (!normalize && !pack) {
+            src.m().convertTo(dst, CV_8U, a, b);
+            return;
+        }
+
+        const Mat &m = src;
+        if ((m.type() != CV_32FC1) || !m.isContinuous()) qFatal("Requires continuous single channel 32-bit floating point matrices.");
+        const int size = m.total();
+        if (pack && (size % 2 != 0)) qFatal("Packing requires an even number of elements.");
+
+        // Same float arithmetic as the separate convertTo() calls
+        const float scale = normalize ? l1Scale(m) : 1;
+        const float *in = m.ptr<float>();
+        Mat n(1, pack ? size/2 : size, CV_8UC1);
+        uchar *out = n.ptr<uchar>();
+        if (pack) {
+            for (int i=0; i<size/2; i++)
+                out[i] = (saturate_cast<uchar>((in[2*i+0]*scale)*a + b) & 0xF0) |
+                         (saturate_cast<uchar>((in[2*i+1]*scale)*a + b) >> 4);
+        } else {
+            for (int i=0; i<size; i++)
+                out[i] = saturate_cast<uchar>((in[i]*scale)*a + b);
+        }
+        dst = pack ? n : n.reshape(1, m.rows);
     }
 };
 
 BR_REGISTER(Transform, QuantizeTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Approximate floats as IEEE 754 half precision.
+ * \author Josh Klontz \cite jklontz
+ *
+ * OpenCV has no 16-bit float type, so the half bits are stored as CV_16UC1.
+ * Compare the result with br::HalfDistance.
+ */
+class HalfTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m = src.m().reshape(1, src.m().rows);
+        if (m.type() != CV_32FC1) qFatal("Requires single channel 32-bit floating point matrices.");
+        Mat n(m.rows, m.cols, CV_16UC1);
+        for (int i=0; i<m.rows; i++) {
+            const float *in = m.ptr<float>(i);
+            quint16 *out = n.ptr<quint16>(i);
+            for (int j=0; j<m.cols; j++)
+                out[j] = toHalf(in[j]);
+        }
+        dst = n;
+    }
+};
+
+BR_REGISTER(Transform, HalfTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Approximate floats as symmetrically scaled signed bytes.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Training records the largest magnitude of the data and maps it to 127.
+ * Since zero is preserved and every dimension shares one scale, distances and dot products of the result are proportional to those of the input.
+ * Compare the result with br::Int8Distance.
+ * Set \em perDimension to scale each dimension by its own largest magnitude instead,
+ * which keeps more precision in small dimensions but weights them differently from the input, so br::Int8Distance scores no longer match.
+ */
+class QuantizeInt8Transform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(bool perDimension READ get_perDimension WRITE set_perDimension RESET reset_perDimension STORED false)
+    BR_PROPERTY(bool, perDimension, false)
+
+    Mat scales;
+
+    void train(const TemplateList &data)
+    {
+        Mat m = OpenCVUtils::toMat(data.data());
+        if (m.type() != CV_32FC1) qFatal("Requires single channel 32-bit floating point matrices.");
+        Mat magnitudes;
+        reduce(abs(m), magnitudes, 0, CV_REDUCE_MAX);
+        if (!perDimension) {
+            double maxVal;
+            minMaxLoc(magnitudes, NULL, &maxVal);
+            magnitudes = Scalar(maxVal);
+        }
+
+        scales = Mat(1, m.cols, CV_32FC1);
+        for (int j=0; j<m.cols; j++) {
+            const float magnitude = magnitudes.at<float>(0,j);
+            scales.at<float>(0,j) = magnitude > 0 ? 127/magnitude : 1;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m = src.m().reshape(1, 1);
+        if (m.type() != CV_32FC1) qFatal("Requires single channel 32-bit floating point matrices.");
+        if (m.cols != scales.cols) qFatal("Expected %d dimensions, got %d.", scales.cols, m.cols);
+        Mat n(1, m.cols, CV_8SC1);
+        const float *in = m.ptr<float>();
+        const float *scale = scales.ptr<float>();
+        qint8 *out = n.ptr<qint8>();
+        for (int j=0; j<m.cols; j++)
+            out[j] = saturate_cast<schar>(in[j] * scale[j]);
+        dst = n;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << scales;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> scales;
+    }
+};
+
+BR_REGISTER(Transform, QuantizeInt8Transform)
+
 /*!
  * \ingroup transforms
  * \brief Approximate floats as signed bit.
  * \author Josh Klontz \cite jklontz
+ *
+ * Eight signs are packed per byte, compare the resulting codes with br::HammingDistance.
  */
 class BinarizeTransform : public UntrainableTransform
 {
@@ -72,14 +218,14 @@ class BinarizeTransform : public UntrainableTransform
         Mat n(m.rows, m.cols/8, CV_8UC1);
         for (int i=0; i<m.rows; i++)
             for (int j=0; j<m.cols-7; j+=8)
-                n.at<uchar>(i,j) = ((m.at<float>(i,j+0) > 0) << 0) +
-                                   ((m.at<float>(i,j+1) > 0) << 1) +
-                                   ((m.at<float>(i,j+2) > 0) << 2) +
-                                   ((m.at<float>(i,j+3) > 0) << 3) +
-                                   ((m.at<float>(i,j+4) > 0) << 4) +
-                                   ((m.at<float>(i,j+5) > 0) << 5) +
-                                   ((m.at<float>(i,j+6) > 0) << 6) +
-                                   ((m.at<float>(i,j+7) > 0) << 7);
+                n.at<uchar>(i,j/8) = ((m.at<float>(i,j+0) > 0) << 0) +
+                                     ((m.at<float>(i,j+1) > 0) << 1) +
+                                     ((m.at<float>(i,j+2) > 0) << 2) +
+                                     ((m.at<float>(i,j+3) > 0) << 3) +
+                                     ((m.at<float>(i,j+4) > 0) << 4) +
+                                     ((m.at<float>(i,j+5) > 0) << 5) +
+                                     ((m.at<float>(i,j+6) > 0) << 6) +
+                                     ((m.at<float>(i,j+7) > 0) << 7);
         dst = n;
     }
 };
@@ -102,10 +248,12 @@ class PackTransform : public UntrainableTransform
             qFatal("Invalid template format.");
 
         Mat n(m.rows, m.cols/2, CV_8UC1);
-        for (int i=0; i<m.rows; i++)
-            for (int j=0; j<m.cols/2; j++)
-                n.at<uchar>(i,j) = ((m.at<uchar>(i,2*j+0) >> 4) << 4) +
-                                   ((m.at<uchar>(i,2*j+1) >> 4) << 0);
+        for (int i=0; i<m.rows; i++) {
+            const uchar *in = m.ptr<uchar>(i);
+            uchar *out = n.ptr<uchar>(i);
+            for (int j=0; j<n.cols; j++)
+                out[j] = (in[2*j+0] & 0xF0) | (in[2*j+1] >> 4);
+        }
         dst = n;
     }
 };
@@ -139,14 +287,146 @@ class ProductQuantizationDistance : public Distance
         if (!bayesian) distance = -log(distance+1);
         return distance;
     }
+
+    void compareBatch(const TemplateList &targets, const Template &query, float *scores, int offset, int count) const
+    {
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if (data == NULL) return Distance::compareBatch(targets, query, scores, offset, count);
+
+        const int elements = query.m().total();
+        const uchar *queryData = query.m().data;
+        const float *lut = (const float*)ProductQuantizationLUTs[0].data;
+        if (count < MinTableTargets) {
+            for (int i=0; i<count; i++) {
+                const uchar *targetData = data + i*stride;
+                float distance = 0;
+                for (int j=0; j<elements; j++)
+                    distance += lut[j*256*256 + targetData[j]*256+queryData[j]];
+                scores[i] = bayesian ? distance : -log(distance+1);
+            }
+            return;
+        }
+
+        // The query selects one column of each 256x256 subspace LUT, gathering them keeps the scan within 1 KB per subspace
+        QVector<float> table(elements*256);
+        for (int j=0; j<elements; j++)
+            for (int k=0; k<256; k++)
+                table[j*256+k] = lut[j*256*256 + k*256+queryData[j]];
+
+        switch (elements) {
+#define BR_SCAN(SIZE) case SIZE: scan<SIZE>(table.data(), data, stride, count, SIZE, scores); break;
+          BR_SPECIALIZED_SIZES(BR_SCAN)
+#undef BR_SCAN
+          default: scan<0>(table.data(), data, stride, count, elements, scores);
+        }
+    }
+
+    void compareBatchBounded(const TemplateList &targets, const Template &query, float *scores, int offset, int count, float lower, float upper) const
+    {
+        // Bayesian scores sum log likelihood ratios of either sign, so they can't be bounded by a partial sum
+        (void) upper;
+        size_t stride;
+        const uchar *data = contiguousData(targets, query, offset, &stride);
+        if ((data == NULL) || bayesian || (lower == -std::numeric_limits<float>::max()) || (count < MinTableTargets))
+            return compareBatch(targets, query, scores, offset, count);
+
+        const int elements = query.m().total();
+        const uchar *queryData = query.m().data;
+        const float *lut = (const float*)ProductQuantizationLUTs[0].data;
+        QVector<float> table(elements*256);
+        for (int j=0; j<elements; j++)
+            for (int k=0; k<256; k++)
+                table[j*256+k] = lut[j*256*256 + k*256+queryData[j]];
+
+        // -log(distance+1) >= lower exactly when distance <= exp(-lower)-1
+        const float bound = exp(-double(lower)) - 1;
+        for (int i=0; i<count; i++) {
+            const uchar *targetData = data + i*stride;
+            float distance = 0;
+            for (int j=0; j<elements; j+=BoundedSubspaces) {
+                const int end = std::min(elements, j+int(BoundedSubspaces));
+                for (int k=j; k<end; k++)
+                    distance += table[k*256 + targetData[k]];
+                if (distance > bound) break;
+            }
+            scores[i] = -log(distance+1);
+        }
+    }
+
+    // Scores targets against the gathered table, Elements is the template size if fixed at compile time or 0
+    template <int Elements>
+    void scan(const float *t, const uchar *data, size_t stride, int count, int elements, float *scores) const
+    {
+        const int n = Elements ? Elements : elements;
+
+        // Interleave targets so the independent table lookups overlap
+        int i = 0;
+        for (; i+4<=count; i+=4) {
+            const uchar *t0 = data + (i+0)*stride, *t1 = data + (i+1)*stride,
+                        *t2 = data + (i+2)*stride, *t3 = data + (i+3)*stride;
+            float d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+            for (int j=0; j<n; j++) {
+                const float *subspace = t + j*256;
+                d0 += subspace[t0[j]];
+                d1 += subspace[t1[j]];
+                d2 += subspace[t2[j]];
+                d3 += subspace[t3[j]];
+            }
+            scores[i+0] = bayesian ? d0 : -log(d0+1);
+            scores[i+1] = bayesian ? d1 : -log(d1+1);
+            scores[i+2] = bayesian ? d2 : -log(d2+1);
+            scores[i+3] = bayesian ? d3 : -log(d3+1);
+        }
+        for (; i<count; i++) {
+            const uchar *targetData = data + i*stride;
+            float distance = 0;
+            for (int j=0; j<n; j++)
+                distance += t[j*256 + targetData[j]];
+            scores[i] = bayesian ? distance : -log(distance+1);
+        }
+    }
+
+    // Below this many targets gathering the query's table doesn't pay for itself
+    enum { MinTableTargets = 64 };
+
+    // Subspaces summed between checks of a bounded comparison's cutoff
+    enum { BoundedSubspaces = 16 };
 };
 
 BR_REGISTER(Distance, ProductQuantizationDistance)
 
+/*!
+ * \brief A uniform random sample of at most \em capacity of the values offered to it.
+ */
+struct Reservoir
+{
+    QVector<float> values;
+    int capacity;
+    qint64 offered;
+    RNG rng;
+
+    explicit Reservoir(int capacity) : capacity(capacity), offered(0), rng(capacity) { values.reserve(capacity); }
+
+    void offer(float value)
+    {
+        if (values.size() < capacity) {
+            values.append(value);
+        } else {
+            const qint64 index = qint64(rng.uniform(0., 1.) * (offered+1));
+            if (index < capacity) values[index] = value;
+        }
+        offered++;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Product quantization \cite jegou11
  * \author Josh Klontz \cite jklontz
+ *
+ * Codebooks for large training sets are learned with mini-batch k-means, see br::KMeans().
+ * Bayesian score distributions are estimated from at most 65536 sampled genuine and impostor pairs each.
  */
 class ProductQuantizationTransform : public Transform
 {
@@ -169,10 +449,14 @@ public:
     }
 
 private:
+    enum { Max_Scores = 1 << 16,
+           Max_Bins = 1 << 12 };
+    static const double Min_Density; // Of the peak density, scores beyond the sampled ones are floored to it so their log ratio stays finite
+
     void _train(const Mat &data, const QList<int> &labels, Mat *lut, Mat *center)
     {
         Mat clusterLabels;
-        kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
+        KMeans(data, 256, clusterLabels, *center);
 
         for (int j=0; j<256; j++)
             for (int k=0; k<256; k++)
@@ -181,24 +465,51 @@ private:
         if (!bayesian) return;
 
         QList<int> indicies = OpenCVUtils::matrixToVector<int>(clusterLabels);
-        QVector<float> genuineScores; genuineScores.reserve(data.rows);
-        QVector<float> impostorScores; impostorScores.reserve(data.rows*data.rows/2);
-        for (int i=0; i<indicies.size(); i++)
-            for (int j=i+1; j<indicies.size(); j++) {
-                const float score = lut->at<float>(0, indicies[i]*256+indicies[j]);
-                if (labels[i] == labels[j]) genuineScores.append(score);
-                else                        impostorScores.append(score);
+        const int n = indicies.size();
+        Reservoir genuine(Max_Scores), impostor(Max_Scores);
+        if (qint64(n)*(n-1)/2 <= Max_Scores) {
+            // Every pair fits
+            for (int i=0; i<n; i++)
+                for (int j=i+1; j<n; j++) {
+                    const float score = lut->at<float>(0, indicies[i]*256+indicies[j]);
+                    if (labels[i] == labels[j]) genuine.offer(score);
+                    else                        impostor.offer(score);
+                }
+        } else {
+            // Enumerate genuine pairs within each label, draw impostor pairs at random
+            QHash<int, QList<int> > members;
+            for (int i=0; i<n; i++)
+                members[labels[i]].append(i);
+            foreach (const QList<int> &label, members)
+                for (int i=0; i<label.size(); i++)
+                    for (int j=i+1; j<label.size(); j++)
+                        genuine.offer(lut->at<float>(0, indicies[label[i]]*256+indicies[label[j]]));
+
+            RNG rng(n);
+            for (int attempt=0; (impostor.values.size() < Max_Scores) && (attempt < 16*Max_Scores); attempt++) {
+                const int i = rng.uniform(0, n), j = rng.uniform(0, n);
+                if (labels[i] != labels[j])
+                    impostor.offer(lut->at<float>(0, indicies[i]*256+indicies[j]));
             }
-        genuineScores = Common::Downsample(genuineScores, 256);
-        impostorScores = Common::Downsample(impostorScores, 256);
-
-        double hGenuine = Common::KernelDensityBandwidth(genuineScores);
-        double hImpostor = Common::KernelDensityBandwidth(impostorScores);
+        }
+        // Every table entry lies within the range of the table, so tabulate both densities over it and interpolate
+        double low, high;
+        minMaxLoc(*lut, &low, &high);
+        const QVector<double> genuineDensity = Common::KernelDensityEstimation(genuine.values, low, high, Max_Bins, Common::KernelDensityBandwidth(genuine.values));
+        const QVector<double> impostorDensity = Common::KernelDensityEstimation(impostor.values, low, high, Max_Bins, Common::KernelDensityBandwidth(impostor.values));
+
+        // The binned estimate is exactly zero away from the samples
+        double peak = 0;
+        for (int i=0; i<Max_Bins; i++)
+            peak = std::max(peak, std::max(genuineDensity[i], impostorDensity[i]));
+        const double floor = (peak > 0) ? Min_Density * peak : 1;
 
         for (int j=0; j<256; j++)
-            for (int k=0; k<256; k++)
-                lut->at<float>(0,j*256+k) = log(Common::KernelDensityEstimation(genuineScores, lut->at<float>(0,j*256+k), hGenuine) /
-                                                Common::KernelDensityEstimation(impostorScores, lut->at<float>(0,j*256+k), hImpostor));
+            for (int k=0; k<256; k++) {
+                const float score = lut->at<float>(0,j*256+k);
+                lut->at<float>(0,j*256+k) = log(std::max(Common::Interpolate(genuineDensity, low, high, score), floor) /
+                                                std::max(Common::Interpolate(impostorDensity, low, high, score), floor));
+            }
     }
 
     void train(const TemplateList &src)
@@ -217,20 +528,25 @@ private:
             subluts.append(lut.row(i));
         }
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<lut.rows; i++) {
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i]));
-            else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
+            if (Globals->parallelism) tasks.run(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i]);
+            else                                                                     _train (subdata[i], labels, &subluts[i], &centers[i]);
         }
-        futures.waitForFinished();
+        tasks.wait();
     }
 
-    int getIndex(const Mat &m, const Mat &center) const
+    // Nearest of the 256 contiguous centers of dimensionality n
+    int getIndex(const float *m, const float *center) const
     {
         int bestIndex = 0;
-        double bestDistance = std::numeric_limits<double>::max();
+        float bestDistance = std::numeric_limits<float>::max();
         for (int j=0; j<256; j++) {
-            double distance = norm(m, center.row(j), NORM_L2);
+            float distance = 0;
+            for (int k=0; k<n; k++) {
+                const float delta = m[k] - center[j*n+k];
+                distance += delta * delta;
+            }
             if (distance < bestDistance) {
                 bestDistance = distance;
                 bestIndex = j;
@@ -242,9 +558,13 @@ private:
     void project(const Template &src, Template &dst) const
     {
         Mat m = src.m().reshape(1, 1);
+        if (m.type() != CV_32FC1) qFatal("Requires single channel 32-bit floating point matrices.");
+        if (!m.isContinuous()) m = m.clone();
+        const float *data = m.ptr<float>();
         dst = Mat(1, m.cols/n, CV_8UC1);
+        uchar *codes = dst.m().ptr();
         for (int i=0; i<dst.m().cols; i++)
-            dst.m().at<uchar>(0,i) = getIndex(m.colRange(i*n, (i+1)*n), centers[i]);
+            codes[i] = getIndex(data + i*n, centers[i].ptr<float>());
     }
 
     void store(QDataStream &stream) const
@@ -258,6 +578,8 @@ private:
     }
 };
 
+const double ProductQuantizationTransform::Min_Density = 1e-6;
+
 BR_REGISTER(Transform, ProductQuantizationTransform)
 
 } // namespace br
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
 
@@ -28,6 +29,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Generates a random subspace.
+ *
+ * Projection gathers the sampled elements straight from the source matrix, which may be a view such as a region.
  * \author Josh Klontz \cite jklontz
  */
 class RndSubspaceTransform : public Transform
@@ -39,6 +42,17 @@ class RndSubspaceTransform : public Transform
     BR_PROPERTY(bool, weighted, false)
 
     Mat map;
+    int minRows, minCols; // Smallest source the map can gather from
+
+    void init()
+    {
+        minRows = minCols = 0;
+        for (int j=0; j<map.cols; j++) {
+            const Vec2s &point = map.at<Vec2s>(0,j);
+            minCols = std::max(minCols, point[0]+1);
+            minRows = std::max(minRows, point[1]+1);
+        }
+    }
 
     void train(const TemplateList &data)
     {
@@ -71,11 +85,37 @@ class RndSubspaceTransform : public Transform
         mv.push_back(yMap);
 
         merge(mv, map);
+        init();
+    }
+
+    template <typename T>
+    void gather(const Mat &src, Mat &dst) const
+    {
+        T *out = dst.ptr<T>();
+        for (int j=0; j<map.cols; j++) {
+            const Vec2s &point = map.at<Vec2s>(0,j);
+            out[j] = src.ptr<T>(point[1])[point[0]];
+        }
     }
 
     void project(const Template &src, Template &dst) const
     {
-        remap(src, dst, map, Mat(), INTER_NEAREST);
+        // The same elements remap() with INTER_NEAREST would read, without building float coordinate maps
+        const Mat &m = src.m();
+        if ((m.rows < minRows) || (m.cols < minCols)) qFatal("Matrix is smaller than the trained subspace.");
+        Mat &out = MatArena::output(dst);
+        out.create(1, map.cols, m.type());
+        switch (m.elemSize()) {
+          case 1:  gather<uchar>(m, out); break;
+          case 2:  gather<ushort>(m, out); break;
+          case 4:  gather<int>(m, out); break;
+          case 8:  gather<double>(m, out); break;
+          default:
+            for (int j=0; j<map.cols; j++) {
+                const Vec2s &point = map.at<Vec2s>(0,j);
+                memcpy(out.ptr(0, j), m.ptr(point[1], point[0]), m.elemSize());
+            }
+        }
     }
 
     void store(QDataStream &stream) const
@@ -86,6 +126,7 @@ class RndSubspaceTransform : public Transform
     void load(QDataStream &stream)
     {
         stream >> fraction >> weighted >> map;
+        init();
     }
 };
 
@@ -68,6 +68,11 @@ class AndTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
 
+    int tileHalo() const
+    {
+        return 0;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
@@ -17,6 +17,8 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
+
 using namespace cv;
 
 namespace br
@@ -90,12 +92,22 @@ class CatTransform : public UntrainableMetaTransform
 
         if (src.size() % partitions != 0)
             qFatal("%d partitions does not evenly divide %d matrices.", partitions, src.size());
+
+        // A lone continuous floating point matrix is already its own concatenation
+        if ((partitions == 1) && (src.size() == 1) && src.first().isContinuous() && (src.first().depth() == CV_32F)) {
+            dst.append(src.first().reshape(1, 1));
+            return;
+        }
+
         QVector<int> sizes(partitions, 0);
         for (int i=0; i<src.size(); i++)
             sizes[i%partitions] += src[i].total() * src[i].channels();
 
-        foreach (int size, sizes)
-            dst.append(Mat(1, size, CV_32FC1));
+        foreach (int size, sizes) {
+            Mat m;
+            MatArena::output(m).create(1, size, CV_32FC1);
+            dst.append(m);
+        }
 
         QVector<int> offsets(partitions, 0);
         for (int i=0; i<src.size(); i++) {
@@ -143,8 +155,10 @@ class DupTransform : public UntrainableMetaTransform
 
     void project(const Template &src, Template &dst) const
     {
+        // Copies share the source matrices, merging the file with itself would leave it unchanged
+        dst.file = src.file;
         for (int i=0; i<n; i++)
-            dst.merge(src);
+            dst.append(src);
     }
 };
 
@@ -17,7 +17,9 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
 
 using namespace cv;
 
@@ -27,6 +29,10 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Performs a two or three point registration.
+ *
+ * Set \c gray to convert color crops to grayscale, as a following <tt>Cvt(Gray)</tt> would, without a full color output.
+ * Set \c batch to write a list of templates' crops into rows of one contiguous block,
+ * which batched projections such as PCATransform read without copying.
  * \author Josh Klontz \cite jklontz
  */
 class AffineTransform : public UntrainableTransform
@@ -40,6 +46,8 @@ class AffineTransform : public UntrainableTransform
     Q_PROPERTY(float y2 READ get_y2 WRITE set_y2 RESET reset_y2 STORED false)
     Q_PROPERTY(float x3 READ get_x3 WRITE set_x3 RESET reset_x3 STORED false)
     Q_PROPERTY(float y3 READ get_y3 WRITE set_y3 RESET reset_y3 STORED false)
+    Q_PROPERTY(bool gray READ get_gray WRITE set_gray RESET reset_gray STORED false)
+    Q_PROPERTY(bool batch READ get_batch WRITE set_batch RESET reset_batch STORED false)
     BR_PROPERTY(int, width, 64)
     BR_PROPERTY(int, height, 64)
     BR_PROPERTY(float, x1, 0)
@@ -48,6 +56,11 @@ class AffineTransform : public UntrainableTransform
     BR_PROPERTY(float, y2, -1)
     BR_PROPERTY(float, x3, -1)
     BR_PROPERTY(float, y3, -1)
+    BR_PROPERTY(bool, gray, false)
+    BR_PROPERTY(bool, batch, false)
+
+    bool twoPoints;
+    Point2f dstPoints[3];
 
     static Point2f getThirdAffinePoint(const Point2f &a, const Point2f &b)
     {
@@ -56,28 +69,42 @@ class AffineTransform : public UntrainableTransform
         return Point2f(a.x - dy, a.y + dx);
     }
 
-    void project(const Template &src, Template &dst) const
+    void init()
     {
-        const bool twoPoints = ((x3 == -1) || (y3 == -1));
-
-        Point2f dstPoints[3];
+        twoPoints = ((x3 == -1) || (y3 == -1));
         dstPoints[0] = Point2f(x1*width, y1*height);
         dstPoints[1] = Point2f((x2 == -1 ? 1 - x1 : x2)*width, (y2 == -1 ? y1 : y2)*height);
         if (twoPoints) dstPoints[2] = getThirdAffinePoint(dstPoints[0], dstPoints[1]);
         else           dstPoints[2] = Point2f(x3*width, y3*height);
+    }
 
+    int outputType(int type) const
+    {
+        return (gray && (CV_MAT_CN(type) == 3)) ? CV_MAKETYPE(CV_MAT_DEPTH(type), 1) : type;
+    }
+
+    // Writes into dst.m(), which is reused when it already has the output size and type
+    void warp(const Template &src, Template &dst) const
+    {
         Point2f srcPoints[3];
-        if (src.file.contains("Affine_0") &&
-            src.file.contains("Affine_1") &&
-            (src.file.contains("Affine_2") || twoPoints)) {
-            srcPoints[0] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_0"));
-            srcPoints[1] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_1"));
-            if (!twoPoints) srcPoints[2] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_2"));
+        const QMap<QString,QVariant> metadata = src.file.localMetadata();
+        const QMap<QString,QVariant>::const_iterator affine0 = metadata.constFind("Affine_0");
+        const QMap<QString,QVariant>::const_iterator affine1 = metadata.constFind("Affine_1");
+        const QMap<QString,QVariant>::const_iterator affine2 = metadata.constFind("Affine_2");
+        const QMap<QString,QVariant>::const_iterator end = metadata.constEnd();
+
+        Mat color;
+        Mat &out = (outputType(src.m().type()) != src.m().type()) ? MatArena::output(color) : MatArena::output(dst);
+        if ((affine0 != end) && (affine1 != end) && ((affine2 != end) || twoPoints)) {
+            srcPoints[0] = OpenCVUtils::toPoint(affine0.value().toPointF());
+            srcPoints[1] = OpenCVUtils::toPoint(affine1.value().toPointF());
+            if (!twoPoints) srcPoints[2] = OpenCVUtils::toPoint(affine2.value().toPointF());
         } else {
             const QList<Point2f> landmarks = OpenCVUtils::toPoints(src.file.points());
 
             if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3))) {
-                resize(src, dst, Size(width, height));
+                resize(src, out, Size(width, height));
+                if (!color.empty()) cvtColor(color, MatArena::output(dst), CV_BGR2GRAY);
                 return;
             } else {
                 srcPoints[0] = landmarks[0];
@@ -91,7 +118,52 @@ class AffineTransform : public UntrainableTransform
         }
         if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
 
-        warpAffine(src, dst, getAffineTransform(srcPoints, dstPoints), Size(width, height));
+        warpAffine(src, out, getAffineTransform(srcPoints, dstPoints), Size(width, height));
+        if (!color.empty()) cvtColor(color, MatArena::output(dst), CV_BGR2GRAY);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        warp(src, dst);
+    }
+
+    static void _warp(const AffineTransform *transform, const Template *src, Template *dst)
+    {
+        try {
+            transform->warp(*src, *dst);
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(src->file.flat()), qPrintable(transform->objectName()));
+            *dst = Template(src->file);
+            dst->file.set("FTE", true);
+        }
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        bool uniform = batch && !src.isEmpty();
+        foreach (const Template &t, src)
+            if (t.isEmpty() || (t.m().type() != src.first().m().type()))
+                uniform = false;
+        if (!uniform) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        // Each crop is warped in place into its row of the block
+        const int type = outputType(src.first().m().type());
+        Mat block;
+        MatArena::output(block).create(src.size(), width*height*CV_MAT_CN(type), CV_MAT_DEPTH(type));
+        TemplateList warped;
+        for (int i=0; i<src.size(); i++)
+            warped.append(Template(src[i].file, block.row(i).reshape(CV_MAT_CN(type), height)));
+
+        TaskGroup tasks;
+        for (int i=0; i<src.size(); i++) {
+            if (Globals->parallelism) tasks.run(&_warp, this, &src[i], &warped[i]);
+            else                      _warp(this, &src[i], &warped[i]);
+        }
+        tasks.wait();
+        dst.append(warped);
     }
 };
 
@@ -1,11 +1,78 @@
+#include <QVarLengthArray>
 #include <stdint.h>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/distance_sse.h"
+
 using namespace cv;
 
 namespace br
 {
 
+/*!
+ * \brief Serialized layout shared by SentenceTransform and SentenceSimilarityDistance.
+ *
+ * A sentence is a header followed by word-sorted structure-of-arrays columns and float blocks padded to 16 bytes:
+ * <tt>[Magic, count, words[count], rows[count], cols[count], offsets[count], pad, data...]</tt>.
+ * Sentences in the original <tt>[word, rows, cols, floats...]</tt> record layout are still read.
+ */
+struct Sentence
+{
+    enum { Magic = -1, Alignment = 16 };
+
+    struct Word
+    {
+        int32_t word, rows, cols;
+        const float *data;
+    };
+
+    QVarLengthArray<Word, 32> words;
+
+    Sentence(const Mat &m)
+    {
+        const uchar *buffer = m.data;
+        const uchar *end = buffer + m.total();
+        if (buffer == end) return;
+
+        if (read(buffer) == Magic) {
+            const int count = read(buffer + 4);
+            const uchar *columns = buffer + 8;
+            const uchar *data = buffer + align(8 + 16*count);
+            words.resize(count);
+            for (int i=0; i<count; i++) {
+                Word &w = words[i];
+                w.word = read(columns + 4*i);
+                w.rows = read(columns + 4*(count+i));
+                w.cols = read(columns + 4*(2*count+i));
+                w.data = reinterpret_cast<const float*>(data) + read(columns + 4*(3*count+i));
+            }
+        } else {
+            // Original record layout
+            while (buffer < end) {
+                Word w;
+                w.word = read(buffer);
+                w.rows = read(buffer+4);
+                w.cols = read(buffer+8);
+                w.data = reinterpret_cast<const float*>(buffer+12);
+                words.append(w);
+                buffer += 12 + 4*w.rows*w.cols;
+            }
+        }
+    }
+
+    static inline int32_t read(const uchar *buffer)
+    {
+        int32_t value;
+        memcpy(&value, buffer, 4);
+        return value;
+    }
+
+    static inline int align(int bytes)
+    {
+        return (bytes + Alignment - 1) / Alignment * Alignment;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Ordered words
@@ -17,18 +84,38 @@ class SentenceTransform : public UntrainableMetaTransform
 
     void project(const Template &src, Template &dst) const
     {
-        QByteArray sentence;
-        QDataStream stream(&sentence, QIODevice::WriteOnly);
+        QVector<int32_t> words, rows, cols, offsets;
+        int floats = 0;
         for (int i=0; i<src.size(); i++) {
             const Mat &m = src[i];
             if (!m.data) continue;
-            stream.writeRawData((const char*)&i, 4);
-            stream.writeRawData((const char*)&m.rows, 4);
-            stream.writeRawData((const char*)&m.cols, 4);
-            stream.writeRawData((const char*)m.data, 4*m.rows*m.cols);
+            words.append(i);
+            rows.append(m.rows);
+            cols.append(m.cols);
+            offsets.append(floats);
+            floats += Sentence::align(4*m.rows*m.cols) / 4;
         }
+
+        const int count = words.size();
+        const int header = Sentence::align(8 + 16*count);
         dst.file = src.file;
-        dst.m() = Mat(1, sentence.size(), CV_8UC1, sentence.data()).clone();
+        dst.m() = Mat(1, header + 4*floats, CV_8UC1, Scalar(0));
+
+        int32_t *columns = reinterpret_cast<int32_t*>(dst.m().data);
+        columns[0] = Sentence::Magic;
+        columns[1] = count;
+        for (int i=0; i<count; i++) {
+            columns[2+i] = words[i];
+            columns[2+count+i] = rows[i];
+            columns[2+2*count+i] = cols[i];
+            columns[2+3*count+i] = offsets[i];
+        }
+
+        float *data = reinterpret_cast<float*>(dst.m().data + header);
+        for (int i=0; i<count; i++) {
+            const Mat m = src[words[i]].isContinuous() ? src[words[i]] : src[words[i]].clone();
+            memcpy(data + offsets[i], m.data, 4*rows[i]*cols[i]);
+        }
     }
 };
 
@@ -45,45 +132,42 @@ class SentenceSimilarityDistance : public Distance
 
     float compare(const Template &a, const Template &b) const
     {
-        uchar *aBuffer = a.m().data;
-        uchar *bBuffer = b.m().data;
-        const uchar *aEnd = aBuffer + a.m().cols;
-        const uchar *bEnd = bBuffer + b.m().cols;
-
-        int32_t aWord, bWord, aRows, bRows, aColumns, bColumns;
-        float *aData, *bData;
-        aWord = aRows = aColumns = -2;
-        bWord = bRows = bColumns = -1;
-        aData = bData = NULL;
+        const Sentence sa(a.m()), sb(b.m());
+        const int na = sa.words.size(), nb = sb.words.size();
 
+        // Merge the sorted word lists, stopping as soon as either runs out
         float distance = 0;
         int comparisons = 0;
+        int i = 0, j = 0;
+        if (i == na) return exhaustedA(distance, comparisons);
+        if (j == nb) return exhaustedB(distance, comparisons);
         while (true) {
-            if (aWord < bWord) {
-                if (aBuffer == aEnd) return distance == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
-                aWord = *reinterpret_cast<int32_t*>(aBuffer);
-                aRows = *reinterpret_cast<int32_t*>(aBuffer+4);
-                aColumns = *reinterpret_cast<int32_t*>(aBuffer+8);
-                aData = reinterpret_cast<float*>(aBuffer+12);
-                aBuffer += 12 + 4*aRows*aColumns;
-            } else if (bWord < aWord) {
-                if (bBuffer == bEnd) return comparisons == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
-                bWord = *reinterpret_cast<int32_t*>(bBuffer);
-                bRows = *reinterpret_cast<int32_t*>(bBuffer+4);
-                bColumns = *reinterpret_cast<int32_t*>(bBuffer+8);
-                bData = reinterpret_cast<float*>(bBuffer+12);
-                bBuffer += 12 + 4*bRows*bColumns;
+            const Sentence::Word &wa = sa.words[i];
+            const Sentence::Word &wb = sb.words[j];
+            if (wa.word < wb.word) {
+                if (++i == na) return exhaustedA(distance, comparisons);
+            } else if (wb.word < wa.word) {
+                if (++j == nb) return exhaustedB(distance, comparisons);
             } else {
-                for (int i=0; i<aRows; i++)
-                    for (int j=0; j<bRows; j++)
-                        for (int k=0; k<aColumns; k++)
-                            distance += pow(aData[i*aColumns+k] - bData[j*bColumns+k], 2.f);
-                comparisons += aRows * bRows * aColumns;
-                aWord = -2;
-                bWord = -1;
+                for (int r=0; r<wa.rows; r++)
+                    for (int s=0; s<wb.rows; s++)
+                        distance += squared_l2(wa.data + r*wa.cols, wb.data + s*wb.cols, wa.cols);
+                comparisons += wa.rows * wb.rows * wa.cols;
+                if (++i == na) return exhaustedA(distance, comparisons);
+                if (++j == nb) return exhaustedB(distance, comparisons);
             }
         }
     }
+
+    static float exhaustedA(float distance, int comparisons)
+    {
+        return distance == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
+    }
+
+    static float exhaustedB(float distance, int comparisons)
+    {
+        return comparisons == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
+    }
 };
 
 BR_REGISTER(Distance, SentenceSimilarityDistance)
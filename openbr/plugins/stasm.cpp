@@ -1,7 +1,11 @@
+#include <QLineF>
 #include <stasm_dll.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/opencvutils.h"
+
 using namespace cv;
 
 namespace br
@@ -32,25 +36,65 @@ BR_REGISTER(Initializer, StasmInitializer)
  * \ingroup transforms
  * \brief Wraps STASM key point detector
  * \author Scott Klum \cite sklum
+ *
+ * If the template has a face rect from Cascade, or eyes from ASEFEyes, Stasm searches only that region
+ * widened by \em padding, so its own detector runs on a small image.
+ * \em fast additionally scales the region down to at most 160 pixels wide before the search.
+ * Stasm isn't reentrant, so the transform is thread-confined while the rest of the algorithm stays parallel.
  */
-
 class StasmTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(float padding READ get_padding WRITE set_padding RESET reset_padding STORED false)
+    Q_PROPERTY(bool fast READ get_fast WRITE set_fast RESET reset_fast STORED false)
+    BR_PROPERTY(float, padding, 0.5)
+    BR_PROPERTY(bool, fast, false)
+
+    bool threadConfined() const
+    {
+        return true;
+    }
 
-    void init()
+    // The face in src from its metadata, or the whole image
+    Rect searchRegion(const Template &src) const
     {
-        Globals->setProperty("parallelism", "0"); // Can only work in single threaded mode
+        const Rect image(0, 0, src.m().cols, src.m().rows);
+        QRectF face;
+        if (!src.file.rects().isEmpty()) {
+            face = src.file.rects().last();
+        } else if (src.file.contains("First_Eye") && src.file.contains("Second_Eye")) {
+            // Eyes sit about 0.4 of the face down and 0.5 of the face apart
+            const QPointF first = src.file.get<QPointF>("First_Eye");
+            const QPointF second = src.file.get<QPointF>("Second_Eye");
+            const QPointF center = (first + second) / 2;
+            const qreal size = 2 * QLineF(first, second).length();
+            face = QRectF(center.x() - size/2, center.y() - 0.4*size, size, size);
+        } else {
+            return image;
+        }
+
+        const qreal x = padding * face.width(), y = padding * face.height();
+        const Rect region = OpenCVUtils::toRect(face.adjusted(-x, -y, x, y)) & image;
+        return region.area() > 0 ? region : image;
     }
 
     void project(const Template &src, Template &dst) const
     {
+        const Rect region = searchRegion(src);
+        Mat m = src.m()(region);
+        double scale = 1;
+        if (fast && (m.cols > 160)) {
+            scale = 160.0 / m.cols;
+            resize(m, m, Size(), scale, scale, INTER_AREA);
+        } else {
+            m = m.clone(); // Stasm expects continuous data
+        }
+
         int nlandmarks;
         int landmarks[500];
-
         AsmSearchDll(&nlandmarks, landmarks,
-                     qPrintable(src.file.name), reinterpret_cast<char*>(src.m().data), src.m().cols, src.m().rows,
-                     src.m(), (src.m().channels() == 3), qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/mu-68-1d.conf"),  qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/mu-76-2d.conf"),  qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/"));
+                     qPrintable(src.file.name), reinterpret_cast<char*>(m.data), m.cols, m.rows,
+                     m, (m.channels() == 3), qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/mu-68-1d.conf"),  qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/mu-76-2d.conf"),  qPrintable(Globals->sdkPath + "/share/openbr/models/stasm/"));
 
         if (nlandmarks == 0) {
             qWarning("Unable to detect Stasm landmarks for %s", qPrintable(src.file.fileName()));
@@ -60,7 +104,7 @@ class StasmTransform : public UntrainableTransform
         }
 
         for (int i = 0; i < nlandmarks; i++)
-            dst.file.appendPoint(QPointF(landmarks[2 * i], landmarks[2 * i + 1]));
+            dst.file.appendPoint(QPointF(landmarks[2 * i] / scale + region.x, landmarks[2 * i + 1] / scale + region.y));
 
         dst.m() = src.m();
     }
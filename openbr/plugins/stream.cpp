@@ -2,15 +2,22 @@
 #include <QWaitCondition>
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QThread>
 #include <QMap>
+#include <QVector>
 #include <opencv/highgui.h>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <QtConcurrent>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
+#include "openbr/core/trace.h"
 
+#include <algorithm>
 #include <iostream>
 
 using namespace cv;
@@ -18,11 +25,25 @@ using namespace cv;
 namespace br
 {
 
+// How a stream reads its source
+struct StreamOptions
+{
+    int frames; // Frame pool size
+    int latency; // Milliseconds budget before dropping frames, 0 never drops
+    bool gray; // Decode video frames to single channel
+    int limit; // Decode video frames no larger than this, -1 for full size
+    bool synthetic; // Generate frames instead of reading the input
+};
+
 class FrameData
 {
 public:
     int sequenceNumber;
+    qint64 issued; // msecs since epoch when the frame was read
+    int dropped; // frames dropped by the source before this one
+    qint64 queued; // Trace::now() when handed to the current stage, -1 when not tracing
     TemplateList data;
+    FrameData() : queued(-1) {}
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -35,6 +56,12 @@ public:
     virtual void addItem(FrameData * input)=0;
 
     virtual FrameData * tryGetItem()=0;
+
+    // Approximate number of items waiting, for statistics
+    virtual int size()=0;
+
+    // Prepare for a new stream, only called while empty
+    virtual void reset() {}
 };
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
@@ -76,6 +103,18 @@ public:
         return output;
     }
 
+    int size()
+    {
+        QMutexLocker bufferLock(&bufferGuard);
+        return buffer.size();
+    }
+
+    void reset()
+    {
+        QMutexLocker bufferLock(&bufferGuard);
+        next_target = 0;
+    }
+
 private:
     QMutex bufferGuard;
     int next_target;
@@ -83,74 +122,57 @@ private:
     QMap<int, FrameData *> buffer;
 };
 
-// For 1 - 1 boundaries, a double buffering scheme
-// Producer/consumer read/write from separate buffers, and switch if their
-// buffer runs out/overflows. Synchronization is handled by a read/write lock
-// threads are "reading" if they are adding to/removing from their individual
-// buffer, and writing if they access or swap with the other buffer.
-class DoubleBuffer : public SharedBuffer
+// For 1 - 1 boundaries, a bounded single producer, single consumer ring.
+// The producer only advances the tail and the consumer only advances the
+// head, so neither side takes a lock. A stream never has more frames in
+// flight than its frame pool holds, so a ring sized to the pool never fills.
+class RingBuffer : public SharedBuffer
 {
 public:
-    DoubleBuffer()
+    RingBuffer(int capacity = 0)
     {
-        inputBuffer = &buffer1;
-        outputBuffer = &buffer2;
+        reserve(capacity);
     }
 
+    // Not thread safe, only called while the stream is idle
+    void reserve(int capacity)
+    {
+        slots.fill(NULL, capacity + 1);
+        head.store(0);
+        tail.store(0);
+    }
 
     // called from the producer thread
     void addItem(FrameData * input)
     {
-        QReadLocker readLock(&bufferGuard);
-        inputBuffer->append(input);
+        const int current = tail.load();
+        const int next = (current + 1) % slots.size();
+        if (next == head.loadAcquire())
+            qFatal("Stream buffer overflow.");
+        slots[current] = input;
+        tail.storeRelease(next);
     }
 
+    // called from the consumer thread
     FrameData * tryGetItem()
     {
-        QReadLocker readLock(&bufferGuard);
-
-        // There is something for us to get
-        if (!outputBuffer->empty()) {
-            FrameData * output = outputBuffer->first();
-            outputBuffer->removeFirst();
-            return output;
-        }
-
-        // Outputbuffer is empty, try to swap with the input buffer, we need a
-        // write lock to do that.
-        readLock.unlock();
-        QWriteLocker writeLock(&bufferGuard);
-
-        // Nothing on the input buffer either?
-        if (inputBuffer->empty()) {
+        const int current = head.load();
+        if (current == tail.loadAcquire())
             return NULL;
-        }
-
-        // input buffer is non-empty, so swap the buffers
-        std::swap(inputBuffer, outputBuffer);
-
-        // Return a frame
-        FrameData * output = outputBuffer->first();
-        outputBuffer->removeFirst();
+        FrameData * output = slots[current];
+        head.storeRelease((current + 1) % slots.size());
         return output;
     }
 
+    int size()
+    {
+        return (tail.load() - head.load() + slots.size()) % slots.size();
+    }
+
 private:
-    // The read-write lock. The thread adding to this buffer can add
-    // to the current input buffer if it has a read lock. The thread
-    // removing from this buffer can remove things from the current
-    // output buffer if it has a read lock, or swap the buffers if it
-    // has a write lock.
-    QReadWriteLock bufferGuard;
-
-    // The buffer that is currently being added to
-    QList<FrameData *> * inputBuffer;
-    // The buffer that is currently being removed from
-    QList<FrameData *> * outputBuffer;
-
-    // The buffers pointed at by inputBuffer/outputBuffer
-    QList<FrameData *> buffer1;
-    QList<FrameData *> buffer2;
+    QVector<FrameData *> slots;
+    QAtomicInt head;
+    QAtomicInt tail;
 };
 
 
@@ -164,23 +186,38 @@ public:
     {
         final_frame = -1;
         last_issued = -2;
-        for (int i=0; i < maxFrames;i++)
-        {
-            allFrames.addItem(new FrameData());
-        }
+        last_received = -2;
+        finished = false;
+        latency = 0;
+        lastLatency = 0;
+        dropped = 0;
+        allocate(maxFrames);
     }
 
     virtual ~DataSource()
     {
-        while (true)
+        release();
+    }
+
+    // Replace the frame pool, which bounds the number of frames in flight
+    // and so the memory used by the stream. Only called while idle.
+    void allocate(int maxFrames)
+    {
+        release();
+        frames = maxFrames;
+        allFrames.reserve(maxFrames);
+        for (int i=0; i < maxFrames;i++)
         {
-            FrameData * frame = allFrames.tryGetItem();
-            if (frame == NULL)
-                break;
-            delete frame;
+            allFrames.addItem(new FrameData());
         }
     }
 
+    int capacity() const { return frames; }
+
+    // Drop frames whenever the last frame took longer than this many
+    // milliseconds to get through the stream, 0 never drops
+    void setLatency(int milliseconds) { latency = milliseconds; }
+
     // non-blocking version of getFrame
     FrameData * tryGetFrame()
     {
@@ -191,6 +228,13 @@ public:
         aFrame->data.clear();
         aFrame->sequenceNumber = -1;
 
+        // Behind the latency budget? Skip ahead, more the further behind we are.
+        if ((latency > 0) && (lastLatency.load() > latency)) {
+            const int drops = std::min(lastLatency.load() / latency, int(Max_Drops));
+            for (int i=0; i<drops; i++)
+                if (skip()) dropped++;
+        }
+
         bool res = getNext(*aFrame);
         if (!res) {
             allFrames.addItem(aFrame);
@@ -198,33 +242,41 @@ public:
             QMutexLocker lock(&last_frame_update);
 
             final_frame = last_issued;
-            if (final_frame == last_received)
+            if (final_frame == last_received) {
+                finished = true;
                 lastReturned.wakeAll();
+            }
             else if (final_frame < last_received)
                 std::cout << "Bad last frame " << final_frame << " but received " << last_received << std::endl;
             return NULL;
         }
         last_issued = aFrame->sequenceNumber;
+        aFrame->issued = QDateTime::currentMSecsSinceEpoch();
+        aFrame->dropped = dropped;
         return aFrame;
     }
 
     bool returnFrame(FrameData * inputFrame)
     {
+        lastLatency.store(int(QDateTime::currentMSecsSinceEpoch() - inputFrame->issued));
         allFrames.addItem(inputFrame);
 
         QMutexLocker lock(&last_frame_update);
         last_received = inputFrame->sequenceNumber;
         if (inputFrame->sequenceNumber == final_frame) {
+            finished = true;
             lastReturned.wakeAll();
         }
 
         return this->final_frame != -1;
     }
 
+    // Returns once the last frame of the stream made it back to the pool
     void waitLast()
     {
         QMutexLocker lock(&last_frame_update);
-        lastReturned.wait(&last_frame_update);
+        while (!finished)
+            lastReturned.wait(&last_frame_update);
     }
 
     virtual void close() = 0;
@@ -233,21 +285,45 @@ public:
 
     virtual bool getNext(FrameData & input) = 0;
 
+    // Discard the next frame cheaply, returns false if there is none
+    virtual bool skip() { return false; }
+
 protected:
-    DoubleBuffer allFrames;
+    enum { Max_Drops = 30 };
+
+    RingBuffer allFrames;
+    int frames;
     int final_frame;
     int last_issued;
     int last_received;
+    bool finished;
+    int latency;
+    QAtomicInt lastLatency;
+    int dropped;
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
+
+private:
+    void release()
+    {
+        while (true)
+        {
+            FrameData * frame = allFrames.tryGetItem();
+            if (frame == NULL)
+                break;
+            delete frame;
+        }
+    }
 };
 
-// Read a video frame by frame using cv::VideoCapture
+// Read a video frame by frame using cv::VideoCapture, optionally
+// converting each decoded frame straight to gray and/or a smaller size
+// so the pipeline doesn't need Cvt(Gray) or LimitSize stages
 class VideoDataSource : public DataSource
 {
 public:
-    VideoDataSource(int maxFrames) : DataSource(maxFrames) {}
+    VideoDataSource(int maxFrames, bool gray, int limit) : DataSource(maxFrames), gray(gray), limit(limit) {}
 
     bool open(Template &input)
     {
@@ -255,6 +331,7 @@ public:
         last_issued = -2;
 
         next_idx = 0;
+        frame_idx = 0;
         basis = input;
         video.open(input.file.name.toStdString());
         return video.isOpened();
@@ -276,17 +353,50 @@ private:
         output.sequenceNumber = next_idx;
         next_idx++;
 
-        bool res = video.read(output.data.last().last());
+        bool res = (!gray && (limit <= 0)) ? video.read(output.data.last().last())
+                                            : decode(output.data.last().last());
         if (!res) {
             return false;
         }
-        output.data.last().file.set("FrameNumber", output.sequenceNumber);
+        output.data.last().file.set("FrameNumber", frame_idx++);
+        return true;
+    }
+
+    bool decode(cv::Mat & frame)
+    {
+        if (!video.read(decoded))
+            return false;
+
+        const cv::Mat * current = &decoded;
+        if (gray && (decoded.channels() == 3)) {
+            cv::cvtColor(decoded, converted, CV_BGR2GRAY);
+            current = &converted;
+        }
+
+        const int size = std::max(current->rows, current->cols);
+        if ((limit > 0) && (size > limit))
+            cv::resize(*current, frame, cv::Size(std::max(1, current->cols * limit / size), std::max(1, current->rows * limit / size)), 0, 0, cv::INTER_AREA);
+        else
+            current->copyTo(frame);
+        return true;
+    }
+
+    // Grab without decoding
+    bool skip()
+    {
+        if (!isOpen() || !video.grab())
+            return false;
+        frame_idx++;
         return true;
     }
 
     cv::VideoCapture video;
     Template basis;
     int next_idx;
+    int frame_idx; // Counts dropped frames too
+    bool gray;
+    int limit;
+    cv::Mat decoded, converted; // Reused between frames
 };
 
 // Given a template as input, return its matrices one by one on subsequent calls
@@ -338,15 +448,104 @@ private:
     int next_sequence;
 };
 
+// Generate frames for benchmarking the stream itself, configured through the
+// metadata of the input template: "frames" to produce, "fps" to
+// produce them at (0 as fast as they are consumed), and "rows", "cols" and
+// "channels" of each frame. Frames share one random matrix so generating them
+// costs nothing but the pacing.
+class SyntheticDataSource : public DataSource
+{
+public:
+    SyntheticDataSource(int maxFrames) : DataSource(maxFrames)
+    {
+        total = 0;
+        next_idx = 0;
+        fps = 0;
+    }
+
+    bool open(Template &input)
+    {
+        final_frame = -1;
+        last_issued = -2;
+
+        basis = input.file;
+        total = input.file.get<int>("frames", 1000);
+        fps = input.file.get<float>("fps", 0);
+        frame = Mat(input.file.get<int>("rows", 480), input.file.get<int>("cols", 640), CV_8UC(input.file.get<int>("channels", 3)));
+        randu(frame, Scalar::all(0), Scalar::all(255));
+        next_idx = 0;
+        timer.start();
+        return isOpen();
+    }
+
+    bool isOpen() { return next_idx < total; }
+
+    void close()
+    {
+        total = 0;
+        frame.release();
+    }
+
+private:
+    bool getNext(FrameData & output)
+    {
+        if (!isOpen())
+            return false;
+
+        // Hold each frame until its due time, like a live camera would
+        if (fps > 0) {
+            const qint64 due = qint64(1000000 * next_idx / fps);
+            const qint64 elapsed = timer.nsecsElapsed() / 1000;
+            if (due > elapsed)
+                QThread::usleep(due - elapsed);
+        }
+
+        output.data.append(Template(basis, frame));
+        output.data.last().file.set("FrameNumber", next_idx);
+        output.sequenceNumber = next_idx;
+        next_idx++;
+        return true;
+    }
+
+    bool skip()
+    {
+        if (!isOpen())
+            return false;
+        next_idx++;
+        return true;
+    }
+
+    File basis;
+    Mat frame;
+    QElapsedTimer timer;
+    int total;
+    int next_idx;
+    float fps;
+};
+
 // Given a template as input, create a VideoDataSource or a TemplateDataSource
 // depending on whether or not it looks like the input template has already
-// loaded frames into memory.
+// loaded frames into memory, or a SyntheticDataSource if the stream asks for one.
 class DataSourceManager : public DataSource
 {
 public:
     DataSourceManager()
     {
         actualSource = NULL;
+        gray = false;
+        limit = -1;
+        synthetic = false;
+    }
+
+    void setDecoding(bool gray, int limit)
+    {
+        this->gray = gray;
+        this->limit = limit;
+    }
+
+    void setSynthetic(bool synthetic)
+    {
+        this->synthetic = synthetic;
     }
 
     ~DataSourceManager()
@@ -369,10 +568,18 @@ public:
         bool open_res = false;
         final_frame = -1;
         last_issued = -2;
+        last_received = -2;
+        finished = false;
+        lastLatency.store(0);
+        dropped = 0;
 
+        if (synthetic) {
+            actualSource = new SyntheticDataSource(0);
+            open_res = actualSource->open(input);
+        }
         // Input has no matrices? Its probably a video that hasn't been loaded yet
-        if (input.empty()) {
-            actualSource = new VideoDataSource(0);
+        else if (input.empty()) {
+            actualSource = new VideoDataSource(0, gray, limit);
             open_res = actualSource->open(input);
         }
         else {
@@ -392,17 +599,25 @@ public:
 
 protected:
     DataSource * actualSource;
+    bool gray;
+    int limit;
+    bool synthetic;
     bool getNext(FrameData & output)
     {
         return actualSource->getNext(output);
     }
 
+    bool skip()
+    {
+        return actualSource->skip();
+    }
+
 };
 
 class ProcessingStage : public QRunnable
 {
 public:
-    friend class StreamTransform;
+    friend class StreamPipeline;
 public:
     ProcessingStage(int nThreads = 1)
     {
@@ -414,8 +629,28 @@ public:
 
     virtual void nextStageRun(FrameData * input)=0;
 
+    // Prepare for a new stream, only called while idle
+    virtual void reset()
+    {
+        peakDepth.store(0);
+    }
+
+    // Largest number of frames seen waiting on (or running in) this stage
+    int peak() const
+    {
+        return peakDepth.load();
+    }
+
 protected:
     int thread_count;
+    QAtomicInt peakDepth;
+
+    void recordDepth(int depth)
+    {
+        int peak = peakDepth.load();
+        while ((depth > peak) && !peakDepth.testAndSetOrdered(peak, depth))
+            peak = peakDepth.load();
+    }
 
     SharedBuffer * inputBuffer;
     ProcessingStage * nextStage;
@@ -440,32 +675,44 @@ public:
         qFatal("no don't do it!");
     }
 
-    // Called from a different thread than run
+    // Called from a different thread than run. The frame pool bounds
+    // the number of these tasks in flight.
     virtual void nextStageRun(FrameData * input)
     {
+        input->queued = Trace::enabled() ? Trace::now() : -1;
+        recordDepth(active.fetchAndAddOrdered(1) + 1);
         QtConcurrent::run(multistage_run, this, input);
     }
+
+private:
+    QAtomicInt active;
 };
 
 void multistage_run(MultiThreadStage * basis, FrameData * input)
 {
     if (input == NULL)
         qFatal("null input to multi-thread stage");
+    if (input->queued >= 0) Trace::record("wait", "queue " + basis->transform->objectName(), input->queued);
+
     // Project the input we got
-    basis->transform->projectUpdate(input->data);
+    {
+        Trace::Scope span("stage", basis->transform->objectName());
+        basis->transform->projectUpdate(input->data);
+    }
 
+    basis->active.fetchAndAddOrdered(-1);
     basis->nextStage->nextStageRun(input);
 }
 
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    SingleThreadStage(bool input_variance, int capacity) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         if (input_variance)
-            this->inputBuffer = new DoubleBuffer();
+            this->inputBuffer = new RingBuffer(capacity);
         else
             this->inputBuffer = new SequencingBuffer();
     }
@@ -474,6 +721,13 @@ public:
         delete inputBuffer;
     }
 
+    void reset()
+    {
+        ProcessingStage::reset();
+        next_target = 0;
+        inputBuffer->reset();
+    }
+
     int next_target;
     enum Status
     {
@@ -503,9 +757,13 @@ public:
                 qFatal("out of order frames for stage %d, got %d expected %d", this->stage_id, currentItem->sequenceNumber, this->next_target);
             }
             next_target = currentItem->sequenceNumber + 1;
+            if (currentItem->queued >= 0) Trace::record("wait", "queue " + transform->objectName(), currentItem->queued);
 
             // Project the input we got
-            transform->projectUpdate(currentItem->data);
+            {
+                Trace::Scope span("stage", transform->objectName());
+                transform->projectUpdate(currentItem->data);
+            }
 
             this->nextStage->nextStageRun(currentItem);
         }
@@ -515,7 +773,9 @@ public:
     void nextStageRun(FrameData * input)
     {
         // add to our input buffer
+        input->queued = Trace::enabled() ? Trace::now() : -1;
         inputBuffer->addItem(input);
+        recordDepth(inputBuffer->size());
         QReadLocker lock(&statusLock);
         if (currentStatus == STARTING)
             return;
@@ -537,7 +797,7 @@ public:
 class FirstStage : public SingleThreadStage
 {
 public:
-    FirstStage() : SingleThreadStage(true) {}
+    FirstStage() : SingleThreadStage(true, 0) {}
 
     DataSourceManager dataSource;
     // Start drawing frames from the datasource.
@@ -549,7 +809,9 @@ public:
             // Whether or not we get a valid item controls whether or not we
             QWriteLocker lock(&statusLock);
 
+            const qint64 begin = Trace::enabled() ? Trace::now() : -1;
             currentItem = this->dataSource.tryGetFrame();
+            if (begin >= 0) Trace::record("io", "read frame", begin);
             if (currentItem == NULL)
             {
                 this->currentStatus = STOPPING;
@@ -588,12 +850,18 @@ public:
 class LastStage : public SingleThreadStage
 {
 public:
-    LastStage(bool _prev_stage_variance) : SingleThreadStage(_prev_stage_variance) {}
+    LastStage(bool _prev_stage_variance, int capacity) : SingleThreadStage(_prev_stage_variance, capacity) {}
     TemplateList getOutput()
     {
         return collectedOutput;
     }
 
+    void reset()
+    {
+        SingleThreadStage::reset();
+        collectedOutput.clear();
+    }
+
 private:
     TemplateList collectedOutput;
 public:
@@ -615,17 +883,199 @@ public:
                 qFatal("out of order frames for collection stage %d, got %d expected %d", this->stage_id, currentItem->sequenceNumber, this->next_target);
             }
             next_target = currentItem->sequenceNumber + 1;
+            if (currentItem->queued >= 0) Trace::record("wait", "queue output", currentItem->queued);
 
             // Just put the item on collectedOutput
+            const qint64 latency = QDateTime::currentMSecsSinceEpoch() - currentItem->issued;
+            for (int i=0; i<currentItem->data.size(); i++) {
+                currentItem->data[i].file.set("StreamLatency", latency);
+                currentItem->data[i].file.set("DroppedFrames", currentItem->dropped);
+            }
             collectedOutput.append(currentItem->data);
             this->nextStage->nextStageRun(currentItem);
         }
     }
 };
 
+// The stages streaming one source at a time, linked into a ring through
+// the read stage. Pipelines streaming concurrently share the stateless
+// transforms and own copies of the time-varying ones.
+class StreamPipeline
+{
+public:
+    StreamPipeline(const QList<Transform *> &transforms, const StreamOptions & options, bool copy)
+    {
+        const int frames = options.frames;
+        readStage.dataSource.allocate(frames);
+        readStage.dataSource.setLatency(options.latency);
+        readStage.dataSource.setDecoding(options.gray, options.limit);
+        readStage.dataSource.setSynthetic(options.synthetic);
+        readStage.stage_id = 0;
+
+        int next_stage_id = 1;
+        bool prev_stage_variance = true;
+        for (int i =0; i < transforms.size(); i++)
+        {
+            Transform * transform = transforms[i];
+            const bool variance = transform->timeVarying();
+            if (variance && copy) {
+                transform = transform->clone();
+                if (transform != transforms[i])
+                    owned.append(transform);
+            }
+
+            if (variance)
+                processingStages.append(new SingleThreadStage(prev_stage_variance, frames));
+            else
+                processingStages.append(new MultiThreadStage(Globals->parallelism));
+
+            processingStages.last()->stage_id = next_stage_id++;
+
+            // link nextStage pointers
+            if (i == 0)
+                this->readStage.nextStage = processingStages[i];
+            else
+                processingStages[i-1]->nextStage = processingStages[i];
+
+            processingStages.last()->transform = transform;
+            prev_stage_variance = variance;
+        }
+
+        collectionStage = new LastStage(prev_stage_variance, frames);
+        collectionStage->stage_id = next_stage_id;
+
+        // It's a ring buffer, get it?
+        processingStages.last()->nextStage = collectionStage;
+        collectionStage->nextStage = &readStage;
+    }
+
+    ~StreamPipeline()
+    {
+        qDeleteAll(processingStages);
+        delete collectionStage;
+        qDeleteAll(owned);
+    }
+
+    // Blocks until every frame of input made it through the stages
+    bool stream(const Template & input, TemplateList & output)
+    {
+        Template source = input;
+        if (!readStage.dataSource.open(source)) {
+            qWarning("failed to stream template %s", qPrintable(input.file.name));
+            return false;
+        }
+
+        readStage.reset();
+        foreach (ProcessingStage *stage, processingStages)
+            stage->reset();
+        collectionStage->reset();
+
+        readStage.currentStatus = SingleThreadStage::STARTING;
+        QThreadPool::globalInstance()->start(&readStage, 0);
+        readStage.dataSource.waitLast();
+        output = collectionStage->getOutput();
+
+        // The source ended, push whatever the time-varying stages still hold through the stages after them
+        for (int i=0; i<processingStages.size(); i++) {
+            TemplateList last_set;
+            processingStages[i]->transform->finalize(last_set);
+            if (last_set.empty())
+                continue;
+            for (int j=i+1; j<processingStages.size(); j++)
+                processingStages[j]->transform->projectUpdate(last_set);
+            output.append(last_set);
+        }
+
+        if (Globals->verbose) {
+            for (int i=0; i<processingStages.size(); i++)
+                qDebug("Stream stage %d (%s): peak depth %d of %d frames", processingStages[i]->stage_id, qPrintable(processingStages[i]->transform->objectName()),
+                       processingStages[i]->peak(), readStage.dataSource.capacity());
+            qDebug("Stream collection stage: peak depth %d of %d frames", collectionStage->peak(), readStage.dataSource.capacity());
+        }
+        return true;
+    }
+
+private:
+    FirstStage readStage;
+    QList<ProcessingStage *> processingStages;
+    LastStage * collectionStage;
+    QList<Transform *> owned;
+};
+
+// Streams sources from a shared list until none are left
+class StreamDriver : public QRunnable
+{
+public:
+    StreamDriver(StreamPipeline * pipeline, const TemplateList * sources, QVector<TemplateList> * outputs, QAtomicInt * next)
+        : pipeline(pipeline), sources(sources), outputs(outputs), next(next) {}
+
+    void run()
+    {
+        forever {
+            const int index = next->fetchAndAddOrdered(1);
+            if (index >= sources->size())
+                return;
+            if (!pipeline->stream(sources->at(index), (*outputs)[index]))
+                (*outputs)[index] = TemplateList() << sources->at(index);
+        }
+    }
+
+private:
+    StreamPipeline * pipeline;
+    const TemplateList * sources;
+    QVector<TemplateList> * outputs;
+    QAtomicInt * next;
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Projects the frames of a video or the matrices of a template through a pipeline of concurrently running stages.
+ * \author Charles Otto \cite caotto
+ *
+ * At most \em capacity frames, or br::Context::parallelism + 1 if it is \c 0, are in flight at once.
+ * Reading stalls until the last stage returns a frame, which bounds both the latency and the memory of every stage queue.
+ * In verbose mode the peak queue depth of each stage is reported after each stream, the bottleneck stage has the deepest queue.
+ *
+ * Given several templates, up to \em streams of them, or br::Context::parallelism if it is \c 0, are streamed concurrently.
+ * Each concurrent stream has its own stages sequencing its frames and its own br::Transform::clone() of the time-varying transforms,
+ * all of them share the global thread pool.
+ * The output holds the frames of each template in input order.
+ *
+ * For live sources set \em latency to a budget in milliseconds.
+ * While frames take longer than that to get through the stream, the source grabs and discards frames before reading the next one.
+ * Each output frame records its \c StreamLatency in milliseconds and the \c DroppedFrames before it, \c FrameNumber counts dropped frames.
+ *
+ * Set \em gray and \em limit to have video frames converted to gray and shrunk to at most \em limit pixels on a side
+ * as they are decoded, in place of leading \c Cvt(Gray) and \c LimitSize stages.
+ *
+ * Set \em source to \c Synthetic to stream generated frames instead of the input, for benchmarking the stream itself.
+ * The input template's \c frames, \c fps, \c rows, \c cols and \c channels metadata set how many frames of what size arrive at what rate,
+ * an \c fps of \c 0 produces them as fast as the stream takes them.
+ */
 class StreamTransform : public CompositeTransform
 {
     Q_OBJECT
+    Q_ENUMS(Source)
+    Q_PROPERTY(int capacity READ get_capacity WRITE set_capacity RESET reset_capacity STORED false)
+    Q_PROPERTY(int streams READ get_streams WRITE set_streams RESET reset_streams STORED false)
+    Q_PROPERTY(int latency READ get_latency WRITE set_latency RESET reset_latency STORED false)
+    Q_PROPERTY(bool gray READ get_gray WRITE set_gray RESET reset_gray STORED false)
+    Q_PROPERTY(int limit READ get_limit WRITE set_limit RESET reset_limit STORED false)
+    Q_PROPERTY(Source source READ get_source WRITE set_source RESET reset_source STORED false)
+
+public:
+    /*!< */
+    enum Source { Input,
+                  Synthetic };
+
+private:
+    BR_PROPERTY(int, capacity, 0)
+    BR_PROPERTY(int, streams, 0)
+    BR_PROPERTY(int, latency, 0)
+    BR_PROPERTY(bool, gray, false)
+    BR_PROPERTY(int, limit, -1)
+    BR_PROPERTY(Source, source, Input)
+
 public:
     void train(const TemplateList & data)
     {
@@ -656,25 +1106,33 @@ public:
     // start processing
     void projectUpdate(const TemplateList & src, TemplateList & dst)
     {
-        if (src.size() != 1)
-            qFatal("Expected single template input to stream");
-
-        dst = src;
-        bool res = readStage.dataSource.open(dst[0]);
-        if (!res) {
-            qWarning("failed to stream template %s", qPrintable(dst[0].file.name));
-            return;
-        }
+        if (src.isEmpty())
+            qFatal("Expected template input to stream");
 
+        // Waiting on the stream doesn't count against the thread pool
         QThreadPool::globalInstance()->releaseThread();
-        readStage.currentStatus = SingleThreadStage::STARTING;
-        QThreadPool::globalInstance()->start(&readStage, 0);
-        // Wait for the end.
-        readStage.dataSource.waitLast();
+        if (src.size() == 1) {
+            if (!pipelines.first()->stream(src.first(), dst))
+                dst = src;
+        } else {
+            const int count = std::min(src.size(), (streams > 0) ? streams : std::max(1, Globals->parallelism));
+            while (pipelines.size() < count)
+                pipelines.append(new StreamPipeline(transforms, options(), true));
+
+            // Drivers only block waiting on their streams, so they get their own threads
+            QVector<TemplateList> outputs(src.size());
+            QAtomicInt next(0);
+            QThreadPool drivers;
+            drivers.setMaxThreadCount(count);
+            for (int i=0; i<count; i++)
+                drivers.start(new StreamDriver(pipelines[i], &src, &outputs, &next));
+            drivers.waitForDone();
+
+            dst.clear();
+            foreach (const TemplateList &output, outputs)
+                dst.append(output);
+        }
         QThreadPool::globalInstance()->reserveThread();
-
-        // dst is set to all output received by the final stage
-        dst = collectionStage->getOutput();
     }
 
     virtual void finalize(TemplateList & output)
@@ -687,63 +1145,28 @@ public:
     void init()
     {
         if (transforms.isEmpty()) return;
-
-        stage_variance.reserve(transforms.size());
-        foreach (const br::Transform *transform, transforms) {
-            stage_variance.append(transform->timeVarying());
-        }
-
-        readStage.stage_id = 0;
-
-        int next_stage_id = 1;
-        int lastBufferIdx = 0;
-        bool prev_stage_variance = true;
-        for (int i =0; i < transforms.size(); i++)
-        {
-            if (stage_variance[i])
-            {
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
-            }
-            else
-                processingStages.append(new MultiThreadStage(Globals->parallelism));
-
-            processingStages.last()->stage_id = next_stage_id++;
-
-            // link nextStage pointers
-            if (i == 0)
-                this->readStage.nextStage = processingStages[i];
-            else
-                processingStages[i-1]->nextStage = processingStages[i];
-
-            lastBufferIdx++;
-
-            processingStages.last()->transform = transforms[i];
-            prev_stage_variance = stage_variance[i];
-        }
-
-        collectionStage = new LastStage(prev_stage_variance);
-        collectionStage->stage_id = next_stage_id;
-
-        // It's a ring buffer, get it?
-        processingStages.last()->nextStage = collectionStage;
-        collectionStage->nextStage = &readStage;
+        pipelines.append(new StreamPipeline(transforms, options(), false));
     }
 
     ~StreamTransform()
     {
-        for (int i = 0; i < processingStages.size(); i++) {
-            delete processingStages[i];
-        }
-        delete collectionStage;
+        qDeleteAll(pipelines);
     }
 
 protected:
-    QList<bool> stage_variance;
-
-    FirstStage readStage;
-    LastStage * collectionStage;
+    // The first pipeline uses the transforms themselves
+    QList<StreamPipeline *> pipelines;
 
-    QList<ProcessingStage *> processingStages;
+    StreamOptions options() const
+    {
+        StreamOptions options;
+        options.frames = (capacity > 0) ? capacity : Globals->parallelism + 1;
+        options.latency = latency;
+        options.gray = gray;
+        options.limit = limit;
+        options.synthetic = (source == Synthetic);
+        return options;
+    }
 
     void _project(const Template &src, Template &dst) const
     {
@@ -14,21 +14,129 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QTemporaryFile>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/parallel.h"
+#include "openbr/core/qtutils.h"
 
 namespace br
 {
 
+/*!
+ * \brief CvSVM with its model packed into contiguous matrices for batch prediction.
+ *
+ * Linear and RBF kernels are evaluated against all support vectors of a block of samples with one matrix product,
+ * a linear model further collapses each decision function to a single weight vector.
+ * Other kernels, and models trained on a variable subset, fall back to CvSVM::predict().
+ */
+class PackedSVM : public CvSVM
+{
+    cv::Mat supportVectors; // sv_total x var_all
+    cv::Mat squaredNorms;   // 1 x sv_total, RBF only
+    cv::Mat alpha;          // sv_total x decisions, zero where a decision function doesn't use a support vector
+    cv::Mat weights;        // decisions x var_all, linear only
+    QVector<double> rho;
+    int classes;            // 0 for regression and one class models
+
+public:
+    void pack()
+    {
+        supportVectors.release();
+        rho.clear();
+        if (((params.kernel_type != LINEAR) && (params.kernel_type != RBF)) || (var_idx != NULL) || (sv_total == 0)) return;
+
+        const bool classification = (params.svm_type == C_SVC) || (params.svm_type == NU_SVC);
+        classes = classification ? class_labels->cols : 0;
+        const int decisions = classification ? classes*(classes-1)/2 : 1;
+
+        supportVectors.create(sv_total, var_all, CV_32FC1);
+        for (int i=0; i<sv_total; i++)
+            memcpy(supportVectors.ptr(i), sv[i], var_all*sizeof(float));
+
+        alpha = cv::Mat::zeros(sv_total, decisions, CV_64FC1);
+        for (int d=0; d<decisions; d++) {
+            const CvSVMDecisionFunc &df = decision_func[d];
+            rho.append(df.rho);
+            for (int k=0; k<df.sv_count; k++)
+                alpha.at<double>(classification ? df.sv_index[k] : k, d) = df.alpha[k];
+        }
+
+        if (params.kernel_type == LINEAR) {
+            cv::Mat sv64; supportVectors.convertTo(sv64, CV_64F);
+            cv::Mat w = alpha.t() * sv64;
+            w.convertTo(weights, CV_32F);
+        } else {
+            weights.release();
+            cv::reduce(supportVectors.mul(supportVectors), squaredNorms, 1, CV_REDUCE_SUM);
+            squaredNorms = squaredNorms.t();
+        }
+    }
+
+    //! Predicts each row of \em samples into \em results, as CvSVM::predict() would
+    void predictRows(const cv::Mat &samples, float *results) const
+    {
+        if (supportVectors.empty()) {
+            for (int i=0; i<samples.rows; i++)
+                results[i] = predict(samples.row(i));
+            return;
+        }
+        if (samples.cols != var_all) qFatal("SVM expected %d features, got %d.", var_all, samples.cols);
+
+        cv::Mat sums;
+        if (!weights.empty()) {
+            cv::gemm(samples, weights, 1, cv::Mat(), 0, sums, cv::GEMM_2_T);
+            sums.convertTo(sums, CV_64F);
+        } else {
+            // exp(-gamma*|x-s|^2) with |x-s|^2 = |x|^2 + |s|^2 - 2x.s
+            cv::Mat k, xx;
+            cv::gemm(samples, supportVectors, -2, cv::Mat(), 0, k, cv::GEMM_2_T);
+            cv::reduce(samples.mul(samples), xx, 1, CV_REDUCE_SUM);
+            const float gamma = -params.gamma;
+            for (int i=0; i<k.rows; i++) {
+                float *row = k.ptr<float>(i);
+                const float *s = squaredNorms.ptr<float>();
+                const float x = xx.at<float>(i, 0);
+                for (int j=0; j<k.cols; j++)
+                    row[j] = std::max(row[j] + x + s[j], 0.f) * gamma;
+            }
+            cv::exp(k, k);
+            k.convertTo(k, CV_64F);
+            sums = k * alpha;
+        }
+
+        for (int i=0; i<samples.rows; i++) {
+            const double *sum = sums.ptr<double>(i);
+            if (classes == 0) {
+                const double value = sum[0] - rho[0];
+                results[i] = params.svm_type == ONE_CLASS ? float(value > 0) : float(value);
+                continue;
+            }
+
+            QVector<int> votes(classes, 0);
+            for (int a=0, d=0; a<classes; a++)
+                for (int b=a+1; b<classes; b++, d++)
+                    votes[sum[d] - rho[d] > 0 ? a : b]++;
+            int best = 0;
+            for (int c=1; c<classes; c++)
+                if (votes[c] > votes[best]) best = c;
+            results[i] = class_labels->data.i[best];
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief C. Burges. "A tutorial on support vector machines for pattern recognition,"
  * Knowledge Discovery and Data Mining 2(2), 1998.
  * \author Josh Klontz \cite jklontz
+ *
+ * Parameters left at -1 are chosen by 5-fold cross validation over the CvSVM::get_default_grid() values,
+ * with every candidate validated concurrently on at most \em gridInstances random training samples.
+ * \em warmStart names a model stored by LoadStore whose first SVM supplies the parameters instead of searching.
  */
 class SVMTransform : public Transform
 {
@@ -39,6 +147,8 @@ class SVMTransform : public Transform
     Q_PROPERTY(Type type READ get_type WRITE set_type RESET reset_type STORED false)
     Q_PROPERTY(float C READ get_C WRITE set_C RESET reset_C STORED false)
     Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
+    Q_PROPERTY(int gridInstances READ get_gridInstances WRITE set_gridInstances RESET reset_gridInstances STORED false)
+    Q_PROPERTY(QString warmStart READ get_warmStart WRITE set_warmStart RESET reset_warmStart STORED false)
 
 public:
     /*!
@@ -62,8 +172,10 @@ private:
     BR_PROPERTY(Type, type, C_SVC)
     BR_PROPERTY(float, C, -1)
     BR_PROPERTY(float, gamma, -1)
+    BR_PROPERTY(int, gridInstances, -1)
+    BR_PROPERTY(QString, warmStart, "")
 
-    cv::SVM svm;
+    PackedSVM svm;
     float a, b;
 
 public:
@@ -93,64 +205,196 @@ private:
         params.svm_type = type;
         params.p = 0.1;
         params.nu = 0.5;
-        if ((C == -1) || ((gamma == -1) && (int(kernel) != int(CvSVM::LINEAR)))) {
-            try {
-                svm.train_auto(data, lab, cv::Mat(), cv::Mat(), params, 5);
-            } catch (...) {
+        params.C = C;
+        params.gamma = gamma;
+        bool trained = false;
+        if (!warmStart.isEmpty()) {
+            warmStartParams(params);
+        } else if ((C == -1) || ((gamma == -1) && (int(kernel) != int(CvSVM::LINEAR)))) {
+            if (!gridSearch(data, lab, params)) {
                 qWarning("Some classes do not contain sufficient examples or are not discriminative enough for accurate SVM classification.");
                 svm.train(data, lab);
+                trained = true;
             }
-        } else {
-            params.C = C;
-            params.gamma = gamma;
-            svm.train(data, lab, cv::Mat(), cv::Mat(), params);
         }
+        if (!trained)
+            svm.train(data, lab, cv::Mat(), cv::Mat(), params);
 
         CvSVMParams p = svm.get_params();
         qDebug("SVM C = %f  Gamma = %f  Support Vectors = %d", p.C, p.gamma, svm.get_support_vector_count());
+        svm.pack();
+    }
+
+    // Candidate parameters with one more grid searched, when its property is free for this kernel and type
+    static QList<CvSVMParams> expand(const QList<CvSVMParams> &candidates, int grid)
+    {
+        const CvParamGrid values = CvSVM::get_default_grid(grid);
+        QList<CvSVMParams> expanded;
+        foreach (const CvSVMParams &candidate, candidates)
+            for (double value=values.min_val; value<values.max_val; value*=values.step) {
+                CvSVMParams params = candidate;
+                if      (grid == CvSVM::C)     params.C = value;
+                else if (grid == CvSVM::GAMMA) params.gamma = value;
+                else if (grid == CvSVM::P)     params.p = value;
+                else                           params.nu = value;
+                expanded.append(params);
+            }
+        return expanded;
+    }
+
+    // Sum of the validation errors of params over all folds, squared for regression
+    static void validate(const cv::Mat *data, const cv::Mat *lab, const QVector<int> *folds, CvSVMParams params, double *error)
+    {
+        const bool regression = (params.svm_type == CvSVM::EPS_SVR) || (params.svm_type == CvSVM::NU_SVR);
+        const int k = 1 + *std::max_element(folds->begin(), folds->end());
+        *error = 0;
+        for (int fold=0; fold<k; fold++) {
+            cv::Mat trainData, trainLab;
+            for (int i=0; i<data->rows; i++)
+                if ((*folds)[i] != fold) {
+                    trainData.push_back(data->row(i));
+                    trainLab.push_back(lab->row(i));
+                }
+
+            CvSVM svm;
+            try {
+                svm.train(trainData, trainLab, cv::Mat(), cv::Mat(), params);
+            } catch (...) {
+                *error = std::numeric_limits<double>::max();
+                return;
+            }
+
+            for (int i=0; i<data->rows; i++)
+                if ((*folds)[i] == fold) {
+                    const double delta = svm.predict(data->row(i)) - lab->at<float>(i, 0);
+                    *error += regression ? delta*delta : (delta != 0);
+                }
+        }
+    }
+
+    // Sets params to the candidate with the least cross validation error, returns false if none could be trained
+    bool gridSearch(const cv::Mat &data, const cv::Mat &lab, CvSVMParams &params) const
+    {
+        QList<CvSVMParams> candidates; candidates.append(params);
+        const bool nu = (type == NU_SVC) || (type == ONE_CLASS) || (type == NU_SVR);
+        if ((C == -1) && ((type == C_SVC) || (type == EPS_SVR) || (type == NU_SVR))) candidates = expand(candidates, CvSVM::C);
+        if ((gamma == -1) && (kernel != Linear)) candidates = expand(candidates, CvSVM::GAMMA);
+        if (type == EPS_SVR) candidates = expand(candidates, CvSVM::P);
+        if (nu) candidates = expand(candidates, CvSVM::NU);
+
+        cv::Mat gridData = data, gridLab = lab;
+        if ((gridInstances > 0) && (gridInstances < data.rows)) {
+            gridData = cv::Mat(); gridLab = cv::Mat();
+            foreach (int i, Common::RandSample(gridInstances, data.rows, 0, true)) {
+                gridData.push_back(data.row(i));
+                gridLab.push_back(lab.row(i));
+            }
+        }
+
+        QVector<int> folds(gridData.rows);
+        const QList<int> order = Common::RandSample(gridData.rows, gridData.rows, 0, true);
+        for (int i=0; i<order.size(); i++)
+            folds[order[i]] = i % 5;
+
+        QVector<double> errors(candidates.size());
+        TaskGroup tasks;
+        for (int i=0; i<candidates.size(); i++)
+            if (Globals->parallelism) tasks.run(validate, &gridData, &gridLab, &folds, candidates[i], &errors[i]);
+            else                                validate (&gridData, &gridLab, &folds, candidates[i], &errors[i]);
+        tasks.wait();
+
+        const int best = std::min_element(errors.begin(), errors.end()) - errors.begin();
+        if (errors[best] == std::numeric_limits<double>::max()) return false;
+        params = candidates[best];
+        return true;
+    }
+
+    // Takes the parameters of the first SVM in the model stored by LoadStore at warmStart
+    void warmStartParams(CvSVMParams &params) const
+    {
+        QByteArray data;
+        QtUtils::readFile(warmStart, data, true);
+        QDataStream stream(&data, QFile::ReadOnly);
+        QString description;
+        stream >> description;
+        QScopedPointer<Transform> model(Transform::make(description, NULL));
+        model->load(stream);
+
+        SVMTransform *previous = qobject_cast<SVMTransform*>(model.data());
+        if (!previous) {
+            QList<SVMTransform*> children = model->findChildren<SVMTransform*>();
+            if (children.isEmpty()) qFatal("No SVM in %s.", qPrintable(warmStart));
+            previous = children.first();
+        }
+
+        const CvSVMParams previousParams = previous->svm.get_params();
+        params.C = previousParams.C;
+        params.gamma = previousParams.gamma;
+        params.p = previousParams.p;
+        params.nu = previousParams.nu;
+        qDebug("SVM warm start from %s", qPrintable(warmStart));
     }
 
     void project(const Template &src, Template &dst) const
     {
-        dst = src;
-        dst.file.setLabel((svm.predict(src.m().reshape(0, 1)) - b)/a);
+        TemplateList srcs, dsts;
+        srcs.append(src);
+        project(srcs, dsts);
+        dst = dsts.first();
     }
 
-    void store(QDataStream &stream) const
+    void projectBlock(const TemplateList *src, int begin, int end, TemplateList *dst) const
     {
-        stream << a << b;
+        cv::Mat samples(end-begin, src->at(begin).m().total(), CV_32FC1);
+        for (int i=begin; i<end; i++) {
+            const cv::Mat &m = src->at(i).m();
+            if ((m.type() != CV_32FC1) || (int(m.total()) != samples.cols))
+                qFatal("SVM expected %d floating point features.", samples.cols);
+            m.reshape(0, 1).copyTo(samples.row(i-begin));
+        }
 
-        // Create local file
-        QTemporaryFile tempFile;
-        tempFile.open();
-        tempFile.close();
+        QVector<float> results(end-begin);
+        svm.predictRows(samples, results.data());
+        for (int i=begin; i<end; i++)
+            (*dst)[i].file.setLabel((results[i-begin] - b)/a);
+    }
 
-        // Save SVM to local file
-        svm.save(qPrintable(tempFile.fileName()));
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        // Blocks of samples are predicted together against the packed support vectors
+        const int blockSize = 256;
+        TemplateList projected = src;
+        TaskGroup tasks;
+        for (int i=0; i<src.size(); i+=blockSize)
+            if (Globals->parallelism) tasks.run(this, &SVMTransform::projectBlock, &src, i, std::min(i+blockSize, src.size()), &projected);
+            else                                                       projectBlock( &src, i, std::min(i+blockSize, src.size()), &projected);
+        tasks.wait();
+        dst.append(projected);
+    }
 
-        // Copy local file contents to stream
-        tempFile.open();
-        QByteArray data = tempFile.readAll();
-        tempFile.close();
-        stream << data;
+    void store(QDataStream &stream) const
+    {
+        stream << a << b;
+
+        // The same XML CvSVM::save() writes, built in memory
+        cv::FileStorage fs(".xml", cv::FileStorage::WRITE + cv::FileStorage::MEMORY);
+        svm.write(*fs, "my_svm");
+        const std::string xml = fs.releaseAndGetString();
+        stream << QByteArray(xml.data(), xml.size());
     }
 
     void load(QDataStream &stream)
     {
         stream >> a >> b;
 
-        // Copy local file contents from stream
         QByteArray data;
         stream >> data;
 
-        // Create local file
-        QTemporaryFile tempFile(QDir::tempPath()+"/SVM");
-        tempFile.open();
-        tempFile.write(data);
-        tempFile.close();
-
-        // Load SVM from local file
-        svm.load(qPrintable(tempFile.fileName()));
+        cv::FileStorage fs(std::string(data.constData(), data.size()), cv::FileStorage::READ + cv::FileStorage::MEMORY);
+        cv::FileNode node = fs.getFirstTopLevelNode();
+        if (node.empty()) qFatal("Failed to read SVM model.");
+        svm.read(*fs, *node);
+        svm.pack();
     }
 };
 
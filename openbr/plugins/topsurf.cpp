@@ -1,30 +1,49 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 #include <topsurf/descriptor.h>
 #include <topsurf/topsurf.h>
-#include <mm_plugin.h>
+#include <algorithm>
+#include <limits>
+#include <openbr/openbr_plugin.h>
 
-#include "common/opencvutils.h"
-#include "common/qtutils.h"
-#include "common/resource.h"
+#include "openbr/core/parallel.h"
+#include "openbr/core/resource.h"
 
 using namespace cv;
-using namespace mm;
-using namespace std;
+
+namespace br
+{
 
 class TopSurfInitializer : public Initializer
 {
+    Q_OBJECT
+
     void initialize() const
     {
-        Globals.Abbreviations.insert("TopSurf", "Open!TopSurfExtract(40000):TopSurfCompare");
-        Globals.Abbreviations.insert("TopSurfM", "Open!TopSurfExtract(1000000):TopSurfCompare");
-        Globals.Abbreviations.insert("TopSurfKNN", "Open!TopSurfExtract+TopSurfKNN");
-        Globals.Abbreviations.insert("DocumentClassification", "TopSurfKNN");
+        Globals->abbreviations.insert("TopSurf", "Open!TopSurfExtract(40000):TopSurfCompare");
+        Globals->abbreviations.insert("TopSurfM", "Open!TopSurfExtract(1000000):TopSurfCompare");
+        Globals->abbreviations.insert("TopSurfKNN", "Open!TopSurfExtract+TopSurfKNN");
+        Globals->abbreviations.insert("DocumentClassification", "TopSurfKNN");
     }
 
     void finalize() const {}
 };
 
-MM_REGISTER(Initializer, TopSurfInitializer, false)
-
+BR_REGISTER(Initializer, TopSurfInitializer)
 
 class TopSurfResourceMaker : public ResourceMaker<TopSurf>
 {
@@ -33,7 +52,7 @@ class TopSurfResourceMaker : public ResourceMaker<TopSurf>
 public:
     TopSurfResourceMaker(const QString &dictionary)
     {
-        file = Globals.SDKPath + "/models/topsurf/dictionary_" + dictionary;
+        file = Globals->sdkPath + "/models/topsurf/dictionary_" + dictionary;
     }
 
 private:
@@ -41,30 +60,24 @@ private:
     {
         TopSurf *topSurf = new TopSurf(256, 100);
         if (!topSurf->LoadDictionary(qPrintable(file)))
-            qFatal("TopSurfResourceMaker::make failed to load dictionary.");
+            qFatal("Failed to load TopSurf dictionary %s.", qPrintable(file));
         return topSurf;
     }
 };
 
-
-/****
-TopSurfExtract
-    Wrapper to TopSurf::ExtractDescriptor()
-    B. Thomee, E.M. Bakker, and M.S. Lew, "TOP-SURF: a visual words toolkit",
-    in Proceedings of the 18th ACM International Conference on Multimedia, pp. 1473-1476, Firenze, Italy, 2010.
-****/
-class TopSurfExtract : public UntrainableFeature
+/*!
+ * \ingroup transforms
+ * \brief Wraps TopSurf::ExtractDescriptor() \cite thomee10
+ * \author Josh Klontz \cite jklontz
+ */
+class TopSurfExtractTransform : public UntrainableTransform
 {
     Q_OBJECT
-    Q_PROPERTY(QString dictionary READ get_dictionary WRITE set_dictionary)
-    MM_MEMBER(QString, dictionary)
+    Q_PROPERTY(QString dictionary READ get_dictionary WRITE set_dictionary RESET reset_dictionary STORED false)
+    BR_PROPERTY(QString, dictionary, "10000")
 
     Resource<TopSurf> topSurfResource;
 
-public:
-    TopSurfExtract() : topSurfResource(new TopSurfResourceMaker("10000")) {}
-
-private:
     void init()
     {
         topSurfResource.setResourceMaker(new TopSurfResourceMaker(dictionary));
@@ -72,46 +85,41 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        // Compute descriptor (not thread safe)
+        // TopSurf instances aren't thread safe
         TopSurf *topSurf = topSurfResource.acquire();
         TOPSURF_DESCRIPTOR descriptor;
         IplImage iplSrc = src.m();
-        if (!topSurf->ExtractDescriptor(iplSrc, descriptor))
-            qFatal("TopSurfExtract::project ExtractDescriptor failure.");
+        const bool success = topSurf->ExtractDescriptor(iplSrc, descriptor);
         topSurfResource.release(topSurf);
+        if (!success) {
+            dst = src;
+            dst.file.set("FTE", true);
+            return;
+        }
 
-        // Copy descriptor and clean up
         unsigned char *data;
         int length;
         Descriptor2Array(descriptor, data, length);
         Mat m(1, length, CV_8UC1);
         memcpy(m.data, data, length);
-        delete data;
+        delete[] data;
         TopSurf::ReleaseDescriptor(descriptor);
-        dst = m;
-    }
-
-public:
-    static QString args()
-    {
-        return "10000|20000|40000 dictionary = 10000";
-    }
-
-    static TopSurfExtract *make(const QStringList &args)
-    {
-        (void) args;
-        return new TopSurfExtract();
+        dst = Template(src.file, m);
     }
 };
 
-MM_REGISTER(Feature, TopSurfExtract, true)
+BR_REGISTER(Transform, TopSurfExtractTransform)
 
-
-class TopSurfHist : public UntrainableFeature
+/*!
+ * \ingroup transforms
+ * \brief Histogram of TopSurf visual words.
+ * \author Josh Klontz \cite jklontz
+ */
+class TopSurfHistTransform : public UntrainableTransform
 {
     Q_OBJECT
-    Q_PROPERTY(int size READ get_size WRITE set_size)
-    MM_MEMBER(int, size)
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
+    BR_PROPERTY(int, size, 10000)
 
     void project(const Template &src, Template &dst) const
     {
@@ -124,27 +132,14 @@ class TopSurfHist : public UntrainableFeature
             m.at<float>(0, td.visualword[i].identifier % size)++;
 
         TopSurf::ReleaseDescriptor(td);
-        dst = m;
-    }
-
-public:
-    static QString args()
-    {
-        return "int size = 10000";
-    }
-
-    static TopSurfHist *make(const QStringList &args)
-    {
-        (void) args;
-        return new TopSurfHist();
+        dst = Template(src.file, m);
     }
 };
 
-MM_REGISTER(Feature, TopSurfHist, true)
-
+BR_REGISTER(Transform, TopSurfHistTransform)
 
-// Wrapper around TopSurf CompareDescriptors
-float TopSurfSimilarity(const Mat &a, const Mat &b, bool cosine)
+// Wrapper around TopSurf::CompareDescriptors, 0 for identical descriptors and 1 for descriptors sharing no visual words
+static float TopSurfSimilarity(const Mat &a, const Mat &b, bool cosine)
 {
     TOPSURF_DESCRIPTOR tda, tdb;
     Array2Descriptor(a.data, tda);
@@ -159,106 +154,145 @@ float TopSurfSimilarity(const Mat &a, const Mat &b, bool cosine)
     return result;
 }
 
-
-/****
-TopSurfCompare
-    Wrapper to TopSurf_CompareDescriptors()
-    B. Thomee, E.M. Bakker, and M.S. Lew, "TOP-SURF: a visual words toolkit",
-    in Proceedings of the 18th ACM International Conference on Multimedia, pp. 1473-1476, Firenze, Italy, 2010.
-****/
-class TopSurfCompare : public ComparerBase
+/*!
+ * \ingroup distances
+ * \brief Wraps TopSurf::CompareDescriptors() \cite thomee10
+ * \author Josh Klontz \cite jklontz
+ *
+ * Negated so that more similar descriptors score higher.
+ */
+class TopSurfCompareDistance : public Distance
 {
     Q_OBJECT
-    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine)
-    MM_MEMBER(bool, cosine)
-
-    float compare(const Mat &a, const Mat &b) const
-    {
-        return TopSurfSimilarity(a, b, cosine);
-    }
+    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine RESET reset_cosine STORED false)
+    BR_PROPERTY(bool, cosine, true)
 
-public:
-    static QString args()
+    float compare(const Template &a, const Template &b) const
     {
-        return "bool cosine = 1";
+        return -TopSurfSimilarity(a, b, cosine);
     }
 
-    static TopSurfCompare *make(const QStringList &args)
+    bool symmetric() const
     {
-        (void) args;
-        return new TopSurfCompare();
+        return true;
     }
 };
 
-MM_REGISTER(Comparer, TopSurfCompare, true)
-
-
-/****
-TopSurfKNN
-    KNN classifier for TopSurf features.
-****/
-class TopSurfKNN : public Feature
+BR_REGISTER(Distance, TopSurfCompareDistance)
+
+/*!
+ * \ingroup transforms
+ * \brief KNN classifier for TopSurf descriptors.
+ * \author Josh Klontz \cite jklontz
+ *
+ * With \em cosine distances only the training descriptors sharing a visual word with the query are scored,
+ * found with an inverted index built at training time, since every other descriptor is at the maximum distance of 1.
+ */
+class TopSurfKNNTransform : public Transform
 {
     Q_OBJECT
-    Q_PROPERTY(int k READ get_k WRITE set_k)
-    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine)
-    MM_MEMBER(int, k)
-    MM_MEMBER(bool, cosine)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine RESET reset_cosine STORED false)
+    BR_PROPERTY(int, k, 1)
+    BR_PROPERTY(bool, cosine, true)
+
+    typedef QPair<float,int> Neighbor; // <distance, index>
 
     TemplateList data;
+    QHash< int, QVector<int> > postings; // Visual word to the indices of the descriptors containing it
+    enum { Min_Parallel_Scores = 256 };
 
-private:
     void train(const TemplateList &data)
     {
         this->data = data;
+        index();
+    }
+
+    // Builds the inverted index, which is cheap enough to rebuild on load instead of storing
+    void index()
+    {
+        postings.clear();
+        for (int i=0; i<data.size(); i++) {
+            TOPSURF_DESCRIPTOR td;
+            Array2Descriptor(data[i].m().data, td);
+            for (int j=0; j<td.count; j++) {
+                QVector<int> &list = postings[td.visualword[j].identifier];
+                if (list.isEmpty() || (list.last() != i)) list.append(i);
+            }
+            TopSurf::ReleaseDescriptor(td);
+        }
+    }
+
+    // Descriptors sharing a visual word with src, in index order
+    QVector<int> candidates(const Template &src) const
+    {
+        QVector<int> result;
+        TOPSURF_DESCRIPTOR td;
+        Array2Descriptor(src.m().data, td);
+        for (int j=0; j<td.count; j++)
+            result += postings.value(td.visualword[j].identifier);
+        TopSurf::ReleaseDescriptor(td);
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    void score(const Mat &query, const int *indices, int count, Neighbor *neighbors) const
+    {
+        for (int i=0; i<count; i++)
+            neighbors[i] = Neighbor(TopSurfSimilarity(query, data[indices[i]], cosine), indices[i]);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        // Compute distance to each descriptor
-        QList< QPair<float, int> > distances; // <distance, label>
-        distances.reserve(data.size());
-        foreach (const Template &t, data)
-            distances.append(QPair<float, int>(TopSurfSimilarity(src, t, cosine), t.file.label()));
-
-        // Find nearest neighbors
-        qSort(distances);
+        dst = src;
+        if (data.isEmpty()) qFatal("TopSurfKNN has no training data.");
+
+        // Descriptors sharing no visual word can only be neighbors if fewer than k share one
+        QVector<int> indices = cosine ? candidates(src) : QVector<int>();
+        if (indices.size() < std::min(k, data.size())) {
+            indices.resize(data.size());
+            for (int i=0; i<data.size(); i++)
+                indices[i] = i;
+        }
+
+        // Score in parallel chunks, then select the k nearest without sorting every score
+        QVector<Neighbor> neighbors(indices.size());
+        const int threads = std::max(1, abs(Globals->parallelism));
+        const int chunk = std::max(int(Min_Parallel_Scores), (indices.size() + threads - 1) / threads);
+        TaskGroup tasks;
+        for (int i=0; i<indices.size(); i+=chunk) {
+            const int count = std::min(chunk, indices.size()-i);
+            if (Globals->parallelism) tasks.run(this, &TopSurfKNNTransform::score, src.m(), (const int*)indices.data()+i, count, neighbors.data()+i);
+            else                                                        score(src.m(), indices.data()+i, count, neighbors.data()+i);
+        }
+        tasks.wait();
+
+        const int n = std::min(k, neighbors.size());
+        std::partial_sort(neighbors.begin(), neighbors.begin()+n, neighbors.end());
+
         QHash<int, QPair<int, float> > counts; // <label, <count, cumulative distance>>
-        for (int i=0; i<k; i++) {
-            QPair<float,int> &distance = distances[i];
-            QPair<int,float> &count = counts[distance.second];
+        for (int i=0; i<n; i++) {
+            QPair<int,float> &count = counts[data[neighbors[i].second].file.label()];
             count.first++;
-            count.second += distance.first;
+            count.second += neighbors[i].first;
         }
 
-        // Find most occuring label
-        int best_label = -1;
-        int best_count = 0;
-        float best_distance = numeric_limits<float>::max();
+        // Find the most occuring label, breaking ties by cumulative distance
+        int bestLabel = -1;
+        int bestCount = 0;
+        float bestDistance = std::numeric_limits<float>::max();
         foreach (int label, counts.keys()) {
             const QPair<int, float> &count = counts[label];
-            if ((count.first > best_count) || ((count.first == best_count) && (count.second < best_distance))) {
-                best_label = label;
-                best_count = count.first;
-                best_distance = count.second;
+            if ((count.first > bestCount) || ((count.first == bestCount) && (count.second < bestDistance))) {
+                bestLabel = label;
+                bestCount = count.first;
+                bestDistance = count.second;
             }
         }
-        assert(best_label != -1);
 
-        // Measure confidence
-        int rest_count = 0;
-        float rest_distance = 0;
-        foreach (int label, counts.keys()) {
-            if (label != best_label) {
-                const QPair<int, float> &count = counts[label];
-                rest_count = count.first;
-                rest_distance = count.second;
-            }
-        }
-
-        dst = src;
-        dst.file["Label"] = best_label;
-        dst.file["Confidence"] = (float)best_count/(float)k;
+        dst.file.setLabel(bestLabel);
+        dst.file.set("Confidence", float(bestCount)/float(std::max(1, n)));
     }
 
     void store(QDataStream &stream) const
@@ -269,21 +303,12 @@ private:
     void load(QDataStream &stream)
     {
         stream >> data;
-    }
-
-public:
-    static QString args()
-    {
-        return "int k, int cosine = 1";
-    }
-
-    static TopSurfKNN *make(const QStringList &args)
-    {
-        (void) args;
-        return new TopSurfKNN();
+        index();
     }
 };
 
-MM_REGISTER(Feature, TopSurfKNN, true)
+BR_REGISTER(Transform, TopSurfKNNTransform)
+
+} // namespace br
 
 #include "topsurf.moc"
@@ -0,0 +1,235 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <limits>
+#include <openbr/openbr_plugin.h>
+
+#include "openbr/core/opencvutils.h"
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Tracks detections across the frames of a stream so the detector rarely searches whole frames.
+ * \author Josh Klontz \cite jklontz
+ *
+ * The \em detector, for example \c Cascade, searches the whole frame every \em period frames or whenever a track is lost.
+ * Between those frames it only searches the \c ROI around each track.
+ * Detections are associated with tracks by their overlap, a track not found for more than \em patience frames ends.
+ *
+ * By default every frame is output with the \c Rects of its tracked objects and their \c TrackIDs.
+ * With \em best set, just one template is output per track when it ends: the frame of highest quality with the track's rect,
+ * \c TrackID and \c TrackLength, so only that frame has to be enrolled.
+ * Quality is the \em key metadata set by the optional \em quality transform projecting the detection, or the detection area without one.
+ */
+class TrackTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* detector READ get_detector WRITE set_detector RESET reset_detector STORED false)
+    Q_PROPERTY(int period READ get_period WRITE set_period RESET reset_period STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
+    Q_PROPERTY(int patience READ get_patience WRITE set_patience RESET reset_patience STORED false)
+    Q_PROPERTY(bool best READ get_best WRITE set_best RESET reset_best STORED false)
+    Q_PROPERTY(br::Transform* quality READ get_quality WRITE set_quality RESET reset_quality STORED false)
+    Q_PROPERTY(QString key READ get_key WRITE set_key RESET reset_key STORED false)
+    BR_PROPERTY(br::Transform*, detector, make("Cascade(FrontalFace)", this))
+    BR_PROPERTY(int, period, 15)
+    BR_PROPERTY(float, overlap, 0.3)
+    BR_PROPERTY(int, patience, 2)
+    BR_PROPERTY(bool, best, false)
+    BR_PROPERTY(br::Transform*, quality, NULL)
+    BR_PROPERTY(QString, key, "Impostor_Uniqueness_Measure")
+
+    struct Track
+    {
+        int id, length, missed;
+        Rect rect;
+        float bestQuality;
+        Template bestFrame;
+    };
+
+    QList<Track> tracks;
+    int frame, nextID;
+
+public:
+    TrackTransform() : TimeVaryingTransform(false, false) {}
+
+private:
+    void init()
+    {
+        tracks.clear();
+        frame = nextID = 0;
+    }
+
+    void train(const TemplateList &data)
+    {
+        (void) data;
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        TemplateList output;
+        projectUpdate(TemplateList() << src, output);
+        dst = output.isEmpty() ? Template(src.file) : output.first();
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        dst.clear();
+        foreach (const Template &t, src)
+            track(t, dst);
+    }
+
+    void finalize(TemplateList &output)
+    {
+        output.clear();
+        if (best)
+            foreach (const Track &t, tracks)
+                output.append(release(t));
+        init();
+    }
+
+    static float intersectionOverUnion(const Rect &a, const Rect &b)
+    {
+        const int intersection = (a & b).area();
+        return intersection == 0 ? 0 : float(intersection) / (a.area() + b.area() - intersection);
+    }
+
+    QList<Rect> detect(const Template &src, const Rect *roi) const
+    {
+        Template in(src.file, src.m());
+        in.file.clearRects();
+        in.file.set("enrollAll", true);
+        if (roi) in.file.set("ROI", OpenCVUtils::fromRect(*roi));
+
+        Template out;
+        detector->project(in, out);
+
+        QList<Rect> rects;
+        foreach (const QRectF &rect, out.file.rects())
+            rects.append(OpenCVUtils::toRect(rect));
+        return rects;
+    }
+
+    float measure(const Template &src, const Rect &rect) const
+    {
+        if (!quality) return rect.area();
+        const Rect bounded = rect & Rect(0, 0, src.m().cols, src.m().rows);
+        if (bounded.area() == 0) return 0;
+        Template face(src.file, src.m()(bounded)), scored;
+        quality->project(face, scored);
+        return scored.file.get<float>(key, 0);
+    }
+
+    Template release(const Track &t) const
+    {
+        Template output = t.bestFrame;
+        output.file.clearRects();
+        output.file.appendRect(OpenCVUtils::fromRect(t.rect));
+        output.file.set("TrackID", t.id);
+        output.file.set("TrackLength", t.length);
+        return output;
+    }
+
+    void track(const Template &src, TemplateList &dst)
+    {
+        // Search the whole frame periodically and after any track was lost,
+        // otherwise only around the existing tracks
+        QList<Rect> detections;
+        bool lost = false;
+        foreach (const Track &t, tracks)
+            lost = lost || (t.missed > 0);
+        if (tracks.isEmpty() || lost || (frame % period == 0)) {
+            detections = detect(src, NULL);
+        } else {
+            foreach (const Track &t, tracks)
+                detections.append(detect(src, &t.rect));
+        }
+        frame++;
+
+        // Greedily extend the most overlapping track with each detection
+        QList<bool> matched;
+        for (int i=0; i<tracks.size(); i++)
+            matched.append(false);
+
+        foreach (const Rect &detection, detections) {
+            int bestTrack = -1;
+            float bestOverlap = overlap;
+            for (int i=0; i<tracks.size(); i++) {
+                if (matched[i]) continue;
+                const float iou = intersectionOverUnion(detection, tracks[i].rect);
+                if (iou > bestOverlap) {
+                    bestOverlap = iou;
+                    bestTrack = i;
+                }
+            }
+
+            if (bestTrack == -1) {
+                Track t;
+                t.id = nextID++;
+                t.length = t.missed = 0;
+                t.bestQuality = -std::numeric_limits<float>::max();
+                tracks.append(t);
+                matched.append(false);
+                bestTrack = tracks.size() - 1;
+            }
+
+            Track &t = tracks[bestTrack];
+            matched[bestTrack] = true;
+            t.rect = detection;
+            t.length++;
+            t.missed = 0;
+            if (best) {
+                const float score = measure(src, detection);
+                if (score > t.bestQuality) {
+                    t.bestQuality = score;
+                    t.bestFrame = src;
+                }
+            }
+        }
+
+        // End the tracks not seen for too long
+        for (int i=tracks.size()-1; i>=0; i--) {
+            if (matched[i]) continue;
+            if (++tracks[i].missed > patience) {
+                if (best) dst.append(release(tracks[i]));
+                tracks.removeAt(i);
+            }
+        }
+
+        if (!best) {
+            Template output = src;
+            output.file.clearRects();
+            QList<QVariant> ids;
+            foreach (const Track &t, tracks) {
+                if (t.missed > 0) continue;
+                output.file.appendRect(OpenCVUtils::fromRect(t.rect));
+                ids.append(t.id);
+            }
+            output.file.set("TrackIDs", ids);
+            dst.append(output);
+        }
+    }
+};
+
+BR_REGISTER(Transform, TrackTransform)
+
+} // namespace br
+
+#include "track.moc"
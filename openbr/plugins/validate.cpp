@@ -1,7 +1,8 @@
-#include <QFutureSynchronizer>
-#include <QtConcurrentRun>
+#include <QSet>
 #include <openbr/openbr_plugin.h>
 
+#include "openbr/core/parallel.h"
+
 namespace br
 {
 
@@ -18,12 +19,25 @@ class CrossValidateTransform : public MetaTransform
 
     QList<br::Transform*> transforms;
 
+    // Trains transform on every template outside the held out partition.
+    // The fold is gathered inside the task, so only the folds in flight are alive at once,
+    // and it holds shallow references to the shared templates rather than copies.
+    static void _train(Transform *transform, const TemplateList *data, const QVector<int> *partitions, int partition)
+    {
+        TemplateList fold;
+        fold.reserve(data->size());
+        for (int j=0; j<data->size(); j++)
+            if ((*partitions)[j] != partition)
+                fold.append((*data)[j]);
+        transform->train(fold);
+    }
+
     void train(const TemplateList &data)
     {
         int numPartitions = 0;
-        QList<int> partitions; partitions.reserve(data.size());
-        foreach (const File &file, data.files()) {
-            partitions.append(file.get<int>("Cross_Validation_Partition", 0));
+        QVector<int> partitions; partitions.reserve(data.size());
+        foreach (const Template &t, data) {
+            partitions.append(t.file.get<int>("Cross_Validation_Partition", 0));
             numPartitions = std::max(numPartitions, partitions.last()+1);
         }
 
@@ -35,16 +49,12 @@ class CrossValidateTransform : public MetaTransform
             return;
         }
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<numPartitions; i++) {
-            TemplateList partitionedData = data;
-            for (int j=partitionedData.size()-1; j>=0; j--)
-                if (partitions[j] == i)
-                    partitionedData.removeAt(j);
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(transforms[i], &Transform::train, partitionedData));
-            else                                                          transforms[i]->train(partitionedData);
+            if (Globals->parallelism) tasks.run(_train, transforms[i], &data, &partitions, i);
+            else                                _train (transforms[i], &data, &partitions, i);
         }
-        futures.waitForFinished();
+        tasks.wait();
     }
 
     void project(const Template &src, Template &dst) const
@@ -87,6 +97,27 @@ class CrossValidateDistance : public Distance
         const int partitionB = b.file.get<int>("Cross_Validation_Partition", 0);
         return (partitionA != partitionB) ? -std::numeric_limits<float>::max() : 0;
     }
+
+    struct Partitions : public TargetFilter
+    {
+        QVector<int> partitions;
+
+        void admit(const Template &query, int offset, int count, uchar *keep) const
+        {
+            const int partition = query.file.get<int>("Cross_Validation_Partition", 0);
+            for (int i=0; i<count; i++)
+                keep[i] &= (partitions[offset+i] == partition);
+        }
+    };
+
+    QSharedPointer<TargetFilter> prefilter(const TemplateList &targets) const
+    {
+        QSharedPointer<Partitions> filter(new Partitions());
+        filter->partitions.reserve(targets.size());
+        foreach (const Template &t, targets)
+            filter->partitions.append(t.file.get<int>("Cross_Validation_Partition", 0));
+        return filter;
+    }
 };
 
 BR_REGISTER(Distance, CrossValidateDistance)
@@ -117,6 +148,35 @@ class FilterDistance : public Distance
         }
         return 0;
     }
+
+    struct Admitted : public TargetFilter
+    {
+        QVector<uchar> admitted;
+
+        void admit(const Template &query, int offset, int count, uchar *keep) const
+        {
+            (void) query; // Query template isn't checked
+            for (int i=0; i<count; i++)
+                keep[i] &= admitted[offset+i];
+        }
+    };
+
+    // Evaluates the filters one key at a time over every target
+    QSharedPointer<TargetFilter> prefilter(const TemplateList &targets) const
+    {
+        QSharedPointer<Admitted> filter(new Admitted());
+        filter->admitted.fill(1, targets.size());
+        foreach (const QString &key, Globals->filters.keys()) {
+            if (Globals->filters[key].isEmpty()) continue;
+            const QSet<QString> values = Globals->filters[key].toSet();
+            for (int i=0; i<targets.size(); i++) {
+                const QString metadata = targets[i].file.get<QString>(key, "");
+                if (!metadata.isEmpty() && !values.contains(metadata))
+                    filter->admitted[i] = 0;
+            }
+        }
+        return filter;
+    }
 };
 
 BR_REGISTER(Distance, FilterDistance)
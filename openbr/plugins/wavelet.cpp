@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCache>
+#include <QMutex>
+#include <QMutexLocker>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -22,6 +25,95 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Correlates an image with a bank of kernels, sharing one forward Fourier transform across the bank.
+ *
+ * Equivalent to calling \c filter2D with each kernel.
+ * Small kernels and non-float images are filtered spatially.
+ */
+class FilterBank
+{
+    static const int Min_Fourier_Area = 11*11;
+    static const int Max_Spectra_Sizes = 4; // Images of varying size would otherwise keep a bank of spectra each
+
+    QList<Mat> kernels;
+    Size anchor; // Largest kernel half size
+    mutable QMutex spectraLock;
+    mutable QCache< QPair<int,int>, QList<Mat> > spectra; // Kernel spectra by transform size, least recently used evicted
+
+    QList<Mat> spectraFor(const Size &size) const
+    {
+        QMutexLocker locker(&spectraLock);
+        const QPair<int,int> key(size.width, size.height);
+        if (const QList<Mat> *cached = spectra.object(key))
+            return *cached;
+
+        QList<Mat> kernelSpectra;
+        foreach (const Mat &kernel, kernels) {
+            Mat spectrum = Mat::zeros(size, CV_32FC1);
+            kernel.copyTo(spectrum(Rect(anchor.width-kernel.cols/2, anchor.height-kernel.rows/2, kernel.cols, kernel.rows)));
+            dft(spectrum, spectrum, CV_DXT_FORWARD, 2*anchor.height+1);
+            kernelSpectra.append(spectrum);
+        }
+        spectra.insert(key, new QList<Mat>(kernelSpectra));
+        return kernelSpectra;
+    }
+
+public:
+    FilterBank()
+        : spectra(Max_Spectra_Sizes) {}
+
+    void clear()
+    {
+        QMutexLocker locker(&spectraLock);
+        kernels.clear();
+        anchor = Size();
+        spectra.clear();
+    }
+
+    void append(const Mat &kernel)
+    {
+        QMutexLocker locker(&spectraLock);
+        kernels.append(kernel);
+        anchor = Size(std::max(anchor.width, kernel.cols/2), std::max(anchor.height, kernel.rows/2));
+        spectra.clear();
+    }
+
+    int size() const
+    {
+        return kernels.size();
+    }
+
+    QList<Mat> filter(const Mat &src) const
+    {
+        QList<Mat> responses;
+        if ((src.type() != CV_32FC1) || ((2*anchor.width+1)*(2*anchor.height+1) < Min_Fourier_Area)) {
+            foreach (const Mat &kernel, kernels) {
+                Mat response;
+                filter2D(src, response, -1, kernel);
+                responses.append(response);
+            }
+            return responses;
+        }
+
+        // Reflect the borders as filter2D does, then zero pad to a fast transform size
+        Mat padded, image;
+        copyMakeBorder(src, padded, anchor.height, anchor.height, anchor.width, anchor.width, BORDER_REFLECT_101);
+        const Size size(getOptimalDFTSize(padded.cols), getOptimalDFTSize(padded.rows));
+        copyMakeBorder(padded, image, 0, size.height-padded.rows, 0, size.width-padded.cols, BORDER_CONSTANT, Scalar());
+        dft(image, image, CV_DXT_FORWARD, padded.rows);
+
+        // The top left of each circular correlation is free of wrap around
+        Mat response;
+        foreach (const Mat &spectrum, spectraFor(size)) {
+            mulSpectrums(image, spectrum, response, 0, true);
+            dft(response, response, CV_DXT_INV_SCALE, src.rows);
+            responses.append(response(Rect(0, 0, src.cols, src.rows)).clone());
+        }
+        return responses;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief http://en.wikipedia.org/wiki/Gabor_filter
@@ -54,8 +146,10 @@ private:
     BR_PROPERTY(Component, component, Phase)
 
     Mat kReal, kImaginary;
+    FilterBank bank;
 
     friend class GaborJetTransform;
+    friend class GaborBankTransform;
 
     static void makeWavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
     {
@@ -93,23 +187,30 @@ private:
     void init()
     {
         makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+        bank.clear();
+        if (component != Imaginary) bank.append(kReal);
+        if (component != Real)      bank.append(kImaginary);
     }
 
-    void project(const Template &src, Template &dst) const
+    static Mat combine(const Mat &real, const Mat &imaginary, Component component)
     {
-        Mat real, imaginary, magnitude, phase;
-        if (component != Imaginary)
-            filter2D(src, real, -1, kReal);
-        if (component != Real)
-            filter2D(src, imaginary, -1, kImaginary);
+        Mat magnitude, phase;
         if ((component == Magnitude) || (component == Phase))
             cartToPolar(real, imaginary, magnitude, phase);
 
-        if      (component == Real)      dst = real;
-        else if (component == Imaginary) dst = imaginary;
-        else if (component == Magnitude) dst = magnitude;
-        else if (component == Phase)     dst = phase;
-        else                             qFatal("Invalid component.");
+        if      (component == Real)      return real;
+        else if (component == Imaginary) return imaginary;
+        else if (component == Magnitude) return magnitude;
+        else if (component != Phase)     qFatal("Invalid component.");
+        return phase;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const QList<Mat> responses = bank.filter(src);
+        dst = combine(component == Imaginary ? Mat() : responses.first(),
+                      component == Real      ? Mat() : responses.last(),
+                      component);
     }
 };
 
@@ -199,6 +300,61 @@ class GaborJetTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, GaborJetTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief A bank of gabor wavelets applied to the whole image, one output matrix per wavelet.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Wavelets are enumerated in the same order as br::GaborJetTransform.
+ * Every wavelet in the bank shares the forward Fourier transform of the image.
+ */
+class GaborBankTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_ENUMS(br::GaborTransform::Component)
+    Q_PROPERTY(QList<float> lambdas READ get_lambdas WRITE set_lambdas RESET reset_lambdas STORED false)
+    Q_PROPERTY(QList<float> thetas READ get_thetas WRITE set_thetas RESET reset_thetas STORED false)
+    Q_PROPERTY(QList<float> psis READ get_psis WRITE set_psis RESET reset_psis STORED false)
+    Q_PROPERTY(QList<float> sigmas READ get_sigmas WRITE set_sigmas RESET reset_sigmas STORED false)
+    Q_PROPERTY(QList<float> gammas READ get_gammas WRITE set_gammas RESET reset_gammas STORED false)
+    Q_PROPERTY(br::GaborTransform::Component component READ get_component WRITE set_component RESET reset_component STORED false)
+    BR_PROPERTY(QList<float>, lambdas, QList<float>())
+    BR_PROPERTY(QList<float>, thetas, QList<float>())
+    BR_PROPERTY(QList<float>, psis, QList<float>())
+    BR_PROPERTY(QList<float>, sigmas, QList<float>())
+    BR_PROPERTY(QList<float>, gammas, QList<float>())
+    BR_PROPERTY(GaborTransform::Component, component, GaborTransform::Phase)
+
+    FilterBank bank;
+
+    void init()
+    {
+        bank.clear();
+        foreach (float lambda, lambdas)
+            foreach (float theta, thetas)
+                foreach (float psi, psis)
+                    foreach (float sigma, sigmas)
+                        foreach (float gamma, gammas) {
+                            Mat kReal, kImaginary;
+                            GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+                            if (component != GaborTransform::Imaginary) bank.append(kReal);
+                            if (component != GaborTransform::Real)      bank.append(kImaginary);
+                        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const QList<Mat> responses = bank.filter(src);
+        const int step = ((component == GaborTransform::Real) || (component == GaborTransform::Imaginary)) ? 1 : 2;
+        for (int i=0; i<responses.size(); i+=step)
+            dst.append(GaborTransform::combine(component == GaborTransform::Imaginary ? Mat() : responses[i],
+                                               component == GaborTransform::Real      ? Mat() : responses[i+step-1],
+                                               component));
+    }
+};
+
+BR_REGISTER(Transform, GaborBankTransform)
+
 } // namespace br
 
 #include "wavelet.moc"
@@ -1,5 +1,7 @@
-#include <QCoreApplication>
-#include <QProcess>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWaitCondition>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/common.h"
@@ -11,6 +13,9 @@ namespace br
  * \ingroup transforms
  * \brief Implements the YouTubesFaceDB \cite wolf11 experimental protocol.
  * \author Josh Klontz \cite jklontz
+ *
+ * Pairs are compared in process and concurrently, each writing its \c .mtx as before.
+ * Every video is enrolled once into a memory gallery shared by all the pairs it appears in.
  */
 class YouTubeFacesDBTransform : public UntrainableMetaTransform
 {
@@ -18,28 +23,63 @@ class YouTubeFacesDBTransform : public UntrainableMetaTransform
     Q_PROPERTY(QString algorithm READ get_algorithm WRITE set_algorithm RESET reset_algorithm STORED false)
     BR_PROPERTY(QString, algorithm, "")
 
+    struct Enrollment
+    {
+        enum State { Pending, Running, Done };
+        QMutex lock;
+        QWaitCondition done;
+        State state;
+        Enrollment() : state(Pending) {}
+    };
+
+    static QMutex enrollmentsLock;
+    static QHash<QString, QSharedPointer<Enrollment> > enrollments;
+
     void project(const Template &src, Template &dst) const
     {
-        static QMutex mutex;
+        dst = Template();
 
         // First input is the header in 'splits.txt'
         if (src.file.get<int>("Index") == 0) return;
 
         const QStringList words = src.file.name.split(", ");
         const QString matrix = "YTF-"+algorithm+"/"+words[0] + "_" + words[1] + "_" + words[4] + ".mtx";
-        const QStringList arguments = QStringList() << "-algorithm" << algorithm
-                                                    << "-parallelism" << QString::number(Globals->parallelism)
-                                                    << "-path" << Globals->path
-                                                    << "-compare" << File(words[2]).resolved() << File(words[3]).resolved() << matrix;
-        mutex.lock();    
-        int result = 0;
-        if (!QFileInfo(matrix).exists())
-            result = QProcess::execute(QCoreApplication::applicationFilePath(), arguments);
-        mutex.unlock();
-
-        if (result != 0)
-            qWarning("Process for computing %s returned %d.", qPrintable(matrix), result);
-        dst = Template();
+        if (QFileInfo(matrix).exists()) return;
+
+        // Each pair runs in its own job so concurrent pairs don't share progress
+        QScopedPointer<Context> job(Globals->fork());
+        job->algorithm = algorithm;
+        job->quiet = true;
+        ContextScope scope(job.data());
+        Compare(enroll(words[2]), enroll(words[3]), matrix);
+    }
+
+    File enroll(const QString &video) const
+    {
+        const File input = File(video).resolved();
+        const File gallery = "YTF-" + algorithm + "/" + input.name + ".mem";
+
+        QSharedPointer<Enrollment> enrollment;
+        {
+            QMutexLocker locker(&enrollmentsLock);
+            QSharedPointer<Enrollment> &entry = enrollments[gallery.name];
+            if (entry.isNull()) entry = QSharedPointer<Enrollment>(new Enrollment());
+            enrollment = entry;
+        }
+
+        // Pairs sharing a video wait for its first enrollment, which runs without the lock held
+        QMutexLocker locker(&enrollment->lock);
+        if (enrollment->state == Enrollment::Pending) {
+            enrollment->state = Enrollment::Running;
+            locker.unlock();
+            Enroll(input, gallery);
+            locker.relock();
+            enrollment->state = Enrollment::Done;
+            enrollment->done.wakeAll();
+        }
+        while (enrollment->state != Enrollment::Done)
+            enrollment->done.wait(&enrollment->lock);
+        return gallery;
     }
 
     static void sort(TemplateList &templates)
@@ -63,6 +103,9 @@ class YouTubeFacesDBTransform : public UntrainableMetaTransform
     }
 };
 
+QMutex YouTubeFacesDBTransform::enrollmentsLock;
+QHash<QString, QSharedPointer<YouTubeFacesDBTransform::Enrollment> > YouTubeFacesDBTransform::enrollments;
+
 BR_REGISTER(Transform, YouTubeFacesDBTransform)
 
 } // namespace br
@@ -0,0 +1,12 @@
+%module br_sdk_swig
+%{
+#include <openbr/openbr.h>
+%}
+
+// Caller-owned buffers for br_compare_template_lists and br_search_template_list
+%include <carrays.i>
+%array_class(float, floatArray);
+%array_class(int, intArray);
+
+%include <openbr/openbr_export.h>
+%include <openbr/openbr.h>
@@ -1,7 +0,0 @@
-%module mm_sdk_swig
-%{
-#include <mm/mm.h>
-%}
-
-%include <mm/mm.h>
-